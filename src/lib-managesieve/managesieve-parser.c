@@ -44,6 +44,7 @@ struct managesieve_parser {
 
 	const char *error;
 
+	bool str_8bit:1; /* ARG_PARSE_STRING: seen 8bit characters */
 	bool literal_skip_crlf:1;
 	bool literal_nonsync:1;
 	bool eol:1;
@@ -171,11 +172,13 @@ managesieve_parser_save_arg(struct managesieve_parser *parser,
 			/* remove the escapes */
 			if (parser->str_first_escape >= 0 &&
 			    (parser->flags &
-			     MANAGESIEVE_PARSE_FLAG_NO_UNESCAPE) == 0)
+			     MANAGESIEVE_PARSE_FLAG_NO_UNESCAPE) == 0) {
 				(void)str_unescape(str);
-
+				arg->str_len = strlen(str);
+			} else {
+				arg->str_len = size - 1;
+			}
 			arg->_data.str = str;
-			arg->str_len = strlen(str);
 		}
 		break;
 	case ARG_PARSE_LITERAL_DATA:
@@ -248,7 +251,8 @@ managesieve_parser_read_string(struct managesieve_parser *parser,
 	/* Read until we've found non-escaped ", CR or LF */
 	for (i = parser->cur_pos; i < data_size; i++) {
 		if (data[i] == '"') {
-			if (!uni_utf8_data_is_valid(data+1, i-1)) {
+			if (parser->str_8bit &&
+			    !uni_utf8_data_is_valid(data+1, i-1)) {
 				parser->error =
 					"Invalid UTF-8 character in quoted-string.";
 				return FALSE;
@@ -286,7 +290,9 @@ managesieve_parser_read_string(struct managesieve_parser *parser,
 			continue;
 		}
 
-		if ((data[i] & 0x80) == 0 && !IS_SAFE_CHAR(data[i])) {
+		if ((data[i] & 0x80) != 0)
+			parser->str_8bit = TRUE;
+		else if (!IS_SAFE_CHAR(data[i])) {
 			parser->error = "String contains invalid character.";
 			return FALSE;
 		}
@@ -448,6 +454,7 @@ static bool managesieve_parser_read_arg(struct managesieve_parser *parser)
 		case '"':
 			parser->cur_type = ARG_PARSE_STRING;
 			parser->str_first_escape = -1;
+			parser->str_8bit = FALSE;
 			break;
 		case '{':
 			parser->cur_type = ARG_PARSE_LITERAL;
@@ -665,7 +672,7 @@ static ssize_t quoted_string_istream_read(struct istream_private *stream)
 		(struct quoted_string_istream *)stream;
 	const unsigned char *data;
 	unsigned int extra;
-	size_t i, dest, size;
+	size_t i, n, run, dest, size;
 	ssize_t ret;
 
 	if (qsstream->str_end) {
@@ -683,6 +690,20 @@ static ssize_t quoted_string_istream_read(struct istream_private *stream)
 
 	data = i_stream_get_data(stream->parent, &size);
 	for (i = 0; i < size && dest < stream->buffer_size; ) {
+		/* Copy a run of plain characters at once */
+		run = I_MIN(size - i, stream->buffer_size - dest);
+		for (n = 0; n < run; n++) {
+			if (data[i+n] == '"' || data[i+n] == '\\' ||
+			    data[i+n] == '\r' || data[i+n] == '\n')
+				break;
+		}
+		if (n > 0) {
+			memcpy(stream->w_buffer + dest, data + i, n);
+			dest += n;
+			i += n;
+			continue;
+		}
+
 		if (data[i] == '"') {
 			i++;
 			qsstream->str_end = TRUE;
@@ -710,15 +731,11 @@ static ssize_t quoted_string_istream_read(struct istream_private *stream)
 			stream->w_buffer[dest++] = data[i];
 			i++;
 		} else {
-			if (data[i] == '\r' || data[i] == '\n') {
-				io_stream_set_error(&stream->iostream,
-					"Quoted string contains an invalid character");
-				stream->istream.stream_errno = EINVAL;
-				return -1;
-			}
-
-			stream->w_buffer[dest++] = data[i];
-			i++;
+			/* CR or LF */
+			io_stream_set_error(&stream->iostream,
+				"Quoted string contains an invalid character");
+			stream->istream.stream_errno = EINVAL;
+			return -1;
 		}
 		i_assert(dest <= stream->buffer_size);
 	}
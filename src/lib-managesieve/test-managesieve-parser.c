@@ -0,0 +1,192 @@
+/* Copyright (c) 2021 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "test-common.h"
+#include "managesieve-parser.h"
+
+#define TEST_MAX_LINE_SIZE 1024
+
+struct managesieve_parse_test {
+	const char *input;
+
+	/* Expected arguments; atoms are prefixed with '~' */
+	const char *args[4];
+};
+
+static const struct managesieve_parse_test parse_tests[] = {
+	{
+		.input = "atom\r\n",
+		.args = { "~atom" },
+	},
+	{
+		.input = "\"quoted string\" atom2\r\n",
+		.args = { "quoted string", "~atom2" },
+	},
+	{
+		.input = "\"esc \\\"aped\\\\\" \"\"\r\n",
+		.args = { "esc \"aped\\", "" },
+	},
+	{
+		.input = "\"8bit \xc3\xa6\xc3\xb8\xc3\xa5\"\r\n",
+		.args = { "8bit \xc3\xa6\xc3\xb8\xc3\xa5" },
+	},
+	{
+		.input = "{5+}\r\nabcde \"x\"\r\n",
+		.args = { "abcde", "x" },
+	},
+	{
+		.input = "{3}\r\n\"\\\" {0+}\r\n\r\n",
+		.args = { "\"\\\"", "" },
+	},
+};
+
+static const char *const parse_invalid_tests[] = {
+	"\"unterminated\\x\"\r\n",
+	"\"invalid \xc3\x28 utf-8\"\r\n",
+	"at(om\r\n",
+	"{5x}\r\nabcde\r\n",
+};
+
+static int
+test_parse_line(struct istream *input, unsigned int input_size,
+		const struct managesieve_arg **args_r,
+		struct managesieve_parser **parser_r)
+{
+	struct managesieve_parser *parser;
+	unsigned int size;
+	int ret = -2;
+
+	parser = managesieve_parser_create(input, TEST_MAX_LINE_SIZE);
+	for (size = 1; size <= input_size && ret == -2; size++) {
+		test_istream_set_size(input, size);
+		(void)i_stream_read(input);
+		ret = managesieve_parser_read_args(parser, 0, 0, args_r);
+	}
+	*parser_r = parser;
+	return ret;
+}
+
+static void test_managesieve_parser_valid(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < N_ELEMENTS(parse_tests); i++) T_BEGIN {
+		const struct managesieve_parse_test *test = &parse_tests[i];
+		struct managesieve_parser *parser;
+		const struct managesieve_arg *args;
+		struct istream *input;
+		const char *value;
+		int ret;
+
+		test_begin(t_strdup_printf("managesieve parser valid [%u]", i));
+
+		/* Feed the input a byte at a time, so that each token is seen
+		   partially at least once */
+		input = test_istream_create(test->input);
+		ret = test_parse_line(input, strlen(test->input),
+				      &args, &parser);
+		test_assert(ret >= 0);
+		for (j = 0; ret >= 0 && test->args[j] != NULL; j++) {
+			if (test->args[j][0] == '~') {
+				test_assert_idx(managesieve_arg_get_atom(
+					&args[j], &value), j);
+				test_assert_idx(null_strcmp(
+					value, test->args[j] + 1) == 0, j);
+			} else {
+				test_assert_idx(managesieve_arg_get_string(
+					&args[j], &value), j);
+				test_assert_idx(null_strcmp(
+					value, test->args[j]) == 0, j);
+				test_assert_idx(args[j].str_len ==
+						strlen(test->args[j]), j);
+			}
+		}
+		if (ret >= 0)
+			test_assert(MANAGESIEVE_ARG_IS_EOL(&args[j]));
+
+		managesieve_parser_destroy(&parser);
+		i_stream_unref(&input);
+		test_end();
+	} T_END;
+}
+
+static void test_managesieve_parser_invalid(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(parse_invalid_tests); i++) T_BEGIN {
+		const char *line = parse_invalid_tests[i];
+		struct managesieve_parser *parser;
+		const struct managesieve_arg *args;
+		struct istream *input;
+		int ret;
+
+		test_begin(t_strdup_printf("managesieve parser invalid [%u]",
+					   i));
+		input = test_istream_create(line);
+		ret = test_parse_line(input, strlen(line), &args, &parser);
+		test_assert(ret == -1);
+
+		managesieve_parser_destroy(&parser);
+		i_stream_unref(&input);
+		test_end();
+	} T_END;
+}
+
+static void test_managesieve_parser_string_stream(void)
+{
+	static const char *line =
+		"\"plain run \\\"escaped\\\" \\\\ and another run\"\r\n";
+	static const char *expected =
+		"plain run \"escaped\" \\ and another run";
+	struct managesieve_parser *parser;
+	const struct managesieve_arg *args;
+	struct istream *input, *str_input;
+	const unsigned char *data;
+	string_t *result;
+	unsigned int size;
+	size_t data_size;
+	int ret = -2;
+
+	test_begin("managesieve parser string stream");
+
+	input = test_istream_create(line);
+	parser = managesieve_parser_create(input, TEST_MAX_LINE_SIZE);
+	test_istream_set_size(input, 1);
+	(void)i_stream_read(input);
+	ret = managesieve_parser_read_args(
+		parser, 0, MANAGESIEVE_PARSE_FLAG_STRING_STREAM, &args);
+	test_assert(ret == 1);
+	test_assert(managesieve_arg_get_string_stream(&args[0], &str_input));
+
+	/* Grow the input a byte at a time while reading the string */
+	result = t_str_new(128);
+	for (size = 2; ret >= 0 && size <= strlen(line); size++) {
+		test_istream_set_size(input, size);
+		while ((ret = i_stream_read_more(str_input, &data,
+						 &data_size)) > 0) {
+			str_append_data(result, data, data_size);
+			i_stream_skip(str_input, data_size);
+		}
+	}
+	test_assert(ret == -1 && str_input->stream_errno == 0);
+	test_assert_strcmp(str_c(result), expected);
+
+	managesieve_parser_destroy(&parser);
+	i_stream_unref(&input);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_managesieve_parser_valid,
+		test_managesieve_parser_invalid,
+		test_managesieve_parser_string_stream,
+		NULL
+	};
+	return test_run(test_functions);
+}
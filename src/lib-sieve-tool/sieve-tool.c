@@ -20,6 +20,7 @@
 #include "sieve.h"
 #include "sieve-plugins.h"
 #include "sieve-extensions.h"
+#include "sieve-settings.h"
 
 #include "mail-raw.h"
 
@@ -31,6 +32,9 @@
 #include <pwd.h>
 #include <sysexits.h>
 
+/* Default for sieve_tool_mail_memory_buffer */
+#define SIEVE_TOOL_DEFAULT_MAIL_MEMORY_BUFFER (1024*128)
+
 /*
  * Global state
  */
@@ -299,8 +303,11 @@ void sieve_tool_deinit(struct sieve_tool **_tool)
 
 	*_tool = NULL;
 
-	/* Deinitialize Sieve engine */
-	sieve_deinit(&tool->svinst);
+	/* Deinitialize Sieve engine; it is not initialized when the tool
+	   only forked worker processes */
+	if (tool->svinst != NULL)
+		sieve_deinit(&tool->svinst);
+	sieve_caches_free();
 
 	/* Free options */
 
@@ -328,7 +335,8 @@ void sieve_tool_deinit(struct sieve_tool **_tool)
 	if (tool->mail_user_dovecot != NULL)
 		mail_user_unref(&tool->mail_user_dovecot);
 
-	mail_storage_service_deinit(&tool->storage_service);
+	if (tool->storage_service != NULL)
+		mail_storage_service_deinit(&tool->storage_service);
 
 	/* Free sieve tool object */
 
@@ -376,6 +384,19 @@ void sieve_tool_init_mail_user(struct sieve_tool *tool,
 	ns->flags |= NAMESPACE_FLAG_NOQUOTA | NAMESPACE_FLAG_NOACL;
 }
 
+/* Messages read from standard input are kept in memory up to this size */
+static size_t sieve_tool_get_raw_memory_buffer(struct sieve_tool *tool)
+{
+	size_t size;
+
+	if (tool->svinst == NULL ||
+	    !sieve_setting_get_size_value(tool->svinst,
+					  "sieve_tool_mail_memory_buffer",
+					  &size))
+		return SIEVE_TOOL_DEFAULT_MAIL_MEMORY_BUFFER;
+	return size;
+}
+
 static void sieve_tool_init_mail_raw_user(struct sieve_tool *tool)
 {
 	if (tool->mail_raw_user == NULL) {
@@ -392,7 +413,8 @@ sieve_tool_open_file_as_mail(struct sieve_tool *tool, const char *path)
 	if (tool->mail_raw != NULL)
 		mail_raw_close(&tool->mail_raw);
 
-	tool->mail_raw = mail_raw_open_file(tool->mail_raw_user, path);
+	tool->mail_raw = mail_raw_open_file_buffered(
+		tool->mail_raw_user, path, sieve_tool_get_raw_memory_buffer(tool));
 
 	return tool->mail_raw->mail;
 }
@@ -672,6 +694,8 @@ void sieve_tool_parse_trace_option(struct sieve_trace_config *tr_config,
 		tr_config->flags |= SIEVE_TRFLG_DEBUG;
 	} else if (strcmp(tr_option, "addresses") == 0) {
 		tr_config->flags |= SIEVE_TRFLG_ADDRESSES;
+	} else if (strcmp(tr_option, "profile") == 0) {
+		tr_config->flags |= SIEVE_TRFLG_PROFILE;
 	} else {
 		i_fatal_status(EX_USAGE, "Unknown -t trace option value: %s",
 			       tr_option);
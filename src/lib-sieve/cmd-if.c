@@ -7,6 +7,7 @@
 #include "sieve-generator.h"
 #include "sieve-code.h"
 #include "sieve-binary.h"
+#include "sieve-optimizer.h"
 
 /*
  * Commands
@@ -86,10 +87,19 @@ struct cmd_if_context_data {
 	struct cmd_if_context_data *previous;
 	struct cmd_if_context_data *next;
 
+	struct sieve_command *cmd;
+
 	int const_condition;
 
 	bool jump_generated;
 	sieve_size_t exit_jump;
+
+	/* Header switch: the test is replaced by entries in a HEADER_SWITCH
+	   operation emitted by the first if command of the chain */
+	bool switched;
+	struct sieve_jumplist *switch_jumps;
+	/* Jump for when no key matches (only for the last switched command) */
+	struct sieve_jumplist *switch_end;
 };
 
 static void cmd_if_initialize_context_data
@@ -99,6 +109,7 @@ static void cmd_if_initialize_context_data
 
 	/* Assign context */
 	cmd_data = p_new(sieve_command_pool(cmd), struct cmd_if_context_data, 1);
+	cmd_data->cmd = cmd;
 	cmd_data->exit_jump = 0;
 	cmd_data->jump_generated = FALSE;
 
@@ -206,6 +217,113 @@ static void cmd_if_resolve_exit_jumps
 	}
 }
 
+/* Generated rule sets often contain long if/elsif chains testing the same
+ * header with :is against constant keys. When optimization is enabled, the
+ * tests of such a chain are lowered into a single HEADER_SWITCH operation
+ * that fetches the header once and jumps directly to the selected branch.
+ */
+
+#define CMD_IF_HEADER_SWITCH_MIN_BRANCHES 4
+
+static unsigned int cmd_if_header_switch_keys
+(struct sieve_ast_argument *keys)
+{
+	if ( sieve_ast_argument_type(keys) == SAAT_STRING )
+		return 1;
+	return sieve_ast_strlist_count(keys);
+}
+
+static void cmd_if_header_switch_emit_keys
+(struct sieve_binary_block *sblock, struct sieve_ast_argument *keys,
+	struct sieve_jumplist *jumps)
+{
+	struct sieve_ast_argument *item;
+
+	if ( sieve_ast_argument_type(keys) == SAAT_STRING ) {
+		sieve_opr_string_emit(sblock, sieve_ast_argument_str(keys));
+		sieve_jumplist_add(jumps, sieve_binary_emit_offset(sblock, 0));
+		return;
+	}
+
+	item = sieve_ast_strlist_first(keys);
+	for ( ; item != NULL; item = sieve_ast_strlist_next(item) ) {
+		sieve_opr_string_emit(sblock, sieve_ast_argument_str(item));
+		sieve_jumplist_add(jumps, sieve_binary_emit_offset(sblock, 0));
+	}
+}
+
+static struct sieve_command *cmd_if_header_switch_test
+(struct cmd_if_context_data *cmd_data,
+	struct sieve_ast_argument **hdrs_r, struct sieve_ast_argument **keys_r)
+{
+	struct sieve_ast_node *test;
+
+	if ( sieve_command_is(cmd_data->cmd, cmd_else) ||
+		cmd_data->const_condition >= 0 )
+		return NULL;
+
+	test = sieve_ast_test_first(cmd_data->cmd->ast_node);
+	if ( test == NULL || test->command == NULL ||
+		!sieve_optimizer_header_is_literal(test->command, hdrs_r, keys_r) )
+		return NULL;
+	return test->command;
+}
+
+static bool cmd_if_generate_header_switch
+(const struct sieve_codegen_env *cgenv, struct cmd_if_context_data *first)
+{
+	struct sieve_binary_block *sblock = cgenv->sblock;
+	struct cmd_if_context_data *cmd_data, *last = NULL;
+	struct sieve_command *first_tst = NULL;
+	struct sieve_ast_argument *hdrs = NULL, *cur_hdrs, *keys;
+	unsigned int branches = 0, count = 0;
+
+	/* Find the leading commands of the chain that can be switched */
+	for ( cmd_data = first; cmd_data != NULL; cmd_data = cmd_data->next ) {
+		struct sieve_command *tst =
+			cmd_if_header_switch_test(cmd_data, &cur_hdrs, &keys);
+
+		if ( tst == NULL )
+			break;
+		if ( first_tst == NULL ) {
+			first_tst = tst;
+			hdrs = cur_hdrs;
+		} else if ( !sieve_optimizer_header_lists_equal(hdrs, cur_hdrs) ) {
+			break;
+		}
+
+		count += cmd_if_header_switch_keys(keys);
+		branches++;
+		last = cmd_data;
+	}
+
+	if ( branches < CMD_IF_HEADER_SWITCH_MIN_BRANCHES )
+		return TRUE;
+
+	sieve_operation_emit(sblock, NULL, &tst_header_switch_operation);
+	sieve_generate_message_headers(cgenv, hdrs);
+	if ( !sieve_generate_argument(cgenv, hdrs, first_tst) )
+		return FALSE;
+	sieve_binary_emit_unsigned(sblock, count);
+
+	for ( cmd_data = first; ; cmd_data = cmd_data->next ) {
+		(void)cmd_if_header_switch_test(cmd_data, &cur_hdrs, &keys);
+
+		cmd_data->switched = TRUE;
+		cmd_data->switch_jumps = sieve_jumplist_create
+			(sieve_command_pool(cmd_data->cmd), sblock);
+		cmd_if_header_switch_emit_keys(sblock, keys, cmd_data->switch_jumps);
+
+		if ( cmd_data == last )
+			break;
+	}
+
+	last->switch_end = sieve_jumplist_create
+		(sieve_command_pool(last->cmd), sblock);
+	sieve_jumplist_add(last->switch_end, sieve_binary_emit_offset(sblock, 0));
+	return TRUE;
+}
+
 static bool cmd_if_generate
 (const struct sieve_codegen_env *cgenv, struct sieve_command *cmd)
 {
@@ -215,8 +333,16 @@ static bool cmd_if_generate
 	struct sieve_ast_node *test;
 	struct sieve_jumplist jmplist;
 
+	if ( cmd_data->previous == NULL && cgenv->svinst->optimize ) {
+		if ( !cmd_if_generate_header_switch(cgenv, cmd_data) )
+			return FALSE;
+	}
+
 	/* Generate test condition */
-	if ( cmd_data->const_condition < 0 ) {
+	if ( cmd_data->switched ) {
+		/* Header switch jumps here when one of our keys matches */
+		sieve_jumplist_resolve(cmd_data->switch_jumps);
+	} else if ( cmd_data->const_condition < 0 ) {
 		/* Prepare jumplist */
 		sieve_jumplist_init_temp(&jmplist, sblock);
 
@@ -249,7 +375,11 @@ static bool cmd_if_generate
 		}
 	}
 
-	if ( cmd_data->const_condition < 0 ) {
+	if ( cmd_data->switched ) {
+		/* Header switch jumps here when no key matches */
+		if ( cmd_data->switch_end != NULL )
+			sieve_jumplist_resolve(cmd_data->switch_end);
+	} else if ( cmd_data->const_condition < 0 ) {
 		/* Case false ... (subsequent elsif/else commands might generate more) */
 		sieve_jumplist_resolve(&jmplist);
 	}
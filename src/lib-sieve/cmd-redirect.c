@@ -148,6 +148,9 @@ cmd_redirect_validate(struct sieve_validator *validator,
 			}
 		} T_END;
 
+		/* Store the address in parsed form */
+		if (result)
+			arg->argument->def = &address_argument;
 		return result;
 	}
 
@@ -203,7 +206,6 @@ cmd_redirect_operation_execute(const struct sieve_runtime_env *renv,
 	struct sieve_side_effects_list *slist = NULL;
 	string_t *redirect;
 	const struct smtp_address *to_address;
-	const char *error;
 	int ret;
 
 	/*
@@ -216,21 +218,25 @@ cmd_redirect_operation_execute(const struct sieve_runtime_env *renv,
 		return ret;
 
 	/* Read the address */
-	if ((ret = sieve_opr_string_read(renv, address, "address",
-					 &redirect)) <= 0)
+	if ((ret = sieve_opr_address_read(renv, address, "address",
+					  &redirect, &to_address)) <= 0)
 		return ret;
 
 	/*
 	 * Perform operation
 	 */
 
-	/* Parse the address */
-	to_address = sieve_address_parse_str(redirect, &error);
+	/* Parse the address, unless this was done at compile time */
 	if (to_address == NULL) {
-		sieve_runtime_error(renv, NULL,
-			"specified redirect address '%s' is invalid: %s",
-			str_sanitize(str_c(redirect),128), error);
-		return SIEVE_EXEC_FAILURE;
+		const char *error;
+
+		to_address = sieve_address_parse_str(redirect, &error);
+		if (to_address == NULL) {
+			sieve_runtime_error(renv, NULL,
+				"specified redirect address '%s' is invalid: %s",
+				str_sanitize(str_c(redirect),128), error);
+			return SIEVE_EXEC_FAILURE;
+		}
 	}
 
 	if (svinst->max_redirects == 0) {
@@ -313,7 +319,7 @@ act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
 	struct istream *input;
 	struct ostream *output;
 	const struct smtp_address *sender;
-	const char *error;
+	const char *header, *error;
 	struct sieve_smtp_context *sctx;
 	int ret;
 
@@ -363,11 +369,24 @@ act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
 	/* Open SMTP transport */
 	sctx = sieve_smtp_start_single(senv, ctx->to_address, sender, &output);
 
-	/* Remove unwanted headers */
-	input = i_stream_create_header_filter(
-		input, HEADER_FILTER_EXCLUDE | HEADER_FILTER_NO_CR,
-		hide_headers, N_ELEMENTS(hide_headers),
-		*null_header_filter_callback, (void *)NULL);
+	/* Remove unwanted headers. Most messages don't have these, in which
+	   case the message is sent as is, so that the output stream can take
+	   the data straight from the (possibly file-backed) input stream. */
+	if ((ret = mail_get_first_header(mail, hide_headers[0],
+					 &header)) < 0) {
+		sieve_smtp_abort(sctx);
+		return sieve_result_mail_error(aenv, mail,
+					       "failed to read header field `%s'",
+					       hide_headers[0]);
+	}
+	if (ret > 0) {
+		input = i_stream_create_header_filter(
+			input, HEADER_FILTER_EXCLUDE | HEADER_FILTER_NO_CR,
+			hide_headers, N_ELEMENTS(hide_headers),
+			*null_header_filter_callback, (void *)NULL);
+	} else {
+		i_stream_ref(input);
+	}
 
 	T_BEGIN {
 		string_t *hdr = t_str_new(256);
@@ -46,13 +46,67 @@ const struct sieve_comparator_def i_ascii_casemap_comparator = {
  * Comparator implementation
  */
 
+/* Case folding is performed a 64-bit word at a time while both values contain
+   only ASCII characters. Words holding non-ASCII octets are folded one octet
+   at a time, so the result is identical to folding with i_tolower(). */
+
+#define CASEMAP_WORD_ONES  0x0101010101010101ULL
+#define CASEMAP_WORD_HIGHS 0x8080808080808080ULL
+
+static inline uint64_t cmp_i_ascii_casemap_load(const char *p)
+{
+	uint64_t word;
+
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline uint64_t cmp_i_ascii_casemap_fold(uint64_t word)
+{
+	/* All octets are < 0x80 here, so none of the additions carry into the
+	   next octet */
+	uint64_t ge_a = word + CASEMAP_WORD_ONES * (0x80 - 'A');
+	uint64_t gt_z = word + CASEMAP_WORD_ONES * (0x7f - 'Z');
+	uint64_t upper = (ge_a ^ gt_z) & CASEMAP_WORD_HIGHS;
+
+	return word | (upper >> 2);
+}
+
+/* Returns the length of the case-insensitively equal prefix of both values */
+static size_t cmp_i_ascii_casemap_prefix
+(const char *val1, const char *val2, size_t size)
+{
+	size_t i = 0;
+
+	while ( i + sizeof(uint64_t) <= size ) {
+		uint64_t w1 = cmp_i_ascii_casemap_load(val1 + i);
+		uint64_t w2 = cmp_i_ascii_casemap_load(val2 + i);
+
+		if ( w1 != w2 ) {
+			if ( ((w1 | w2) & CASEMAP_WORD_HIGHS) != 0 ||
+				cmp_i_ascii_casemap_fold(w1) != cmp_i_ascii_casemap_fold(w2) )
+				break;
+		}
+		i += sizeof(uint64_t);
+	}
+
+	while ( i < size && i_tolower(val1[i]) == i_tolower(val2[i]) )
+		i++;
+	return i;
+}
+
 static int cmp_i_ascii_casemap_compare(
 	const struct sieve_comparator *cmp ATTR_UNUSED,
 	const char *val1, size_t val1_size, const char *val2, size_t val2_size)
 {
 	size_t size = I_MIN(val1_size, val2_size);
-	int ret = strncasecmp(val1, val2, size);
-	return ret != 0 ? ret : (int)val1_size - (int)val2_size;
+	size_t prefix = cmp_i_ascii_casemap_prefix(val1, val2, size);
+
+	if ( prefix < size ) {
+		return (int)(unsigned char)i_tolower(val1[prefix]) -
+			(int)(unsigned char)i_tolower(val2[prefix]);
+	}
+	return (int)val1_size - (int)val2_size;
 }
 
 static bool cmp_i_ascii_casemap_char_match
@@ -60,23 +114,15 @@ static bool cmp_i_ascii_casemap_char_match
 		const char **val, const char *val_end,
 		const char **key, const char *key_end)
 {
-	const char *val_begin = *val;
-	const char *key_begin = *key;
-
-	while ( i_tolower(**val) == i_tolower(**key) &&
-		*val < val_end && *key < key_end ) {
-		(*val)++;
-		(*key)++;
-	}
-
-	if ( *key < key_end ) {
-		/* Reset */
-		*val = val_begin;
-		*key = key_begin;
+	size_t key_size = key_end - *key;
 
+	/* Only a match of the whole remaining key advances the positions */
+	if ( (size_t)(val_end - *val) < key_size ||
+		cmp_i_ascii_casemap_prefix(*val, *key, key_size) < key_size )
 		return FALSE;
-	}
 
+	*val += key_size;
+	*key = key_end;
 	return TRUE;
 }
 
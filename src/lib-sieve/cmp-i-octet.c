@@ -75,22 +75,15 @@ static bool cmp_i_octet_char_match
 		const char **val, const char *val_end,
 		const char **key, const char *key_end)
 {
-	const char *val_begin = *val;
-	const char *key_begin = *key;
-
-	while ( **val == **key && *val < val_end && *key < key_end ) {
-		(*val)++;
-		(*key)++;
-	}
-
-	if ( *key < key_end ) {
-		/* Reset */
-		*val = val_begin;
-		*key = key_begin;
+	size_t key_size = key_end - *key;
 
+	/* Only a match of the whole remaining key advances the positions */
+	if ( (size_t)(val_end - *val) < key_size ||
+		memcmp(*val, *key, key_size) != 0 )
 		return FALSE;
-	}
 
+	*val += key_size;
+	*key = key_end;
 	return TRUE;
 }
 
@@ -204,21 +204,21 @@ struct sieve_envelope_part {
 	const char *identifier;
 
 	const struct smtp_address *const *(*get_addresses)
-		(const struct sieve_runtime_env *renv);
+		(const struct sieve_runtime_env *renv, pool_t pool);
 	const char * const *(*get_values)
-		(const struct sieve_runtime_env *renv);
+		(const struct sieve_runtime_env *renv, pool_t pool);
 };
 
 static const struct smtp_address *const *
-_from_part_get_addresses(const struct sieve_runtime_env *renv);
+_from_part_get_addresses(const struct sieve_runtime_env *renv, pool_t pool);
 static const char *const *
-_from_part_get_values(const struct sieve_runtime_env *renv);
+_from_part_get_values(const struct sieve_runtime_env *renv, pool_t pool);
 static const struct smtp_address *const *
-_to_part_get_addresses(const struct sieve_runtime_env *renv);
+_to_part_get_addresses(const struct sieve_runtime_env *renv, pool_t pool);
 static const char *const *
-_to_part_get_values(const struct sieve_runtime_env *renv);
+_to_part_get_values(const struct sieve_runtime_env *renv, pool_t pool);
 static const char *const *
-_auth_part_get_values(const struct sieve_runtime_env *renv);
+_auth_part_get_values(const struct sieve_runtime_env *renv, pool_t pool);
 
 static const struct sieve_envelope_part _from_part = {
 	"from",
@@ -265,16 +265,16 @@ _envelope_part_find(const char *identifier)
 /* Envelope parts implementation */
 
 static const struct smtp_address *const *
-_from_part_get_addresses(const struct sieve_runtime_env *renv)
+_from_part_get_addresses(const struct sieve_runtime_env *renv, pool_t pool)
 {
 	ARRAY(const struct smtp_address *) envelope_values;
 	const struct smtp_address *address =
 		sieve_message_get_sender(renv->msgctx);
 
-	t_array_init(&envelope_values, 2);
+	p_array_init(&envelope_values, pool, 2);
 
 	if (address == NULL)
-		address = smtp_address_create_temp(NULL, NULL);
+		address = p_new(pool, struct smtp_address, 1);
 	array_append(&envelope_values, &address, 1);
 
 	(void)array_append_space(&envelope_values);
@@ -282,18 +282,18 @@ _from_part_get_addresses(const struct sieve_runtime_env *renv)
 }
 
 static const char *const *
-_from_part_get_values(const struct sieve_runtime_env *renv)
+_from_part_get_values(const struct sieve_runtime_env *renv, pool_t pool)
 {
 	ARRAY(const char *)envelope_values;
 	const struct smtp_address *address =
 		sieve_message_get_sender(renv->msgctx);
 	const char *value;
 
-	t_array_init(&envelope_values, 2);
+	p_array_init(&envelope_values, pool, 2);
 
 	value = "";
 	if (!smtp_address_isnull(address))
-		value = smtp_address_encode(address);
+		value = p_strdup(pool, smtp_address_encode(address));
 	array_append(&envelope_values, &value, 1);
 
 	(void)array_append_space(&envelope_values);
@@ -302,14 +302,14 @@ _from_part_get_values(const struct sieve_runtime_env *renv)
 }
 
 static const struct smtp_address *const *
-_to_part_get_addresses(const struct sieve_runtime_env *renv)
+_to_part_get_addresses(const struct sieve_runtime_env *renv, pool_t pool)
 {
 	ARRAY(const struct smtp_address *) envelope_values;
 	const struct smtp_address *address =
 		sieve_message_get_orig_recipient(renv->msgctx);
 
 	if (address != NULL && address->localpart != NULL) {
-		t_array_init(&envelope_values, 2);
+		p_array_init(&envelope_values, pool, 2);
 
 		array_append(&envelope_values, &address, 1);
 
@@ -320,16 +320,17 @@ _to_part_get_addresses(const struct sieve_runtime_env *renv)
 }
 
 static const char *const *
-_to_part_get_values(const struct sieve_runtime_env *renv)
+_to_part_get_values(const struct sieve_runtime_env *renv, pool_t pool)
 {
 	ARRAY(const char *) envelope_values;
 	const struct smtp_address *address =
 		sieve_message_get_orig_recipient(renv->msgctx);
 
-	t_array_init(&envelope_values, 2);
+	p_array_init(&envelope_values, pool, 2);
 
 	if (address != NULL && address->localpart != NULL) {
-		const char *value = smtp_address_encode(address);
+		const char *value =
+			p_strdup(pool, smtp_address_encode(address));
 		array_append(&envelope_values, &value, 1);
 	}
 
@@ -339,12 +340,12 @@ _to_part_get_values(const struct sieve_runtime_env *renv)
 }
 
 static const char *const *
-_auth_part_get_values(const struct sieve_runtime_env *renv)
+_auth_part_get_values(const struct sieve_runtime_env *renv, pool_t pool)
 {
 	const struct sieve_execute_env *eenv = renv->exec_env;
 	ARRAY(const char *) envelope_values;
 
-	t_array_init(&envelope_values, 2);
+	p_array_init(&envelope_values, pool, 2);
 
 	if (eenv->msgdata->auth_user != NULL)
 		array_append(&envelope_values, &eenv->msgdata->auth_user, 1);
@@ -354,6 +355,68 @@ _auth_part_get_values(const struct sieve_runtime_env *renv)
 	return array_idx(&envelope_values, 0);
 }
 
+/* Envelope parts are resolved only once per message context */
+
+struct ext_envelope_part_data {
+	const struct smtp_address *const *addresses;
+	const char *const *values;
+
+	bool resolved:1;
+};
+
+struct ext_envelope_message_context {
+	struct ext_envelope_part_data parts[N_ELEMENTS(_envelope_parts)];
+};
+
+static const struct ext_envelope_part_data *
+_envelope_part_get_data(const struct sieve_runtime_env *renv,
+			const struct sieve_extension *this_ext,
+			const struct sieve_envelope_part *epart)
+{
+	pool_t pool = sieve_message_context_pool(renv->msgctx);
+	struct ext_envelope_message_context *mctx;
+	struct ext_envelope_part_data *pdata;
+	unsigned int i;
+
+	mctx = (struct ext_envelope_message_context *)
+		sieve_message_context_extension_get(renv->msgctx, this_ext);
+	if (mctx == NULL) {
+		mctx = p_new(pool, struct ext_envelope_message_context, 1);
+		sieve_message_context_extension_set(renv->msgctx, this_ext,
+						    (void *)mctx);
+	}
+
+	for (i = 0; i < _envelope_part_count; i++) {
+		if (_envelope_parts[i] == epart)
+			break;
+	}
+	i_assert(i < _envelope_part_count);
+
+	pdata = &mctx->parts[i];
+	if (pdata->resolved)
+		return pdata;
+	pdata->resolved = TRUE;
+
+	if (epart->get_addresses != NULL) {
+		/* Field contains addresses */
+		pdata->addresses = epart->get_addresses(renv, pool);
+
+		/* Drop empty list */
+		if (pdata->addresses != NULL && pdata->addresses[0] == NULL)
+			pdata->addresses = NULL;
+	}
+
+	if (pdata->addresses == NULL && epart->get_values != NULL) {
+		/* Field contains something else */
+		pdata->values = epart->get_values(renv, pool);
+
+		/* Drop empty list */
+		if (pdata->values != NULL && pdata->values[0] == NULL)
+			pdata->values = NULL;
+	}
+	return pdata;
+}
+
 /*
  * Envelope address list
  */
@@ -375,6 +438,7 @@ sieve_envelope_address_list_reset(struct sieve_stringlist *_strlist);
 struct sieve_envelope_address_list {
 	struct sieve_address_list addrlist;
 
+	const struct sieve_extension *ext;
 	struct sieve_stringlist *env_parts;
 
 	const struct smtp_address *const *cur_addresses;
@@ -396,6 +460,7 @@ sieve_envelope_address_list_create(const struct sieve_runtime_env *renv,
 		sieve_envelope_address_list_next_string_item;
 	addrlist->addrlist.strlist.reset = sieve_envelope_address_list_reset;
 	addrlist->addrlist.next_item = sieve_envelope_address_list_next_item;
+	addrlist->ext = renv->oprtn->ext;
 	addrlist->env_parts = env_parts;
 
 	return &addrlist->addrlist;
@@ -433,29 +498,13 @@ sieve_envelope_address_list_next_item(struct sieve_address_list *_addrlist,
 		}
 
 		if ((epart=_envelope_part_find(str_c(envp_item))) != NULL) {
-			addrlist->value_index = 0;
-
-			if (epart->get_addresses != NULL) {
-				/* Field contains addresses */
-				addrlist->cur_addresses =
-					epart->get_addresses(renv);
-
-				/* Drop empty list */
-				if (addrlist->cur_addresses != NULL &&
-				    addrlist->cur_addresses[0] == NULL)
-					addrlist->cur_addresses = NULL;
-			}
+			const struct ext_envelope_part_data *pdata =
+				_envelope_part_get_data(renv, addrlist->ext,
+							epart);
 
-			if (addrlist->cur_addresses == NULL &&
-			    epart->get_values != NULL) {
-				/* Field contains something else */
-				addrlist->cur_values = epart->get_values(renv);
-
-				/* Drop empty list */
-				if (addrlist->cur_values != NULL &&
-				    addrlist->cur_values[0] == NULL)
-					addrlist->cur_values = NULL;
-			}
+			addrlist->value_index = 0;
+			addrlist->cur_addresses = pdata->addresses;
+			addrlist->cur_values = pdata->values;
 		}
 	}
 
@@ -0,0 +1,54 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "hostpid.h"
+#include "write-full.h"
+#include "time-util.h"
+
+#include "sieve.h"
+#include "sieve-binary.h"
+
+#include "fuzz-sieve-common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Opens the input as a Sieve binary. Binaries produced by sievec make a good
+   seed corpus. The binary code can only be read from a file, so the input is
+   written to a temporary file first. */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct sieve_instance *svinst = fuzz_sieve_init();
+	struct sieve_binary *sbin;
+	struct timeval start;
+	const char *path;
+	int fd;
+
+	T_BEGIN {
+		path = t_strdup_printf("/tmp/fuzz-sieve-binary.%s.svbin",
+				       my_pid);
+		fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+		if (fd == -1)
+			i_fatal("open(%s) failed: %m", path);
+		if (write_full(fd, data, size) < 0)
+			i_fatal("write(%s) failed: %m", path);
+		i_close_fd(&fd);
+
+		i_gettimeofday(&start);
+		sbin = sieve_binary_open(svinst, path, NULL, NULL);
+		fuzz_sieve_check_time("Opening binary", size, &start);
+
+		if (sbin != NULL) {
+			/* Blocks are loaded lazily */
+			(void)sieve_binary_block_get(
+				sbin, SBIN_SYSBLOCK_MAIN_PROGRAM);
+			fuzz_sieve_check_time("Loading binary", size, &start);
+			sieve_binary_unref(&sbin);
+		}
+		i_unlink(path);
+	} T_END;
+	return 0;
+}
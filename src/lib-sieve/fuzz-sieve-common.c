@@ -0,0 +1,70 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "time-util.h"
+
+#include "sieve.h"
+
+#include "fuzz-sieve-common.h"
+
+#include <stdlib.h>
+
+static struct sieve_instance *fuzz_svinst = NULL;
+static unsigned int fuzz_budget_msecs = FUZZ_SIEVE_DEFAULT_BUDGET_MSECS;
+
+static const char *
+fuzz_sieve_get_setting(void *context ATTR_UNUSED,
+		       const char *identifier ATTR_UNUSED)
+{
+	return NULL;
+}
+
+static const struct sieve_callbacks fuzz_sieve_callbacks = {
+	NULL,
+	fuzz_sieve_get_setting
+};
+
+struct sieve_instance *fuzz_sieve_init(void)
+{
+	struct sieve_environment svenv;
+	const char *budget;
+
+	if (fuzz_svinst != NULL)
+		return fuzz_svinst;
+
+	lib_init();
+
+	budget = getenv("SIEVE_FUZZ_BUDGET_MSECS");
+	if (budget != NULL && str_to_uint(budget, &fuzz_budget_msecs) < 0)
+		i_fatal("Invalid SIEVE_FUZZ_BUDGET_MSECS: %s", budget);
+
+	i_zero(&svenv);
+	svenv.username = "fuzz";
+	svenv.hostname = "localhost";
+	svenv.base_dir = "/tmp";
+	svenv.temp_dir = "/tmp";
+	svenv.location = SIEVE_ENV_LOCATION_MS;
+	svenv.delivery_phase = SIEVE_DELIVERY_PHASE_POST;
+
+	fuzz_svinst = sieve_init(&svenv, &fuzz_sieve_callbacks, NULL, FALSE);
+	if (fuzz_svinst == NULL)
+		i_fatal("Failed to initialize Sieve");
+	return fuzz_svinst;
+}
+
+void fuzz_sieve_check_time(const char *what, size_t size,
+			   const struct timeval *start)
+{
+	struct timeval end;
+	long long msecs, budget;
+
+	i_gettimeofday(&end);
+	msecs = timeval_diff_msecs(&end, start);
+	budget = fuzz_budget_msecs +
+		(long long)(size / 1024) * FUZZ_SIEVE_BUDGET_MSECS_PER_KB;
+	if (msecs > budget) {
+		i_panic("%s took %lld ms for %"PRIuSIZE_T" bytes "
+			"(budget is %lld ms)", what, msecs, size, budget);
+	}
+}
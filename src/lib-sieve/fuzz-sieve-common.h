@@ -0,0 +1,26 @@
+#ifndef FUZZ_SIEVE_COMMON_H
+#define FUZZ_SIEVE_COMMON_H
+
+#include "sieve-common.h"
+
+/*
+ * Fuzzer support
+ */
+
+/* Time allowed for handling an input of the given size. The budget grows
+   linearly with the input size, so that inputs that take super-linear time
+   (e.g. deeply nested blocks or huge text: literals) exceed it. The base
+   budget can be changed with the SIEVE_FUZZ_BUDGET_MSECS environment
+   variable. */
+#define FUZZ_SIEVE_DEFAULT_BUDGET_MSECS 250
+#define FUZZ_SIEVE_BUDGET_MSECS_PER_KB  2
+
+/* Returns the Sieve instance shared by all runs of the fuzzer. */
+struct sieve_instance *fuzz_sieve_init(void);
+
+/* Panics when handling the input took longer than its budget, so that the
+   fuzzer records it. */
+void fuzz_sieve_check_time(const char *what, size_t size,
+			   const struct timeval *start);
+
+#endif
@@ -0,0 +1,48 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "time-util.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-error.h"
+
+#include "fuzz-sieve-common.h"
+
+/* Compiles the input as a Sieve script. Scripts from the testsuite (tests/)
+   make a good seed corpus. */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct sieve_instance *svinst = fuzz_sieve_init();
+	struct sieve_error_handler *ehandler;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	struct istream *input;
+	struct timeval start;
+	string_t *errors;
+
+	T_BEGIN {
+		errors = t_str_new(256);
+		ehandler = sieve_strbuf_ehandler_create(svinst, errors,
+							FALSE, 0);
+		input = i_stream_create_from_data(data, size);
+		script = sieve_data_script_create_from_input(svinst, "fuzz",
+							     input);
+
+		i_gettimeofday(&start);
+		sbin = sieve_compile_script(script, ehandler, 0, NULL);
+		fuzz_sieve_check_time("Compiling script", size, &start);
+
+		if (sbin != NULL)
+			sieve_binary_unref(&sbin);
+		sieve_script_unref(&script);
+		i_stream_unref(&input);
+		sieve_error_handler_unref(&ehandler);
+	} T_END;
+	return 0;
+}
@@ -5,7 +5,16 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-binary.h"
+#include "sieve-runtime.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -13,13 +22,28 @@
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Key lists with fewer keys are matched one key at a time */
+#define MCHT_CONTAINS_AUTOMATON_MIN_KEYS 4
+
 /*
  * Forward declarations
  */
 
+static void mcht_contains_match_init(struct sieve_match_context *mctx);
+static int mcht_contains_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_contains_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static int mcht_contains_match_chunk
+	(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+		bool last, struct sieve_stringlist *key_list);
+static void mcht_contains_match_deinit(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -29,13 +53,412 @@ const struct sieve_match_type_def contains_match_type = {
 	SIEVE_OBJECT("contains",
 		&match_type_operand, SIEVE_MATCH_TYPE_CONTAINS),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_contains_match_key
+	.match_init = mcht_contains_match_init,
+	.match_keys = mcht_contains_match_keys,
+	.match_key = mcht_contains_match_key,
+	.match_chunk = mcht_contains_match_chunk,
+	.match_deinit = mcht_contains_match_deinit
+};
+
+/*
+ * Multi-pattern automaton
+ */
+
+/* For long key lists, all keys are compiled into a single Aho-Corasick
+   automaton, so that each value is scanned only once rather than once for
+   each key. The automaton is associated with the binary, so that it is built
+   only once for all executions. */
+
+struct mcht_contains_state {
+	/* Trie structure; 0 means none, since the root is never a child */
+	unsigned int first_child, next_sibling;
+	/* Failure link */
+	unsigned int fail;
+
+	unsigned char c;
+	/* A key ends in this state (or in one of its failure states) */
+	bool output:1;
 };
 
+struct mcht_contains_automaton {
+	ARRAY(struct mcht_contains_state) states;
+	/* Transitions from the root state */
+	unsigned int root[256];
+
+	/* Keys (and values) are case-folded */
+	bool icase:1;
+	/* An empty key matches any value */
+	bool match_all:1;
+};
+
+struct mcht_contains_key {
+	size_t offset, size;
+};
+ARRAY_DEFINE_TYPE(mcht_contains_key, struct mcht_contains_key);
+
+static unsigned int
+mcht_contains_automaton_next(const struct mcht_contains_automaton *aut,
+			     unsigned int state, unsigned char c)
+{
+	const struct mcht_contains_state *states;
+	unsigned int child;
+
+	if ( state == 0 )
+		return aut->root[c];
+
+	states = array_idx(&aut->states, 0);
+	for ( child = states[state].first_child; child != 0;
+		child = states[child].next_sibling ) {
+		if ( states[child].c == c )
+			return child;
+	}
+	return 0;
+}
+
+static void
+mcht_contains_automaton_add_key(struct mcht_contains_automaton *aut,
+				const unsigned char *key, size_t key_size)
+{
+	struct mcht_contains_state *st;
+	unsigned int state = 0, next;
+	size_t i;
+
+	if ( key_size == 0 ) {
+		aut->match_all = TRUE;
+		return;
+	}
+
+	for ( i = 0; i < key_size; i++ ) {
+		unsigned char c = ( aut->icase ? i_tolower(key[i]) : key[i] );
+
+		next = mcht_contains_automaton_next(aut, state, c);
+		if ( next == 0 ) {
+			next = array_count(&aut->states);
+			st = array_append_space(&aut->states);
+			st->c = c;
+
+			if ( state == 0 ) {
+				aut->root[c] = next;
+			} else {
+				struct mcht_contains_state *parent =
+					array_idx_modifiable(&aut->states, state);
+
+				st = array_idx_modifiable(&aut->states, next);
+				st->next_sibling = parent->first_child;
+				parent->first_child = next;
+			}
+		}
+		state = next;
+	}
+
+	st = array_idx_modifiable(&aut->states, state);
+	st->output = TRUE;
+}
+
+static void
+mcht_contains_automaton_link(struct mcht_contains_automaton *aut)
+{
+	ARRAY(unsigned int) queue;
+	struct mcht_contains_state *states;
+	unsigned int c, head, state, child, fail;
+
+	/* Compute failure links breadth-first */
+	t_array_init(&queue, array_count(&aut->states));
+	for ( c = 0; c < 256; c++ ) {
+		if ( aut->root[c] != 0 )
+			array_append(&queue, &aut->root[c], 1);
+	}
+
+	states = array_idx_modifiable(&aut->states, 0);
+	for ( head = 0; head < array_count(&queue); head++ ) {
+		state = *array_idx(&queue, head);
+
+		for ( child = states[state].first_child; child != 0;
+			child = states[child].next_sibling ) {
+			c = states[child].c;
+
+			fail = states[state].fail;
+			while ( fail != 0 &&
+				mcht_contains_automaton_next(aut, fail, c) == 0 )
+				fail = states[fail].fail;
+			fail = mcht_contains_automaton_next(aut, fail, c);
+
+			states[child].fail = fail;
+			if ( states[fail].output )
+				states[child].output = TRUE;
+
+			array_append(&queue, &child, 1);
+		}
+	}
+}
+
+static void mcht_contains_automaton_free(void *object)
+{
+	struct mcht_contains_automaton *aut =
+		(struct mcht_contains_automaton *)object;
+
+	array_free(&aut->states);
+	i_free(aut);
+}
+
+static struct mcht_contains_automaton *
+mcht_contains_automaton_create(const string_t *keys_str,
+			       const ARRAY_TYPE(mcht_contains_key) *keys,
+			       bool icase)
+{
+	struct mcht_contains_automaton *aut;
+	const struct mcht_contains_key *key;
+	const unsigned char *data = str_data(keys_str);
+
+	aut = i_new(struct mcht_contains_automaton, 1);
+	aut->icase = icase;
+	i_array_init(&aut->states, 256);
+
+	/* State 0 is the root */
+	(void)array_append_space(&aut->states);
+
+	array_foreach(keys, key)
+		mcht_contains_automaton_add_key(aut, data + key->offset, key->size);
+
+	T_BEGIN {
+		mcht_contains_automaton_link(aut);
+	} T_END;
+
+	return aut;
+}
+
+static int
+mcht_contains_automaton_scan(const struct mcht_contains_automaton *aut,
+			     unsigned int *_state, const char *val,
+			     size_t val_size)
+{
+	const struct mcht_contains_state *states = array_idx(&aut->states, 0);
+	const unsigned char *vp = (const unsigned char *)val;
+	const unsigned char *vend = vp + val_size;
+	unsigned int state = *_state, next;
+
+	if ( aut->match_all )
+		return 1;
+
+	for ( ; vp < vend; vp++ ) {
+		unsigned char c = ( aut->icase ? i_tolower(*vp) : *vp );
+
+		for (;;) {
+			next = mcht_contains_automaton_next(aut, state, c);
+			if ( next != 0 || state == 0 )
+				break;
+			state = states[state].fail;
+		}
+		state = next;
+
+		if ( states[state].output )
+			return 1;
+	}
+	*_state = state;
+	return 0;
+}
+
+static int
+mcht_contains_automaton_match(const struct mcht_contains_automaton *aut,
+			      const char *val, size_t val_size)
+{
+	unsigned int state = 0;
+
+	return mcht_contains_automaton_scan(aut, &state, val, val_size);
+}
+
 /*
  * Match-type implementation
  */
 
+struct mcht_contains_context {
+	const struct mcht_contains_automaton *automaton;
+	/* Automaton not owned by the binary */
+	struct mcht_contains_automaton *own_automaton;
+
+	/* Chunked matching: automaton state or, when keys are matched one at
+	   a time, the tail of the previous chunks that a key may start in */
+	unsigned int chunk_state;
+	buffer_t *chunk_tail;
+
+	bool prepared:1;
+};
+
+static void mcht_contains_match_init
+(struct sieve_match_context *mctx)
+{
+	mctx->data = (void *)p_new(mctx->pool, struct mcht_contains_context, 1);
+}
+
+static int mcht_contains_prepare
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	struct mcht_contains_automaton *aut;
+	ARRAY_TYPE(mcht_contains_key) keys;
+	struct mcht_contains_key *key;
+	string_t *keys_str, *key_item = NULL;
+	bool icase;
+	int ret;
+
+	ctx->prepared = TRUE;
+
+	/* Only comparators with trivial character semantics are supported */
+	if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		icase = FALSE;
+	else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		icase = TRUE;
+	else
+		return 0;
+
+	/* The automaton is identified by its keys */
+	keys_str = str_new(mctx->pool, 256);
+	str_printfa(keys_str, "mcht-contains\n%s\n", sieve_comparator_name(cmp));
+
+	p_array_init(&keys, mctx->pool, 16);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		str_printfa(keys_str, "%"PRIuSIZE_T":", str_len(key_item));
+
+		key = array_append_space(&keys);
+		key->offset = str_len(keys_str);
+		key->size = str_len(key_item);
+
+		str_append_str(keys_str, key_item);
+	}
+	sieve_stringlist_reset(key_list);
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+	if ( array_count(&keys) < MCHT_CONTAINS_AUTOMATON_MIN_KEYS )
+		return 0;
+
+	ctx->automaton = sieve_binary_runtime_object_lookup
+		(renv->sbin, str_c(keys_str));
+	if ( ctx->automaton != NULL )
+		return 1;
+
+	aut = mcht_contains_automaton_create(keys_str, &keys, icase);
+	if ( !sieve_binary_runtime_object_add(renv->sbin, str_c(keys_str),
+		aut, mcht_contains_automaton_free) )
+		ctx->own_automaton = aut;
+	ctx->automaton = aut;
+	return 1;
+}
+
+static int mcht_contains_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	string_t *key_item = NULL;
+	int match, ret;
+
+	/* Tracing reports the result for each key, so the automaton is not
+	   used then */
+	if ( !ctx->prepared && !mctx->trace ) {
+		if ( mcht_contains_prepare(mctx, key_list) < 0 )
+			return -1;
+	}
+
+	if ( ctx->automaton != NULL )
+		return mcht_contains_automaton_match(ctx->automaton, val, val_size);
+
+	/* Match one key at a time */
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		T_BEGIN {
+			match = mcht_contains_match_key
+				(mctx, val, val_size, str_c(key_item), str_len(key_item));
+
+			if ( mctx->trace ) {
+				sieve_runtime_trace(renv, 0,
+					"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+					match);
+			}
+		} T_END;
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		match = -1;
+	}
+	return match;
+}
+
+static int mcht_contains_match_chunk
+(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+	bool last ATTR_UNUSED, struct sieve_stringlist *key_list)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
+	int match, ret;
+
+	if ( !ctx->prepared ) {
+		if ( mcht_contains_prepare(mctx, key_list) < 0 )
+			return -1;
+	}
+
+	if ( ctx->automaton != NULL ) {
+		if ( mctx->chunk_offset == 0 )
+			ctx->chunk_state = 0;
+		return mcht_contains_automaton_scan
+			(ctx->automaton, &ctx->chunk_state, chunk, chunk_size);
+	}
+
+	if ( ctx->chunk_tail == NULL )
+		ctx->chunk_tail = buffer_create_dynamic(mctx->pool, 256);
+	if ( mctx->chunk_offset == 0 )
+		buffer_set_used_size(ctx->chunk_tail, 0);
+
+	match = 0;
+	T_BEGIN {
+		string_t *key_item = NULL;
+		const char *val = chunk;
+		size_t val_size = chunk_size, max_key_size = 0;
+
+		/* Prepend the end of the previous chunks, so that keys crossing
+		   the chunk boundary are found */
+		if ( ctx->chunk_tail->used > 0 ) {
+			buffer_t *buf =
+				t_buffer_create(ctx->chunk_tail->used + chunk_size);
+
+			buffer_append_buf(buf, ctx->chunk_tail, 0, (size_t)-1);
+			buffer_append(buf, chunk, chunk_size);
+			val = (const char *)buf->data;
+			val_size = buf->used;
+		}
+
+		while ( match == 0 &&
+			(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+			if ( str_len(key_item) > max_key_size )
+				max_key_size = str_len(key_item);
+			match = mcht_contains_match_key
+				(mctx, val, val_size, str_c(key_item), str_len(key_item));
+		}
+
+		if ( ret < 0 ) {
+			mctx->exec_status = key_list->exec_status;
+			match = -1;
+		} else if ( match == 0 && max_key_size > 1 ) {
+			size_t tail_size = I_MIN(val_size, max_key_size - 1);
+
+			buffer_set_used_size(ctx->chunk_tail, 0);
+			buffer_append(ctx->chunk_tail, val + val_size - tail_size,
+				tail_size);
+		}
+	} T_END;
+
+	return match;
+}
+
 /* FIXME: Naive substring match implementation. Should switch to more
  * efficient algorithm if large values need to be searched (e.g. message body).
  */
@@ -63,4 +486,12 @@ static int mcht_contains_match_key
 	return ( kp == kend ? 1 : 0 );
 }
 
+static void mcht_contains_match_deinit
+(struct sieve_match_context *mctx)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *)mctx->data;
 
+	if ( ctx->own_automaton != NULL )
+		mcht_contains_automaton_free(ctx->own_automaton);
+}
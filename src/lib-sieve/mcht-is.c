@@ -5,7 +5,17 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-binary.h"
+#include "sieve-runtime.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -13,13 +23,28 @@
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Key lists with fewer keys are matched one key at a time */
+#define MCHT_IS_KEY_SET_MIN_KEYS 8
+
 /*
  * Forward declarations
  */
 
+static void mcht_is_match_init(struct sieve_match_context *mctx);
+static int mcht_is_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_is_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static int mcht_is_match_chunk
+	(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+		bool last, struct sieve_stringlist *key_list);
+static void mcht_is_match_deinit(struct sieve_match_context *mctx);
 
 /*
  * Match-type object
@@ -28,13 +53,220 @@ static int mcht_is_match_key
 const struct sieve_match_type_def is_match_type = {
 	SIEVE_OBJECT("is",
 		&match_type_operand, SIEVE_MATCH_TYPE_IS),
-	.match_key = mcht_is_match_key
+	.match_init = mcht_is_match_init,
+	.match_keys = mcht_is_match_keys,
+	.match_key = mcht_is_match_key,
+	.match_chunk = mcht_is_match_chunk,
+	.match_deinit = mcht_is_match_deinit
 };
 
+/*
+ * Key set
+ */
+
+/* For long key lists, the keys are put in a hash set, so that each value is
+   looked up once rather than compared with each key. Like the :contains
+   automaton, the set is associated with the binary, so that it is built only
+   once for all executions. */
+
+struct mcht_is_key_set {
+	pool_t pool;
+	HASH_TABLE(const char *, const char *) keys;
+
+	/* Keys (and values) are case-folded */
+	bool icase:1;
+};
+
+static const char *
+mcht_is_key_set_fold(const struct mcht_is_key_set *set,
+		     const unsigned char *data, size_t size, pool_t pool)
+{
+	char *str;
+	size_t i;
+
+	str = p_malloc(pool, size + 1);
+	for ( i = 0; i < size; i++ )
+		str[i] = ( set->icase ? i_tolower(data[i]) : data[i] );
+	return str;
+}
+
+static void mcht_is_key_set_free(void *object)
+{
+	struct mcht_is_key_set *set = (struct mcht_is_key_set *)object;
+
+	hash_table_destroy(&set->keys);
+	pool_unref(&set->pool);
+}
+
+static struct mcht_is_key_set *
+mcht_is_key_set_create(const ARRAY_TYPE(const_string) *keys, bool icase)
+{
+	struct mcht_is_key_set *set;
+	const char *const *keyp;
+	pool_t pool;
+
+	pool = pool_alloconly_create("mcht_is_key_set", 1024);
+	set = p_new(pool, struct mcht_is_key_set, 1);
+	set->pool = pool;
+	set->icase = icase;
+	hash_table_create(&set->keys, pool, array_count(keys),
+			  str_hash, strcmp);
+
+	array_foreach(keys, keyp) {
+		const char *key = mcht_is_key_set_fold(
+			set, (const unsigned char *)*keyp, strlen(*keyp), pool);
+
+		hash_table_update(set->keys, key, key);
+	}
+	return set;
+}
+
+static int
+mcht_is_key_set_match(const struct mcht_is_key_set *set,
+		      const char *val, size_t val_size)
+{
+	int match;
+
+	/* The keys contain no NULs, so such a value cannot be equal to any */
+	if ( memchr(val, '\0', val_size) != NULL )
+		return 0;
+
+	T_BEGIN {
+		const char *folded = mcht_is_key_set_fold(
+			set, (const unsigned char *)val, val_size,
+			pool_datastack_create());
+
+		match = ( hash_table_lookup(set->keys, folded) != NULL ? 1 : 0 );
+	} T_END;
+	return match;
+}
+
 /*
  * Match-type implementation
  */
 
+struct mcht_is_context {
+	const struct mcht_is_key_set *key_set;
+	/* Key set not owned by the binary */
+	struct mcht_is_key_set *own_key_set;
+	bool prepared:1;
+
+	/* Chunked matching */
+	ARRAY(size_t) key_matched;
+	buffer_t *value;
+};
+
+static void mcht_is_match_init
+(struct sieve_match_context *mctx)
+{
+	mctx->data = (void *)p_new(mctx->pool, struct mcht_is_context, 1);
+}
+
+static int mcht_is_prepare
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_is_context *ctx = (struct mcht_is_context *)mctx->data;
+	struct mcht_is_key_set *set;
+	ARRAY_TYPE(const_string) keys;
+	string_t *keys_str, *key_item = NULL;
+	bool icase;
+	int ret;
+
+	ctx->prepared = TRUE;
+
+	/* Only comparators with trivial character semantics are supported */
+	if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		icase = FALSE;
+	else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		icase = TRUE;
+	else
+		return 0;
+
+	/* The key set is identified by its keys */
+	keys_str = str_new(mctx->pool, 256);
+	str_printfa(keys_str, "mcht-is\n%s\n", sieve_comparator_name(cmp));
+
+	p_array_init(&keys, mctx->pool, 16);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		const char *key = p_strndup(mctx->pool,
+			str_data(key_item), str_len(key_item));
+
+		if ( strlen(key) != str_len(key_item) ) {
+			/* Keys with NULs cannot be hashed as strings */
+			array_clear(&keys);
+			ret = 0;
+			break;
+		}
+		str_printfa(keys_str, "%"PRIuSIZE_T":", str_len(key_item));
+		str_append_str(keys_str, key_item);
+		array_append(&keys, &key, 1);
+	}
+	sieve_stringlist_reset(key_list);
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+	if ( array_count(&keys) < MCHT_IS_KEY_SET_MIN_KEYS )
+		return 0;
+
+	ctx->key_set = sieve_binary_runtime_object_lookup
+		(renv->sbin, str_c(keys_str));
+	if ( ctx->key_set != NULL )
+		return 1;
+
+	set = mcht_is_key_set_create(&keys, icase);
+	if ( !sieve_binary_runtime_object_add(renv->sbin, str_c(keys_str),
+		set, mcht_is_key_set_free) )
+		ctx->own_key_set = set;
+	ctx->key_set = set;
+	return 1;
+}
+
+static int mcht_is_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	struct mcht_is_context *ctx = (struct mcht_is_context *)mctx->data;
+	string_t *key_item = NULL;
+	int match, ret;
+
+	/* Tracing reports the result for each key, so the key set is not
+	   used then */
+	if ( !ctx->prepared && !mctx->trace ) {
+		if ( mcht_is_prepare(mctx, key_list) < 0 )
+			return -1;
+	}
+
+	if ( ctx->key_set != NULL )
+		return mcht_is_key_set_match(ctx->key_set, val, val_size);
+
+	/* Match one key at a time */
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		T_BEGIN {
+			match = mcht_is_match_key
+				(mctx, val, val_size, str_c(key_item), str_len(key_item));
+
+			if ( mctx->trace ) {
+				sieve_runtime_trace(renv, 0,
+					"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+					match);
+			}
+		} T_END;
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		match = -1;
+	}
+	return match;
+}
+
 static int mcht_is_match_key
 (struct sieve_match_context *mctx ATTR_UNUSED,
 	const char *val, size_t val_size,
@@ -50,3 +282,103 @@ static int mcht_is_match_key
 	return 0;
 }
 
+
+/* For chunked matching, the number of bytes of each key that matched the
+   value so far is recorded. Only comparators with trivial character
+   semantics can compare a key piecewise; for others, the value is collected
+   and compared at the end. */
+
+#define MCHT_IS_KEY_MISMATCH ((size_t)-1)
+
+static int mcht_is_match_chunk_value
+(struct sieve_match_context *mctx, struct mcht_is_context *ctx,
+	const char *chunk, size_t chunk_size, bool last,
+	struct sieve_stringlist *key_list)
+{
+	string_t *key_item = NULL;
+	int match, ret;
+
+	if ( ctx->value == NULL )
+		ctx->value = buffer_create_dynamic(default_pool, 4096);
+	if ( mctx->chunk_offset == 0 )
+		buffer_set_used_size(ctx->value, 0);
+	buffer_append(ctx->value, chunk, chunk_size);
+	if ( !last )
+		return 0;
+
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		match = mcht_is_match_key(mctx, ctx->value->data, ctx->value->used,
+			str_c(key_item), str_len(key_item));
+	}
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+	return match;
+}
+
+static int mcht_is_match_chunk
+(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+	bool last, struct sieve_stringlist *key_list)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_is_context *ctx = (struct mcht_is_context *)mctx->data;
+	string_t *key_item = NULL;
+	size_t *matched;
+	unsigned int i;
+	int match, ret;
+
+	if ( !array_is_created(&ctx->key_matched) )
+		p_array_init(&ctx->key_matched, mctx->pool, 8);
+
+	if ( cmp->def == NULL || cmp->def->compare == NULL ||
+		(!sieve_comparator_is(cmp, i_octet_comparator) &&
+			!sieve_comparator_is(cmp, i_ascii_casemap_comparator)) ) {
+		return mcht_is_match_chunk_value
+			(mctx, ctx, chunk, chunk_size, last, key_list);
+	}
+
+	if ( mctx->chunk_offset == 0 )
+		array_clear(&ctx->key_matched);
+
+	match = 0;
+	for ( i = 0; match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0; i++ ) {
+		size_t key_size = str_len(key_item);
+
+		matched = array_idx_get_space(&ctx->key_matched, i);
+		if ( mctx->chunk_offset == 0 )
+			*matched = 0;
+		if ( *matched == MCHT_IS_KEY_MISMATCH )
+			continue;
+
+		/* Compare the next piece of the key */
+		if ( chunk_size > key_size - *matched ||
+			(chunk_size > 0 && cmp->def->compare(cmp, chunk, chunk_size,
+				str_c(key_item) + *matched, chunk_size) != 0) ) {
+			*matched = MCHT_IS_KEY_MISMATCH;
+			continue;
+		}
+		*matched += chunk_size;
+
+		if ( last && *matched == key_size )
+			match = 1;
+	}
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+	return match;
+}
+
+static void mcht_is_match_deinit(struct sieve_match_context *mctx)
+{
+	struct mcht_is_context *ctx = (struct mcht_is_context *)mctx->data;
+
+	if ( ctx->own_key_set != NULL )
+		mcht_is_key_set_free(ctx->own_key_set);
+	if ( ctx->value != NULL )
+		buffer_free(&ctx->value);
+}
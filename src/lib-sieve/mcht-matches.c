@@ -5,8 +5,16 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "hash.h"
 #include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
+#include "sieve-binary.h"
+#include "sieve-runtime.h"
+#include "sieve-runtime-trace.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -14,10 +22,22 @@
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Domain lists with fewer keys are matched one key at a time */
+#define MCHT_MATCHES_DOMAIN_INDEX_MIN_KEYS 8
+
 /*
  * Forward declarations
  */
 
+static void mcht_matches_match_init(struct sieve_match_context *mctx);
+static int mcht_matches_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
+static void mcht_matches_match_deinit(struct sieve_match_context *mctx);
 static int mcht_matches_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
@@ -30,7 +50,10 @@ const struct sieve_match_type_def matches_match_type = {
 	SIEVE_OBJECT("matches",
 		&match_type_operand, SIEVE_MATCH_TYPE_MATCHES),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_matches_match_key
+	.match_init = mcht_matches_match_init,
+	.match_keys = mcht_matches_match_keys,
+	.match_key = mcht_matches_match_key,
+	.match_deinit = mcht_matches_match_deinit
 };
 
 /*
@@ -438,3 +461,600 @@ static int mcht_matches_match_key
 	return 0;
 }
 
+
+/*
+ * Compiled patterns
+ */
+
+/* Patterns that contain no '?' wildcards are compiled into a list of literal
+   pieces separated by '*' wildcards: a fixed prefix, a fixed suffix and the
+   pieces in between. Such a pattern is matched by finding the leftmost
+   occurrence of each middle piece, which needs no backtracking. Patterns are
+   compiled once for each match, so that these are not parsed again for every
+   value. More complex patterns use the generic matcher above. */
+
+struct mcht_matches_piece {
+	const char *data;
+	size_t size;
+};
+
+struct mcht_matches_pattern {
+	/* NULL if the pattern needs the generic matcher */
+	ARRAY(struct mcht_matches_piece) pieces;
+};
+
+struct mcht_matches_domain_index;
+
+struct mcht_matches_context {
+	ARRAY(struct mcht_matches_pattern) patterns;
+
+	const struct mcht_matches_domain_index *domain_index;
+	/* Domain index not owned by the binary */
+	struct mcht_matches_domain_index *own_domain_index;
+	bool prepared:1;
+};
+
+static void
+mcht_matches_pattern_compile(pool_t pool, struct mcht_matches_pattern *pattern,
+			     const char *key, size_t key_size)
+{
+	const char *kp = key, *kend = key + key_size;
+	struct mcht_matches_piece *piece;
+	string_t *section = t_str_new(key_size);
+
+	p_array_init(&pattern->pieces, pool, 4);
+
+	for (;;) {
+		str_truncate(section, 0);
+		while ( kp < kend && *kp != '*' ) {
+			if ( *kp == '?' || (*kp == '\\' && kp + 1 == kend) ) {
+				/* Not supported */
+				array_free(&pattern->pieces);
+				return;
+			}
+			if ( *kp == '\\' )
+				kp++;
+			str_append_c(section, *kp);
+			kp++;
+		}
+
+		piece = array_append_space(&pattern->pieces);
+		piece->data = p_memdup(pool, str_data(section), str_len(section));
+		piece->size = str_len(section);
+
+		if ( kp == kend )
+			break;
+		kp++;
+	}
+}
+
+static inline bool
+mcht_matches_piece_equals(const struct sieve_comparator *cmp,
+			  const char *vp, const char *vend,
+			  const struct mcht_matches_piece *piece)
+{
+	const char *np = piece->data;
+
+	if ( (size_t)(vend - vp) < piece->size )
+		return FALSE;
+	return cmp->def->char_match(cmp, &vp, vend, &np, np + piece->size);
+}
+
+static const char *
+mcht_matches_piece_find(const struct sieve_comparator *cmp,
+			const char *vp, const char *vend,
+			const struct mcht_matches_piece *piece)
+{
+	for ( ; vp + piece->size <= vend; vp++ ) {
+		if ( mcht_matches_piece_equals(cmp, vp, vend, piece) )
+			return vp;
+	}
+	return NULL;
+}
+
+static int
+mcht_matches_pattern_match(struct sieve_match_context *mctx,
+			   const struct mcht_matches_pattern *pattern,
+			   const char *val, size_t val_size)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	const struct mcht_matches_piece *pieces;
+	const char *vp = val, *vend = val + val_size, *send, *found;
+	struct sieve_match_values *mvalues;
+	unsigned int count, i;
+
+	pieces = array_get(&pattern->pieces, &count);
+	i_assert(count > 0);
+
+	/* Pattern without wildcards */
+	if ( count == 1 ) {
+		if ( pieces[0].size != val_size ||
+			!mcht_matches_piece_equals(cmp, vp, vend, &pieces[0]) )
+			return 0;
+		if ( (mvalues = sieve_match_values_start(mctx->runenv)) != NULL ) {
+			string_t *matched =
+				str_new_const(pool_datastack_create(), val, val_size);
+
+			sieve_match_values_add(mvalues, matched);
+			sieve_match_values_commit(mctx->runenv, &mvalues);
+		}
+		return 1;
+	}
+
+	/* Fixed prefix and suffix */
+	if ( pieces[0].size + pieces[count-1].size > val_size )
+		return 0;
+	if ( !mcht_matches_piece_equals(cmp, vp, vend, &pieces[0]) )
+		return 0;
+	vp += pieces[0].size;
+	send = vend - pieces[count-1].size;
+	if ( !mcht_matches_piece_equals(cmp, send, vend, &pieces[count-1]) )
+		return 0;
+
+	if ( (mvalues = sieve_match_values_start(mctx->runenv)) != NULL ) {
+		/* Skip ${0} for now; added when match succeeds */
+		sieve_match_values_add(mvalues, NULL);
+	}
+
+	/* Leftmost occurrence of each piece in between */
+	for ( i = 1; i < count - 1; i++ ) {
+		found = mcht_matches_piece_find(cmp, vp, send, &pieces[i]);
+		if ( found == NULL ) {
+			sieve_match_values_abort(&mvalues);
+			return 0;
+		}
+
+		if ( mvalues != NULL ) {
+			string_t *mvalue = t_str_new(found - vp + 1);
+
+			str_append_data(mvalue, vp, found - vp);
+			sieve_match_values_add(mvalues, mvalue);
+		}
+		vp = found + pieces[i].size;
+	}
+
+	if ( mvalues != NULL ) {
+		string_t *mvalue = t_str_new(send - vp + 1);
+		string_t *matched =
+			str_new_const(pool_datastack_create(), val, val_size);
+
+		/* The last '*' matches the rest of the value */
+		str_append_data(mvalue, vp, send - vp);
+		sieve_match_values_add(mvalues, mvalue);
+
+		/* Set ${0} */
+		sieve_match_values_set(mvalues, 0, matched);
+		sieve_match_values_commit(mctx->runenv, &mvalues);
+	}
+	return 1;
+}
+
+/*
+ * Domain index
+ */
+
+/* Blocklists often consist of many keys that are either a literal domain
+   ("example.com") or a domain suffix ("*.example.com"). When all keys have
+   one of these forms, these are put in a trie of domain labels, stored from
+   the last label to the first. A value is then matched by walking its labels
+   from right to left, which costs one lookup for each label instead of one
+   pattern match for each key. Like the :contains automaton, the index is
+   associated with the binary, so that it is built only once for all
+   executions.
+ */
+
+struct mcht_matches_domain_edge {
+	unsigned int parent;
+	const char *label;
+	size_t label_size;
+};
+
+struct mcht_matches_domain_node {
+	/* Index + 1 of the first key ending at this node; 0 means none */
+	unsigned int literal_key, suffix_key;
+};
+
+struct mcht_matches_domain_index {
+	pool_t pool;
+
+	/* Node 0 is the root */
+	ARRAY(struct mcht_matches_domain_node) nodes;
+	HASH_TABLE(struct mcht_matches_domain_edge *, void *) edges;
+
+	/* Keys (and values) are case-folded */
+	bool icase:1;
+};
+
+static unsigned int
+mcht_matches_domain_edge_hash(const struct mcht_matches_domain_edge *edge)
+{
+	unsigned int hash = edge->parent;
+	size_t i;
+
+	for ( i = 0; i < edge->label_size; i++ )
+		hash = hash * 31 + (unsigned char)edge->label[i];
+	return hash;
+}
+
+static int
+mcht_matches_domain_edge_cmp(const struct mcht_matches_domain_edge *edge1,
+			     const struct mcht_matches_domain_edge *edge2)
+{
+	if ( edge1->parent != edge2->parent )
+		return ( edge1->parent < edge2->parent ? -1 : 1 );
+	if ( edge1->label_size != edge2->label_size )
+		return ( edge1->label_size < edge2->label_size ? -1 : 1 );
+	return memcmp(edge1->label, edge2->label, edge1->label_size);
+}
+
+static char *
+mcht_matches_domain_fold(bool icase, const char *data, size_t size,
+			 pool_t pool)
+{
+	char *str;
+	size_t i;
+
+	str = p_malloc(pool, size + 1);
+	for ( i = 0; i < size; i++ )
+		str[i] = ( icase ? i_tolower(data[i]) : data[i] );
+	return str;
+}
+
+static unsigned int
+mcht_matches_domain_child(const struct mcht_matches_domain_index *index,
+			  unsigned int node, const char *label,
+			  size_t label_size)
+{
+	struct mcht_matches_domain_edge lookup;
+	void *child;
+
+	lookup.parent = node;
+	lookup.label = label;
+	lookup.label_size = label_size;
+
+	child = hash_table_lookup(index->edges, &lookup);
+	return POINTER_CAST_TO(child, unsigned int);
+}
+
+static void
+mcht_matches_domain_index_add(struct mcht_matches_domain_index *index,
+			      const char *domain, size_t domain_size,
+			      bool suffix, unsigned int key_idx)
+{
+	struct mcht_matches_domain_node *nodes;
+	unsigned int node = 0, child;
+	const char *lend, *p;
+	char *folded;
+
+	folded = mcht_matches_domain_fold(index->icase, domain, domain_size,
+					  index->pool);
+	lend = folded + domain_size;
+
+	/* Walk the labels from right to left; there is always one more label
+	   than there are dots */
+	for (;;) {
+		for ( p = lend; p > folded && *(p-1) != '.'; p-- );
+
+		child = mcht_matches_domain_child(index, node, p, lend - p);
+		if ( child == 0 ) {
+			struct mcht_matches_domain_edge *edge;
+
+			edge = p_new(index->pool, struct mcht_matches_domain_edge, 1);
+			edge->parent = node;
+			edge->label = p;
+			edge->label_size = lend - p;
+
+			child = array_count(&index->nodes);
+			(void)array_append_space(&index->nodes);
+			hash_table_insert(index->edges, edge,
+					  POINTER_CAST(child));
+		}
+		node = child;
+
+		if ( p == folded )
+			break;
+		lend = p - 1;
+	}
+
+	/* Earlier keys take precedence, as when matching one key at a time */
+	nodes = array_front_modifiable(&index->nodes);
+	if ( suffix ) {
+		if ( nodes[node].suffix_key == 0 )
+			nodes[node].suffix_key = key_idx + 1;
+	} else {
+		if ( nodes[node].literal_key == 0 )
+			nodes[node].literal_key = key_idx + 1;
+	}
+}
+
+static void mcht_matches_domain_index_free(void *object)
+{
+	struct mcht_matches_domain_index *index =
+		(struct mcht_matches_domain_index *)object;
+
+	hash_table_destroy(&index->edges);
+	pool_unref(&index->pool);
+}
+
+static struct mcht_matches_domain_index *
+mcht_matches_domain_index_create(bool icase)
+{
+	struct mcht_matches_domain_index *index;
+	pool_t pool;
+
+	pool = pool_alloconly_create("mcht_matches_domain_index", 4096);
+	index = p_new(pool, struct mcht_matches_domain_index, 1);
+	index->pool = pool;
+	index->icase = icase;
+	p_array_init(&index->nodes, pool, 64);
+	(void)array_append_space(&index->nodes);
+	hash_table_create(&index->edges, pool, 0,
+			  mcht_matches_domain_edge_hash,
+			  mcht_matches_domain_edge_cmp);
+	return index;
+}
+
+static bool
+mcht_matches_domain_key_parse(const char *key, size_t key_size,
+			      const char **domain_r, size_t *domain_size_r,
+			      bool *suffix_r)
+{
+	size_t i;
+
+	/* "*.suffix" or a literal domain */
+	*suffix_r = ( key_size >= 2 && key[0] == '*' && key[1] == '.' );
+	if ( *suffix_r ) {
+		key += 2;
+		key_size -= 2;
+	}
+
+	for ( i = 0; i < key_size; i++ ) {
+		if ( key[i] == '*' || key[i] == '?' || key[i] == '\\' )
+			return FALSE;
+	}
+
+	*domain_r = key;
+	*domain_size_r = key_size;
+	return TRUE;
+}
+
+static int
+mcht_matches_domain_index_match(struct sieve_match_context *mctx,
+				const struct mcht_matches_domain_index *index,
+				const char *val, size_t val_size)
+{
+	const struct mcht_matches_domain_node *nodes;
+	const char *folded, *vend, *lend, *p;
+	struct sieve_match_values *mvalues;
+	unsigned int node = 0, key = 0;
+	size_t prefix_size = 0;
+	bool suffix = FALSE;
+
+	nodes = array_front(&index->nodes);
+	folded = mcht_matches_domain_fold(index->icase, val, val_size,
+					  pool_datastack_create());
+	vend = folded + val_size;
+	lend = vend;
+
+	/* Walk the labels from right to left. Of all keys that match, the one
+	   listed first wins, which only matters for the match values. */
+	for (;;) {
+		for ( p = lend; p > folded && *(p-1) != '.'; p-- );
+
+		node = mcht_matches_domain_child(index, node, p, lend - p);
+		if ( node == 0 )
+			break;
+
+		if ( p == folded ) {
+			if ( nodes[node].literal_key != 0 &&
+			     (key == 0 || nodes[node].literal_key < key) ) {
+				key = nodes[node].literal_key;
+				suffix = FALSE;
+			}
+			break;
+		}
+
+		/* A dot precedes this label, so "*." matches what is left */
+		if ( nodes[node].suffix_key != 0 &&
+		     (key == 0 || nodes[node].suffix_key < key) ) {
+			key = nodes[node].suffix_key;
+			suffix = TRUE;
+			prefix_size = (p - 1) - folded;
+		}
+		lend = p - 1;
+	}
+
+	if ( key == 0 )
+		return 0;
+
+	if ( (mvalues = sieve_match_values_start(mctx->runenv)) != NULL ) {
+		string_t *matched =
+			str_new_const(pool_datastack_create(), val, val_size);
+
+		if ( suffix ) {
+			string_t *mvalue = t_str_new(prefix_size + 1);
+
+			/* Skip ${0} for now; added below */
+			sieve_match_values_add(mvalues, NULL);
+			str_append_data(mvalue, val, prefix_size);
+			sieve_match_values_add(mvalues, mvalue);
+			sieve_match_values_set(mvalues, 0, matched);
+		} else {
+			sieve_match_values_add(mvalues, matched);
+		}
+		sieve_match_values_commit(mctx->runenv, &mvalues);
+	}
+	return 1;
+}
+
+static int mcht_matches_prepare
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+	struct mcht_matches_domain_index *index;
+	ARRAY(struct mcht_matches_piece) keys;
+	const struct mcht_matches_piece *keyp;
+	string_t *keys_str, *key_item = NULL;
+	const char *domain;
+	size_t domain_size;
+	bool icase, suffix, indexable = TRUE;
+	unsigned int i;
+	int ret;
+
+	ctx->prepared = TRUE;
+
+	/* Only comparators with trivial character semantics are supported */
+	if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		icase = FALSE;
+	else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		icase = TRUE;
+	else
+		return 0;
+
+	/* The index is identified by its keys */
+	keys_str = str_new(mctx->pool, 256);
+	str_printfa(keys_str, "mcht-matches-domains\n%s\n",
+		    sieve_comparator_name(cmp));
+
+	p_array_init(&keys, mctx->pool, 16);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		struct mcht_matches_piece *key;
+
+		if ( !mcht_matches_domain_key_parse(str_c(key_item),
+			str_len(key_item), &domain, &domain_size, &suffix) ) {
+			indexable = FALSE;
+			break;
+		}
+		str_printfa(keys_str, "%"PRIuSIZE_T":", str_len(key_item));
+		str_append_str(keys_str, key_item);
+
+		key = array_append_space(&keys);
+		key->data = p_memdup(mctx->pool,
+			str_data(key_item), str_len(key_item));
+		key->size = str_len(key_item);
+	}
+	sieve_stringlist_reset(key_list);
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+	if ( !indexable ||
+		array_count(&keys) < MCHT_MATCHES_DOMAIN_INDEX_MIN_KEYS )
+		return 0;
+
+	ctx->domain_index = sieve_binary_runtime_object_lookup
+		(renv->sbin, str_c(keys_str));
+	if ( ctx->domain_index != NULL )
+		return 1;
+
+	index = mcht_matches_domain_index_create(icase);
+	array_foreach(&keys, keyp) {
+		i = array_foreach_idx(&keys, keyp);
+		(void)mcht_matches_domain_key_parse(keyp->data, keyp->size,
+			&domain, &domain_size, &suffix);
+		mcht_matches_domain_index_add(index, domain, domain_size,
+			suffix, i);
+	}
+
+	if ( !sieve_binary_runtime_object_add(renv->sbin, str_c(keys_str),
+		index, mcht_matches_domain_index_free) )
+		ctx->own_domain_index = index;
+	ctx->domain_index = index;
+	return 1;
+}
+
+/*
+ * Match-type implementation
+ */
+
+static void mcht_matches_match_init
+(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_context *ctx;
+
+	ctx = p_new(mctx->pool, struct mcht_matches_context, 1);
+	p_array_init(&ctx->patterns, mctx->pool, 16);
+	mctx->data = (void *)ctx;
+}
+
+static int mcht_matches_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+	string_t *key_item = NULL;
+	unsigned int i = 0;
+	int match, ret;
+
+	if ( cmp->def == NULL || cmp->def->char_match == NULL )
+		return 0;
+
+	/* Tracing reports the result for each key, so the domain index is not
+	   used then */
+	if ( !ctx->prepared && !mctx->trace ) {
+		if ( mcht_matches_prepare(mctx, key_list) < 0 )
+			return -1;
+	}
+
+	if ( ctx->domain_index != NULL ) {
+		T_BEGIN {
+			match = mcht_matches_domain_index_match
+				(mctx, ctx->domain_index, val, val_size);
+		} T_END;
+		return match;
+	}
+
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		T_BEGIN {
+			struct mcht_matches_pattern *pattern;
+
+			if ( i >= array_count(&ctx->patterns) ) {
+				pattern = array_append_space(&ctx->patterns);
+				mcht_matches_pattern_compile(mctx->pool, pattern,
+					str_c(key_item), str_len(key_item));
+			} else {
+				pattern = array_idx_modifiable(&ctx->patterns, i);
+			}
+
+			if ( array_is_created(&pattern->pieces) ) {
+				match = mcht_matches_pattern_match
+					(mctx, pattern, val, val_size);
+			} else {
+				match = mcht_matches_match_key
+					(mctx, val, val_size, str_c(key_item), str_len(key_item));
+			}
+
+			if ( mctx->trace ) {
+				sieve_runtime_trace(renv, 0,
+					"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+					match);
+			}
+		} T_END;
+		i++;
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		match = -1;
+	}
+	return match;
+}
+
+static void mcht_matches_match_deinit
+(struct sieve_match_context *mctx)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *)mctx->data;
+
+	if ( ctx->own_domain_index != NULL )
+		mcht_matches_domain_index_free(ctx->own_domain_index);
+}
@@ -14,6 +14,7 @@
 #include "sieve-code.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
+#include "sieve-match.h"
 
 #include "ext-body-common.h"
 
@@ -100,3 +101,95 @@ static void ext_body_stringlist_reset
 
 	strlist->body_parts_iter = strlist->body_parts;
 }
+
+/*
+ * Body matching
+ */
+
+/* Messages at least this large are matched while these are parsed, rather
+   than having all requested body parts decoded into memory first. This
+   keeps the memory use bounded, but the body needs to be decoded again for
+   each body test. The raw body is matched directly from the message
+   stream. */
+#define EXT_BODY_STREAM_MIN_SIZE (1024*1024)
+
+struct ext_body_match_context {
+	struct sieve_match_context *mctx;
+	struct sieve_stringlist *key_list;
+};
+
+static int ext_body_match_chunk
+(void *context, const char *data, size_t size, bool last)
+{
+	struct ext_body_match_context *ctx =
+		(struct ext_body_match_context *)context;
+
+	return sieve_match_value_chunk
+		(ctx->mctx, data, size, last, ctx->key_list);
+}
+
+static bool ext_body_match_streamed
+(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+	const struct sieve_match_type *mcht)
+{
+	struct mail *mail;
+	uoff_t size;
+
+	if ( !sieve_match_can_chunk(renv, mcht) )
+		return FALSE;
+
+	mail = sieve_message_get_mail(renv->msgctx);
+	if ( mail == NULL || mail_get_physical_size(mail, &size) < 0 )
+		return FALSE;
+	return ( size >= EXT_BODY_STREAM_MIN_SIZE );
+}
+
+int ext_body_match
+(const struct sieve_runtime_env *renv, enum tst_body_transform transform,
+	const char * const *content_types,
+	const struct sieve_match_type *mcht,
+	const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, int *match_r)
+{
+	struct ext_body_match_context ctx;
+	struct sieve_stringlist *value_list;
+	int match, status, ret;
+
+	*match_r = 0;
+
+	if ( !ext_body_match_streamed(renv, transform, mcht) ) {
+		/* Extract requested parts */
+		if ( (ret=ext_body_get_part_list
+			(renv, transform, content_types, &value_list)) <= 0 )
+			return ret;
+
+		match = sieve_match(renv, mcht, cmp, value_list, key_list, &ret);
+		if ( match < 0 )
+			return ret;
+		*match_r = match;
+		return SIEVE_EXEC_OK;
+	}
+
+	i_zero(&ctx);
+	ctx.key_list = key_list;
+	if ( (ctx.mctx=sieve_match_begin(renv, mcht, cmp)) == NULL )
+		return SIEVE_EXEC_OK;
+
+	/* Match the parts while these are extracted */
+	if ( transform == TST_BODY_TRANSFORM_RAW ) {
+		status = sieve_message_body_stream_raw
+			(renv, ext_body_match_chunk, &ctx);
+	} else {
+		status = sieve_message_body_stream(renv, content_types,
+			( transform == TST_BODY_TRANSFORM_TEXT ),
+			ext_body_match_chunk, &ctx);
+	}
+
+	match = sieve_match_end(&ctx.mctx, &ret);
+	if ( match < 0 )
+		return ret;
+	if ( status <= 0 )
+		return status;
+	*match_r = match;
+	return SIEVE_EXEC_OK;
+}
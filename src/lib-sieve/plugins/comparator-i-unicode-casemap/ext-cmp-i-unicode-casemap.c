@@ -0,0 +1,313 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+/* Extension comparator-i;unicode-casemap
+ * --------------------------------------
+ *
+ * Author: Stephan Bosch
+ * Specification: RFC 5051
+ * Implementation: full
+ * Status: testing
+ *
+ */
+
+#include "lib.h"
+#include "buffer.h"
+#include "hash.h"
+#include "unichar.h"
+
+#include "sieve-common.h"
+
+#include "sieve-code.h"
+#include "sieve-extensions.h"
+#include "sieve-comparators.h"
+#include "sieve-validator.h"
+#include "sieve-generator.h"
+#include "sieve-interpreter.h"
+
+/*
+ * Configuration
+ */
+
+/* Maximum number of folded strings remembered by a Sieve instance; the cache
+   is emptied when it is full */
+#define EXT_CMP_UNICODE_CASEMAP_CACHE_MAX_ENTRIES 1024
+/* Longer strings are folded each time */
+#define EXT_CMP_UNICODE_CASEMAP_CACHE_MAX_SIZE 4096
+
+/*
+ * Forward declarations
+ */
+
+static const struct sieve_operand_def my_comparator_operand;
+
+const struct sieve_comparator_def i_unicode_casemap_comparator;
+
+/*
+ * Extension
+ */
+
+static bool ext_cmp_i_unicode_casemap_load
+	(const struct sieve_extension *ext, void **context);
+static void ext_cmp_i_unicode_casemap_unload
+	(const struct sieve_extension *ext);
+static bool ext_cmp_i_unicode_casemap_validator_load
+	(const struct sieve_extension *ext, struct sieve_validator *validator);
+
+const struct sieve_extension_def comparator_i_unicode_casemap_extension = {
+	.name = "comparator-i;unicode-casemap",
+	.load = ext_cmp_i_unicode_casemap_load,
+	.unload = ext_cmp_i_unicode_casemap_unload,
+	.validator_load = ext_cmp_i_unicode_casemap_validator_load,
+	SIEVE_EXT_DEFINE_OPERAND(my_comparator_operand)
+};
+
+static bool ext_cmp_i_unicode_casemap_validator_load
+(const struct sieve_extension *ext, struct sieve_validator *validator)
+{
+	sieve_comparator_register(validator, ext, &i_unicode_casemap_comparator);
+	return TRUE;
+}
+
+/*
+ * Fold cache
+ */
+
+/* Folding a string to its decomposed titlecase form is much more expensive
+   than comparing it. Both the (constant) keys of a script and the header
+   values of a message are usually compared many times: keys for each
+   message and values once for each test that inspects them. Therefore, the
+   folded forms are remembered for the Sieve instance. */
+
+struct ext_cmp_i_unicode_casemap_context {
+	pool_t pool;
+	HASH_TABLE(const char *, const char *) folded;
+	unsigned int count;
+};
+
+static bool ext_cmp_i_unicode_casemap_load
+(const struct sieve_extension *ext ATTR_UNUSED, void **context)
+{
+	struct ext_cmp_i_unicode_casemap_context *extctx;
+	pool_t pool;
+
+	if ( *context != NULL )
+		return TRUE;
+
+	pool = pool_alloconly_create("comparator-i;unicode-casemap", 8192);
+	extctx = p_new(pool, struct ext_cmp_i_unicode_casemap_context, 1);
+	extctx->pool = pool;
+	hash_table_create(&extctx->folded, default_pool, 0, str_hash, strcmp);
+
+	*context = extctx;
+	return TRUE;
+}
+
+static void ext_cmp_i_unicode_casemap_unload
+(const struct sieve_extension *ext)
+{
+	struct ext_cmp_i_unicode_casemap_context *extctx =
+		(struct ext_cmp_i_unicode_casemap_context *)ext->context;
+
+	if ( extctx == NULL )
+		return;
+
+	hash_table_destroy(&extctx->folded);
+	pool_unref(&extctx->pool);
+}
+
+static struct ext_cmp_i_unicode_casemap_context *
+ext_cmp_i_unicode_casemap_get_context(const struct sieve_comparator *cmp)
+{
+	const struct sieve_extension *ext = cmp->object.ext;
+
+	if ( ext == NULL )
+		return NULL;
+	return (struct ext_cmp_i_unicode_casemap_context *)ext->context;
+}
+
+/* Makes room for the strings folded by the next comparison; the strings
+   returned earlier remain valid until then */
+static void ext_cmp_i_unicode_casemap_cache_maintain
+(struct ext_cmp_i_unicode_casemap_context *extctx)
+{
+	if ( extctx == NULL ||
+		extctx->count + 2 <= EXT_CMP_UNICODE_CASEMAP_CACHE_MAX_ENTRIES )
+		return;
+
+	hash_table_clear(extctx->folded, FALSE);
+	p_clear(extctx->pool);
+	extctx->count = 0;
+}
+
+static const char *ext_cmp_i_unicode_casemap_fold
+(struct ext_cmp_i_unicode_casemap_context *extctx,
+	const char *str, size_t size, size_t *size_r)
+{
+	const char *key = NULL, *folded;
+	buffer_t *buf;
+	bool cache;
+
+	cache = ( extctx != NULL &&
+		size <= EXT_CMP_UNICODE_CASEMAP_CACHE_MAX_SIZE &&
+		memchr(str, '\0', size) == NULL );
+
+	if ( cache ) {
+		key = t_strndup(str, size);
+		folded = hash_table_lookup(extctx->folded, key);
+		if ( folded != NULL ) {
+			*size_r = strlen(folded);
+			return folded;
+		}
+	}
+
+	buf = t_buffer_create(size + 16);
+	(void)uni_utf8_to_decomposed_titlecase(str, size, buf);
+	folded = buffer_get_data(buf, size_r);
+
+	if ( cache && memchr(folded, '\0', *size_r) == NULL ) {
+		folded = p_strndup(extctx->pool, folded, *size_r);
+		hash_table_insert(extctx->folded,
+			p_strdup(extctx->pool, key), folded);
+		extctx->count++;
+	}
+	return folded;
+}
+
+/*
+ * Operand
+ */
+
+static const struct sieve_extension_objects ext_comparators =
+	SIEVE_EXT_DEFINE_COMPARATOR(i_unicode_casemap_comparator);
+
+static const struct sieve_operand_def my_comparator_operand = {
+	.name = "comparator-i;unicode-casemap",
+	.ext_def = &comparator_i_unicode_casemap_extension,
+	.class = &sieve_comparator_operand_class,
+	.interface = &ext_comparators
+};
+
+/*
+ * Comparator
+ */
+
+/* Forward declarations */
+
+static int cmp_i_unicode_casemap_compare
+	(const struct sieve_comparator *cmp,
+		const char *val1, size_t val1_size, const char *val2, size_t val2_size);
+static bool cmp_i_unicode_casemap_char_match
+	(const struct sieve_comparator *cmp, const char **val, const char *val_end,
+		const char **key, const char *key_end);
+static bool cmp_i_unicode_casemap_char_skip
+	(const struct sieve_comparator *cmp, const char **val, const char *val_end);
+
+/* Comparator object */
+
+const struct sieve_comparator_def i_unicode_casemap_comparator = {
+	SIEVE_OBJECT("i;unicode-casemap",
+		&my_comparator_operand, 0),
+	.flags =
+		SIEVE_COMPARATOR_FLAG_ORDERING |
+		SIEVE_COMPARATOR_FLAG_EQUALITY |
+		SIEVE_COMPARATOR_FLAG_SUBSTRING_MATCH |
+		SIEVE_COMPARATOR_FLAG_PREFIX_MATCH,
+	.compare = cmp_i_unicode_casemap_compare,
+	.char_match = cmp_i_unicode_casemap_char_match,
+	.char_skip = cmp_i_unicode_casemap_char_skip
+};
+
+/* Comparator implementation */
+
+static int cmp_i_unicode_casemap_compare
+	(const struct sieve_comparator *cmp,
+		const char *val1, size_t val1_size, const char *val2, size_t val2_size)
+{
+	struct ext_cmp_i_unicode_casemap_context *extctx =
+		ext_cmp_i_unicode_casemap_get_context(cmp);
+	const char *fold1, *fold2;
+	size_t fold1_size, fold2_size;
+	int ret;
+
+	ext_cmp_i_unicode_casemap_cache_maintain(extctx);
+
+	T_BEGIN {
+		fold1 = ext_cmp_i_unicode_casemap_fold
+			(extctx, val1, val1_size, &fold1_size);
+		fold2 = ext_cmp_i_unicode_casemap_fold
+			(extctx, val2, val2_size, &fold2_size);
+
+		ret = memcmp(fold1, fold2, I_MIN(fold1_size, fold2_size));
+		if ( ret == 0 )
+			ret = (int)fold1_size - (int)fold2_size;
+	} T_END;
+	return ret;
+}
+
+static bool cmp_i_unicode_casemap_char_match
+	(const struct sieve_comparator *cmp,
+		const char **val, const char *val_end,
+		const char **key, const char *key_end)
+{
+	struct ext_cmp_i_unicode_casemap_context *extctx =
+		ext_cmp_i_unicode_casemap_get_context(cmp);
+	const char *vp = *val;
+	bool match;
+
+	/* Never start a match halfway into a character */
+	if ( vp < val_end && ((unsigned char)*vp & 0xc0) == 0x80 )
+		return FALSE;
+
+	ext_cmp_i_unicode_casemap_cache_maintain(extctx);
+
+	T_BEGIN {
+		const char *fkey;
+		size_t fkey_size, fpos = 0;
+		buffer_t *fchar = t_buffer_create(16);
+
+		fkey = ext_cmp_i_unicode_casemap_fold
+			(extctx, *key, key_end - *key, &fkey_size);
+
+		/* Fold the value one character at a time, until the folded key
+		   is consumed */
+		while ( fpos < fkey_size && vp < val_end ) {
+			unsigned int n = uni_utf8_char_bytes((unsigned char)*vp);
+
+			if ( n > (size_t)(val_end - vp) )
+				n = val_end - vp;
+
+			buffer_set_used_size(fchar, 0);
+			(void)uni_utf8_to_decomposed_titlecase(vp, n, fchar);
+			if ( fchar->used > fkey_size - fpos ||
+				memcmp(fchar->data, fkey + fpos, fchar->used) != 0 )
+				break;
+
+			fpos += fchar->used;
+			vp += n;
+		}
+		match = ( fpos == fkey_size );
+	} T_END;
+
+	if ( !match )
+		return FALSE;
+
+	*val = vp;
+	*key = key_end;
+	return TRUE;
+}
+
+static bool cmp_i_unicode_casemap_char_skip
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char **val, const char *val_end)
+{
+	unsigned int n;
+
+	if ( *val >= val_end )
+		return FALSE;
+
+	/* Skip a whole character */
+	n = uni_utf8_char_bytes((unsigned char)**val);
+	*val += I_MIN(n, (size_t)(val_end - *val));
+	return TRUE;
+}
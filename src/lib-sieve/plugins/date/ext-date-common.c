@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "utc-offset.h"
 #include "str.h"
 #include "iso8601-date.h"
@@ -18,9 +19,22 @@
 #include <time.h>
 #include <ctype.h>
 
+/* A date header value parsed for the current message */
+struct ext_date_parsed {
+	const char *date_string;
+	time_t date_value;
+	int original_zone;
+	bool valid;
+};
+
 struct ext_date_context {
 	time_t current_date;
 	int zone_offset;
+
+	/* Scripts commonly test several parts of the same header, so keep the
+	   parsed header values for the message. There are few distinct ones, so
+	   these are searched linearly. */
+	ARRAY(struct ext_date_parsed) parsed_dates;
 };
 
 /*
@@ -51,6 +65,7 @@ static int ext_date_runtime_init
 	dctx = p_new(pool, struct ext_date_context, 1);
 	dctx->current_date = current_date;
 	dctx->zone_offset = zone_offset;
+	p_array_init(&dctx->parsed_dates, pool, 2);
 
 	sieve_message_context_extension_set
 		(renv->msgctx, ext, (void *) dctx);
@@ -110,8 +125,8 @@ bool ext_date_parse_timezone
  * Current date
  */
 
-time_t ext_date_get_current_date
-(const struct sieve_runtime_env *renv, int *zone_offset_r)
+static struct ext_date_context *
+ext_date_get_context(const struct sieve_runtime_env *renv)
 {
 	const struct sieve_extension *this_ext = renv->oprtn->ext;
 	struct ext_date_context *dctx = (struct ext_date_context *)
@@ -124,6 +139,13 @@ time_t ext_date_get_current_date
 
 		i_assert(dctx != NULL);
 	}
+	return dctx;
+}
+
+time_t ext_date_get_current_date
+(const struct sieve_runtime_env *renv, int *zone_offset_r)
+{
+	struct ext_date_context *dctx = ext_date_get_context(renv);
 
 	/* Read script start timestamp from message context */
 
@@ -133,6 +155,38 @@ time_t ext_date_get_current_date
 	return dctx->current_date;
 }
 
+/*
+ * Date header parsing
+ */
+
+static bool ext_date_parse_header_date
+(const struct sieve_runtime_env *renv, const char *date_string,
+	time_t *date_value_r, int *original_zone_r)
+{
+	struct ext_date_context *dctx = ext_date_get_context(renv);
+	struct ext_date_parsed *parsed;
+	pool_t pool;
+
+	array_foreach_modifiable(&dctx->parsed_dates, parsed) {
+		if ( strcmp(parsed->date_string, date_string) == 0 ) {
+			*date_value_r = parsed->date_value;
+			*original_zone_r = parsed->original_zone;
+			return parsed->valid;
+		}
+	}
+
+	pool = sieve_message_context_pool(renv->msgctx);
+	parsed = array_append_space(&dctx->parsed_dates);
+	parsed->date_string = p_strdup(pool, date_string);
+	parsed->valid = message_date_parse
+		((const unsigned char *) date_string, strlen(date_string),
+			&parsed->date_value, &parsed->original_zone);
+
+	*date_value_r = parsed->date_value;
+	*original_zone_r = parsed->original_zone;
+	return parsed->valid;
+}
+
 /*
  * Date parts
  */
@@ -533,8 +587,8 @@ static int ext_date_stringlist_next_item
 		}
 
 		/* Parse the date value */
-		if ( message_date_parse((const unsigned char *) date_string,
-			strlen(date_string), &date_value, &original_zone) ) {
+		if ( ext_date_parse_header_date(_strlist->runenv, date_string,
+			&date_value, &original_zone) ) {
 			got_date = TRUE;
 		}
 	} else {
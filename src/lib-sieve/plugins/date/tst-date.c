@@ -305,9 +305,10 @@ static bool tst_date_validate
 static bool tst_date_generate
 (const struct sieve_codegen_env *cgenv, struct sieve_command *tst)
 {
-	if ( sieve_command_is(tst, date_test) )
+	if ( sieve_command_is(tst, date_test) ) {
 		sieve_operation_emit(cgenv->sblock, tst->ext, &date_operation);
-	else if ( sieve_command_is(tst, currentdate_test) )
+		sieve_generate_message_headers(cgenv, tst->first_positional);
+	} else if ( sieve_command_is(tst, currentdate_test) )
 		sieve_operation_emit(cgenv->sblock, tst->ext, &currentdate_operation);
 	else
 		i_unreached();
@@ -132,21 +132,28 @@ act_duplicate_mark_finish(const struct sieve_action_exec_env *aenv,
  * Duplicate checking
  */
 
-struct ext_duplicate_handle {
-	const char *handle;
-	bool last:1;
-	bool duplicate:1;
-};
-
-struct ext_duplicate_hash {
+/* The results of the duplicate tests performed for the message, sorted by
+   their hash. The handle and the :last flag are part of the hash. The array
+   lives in the message context pool, which is freed without notifying the
+   extension, so it needs no cleanup (unlike a hash table). */
+struct ext_duplicate_record {
 	unsigned char hash[MD5_RESULTLEN];
-	ARRAY(struct ext_duplicate_handle) handles;
+	bool duplicate;
 };
 
 struct ext_duplicate_context {
-	ARRAY(struct ext_duplicate_hash) hashes;
+	ARRAY(struct ext_duplicate_record) records;
 };
 
+static int
+ext_duplicate_record_cmp(const unsigned char *hash,
+			 const struct ext_duplicate_record *record)
+{
+	return memcmp(hash, record->hash, MD5_RESULTLEN);
+}
+
+/* The hash is the ID stored in the duplicate database, so its format must
+   remain stable: changing it would forget all tracked IDs at once. */
 static void
 ext_duplicate_hash(string_t *handle, const char *value, size_t value_len,
 		   bool last, unsigned char hash_r[])
@@ -178,11 +185,12 @@ int ext_duplicate_check(const struct sieve_runtime_env *renv, string_t *handle,
 	const struct sieve_extension *this_ext = renv->oprtn->ext;
 	struct ext_duplicate_context *rctx;
 	bool duplicate = FALSE;
-	pool_t msg_pool = NULL, result_pool = NULL;
+	pool_t msg_pool, result_pool;
 	unsigned char hash[MD5_RESULTLEN];
-	struct ext_duplicate_hash *hash_record = NULL;
-	struct ext_duplicate_handle *handle_record = NULL;
+	const struct ext_duplicate_record *record;
+	struct ext_duplicate_record new_record;
 	struct act_duplicate_mark_data *act;
+	unsigned int idx;
 	int ret;
 
 	*duplicate_r = FALSE;
@@ -208,29 +216,15 @@ int ext_duplicate_check(const struct sieve_runtime_env *renv, string_t *handle,
 		/* Create context */
 		msg_pool = sieve_message_context_pool(renv->msgctx);
 		rctx = p_new(msg_pool, struct ext_duplicate_context, 1);
+		p_array_init(&rctx->records, msg_pool, 16);
 		sieve_message_context_extension_set(renv->msgctx, this_ext,
 						    (void *)rctx);
-	} else if (array_is_created(&rctx->hashes)) {
-		struct ext_duplicate_hash *record;
-
-		array_foreach_modifiable(&rctx->hashes, record) {
-			if (memcmp(record->hash, hash, MD5_RESULTLEN) == 0) {
-				hash_record = record;
-				break;
-			}
-		}
 	}
-	if (hash_record != NULL) {
-		const struct ext_duplicate_handle *rhandle;
-		array_foreach(&hash_record->handles, rhandle) {
-			const char *handle_str =
-				(handle == NULL ? NULL : str_c(handle));
-			if (null_strcmp(rhandle->handle, handle_str) == 0 &&
-			    rhandle->last == last)
-				return (rhandle->duplicate ?
-				        SIEVE_DUPLICATE_CHECK_RESULT_EXISTS :
-					SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND);
-		}
+	if (array_bsearch_insert_pos(&rctx->records, hash,
+				     ext_duplicate_record_cmp, &idx)) {
+		record = array_idx(&rctx->records, idx);
+		*duplicate_r = record->duplicate;
+		return SIEVE_EXEC_OK;
 	}
 
 	result_pool = sieve_result_pool(renv->result);
@@ -275,21 +269,10 @@ int ext_duplicate_check(const struct sieve_runtime_env *renv, string_t *handle,
 	}
 
 	/* Cache result */
-	if (msg_pool == NULL)
-		msg_pool = sieve_message_context_pool(renv->msgctx);
-	if (hash_record == NULL) {
-		if (!array_is_created(&rctx->hashes))
-			p_array_init(&rctx->hashes, msg_pool, 64);
-		hash_record = array_append_space(&rctx->hashes);
-		memcpy(hash_record->hash, hash, MD5_RESULTLEN);
-		p_array_init(&hash_record->handles, msg_pool, 64);
-	}
-
-	handle_record = array_append_space(&hash_record->handles);
-	if (handle != NULL)
-		handle_record->handle = p_strdup(msg_pool, str_c(handle));
-	handle_record->last = last;
-	handle_record->duplicate = duplicate;
+	i_zero(&new_record);
+	memcpy(new_record.hash, hash, MD5_RESULTLEN);
+	new_record.duplicate = duplicate;
+	array_insert(&rctx->records, idx, &new_record, 1);
 
 	*duplicate_r = duplicate;
 
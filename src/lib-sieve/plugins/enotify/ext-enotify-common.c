@@ -55,6 +55,8 @@ const struct sieve_extension_capabilities notify_capabilities = {
  */
 
 extern const struct sieve_enotify_method_def mailto_notify;
+extern const struct sieve_enotify_method_def http_notify;
+extern const struct sieve_enotify_method_def https_notify;
 
 /*
  * Notify method registry
@@ -73,8 +75,12 @@ ext_enotify_method_register(struct sieve_instance *svinst,
 	nmth->id = nmth_id;
 	nmth->svinst = svinst;
 
-	if (nmth_def->load != NULL)
-		nmth_def->load(nmth, &nmth->context);
+	if (nmth_def->load != NULL &&
+	    !nmth_def->load(nmth, &nmth->context)) {
+		/* Method is not available in this configuration */
+		nmth->def = NULL;
+		return NULL;
+	}
 
 	return nmth;
 }
@@ -85,6 +91,8 @@ void ext_enotify_methods_init(struct sieve_instance *svinst,
 	p_array_init(&ectx->notify_methods, default_pool, 4);
 
 	ext_enotify_method_register(svinst, ectx, &mailto_notify);
+	ext_enotify_method_register(svinst, ectx, &http_notify);
+	ext_enotify_method_register(svinst, ectx, &https_notify);
 }
 
 void ext_enotify_methods_deinit(struct ext_enotify_context *ectx)
@@ -171,10 +179,11 @@ ext_notify_get_methods_string(const struct sieve_extension *ntfy_ext)
 	methods = array_get(&ectx->notify_methods, &meth_count);
 	if (meth_count > 0) {
 		for (i = 0; i < meth_count; i++) {
+			if (methods[i].def == NULL)
+				continue;
 			if (str_len(result) > 0)
 				str_append_c(result, ' ');
-			if (methods[i].def != NULL)
-				str_append(result, methods[i].def->identifier);
+			str_append(result, methods[i].def->identifier);
 		}
 		return str_c(result);
 	}
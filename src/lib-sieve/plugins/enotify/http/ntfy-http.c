@@ -0,0 +1,543 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+/* Notify methods http/https
+ * -------------------------
+ *
+ * Authors: Stephan Bosch
+ * Specification: vendor-defined; webhook delivery of notifications
+ * Implementation: full
+ * Status: experimental
+ *
+ */
+
+/* Notifications are POSTed to the URI as a JSON array of notification
+   objects. Delivery is asynchronous: action execution only queues the
+   notification. Queued notifications for the same URI are combined into a
+   single request, which is submitted once the batch is full or the ioloop
+   gets to run. Pending requests are finished when the method is unloaded.
+
+   Because scripts control the URI, these methods are only available when
+   sieve_notify_http_allowed_hosts is configured.
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "str-sanitize.h"
+#include "ioloop.h"
+#include "json-parser.h"
+#include "iostream-ssl.h"
+#include "http-url.h"
+#include "http-response.h"
+#include "http-client.h"
+#include "mail-storage.h"
+
+#include "sieve-common.h"
+#include "sieve-message.h"
+#include "sieve-settings.h"
+
+#include "sieve-ext-enotify.h"
+
+/*
+ * Configuration
+ */
+
+#define NTFY_HTTP_DEFAULT_MAX_QUEUE    100
+#define NTFY_HTTP_DEFAULT_BATCH_SIZE   16
+#define NTFY_HTTP_DEFAULT_TIMEOUT      10
+
+#define NTFY_HTTP_MAX_MESSAGE_LEN      1024
+
+/*
+ * HTTP notification configuration
+ */
+
+struct ntfy_http_config {
+	pool_t pool;
+	struct event *event;
+
+	const char *const *allowed_hosts;
+	unsigned int max_queue;
+	unsigned int batch_size;
+	unsigned int timeout_msecs;
+	struct ssl_iostream_settings ssl_set;
+
+	struct http_client *client;
+
+	/* Notifications not yet submitted, per URI */
+	HASH_TABLE(const char *, struct ntfy_http_batch *) batches;
+	struct timeout *to_flush;
+
+	/* Notifications queued or in flight */
+	unsigned int pending;
+};
+
+struct ntfy_http_batch {
+	struct ntfy_http_config *config;
+
+	char *url;
+	string_t *payload;
+	unsigned int count;
+};
+
+struct ntfy_http_request {
+	struct ntfy_http_config *config;
+
+	char *url;
+	unsigned int count;
+};
+
+/*
+ * HTTP notification methods
+ */
+
+static bool
+ntfy_http_load(const struct sieve_enotify_method *nmth, void **context);
+static void
+ntfy_http_unload(const struct sieve_enotify_method *nmth);
+
+static bool
+ntfy_http_compile_check_uri(const struct sieve_enotify_env *nenv,
+			    const char *uri, const char *uri_body);
+
+static const char *
+ntfy_http_runtime_get_notify_capability(const struct sieve_enotify_env *nenv,
+					const char *uri, const char *uri_body,
+					const char *capability);
+static bool
+ntfy_http_runtime_check_uri(const struct sieve_enotify_env *nenv,
+			    const char *uri, const char *uri_body);
+static bool
+ntfy_http_runtime_check_operands(const struct sieve_enotify_env *nenv,
+				 const char *uri, const char *uri_body,
+				 string_t *message, string_t *from,
+				 pool_t context_pool, void **method_context);
+
+static void
+ntfy_http_action_print(const struct sieve_enotify_print_env *penv,
+		       const struct sieve_enotify_action *nact);
+
+static int
+ntfy_http_action_execute(const struct sieve_enotify_exec_env *nenv,
+			 const struct sieve_enotify_action *nact);
+
+const struct sieve_enotify_method_def http_notify = {
+	"http",
+	ntfy_http_load,
+	ntfy_http_unload,
+	ntfy_http_compile_check_uri,
+	NULL,
+	NULL,
+	NULL,
+	ntfy_http_runtime_check_uri,
+	ntfy_http_runtime_get_notify_capability,
+	ntfy_http_runtime_check_operands,
+	NULL,
+	NULL,
+	ntfy_http_action_print,
+	ntfy_http_action_execute,
+};
+
+const struct sieve_enotify_method_def https_notify = {
+	"https",
+	ntfy_http_load,
+	ntfy_http_unload,
+	ntfy_http_compile_check_uri,
+	NULL,
+	NULL,
+	NULL,
+	ntfy_http_runtime_check_uri,
+	ntfy_http_runtime_get_notify_capability,
+	ntfy_http_runtime_check_operands,
+	NULL,
+	NULL,
+	ntfy_http_action_print,
+	ntfy_http_action_execute,
+};
+
+/*
+ * Method context data
+ */
+
+struct ntfy_http_context {
+	const char *url;
+};
+
+/*
+ * Method registration
+ */
+
+static bool
+ntfy_http_load(const struct sieve_enotify_method *nmth, void **context)
+{
+	struct sieve_instance *svinst = nmth->svinst;
+	struct ntfy_http_config *config;
+	const char *setval;
+	unsigned long long int uint_setting;
+	sieve_number_t duration;
+	pool_t pool;
+
+	if (*context != NULL)
+		ntfy_http_unload(nmth);
+
+	setval = sieve_setting_get(svinst, "sieve_notify_http_allowed_hosts");
+	if (setval == NULL || *setval == '\0')
+		return FALSE;
+
+	pool = pool_alloconly_create("ntfy_http_config", 512);
+	config = p_new(pool, struct ntfy_http_config, 1);
+	config->pool = pool;
+	config->event = event_create(svinst->event);
+	event_set_append_log_prefix(
+		config->event,
+		t_strdup_printf("%s notification: ", nmth->def->identifier));
+
+	config->allowed_hosts =
+		p_strarray_dup(pool, t_strsplit_spaces(setval, " ,"));
+
+	config->max_queue = NTFY_HTTP_DEFAULT_MAX_QUEUE;
+	if (sieve_setting_get_uint_value(
+		svinst, "sieve_notify_http_max_queue", &uint_setting))
+		config->max_queue = (unsigned int)uint_setting;
+	config->batch_size = NTFY_HTTP_DEFAULT_BATCH_SIZE;
+	if (sieve_setting_get_uint_value(
+		svinst, "sieve_notify_http_batch_size", &uint_setting) &&
+	    uint_setting > 0)
+		config->batch_size = (unsigned int)uint_setting;
+	config->timeout_msecs = NTFY_HTTP_DEFAULT_TIMEOUT * 1000;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_notify_http_timeout", &duration) &&
+	    duration > 0)
+		config->timeout_msecs = (unsigned int)duration * 1000;
+
+	config->ssl_set.ca_dir = p_strdup_empty(pool, sieve_setting_get(
+		svinst, "sieve_notify_http_ssl_ca_dir"));
+	config->ssl_set.ca_file = p_strdup_empty(pool, sieve_setting_get(
+		svinst, "sieve_notify_http_ssl_ca_file"));
+
+	hash_table_create(&config->batches, pool, 0, str_hash, strcmp);
+
+	*context = (void *)config;
+	return TRUE;
+}
+
+static void ntfy_http_batch_submit(struct ntfy_http_batch *batch);
+
+static void ntfy_http_flush(struct ntfy_http_config *config)
+{
+	struct hash_iterate_context *iter;
+	const char *url;
+	struct ntfy_http_batch *batch;
+
+	timeout_remove(&config->to_flush);
+
+	iter = hash_table_iterate_init(config->batches);
+	while (hash_table_iterate(iter, config->batches, &url, &batch)) {
+		if (batch->count > 0)
+			ntfy_http_batch_submit(batch);
+	}
+	hash_table_iterate_deinit(&iter);
+}
+
+static void ntfy_http_unload(const struct sieve_enotify_method *nmth)
+{
+	struct ntfy_http_config *config =
+		(struct ntfy_http_config *)nmth->context;
+	struct hash_iterate_context *iter;
+	const char *url;
+	struct ntfy_http_batch *batch;
+
+	if (config == NULL)
+		return;
+
+	/* Finish whatever is still queued; bounded by the request timeout */
+	ntfy_http_flush(config);
+	if (config->client != NULL) {
+		if (config->pending > 0)
+			http_client_wait(config->client);
+		http_client_deinit(&config->client);
+	}
+
+	iter = hash_table_iterate_init(config->batches);
+	while (hash_table_iterate(iter, config->batches, &url, &batch)) {
+		str_free(&batch->payload);
+		i_free(batch->url);
+		i_free(batch);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&config->batches);
+
+	event_unref(&config->event);
+	pool_unref(&config->pool);
+}
+
+/*
+ * URI validation
+ */
+
+static bool
+ntfy_http_uri_parse(const struct sieve_enotify_env *nenv, const char *uri,
+		    struct http_url **url_r)
+{
+	const char *error;
+
+	if (http_url_parse(uri, NULL, 0, pool_datastack_create(),
+			   url_r, &error) < 0) {
+		if (nenv != NULL) {
+			sieve_enotify_error(
+				nenv, "invalid %s URI '%s': %s",
+				nenv->method->def->identifier,
+				str_sanitize(uri, 128), error);
+		}
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+ntfy_http_host_allowed(const struct sieve_enotify_env *nenv,
+		       const struct http_url *url)
+{
+	struct ntfy_http_config *config =
+		(struct ntfy_http_config *)nenv->method->context;
+
+	if (str_array_icase_find(config->allowed_hosts, url->host.name))
+		return TRUE;
+
+	sieve_enotify_error(nenv, "notifications to host '%s' are not allowed",
+			    str_sanitize(url->host.name, 128));
+	return FALSE;
+}
+
+static bool
+ntfy_http_compile_check_uri(const struct sieve_enotify_env *nenv,
+			    const char *uri, const char *uri_body ATTR_UNUSED)
+{
+	struct http_url *url;
+
+	return ntfy_http_uri_parse(nenv, uri, &url);
+}
+
+/*
+ * Runtime
+ */
+
+static const char *
+ntfy_http_runtime_get_notify_capability(
+	const struct sieve_enotify_env *nenv ATTR_UNUSED,
+	const char *uri, const char *uri_body ATTR_UNUSED,
+	const char *capability)
+{
+	struct http_url *url;
+
+	if (!ntfy_http_uri_parse(NULL, uri, &url))
+		return NULL;
+
+	if (strcasecmp(capability, "online") == 0)
+		return "maybe";
+
+	return NULL;
+}
+
+static bool
+ntfy_http_runtime_check_uri(const struct sieve_enotify_env *nenv ATTR_UNUSED,
+			    const char *uri, const char *uri_body ATTR_UNUSED)
+{
+	struct http_url *url;
+
+	return ntfy_http_uri_parse(NULL, uri, &url);
+}
+
+static bool
+ntfy_http_runtime_check_operands(const struct sieve_enotify_env *nenv,
+				 const char *uri,
+				 const char *uri_body ATTR_UNUSED,
+				 string_t *message ATTR_UNUSED,
+				 string_t *from ATTR_UNUSED,
+				 pool_t context_pool, void **method_context)
+{
+	struct ntfy_http_context *htctx;
+	struct http_url *url;
+
+	if (!ntfy_http_uri_parse(nenv, uri, &url))
+		return FALSE;
+	if (!ntfy_http_host_allowed(nenv, url))
+		return FALSE;
+
+	htctx = p_new(context_pool, struct ntfy_http_context, 1);
+	htctx->url = p_strdup(context_pool, uri);
+
+	*method_context = (void *)htctx;
+	return TRUE;
+}
+
+/*
+ * Action printing
+ */
+
+static void
+ntfy_http_action_print(const struct sieve_enotify_print_env *penv,
+		       const struct sieve_enotify_action *nact)
+{
+	struct ntfy_http_context *htctx =
+		(struct ntfy_http_context *)nact->method_context;
+
+	sieve_enotify_method_printf(penv, "    => importance   : %llu\n",
+				    (unsigned long long)nact->importance);
+	if (nact->message != NULL) {
+		sieve_enotify_method_printf(
+			penv, "    => message      : %s\n", nact->message);
+	}
+	if (nact->from != NULL) {
+		sieve_enotify_method_printf(
+			penv, "    => from         : %s\n", nact->from);
+	}
+	sieve_enotify_method_printf(penv, "    => url          : %s\n",
+				    htctx->url);
+	sieve_enotify_method_printf(penv, "\n");
+}
+
+/*
+ * Action execution
+ */
+
+static void
+ntfy_http_response(const struct http_response *response,
+		   struct ntfy_http_request *hreq)
+{
+	struct ntfy_http_config *config = hreq->config;
+
+	i_assert(config->pending >= hreq->count);
+	config->pending -= hreq->count;
+
+	if (response->status / 100 != 2) {
+		e_error(config->event,
+			"failed to deliver %u notification(s) to %s: %u %s",
+			hreq->count, hreq->url, response->status,
+			str_sanitize(response->reason, 256));
+	} else {
+		e_debug(config->event, "delivered %u notification(s) to %s",
+			hreq->count, hreq->url);
+	}
+
+	i_free(hreq->url);
+	i_free(hreq);
+}
+
+static void ntfy_http_batch_submit(struct ntfy_http_batch *batch)
+{
+	struct ntfy_http_config *config = batch->config;
+	struct ntfy_http_request *hreq;
+	struct http_client_request *req;
+
+	if (config->client == NULL) {
+		struct http_client_settings http_set;
+
+		i_zero(&http_set);
+		http_set.user_agent = "Pigeonhole Sieve notify";
+		http_set.max_idle_time_msecs = 5*1000;
+		http_set.max_parallel_connections = 1;
+		http_set.max_pipelined_requests = 1;
+		http_set.max_attempts = 2;
+		http_set.request_timeout_msecs = config->timeout_msecs;
+		http_set.connect_timeout_msecs = config->timeout_msecs;
+		http_set.ssl = &config->ssl_set;
+		http_set.event_parent = config->event;
+		config->client = http_client_init(&http_set);
+	}
+
+	hreq = i_new(struct ntfy_http_request, 1);
+	hreq->config = config;
+	hreq->url = i_strdup(batch->url);
+	hreq->count = batch->count;
+
+	str_append_c(batch->payload, ']');
+
+	req = http_client_request_url_str(config->client, "POST", batch->url,
+					  ntfy_http_response, hreq);
+	http_client_request_add_header(req, "Content-Type",
+				       "application/json");
+	http_client_request_set_payload_data(req, str_data(batch->payload),
+					     str_len(batch->payload));
+	http_client_request_submit(req);
+
+	str_truncate(batch->payload, 0);
+	batch->count = 0;
+}
+
+static void
+ntfy_http_json_append_field(string_t *json, const char *name,
+			    const char *value)
+{
+	if (value == NULL)
+		return;
+	str_printfa(json, ",\"%s\":\"", name);
+	json_append_escaped(json, value);
+	str_append_c(json, '"');
+}
+
+static int
+ntfy_http_action_execute(const struct sieve_enotify_exec_env *nenv,
+			 const struct sieve_enotify_action *nact)
+{
+	struct ntfy_http_config *config =
+		(struct ntfy_http_config *)nenv->method->context;
+	struct ntfy_http_context *htctx =
+		(struct ntfy_http_context *)nact->method_context;
+	struct mail *mail = nenv->msgdata->mail;
+	struct ntfy_http_batch *batch;
+	const char *subject = NULL, *from = NULL, *message = NULL;
+	const struct smtp_address *sender = NULL;
+
+	if (config->pending >= config->max_queue) {
+		sieve_enotify_global_warning(
+			nenv, "notification queue is full; "
+			"not sending notification to %s", htctx->url);
+		return 0;
+	}
+
+	if (mail_get_first_header_utf8(mail, "subject", &subject) <= 0)
+		subject = NULL;
+	if (mail_get_first_header_utf8(mail, "from", &from) <= 0)
+		from = NULL;
+	if ((nenv->flags & SIEVE_EXECUTE_FLAG_NO_ENVELOPE) == 0)
+		sender = sieve_message_get_sender(nenv->msgctx);
+	if (nact->message != NULL) {
+		message = str_sanitize_utf8(nact->message,
+					    NTFY_HTTP_MAX_MESSAGE_LEN);
+	}
+
+	batch = hash_table_lookup(config->batches, htctx->url);
+	if (batch == NULL) {
+		batch = i_new(struct ntfy_http_batch, 1);
+		batch->config = config;
+		batch->url = i_strdup(htctx->url);
+		batch->payload = str_new(default_pool, 256);
+		hash_table_insert(config->batches, batch->url, batch);
+	}
+
+	str_append_c(batch->payload, (batch->count == 0 ? '[' : ','));
+	str_printfa(batch->payload, "{\"importance\":%llu",
+		    (unsigned long long)nact->importance);
+	ntfy_http_json_append_field(batch->payload, "message", message);
+	ntfy_http_json_append_field(batch->payload, "from", nact->from);
+	ntfy_http_json_append_field(batch->payload, "subject", subject);
+	ntfy_http_json_append_field(batch->payload, "header_from", from);
+	ntfy_http_json_append_field(
+		batch->payload, "envelope_from",
+		(sender == NULL ? NULL : smtp_address_encode(sender)));
+	str_append_c(batch->payload, '}');
+
+	batch->count++;
+	config->pending++;
+
+	if (batch->count >= config->batch_size)
+		ntfy_http_batch_submit(batch);
+	else if (config->to_flush == NULL)
+		config->to_flush = timeout_add_short(0, ntfy_http_flush, config);
+
+	e_debug(config->event, "queued notification to %s", htctx->url);
+	return 0;
+}
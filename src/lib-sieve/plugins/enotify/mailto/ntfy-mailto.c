@@ -20,6 +20,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "ioloop.h"
 #include "str-sanitize.h"
@@ -47,6 +48,7 @@
 
 #define NTFY_MAILTO_MAX_RECIPIENTS  8
 #define NTFY_MAILTO_MAX_HEADERS     16
+#define NTFY_MAILTO_MAX_CACHED_URIS 32
 
 /*
  * Mailto notification configuration
@@ -55,6 +57,11 @@
 struct ntfy_mailto_config {
 	pool_t pool;
 	struct sieve_address_source envelope_from;
+
+	/* Successfully parsed URIs, keyed by URI body. Scripts mostly use
+	   constant URIs, so these are parsed only once per instance. */
+	pool_t uri_cache_pool;
+	HASH_TABLE(const char *, struct uri_mailto *) uri_cache;
 };
 
 /*
@@ -186,6 +193,10 @@ static void ntfy_mailto_unload(const struct sieve_enotify_method *nmth)
 	struct ntfy_mailto_config *config =
 		(struct ntfy_mailto_config *)nmth->context;
 
+	if (hash_table_is_created(config->uri_cache)) {
+		hash_table_destroy(&config->uri_cache);
+		pool_unref(&config->uri_cache_pool);
+	}
 	pool_unref(&config->pool);
 }
 
@@ -232,6 +243,85 @@ static void ntfy_mailto_uri_env_deinit(struct ntfy_mailto_uri_env *nmuenv)
 	event_unref(&nmuenv->event);
 }
 
+static struct uri_mailto *
+ntfy_mailto_uri_copy(pool_t pool, const struct uri_mailto *src)
+{
+	struct uri_mailto *dest;
+	const struct uri_mailto_recipient *rcpts;
+	const struct uri_mailto_header_field *hdrs;
+	unsigned int count, i;
+
+	dest = p_new(pool, struct uri_mailto, 1);
+
+	rcpts = array_get(&src->recipients, &count);
+	p_array_init(&dest->recipients, pool, count);
+	for (i = 0; i < count; i++) {
+		struct uri_mailto_recipient *rcpt =
+			array_append_space(&dest->recipients);
+
+		rcpt->full = p_strdup(pool, rcpts[i].full);
+		rcpt->address = smtp_address_clone(pool, rcpts[i].address);
+		rcpt->carbon_copy = rcpts[i].carbon_copy;
+	}
+
+	hdrs = array_get(&src->headers, &count);
+	p_array_init(&dest->headers, pool, count);
+	for (i = 0; i < count; i++) {
+		struct uri_mailto_header_field *hdr =
+			array_append_space(&dest->headers);
+
+		hdr->name = p_strdup(pool, hdrs[i].name);
+		hdr->body = p_strdup(pool, hdrs[i].body);
+	}
+
+	dest->subject = p_strdup(pool, src->subject);
+	dest->body = p_strdup(pool, src->body);
+	return dest;
+}
+
+static struct uri_mailto *
+ntfy_mailto_uri_parse(const struct sieve_enotify_env *nenv,
+		      const char *uri_body, pool_t pool)
+{
+	struct ntfy_mailto_config *config =
+		(struct ntfy_mailto_config *)nenv->method->context;
+	struct ntfy_mailto_uri_env nmuenv;
+	struct uri_mailto *parsed_uri;
+
+	if (hash_table_is_created(config->uri_cache)) {
+		parsed_uri = hash_table_lookup(config->uri_cache, uri_body);
+		/* The action owns its copy; duplicate checking modifies the
+		   recipient list */
+		if (parsed_uri != NULL)
+			return ntfy_mailto_uri_copy(pool, parsed_uri);
+	}
+
+	ntfy_mailto_uri_env_init(&nmuenv, nenv);
+	parsed_uri = uri_mailto_parse(uri_body, pool,
+				      _reserved_headers, _unique_headers,
+				      NTFY_MAILTO_MAX_RECIPIENTS,
+				      NTFY_MAILTO_MAX_HEADERS,
+				      &nmuenv.uri_log);
+	ntfy_mailto_uri_env_deinit(&nmuenv);
+
+	if (parsed_uri == NULL)
+		return NULL;
+
+	if (!hash_table_is_created(config->uri_cache)) {
+		config->uri_cache_pool =
+			pool_alloconly_create("ntfy_mailto_uri_cache", 1024);
+		hash_table_create(&config->uri_cache, config->uri_cache_pool,
+				  0, str_hash, strcmp);
+	}
+	if (hash_table_count(config->uri_cache) < NTFY_MAILTO_MAX_CACHED_URIS) {
+		hash_table_insert(config->uri_cache,
+				  p_strdup(config->uri_cache_pool, uri_body),
+				  ntfy_mailto_uri_copy(config->uri_cache_pool,
+						       parsed_uri));
+	}
+	return parsed_uri;
+}
+
 /*
  * Validation
  */
@@ -322,7 +412,6 @@ ntfy_mailto_runtime_check_operands(const struct sieve_enotify_env *nenv,
 	struct ntfy_mailto_context *mtctx;
 	struct uri_mailto *parsed_uri;
 	const struct smtp_address *address;
-	struct ntfy_mailto_uri_env nmuenv;
 	const char *error;
 
 	/* Need to create context before validation to have arrays present */
@@ -348,14 +437,7 @@ ntfy_mailto_runtime_check_operands(const struct sieve_enotify_env *nenv,
 			return FALSE;
 	}
 
-	ntfy_mailto_uri_env_init(&nmuenv, nenv);
-	parsed_uri = uri_mailto_parse(uri_body, context_pool,
-				      _reserved_headers, _unique_headers,
-				      NTFY_MAILTO_MAX_RECIPIENTS,
-				      NTFY_MAILTO_MAX_HEADERS,
-				      &nmuenv.uri_log);
-	ntfy_mailto_uri_env_deinit(&nmuenv);
-
+	parsed_uri = ntfy_mailto_uri_parse(nenv, uri_body, context_pool);
 	if (parsed_uri == NULL)
 		return FALSE;
 
@@ -739,7 +821,10 @@ ntfy_mailto_send(const struct sieve_enotify_exec_env *nenv,
 	output = sieve_smtp_send(sctx);
 	o_stream_nsend(output, str_data(msg), str_len(msg));
 
-	if ((ret = sieve_smtp_finish(sctx, &error)) <= 0) {
+	ret = sieve_smtp_finish_async(
+		sctx, t_strdup_printf("mail notification to %s", str_c(all)),
+		&error);
+	if (ret <= 0) {
 		if (ret < 0) {
 			sieve_enotify_global_error(
 				nenv, "failed to send mail notification to %s: "
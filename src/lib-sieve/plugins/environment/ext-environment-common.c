@@ -35,11 +35,22 @@ sieve_environment_item_insert(struct ext_environment_interpreter_context *ctx,
  * Validator context
  */
 
+struct ext_environment_resolved_item {
+	const struct sieve_environment_item *item;
+	const char *name;
+};
+
 struct ext_environment_interpreter_context {
 	HASH_TABLE(const char *,
 		   const struct sieve_environment_item *) name_items;
 	ARRAY(const struct sieve_environment_item *) prefix_items;
 
+	/* Item names requested at runtime, mapped to the item they resolved
+	   to (if any) */
+	pool_t resolved_pool;
+	HASH_TABLE(const char *,
+		   struct ext_environment_resolved_item *) resolved_items;
+
 	bool active:1;
 };
 
@@ -82,6 +93,10 @@ ext_environment_interpreter_extension_free(
 
 	hash_table_destroy(&ctx->name_items);
 	array_free(&ctx->prefix_items);
+	if (hash_table_is_created(ctx->resolved_items)) {
+		hash_table_destroy(&ctx->resolved_items);
+		pool_unref(&ctx->resolved_pool);
+	}
 }
 
 static struct ext_environment_interpreter_context *
@@ -135,6 +150,12 @@ sieve_environment_item_insert(struct ext_environment_interpreter_context *ctx,
 		hash_table_insert(ctx->name_items, item->name, item);
 	else
 		array_append(&ctx->prefix_items, &item, 1);
+
+	/* Earlier resolutions may be shadowed now */
+	if (hash_table_is_created(ctx->resolved_items)) {
+		hash_table_clear(ctx->resolved_items, FALSE);
+		p_clear(ctx->resolved_pool);
+	}
 }
 
 void sieve_environment_item_register(const struct sieve_extension *env_ext,
@@ -178,6 +199,35 @@ ext_environment_item_lookup(struct ext_environment_interpreter_context *ctx,
 	return NULL;
 }
 
+static const struct sieve_environment_item *
+ext_environment_item_resolve(struct ext_environment_interpreter_context *ctx,
+			     const char **_name)
+{
+	struct ext_environment_resolved_item *resolved;
+	const char *name = *_name;
+
+	if (!hash_table_is_created(ctx->resolved_items)) {
+		ctx->resolved_pool = pool_alloconly_create(
+			"sieve environment resolved items", 256);
+		hash_table_create(&ctx->resolved_items, default_pool, 0,
+				  str_hash, strcmp);
+	}
+
+	resolved = hash_table_lookup(ctx->resolved_items, name);
+	if (resolved == NULL) {
+		resolved = p_new(ctx->resolved_pool,
+				 struct ext_environment_resolved_item, 1);
+		resolved->item = ext_environment_item_lookup(ctx, &name);
+		resolved->name = p_strdup(ctx->resolved_pool, name);
+		hash_table_insert(ctx->resolved_items,
+				  p_strdup(ctx->resolved_pool, *_name),
+				  resolved);
+	}
+
+	*_name = resolved->name;
+	return resolved->item;
+}
+
 const char *
 ext_environment_item_get_value(const struct sieve_extension *env_ext,
 			       const struct sieve_runtime_env *renv,
@@ -189,7 +239,7 @@ ext_environment_item_get_value(const struct sieve_extension *env_ext,
 	i_assert(sieve_extension_is(env_ext, environment_extension));
 	ctx = ext_environment_interpreter_context_get(env_ext, renv->interp);
 
-	item = ext_environment_item_lookup(ctx, &name);
+	item = ext_environment_item_resolve(ctx, &name);
 	if (item == NULL)
 		return NULL;
 
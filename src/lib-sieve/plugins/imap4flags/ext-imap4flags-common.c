@@ -273,14 +273,12 @@ bool sieve_ext_imap4flags_flag_is_valid(const char *flag)
 
 	if ( *flag == '\\' ) {
 		/* System flag */
-		const char *atom = t_str_ucase(flag);
-
 		if (
-			(strcmp(atom, "\\ANSWERED") != 0) &&
-			(strcmp(atom, "\\FLAGGED") != 0) &&
-			(strcmp(atom, "\\DELETED") != 0) &&
-			(strcmp(atom, "\\SEEN") != 0) &&
-			(strcmp(atom, "\\DRAFT") != 0) )
+			(strcasecmp(flag, "\\ANSWERED") != 0) &&
+			(strcasecmp(flag, "\\FLAGGED") != 0) &&
+			(strcasecmp(flag, "\\DELETED") != 0) &&
+			(strcasecmp(flag, "\\SEEN") != 0) &&
+			(strcasecmp(flag, "\\DRAFT") != 0) )
 		{
 			return FALSE;
 		}
@@ -382,20 +380,6 @@ const char *ext_imap4flags_iter_get_flag
 	return str_c(flag);
 }
 
-static void ext_imap4flags_iter_delete_last
-(struct ext_imap4flags_iter *iter)
-{
-	iter->offset++;
-	if ( iter->offset > str_len(iter->flags_list) )
-		iter->offset = str_len(iter->flags_list);
-	if ( iter->offset == str_len(iter->flags_list) && iter->last > 0 )
-		iter->last--;
-
-	str_delete(iter->flags_list, iter->last, iter->offset - iter->last);
-
-	iter->offset = iter->last;
-}
-
 /* Flag operations */
 
 static string_t *ext_imap4flags_get_flag_variable
@@ -405,34 +389,61 @@ static string_t *ext_imap4flags_get_flag_variable
 	unsigned int var_index)
 	ATTR_NULL(2);
 
-static bool flags_list_flag_exists
-(string_t *flags_list, const char *flag)
+/* Find the next occurrence of flag in the flags list, starting at *offset.
+   The list is scanned in place, since it is searched once for every flag
+   that is added or removed. */
+static bool flags_list_flag_find
+(string_t *flags_list, const char *flag, size_t flag_len,
+	size_t *offset, size_t *end_r)
 {
-	const char *flg;
-	struct ext_imap4flags_iter flit;
+	const unsigned char *fbegin = str_data(flags_list);
+	const unsigned char *fend = fbegin + str_len(flags_list);
+	const unsigned char *fp = fbegin + *offset, *fnext;
+
+	while ( fp < fend ) {
+		if ( *fp == ' ' ) {
+			fp++;
+			continue;
+		}
 
-	ext_imap4flags_iter_init(&flit, flags_list);
+		fnext = memchr(fp, ' ', fend - fp);
+		if ( fnext == NULL )
+			fnext = fend;
 
-	while ( (flg=ext_imap4flags_iter_get_flag(&flit)) != NULL ) {
-		if ( strcasecmp(flg, flag) == 0 )
+		if ( (size_t)(fnext - fp) == flag_len &&
+			strncasecmp((const char *)fp, flag, flag_len) == 0 ) {
+			*offset = fp - fbegin;
+			*end_r = fnext - fbegin;
 			return TRUE;
+		}
+		fp = fnext;
 	}
-
 	return FALSE;
 }
 
+static bool flags_list_flag_exists
+(string_t *flags_list, const char *flag)
+{
+	size_t offset = 0, end;
+
+	return flags_list_flag_find
+		(flags_list, flag, strlen(flag), &offset, &end);
+}
+
 static void flags_list_flag_delete
 (string_t *flags_list, const char *flag)
 {
-	const char *flg;
-	struct ext_imap4flags_iter flit;
+	size_t flag_len = strlen(flag), offset = 0, end;
 
-	ext_imap4flags_iter_init(&flit, flags_list);
+	while ( flags_list_flag_find
+		(flags_list, flag, flag_len, &offset, &end) ) {
+		/* Delete the flag along with one adjacent space */
+		if ( end < str_len(flags_list) )
+			end++;
+		else if ( offset > 0 )
+			offset--;
 
-	while ( (flg=ext_imap4flags_iter_get_flag(&flit)) != NULL ) {
-		if ( strcasecmp(flg, flag) == 0 ) {
-			ext_imap4flags_iter_delete_last(&flit);
-		}
+		str_delete(flags_list, offset, end - offset);
 	}
 }
 
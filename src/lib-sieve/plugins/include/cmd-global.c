@@ -241,10 +241,9 @@ opc_global_execute(const struct sieve_runtime_env *renv, sieve_size_t *address)
 {
 	const struct sieve_extension *this_ext = renv->oprtn->ext;
 	struct sieve_variable_scope_binary *global_vars;
-	struct sieve_variable_scope *global_scope;
 	struct sieve_variable_storage *storage;
-	struct sieve_variable * const *vars;
 	unsigned int var_count, count, i;
+	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_COMMANDS);
 
 	if (!sieve_binary_read_unsigned(renv->sblock, address, &count)) {
 		sieve_runtime_trace_error(
@@ -252,9 +251,11 @@ opc_global_execute(const struct sieve_runtime_env *renv, sieve_size_t *address)
 		return SIEVE_EXEC_BIN_CORRUPT;
 	}
 
+	/* The variable indexes are fixed at compile time; the names of the
+	   global variables are only needed for the trace, so these are not
+	   read from the binary otherwise. */
 	global_vars = ext_include_binary_get_global_scope(this_ext, renv->sbin);
-	global_scope = sieve_variable_scope_binary_get(global_vars);
-	vars = sieve_variable_scope_get_variables(global_scope, &var_count);
+	var_count = sieve_variable_scope_binary_get_size(global_vars);
 	storage = ext_include_interpreter_get_global_variables(this_ext,
 							       renv->interp);
 
@@ -276,10 +277,18 @@ opc_global_execute(const struct sieve_runtime_env *renv, sieve_size_t *address)
 			return SIEVE_EXEC_BIN_CORRUPT;
 		}
 
-		sieve_runtime_trace(
-			renv, SIEVE_TRLVL_COMMANDS,
-			"global: exporting variable '%s' [gvid: %u, vid: %u]",
-			vars[index]->identifier, i, index);
+		if (trace) {
+			const char *identifier;
+
+			if (!sieve_variable_get_identifier(storage, index,
+							   &identifier) ||
+			    identifier == NULL)
+				identifier = "";
+			sieve_runtime_trace(
+				renv, SIEVE_TRLVL_COMMANDS,
+				"global: exporting variable '%s' "
+				"[gvid: %u, vid: %u]", identifier, i, index);
+		}
 
 		/* Make sure variable is initialized (export) */
 		(void)sieve_variable_get_modifiable(storage, index, NULL);
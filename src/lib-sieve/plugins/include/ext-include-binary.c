@@ -3,6 +3,8 @@
 
 #include "lib.h"
 #include "str.h"
+#include "md5.h"
+#include "istream.h"
 
 #include "sieve-common.h"
 #include "sieve-error.h"
@@ -197,6 +199,112 @@ struct sieve_variable_scope_binary *ext_include_binary_get_global_scope
 	return binctx->global_vars;
 }
 
+/*
+ * Script digest
+ */
+
+/* A digest of the included script's source is stored in the binary. When the
+   script's metadata indicates a change (e.g. a global script was deployed
+   anew with a newer mtime), the binary is only recompiled when the content is
+   actually different. */
+
+static int
+ext_include_script_digest(struct sieve_script *script,
+			  unsigned char digest_r[MD5_RESULTLEN])
+{
+	struct md5_context ctx;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	if (sieve_script_get_stream(script, &input, NULL) < 0)
+		return -1;
+
+	i_stream_seek(input, 0);
+	md5_init(&ctx);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		md5_update(&ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		return -1;
+	md5_final(&ctx, digest_r);
+
+	/* Rewind for the lexer */
+	i_stream_seek(input, 0);
+	return 0;
+}
+
+static void
+ext_include_binary_emit_digest(struct sieve_binary_block *sblock,
+			       struct ext_include_script_info *incscript)
+{
+	unsigned char digest[MD5_RESULTLEN];
+	buffer_t digest_buf;
+
+	if (incscript->block == NULL ||
+	    ext_include_script_digest(incscript->script, digest) < 0) {
+		buffer_create_from_const_data(&digest_buf, "", 0);
+	} else {
+		buffer_create_from_const_data(&digest_buf,
+					      digest, sizeof(digest));
+	}
+	sieve_binary_emit_string(sblock, &digest_buf);
+}
+
+static bool
+ext_include_binary_check_digests(const struct sieve_extension *ext,
+				 struct ext_include_binary_context *binctx,
+				 struct sieve_binary_block *sblock,
+				 sieve_size_t *offset)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct sieve_binary *sbin = binctx->binary;
+	struct ext_include_script_info *const *scripts;
+	unsigned int script_count, i;
+
+	scripts = array_get(&binctx->include_index, &script_count);
+
+	if (*offset >= sieve_binary_block_get_size(sblock)) {
+		/* Written without digests; rely on the metadata only */
+		for (i = 0; i < script_count; i++) {
+			if (scripts[i]->modified)
+				binctx->outdated = TRUE;
+		}
+		return TRUE;
+	}
+
+	for (i = 0; i < script_count; i++) {
+		struct ext_include_script_info *incscript = scripts[i];
+		unsigned char digest[MD5_RESULTLEN];
+		string_t *stored;
+
+		if (!sieve_binary_read_string(sblock, offset, &stored)) {
+			e_error(svinst->event,
+				"include: failed to read script digests "
+				"from dependency block %d of binary %s",
+				sieve_binary_block_get_id(sblock),
+				sieve_binary_path(sbin));
+			return FALSE;
+		}
+		if (!incscript->modified)
+			continue;
+
+		if (str_len(stored) == sizeof(digest) &&
+		    ext_include_script_digest(incscript->script, digest) == 0 &&
+		    memcmp(str_data(stored), digest, sizeof(digest)) == 0) {
+			e_debug(svinst->event, "include: "
+				"script '%s' included in binary %s is unchanged",
+				sieve_script_name(incscript->script),
+				sieve_binary_path(sbin));
+			incscript->modified = FALSE;
+			continue;
+		}
+		binctx->outdated = TRUE;
+	}
+	return TRUE;
+}
+
 /*
  * Binary extension
  */
@@ -236,6 +344,9 @@ static bool ext_include_binary_pre_save
 
 	result = ext_include_variables_save(sblock, binctx->global_vars, error_r);
 
+	for ( i = 0; i < script_count; i++ )
+		ext_include_binary_emit_digest(sblock, scripts[i]);
+
 	return result;
 }
 
@@ -286,6 +397,7 @@ static bool ext_include_binary_open
 		string_t *script_name;
 		struct sieve_storage *storage;
 		struct sieve_script *script;
+		struct ext_include_script_info *incscript;
 		enum sieve_error error;
 		int ret;
 
@@ -381,11 +493,10 @@ static bool ext_include_binary_open
 			return FALSE;
 		}
 
-		if ( ret == 0 )
-			binctx->outdated = TRUE;
-
-		(void)ext_include_binary_script_include
+		incscript = ext_include_binary_script_include
 			(binctx, location, flags, script, inc_block);
+		if ( ret == 0 )
+			incscript->modified = TRUE;
 
 		sieve_script_unref(&script);
 	}
@@ -394,6 +505,9 @@ static bool ext_include_binary_open
 		(ext, sblock, &offset, &binctx->global_vars) )
 		return FALSE;
 
+	if ( !ext_include_binary_check_digests(ext, binctx, sblock, &offset) )
+		return FALSE;
+
 	return TRUE;
 }
 
@@ -34,6 +34,9 @@ struct ext_include_script_info {
 	enum ext_include_script_location location;
 
 	struct sieve_binary_block *block;
+
+	/* Script metadata no longer matches the binary */
+	bool modified:1;
 };
 
 struct ext_include_script_info *ext_include_binary_script_include
@@ -5,6 +5,7 @@
 #include "array.h"
 #include "str-sanitize.h"
 #include "home-expand.h"
+#include "time-util.h"
 
 #include "sieve-common.h"
 #include "sieve-settings.h"
@@ -43,7 +44,9 @@ ext_include_get_generator_context(const struct sieve_extension *ext_this,
 /* Interpreter context */
 
 struct ext_include_interpreter_global {
-	ARRAY(struct sieve_script *) included_scripts;
+	/* Indexed by include id - 1; the binary lists each included script
+	   only once, so this records which scripts have run */
+	ARRAY(bool) included;
 
 	struct sieve_variable_scope_binary *var_scope;
 	struct sieve_variable_storage *var_storage;
@@ -343,7 +346,7 @@ ext_include_runtime_init(const struct sieve_extension *this_ext,
 	if (ctx->parent == NULL) {
 		ctx->global = p_new(ctx->pool,
 				    struct ext_include_interpreter_global, 1);
-		p_array_init(&ctx->global->included_scripts, ctx->pool, 10);
+		p_array_init(&ctx->global->included, ctx->pool, 16);
 
 		ctx->global->var_scope =
 			ext_include_binary_get_global_scope(
@@ -562,6 +565,9 @@ int ext_include_generate_include(
 		} else {
 			struct sieve_binary_block *inc_block =
 				sieve_binary_block_create(sbin);
+			struct timeval start, end;
+
+			i_gettimeofday(&start);
 
 			/* Real include */
 			included = ext_include_binary_script_include(
@@ -619,6 +625,15 @@ int ext_include_generate_include(
 
 			/* Cleanup */
 			sieve_ast_unref(&ast);
+
+			/* Included scripts are compiled one after the other, so
+			   log what each one adds to the compile time of the
+			   including script. */
+			i_gettimeofday(&end);
+			e_debug(this_ext->svinst->event, "include: "
+				"compiled included script '%s' in %lld ms",
+				str_sanitize(script_name, 80),
+				timeval_diff_msecs(&end, &start));
 		}
 	}
 
@@ -640,9 +655,14 @@ ext_include_runtime_check_circular(
 
 	pctx = ctx;
 	while (pctx != NULL) {
-
-		if (sieve_script_equals(include->script, pctx->script))
+		/* Included scripts are identified by their script info; only
+		   the top-level script needs to be compared */
+		if (pctx->script_info != NULL) {
+			if (pctx->script_info == include)
+				return TRUE;
+		} else if (sieve_script_equals(include->script, pctx->script)) {
 			return TRUE;
+		}
 
 		pctx = pctx->parent;
 	}
@@ -655,16 +675,17 @@ ext_include_runtime_include_mark(struct ext_include_interpreter_context *ctx,
 				 const struct ext_include_script_info *include,
 				 bool once)
 {
-	struct sieve_script *const *includes;
-	unsigned int count, i;
+	static const bool included = TRUE;
+	unsigned int idx = include->id - 1;
+	const bool *seen;
 
-	includes = array_get(&ctx->global->included_scripts, &count);
-	for (i = 0; i < count; i++) {
-		if (sieve_script_equals(include->script, includes[i]))
+	if (idx < array_count(&ctx->global->included)) {
+		seen = array_idx(&ctx->global->included, idx);
+		if (*seen)
 			return (!once);
 	}
 
-	array_append(&ctx->global->included_scripts, &include->script, 1);
+	array_idx_set(&ctx->global->included, idx, &included);
 	return TRUE;
 }
 
@@ -11,6 +11,7 @@
 #include "sieve-code.h"
 #include "sieve-actions.h"
 #include "sieve-result.h"
+#include "sieve-message.h"
 #include "sieve-generator.h"
 
 #include "ext-mailbox-common.h"
@@ -132,9 +133,13 @@ seff_mailbox_create_pre_execute(
 
 	eenv->exec_status->last_storage = mailbox_get_storage(box);
 
-	/* Open the mailbox (may already be open) */
+	/* Open the mailbox (may already be open), unless the mailbox list
+	   already tells it does not exist */
 	if (trans->error_code == MAIL_ERROR_NONE) {
-		if (mailbox_open(box) < 0)
+		if (sieve_message_mailbox_exists(
+			aenv->msgctx, mailbox_get_vname(box)) == 0)
+			trans->error_code = MAIL_ERROR_NOTFOUND;
+		else if (mailbox_open(box) < 0)
 			sieve_act_store_get_storage_error(aenv, trans);
 	}
 
@@ -165,6 +170,8 @@ seff_mailbox_create_pre_execute(
 		}
 	}
 
+	sieve_message_mailbox_created(aenv->msgctx, mailbox_get_vname(box));
+
 	/* Subscribe to it if necessary */
 	if (eenv->scriptenv->mailbox_autosubscribe) {
 		(void)mailbox_list_set_subscribed(
@@ -16,6 +16,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
+#include "sieve-message.h"
 
 #include "ext-mailbox-common.h"
 
@@ -169,6 +170,18 @@ tst_mailboxexists_test_mailbox(const struct sieve_runtime_env *renv,
 		return SIEVE_EXEC_OK;
 	}
 
+	/* Mailboxes missing from the mailbox list need not be opened */
+	if (sieve_message_mailbox_exists(renv->msgctx, mailbox) == 0) {
+		if (trace) {
+			sieve_runtime_trace(
+				renv, 0,
+				"mailbox `%s' does not exist",
+				str_sanitize(mailbox, 80));
+		}
+		*all_exist_r = FALSE;
+		return SIEVE_EXEC_OK;
+	}
+
 	/* Open the box */
 	box = mailbox_alloc_for_user(eenv->scriptenv->user,
 				     mailbox,
@@ -0,0 +1,128 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "hash.h"
+#include "mail-storage.h"
+#include "mail-namespace.h"
+
+#include "sieve-common.h"
+#include "sieve-extensions.h"
+#include "sieve-code.h"
+#include "sieve-interpreter.h"
+#include "sieve-message.h"
+
+#include "ext-metadata-common.h"
+
+/*
+ * Annotation cache
+ */
+
+/* Annotations cannot change while a script is executing, so retrieved values
+   are kept for the lifetime of the message context. */
+
+struct ext_metadata_cached_value {
+	const char *value;
+	bool exists;
+};
+
+struct ext_metadata_message_context {
+	HASH_TABLE(const char *, struct ext_metadata_cached_value *) values;
+};
+
+static struct ext_metadata_message_context *
+ext_metadata_message_context_get(const struct sieve_runtime_env *renv)
+{
+	const struct sieve_extension *this_ext = renv->oprtn->ext;
+	struct ext_metadata_message_context *mctx;
+	pool_t pool;
+
+	mctx = (struct ext_metadata_message_context *)
+		sieve_message_context_extension_get(renv->msgctx, this_ext);
+	if (mctx == NULL) {
+		pool = sieve_message_context_pool(renv->msgctx);
+		mctx = p_new(pool, struct ext_metadata_message_context, 1);
+		hash_table_create(&mctx->values, pool, 0, str_hash, strcmp);
+		sieve_message_context_extension_set(renv->msgctx, this_ext,
+						    (void *)mctx);
+	}
+	return mctx;
+}
+
+/*
+ * Annotation lookup
+ */
+
+void ext_metadata_lookup_init(struct ext_metadata_lookup *lookup,
+			      const struct sieve_runtime_env *renv,
+			      const char *mailbox)
+{
+	i_zero(lookup);
+	lookup->renv = renv;
+	lookup->mailbox = mailbox;
+}
+
+static void ext_metadata_lookup_begin(struct ext_metadata_lookup *lookup)
+{
+	const struct sieve_execute_env *eenv = lookup->renv->exec_env;
+	struct mail_user *user = eenv->scriptenv->user;
+
+	if (lookup->imtrans != NULL)
+		return;
+
+	if (lookup->mailbox != NULL) {
+		struct mail_namespace *ns;
+		ns = mail_namespace_find(user->namespaces, lookup->mailbox);
+		lookup->box = mailbox_alloc(ns->list, lookup->mailbox, 0);
+		lookup->imtrans = imap_metadata_transaction_begin(lookup->box);
+	} else {
+		lookup->imtrans = imap_metadata_transaction_begin_server(user);
+	}
+}
+
+int ext_metadata_lookup_get(struct ext_metadata_lookup *lookup,
+			    const char *aname, const char **value_r,
+			    enum mail_error *error_code_r,
+			    const char **error_r)
+{
+	struct ext_metadata_message_context *mctx =
+		ext_metadata_message_context_get(lookup->renv);
+	pool_t pool = sieve_message_context_pool(lookup->renv->msgctx);
+	struct ext_metadata_cached_value *cvalue;
+	struct mail_attribute_value avalue;
+	const char *key;
+
+	*value_r = NULL;
+
+	key = t_strconcat((lookup->mailbox == NULL ? "" : lookup->mailbox),
+			  "\n", aname, NULL);
+	cvalue = hash_table_lookup(mctx->values, key);
+	if (cvalue != NULL) {
+		*value_r = cvalue->value;
+		return (cvalue->exists ? 1 : 0);
+	}
+
+	ext_metadata_lookup_begin(lookup);
+	if (imap_metadata_get(lookup->imtrans, aname, &avalue) < 0) {
+		*error_r = imap_metadata_transaction_get_last_error(
+			lookup->imtrans, error_code_r);
+		return -1;
+	}
+
+	cvalue = p_new(pool, struct ext_metadata_cached_value, 1);
+	cvalue->value = p_strdup(pool, avalue.value);
+	cvalue->exists = (avalue.value != NULL || avalue.value_stream != NULL);
+	hash_table_insert(mctx->values, p_strdup(pool, key), cvalue);
+
+	*value_r = cvalue->value;
+	return (cvalue->exists ? 1 : 0);
+}
+
+void ext_metadata_lookup_deinit(struct ext_metadata_lookup *lookup)
+{
+	if (lookup->imtrans != NULL)
+		(void)imap_metadata_transaction_commit(&lookup->imtrans,
+						       NULL, NULL);
+	if (lookup->box != NULL)
+		mailbox_free(&lookup->box);
+}
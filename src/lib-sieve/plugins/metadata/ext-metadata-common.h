@@ -37,4 +37,31 @@ extern const struct sieve_operation_def servermetadata_operation;
 extern const struct sieve_operation_def metadataexists_operation;
 extern const struct sieve_operation_def servermetadataexists_operation;
 
+/*
+ * Annotation lookup
+ */
+
+/* Looks up annotations of one mailbox (or the server when mailbox is NULL).
+   Results are cached in the message context, and a metadata transaction is
+   only started for annotations that are not cached yet. */
+
+struct ext_metadata_lookup {
+	const struct sieve_runtime_env *renv;
+	const char *mailbox;
+
+	struct mailbox *box;
+	struct imap_metadata_transaction *imtrans;
+};
+
+void ext_metadata_lookup_init(struct ext_metadata_lookup *lookup,
+			      const struct sieve_runtime_env *renv,
+			      const char *mailbox);
+/* Returns 1 when the annotation exists, 0 when it does not and -1 on error.
+   The value is NULL when the annotation only exists as a stream. */
+int ext_metadata_lookup_get(struct ext_metadata_lookup *lookup,
+			    const char *aname, const char **value_r,
+			    enum mail_error *error_code_r,
+			    const char **error_r);
+void ext_metadata_lookup_deinit(struct ext_metadata_lookup *lookup);
+
 #endif
@@ -1,3 +1,37 @@
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	struct mail_user *user = eenv->scriptenv->user;
+	struct ext_metadata_lookup lookup;
+	enum mail_error error_code;
+	const char *error;
+	int status, ret;
+
+	*annotation_r = NULL;
+
+	if (user == NULL)
+		return SIEVE_EXEC_OK;
+
+	ext_metadata_lookup_init(&lookup, renv, mailbox);
+
+	status = SIEVE_EXEC_OK;
+	ret = ext_metadata_lookup_get(&lookup, aname, annotation_r,
+				      &error_code, &error);
+	if (ret < 0) {
+		sieve_runtime_error(
+			renv, NULL, "%s test: "
+			"failed to retrieve annotation `%s': %s%s",
+			(mailbox != NULL ? "metadata" : "servermetadata"),
+			str_sanitize(aname, 256),
+			sieve_error_from_external(error),
+			(error_code == MAIL_ERROR_TEMP ?
+			 " (temporary failure)" : ""));
+
+		status = (error_code == MAIL_ERROR_TEMP ?
+			  SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
+	}
+	ext_metadata_lookup_deinit(&lookup);
+	return status;
+}
+
 /* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
  */
 
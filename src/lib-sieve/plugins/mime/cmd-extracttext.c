@@ -253,6 +253,24 @@ static bool cmd_extracttext_operation_dump
  * Code execution
  */
 
+struct cmd_extracttext_first_context {
+	string_t *value;
+	size_t limit;
+};
+
+static int
+cmd_extracttext_first_callback(void *context, const char *data, size_t size,
+	bool last ATTR_UNUSED)
+{
+	struct cmd_extracttext_first_context *fctx = context;
+
+	if ( size > fctx->limit - str_len(fctx->value) )
+		size = fctx->limit - str_len(fctx->value);
+	str_append_data(fctx->value, data, size);
+
+	return ( str_len(fctx->value) >= fctx->limit ? 1 : 0 );
+}
+
 static int cmd_extracttext_operation_execute
 (const struct sieve_runtime_env *renv, sieve_size_t *address)
 {
@@ -328,15 +346,35 @@ static int cmd_extracttext_operation_execute
 	mpart = sieve_message_part_iter_current(&sfploop->part_iter);
 	i_assert( mpart != NULL );
 
-	/* Get message part content */
-	sieve_message_part_get_data(mpart, &mpart_data, TRUE);
-
-	/* Apply ":first" limit, if any */
-	if ( !have_first || (size_t)first > mpart_data.size ) {
+	if ( !have_first ) {
+		/* Get message part content; the value refers to it directly */
+		if ( (ret=sieve_message_part_read_data
+			(renv, mpart, &mpart_data, TRUE)) <= 0 )
+			return ret;
 		value = t_str_new_const(mpart_data.content, mpart_data.size);
 	} else {
-		value = t_str_new((size_t)first);
-		str_append_data(value, mpart_data.content, (size_t)first);
+		struct cmd_extracttext_first_context fctx;
+		size_t limit = (first > SIZE_MAX ? SIZE_MAX : (size_t)first);
+
+		sieve_message_part_get_data(mpart, &mpart_data, TRUE);
+		if ( mpart_data.content != NULL ) {
+			/* Content was read before; refer to it directly */
+			value = t_str_new_const(mpart_data.content,
+				I_MIN(mpart_data.size, limit));
+		} else {
+			/* Decode only as much of the part as the ":first" limit
+			   needs */
+			i_zero(&fctx);
+			fctx.limit = limit;
+			fctx.value = str_new(default_pool, I_MIN(limit, 1024));
+			ret = sieve_message_part_stream_data(renv, mpart, TRUE,
+				cmd_extracttext_first_callback, &fctx);
+			value = t_str_new(str_len(fctx.value) + 1);
+			str_append_str(value, fctx.value);
+			str_free(&fctx.value);
+			if ( ret <= 0 )
+				return ret;
+		}
 	}
 
 	/* Apply modifiers */
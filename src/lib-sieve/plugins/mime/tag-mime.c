@@ -521,12 +521,56 @@ content_header_parse(struct content_header_stringlist *strlist,
 	return content;
 }
 
+/* Same as content_header_parse() for the :type, :subtype and :contenttype
+   options, but using the value that was already parsed along with the
+   message part. */
+static string_t *content_header_from_parsed
+(struct content_header_stringlist *strlist, const char *content)
+{
+	const struct sieve_runtime_env *renv = strlist->strlist.runenv;
+	bool trace = strlist->strlist.trace;
+	const char *p;
+
+	if ( *content == '\0' ) {
+		/* Invalid header value */
+		return t_str_new_const("", 0);
+	}
+
+	p = strchr(content, '/');
+	switch ( strlist->option ) {
+	case EXT_MIME_OPTION_TYPE:
+		if ( trace )
+			sieve_runtime_trace(renv, 0, "extracted MIME type");
+		if ( p != NULL )
+			return t_str_new_const(content, (p - content));
+		break;
+	case EXT_MIME_OPTION_SUBTYPE:
+		if ( p == NULL ) {
+			if ( trace ) {
+				sieve_runtime_trace(renv, 0,
+					"no MIME sub-type for content-disposition");
+			}
+			return t_str_new_const("", 0);
+		}
+		if ( trace )
+			sieve_runtime_trace(renv, 0, "extracted MIME sub-type");
+		return t_str_new_const(p + 1, strlen(p + 1));
+	case EXT_MIME_OPTION_CONTENTTYPE:
+		sieve_runtime_trace(renv, 0,
+			"extracted full MIME contenttype");
+		break;
+	default:
+		i_unreached();
+	}
+	return t_str_new_const(content, strlen(content));
+}
+
 static int content_header_stringlist_next_item
 (struct sieve_stringlist *_strlist, string_t **str_r)
 {
 	struct content_header_stringlist *strlist =
 		(struct content_header_stringlist *)_strlist;
-	const char *hdr_name;
+	const char *hdr_name, *content = NULL;
 	int ret;
 
 	if ( strlist->param_values != NULL ) {
@@ -540,8 +584,14 @@ static int content_header_stringlist_next_item
 		}
 	}
 
-	if ( (ret=sieve_header_list_next_item
-		(strlist->source, &hdr_name, str_r)) <= 0 ) {
+	if ( strlist->option == EXT_MIME_OPTION_PARAM ) {
+		ret = sieve_header_list_next_item
+			(strlist->source, &hdr_name, str_r);
+	} else {
+		ret = sieve_header_list_next_item_content
+			(strlist->source, &hdr_name, str_r, &content);
+	}
+	if ( ret <= 0 ) {
 		if (ret < 0) {
 			_strlist->exec_status =
 				strlist->source->strlist.exec_status;
@@ -549,7 +599,10 @@ static int content_header_stringlist_next_item
 		return ret;
 	}
 
-	*str_r = content_header_parse(strlist, hdr_name, *str_r);
+	if ( content != NULL )
+		*str_r = content_header_from_parsed(strlist, content);
+	else
+		*str_r = content_header_parse(strlist, hdr_name, *str_r);
 	return 1;
 }
 
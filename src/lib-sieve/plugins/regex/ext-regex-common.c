@@ -1,11 +1,62 @@
 /* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
  */
 
+#include "lib.h"
+
 #include "sieve-common.h"
+#include "sieve-settings.h"
+#include "sieve-extensions.h"
 #include "sieve-match-types.h"
 
 #include "ext-regex-common.h"
 
+/*
+ * Extension configuration
+ */
+
+bool ext_regex_load(const struct sieve_extension *ext, void **context)
+{
+	struct sieve_instance *svinst = ext->svinst;
+	struct ext_regex_context *extctx;
+	enum ext_regex_engine_type engine = EXT_REGEX_ENGINE_POSIX;
+	const char *setval;
+
+	if (*context != NULL)
+		ext_regex_unload(ext);
+
+	setval = sieve_setting_get(svinst, "sieve_regex_engine");
+	if (setval != NULL && *setval != '\0' &&
+	    !ext_regex_engine_parse(setval, &engine)) {
+		e_warning(svinst->event, "regex: "
+			  "Invalid or unsupported value `%s' for "
+			  "sieve_regex_engine setting; using %s instead",
+			  setval, ext_regex_engine_name(engine));
+	}
+
+	extctx = i_new(struct ext_regex_context, 1);
+	extctx->engine = engine;
+
+	*context = (void *)extctx;
+	return TRUE;
+}
+
+void ext_regex_unload(const struct sieve_extension *ext)
+{
+	struct ext_regex_context *extctx =
+		(struct ext_regex_context *)ext->context;
+
+	i_free(extctx);
+}
+
+enum ext_regex_engine_type
+ext_regex_get_engine(const struct sieve_extension *ext)
+{
+	const struct ext_regex_context *extctx =
+		(const struct ext_regex_context *)ext->context;
+
+	return (extctx == NULL ? EXT_REGEX_ENGINE_POSIX : extctx->engine);
+}
+
 /*
  * Regex match type operand
  */
@@ -1,12 +1,24 @@
 #ifndef EXT_REGEX_COMMON_H
 #define EXT_REGEX_COMMON_H
 
+#include "ext-regex-engine.h"
+
 /*
  * Extension
  */
 
 extern const struct sieve_extension_def regex_extension;
 
+struct ext_regex_context {
+	enum ext_regex_engine_type engine;
+};
+
+bool ext_regex_load(const struct sieve_extension *ext, void **context);
+void ext_regex_unload(const struct sieve_extension *ext);
+
+enum ext_regex_engine_type
+ext_regex_get_engine(const struct sieve_extension *ext);
+
 /*
  * Operand
  */
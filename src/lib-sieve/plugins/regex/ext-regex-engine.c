@@ -0,0 +1,275 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+
+#include "ext-regex-engine.h"
+
+#ifdef HAVE_PCRE2
+#  define PCRE2_CODE_UNIT_WIDTH 8
+#  include <pcre2.h>
+#endif
+
+struct ext_regex {
+	enum ext_regex_engine_type engine;
+
+	regex_t regexp;
+#ifdef HAVE_PCRE2
+	pcre2_code *code;
+	pcre2_match_data *match_data;
+#endif
+};
+
+/*
+ * Engine selection
+ */
+
+bool ext_regex_engine_parse(const char *name,
+			    enum ext_regex_engine_type *engine_r)
+{
+	if (strcasecmp(name, "posix") == 0) {
+		*engine_r = EXT_REGEX_ENGINE_POSIX;
+		return TRUE;
+	}
+#ifdef HAVE_PCRE2
+	if (strcasecmp(name, "pcre2") == 0) {
+		*engine_r = EXT_REGEX_ENGINE_PCRE2;
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+const char *ext_regex_engine_name(enum ext_regex_engine_type engine)
+{
+	switch (engine) {
+	case EXT_REGEX_ENGINE_POSIX:
+		break;
+	case EXT_REGEX_ENGINE_PCRE2:
+		return "pcre2";
+	}
+	return "posix";
+}
+
+/*
+ * POSIX engine
+ */
+
+/* Wrapper around the regerror function for easy access */
+static const char *ext_regex_posix_error(regex_t *regexp, int errorcode)
+{
+	size_t errsize = regerror(errorcode, regexp, NULL, 0);
+	buffer_t *error_buf;
+	char *errbuf;
+
+	if (errsize == 0)
+		return "";
+
+	error_buf = buffer_create_dynamic(pool_datastack_create(), errsize);
+	errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
+
+	errsize = regerror(errorcode, regexp, errbuf, errsize);
+
+	/* We don't want the error to start with a capital letter */
+	errbuf[0] = i_tolower(errbuf[0]);
+
+	buffer_append_space_unsafe(error_buf, errsize);
+
+	return str_c(error_buf);
+}
+
+static bool
+ext_regex_posix_compile(struct ext_regex *regex, const char *pattern,
+			enum ext_regex_flags flags, const char **error_r)
+{
+	int cflags = REG_EXTENDED, ret;
+
+	if (HAS_ALL_BITS(flags, EXT_REGEX_FLAG_ICASE))
+		cflags |= REG_ICASE;
+	if (HAS_ALL_BITS(flags, EXT_REGEX_FLAG_NOSUB))
+		cflags |= REG_NOSUB;
+
+	ret = regcomp(&regex->regexp, pattern, cflags);
+	if (ret != 0) {
+		*error_r = ext_regex_posix_error(&regex->regexp, ret);
+		regfree(&regex->regexp);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+ext_regex_posix_match(struct ext_regex *regex, const char *value,
+		      size_t value_size ATTR_UNUSED, regmatch_t *pmatch,
+		      size_t nmatch)
+{
+	int ret;
+
+	ret = regexec(&regex->regexp, value, nmatch, pmatch, 0);
+	if (ret == REG_NOMATCH)
+		return 0;
+	return (ret == 0 ? 1 : -1);
+}
+
+/*
+ * PCRE2 engine
+ */
+
+#ifdef HAVE_PCRE2
+static bool
+ext_regex_pcre2_compile(struct ext_regex *regex, const char *pattern,
+			enum ext_regex_flags flags, const char **error_r)
+{
+	PCRE2_UCHAR errbuf[256];
+	PCRE2_SIZE erroffset;
+	uint32_t options = 0;
+	int errcode;
+
+	if (HAS_ALL_BITS(flags, EXT_REGEX_FLAG_ICASE))
+		options |= PCRE2_CASELESS;
+	if (HAS_ALL_BITS(flags, EXT_REGEX_FLAG_NOSUB))
+		options |= PCRE2_NO_AUTO_CAPTURE;
+
+	regex->code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+				    options, &errcode, &erroffset, NULL);
+	if (regex->code == NULL) {
+		if (pcre2_get_error_message(errcode, errbuf,
+					    sizeof(errbuf)) < 0)
+			i_strocpy((char *)errbuf, "unknown error",
+				  sizeof(errbuf));
+		*error_r = t_strdup_printf("%s at offset %"PRIuSIZE_T,
+					   (const char *)errbuf,
+					   (size_t)erroffset);
+		return FALSE;
+	}
+
+	/* JIT compilation is an optimization; the interpreter is used when it
+	   is not available */
+	(void)pcre2_jit_compile(regex->code, PCRE2_JIT_COMPLETE);
+
+	regex->match_data =
+		pcre2_match_data_create_from_pattern(regex->code, NULL);
+	if (regex->match_data == NULL) {
+		pcre2_code_free(regex->code);
+		regex->code = NULL;
+		*error_r = "out of memory";
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+ext_regex_pcre2_match(struct ext_regex *regex, const char *value,
+		      size_t value_size, regmatch_t *pmatch, size_t nmatch)
+{
+	PCRE2_SIZE *ovector;
+	uint32_t ovec_count;
+	size_t i;
+	int ret;
+
+	ret = pcre2_match(regex->code, (PCRE2_SPTR)value, value_size, 0, 0,
+			  regex->match_data, NULL);
+	if (ret == PCRE2_ERROR_NOMATCH)
+		return 0;
+	if (ret < 0)
+		return -1;
+
+	if (nmatch == 0)
+		return 1;
+
+	ovector = pcre2_get_ovector_pointer(regex->match_data);
+	ovec_count = pcre2_get_ovector_count(regex->match_data);
+	for (i = 0; i < nmatch; i++) {
+		if (i >= ovec_count || i >= (size_t)ret ||
+		    ovector[2*i] == PCRE2_UNSET) {
+			pmatch[i].rm_so = -1;
+			pmatch[i].rm_eo = -1;
+			continue;
+		}
+		pmatch[i].rm_so = (regoff_t)ovector[2*i];
+		pmatch[i].rm_eo = (regoff_t)ovector[2*i+1];
+	}
+	return 1;
+}
+#endif
+
+/*
+ * Regular expression
+ */
+
+struct ext_regex *
+ext_regex_compile(enum ext_regex_engine_type engine, const char *pattern,
+		  enum ext_regex_flags flags, const char **error_r)
+{
+	struct ext_regex *regex;
+	bool success;
+
+	regex = i_new(struct ext_regex, 1);
+	regex->engine = engine;
+
+	switch (engine) {
+	case EXT_REGEX_ENGINE_PCRE2:
+#ifdef HAVE_PCRE2
+		success = ext_regex_pcre2_compile(regex, pattern, flags,
+						  error_r);
+		break;
+#else
+		i_unreached();
+#endif
+	case EXT_REGEX_ENGINE_POSIX:
+	default:
+		success = ext_regex_posix_compile(regex, pattern, flags,
+						  error_r);
+		break;
+	}
+
+	if (!success) {
+		i_free(regex);
+		return NULL;
+	}
+	return regex;
+}
+
+void ext_regex_free(struct ext_regex **_regex)
+{
+	struct ext_regex *regex = *_regex;
+
+	*_regex = NULL;
+	if (regex == NULL)
+		return;
+
+	switch (regex->engine) {
+	case EXT_REGEX_ENGINE_PCRE2:
+#ifdef HAVE_PCRE2
+		pcre2_match_data_free(regex->match_data);
+		pcre2_code_free(regex->code);
+		break;
+#else
+		i_unreached();
+#endif
+	case EXT_REGEX_ENGINE_POSIX:
+		regfree(&regex->regexp);
+		break;
+	}
+	i_free(regex);
+}
+
+int ext_regex_match(struct ext_regex *regex, const char *value,
+		    size_t value_size,
+		    regmatch_t *pmatch, size_t nmatch)
+{
+	switch (regex->engine) {
+	case EXT_REGEX_ENGINE_PCRE2:
+#ifdef HAVE_PCRE2
+		return ext_regex_pcre2_match(regex, value, value_size,
+					     pmatch, nmatch);
+#else
+		i_unreached();
+#endif
+	case EXT_REGEX_ENGINE_POSIX:
+		break;
+	}
+	return ext_regex_posix_match(regex, value, value_size, pmatch, nmatch);
+}
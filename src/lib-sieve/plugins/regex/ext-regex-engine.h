@@ -0,0 +1,48 @@
+#ifndef EXT_REGEX_ENGINE_H
+#define EXT_REGEX_ENGINE_H
+
+#include <sys/types.h>
+#include <regex.h>
+
+/*
+ * Regular expression engine
+ */
+
+/* The regex match type does not use a regular expression library directly,
+   but rather through this small interface. This way, the POSIX <regex.h>
+   implementation can be replaced by PCRE2 (with JIT compilation) when it is
+   available at build time. */
+
+enum ext_regex_engine_type {
+	EXT_REGEX_ENGINE_POSIX = 0,
+	EXT_REGEX_ENGINE_PCRE2,
+};
+
+enum ext_regex_flags {
+	/* Match case-insensitively */
+	EXT_REGEX_FLAG_ICASE = BIT(0),
+	/* No substring captures are needed */
+	EXT_REGEX_FLAG_NOSUB = BIT(1),
+};
+
+struct ext_regex;
+
+/* Returns FALSE if the named engine is unknown or not built in. */
+bool ext_regex_engine_parse(const char *name,
+			    enum ext_regex_engine_type *engine_r);
+const char *ext_regex_engine_name(enum ext_regex_engine_type engine);
+
+/* Compiles the regular expression. Returns NULL and sets error_r upon
+   failure. */
+struct ext_regex *
+ext_regex_compile(enum ext_regex_engine_type engine, const char *pattern,
+		  enum ext_regex_flags flags, const char **error_r);
+void ext_regex_free(struct ext_regex **_regex);
+
+/* Matches the value against the regular expression. The captured substrings
+   are returned in pmatch (unused entries have rm_so == -1). Returns 1 when
+   the value matches, 0 when it does not and -1 upon an error. */
+int ext_regex_match(struct ext_regex *regex, const char *value,
+		    size_t value_size, regmatch_t *pmatch, size_t nmatch);
+
+#endif
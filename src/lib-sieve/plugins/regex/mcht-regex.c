@@ -10,10 +10,12 @@
 #include "array.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "hash.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
 #include "sieve-ast.h"
+#include "sieve-binary.h"
 #include "sieve-stringlist.h"
 #include "sieve-commands.h"
 #include "sieve-validator.h"
@@ -24,8 +26,6 @@
 
 #include "ext-regex-common.h"
 
-#include <sys/types.h>
-#include <regex.h>
 #include <ctype.h>
 
 /*
@@ -34,6 +34,10 @@
 
 #define MCHT_REGEX_MAX_SUBSTITUTIONS SIEVE_MAX_MATCH_VALUES
 
+/* Maximum number of compiled regular expressions kept with a binary; keys
+   produced by variables can differ for each message, so this is bounded. */
+#define MCHT_REGEX_MAX_CACHED_KEYS 256
+
 /*
  * Match type
  */
@@ -60,57 +64,33 @@ const struct sieve_match_type_def regex_match_type = {
  * Match type validation
  */
 
-/* Wrapper around the regerror function for easy access */
-static const char *_regexp_error(regex_t *regexp, int errorcode)
-{
-	size_t errsize = regerror(errorcode, regexp, NULL, 0);
-
-	if ( errsize > 0 ) {
-		char *errbuf;
-
-		buffer_t *error_buf =
-			buffer_create_dynamic(pool_datastack_create(), errsize);
-		errbuf = buffer_get_space_unsafe(error_buf, 0, errsize);
-
-		errsize = regerror(errorcode, regexp, errbuf, errsize);
-
-		/* We don't want the error to start with a capital letter */
-		errbuf[0] = i_tolower(errbuf[0]);
-
-		buffer_append_space_unsafe(error_buf, errsize);
-
-		return str_c(error_buf);
-	}
-
-	return "";
-}
-
 static int mcht_regex_validate_regexp
 (struct sieve_validator *valdtr,
-	struct sieve_match_type_context *mtctx ATTR_UNUSED,
-	struct sieve_ast_argument *key, int cflags)
+	struct sieve_match_type_context *mtctx,
+	struct sieve_ast_argument *key, enum ext_regex_flags flags)
 {
-	int ret;
-	regex_t regexp;
+	const struct sieve_extension *this_ext = mtctx->match_type->object.ext;
 	const char *regex_str = sieve_ast_argument_strc(key);
+	struct ext_regex *regex;
+	const char *error;
 
-	if ( (ret=regcomp(&regexp, regex_str, cflags)) != 0 ) {
+	regex = ext_regex_compile(ext_regex_get_engine(this_ext),
+		regex_str, flags, &error);
+	if ( regex == NULL ) {
 		sieve_argument_validate_error(valdtr, key,
 			"invalid regular expression '%s' for regex match: %s",
-			str_sanitize(regex_str, 128), _regexp_error(&regexp, ret));
-
-		regfree(&regexp);
+			str_sanitize(regex_str, 128), error);
 		return -1;
 	}
 
-	regfree(&regexp);
+	ext_regex_free(&regex);
 	return 1;
 }
 
 struct _regex_key_context {
 	struct sieve_validator *valdtr;
 	struct sieve_match_type_context *mtctx;
-	int cflags;
+	enum ext_regex_flags flags;
 };
 
 static int mcht_regex_validate_key_argument
@@ -123,7 +103,7 @@ static int mcht_regex_validate_key_argument
 	 */
 	if ( sieve_argument_is_string_literal(key) ) {
 		return mcht_regex_validate_regexp
-			(keyctx->valdtr, keyctx->mtctx, key, keyctx->cflags);
+			(keyctx->valdtr, keyctx->mtctx, key, keyctx->flags);
 	}
 
 	return 1;
@@ -134,15 +114,15 @@ static bool mcht_regex_validate_context
 	struct sieve_match_type_context *mtctx, struct sieve_ast_argument *key_arg)
 {
 	const struct sieve_comparator *cmp = mtctx->comparator;
-	int cflags = REG_EXTENDED | REG_NOSUB;
+	enum ext_regex_flags flags = EXT_REGEX_FLAG_NOSUB;
 	struct _regex_key_context keyctx;
 	struct sieve_ast_argument *kitem;
 
 	if ( cmp != NULL ) {
 		if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
-			cflags =  REG_EXTENDED | REG_NOSUB | REG_ICASE;
+			flags =  EXT_REGEX_FLAG_NOSUB | EXT_REGEX_FLAG_ICASE;
 		else if ( sieve_comparator_is(cmp, i_octet_comparator) )
-			cflags =  REG_EXTENDED | REG_NOSUB;
+			flags =  EXT_REGEX_FLAG_NOSUB;
 		else {
 			sieve_argument_validate_error(valdtr, mtctx->argument,
 				"regex match type only supports "
@@ -155,7 +135,7 @@ static bool mcht_regex_validate_context
 
 	keyctx.valdtr = valdtr;
 	keyctx.mtctx = mtctx;
-	keyctx.cflags = cflags;
+	keyctx.flags = flags;
 
 	kitem = key_arg;
 	if ( sieve_ast_stringlist_map(&kitem, (void *) &keyctx,
@@ -166,16 +146,390 @@ static bool mcht_regex_validate_context
 }
 
 /*
- * Match type implementation
+ * Compiled regular expressions
  */
 
+struct mcht_regex_literal {
+	const char *data;
+	size_t size;
+};
+
 struct mcht_regex_key {
-	regex_t regexp;
+	struct ext_regex *regexp;
 	int status;
+
+	/* A value can only match if it contains one of these literals; none
+	   when nothing could be derived from the pattern */
+	const struct mcht_regex_literal *literals;
+	unsigned int literals_count;
+	bool literals_icase:1;
+
+	/* Owned by the match context rather than by the binary */
+	bool transient:1;
+};
+
+/* Compiled regular expressions are kept with the binary, so that these are
+   compiled only once for all executions of a (cached) binary, rather than
+   once for each match. */
+
+struct mcht_regex_binary_context {
+	HASH_TABLE(char *, struct mcht_regex_key *) regexps;
+	unsigned int count;
+};
+
+static void mcht_regex_binary_free
+(const struct sieve_extension *ext, struct sieve_binary *sbin,
+	void *context);
+
+static const struct sieve_binary_extension regex_binary_ext = {
+	.extension = &regex_extension,
+	.binary_free = mcht_regex_binary_free,
 };
 
+static struct mcht_regex_binary_context *mcht_regex_binary_get_context
+(const struct sieve_extension *this_ext, struct sieve_binary *sbin)
+{
+	struct mcht_regex_binary_context *binctx =
+		(struct mcht_regex_binary_context *)
+		sieve_binary_extension_get_context(sbin, this_ext);
+
+	if ( binctx == NULL ) {
+		pool_t pool = sieve_binary_pool(sbin);
+
+		binctx = p_new(pool, struct mcht_regex_binary_context, 1);
+		hash_table_create(&binctx->regexps, pool, 0, str_hash, strcmp);
+
+		sieve_binary_extension_set
+			(sbin, this_ext, &regex_binary_ext, binctx);
+	}
+
+	return binctx;
+}
+
+static void mcht_regex_binary_free
+(const struct sieve_extension *ext ATTR_UNUSED,
+	struct sieve_binary *sbin ATTR_UNUSED, void *context)
+{
+	struct mcht_regex_binary_context *binctx =
+		(struct mcht_regex_binary_context *) context;
+	struct hash_iterate_context *hctx;
+	char *key;
+	struct mcht_regex_key *rkey;
+
+	hctx = hash_table_iterate_init(binctx->regexps);
+	while ( hash_table_iterate(hctx, binctx->regexps, &key, &rkey) )
+		ext_regex_free(&rkey->regexp);
+	hash_table_iterate_deinit(&hctx);
+
+	hash_table_destroy(&binctx->regexps);
+}
+
+/*
+ * Literal prefilter
+ */
+
+/* Many regular expressions can only match values that contain a certain
+   literal string (e.g. "viagra|cialis" or "^\\[SPAM\\]"). These literals
+   are derived from the pattern when it is compiled, so that values that
+   cannot match are rejected by a plain substring search without running
+   the regular expression engine. The derivation is conservative: anything
+   not understood yields no literal for that part of the pattern. */
+
+static const char *
+mcht_regex_skip_bracket(const char *p, const char *pend)
+{
+	/* p points just after '[' */
+	if ( p < pend && *p == '^' )
+		p++;
+	if ( p < pend && *p == ']' )
+		p++;
+	while ( p < pend && *p != ']' ) {
+		if ( *p == '[' && p + 1 < pend &&
+			(p[1] == ':' || p[1] == '.' || p[1] == '=') ) {
+			/* Character class, collating symbol or equivalence class */
+			char term = p[1];
+
+			p += 2;
+			while ( p + 1 < pend && !(p[0] == term && p[1] == ']') )
+				p++;
+			p += 2;
+			continue;
+		}
+		p++;
+	}
+	return ( p < pend ? p + 1 : pend );
+}
+
+static const char *
+mcht_regex_skip_group(const char *p, const char *pend)
+{
+	unsigned int depth = 1;
+
+	/* p points just after '(' */
+	while ( p < pend ) {
+		if ( *p == '\\' ) {
+			p += 2;
+			continue;
+		}
+		if ( *p == '[' ) {
+			p = mcht_regex_skip_bracket(p + 1, pend);
+			continue;
+		}
+		if ( *p == '(' )
+			depth++;
+		else if ( *p == ')' && --depth == 0 )
+			return p + 1;
+		p++;
+	}
+	return pend;
+}
+
+static const char *
+mcht_regex_skip_interval(const char *p, const char *pend)
+{
+	const char *q;
+
+	/* p points at '{'; only a proper interval is skipped */
+	for ( q = p + 1; q < pend && (i_isdigit(*q) || *q == ','); q++ );
+	if ( q < pend && *q == '}' && q > p + 1 )
+		return q + 1;
+	return p + 1;
+}
+
+static inline bool mcht_regex_is_quantifier(const char *p, const char *pend)
+{
+	return ( p < pend && (*p == '*' || *p == '?' || *p == '+' || *p == '{') );
+}
+
+static inline void
+mcht_regex_literal_end_run(string_t *run, string_t *literal)
+{
+	if ( str_len(run) > str_len(literal) ) {
+		str_truncate(literal, 0);
+		str_append_str(literal, run);
+	}
+	str_truncate(run, 0);
+}
+
+/* Finds the longest literal that any match of this alternative (which has no
+   top-level '|') must contain. */
+static void
+mcht_regex_alternative_literal(const char *p, const char *pend, bool icase,
+			       string_t *literal)
+{
+	string_t *run = t_str_new(64);
+
+	str_truncate(literal, 0);
+	while ( p < pend ) {
+		bool is_literal = FALSE, quantified;
+		unsigned char c = '\0';
+
+		if ( *p == '\\' && p + 1 < pend &&
+			!i_isalnum(p[1]) && (unsigned char)p[1] < 0x80 ) {
+			/* Escaped special character */
+			c = p[1];
+			p += 2;
+			is_literal = TRUE;
+		} else if ( strchr("\\.[]()*+?{}|^$", *p) == NULL ) {
+			c = *p;
+			p++;
+			/* Case-folding of non-ASCII characters is engine-specific */
+			is_literal = !( icase && c >= 0x80 );
+		} else if ( *p == '[' ) {
+			p = mcht_regex_skip_bracket(p + 1, pend);
+		} else if ( *p == '(' ) {
+			p = mcht_regex_skip_group(p + 1, pend);
+		} else if ( *p == '\\' ) {
+			/* Character class escape, back-reference, etc. */
+			p = ( p + 2 < pend ? p + 2 : pend );
+		} else {
+			p++;
+		}
+
+		/* Only the first occurrence of a character followed by '+' is
+		   required */
+		quantified = mcht_regex_is_quantifier(p, pend);
+		if ( is_literal && (!quantified || *p == '+') )
+			str_append_c(run, icase ? i_tolower(c) : c);
+		if ( !is_literal || quantified ) {
+			mcht_regex_literal_end_run(run, literal);
+			while ( mcht_regex_is_quantifier(p, pend) ) {
+				if ( *p == '{' )
+					p = mcht_regex_skip_interval(p, pend);
+				else
+					p++;
+			}
+		}
+	}
+	mcht_regex_literal_end_run(run, literal);
+}
+
+static void
+mcht_regex_extract_literals(pool_t pool, struct mcht_regex_key *rkey,
+			    const char *regex_str, enum ext_regex_flags flags)
+{
+	ARRAY(struct mcht_regex_literal) literals;
+	struct mcht_regex_literal *lit;
+	const char *p = regex_str, *alt = regex_str, *pend;
+	bool icase = ( (flags & EXT_REGEX_FLAG_ICASE) != 0 );
+	string_t *literal;
+
+	/* Inline options (e.g. "(?i)" for PCRE) can change how literals match */
+	if ( strstr(regex_str, "(?") != NULL )
+		return;
+
+	literal = t_str_new(64);
+	t_array_init(&literals, 4);
+	pend = regex_str + strlen(regex_str);
+	for (;;) {
+		if ( p < pend && *p == '\\' ) {
+			p = ( p + 2 < pend ? p + 2 : pend );
+			continue;
+		}
+		if ( p < pend && *p == '[' ) {
+			p = mcht_regex_skip_bracket(p + 1, pend);
+			continue;
+		}
+		if ( p < pend && *p == '(' ) {
+			p = mcht_regex_skip_group(p + 1, pend);
+			continue;
+		}
+		if ( p < pend && *p != '|' ) {
+			p++;
+			continue;
+		}
+
+		/* End of a top-level alternative */
+		mcht_regex_alternative_literal(alt, p, icase, literal);
+		if ( str_len(literal) == 0 ) {
+			/* This alternative can match without any literal */
+			return;
+		}
+		lit = array_append_space(&literals);
+		lit->data = p_memdup(pool, str_data(literal), str_len(literal));
+		lit->size = str_len(literal);
+
+		if ( p == pend )
+			break;
+		alt = ++p;
+	}
+
+	rkey->literals = p_memdup(pool, array_front(&literals),
+		sizeof(struct mcht_regex_literal) * array_count(&literals));
+	rkey->literals_count = array_count(&literals);
+	rkey->literals_icase = icase;
+}
+
+static bool
+mcht_regex_literal_find(const struct mcht_regex_literal *literal, bool icase,
+			const char *val, size_t val_size)
+{
+	const char *vp = val, *vend = val + val_size;
+	size_t i;
+
+	if ( literal->size > val_size )
+		return FALSE;
+	vend -= literal->size - 1;
+
+	if ( !icase ) {
+		while ( vp < vend &&
+			(vp=memchr(vp, literal->data[0], vend - vp)) != NULL ) {
+			if ( memcmp(vp, literal->data, literal->size) == 0 )
+				return TRUE;
+			vp++;
+		}
+		return FALSE;
+	}
+
+	for ( ; vp < vend; vp++ ) {
+		if ( i_tolower(*vp) != literal->data[0] )
+			continue;
+		for ( i = 1; i < literal->size; i++ ) {
+			if ( i_tolower(vp[i]) != literal->data[i] )
+				break;
+		}
+		if ( i == literal->size )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static bool
+mcht_regex_prefilter(const struct mcht_regex_key *rkey,
+		     const char *val, size_t val_size)
+{
+	unsigned int i;
+
+	if ( rkey->literals_count == 0 )
+		return TRUE;
+	for ( i = 0; i < rkey->literals_count; i++ ) {
+		if ( mcht_regex_literal_find(&rkey->literals[i],
+			rkey->literals_icase, val, val_size) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Compilation
+ */
+
+static struct mcht_regex_key *mcht_regex_compile
+(struct sieve_match_context *mctx, const char *regex_str,
+	enum ext_regex_flags flags)
+{
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	const struct sieve_extension *this_ext = mctx->match_type->object.ext;
+	struct mcht_regex_binary_context *binctx;
+	struct mcht_regex_key *rkey;
+	const char *key, *error;
+
+	binctx = mcht_regex_binary_get_context(this_ext, renv->sbin);
+
+	key = t_strdup_printf("%x:%s", flags, regex_str);
+	rkey = hash_table_lookup(binctx->regexps, key);
+	if ( rkey != NULL )
+		return rkey;
+
+	if ( binctx->count < MCHT_REGEX_MAX_CACHED_KEYS ) {
+		rkey = p_new(sieve_binary_pool(renv->sbin),
+			struct mcht_regex_key, 1);
+	} else {
+		rkey = p_new(mctx->pool, struct mcht_regex_key, 1);
+		rkey->transient = TRUE;
+	}
+
+	/* Compile regular expression */
+	rkey->regexp = ext_regex_compile(ext_regex_get_engine(this_ext),
+		regex_str, flags, &error);
+	if ( rkey->regexp == NULL ) {
+		sieve_runtime_error(renv, NULL,
+			"invalid regular expression '%s' for regex match: %s",
+			str_sanitize(regex_str, 128), error);
+		rkey->status = -1;
+		rkey->transient = FALSE;
+		return rkey;
+	}
+	rkey->status = 1;
+
+	mcht_regex_extract_literals(( rkey->transient ?
+		mctx->pool : sieve_binary_pool(renv->sbin) ),
+		rkey, regex_str, flags);
+
+	if ( !rkey->transient ) {
+		hash_table_insert(binctx->regexps,
+			p_strdup(sieve_binary_pool(renv->sbin), key), rkey);
+		binctx->count++;
+	}
+	return rkey;
+}
+
+/*
+ * Match type implementation
+ */
+
 struct mcht_regex_context {
-	ARRAY(struct mcht_regex_key) reg_expressions;
+	ARRAY(struct mcht_regex_key *) reg_expressions;
 	regmatch_t *pmatch;
 	size_t nmatch;
 	bool all_compiled:1;
@@ -186,14 +540,17 @@ static void mcht_regex_match_init
 {
 	pool_t pool = mctx->pool;
 	struct mcht_regex_context *ctx;
+	unsigned int limit;
 
 	/* Create context */
 	ctx = p_new(pool, struct mcht_regex_context, 1);
 
-	/* Create storage for match values if match values are requested */
-	if ( sieve_match_values_are_enabled(mctx->runenv) ) {
-		ctx->pmatch = p_new(pool, regmatch_t, MCHT_REGEX_MAX_SUBSTITUTIONS);
-		ctx->nmatch = MCHT_REGEX_MAX_SUBSTITUTIONS;
+	/* Create storage for match values if match values are requested; only
+	   the groups the script can reference are substituted */
+	limit = sieve_match_values_get_limit(mctx->runenv);
+	if ( limit > 0 ) {
+		ctx->nmatch = I_MIN(limit, MCHT_REGEX_MAX_SUBSTITUTIONS);
+		ctx->pmatch = p_new(pool, regmatch_t, ctx->nmatch);
 	} else {
 		ctx->pmatch = NULL;
 		ctx->nmatch = 0;
@@ -204,19 +561,25 @@ static void mcht_regex_match_init
 }
 
 static int mcht_regex_match_key
-(struct sieve_match_context *mctx, const char *val,
-	const regex_t *regexp)
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	const struct mcht_regex_key *rkey)
 {
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
 	int ret;
 
+	/* Values without any of the required literals cannot match */
+
+	if ( !mcht_regex_prefilter(rkey, val, val_size) )
+		return 0;
+
 	/* Execute regex */
 
-	ret = regexec(regexp, val, ctx->nmatch, ctx->pmatch, 0);
+	ret = ext_regex_match(rkey->regexp, val, val_size,
+		ctx->pmatch, ctx->nmatch);
 
 	/* Handle match values if necessary */
 
-	if ( ret == 0 ) {
+	if ( ret > 0 ) {
 		if ( ctx->nmatch > 0 ) {
 			struct sieve_match_values *mvalues;
 			size_t i;
@@ -256,7 +619,7 @@ static int mcht_regex_match_key
 }
 
 static int mcht_regex_match_keys
-(struct sieve_match_context *mctx, const char *val, size_t val_size ATTR_UNUSED,
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
 	struct sieve_stringlist *key_list)
 {
 	const struct sieve_runtime_env *renv = mctx->runenv;
@@ -284,42 +647,35 @@ static int mcht_regex_match_keys
 				struct mcht_regex_key *rkey;
 
 				if ( i >= array_count(&ctx->reg_expressions) ) {
-					int cflags;
-
-					rkey = array_append_space(&ctx->reg_expressions);
+					enum ext_regex_flags flags = 0;
+					bool supported = TRUE;
 
 					/* Configure case-sensitivity according to comparator */
 					if ( sieve_comparator_is(cmp, i_octet_comparator) )
-						cflags =  REG_EXTENDED;
+						flags = 0;
 					else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
-						cflags =  REG_EXTENDED | REG_ICASE;
+						flags = EXT_REGEX_FLAG_ICASE;
 					else
-						rkey->status = -1; /* Not supported */
-
-					if ( rkey->status >= 0 ) {
-						const char *regex_str = str_c(key_item);
-						int rxret;
+						supported = FALSE;
 
+					if ( supported ) {
 						/* Indicate whether match values need to be produced */
-						if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
-
-						/* Compile regular expression */
-						if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
-							sieve_runtime_error(renv, NULL,
-								"invalid regular expression '%s' for regex match: %s",
-								str_sanitize(regex_str, 128),
-								_regexp_error(&rkey->regexp, rxret));
-							rkey->status = -1;
-						} else {
-							rkey->status = 1;
-						}
+						if ( ctx->nmatch == 0 ) flags |= EXT_REGEX_FLAG_NOSUB;
+
+						/* Obtain compiled regular expression */
+						rkey = mcht_regex_compile(mctx, str_c(key_item), flags);
+					} else {
+						rkey = p_new(mctx->pool, struct mcht_regex_key, 1);
+						rkey->status = -1;
 					}
+					array_append(&ctx->reg_expressions, &rkey, 1);
 				} else {
-					rkey = array_idx_modifiable(&ctx->reg_expressions, 1);
+					rkey = *array_idx(&ctx->reg_expressions, i);
 				}
 
 				if ( rkey->status > 0 ) {
-					match = mcht_regex_match_key(mctx, val, &rkey->regexp);
+					match = mcht_regex_match_key
+						(mctx, val, val_size, rkey);
 
 					if ( trace ) {
 						sieve_runtime_trace(renv, 0,
@@ -341,7 +697,7 @@ static int mcht_regex_match_keys
 		}
 
 	} else {
-		const struct mcht_regex_key *rkeys;
+		struct mcht_regex_key *const *rkeys;
 		unsigned int i, count;
 
 		/* Regular expressions are compiled */
@@ -351,8 +707,9 @@ static int mcht_regex_match_keys
 		i = 0;
 		match = 0;
 		while ( match == 0 && i < count ) {
-			if ( rkeys[i].status > 0 ) {
-				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+			if ( rkeys[i]->status > 0 ) {
+				match = mcht_regex_match_key
+					(mctx, val, val_size, rkeys[i]);
 
 				if ( trace ) {
 					sieve_runtime_trace(renv, 0,
@@ -371,14 +728,15 @@ void mcht_regex_match_deinit
 (struct sieve_match_context *mctx)
 {
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
-	struct mcht_regex_key *rkeys;
+	struct mcht_regex_key *const *rkeys;
 	unsigned int count, i;
 
-	/* Clean up compiled regular expressions */
+	/* Clean up compiled regular expressions not kept with the binary */
 	if ( array_is_created(&ctx->reg_expressions) ) {
-		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
+		rkeys = array_get(&ctx->reg_expressions, &count);
 		for ( i = 0; i < count; i++ ) {
-			regfree(&rkeys[i].regexp);
+			if ( rkeys[i]->transient )
+				ext_regex_free(&rkeys[i]->regexp);
 		}
 	}
 }
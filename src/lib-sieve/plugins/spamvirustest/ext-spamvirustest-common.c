@@ -431,10 +431,15 @@ void ext_spamvirustest_unload(const struct sieve_extension *ext)
 struct ext_spamvirustest_message_context {
 	int reload;
 	float score_ratio;
+
+	/* Score strings derived from score_ratio; the test is commonly
+	   evaluated many times for the same message */
+	const char *score, *score_percent;
 };
 
 static const char *ext_spamvirustest_get_score
-(const struct sieve_extension *ext, float score_ratio, bool percent)
+(const struct sieve_extension *ext, pool_t pool, float score_ratio,
+	bool percent)
 {
 	int score;
 
@@ -451,7 +456,26 @@ static const char *ext_spamvirustest_get_score
 	else
 		score = score_ratio * 9 + 1.001;
 
-	return t_strdup_printf("%d", score);
+	return p_strdup_printf(pool, "%d", score);
+}
+
+static const char *ext_spamvirustest_message_get_score
+(const struct sieve_extension *ext, pool_t pool,
+	struct ext_spamvirustest_message_context *mctx, bool percent)
+{
+	if ( percent ) {
+		if ( mctx->score_percent == NULL ) {
+			mctx->score_percent = ext_spamvirustest_get_score
+				(ext, pool, mctx->score_ratio, TRUE);
+		}
+		return mctx->score_percent;
+	}
+
+	if ( mctx->score == NULL ) {
+		mctx->score = ext_spamvirustest_get_score
+			(ext, pool, mctx->score_ratio, FALSE);
+	}
+	return mctx->score;
 }
 
 int ext_spamvirustest_get_value
@@ -495,13 +519,15 @@ int ext_spamvirustest_get_value
 		sieve_message_context_extension_set(msgctx, ext, (void *)mctx);
 	} else if ( mctx->reload == ext_data->reload ) {
 		/* Use cached result */
-		*value_r = ext_spamvirustest_get_score(ext, mctx->score_ratio, percent);
+		*value_r = ext_spamvirustest_message_get_score
+			(ext, pool, mctx, percent);
 		return SIEVE_EXEC_OK;
 	} else {
 		/* Extension was reloaded (probably in testsuite) */
 	}
 
 	mctx->reload = ext_data->reload;
+	mctx->score = mctx->score_percent = NULL;
 
 	/*
 	 * Get max status value
@@ -662,7 +688,7 @@ int ext_spamvirustest_get_value
 		"extracted score=%.3f, max=%.3f, ratio=%.0f %%",
 		status_value, max_value, mctx->score_ratio * 100);
 
-	*value_r = ext_spamvirustest_get_score(ext, mctx->score_ratio, percent);
+	*value_r = ext_spamvirustest_message_get_score(ext, pool, mctx, percent);
 	return SIEVE_EXEC_OK;
 
 failed:
@@ -16,6 +16,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
+#include "sieve-message.h"
 
 #include "ext-special-use-common.h"
 
@@ -258,6 +259,16 @@ tst_specialuse_find_mailbox(const struct sieve_runtime_env *renv,
 	if (user == NULL)
 		return 0;
 
+	/* Mailboxes missing from the mailbox list need not be opened */
+	if (sieve_message_mailbox_exists(renv->msgctx, mailbox) == 0) {
+		if (trace) {
+			sieve_runtime_trace(
+				renv, 0, "mailbox `%s' does not exist",
+				str_sanitize(mailbox, 256));
+		}
+		return 0;
+	}
+
 	/* Open the box */
 	box = mailbox_alloc_for_user(user, mailbox, MAILBOX_FLAG_POST_SESSION);
 	if (mailbox_open(box) < 0) {
@@ -311,6 +322,17 @@ tst_specialuse_find_specialuse(const struct sieve_runtime_env *renv,
 	if (user == NULL)
 		return 0;
 
+	/* No need to open anything when no listed mailbox has the flag */
+	if (sieve_message_mailbox_special_use_exists(renv->msgctx,
+						     special_use) == 0) {
+		if (trace) {
+			sieve_runtime_trace(
+				renv, 0, "no mailbox with special-use flag `%s'",
+				str_sanitize(special_use, 64));
+		}
+		return 0;
+	}
+
 	/* Open the box */
 	box = mailbox_alloc_for_user(user, special_use,
 				     (MAILBOX_FLAG_POST_SESSION |
@@ -2,6 +2,8 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "strfuncs.h"
 #include "md5.h"
@@ -31,6 +33,7 @@
 #include "sieve-result.h"
 #include "sieve-message.h"
 #include "sieve-smtp.h"
+#include "sieve-duplicate-dict.h"
 
 #include "ext-vacation-common.h"
 
@@ -214,6 +217,8 @@ struct act_vacation_context {
 	const char *from;
 	const struct smtp_address *from_address;
 	const struct smtp_address *const *addresses;
+	/* The :addresses, indexed by their lowercase encoding */
+	HASH_TABLE(const char *, const struct smtp_address *) address_set;
 };
 
 /*
@@ -332,6 +337,9 @@ cmd_vacation_validate_string_tag(struct sieve_validator *valdtr,
 
 			if (!result)
 				return FALSE;
+
+			/* Store the address in parsed form */
+			(*arg)->argument->def = &address_argument;
 		}
 
 		ctx_data->from = sieve_ast_argument_str(*arg);
@@ -591,6 +599,28 @@ ext_vacation_operation_dump(const struct sieve_dumptime_env *denv,
 		sieve_opr_string_dump(denv, address, "handle"));
 }
 
+/*
+ * Address set
+ */
+
+static const char *
+_address_set_key(pool_t pool, const struct smtp_address *address)
+{
+	/* Addresses are compared case-insensitively */
+	return p_strdup(pool, t_str_lcase(smtp_address_encode(address)));
+}
+
+static const struct smtp_address *
+_address_set_lookup(struct act_vacation_context *ctx,
+		    const struct smtp_address *address)
+{
+	if (ctx->addresses == NULL || !hash_table_is_created(ctx->address_set))
+		return NULL;
+	return hash_table_lookup(ctx->address_set,
+				 _address_set_key(pool_datastack_create(),
+						  address));
+}
+
 /*
  * Code execution
  */
@@ -639,8 +669,8 @@ ext_vacation_operation_execute(const struct sieve_runtime_env *renv,
 						    &subject);
 			break;
 		case OPT_FROM:
-			ret = sieve_opr_string_read(renv, address, "from",
-						    &from);
+			ret = sieve_opr_address_read(renv, address, "from",
+						     &from, &from_address);
 			break;
 		case OPT_ADDRESSES:
 			ret = sieve_opr_stringlist_read(renv, address,
@@ -682,8 +712,8 @@ ext_vacation_operation_execute(const struct sieve_runtime_env *renv,
 				    str_sanitize(str_c(reason), 80));
 	}
 
-	/* Parse :from address */
-	if (from != NULL) {
+	/* Parse :from address, unless this was done at compile time */
+	if (from != NULL && from_address == NULL) {
 		const char *error;
 
 		from_address = sieve_address_parse_str(from, &error);
@@ -719,6 +749,7 @@ ext_vacation_operation_execute(const struct sieve_runtime_env *renv,
 		sieve_stringlist_reset(addresses);
 
 		p_array_init(&addrs, pool, 4);
+		hash_table_create(&act->address_set, pool, 0, str_hash, strcmp);
 
 		raw_address = NULL;
 		while ((ret = sieve_stringlist_next_item(addresses,
@@ -728,8 +759,14 @@ ext_vacation_operation_execute(const struct sieve_runtime_env *renv,
 
 			addr = sieve_address_parse_str(raw_address, &error);
 			if (addr != NULL) {
+				const char *key = _address_set_key(pool, addr);
+
+				if (hash_table_lookup(act->address_set,
+						      key) != NULL)
+					continue;
 				addr = smtp_address_clone(pool, addr);
 				array_append(&addrs, &addr, 1);
+				hash_table_insert(act->address_set, key, addr);
 			} else {
 				sieve_runtime_error(
 					renv, NULL,
@@ -894,49 +931,64 @@ _msg_address_equals(const struct message_address *addr1,
 		smtp_address_equals_icase(addr2, &saddr));
 }
 
-static inline bool
-_header_contains_my_address(const char *header_val,
-			    const struct smtp_address *my_address)
+/* Parses the addresses listed in the header values once, so that they can be
+   checked against several of the user's addresses. The result is allocated
+   from the data stack. */
+static void
+_headers_get_addresses(const char *const *headers,
+		       ARRAY_TYPE(smtp_address_const) *addrs)
 {
-	const struct message_address *msg_addr;
-
-	msg_addr = message_address_parse(pool_datastack_create(),
-					 (const unsigned char *)header_val,
-					 strlen(header_val), 256, 0);
-	while (msg_addr != NULL) {
-		if (msg_addr->domain != NULL) {
-			if (_msg_address_equals(msg_addr, my_address))
-				return TRUE;
-		}
+	const char *const *hdsp;
 
-		msg_addr = msg_addr->next;
-	}
+	t_array_init(addrs, 8);
+	for (hdsp = headers; *hdsp != NULL; hdsp++) {
+		const struct message_address *msg_addr;
 
-	return FALSE;
+		msg_addr = message_address_parse(
+			pool_datastack_create(),
+			(const unsigned char *)*hdsp, strlen(*hdsp), 256, 0);
+		for (; msg_addr != NULL; msg_addr = msg_addr->next) {
+			struct smtp_address *saddr;
+			const struct smtp_address *addr;
+
+			if (msg_addr->domain == NULL)
+				continue;
+			saddr = t_new(struct smtp_address, 1);
+			if (smtp_address_init_from_msg(saddr, msg_addr) < 0)
+				continue;
+			addr = saddr;
+			array_append(addrs, &addr, 1);
+		}
+	}
 }
 
-static inline bool
-_contains_my_address(const char * const *headers,
+static bool
+_contains_my_address(const ARRAY_TYPE(smtp_address_const) *addrs,
 		     const struct smtp_address *my_address)
 {
-	const char *const *hdsp = headers;
-
-	while (*hdsp != NULL) {
-		bool result;
+	const struct smtp_address *const *addrp;
 
-		T_BEGIN {
-			result = _header_contains_my_address(*hdsp, my_address);
-		} T_END;
-
-		if (result)
+	array_foreach(addrs, addrp) {
+		if (smtp_address_equals_icase(*addrp, my_address))
 			return TRUE;
-
-		hdsp++;
 	}
-
 	return FALSE;
 }
 
+static const struct smtp_address *
+_contains_alt_address(struct act_vacation_context *ctx,
+		      const ARRAY_TYPE(smtp_address_const) *addrs)
+{
+	const struct smtp_address *const *addrp, *found;
+
+	array_foreach(addrs, addrp) {
+		found = _address_set_lookup(ctx, *addrp);
+		if (found != NULL)
+			return found;
+	}
+	return NULL;
+}
+
 static bool _contains_8bit(const char *text)
 {
 	const unsigned char *p = (const unsigned char *)text;
@@ -1066,6 +1118,56 @@ act_vacation_get_default_subject(const struct sieve_action_exec_env *aenv,
 	return SIEVE_EXEC_OK;
 }
 
+static string_t *
+act_vacation_reply_cache_get(char **key, string_t **header,
+			     const char *value)
+{
+	if (*header != NULL && strcmp(*key, value) == 0)
+		return NULL;
+
+	i_free(*key);
+	*key = i_strdup(value);
+	if (*header == NULL)
+		*header = str_new(default_pool, 128);
+	else
+		str_truncate(*header, 0);
+	return *header;
+}
+
+static void
+act_vacation_write_from(const struct ext_vacation_config *config,
+			string_t *msg, const char *from)
+{
+	struct ext_vacation_reply_cache *cache = config->reply_cache;
+	string_t *header;
+
+	header = act_vacation_reply_cache_get(&cache->from,
+					      &cache->from_header, from);
+	if (header != NULL)
+		rfc2822_header_write_address(header, "From", from);
+	str_append_str(msg, cache->from_header);
+}
+
+static void
+act_vacation_write_subject(const struct ext_vacation_config *config,
+			   string_t *msg, const char *subject)
+{
+	struct ext_vacation_reply_cache *cache = config->reply_cache;
+	string_t *header;
+
+	header = act_vacation_reply_cache_get(&cache->subject,
+					      &cache->subject_header, subject);
+	if (header != NULL) {
+		if (_contains_8bit(subject)) {
+			rfc2822_header_utf8_printf(header, "Subject",
+						   "%s", subject);
+		} else {
+			rfc2822_header_printf(header, "Subject", "%s", subject);
+		}
+	}
+	str_append_str(msg, cache->subject_header);
+}
+
 static int
 act_vacation_send(const struct sieve_action_exec_env *aenv,
 		  const struct ext_vacation_config *config,
@@ -1128,7 +1230,7 @@ act_vacation_send(const struct sieve_action_exec_env *aenv,
 	rfc2822_header_write(msg, "Date", message_date_create(ioloop_time));
 
 	if (ctx->from != NULL && *(ctx->from) != '\0') {
-		rfc2822_header_write_address(msg, "From", ctx->from);
+		act_vacation_write_from(config, msg, ctx->from);
 	} else {
 		if (reply_from == NULL || reply_from->mailbox == NULL ||
 		    *reply_from->mailbox == '\0')
@@ -1141,10 +1243,7 @@ act_vacation_send(const struct sieve_action_exec_env *aenv,
 	rfc2822_header_write(msg, "To",
 			     message_address_first_to_string(&reply_to));
 
-	if (_contains_8bit(subject))
-		rfc2822_header_utf8_printf(msg, "Subject", "%s", subject);
-	else
-		rfc2822_header_printf(msg, "Subject", "%s", subject);
+	act_vacation_write_subject(config, msg, subject);
 
 	/* Compose proper in-reply-to and references headers */
 
@@ -1185,11 +1284,18 @@ act_vacation_send(const struct sieve_action_exec_env *aenv,
 		str_append(msg, "\r\n");
 	}
 
-	str_printfa(msg, "%s\r\n", ctx->reason);
 	o_stream_nsend(output, str_data(msg), str_len(msg));
 
-	/* Close smtp session */
-	if ((ret = sieve_smtp_finish(sctx, &error)) <= 0) {
+	/* The reason can be big; send it as is rather than copying it */
+	o_stream_nsend_str(output, ctx->reason);
+	o_stream_nsend_str(output, "\r\n");
+
+	/* Close smtp session; the reply does not affect delivery, so it may
+	   be submitted in the background */
+	ret = sieve_smtp_finish_async(
+		sctx, t_strdup_printf("vacation response to %s",
+				      smtp_address_encode(smtp_to)), &error);
+	if (ret <= 0) {
 		if (ret < 0) {
 			sieve_result_global_error(
 				aenv, "failed to send vacation response to %s: "
@@ -1211,6 +1317,84 @@ act_vacation_send(const struct sieve_action_exec_env *aenv,
 	return SIEVE_EXEC_OK;
 }
 
+/* Tracking which senders were replied to uses the sieve_vacation_dict when
+   configured, and the generic duplicate store otherwise. */
+
+static bool
+act_vacation_use_dict(const struct sieve_action_exec_env *aenv,
+		      const struct ext_vacation_config *config)
+{
+	return (config->dict != NULL &&
+		aenv->exec_env->svinst->username != NULL);
+}
+
+static bool
+act_vacation_duplicate_check_available(
+	const struct sieve_action_exec_env *aenv,
+	const struct ext_vacation_config *config)
+{
+	return (act_vacation_use_dict(aenv, config) ||
+		sieve_action_duplicate_check_available(aenv));
+}
+
+static int
+act_vacation_duplicate_check(const struct sieve_action_exec_env *aenv,
+			     const struct ext_vacation_config *config,
+			     const void *id, size_t id_size,
+			     bool *duplicate_r)
+{
+	struct sieve_duplicate_dict_transaction *dtrans;
+	enum sieve_duplicate_check_result ret;
+
+	if (!act_vacation_use_dict(aenv, config)) {
+		return sieve_action_duplicate_check(aenv, id, id_size,
+						    duplicate_r);
+	}
+
+	*duplicate_r = FALSE;
+	dtrans = sieve_duplicate_dict_transaction_begin(
+		config->dict, aenv->exec_env->svinst->username);
+	if (dtrans == NULL)
+		return SIEVE_EXEC_TEMP_FAILURE;
+	ret = sieve_duplicate_dict_check(dtrans, id, id_size);
+	sieve_duplicate_dict_transaction_rollback(&dtrans);
+
+	switch (ret) {
+	case SIEVE_DUPLICATE_CHECK_RESULT_EXISTS:
+		*duplicate_r = TRUE;
+		break;
+	case SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND:
+		break;
+	case SIEVE_DUPLICATE_CHECK_RESULT_FAILURE:
+		return SIEVE_EXEC_FAILURE;
+	case SIEVE_DUPLICATE_CHECK_RESULT_TEMP_FAILURE:
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+	return SIEVE_EXEC_OK;
+}
+
+static void
+act_vacation_duplicate_mark(const struct sieve_action_exec_env *aenv,
+			    const struct ext_vacation_config *config,
+			    const void *id, size_t id_size, time_t time)
+{
+	struct sieve_duplicate_dict_transaction *dtrans;
+
+	if (!act_vacation_use_dict(aenv, config)) {
+		sieve_action_duplicate_mark(aenv, id, id_size, time);
+		return;
+	}
+
+	dtrans = sieve_duplicate_dict_transaction_begin(
+		config->dict, aenv->exec_env->svinst->username);
+	if (dtrans == NULL)
+		return;
+	sieve_duplicate_dict_mark(dtrans, id, id_size, time);
+	sieve_duplicate_dict_transaction_commit(&dtrans);
+}
+
+/* Like for the duplicate extension, this is the ID stored in the duplicate
+   database and its format must therefore remain stable. */
 static void
 act_vacation_hash(struct act_vacation_context *vctx, const char *sender,
 		  unsigned char hash_r[])
@@ -1286,30 +1470,22 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 
 	/* Are we perhaps trying to respond to one of our alternative :addresses?
 	 */
-	if (ctx->addresses != NULL) {
-		const struct smtp_address * const *alt_address;
-
-		alt_address = ctx->addresses;
-		while (*alt_address != NULL) {
-			if (smtp_address_equals_icase(sender, *alt_address)) {
-				sieve_result_global_log(
-					aenv,
-					"discarded vacation reply to own address <%s> "
-					"(as specified using :addresses argument)",
-					smtp_address_encode(sender));
-				return SIEVE_EXEC_OK;
-			}
-			alt_address++;
-		}
+	if (_address_set_lookup(ctx, sender) != NULL) {
+		sieve_result_global_log(
+			aenv,
+			"discarded vacation reply to own address <%s> "
+			"(as specified using :addresses argument)",
+			smtp_address_encode(sender));
+		return SIEVE_EXEC_OK;
 	}
 
 	/* Did whe respond to this user before? */
-	if (sieve_action_duplicate_check_available(aenv)) {
+	if (act_vacation_duplicate_check_available(aenv, config)) {
 		bool duplicate;
 
 		act_vacation_hash(ctx, smtp_address_encode(sender), dupl_hash);
 
-		ret = sieve_action_duplicate_check(aenv, dupl_hash,
+		ret = act_vacation_duplicate_check(aenv, config, dupl_hash,
 						   sizeof(dupl_hash),
 						   &duplicate);
 		if (ret < SIEVE_EXEC_OK) {
@@ -1448,8 +1624,13 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 				*hdsp);
 		}
 		if (ret > 0 && headers[0] != NULL) {
+			ARRAY_TYPE(smtp_address_const) hdr_addrs;
+			const struct smtp_address *alt_address;
+
+			_headers_get_addresses(headers, &hdr_addrs);
+
 			/* Final recipient directly listed in headers? */
-			if (_contains_my_address(headers, recipient)) {
+			if (_contains_my_address(&hdr_addrs, recipient)) {
 				smtp_from = recipient;
 				message_address_init_from_smtp(
 					&reply_from, NULL, recipient);
@@ -1458,7 +1639,7 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 
 			/* Original recipient directly listed in headers? */
 			if (!smtp_address_isnull(orig_recipient) &&
-			    _contains_my_address(headers, orig_recipient)) {
+			    _contains_my_address(&hdr_addrs, orig_recipient)) {
 				smtp_from = orig_recipient;
 				message_address_init_from_smtp(
 					&reply_from, NULL, orig_recipient);
@@ -1466,29 +1647,20 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 			}
 
 			/* User-provided :addresses listed in headers? */
-			if (ctx->addresses != NULL) {
-				bool found = FALSE;
-				const struct smtp_address * const *my_address;
-
-				my_address = ctx->addresses;
-				while (!found && *my_address != NULL) {
-					if ((found = _contains_my_address(headers, *my_address))) {
-						/* Avoid letting user determine SMTP sender directly */
-						smtp_from = (orig_recipient == NULL ?
-							     recipient : orig_recipient);
-						message_address_init_from_smtp(
-							&reply_from, NULL, *my_address);
-					}
-					my_address++;
-				}
-
-				if (found) break;
+			alt_address = _contains_alt_address(ctx, &hdr_addrs);
+			if (alt_address != NULL) {
+				/* Avoid letting user determine SMTP sender directly */
+				smtp_from = (orig_recipient == NULL ?
+					     recipient : orig_recipient);
+				message_address_init_from_smtp(
+					&reply_from, NULL, alt_address);
+				break;
 			}
 
 			/* Explicitly-configured user email address directly listed in
 			   headers? */
 			if (user_email != NULL &&
-			    _contains_my_address(headers, user_email)) {
+			    _contains_my_address(&hdr_addrs, user_email)) {
 				smtp_from = user_email;
 				message_address_init_from_smtp(
 					&reply_from, NULL, smtp_from);
@@ -1567,7 +1739,7 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 
 		/* Mark as replied */
 		if (seconds > 0) {
-			sieve_action_duplicate_mark(aenv, dupl_hash,
+			act_vacation_duplicate_mark(aenv, config, dupl_hash,
 						    sizeof(dupl_hash),
 						    ioloop_time + seconds);
 		}
@@ -2,11 +2,13 @@
  */
 
 #include "lib.h"
+#include "str.h"
 
 #include "sieve-common.h"
 #include "sieve-error.h"
 #include "sieve-settings.h"
 #include "sieve-extensions.h"
+#include "sieve-duplicate-dict.h"
 
 #include "ext-vacation-common.h"
 
@@ -18,7 +20,7 @@ bool ext_vacation_load
 	sieve_number_t min_period, max_period, default_period;
 	bool use_original_recipient, dont_check_recipient, send_from_recipient,
 		to_header_ignore_envelope;
-	const char *default_subject, *default_subject_template;
+	const char *default_subject, *default_subject_template, *dict_uri;
 
 	if ( *context != NULL ) {
 		ext_vacation_unload(ext);
@@ -79,6 +81,8 @@ bool ext_vacation_load
 		to_header_ignore_envelope = FALSE;
 	}
 
+	dict_uri = sieve_setting_get(svinst, "sieve_vacation_dict");
+
 	config = i_new(struct ext_vacation_config, 1);
 	config->min_period = min_period;
 	config->max_period = max_period;
@@ -89,6 +93,9 @@ bool ext_vacation_load
 	config->dont_check_recipient = dont_check_recipient;
 	config->send_from_recipient = send_from_recipient;
 	config->to_header_ignore_envelope = to_header_ignore_envelope;
+	config->reply_cache = i_new(struct ext_vacation_reply_cache, 1);
+	if (dict_uri != NULL && *dict_uri != '\0')
+		config->dict = sieve_duplicate_dict_create(svinst, dict_uri);
 
 	*context = (void *) config;
 
@@ -101,6 +108,16 @@ void ext_vacation_unload
 	struct ext_vacation_config *config =
 		(struct ext_vacation_config *) ext->context;
 
+	struct ext_vacation_reply_cache *cache = config->reply_cache;
+
+	i_free(cache->from);
+	i_free(cache->subject);
+	str_free(&cache->from_header);
+	str_free(&cache->subject_header);
+	i_free(cache);
+
+	sieve_duplicate_dict_free(&config->dict);
+
 	i_free(config->default_subject);
 	i_free(config->default_subject_template);
 	i_free(config);
@@ -11,6 +11,14 @@
 #define EXT_VACATION_DEFAULT_MIN_PERIOD (24*60*60)
 #define EXT_VACATION_DEFAULT_MAX_PERIOD 0
 
+/* Header fields of the last vacation reply that do not depend on the message
+   being replied to, so that these need not be encoded again while the same
+   vacation action keeps sending replies */
+struct ext_vacation_reply_cache {
+	char *from, *subject;
+	string_t *from_header, *subject_header;
+};
+
 struct ext_vacation_config {
 	unsigned int min_period;
 	unsigned int max_period;
@@ -21,6 +29,12 @@ struct ext_vacation_config {
 	bool dont_check_recipient;
 	bool send_from_recipient;
 	bool to_header_ignore_envelope;
+
+	/* Dict used instead of the duplicate database for tracking which
+	   senders were replied to (sieve_vacation_dict) */
+	struct sieve_duplicate_dict *dict;
+
+	struct ext_vacation_reply_cache *reply_cache;
 };
 
 /*
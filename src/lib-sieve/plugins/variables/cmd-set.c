@@ -176,10 +176,11 @@ static int cmd_set_operation_execute
 (const struct sieve_runtime_env *renv, sieve_size_t *address)
 {
 	const struct sieve_extension *this_ext = renv->oprtn->ext;
-	struct sieve_variable_storage *storage;
+	struct sieve_variable_storage *storage, *src_storage = NULL;
 	ARRAY_TYPE(sieve_variables_modifier) modifiers;
-	unsigned int var_index;
-	string_t *value;
+	struct sieve_operand operand;
+	unsigned int var_index, src_index = 0;
+	string_t *value = NULL;
 	int ret = SIEVE_EXEC_OK;
 
 	/*
@@ -190,9 +191,21 @@ static int cmd_set_operation_execute
 		(renv, address, "variable", &storage, &var_index)) <= 0 )
 		return ret;
 
-	if ( (ret=sieve_opr_string_read(renv, address, "string", &value)) <= 0 )
+	if ( (ret=sieve_operand_runtime_read
+		(renv, address, "string", &operand)) <= 0 )
 		return ret;
 
+	if ( sieve_operand_is_variable(&operand) ) {
+		/* Plain copy of another variable; defer reading it, so that the
+		   value can be shared rather than copied */
+		if ( (ret=sieve_variable_operand_read_data(renv, &operand, address,
+			"string", &src_storage, &src_index)) <= 0 )
+			return ret;
+	} else if ( (ret=sieve_opr_string_read_data
+		(renv, &operand, address, "string", &value)) <= 0 ) {
+		return ret;
+	}
+
 	if ( (ret=sieve_variables_modifiers_code_read
 		(renv, this_ext, address, &modifiers)) <= 0 )
 		return ret;
@@ -204,15 +217,31 @@ static int cmd_set_operation_execute
 	sieve_runtime_trace(renv, SIEVE_TRLVL_COMMANDS, "set command");
 	sieve_runtime_trace_descend(renv);
 
-	/* Apply modifiers */
-	if ( (ret=sieve_variables_modifiers_apply
-		(renv, this_ext, &modifiers, &value)) <= 0 )
-		return ret;
+	if ( value == NULL && array_is_created(&modifiers) &&
+		array_count(&modifiers) > 0 ) {
+		if ( !sieve_variable_get(src_storage, src_index, &value) )
+			return SIEVE_EXEC_FAILURE;
+		if ( value == NULL )
+			value = t_str_new(0);
+	}
 
-	/* Actually assign the value if all is well */
-	i_assert ( value != NULL );
-	if ( !sieve_variable_assign(storage, var_index, value) )
-		return SIEVE_EXEC_BIN_CORRUPT;
+	if ( value == NULL ) {
+		/* Share the value */
+		if ( !sieve_variable_assign_variable
+			(storage, var_index, src_storage, src_index) )
+			return SIEVE_EXEC_BIN_CORRUPT;
+		(void)sieve_variable_get(storage, var_index, &value);
+	} else {
+		/* Apply modifiers */
+		if ( (ret=sieve_variables_modifiers_apply
+			(renv, this_ext, &modifiers, &value)) <= 0 )
+			return ret;
+
+		/* Actually assign the value if all is well */
+		i_assert ( value != NULL );
+		if ( !sieve_variable_assign(storage, var_index, value) )
+			return SIEVE_EXEC_BIN_CORRUPT;
+	}
 
 	/* Trace */
 	if ( sieve_runtime_trace_active(renv, SIEVE_TRLVL_COMMANDS) ) {
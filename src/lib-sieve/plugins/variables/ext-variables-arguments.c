@@ -123,6 +123,9 @@ static bool ext_variables_match_value_argument_activate
 	arg->argument = sieve_argument_create
 		(ast, &match_value_argument, this_ext, 0);
 	arg->argument->data = (void *) POINTER_CAST(index);
+
+	/* Match values that are never referenced need not be recorded */
+	ext_variables_ast_use_match_value(this_ext, ast, index);
 	return TRUE;
 }
 
@@ -133,6 +133,9 @@ struct sieve_variable_scope {
 
 	HASH_TABLE(const char *, struct sieve_variable *) variables;
 	ARRAY(struct sieve_variable *) variable_index;
+
+	/* Highest match value index referenced plus one */
+	unsigned int match_values_used;
 };
 
 struct sieve_variable_scope_binary {
@@ -499,13 +502,22 @@ sieve_variable_scope_binary_get_size(
  * Variable storage
  */
 
+/* Variable values are shared between variables when one is assigned to the
+   other; the value is only copied once either of them is modified. */
+struct sieve_variable_value {
+	string_t *str;
+	unsigned int refcount;
+};
+
 struct sieve_variable_storage {
 	pool_t pool;
 	const struct sieve_extension *var_ext;
 	struct sieve_variable_scope *scope;
 	struct sieve_variable_scope_binary *scope_bin;
 	unsigned int max_size;
-	ARRAY(string_t *) var_values;
+	ARRAY(struct sieve_variable_value *) var_values;
+	/* Values no longer referenced by any variable */
+	ARRAY(struct sieve_variable_value *) spare_values;
 };
 
 struct sieve_variable_storage *
@@ -582,17 +594,81 @@ sieve_variable_get_varid(struct sieve_variable_storage *storage,
 	return sieve_ext_variables_get_varid(storage->scope->ext, index);
 }
 
+static struct sieve_variable_value *
+sieve_variable_value_create(struct sieve_variable_storage *storage)
+{
+	struct sieve_variable_value *value;
+
+	if (array_is_created(&storage->spare_values) &&
+	    array_count(&storage->spare_values) > 0) {
+		unsigned int last = array_count(&storage->spare_values) - 1;
+
+		value = array_idx_elem(&storage->spare_values, last);
+		array_delete(&storage->spare_values, last, 1);
+		str_truncate(value->str, 0);
+	} else {
+		value = p_new(storage->pool, struct sieve_variable_value, 1);
+		value->str = str_new(storage->pool, 256);
+	}
+	value->refcount = 1;
+	return value;
+}
+
+static void
+sieve_variable_value_release(struct sieve_variable_storage *storage,
+			     struct sieve_variable_value *value)
+{
+	i_assert(value->refcount > 0);
+	if (--value->refcount > 0)
+		return;
+
+	if (!array_is_created(&storage->spare_values))
+		p_array_init(&storage->spare_values, storage->pool, 4);
+	array_append(&storage->spare_values, &value, 1);
+}
+
+static struct sieve_variable_value *
+sieve_variable_value_get(struct sieve_variable_storage *storage,
+			 unsigned int index)
+{
+	if (index >= array_count(&storage->var_values))
+		return NULL;
+	return array_idx_elem(&storage->var_values, index);
+}
+
+/* Returns an unshared value for the variable; its current content is kept
+   when keep_content is TRUE. */
+static struct sieve_variable_value *
+sieve_variable_value_get_private(struct sieve_variable_storage *storage,
+				 unsigned int index, bool keep_content)
+{
+	struct sieve_variable_value *value, *new_value;
+
+	value = sieve_variable_value_get(storage, index);
+	if (value != NULL && value->refcount == 1)
+		return value;
+
+	new_value = sieve_variable_value_create(storage);
+	if (value != NULL) {
+		if (keep_content)
+			str_append_str(new_value->str, value->str);
+		sieve_variable_value_release(storage, value);
+	}
+	array_idx_set(&storage->var_values, index, &new_value);
+	return new_value;
+}
+
 bool sieve_variable_get(struct sieve_variable_storage *storage,
 			unsigned int index, string_t **value)
 {
+	struct sieve_variable_value *varval;
+
 	*value = NULL;
 
 	if (index < array_count(&storage->var_values)) {
-		string_t * const *varent;
-
-		varent = array_idx(&storage->var_values, index);
-
-		*value = *varent;
+		varval = array_idx_elem(&storage->var_values, index);
+		if (varval != NULL)
+			*value = varval->str;
 	} else if (!sieve_variable_valid(storage, index)) {
 		return FALSE;
 	}
@@ -603,18 +679,14 @@ bool sieve_variable_get(struct sieve_variable_storage *storage,
 bool sieve_variable_get_modifiable(struct sieve_variable_storage *storage,
 				   unsigned int index, string_t **value)
 {
-	string_t *dummy;
+	struct sieve_variable_value *varval;
 
-	if (value == NULL)
-		value = &dummy;
-
-	if (!sieve_variable_get(storage, index, value))
+	if (!sieve_variable_valid(storage, index))
 		return FALSE;
 
-	if (*value == NULL) {
-		*value = str_new(storage->pool, 256);
-		array_idx_set(&storage->var_values, index, value);
-	}
+	varval = sieve_variable_value_get_private(storage, index, TRUE);
+	if (value != NULL)
+		*value = varval->str;
 	return TRUE;
 }
 
@@ -623,17 +695,24 @@ bool sieve_variable_assign(struct sieve_variable_storage *storage,
 {
 	const struct ext_variables_config *config =
 		ext_variables_get_config(storage->var_ext);
-	string_t *varval;
+	struct sieve_variable_value *varval;
 
-	if (!sieve_variable_get_modifiable(storage, index, &varval))
+	if (!sieve_variable_valid(storage, index))
 		return FALSE;
 
-	str_truncate(varval, 0);
-	str_append_str(varval, value);
+	varval = sieve_variable_value_get(storage, index);
+	if (varval != NULL && varval->str == value) {
+		/* Assigned to itself */
+		return TRUE;
+	}
+	varval = sieve_variable_value_get_private(storage, index, FALSE);
+
+	str_truncate(varval->str, 0);
+	str_append_str(varval->str, value);
 
 	/* Just a precaution, caller should prevent this in the first place */
-	if (str_len(varval) > config->max_variable_size)
-		str_truncate_utf8(varval, config->max_variable_size);
+	if (str_len(varval->str) > config->max_variable_size)
+		str_truncate_utf8(varval->str, config->max_variable_size);
 
 	return TRUE;
 }
@@ -643,21 +722,59 @@ bool sieve_variable_assign_cstr(struct sieve_variable_storage *storage,
 {
 	const struct ext_variables_config *config =
 		ext_variables_get_config(storage->var_ext);
-	string_t *varval;
+	struct sieve_variable_value *varval;
 
-	if (!sieve_variable_get_modifiable(storage, index, &varval))
+	if (!sieve_variable_valid(storage, index))
 		return FALSE;
 
-	str_truncate(varval, 0);
-	str_append(varval, value);
+	varval = sieve_variable_value_get_private(storage, index, FALSE);
+
+	str_truncate(varval->str, 0);
+	str_append(varval->str, value);
 
 	/* Just a precaution, caller should prevent this in the first place */
-	if (str_len(varval) > config->max_variable_size)
-		str_truncate_utf8(varval, config->max_variable_size);
+	if (str_len(varval->str) > config->max_variable_size)
+		str_truncate_utf8(varval->str, config->max_variable_size);
 
 	return TRUE;
 }
 
+bool sieve_variable_assign_variable(struct sieve_variable_storage *storage,
+				    unsigned int index,
+				    struct sieve_variable_storage *src_storage,
+				    unsigned int src_index)
+{
+	struct sieve_variable_value *varval, *src_varval;
+	string_t *src_value;
+
+	if (storage != src_storage) {
+		/* Values are only shared within one storage */
+		if (!sieve_variable_get(src_storage, src_index, &src_value))
+			return FALSE;
+		if (src_value == NULL)
+			return sieve_variable_assign_cstr(storage, index, "");
+		return sieve_variable_assign(storage, index, src_value);
+	}
+
+	if (!sieve_variable_valid(storage, index) ||
+	    !sieve_variable_valid(storage, src_index))
+		return FALSE;
+
+	src_varval = sieve_variable_value_get(storage, src_index);
+	if (src_varval == NULL)
+		return sieve_variable_assign_cstr(storage, index, "");
+
+	varval = sieve_variable_value_get(storage, index);
+	if (varval == src_varval)
+		return TRUE;
+
+	src_varval->refcount++;
+	if (varval != NULL)
+		sieve_variable_value_release(storage, varval);
+	array_idx_set(&storage->var_values, index, &src_varval);
+	return TRUE;
+}
+
 /*
  * AST Context
  */
@@ -702,6 +819,17 @@ ext_variables_ast_get_local_scope(const struct sieve_extension *this_ext,
 	return local_scope;
 }
 
+void ext_variables_ast_use_match_value(const struct sieve_extension *this_ext,
+				       struct sieve_ast *ast,
+				       unsigned int index)
+{
+	struct sieve_variable_scope *local_scope =
+		ext_variables_ast_get_local_scope(this_ext, ast);
+
+	if (local_scope != NULL && index >= local_scope->match_values_used)
+		local_scope->match_values_used = index + 1;
+}
+
 /*
  * Validator context
  */
@@ -819,6 +947,10 @@ bool ext_variables_generator_load(const struct sieve_extension *ext,
 	}
 
 	sieve_binary_resolve_offset(cgenv->sblock, jump);
+
+	/* Number of match values the script can reference */
+	sieve_binary_emit_unsigned(cgenv->sblock,
+				   local_scope->match_values_used);
 	return TRUE;
 }
 
@@ -883,18 +1015,27 @@ bool ext_variables_interpreter_load(const struct sieve_extension *ext,
 {
 	const struct sieve_execute_env *eenv = renv->exec_env;
 	struct sieve_variable_scope_binary *scpbin;
+	unsigned int match_values_used;
 
 	scpbin = sieve_variable_scope_binary_read(eenv->svinst, ext, NULL,
 						  renv->sblock, address);
 	if (scpbin == NULL)
 		return FALSE;
+	if (!sieve_binary_read_unsigned(renv->sblock, address,
+					&match_values_used)) {
+		e_error(eenv->svinst->event, "variables: "
+			"failed to read match value count");
+		return FALSE;
+	}
 
 	/* Create our context */
 	(void)ext_variables_interpreter_context_create(ext, renv->interp,
 						       scpbin);
 
-	/* Enable support for match values */
+	/* Enable support for match values; only those referenced by the
+	   script are recorded */
 	(void)sieve_match_values_set_enabled(renv, TRUE);
+	sieve_match_values_set_limit(renv, match_values_used);
 
 	return TRUE;
 }
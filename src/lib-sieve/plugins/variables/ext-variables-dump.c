@@ -76,9 +76,20 @@ bool ext_variables_code_dump
 {
 	struct ext_variables_dump_context *dctx;
 	struct sieve_variable_scope *local_scope;
+	unsigned int match_values_used;
 
 	local_scope = sieve_variable_scope_binary_dump
 		(ext->svinst, ext, NULL, denv, address);
+	if ( local_scope == NULL )
+		return FALSE;
+
+	sieve_code_mark(denv);
+	if ( !sieve_binary_read_unsigned
+		(denv->sblock, address, &match_values_used) ) {
+		sieve_variable_scope_unref(&local_scope);
+		return FALSE;
+	}
+	sieve_code_dumpf(denv, "MATCH VALUES USED: %u", match_values_used);
 
 	dctx = ext_variables_dump_get_context(ext, denv);
 	dctx->local_scope = local_scope;
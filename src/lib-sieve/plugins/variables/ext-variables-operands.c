@@ -262,11 +262,16 @@ static int opr_match_value_read
 		 * actually read the argument.
 		 	*/
 		if ( str_r != NULL ) {
-			sieve_match_values_get(renv, index, str_r);
+			string_t *value;
 
-			if ( *str_r == NULL )
-				*str_r = t_str_new(0);
-			else if ( str_len(*str_r) > config->max_variable_size )
+			/* Match value buffers are reused by later matches, so
+			   return a copy */
+			sieve_match_values_get(renv, index, &value);
+
+			*str_r = t_str_new(value == NULL ? 0 : str_len(value));
+			if ( value != NULL )
+				str_append_str(*str_r, value);
+			if ( str_len(*str_r) > config->max_variable_size )
 				str_truncate_utf8(*str_r, config->max_variable_size);
 		}
 
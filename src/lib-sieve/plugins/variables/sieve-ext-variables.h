@@ -202,6 +202,11 @@ bool sieve_variable_assign
 bool sieve_variable_assign_cstr
 	(struct sieve_variable_storage *storage, unsigned int index,
 		const char *value);
+/* Assigns the value of another variable; within the same storage, the value
+   is shared until either variable is modified. */
+bool sieve_variable_assign_variable
+	(struct sieve_variable_storage *storage, unsigned int index,
+		struct sieve_variable_storage *src_storage, unsigned int src_index);
 bool sieve_variable_get_identifier
 	(struct sieve_variable_storage *storage, unsigned int index,
 		const char **identifier);
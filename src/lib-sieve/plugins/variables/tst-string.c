@@ -1,6 +1,9 @@
 /* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
  */
 
+#include "lib.h"
+#include "str.h"
+
 #include "sieve-common.h"
 #include "sieve-commands.h"
 #include "sieve-stringlist.h"
@@ -28,6 +31,9 @@ static bool tst_string_registered
 		struct sieve_command_registration *cmd_reg);
 static bool tst_string_validate
 	(struct sieve_validator *valdtr, struct sieve_command *tst);
+static bool tst_string_validate_const
+	(struct sieve_validator *valdtr, struct sieve_command *tst,
+		int *const_current, int const_next);
 static bool tst_string_generate
 	(const struct sieve_codegen_env *cgenv, struct sieve_command *ctx);
 
@@ -40,6 +46,7 @@ const struct sieve_command_def tst_string = {
 	.block_required = FALSE,
 	.registered = tst_string_registered,
 	.validate = tst_string_validate,
+	.validate_const = tst_string_validate_const,
 	.generate = tst_string_generate
 };
 
@@ -121,6 +128,99 @@ static bool tst_string_validate
 		(valdtr, tst, arg, &mcht_default, &cmp_default);
 }
 
+static bool tst_string_literal_list
+(struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *item;
+
+	if ( sieve_ast_argument_type(arg) == SAAT_STRING )
+		return sieve_argument_is_string_literal(arg);
+	if ( sieve_ast_argument_type(arg) != SAAT_STRING_LIST )
+		return FALSE;
+
+	item = sieve_ast_strlist_first(arg);
+	while ( item != NULL ) {
+		if ( !sieve_argument_is_string_literal(item) )
+			return FALSE;
+		item = sieve_ast_strlist_next(item);
+	}
+	return TRUE;
+}
+
+static struct sieve_ast_argument *tst_string_list_item
+(struct sieve_ast_argument *arg, struct sieve_ast_argument *prev)
+{
+	if ( sieve_ast_argument_type(arg) == SAAT_STRING )
+		return ( prev == NULL ? arg : NULL );
+	return ( prev == NULL ?
+		sieve_ast_strlist_first(arg) : sieve_ast_strlist_next(prev) );
+}
+
+static bool tst_string_validate_const
+(struct sieve_validator *valdtr ATTR_UNUSED, struct sieve_command *tst,
+	int *const_current, int const_next ATTR_UNUSED)
+{
+	struct sieve_ast_argument *arg = sieve_command_first_argument(tst);
+	struct sieve_ast_argument *source, *keys, *val, *key;
+	const struct sieve_comparator cmp_default =
+		SIEVE_COMPARATOR_DEFAULT(i_ascii_casemap_comparator);
+	const struct sieve_comparator *cmp = &cmp_default;
+	const struct sieve_match_type_def *mcht_def = &is_match_type;
+
+	*const_current = -1;
+
+	/* Only the :is match type is evaluated here; other match types may
+	   assign match values */
+	while ( arg != NULL && arg != tst->first_positional ) {
+		if ( sieve_argument_is_comparator(arg) ) {
+			cmp = sieve_comparator_tag_get(arg);
+		} else if ( sieve_argument_is_match_type(arg) ) {
+			const struct sieve_match_type_context *mtctx =
+				(const struct sieve_match_type_context *)
+					arg->argument->data;
+
+			mcht_def = mtctx->match_type->def;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+	if ( mcht_def != &is_match_type || cmp == NULL || cmp->def == NULL ||
+		cmp->def->compare == NULL )
+		return TRUE;
+
+	source = tst->first_positional;
+	keys = ( source == NULL ? NULL : sieve_ast_argument_next(source) );
+	if ( keys == NULL || !tst_string_literal_list(source) ||
+		!tst_string_literal_list(keys) )
+		return TRUE;
+
+	/* Both operands are constant; determine the outcome now */
+	*const_current = 0;
+	val = NULL;
+	while ( (val=tst_string_list_item(source, val)) != NULL ) {
+		const string_t *val_str = sieve_ast_argument_str(val);
+
+		key = NULL;
+		while ( (key=tst_string_list_item(keys, key)) != NULL ) {
+			const string_t *key_str = sieve_ast_argument_str(key);
+
+			if ( str_len(val_str) == 0 ) {
+				if ( str_len(key_str) == 0 ) {
+					*const_current = 1;
+					return TRUE;
+				}
+				continue;
+			}
+			if ( cmp->def->compare(cmp,
+				(const char *)str_data(val_str), str_len(val_str),
+				(const char *)str_data(key_str), str_len(key_str)) == 0 ) {
+				*const_current = 1;
+				return TRUE;
+			}
+		}
+	}
+	return TRUE;
+}
+
 /*
  * Test generation
  */
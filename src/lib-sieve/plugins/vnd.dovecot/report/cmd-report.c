@@ -602,9 +602,18 @@ act_report_send(const struct sieve_action_exec_env *aenv,
 				input, hdr_size.physical_size);
 		}
 	} else {
-		ret = mail_get_stream(msgdata->mail, NULL, NULL, &input);
-		if (ret >= 0)
+		struct message_size hdr_size;
+
+		ret = mail_get_stream(msgdata->mail, &hdr_size, NULL, &input);
+		if (ret >= 0 && config->max_message_size > 0) {
+			/* Include the first part of large messages only; the
+			   header is always included completely */
+			input = i_stream_create_limit(
+				input, I_MAX(config->max_message_size,
+					     hdr_size.physical_size));
+		} else if (ret >= 0) {
 			i_stream_ref(input);
+		}
 	}
 	if (ret < 0) {
 		sieve_smtp_abort(sctx);
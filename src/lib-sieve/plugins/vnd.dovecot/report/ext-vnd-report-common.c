@@ -7,6 +7,7 @@
 
 #include "sieve-common.h"
 #include "sieve-extensions.h"
+#include "sieve-settings.h"
 
 #include "ext-vnd-report-common.h"
 
@@ -20,6 +21,9 @@ bool ext_report_load
 
 	(void)sieve_address_source_parse_from_setting(svinst,
 		svinst->pool, "sieve_report_from", &config->report_from);
+	if (!sieve_setting_get_size_value(svinst,
+		"sieve_report_max_message_size", &config->max_message_size))
+		config->max_message_size = 0;
 
 	*context = (void *) config;
 	return TRUE;
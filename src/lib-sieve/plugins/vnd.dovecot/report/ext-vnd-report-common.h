@@ -7,6 +7,9 @@
 
 struct ext_report_config {
 	struct sieve_address_source report_from;
+	/* Maximum size of the original message included in a report;
+	   0 means unlimited */
+	size_t max_message_size;
 };
 
 /*
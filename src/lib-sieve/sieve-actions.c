@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "strfuncs.h"
 #include "ioloop.h"
@@ -28,6 +29,7 @@
 #include "sieve-actions.h"
 #include "sieve-message.h"
 #include "sieve-smtp.h"
+#include "sieve.h"
 
 /*
  * Action execution environment
@@ -284,9 +286,21 @@ void sieve_act_store_add_flags(const struct sieve_action_exec_env *aenv,
 			p_array_init(&trans->keywords, pool, 2);
 		}
 
+		/* Several side effects commonly add the same keywords; collect
+		   each only once */
 		kw = keywords;
 		while (*kw != NULL) {
-			array_append(&trans->keywords, kw, 1);
+			const char *const *kw_old;
+			bool found = FALSE;
+
+			array_foreach(&trans->keywords, kw_old) {
+				if (strcmp(*kw_old, *kw) == 0) {
+					found = TRUE;
+					break;
+				}
+			}
+			if (!found)
+				array_append(&trans->keywords, kw, 1);
 			kw++;
 		}
 	}
@@ -408,6 +422,109 @@ act_store_mailbox_alloc(const struct sieve_action_exec_env *aenv,
 	return TRUE;
 }
 
+/*
+ * Store batch
+ */
+
+struct sieve_store_batch_mailbox {
+	const char *name;
+	struct mailbox *box;
+	struct mailbox_transaction_context *mail_trans;
+	unsigned int saved;
+};
+
+struct sieve_store_batch {
+	pool_t pool;
+	ARRAY(struct sieve_store_batch_mailbox) mailboxes;
+};
+
+struct sieve_store_batch *sieve_store_batch_create(void)
+{
+	struct sieve_store_batch *batch;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_store_batch", 1024);
+	batch = p_new(pool, struct sieve_store_batch, 1);
+	batch->pool = pool;
+	p_array_init(&batch->mailboxes, pool, 8);
+
+	return batch;
+}
+
+static struct sieve_store_batch_mailbox *
+sieve_store_batch_get_mailbox(const struct sieve_action_exec_env *aenv,
+			      struct sieve_store_batch *batch,
+			      const char *mailbox, enum mail_error *error_code_r,
+			      const char **error_r)
+{
+	struct sieve_store_batch_mailbox *bboxes, *bbox;
+	struct mailbox *box;
+	unsigned int count, i;
+
+	bboxes = array_get_modifiable(&batch->mailboxes, &count);
+	for (i = 0; i < count; i++) {
+		if (strcmp(bboxes[i].name, mailbox) == 0)
+			return &bboxes[i];
+	}
+
+	if (!act_store_mailbox_alloc(aenv, mailbox, &box,
+				     error_code_r, error_r))
+		return NULL;
+
+	bbox = array_append_space(&batch->mailboxes);
+	bbox->name = p_strdup(batch->pool, mailbox);
+	bbox->box = box;
+	return bbox;
+}
+
+static void
+sieve_store_batch_free(struct sieve_store_batch **_batch, bool commit,
+		       const char **error_r)
+{
+	struct sieve_store_batch *batch = *_batch;
+	struct sieve_store_batch_mailbox *bbox;
+	const char *error = NULL;
+
+	*_batch = NULL;
+
+	array_foreach_modifiable(&batch->mailboxes, bbox) {
+		if (bbox->mail_trans == NULL) {
+			/* Nothing saved */
+		} else if (!commit) {
+			mailbox_transaction_rollback(&bbox->mail_trans);
+		} else if (mailbox_transaction_commit(&bbox->mail_trans) < 0 &&
+			   error == NULL) {
+			error = t_strdup_printf(
+				"failed to store %u message(s) "
+				"into mailbox '%s': %s", bbox->saved,
+				str_sanitize(bbox->name, 256),
+				mailbox_get_last_internal_error(bbox->box,
+								NULL));
+		}
+		mailbox_free(&bbox->box);
+	}
+	pool_unref(&batch->pool);
+
+	if (error_r != NULL)
+		*error_r = error;
+}
+
+int sieve_store_batch_commit(struct sieve_store_batch **_batch,
+			     const char **error_r)
+{
+	sieve_store_batch_free(_batch, TRUE, error_r);
+	return (*error_r == NULL ? 0 : -1);
+}
+
+void sieve_store_batch_rollback(struct sieve_store_batch **_batch)
+{
+	sieve_store_batch_free(_batch, FALSE, NULL);
+}
+
+/*
+ * Store action
+ */
+
 static int
 act_store_start(const struct sieve_action_exec_env *aenv, void **tr_context)
 {
@@ -417,6 +534,7 @@ act_store_start(const struct sieve_action_exec_env *aenv, void **tr_context)
 	const struct sieve_execute_env *eenv = aenv->exec_env;
 	const struct sieve_script_env *senv = eenv->scriptenv;
 	struct act_store_transaction *trans;
+	struct sieve_store_batch_mailbox *batch_box = NULL;
 	struct mailbox *box = NULL;
 	pool_t pool = sieve_result_pool(aenv->result);
 	const char *error = NULL;
@@ -440,7 +558,15 @@ act_store_start(const struct sieve_action_exec_env *aenv, void **tr_context)
 	   to NULL. This implementation will then skip actually storing the
 	   message.
 	 */
-	if (senv->user != NULL) {
+	if (senv->user != NULL && senv->store_batch != NULL) {
+		batch_box = sieve_store_batch_get_mailbox(
+			aenv, senv->store_batch, ctx->mailbox,
+			&error_code, &error);
+		if (batch_box == NULL)
+			alloc_failed = TRUE;
+		else
+			box = batch_box->box;
+	} else if (senv->user != NULL) {
 		if (!act_store_mailbox_alloc(aenv, ctx->mailbox, &box,
 					     &error_code, &error))
 			alloc_failed = TRUE;
@@ -453,6 +579,7 @@ act_store_start(const struct sieve_action_exec_env *aenv, void **tr_context)
 
 	trans->context = ctx;
 	trans->box = box;
+	trans->batch_box = batch_box;
 	trans->flags = 0;
 
 	trans->mailbox_name = ctx->mailbox;
@@ -553,6 +680,51 @@ static bool have_equal_keywords(struct mail *mail, struct mail_keywords *new_kw)
 	return TRUE;
 }
 
+static int
+act_store_save(const struct sieve_action_exec_env *aenv,
+	       struct act_store_transaction *trans, struct mail *mail)
+{
+	const struct sieve_execute_env *eenv = aenv->exec_env;
+	struct mail_save_context *save_ctx;
+	struct mail_keywords *keywords = NULL;
+	int status = SIEVE_EXEC_OK;
+
+	/* Store the message */
+	save_ctx = mailbox_save_alloc(trans->mail_trans);
+
+	/* Apply keywords and flags that side-effects may have added */
+	if (trans->flags_altered) {
+		keywords = act_store_keywords_create(aenv, &trans->keywords,
+						     trans->box, FALSE);
+
+		if (trans->flags != 0 || keywords != NULL) {
+			eenv->exec_status->significant_action_executed = TRUE;
+			mailbox_save_set_flags(save_ctx, trans->flags, keywords);
+		}
+	} else {
+		mailbox_save_copy_flags(save_ctx, mail);
+	}
+
+	if (mailbox_save_using_mail(&save_ctx, mail) < 0) {
+		sieve_act_store_get_storage_error(aenv, trans);
+		e_debug(aenv->event, "Failed to save to mailbox %s: %s",
+			trans->mailbox_identifier, trans->error);
+
+		status = (trans->error_code == MAIL_ERROR_TEMP ?
+			  SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
+	} else {
+		e_debug(aenv->event, "Saving to mailbox %s successful so far",
+			trans->mailbox_identifier);
+		eenv->exec_status->significant_action_executed = TRUE;
+	}
+
+	/* Deallocate keywords */
+ 	if (keywords != NULL)
+ 		mailbox_keywords_unref(&keywords);
+
+	return status;
+}
+
 static int
 act_store_execute(const struct sieve_action_exec_env *aenv, void *tr_context,
 		  bool *keep)
@@ -563,11 +735,10 @@ act_store_execute(const struct sieve_action_exec_env *aenv, void *tr_context,
 		(struct act_store_transaction *)tr_context;
 	struct mail *mail = (action->mail != NULL ?
 			     action->mail : eenv->msgdata->mail);
-	struct mail_save_context *save_ctx;
 	struct mail_keywords *keywords = NULL;
 	struct mailbox *box;
 	bool backends_equal = FALSE;
-	int status = SIEVE_EXEC_OK;
+	int status;
 
 	/* Verify transaction */
 	if (trans == NULL)
@@ -671,42 +842,19 @@ act_store_execute(const struct sieve_action_exec_env *aenv, void *tr_context,
 		   SIEVE_SCRIPT_DEFAULT_MAILBOX(eenv->scriptenv)) == 0)
 		eenv->exec_status->tried_default_save = TRUE;
 
+	/* Batched stores are saved into the shared transaction upon commit,
+	   since a save cannot be undone without rolling back the saves of
+	   other messages */
+	if (trans->batch_box != NULL) {
+		*keep = FALSE;
+		return SIEVE_EXEC_OK;
+	}
+
 	/* Start mail transaction */
 	trans->mail_trans = mailbox_transaction_begin(
 		box, MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
 
-	/* Store the message */
-	save_ctx = mailbox_save_alloc(trans->mail_trans);
-
-	/* Apply keywords and flags that side-effects may have added */
-	if (trans->flags_altered) {
-		keywords = act_store_keywords_create(aenv, &trans->keywords,
-						     box, FALSE);
-
-		if (trans->flags != 0 || keywords != NULL) {
-			eenv->exec_status->significant_action_executed = TRUE;
-			mailbox_save_set_flags(save_ctx, trans->flags, keywords);
-		}
-	} else {
-		mailbox_save_copy_flags(save_ctx, mail);
-	}
-
-	if (mailbox_save_using_mail(&save_ctx, mail) < 0) {
-		sieve_act_store_get_storage_error(aenv, trans);
-		e_debug(aenv->event, "Failed to save to mailbox %s: %s",
-			trans->mailbox_identifier, trans->error);
-
-		status = (trans->error_code == MAIL_ERROR_TEMP ?
-			  SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
-	} else {
-		e_debug(aenv->event, "Saving to mailbox %s successful so far",
-			trans->mailbox_identifier);
-		eenv->exec_status->significant_action_executed = TRUE;
-	}
-
-	/* Deallocate keywords */
- 	if (keywords != NULL)
- 		mailbox_keywords_unref(&keywords);
+	status = act_store_save(aenv, trans, mail);
 
 	/* Cancel implicit keep if all went well so far */
 	*keep = (status < SIEVE_EXEC_OK);
@@ -791,12 +939,52 @@ act_store_log_status(struct act_store_transaction *trans,
 
 static void act_store_cleanup(struct act_store_transaction *trans)
 {
+	if (trans->batch_box != NULL) {
+		/* Mailbox and transaction belong to the store batch */
+		trans->box = NULL;
+		return;
+	}
 	if (trans->mail_trans != NULL)
 		mailbox_transaction_rollback(&trans->mail_trans);
 	if (trans->box != NULL)
 		mailbox_free(&trans->box);
 }
 
+static int
+act_store_commit_batched(const struct sieve_action_exec_env *aenv,
+			 struct act_store_transaction *trans)
+{
+	const struct sieve_action *action = aenv->action;
+	const struct sieve_execute_env *eenv = aenv->exec_env;
+	struct sieve_store_batch_mailbox *bbox = trans->batch_box;
+	struct mail *mail = (action->mail != NULL ?
+			     action->mail : eenv->msgdata->mail);
+	int ret;
+
+	eenv->exec_status->last_storage = mailbox_get_storage(bbox->box);
+
+	if (bbox->mail_trans == NULL) {
+		bbox->mail_trans = mailbox_transaction_begin(
+			bbox->box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+			"sieve_store_batch");
+	}
+
+	trans->mail_trans = bbox->mail_trans;
+	ret = act_store_save(aenv, trans, mail);
+	trans->mail_trans = NULL;
+
+	if (ret == SIEVE_EXEC_OK) {
+		bbox->saved++;
+		eenv->exec_status->message_saved = TRUE;
+	} else {
+		eenv->exec_status->store_failed = TRUE;
+	}
+
+	act_store_log_status(trans, aenv, FALSE, (ret == SIEVE_EXEC_OK));
+	act_store_cleanup(trans);
+	return ret;
+}
+
 static int
 act_store_commit(const struct sieve_action_exec_env *aenv, void *tr_context)
 {
@@ -838,6 +1026,9 @@ act_store_commit(const struct sieve_action_exec_env *aenv, void *tr_context)
 		return ret;
 	}
 
+	if (trans->batch_box != NULL)
+		return act_store_commit_batched(aenv, trans);
+
 	i_assert(trans->box != NULL);
 	i_assert(trans->mail_trans != NULL);
 
@@ -219,6 +219,8 @@ struct act_store_transaction {
 	struct act_store_context *context;
 	struct mailbox *box;
 	struct mailbox_transaction_context *mail_trans;
+	/* Mailbox shared through the script environment's store batch */
+	struct sieve_store_batch_mailbox *batch_box;
 
 	const char *mailbox_name;
 	const char *mailbox_identifier;
@@ -8,6 +8,7 @@
 #include "message-address.h"
 
 #include "sieve-common.h"
+#include "sieve-message.h"
 #include "sieve-runtime-trace.h"
 
 #include "sieve-address.h"
@@ -152,10 +153,17 @@ sieve_header_address_list_next_item(struct sieve_address_list *_addrlist,
 				str_sanitize(str_c(value_item), 80));
 		}
 
-		addrlist->cur_address = message_address_parse(
-			pool_datastack_create(),
-			(const unsigned char *)str_data(value_item),
-			str_len(value_item), 256, 0);
+		if (runenv->msgctx != NULL) {
+			addrlist->cur_address =
+				sieve_message_parse_address_list(
+					runenv->msgctx, str_c(value_item),
+					str_len(value_item));
+		} else {
+			addrlist->cur_address = message_address_parse(
+				pool_datastack_create(),
+				(const unsigned char *)str_data(value_item),
+				str_len(value_item), 256, 0);
+		}
 	}
 	i_unreached();
 }
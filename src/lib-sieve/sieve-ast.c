@@ -60,7 +60,7 @@ struct sieve_ast *sieve_ast_create(struct sieve_script *script)
 	struct sieve_ast *ast;
 	unsigned int ext_count;
 
-	pool = pool_alloconly_create("sieve_ast", 32768);
+	pool = sieve_compile_pool_get(sieve_script_svinst(script));
 	ast = p_new(pool, struct sieve_ast, 1);
 	ast->pool = pool;
 	ast->refcount = 1;
@@ -106,7 +106,7 @@ void sieve_ast_unref(struct sieve_ast **ast)
 	}
 
 	/* Destroy AST */
-	pool_unref(&(*ast)->pool);
+	sieve_compile_pool_put((*ast)->svinst, &(*ast)->pool);
 
 	*ast = NULL;
 }
@@ -464,6 +464,53 @@ struct sieve_ast_node *sieve_ast_node_detach(struct sieve_ast_node *first)
 	return sieve_ast_list_detach(first, 1);
 }
 
+void sieve_ast_node_reorder_tests(struct sieve_ast_node *node,
+				  struct sieve_ast_node *const *tests,
+				  unsigned int count)
+{
+	struct sieve_ast_list *list = node->tests;
+	unsigned int i;
+
+	i_assert(list != NULL && list->len == count);
+
+	list->head = NULL;
+	list->tail = NULL;
+	list->len = 0;
+	for (i = 0; i < count; i++) {
+		i_assert(tests[i]->list == list);
+		(void)sieve_ast_list_add(list, tests[i]);
+	}
+}
+
+static void
+sieve_ast_list_set_parent(struct sieve_ast_list *list,
+			  struct sieve_ast_node *parent)
+{
+	struct sieve_ast_node *node;
+
+	if (list == NULL)
+		return;
+	for (node = list->head; node != NULL; node = node->next)
+		node->parent = parent;
+}
+
+void sieve_ast_node_swap_children(struct sieve_ast_node *node1,
+				  struct sieve_ast_node *node2)
+{
+	struct sieve_ast_list *tests = node1->tests;
+	struct sieve_ast_list *commands = node1->commands;
+
+	node1->tests = node2->tests;
+	node1->commands = node2->commands;
+	node2->tests = tests;
+	node2->commands = commands;
+
+	sieve_ast_list_set_parent(node1->tests, node1);
+	sieve_ast_list_set_parent(node1->commands, node1);
+	sieve_ast_list_set_parent(node2->tests, node2);
+	sieve_ast_list_set_parent(node2->commands, node2);
+}
+
 const char *sieve_ast_type_name(enum sieve_ast_type ast_type)
 {
 	switch (ast_type) {
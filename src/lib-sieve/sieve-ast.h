@@ -74,10 +74,14 @@ enum sieve_ast_type {
  * AST Nodes
  */
 
+/* Large generated scripts produce a great many of these, so the members are
+   ordered to avoid padding. */
+
 /* Argument node */
 
 struct sieve_ast_argument {
 	enum sieve_ast_argument_type type;
+	unsigned int source_line;
 
 	/* Back reference to the AST object */
 	struct sieve_ast *ast;
@@ -96,8 +100,6 @@ struct sieve_ast_argument {
 		sieve_number_t number;
 	} _value;
 
-	unsigned int source_line;
-
 	/* Assigned during validation */
 
 	/* Argument associated with this ast element  */
@@ -110,6 +112,9 @@ struct sieve_ast_argument {
 struct sieve_ast_node {
 	enum sieve_ast_type type;
 
+	/* The location in the file where this command was started */
+	unsigned int source_line;
+
 	/* Back reference to the AST object */
 	struct sieve_ast *ast;
 
@@ -122,11 +127,9 @@ struct sieve_ast_node {
 	struct sieve_ast_node *prev;
 
 	/* Commands (NULL if not allocated) */
-	bool block;
 	struct sieve_ast_list *commands;
 
 	/* Tests (NULL if not allocated)*/
-	bool test_list;
 	struct sieve_ast_list *tests;
 
 	/* Arguments (NULL if not allocated) */
@@ -135,13 +138,15 @@ struct sieve_ast_node {
 	/* Identifier of command or test */
 	const char *identifier;
 
-	/* The location in the file where this command was started */
-	unsigned int source_line;
-
 	/* Assigned during validation */
 
 	/* Context */
 	struct sieve_command *command;
+
+	/* Command has a block */
+	bool block:1;
+	/* Test has a test list */
+	bool test_list:1;
 };
 
 /*
@@ -217,6 +222,14 @@ sieve_ast_command_create(struct sieve_ast_node *parent, const char *identifier,
 
 struct sieve_ast_node *
 sieve_ast_node_detach(struct sieve_ast_node *first);
+/* Rebuilds the test list of the node in the given order; tests must contain
+   exactly the current tests of the node. */
+void sieve_ast_node_reorder_tests(struct sieve_ast_node *node,
+				  struct sieve_ast_node *const *tests,
+				  unsigned int count);
+/* Exchanges the tests and command blocks of both nodes */
+void sieve_ast_node_swap_children(struct sieve_ast_node *node1,
+				  struct sieve_ast_node *node2);
 
 const char *sieve_ast_type_name(enum sieve_ast_type ast_type);
 
@@ -0,0 +1,302 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+#include "ioloop.h"
+
+#include "sieve-common.h"
+#include "sieve-script.h"
+#include "sieve-binary-private.h"
+
+#include "sieve-binary-cache.h"
+
+#include <sys/stat.h>
+
+struct sieve_binary_cache_entry {
+	struct sieve_binary_cache_entry *prev, *next;
+
+	char *key;
+	struct sieve_binary *sbin;
+
+	/* Identity of the binary file */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+
+	/* When the binary was last checked against the disk */
+	time_t validated;
+	/* When the binary was last looked up */
+	time_t last_used;
+	/* Memory held by the binary's loaded blocks */
+	size_t memory;
+};
+
+struct sieve_binary_cache {
+	struct sieve_instance *svinst;
+	struct event *event;
+
+	HASH_TABLE(char *, struct sieve_binary_cache_entry *) entries;
+	/* Most recently used first */
+	struct sieve_binary_cache_entry *head, *tail;
+	unsigned int count, max_entries;
+	size_t memory;
+
+	uint64_t hits, misses, evictions;
+};
+
+static const char *sieve_binary_cache_key(struct sieve_script *script)
+{
+	const char *name = sieve_script_name(script);
+
+	return t_strconcat(sieve_script_location(script), "\n",
+			   (name == NULL ? "" : name), NULL);
+}
+
+struct sieve_binary_cache *
+sieve_binary_cache_create(struct sieve_instance *svinst,
+			  unsigned int max_entries)
+{
+	struct sieve_binary_cache *cache;
+
+	cache = i_new(struct sieve_binary_cache, 1);
+	cache->svinst = svinst;
+	cache->max_entries = max_entries;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+
+	cache->event = event_create(svinst->event);
+	event_set_append_log_prefix(cache->event, "binary cache: ");
+
+	return cache;
+}
+
+static void
+sieve_binary_cache_entry_free(struct sieve_binary_cache *cache,
+			      struct sieve_binary_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	i_assert(cache->count > 0);
+	cache->count--;
+	i_assert(cache->memory >= entry->memory);
+	cache->memory -= entry->memory;
+
+	sieve_binary_unref(&entry->sbin);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+void sieve_binary_cache_clear(struct sieve_binary_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	while (cache->head != NULL)
+		sieve_binary_cache_entry_free(cache, cache->head);
+}
+
+size_t sieve_binary_cache_get_memory_usage(struct sieve_binary_cache *cache)
+{
+	if (cache == NULL)
+		return 0;
+	return cache->memory;
+}
+
+void sieve_binary_cache_get_statistics(struct sieve_binary_cache *cache,
+				       struct sieve_cache_statistics *stats_r)
+{
+	i_zero(stats_r);
+	if (cache == NULL)
+		return;
+
+	stats_r->hits = cache->hits;
+	stats_r->misses = cache->misses;
+	stats_r->evictions = cache->evictions;
+	stats_r->entries = cache->count;
+	stats_r->memory = cache->memory;
+}
+
+void sieve_binary_cache_free(struct sieve_binary_cache **_cache)
+{
+	struct sieve_binary_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (cache == NULL)
+		return;
+
+	sieve_binary_cache_clear(cache);
+	hash_table_destroy(&cache->entries);
+	event_unref(&cache->event);
+	i_free(cache);
+}
+
+static void
+sieve_binary_cache_event(struct sieve_binary_cache *cache,
+			 struct sieve_script *script, bool hit)
+{
+	struct event_passthrough *e;
+
+	if (hit)
+		cache->hits++;
+	else
+		cache->misses++;
+
+	e = event_create_passthrough(cache->event)->
+		set_name(hit ? "sieve_binary_cache_hit" :
+			 "sieve_binary_cache_miss")->
+		add_str("script_location", sieve_script_location(script))->
+		add_int("hits", cache->hits)->
+		add_int("misses", cache->misses)->
+		add_int("entries", cache->count)->
+		add_int("memory", cache->memory);
+	e_debug(e->event(), "%s for script `%s' (hits=%"PRIu64", "
+		"misses=%"PRIu64")", (hit ? "Hit" : "Miss"),
+		sieve_script_location(script), cache->hits, cache->misses);
+}
+
+static void sieve_binary_cache_expire(struct sieve_binary_cache *cache)
+{
+	unsigned int idle_secs = cache->svinst->binary_cache_idle_secs;
+
+	if (idle_secs == 0)
+		return;
+
+	/* Binaries not used for a while are dropped, so that long-lived
+	   sessions don't keep them all in memory. They are opened from disk
+	   again when needed. */
+	while (cache->tail != NULL &&
+	       (ioloop_time - cache->tail->last_used) >= (time_t)idle_secs) {
+		e_debug(cache->event, "Dropping idle binary %s",
+			cache->tail->sbin->path);
+		sieve_binary_cache_entry_free(cache, cache->tail);
+		cache->evictions++;
+	}
+}
+
+static bool
+sieve_binary_cache_entry_valid(struct sieve_binary_cache *cache,
+			       struct sieve_binary_cache_entry *entry,
+			       struct sieve_script *script,
+			       enum sieve_compile_flags flags)
+{
+	struct sieve_binary *sbin = entry->sbin;
+	unsigned int trust_secs = cache->svinst->binary_cache_trust_secs;
+	struct stat st;
+
+	if (trust_secs > 0 &&
+	    (ioloop_time - entry->validated) < (time_t)trust_secs) {
+		/* Checked recently enough; don't go to the disk again */
+		sieve_binary_set_script(sbin, script);
+		return TRUE;
+	}
+
+	if (stat(sbin->path, &st) < 0) {
+		if (errno != ENOENT) {
+			e_error(cache->event, "stat(%s) failed: %m",
+				sbin->path);
+		}
+		return FALSE;
+	}
+	if (st.st_dev != entry->dev || st.st_ino != entry->ino ||
+	    st.st_mtime != entry->mtime || st.st_size != entry->size) {
+		e_debug(cache->event, "Binary %s changed on disk",
+			sbin->path);
+		return FALSE;
+	}
+
+	/* The binary itself is unchanged; check the script against it */
+	sieve_binary_set_script(sbin, script);
+	if (!sieve_binary_up_to_date(sbin, flags))
+		return FALSE;
+	entry->validated = ioloop_time;
+	return TRUE;
+}
+
+struct sieve_binary *
+sieve_binary_cache_lookup(struct sieve_binary_cache *cache,
+			  struct sieve_script *script,
+			  enum sieve_compile_flags flags)
+{
+	struct sieve_binary_cache_entry *entry;
+	struct sieve_binary *sbin;
+
+	if (cache == NULL)
+		return NULL;
+
+	sieve_binary_cache_expire(cache);
+	entry = hash_table_lookup(cache->entries,
+				  sieve_binary_cache_key(script));
+	if (entry == NULL) {
+		sieve_binary_cache_event(cache, script, FALSE);
+		return NULL;
+	}
+
+	if (!sieve_binary_cache_entry_valid(cache, entry, script, flags)) {
+		sieve_binary_cache_entry_free(cache, entry);
+		sieve_binary_cache_event(cache, script, FALSE);
+		return NULL;
+	}
+
+	/* Move to front */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	entry->last_used = ioloop_time;
+
+	sbin = entry->sbin;
+	sieve_binary_ref(sbin);
+
+	sieve_binary_cache_event(cache, script, TRUE);
+	return sbin;
+}
+
+void sieve_binary_cache_add(struct sieve_binary_cache *cache,
+			    struct sieve_script *script,
+			    struct sieve_binary *sbin)
+{
+	struct sieve_binary_cache_entry *entry;
+	const char *key;
+
+	if (cache == NULL || cache->max_entries == 0)
+		return;
+	if (!sieve_binary_loaded(sbin) || sbin->file == NULL)
+		return;
+
+	/* The file is closed once the binary is released by its user, so all
+	   blocks need to be in memory before the binary is cached. Blocks of a
+	   mapped binary are resolved from the mapping on first access, so
+	   these are left to be loaded lazily. */
+	if (sbin->mmap == NULL && !sieve_binary_load_blocks(sbin))
+		return;
+
+	key = sieve_binary_cache_key(script);
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry != NULL)
+		sieve_binary_cache_entry_free(cache, entry);
+
+	entry = i_new(struct sieve_binary_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->sbin = sbin;
+	sieve_binary_ref(sbin);
+	entry->dev = sbin->st.st_dev;
+	entry->ino = sbin->st.st_ino;
+	entry->mtime = sbin->st.st_mtime;
+	entry->size = sbin->st.st_size;
+	entry->validated = ioloop_time;
+	entry->last_used = ioloop_time;
+	entry->memory = sieve_binary_get_memory_usage(sbin);
+
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+	cache->memory += entry->memory;
+
+	sieve_binary_cache_expire(cache);
+
+	/* Evict least recently used binaries */
+	while (cache->count > cache->max_entries) {
+		sieve_binary_cache_entry_free(cache, cache->tail);
+		cache->evictions++;
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef SIEVE_BINARY_CACHE_H
+#define SIEVE_BINARY_CACHE_H
+
+#include "sieve-common.h"
+
+/*
+ * Binary cache
+ */
+
+/* The binary cache keeps recently opened binaries of a Sieve instance in
+   memory, so that scripts executed repeatedly (e.g. for each message in an
+   IMAP session) need not be re-opened from storage every time. Cached binaries
+   are keyed by script location and name and they are validated against the
+   identity of the binary file on disk upon each lookup. */
+
+struct sieve_binary_cache;
+
+struct sieve_binary_cache *
+sieve_binary_cache_create(struct sieve_instance *svinst,
+			  unsigned int max_entries);
+void sieve_binary_cache_free(struct sieve_binary_cache **_cache);
+/* Drops all cached binaries. */
+void sieve_binary_cache_clear(struct sieve_binary_cache *cache);
+/* Returns the memory held by the cached binaries (excluding memory-mapped
+   ones). */
+size_t sieve_binary_cache_get_memory_usage(struct sieve_binary_cache *cache);
+/* Returns the lookup and eviction counters of the cache. */
+void sieve_binary_cache_get_statistics(struct sieve_binary_cache *cache,
+				       struct sieve_cache_statistics *stats_r);
+
+/* Returns a new reference to the cached binary for the script, or NULL if
+   there is no valid cached binary. */
+struct sieve_binary *
+sieve_binary_cache_lookup(struct sieve_binary_cache *cache,
+			  struct sieve_script *script,
+			  enum sieve_compile_flags flags);
+/* Adds the binary to the cache. Only binaries loaded from a file are
+   cached. */
+void sieve_binary_cache_add(struct sieve_binary_cache *cache,
+			    struct sieve_script *script,
+			    struct sieve_binary *sbin);
+
+#endif
@@ -180,6 +180,42 @@ sieve_size_t sieve_binary_emit_string(struct sieve_binary_block *sblock,
 	return address;
 }
 
+sieve_size_t sieve_binary_emit_string_ref(struct sieve_binary_block *sblock,
+					  const string_t *str)
+{
+	struct sieve_binary *sbin = sblock->sbin;
+	struct sieve_binary_block *strblock;
+	const char *key;
+	sieve_size_t offset;
+	void *value;
+
+	strblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_STRINGS);
+	i_assert(strblock != NULL);
+
+	/* Strings with embedded NULs are not shared */
+	key = str_c(str);
+	if (strlen(key) != str_len(str)) {
+		offset = sieve_binary_emit_string(strblock, str);
+		return sieve_binary_emit_unsigned(sblock, offset);
+	}
+
+	if (!hash_table_is_created(sbin->string_table)) {
+		hash_table_create(&sbin->string_table, default_pool, 0,
+				  str_hash, strcmp);
+	}
+
+	value = hash_table_lookup(sbin->string_table, key);
+	if (value != NULL)
+		offset = POINTER_CAST_TO(value, sieve_size_t) - 1;
+	else {
+		offset = sieve_binary_emit_string(strblock, str);
+		hash_table_insert(sbin->string_table,
+				  p_strdup(sbin->pool, key),
+				  POINTER_CAST(offset + 1));
+	}
+	return sieve_binary_emit_unsigned(sblock, offset);
+}
+
 /*
  * Extension emission
  */
@@ -352,6 +388,25 @@ bool sieve_binary_read_string(struct sieve_binary_block *sblock,
 	return TRUE;
 }
 
+bool sieve_binary_read_string_ref(struct sieve_binary_block *sblock,
+				  sieve_size_t *address, string_t **str_r)
+{
+	struct sieve_binary_block *strblock;
+	unsigned int offset;
+	sieve_size_t str_address;
+
+	if (!sieve_binary_read_unsigned(sblock, address, &offset))
+		return FALSE;
+
+	strblock = sieve_binary_block_get(sblock->sbin,
+					  SBIN_SYSBLOCK_STRINGS);
+	if (strblock == NULL)
+		return FALSE;
+
+	str_address = offset;
+	return sieve_binary_read_string(strblock, &str_address, str_r);
+}
+
 bool sieve_binary_read_extension(struct sieve_binary_block *sblock,
 				 sieve_size_t *address, unsigned int *offset_r,
 				 const struct sieve_extension **ext_r)
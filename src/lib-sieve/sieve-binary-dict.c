@@ -0,0 +1,284 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "base64.h"
+#include "istream.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "dict.h"
+
+#include "sieve-common.h"
+#include "sieve-error.h"
+#include "sieve-script.h"
+#include "sieve-binary.h"
+
+#include "sieve-binary-dict.h"
+
+#include <unistd.h>
+
+#define DICT_SIEVE_BINARY_PATH DICT_PATH_SHARED"sieve/binary/"
+
+/* Larger binaries are not uploaded */
+#define SIEVE_BINARY_DICT_MAX_SIZE (1024*1024)
+
+struct sieve_binary_dict {
+	struct sieve_instance *svinst;
+	struct event *event;
+
+	char *uri;
+	struct dict *dict;
+	bool init_failed:1;
+};
+
+struct sieve_binary_dict_upload {
+	struct sieve_binary_dict *bdict;
+	char *key;
+};
+
+struct sieve_binary_dict *
+sieve_binary_dict_create(struct sieve_instance *svinst, const char *uri)
+{
+	struct sieve_binary_dict *bdict;
+
+	bdict = i_new(struct sieve_binary_dict, 1);
+	bdict->svinst = svinst;
+	bdict->uri = i_strdup(uri);
+
+	bdict->event = event_create(svinst->event);
+	event_set_append_log_prefix(bdict->event, "binary dict: ");
+
+	return bdict;
+}
+
+void sieve_binary_dict_free(struct sieve_binary_dict **_bdict)
+{
+	struct sieve_binary_dict *bdict = *_bdict;
+
+	*_bdict = NULL;
+	if (bdict == NULL)
+		return;
+
+	if (bdict->dict != NULL) {
+		/* Finish the pending uploads */
+		dict_wait(bdict->dict);
+		dict_deinit(&bdict->dict);
+	}
+	event_unref(&bdict->event);
+	i_free(bdict->uri);
+	i_free(bdict);
+}
+
+static struct dict *sieve_binary_dict_get(struct sieve_binary_dict *bdict)
+{
+	struct dict_legacy_settings dict_set;
+	const char *error;
+
+	if (bdict->dict != NULL || bdict->init_failed)
+		return bdict->dict;
+
+	/* Opened upon first use, so that instances that find all binaries
+	   locally do not connect to the dict */
+	i_zero(&dict_set);
+	dict_set.base_dir = bdict->svinst->base_dir;
+	if (dict_init_legacy(bdict->uri, &dict_set, &bdict->dict,
+			     &error) < 0) {
+		e_error(bdict->event, "Failed to initialize dict `%s': %s",
+			bdict->uri, error);
+		bdict->init_failed = TRUE;
+		return NULL;
+	}
+	return bdict->dict;
+}
+
+static const char *sieve_binary_dict_key(struct sieve_script *script)
+{
+	const char *digest;
+
+	digest = sieve_script_binary_get_digest(script);
+	if (digest == NULL)
+		return NULL;
+	return t_strconcat(DICT_SIEVE_BINARY_PATH, digest, NULL);
+}
+
+/*
+ * Fetching binaries
+ */
+
+static int
+sieve_binary_dict_write(struct sieve_binary_dict *bdict, const char *path,
+			const buffer_t *data)
+{
+	string_t *temp_path;
+	int fd, ret = 0;
+
+	temp_path = t_str_new(256);
+	str_append(temp_path, path);
+	str_append_c(temp_path, '.');
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd < 0) {
+		e_error(bdict->event, "open(%s) failed: %m", str_c(temp_path));
+		return -1;
+	}
+
+	if (write_full(fd, data->data, data->used) < 0) {
+		e_error(bdict->event, "write(%s) failed: %m",
+			str_c(temp_path));
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		e_error(bdict->event, "close(%s) failed: %m",
+			str_c(temp_path));
+		ret = -1;
+	}
+	if (ret == 0 && rename(str_c(temp_path), path) < 0) {
+		e_error(bdict->event, "rename(%s, %s) failed: %m",
+			str_c(temp_path), path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink_if_exists(str_c(temp_path));
+	return ret;
+}
+
+struct sieve_binary *
+sieve_binary_dict_open(struct sieve_binary_dict *bdict,
+		       struct sieve_script *script)
+{
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	const char *path, *key, *value, *errstr;
+	buffer_t *data;
+	int ret;
+
+	path = sieve_script_binary_get_shared_path(script);
+	if (path == NULL)
+		return NULL;
+
+	/* Fetched earlier by this node */
+	sbin = sieve_binary_open_shared(script, &error);
+	if (sbin != NULL)
+		return sbin;
+
+	key = sieve_binary_dict_key(script);
+	if (key == NULL || sieve_binary_dict_get(bdict) == NULL)
+		return NULL;
+
+	struct dict_op_settings set;
+	i_zero(&set);
+	ret = dict_lookup(bdict->dict, &set, pool_datastack_create(), key,
+			  &value, &errstr);
+	if (ret < 0) {
+		e_error(bdict->event, "Failed to lookup binary: %s", errstr);
+		return NULL;
+	}
+	if (ret == 0) {
+		e_debug(bdict->event, "No binary stored for script `%s'",
+			sieve_script_name(script));
+		return NULL;
+	}
+
+	data = t_buffer_create(MAX_BASE64_DECODED_SIZE(strlen(value)));
+	if (base64_decode(value, strlen(value), data) < 0) {
+		e_warning(bdict->event, "Ignoring invalid binary entry `%s'",
+			  key);
+		return NULL;
+	}
+
+	/* The binary code can only be read from a file */
+	if (sieve_binary_dict_write(bdict, path, data) < 0)
+		return NULL;
+
+	sbin = sieve_binary_open_shared(script, &error);
+	if (sbin != NULL) {
+		e_debug(bdict->event, "Fetched binary for script `%s' (%zu bytes)",
+			sieve_script_name(script), data->used);
+	}
+	return sbin;
+}
+
+/*
+ * Uploading binaries
+ */
+
+static void
+sieve_binary_dict_upload_callback(const struct dict_commit_result *result,
+				  struct sieve_binary_dict_upload *upload)
+{
+	struct sieve_binary_dict *bdict = upload->bdict;
+
+	if (result->ret < 0) {
+		e_error(bdict->event, "Failed to store binary `%s': %s",
+			upload->key, result->error);
+	} else {
+		e_debug(bdict->event, "Stored binary `%s'", upload->key);
+	}
+	i_free(upload->key);
+	i_free(upload);
+}
+
+static int
+sieve_binary_dict_read(struct sieve_binary_dict *bdict, const char *path,
+		       string_t *value)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	buffer_t *buf;
+	int ret;
+
+	buf = t_buffer_create(4096);
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while ((ret = i_stream_read_more(input, &data, &size)) > 0) {
+		if (buf->used + size > SIEVE_BINARY_DICT_MAX_SIZE) {
+			i_stream_unref(&input);
+			return 0;
+		}
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		e_error(bdict->event, "read(%s) failed: %s",
+			i_stream_get_name(input), i_stream_get_error(input));
+		i_stream_unref(&input);
+		return -1;
+	}
+	i_stream_unref(&input);
+
+	base64_encode(buf->data, buf->used, value);
+	return 1;
+}
+
+void sieve_binary_dict_store(struct sieve_binary_dict *bdict,
+			     struct sieve_binary *sbin)
+{
+	struct sieve_script *script = sieve_binary_script(sbin);
+	struct sieve_binary_dict_upload *upload;
+	struct dict_transaction_context *dctx;
+	const char *path = sieve_binary_path(sbin);
+	const char *key;
+	string_t *value;
+
+	if (script == NULL || path == NULL ||
+	    !sieve_binary_is_shareable(sbin))
+		return;
+	key = sieve_binary_dict_key(script);
+	if (key == NULL || sieve_binary_dict_get(bdict) == NULL)
+		return;
+
+	value = t_str_new(8192);
+	if (sieve_binary_dict_read(bdict, path, value) <= 0)
+		return;
+
+	upload = i_new(struct sieve_binary_dict_upload, 1);
+	upload->bdict = bdict;
+	upload->key = i_strdup(key);
+
+	struct dict_op_settings set;
+	i_zero(&set);
+	dctx = dict_transaction_begin(bdict->dict, &set);
+	dict_set(dctx, key, str_c(value));
+	dict_transaction_commit_async(&dctx, sieve_binary_dict_upload_callback,
+				      upload);
+}
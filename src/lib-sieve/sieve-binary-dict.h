@@ -0,0 +1,33 @@
+#ifndef SIEVE_BINARY_DICT_H
+#define SIEVE_BINARY_DICT_H
+
+#include "sieve-common.h"
+
+/*
+ * Dict binary store
+ */
+
+/* When the sieve_binary_dict setting is configured, compiled binaries are
+   also kept in the configured dict (e.g. redis), shared by all nodes. They
+   are keyed by the same digest of the script source and the enabled
+   extensions that names the binaries in sieve_binary_shared_dir. Binaries
+   missing locally are fetched into that directory before the script is
+   compiled, and newly saved binaries are uploaded asynchronously. */
+
+struct sieve_binary_dict;
+
+struct sieve_binary_dict *
+sieve_binary_dict_create(struct sieve_instance *svinst, const char *uri);
+void sieve_binary_dict_free(struct sieve_binary_dict **_bdict);
+
+/* Fetches the binary for the script from the dict into the shared binary
+   directory and opens it. Returns NULL if it is not available. */
+struct sieve_binary *
+sieve_binary_dict_open(struct sieve_binary_dict *bdict,
+		       struct sieve_script *script);
+/* Uploads the saved binary to the dict, unless it depends on more than the
+   script source. The upload completes in the background. */
+void sieve_binary_dict_store(struct sieve_binary_dict *bdict,
+			     struct sieve_binary *sbin);
+
+#endif
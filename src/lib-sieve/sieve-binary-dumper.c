@@ -102,6 +102,9 @@ bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 	struct sieve_dumptime_env *denv = &(dumper->dumpenv);
 	const struct sieve_binary_header *header = &sbin->header;
 	struct sieve_binary_block *sblock;
+	const char *const *headers;
+	unsigned int hdr_count, hdr_idx;
+	enum sieve_message_fields fields;
 	bool success = TRUE;
 	sieve_size_t offset;
 	int count, i;
@@ -194,6 +197,23 @@ bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 		}
 	}
 
+	/* Dump list of tested header fields */
+
+	headers = sieve_binary_get_message_headers(sbin, &hdr_count);
+	fields = sieve_binary_get_message_fields(sbin);
+	if (headers != NULL || fields != 0) {
+		sieve_binary_dump_sectionf(
+			denv, "Message headers (block: %d)",
+			SBIN_SYSBLOCK_MESSAGE_HEADERS);
+
+		for (hdr_idx = 0; hdr_idx < hdr_count; hdr_idx++) {
+			sieve_binary_dumpf(denv, "%3u: %s\n",
+					   hdr_idx, headers[hdr_idx]);
+		}
+		if ((fields & SIEVE_MESSAGE_FIELD_SIZE) != 0)
+			sieve_binary_dumpf(denv, "  *: (message size)\n");
+	}
+
 	/* Dump extension-specific elements of the binary */
 
 	count = sieve_binary_extensions_count(sbin);
@@ -242,6 +262,118 @@ bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 	return TRUE;
 }
 
+/*
+ * Statistics
+ */
+
+bool sieve_binary_dumper_stats(struct sieve_binary_dumper *dumper,
+			       struct ostream *stream)
+{
+	struct sieve_binary *sbin = dumper->dumpenv.sbin;
+	struct sieve_dumptime_env *denv = &(dumper->dumpenv);
+	const char *const *headers;
+	const char **block_names;
+	unsigned int hdr_count, hdr_idx;
+	size_t total_size = 0;
+	bool success = TRUE;
+	int count, ext_count, i;
+
+	dumper->dumpenv.stream = stream;
+
+	/* Block sizes */
+
+	count = sieve_binary_block_count(sbin);
+	for (i = 0; i < count; i++) {
+		struct sieve_binary_block *sblock =
+			sieve_binary_block_get(sbin, i);
+
+		if (sblock == NULL)
+			return FALSE;
+		total_size += sieve_binary_block_get_size(sblock);
+	}
+
+	/* Name the blocks owned by extensions */
+	block_names = t_new(const char *, I_MAX(count, SBIN_SYSBLOCK_LAST));
+	block_names[SBIN_SYSBLOCK_SCRIPT_DATA] = "script metadata";
+	block_names[SBIN_SYSBLOCK_EXTENSIONS] = "extensions";
+	block_names[SBIN_SYSBLOCK_MAIN_PROGRAM] = "main program";
+	block_names[SBIN_SYSBLOCK_MESSAGE_HEADERS] = "message headers";
+	block_names[SBIN_SYSBLOCK_STRINGS] = "strings";
+
+	ext_count = sieve_binary_extensions_count(sbin);
+	for (i = 0; i < ext_count; i++) {
+		const struct sieve_extension *ext =
+			sieve_binary_extension_get_by_index(sbin, i);
+		struct sieve_binary_block *sblock =
+			sieve_binary_extension_get_block(sbin, ext);
+		unsigned int id;
+
+		if (sblock == NULL)
+			continue;
+		id = sieve_binary_block_get_id(sblock);
+		if (id < (unsigned int)count)
+			block_names[id] = sieve_extension_name(ext);
+	}
+
+	sieve_binary_dump_sectionf(
+		denv, "Binary blocks (count: %d; total size: %zu bytes)",
+		count, total_size);
+
+	for (i = 0; i < count; i++) {
+		struct sieve_binary_block *sblock =
+			sieve_binary_block_get(sbin, i);
+
+		sieve_binary_dumpf(denv, "%3d: size: %8zu bytes  %s\n",
+				   i, sieve_binary_block_get_size(sblock),
+				   (block_names[i] == NULL ? "" : block_names[i]));
+	}
+
+	/* Tested header fields */
+
+	headers = sieve_binary_get_message_headers(sbin, &hdr_count);
+	sieve_binary_dump_sectionf(denv, "Message headers (count: %u)",
+				   hdr_count);
+	for (hdr_idx = 0; hdr_idx < hdr_count; hdr_idx++)
+		sieve_binary_dumpf(denv, "%3u: %s\n", hdr_idx, headers[hdr_idx]);
+
+	/* Extension-specific elements, such as the include tree */
+
+	for (i = 0; i < ext_count && success; i++) {
+		T_BEGIN {
+			const struct sieve_extension *ext =
+				sieve_binary_extension_get_by_index(sbin, i);
+
+			if (ext->def != NULL && ext->def->binary_dump != NULL)
+				success = ext->def->binary_dump(ext, denv);
+		} T_END;
+	}
+	if (!success)
+		return FALSE;
+
+	/* Operations and operands of the main program */
+
+	dumper->dumpenv.sblock =
+		sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MAIN_PROGRAM);
+	if (dumper->dumpenv.sblock == NULL)
+		return FALSE;
+
+	dumper->dumpenv.cdumper = sieve_code_dumper_create(&(dumper->dumpenv));
+	if (dumper->dumpenv.cdumper != NULL) {
+		sieve_code_dumper_enable_stats(dumper->dumpenv.cdumper);
+		sieve_code_dumper_run(dumper->dumpenv.cdumper);
+		T_BEGIN {
+			sieve_code_dumper_write_stats(dumper->dumpenv.cdumper);
+		} T_END;
+
+		sieve_code_dumper_free(&dumper->dumpenv.cdumper);
+	}
+
+	/* Finish with empty line */
+	sieve_binary_dumpf(denv, "\n");
+
+	return TRUE;
+}
+
 /*
  * Hexdump production
  */
@@ -31,6 +31,13 @@ void sieve_binary_dump_sectionf(const struct sieve_dumptime_env *denv,
 bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 			     struct ostream *stream, bool verbose);
 
+/*
+ * Statistics
+ */
+
+bool sieve_binary_dumper_stats(struct sieve_binary_dumper *dumper,
+			       struct ostream *stream);
+
 /*
  * Hexdump production
  */
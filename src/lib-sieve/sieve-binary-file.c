@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "llist.h"
 #include "str.h"
 #include "str-sanitize.h"
 #include "mempool.h"
@@ -25,6 +26,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 /*
  * Macros
@@ -176,10 +178,13 @@ static void sieve_binary_file_update_header(struct sieve_binary *sbin)
 {
 	struct sieve_binary_header *header = &sbin->header;
 	struct sieve_resource_usage rusage;
+	size_t pool_size;
 
 	sieve_binary_get_resource_usage(sbin, &rusage);
+	pool_size = sieve_binary_get_pool_size_hint(sbin);
 
 	i_zero(&header->resource_usage);
+	header->resource_usage.pool_size = pool_size;
 	if (HAS_ALL_BITS(header->flags, SIEVE_BINARY_FLAG_RESOURCE_LIMIT) ||
 	    sieve_resource_usage_is_high(sbin->svinst, &rusage)) {
 		header->resource_usage.update_time = ioloop_time;
@@ -537,9 +542,208 @@ int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 	ret = sieve_binary_do_save(sbin, path, update, save_mode, error_r);
 	sieve_binary_update_event(sbin, NULL);
 
+	/* Processes waiting for the compilation can now load the binary */
+	sieve_binary_compile_unlock(sbin);
+
 	return ret;
 }
 
+bool sieve_binary_is_shareable(struct sieve_binary *sbin)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int ext_count, i;
+
+	/* Extensions that check the binary for being up-to-date make it depend
+	   on more than the script source (e.g. included scripts) */
+	regs = array_get(&sbin->extensions, &ext_count);
+	for (i = 0; i < ext_count; i++) {
+		const struct sieve_binary_extension *binext = regs[i]->binext;
+
+		if (binext != NULL && binext->binary_up_to_date != NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+int sieve_binary_save_shared(struct sieve_binary *sbin, bool update,
+			     enum sieve_error *error_r)
+{
+	const char *path;
+	int ret;
+
+	if (error_r != NULL)
+		*error_r = SIEVE_ERROR_NONE;
+
+	if (sbin->script == NULL || !sieve_binary_is_shareable(sbin))
+		return 0;
+	path = sieve_script_binary_get_shared_path(sbin->script);
+	if (path == NULL)
+		return 0;
+
+	ret = sieve_binary_save(sbin, path, update, 0600, error_r);
+	if (ret >= 0 && strcmp(sbin->path, path) == 0)
+		sbin->shared = TRUE;
+	return ret;
+}
+
+
+/*
+ * Memory-mapped binaries
+ */
+
+struct sieve_binary_mmap {
+	struct sieve_binary_mmap *prev, *next;
+	int refcount;
+
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+
+	void *base;
+	size_t size;
+
+	bool cached:1;
+};
+
+/* Process-wide list of mappings in most-recently-used order */
+static struct sieve_binary_mmap *sieve_binary_mmaps = NULL;
+static unsigned int sieve_binary_mmaps_count = 0;
+
+static void sieve_binary_mmap_detach(struct sieve_binary_mmap *map)
+{
+	if (!map->cached)
+		return;
+
+	DLLIST_REMOVE(&sieve_binary_mmaps, map);
+	i_assert(sieve_binary_mmaps_count > 0);
+	sieve_binary_mmaps_count--;
+	map->cached = FALSE;
+
+	sieve_binary_mmap_unref(&map);
+}
+
+void sieve_binary_mmap_unref(struct sieve_binary_mmap **_map)
+{
+	struct sieve_binary_mmap *map = *_map;
+
+	*_map = NULL;
+	if (map == NULL)
+		return;
+
+	i_assert(map->refcount > 0);
+	if (--map->refcount > 0)
+		return;
+
+	i_assert(!map->cached);
+	if (munmap(map->base, map->size) < 0)
+		i_error("sieve: binary %s: munmap() failed: %m", map->path);
+	i_free(map->path);
+	i_free(map);
+}
+
+void sieve_binary_mmap_invalidate(struct sieve_binary *sbin)
+{
+	if (sbin->mmap != NULL)
+		sieve_binary_mmap_detach(sbin->mmap);
+}
+
+void sieve_binary_mmaps_free(void)
+{
+	while (sieve_binary_mmaps != NULL)
+		sieve_binary_mmap_detach(sieve_binary_mmaps);
+}
+
+static inline bool
+sieve_binary_mmap_matches(const struct sieve_binary_mmap *map,
+			  const struct stat *st)
+{
+	return (map->dev == st->st_dev && map->ino == st->st_ino &&
+		map->mtime == st->st_mtime &&
+		map->size == (size_t)st->st_size);
+}
+
+static void sieve_binary_mmaps_evict(struct sieve_binary_mmap *keep)
+{
+	struct sieve_binary_mmap *map, *last = NULL;
+
+	while (sieve_binary_mmaps_count > SIEVE_BINARY_MMAP_MAX_CACHED) {
+		for (map = sieve_binary_mmaps; map != NULL; map = map->next) {
+			if (map != keep)
+				last = map;
+		}
+		if (last == NULL)
+			break;
+		sieve_binary_mmap_detach(last);
+		last = NULL;
+	}
+}
+
+static struct sieve_binary_mmap *
+sieve_binary_mmap_get(struct sieve_binary *sbin, const char *path, int fd,
+		      const struct stat *st)
+{
+	struct sieve_binary_mmap *map, *next;
+	void *base;
+
+	for (map = sieve_binary_mmaps; map != NULL; map = next) {
+		next = map->next;
+
+		if (strcmp(map->path, path) != 0)
+			continue;
+		if (!sieve_binary_mmap_matches(map, st)) {
+			/* File was replaced; drop the stale mapping */
+			e_debug(sbin->event, "open: "
+				"binary changed on disk; dropping old mapping");
+			sieve_binary_mmap_detach(map);
+			continue;
+		}
+
+		/* Move to front */
+		DLLIST_REMOVE(&sieve_binary_mmaps, map);
+		DLLIST_PREPEND(&sieve_binary_mmaps, map);
+		map->refcount++;
+		return map;
+	}
+
+	if (st->st_size <= 0)
+		return NULL;
+
+	base = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		e_error(sbin->event, "open: "
+			"mmap() failed (falling back to read()): %m");
+		return NULL;
+	}
+
+	map = i_new(struct sieve_binary_mmap, 1);
+	map->refcount = 2; /* list + caller */
+	map->path = i_strdup(path);
+	map->dev = st->st_dev;
+	map->ino = st->st_ino;
+	map->mtime = st->st_mtime;
+	map->base = base;
+	map->size = st->st_size;
+	map->cached = TRUE;
+
+	DLLIST_PREPEND(&sieve_binary_mmaps, map);
+	sieve_binary_mmaps_count++;
+	sieve_binary_mmaps_evict(map);
+
+	return map;
+}
+
+static bool sieve_binary_file_use_mmap(struct sieve_binary *sbin)
+{
+	struct sieve_instance *svinst = sbin->svinst;
+
+	if (svinst->binary_mmap)
+		return TRUE;
+	/* Global binaries are the same for all users, so their mapping
+	   is shared through the page cache by all processes on the host */
+	return (svinst->binary_mmap_global && sbin->script != NULL &&
+		!sieve_script_is_personal(sbin->script));
+}
 
 /*
  * Binary file management
@@ -626,6 +830,9 @@ sieve_binary_file_open(struct sieve_binary *sbin, const char *path,
 	file->st = st;
 	file->sbin = sbin;
 
+	if (sbin->mmap == NULL && sieve_binary_file_use_mmap(sbin))
+		sbin->mmap = sieve_binary_mmap_get(sbin, path, fd, &st);
+
 	*file_r = file;
 	return 0;
 }
@@ -731,14 +938,58 @@ sieve_binary_file_load_buffer(struct sieve_binary_file *file,
 	(header *)sieve_binary_file_load_data(sbin->file, offset, \
 					      sizeof(header))
 
+static bool
+sieve_binary_load_mapped_block(struct sieve_binary_block *sblock)
+{
+	struct sieve_binary *sbin = sblock->sbin;
+	struct sieve_binary_mmap *map = sbin->mmap;
+	const struct sieve_binary_block_header *header;
+	unsigned int id = sblock->id;
+	size_t offset = SIEVE_BINARY_ALIGN(sblock->offset);
+	buffer_t *data;
+
+	if (offset > map->size || (map->size - offset) < sizeof(*header)) {
+		e_error(sbin->event, "load: binary is corrupt: "
+			"header of block %d is beyond end of file", id);
+		return FALSE;
+	}
+	header = CONST_PTR_OFFSET(map->base, offset);
+
+	if (header->id != id) {
+		e_error(sbin->event, "load: binary is corrupt: "
+			"header of block %d has non-matching id %d",
+			id, header->id);
+		return FALSE;
+	}
+
+	offset = SIEVE_BINARY_ALIGN(offset + sizeof(*header));
+	if (offset > map->size || (map->size - offset) < header->size) {
+		e_error(sbin->event, "load: binary is corrupt: "
+			"block %d is truncated (size=%d)", id, header->size);
+		return FALSE;
+	}
+
+	/* Point the block buffer straight into the read-only mapping */
+	data = p_new(sbin->pool, buffer_t, 1);
+	buffer_create_from_const_data(data, CONST_PTR_OFFSET(map->base, offset),
+				      header->size);
+	sblock->data = data;
+	sblock->mapped = TRUE;
+	return TRUE;
+}
+
 bool sieve_binary_load_block(struct sieve_binary_block *sblock)
 {
 	struct sieve_binary *sbin = sblock->sbin;
 	unsigned int id = sblock->id;
 	off_t offset = sblock->offset;
-	const struct sieve_binary_block_header *header =
-		LOAD_HEADER(sbin, &offset,
-			    const struct sieve_binary_block_header);
+	const struct sieve_binary_block_header *header;
+
+	if (sbin->mmap != NULL)
+		return sieve_binary_load_mapped_block(sblock);
+
+	header = LOAD_HEADER(sbin, &offset,
+			     const struct sieve_binary_block_header);
 
 	if (header == NULL) {
 		e_error(sbin->event, "load: binary is corrupt: "
@@ -827,6 +1078,15 @@ static int _read_extensions(struct sieve_binary_block *sblock)
 					if (!sieve_binary_read_unsigned(sblock, &offset, &version) ||
 					    !sieve_binary_read_unsigned(sblock, &offset, &ereg->block_id)) {
 						result = -1;
+					} else if (!sieve_extension_version_is(ext, version) &&
+						   sieve_extension_version_is_compatible(ext, version)) {
+						e_debug(sbin->event, "open: "
+							"binary was compiled with older version "
+							"of the `%s' extension (compiled v%d, current v%d; "
+							"upgraded when re-compiled)",
+							sieve_extension_name(ext), version,
+							sieve_extension_version(ext));
+						sbin->outdated = TRUE;
 					} else if (!sieve_extension_version_is(ext, version)) {
 						e_debug(sbin->event, "open: "
 							"binary was compiled with different version "
@@ -863,6 +1123,18 @@ _sieve_binary_open(struct sieve_binary *sbin, enum sieve_error *error_r)
 		return FALSE;
 	offset = sbin->header.hdr_size;
 
+	/* Older minor versions can still be read */
+	if (sbin->header.version_major != SIEVE_BINARY_VERSION_MAJOR ||
+	    sbin->header.version_minor < SIEVE_BINARY_VERSION_MINOR) {
+		e_debug(sbin->event, "open: "
+			"binary stored with older version %d.%d "
+			"(current %d.%d; upgraded when re-compiled)",
+			(int)sbin->header.version_major,
+			(int)sbin->header.version_minor,
+			SIEVE_BINARY_VERSION_MAJOR, SIEVE_BINARY_VERSION_MINOR);
+		sbin->outdated = TRUE;
+	}
+
 	/* Load block index */
 
 	for (i = 0; i < sbin->header.blocks && result; i++) {
@@ -923,6 +1195,8 @@ sieve_binary_open(struct sieve_instance *svinst, const char *path,
 	}
 
 	sbin->file = file;
+	sbin->st = file->st;
+	sbin->loaded = TRUE;
 
 	event_set_append_log_prefix(
 		sbin->event,
@@ -934,6 +1208,7 @@ sieve_binary_open(struct sieve_instance *svinst, const char *path,
 	}
 
 	sieve_binary_activate(sbin);
+	sieve_binary_usage_pending_apply(sbin);
 
 	/* Signal open event to extensions */
 	regs = array_get(&sbin->extensions, &ext_count);
@@ -953,6 +1228,24 @@ sieve_binary_open(struct sieve_instance *svinst, const char *path,
 	return sbin;
 }
 
+struct sieve_binary *
+sieve_binary_open_shared(struct sieve_script *script,
+			 enum sieve_error *error_r)
+{
+	struct sieve_binary *sbin;
+	const char *path;
+
+	path = sieve_script_binary_get_shared_path(script);
+	if (path == NULL)
+		return NULL;
+
+	sbin = sieve_binary_open(sieve_script_svinst(script), path,
+				 script, error_r);
+	if (sbin != NULL)
+		sbin->shared = TRUE;
+	return sbin;
+}
+
 int sieve_binary_check_executable(struct sieve_binary *sbin,
 				  enum sieve_error *error_r,
 				  const char **client_error_r)
@@ -988,16 +1281,23 @@ sieve_binary_file_do_update_resource_usage(
 	const char *error;
 	int ret;
 
+	/* Never wait for the lock: another process is updating the usage
+	   right now, so the caller keeps its own for a later attempt. */
 	struct file_lock_settings lock_set = {
 		.lock_method = FILE_LOCK_METHOD_FCNTL,
 	};
-	ret = file_wait_lock(fd, sbin->path, F_WRLCK, &lock_set,
-			     SIEVE_BINARY_FILE_LOCK_TIMEOUT, &lock, &error);
-	if (ret <= 0) {
+	ret = file_try_lock(fd, sbin->path, F_WRLCK, &lock_set,
+			    &lock, &error);
+	if (ret < 0) {
 		e_error(sbin->event, "%s", error);
 		*error_r = SIEVE_ERROR_TEMP_FAILURE;
 		return -1;
 	}
+	if (ret == 0) {
+		e_debug(sbin->event, "update: "
+			"binary is locked; deferring resource usage update");
+		return 0;
+	}
 
 	ret = sieve_binary_file_read_header(sbin, fd, header, error_r);
 	if (ret == 0) {
@@ -1007,7 +1307,7 @@ sieve_binary_file_do_update_resource_usage(
 
 	file_lock_free(&lock);
 
-	return ret;
+	return (ret < 0 ? -1 : 1);
 }
 
 int sieve_binary_file_update_resource_usage(struct sieve_binary *sbin,
@@ -1023,9 +1323,13 @@ int sieve_binary_file_update_resource_usage(struct sieve_binary *sbin,
 	sieve_binary_file_close(&sbin->file);
 
 	if (sbin->path == NULL)
-		return 0;
-	if (sbin->header.version_major != SIEVE_BINARY_VERSION_MAJOR)
-		return sieve_binary_save(sbin, sbin->path, TRUE, 0600, error_r);
+		return 1;
+	if (sbin->header.version_major != SIEVE_BINARY_VERSION_MAJOR) {
+		if (sieve_binary_save(sbin, sbin->path, TRUE,
+				      0600, error_r) < 0)
+			return -1;
+		return 1;
+	}
 
 	fd = sieve_binary_fd_open(sbin, sbin->path, O_RDWR, error_r);
 	if (fd < 0)
@@ -1,13 +1,21 @@
 #ifndef SIEVE_BINARY_PRIVATE_H
 #define SIEVE_BINARY_PRIVATE_H
 
+#include "hash.h"
+
 #include "sieve-common.h"
 #include "sieve-binary.h"
 #include "sieve-extensions.h"
 
 #include <sys/stat.h>
 
-#define SIEVE_BINARY_FILE_LOCK_TIMEOUT 10
+/* Minimum interval between writes of the resource usage recorded by a
+   process to the same binary file. Usage recorded in between is accumulated
+   in memory. */
+#define SIEVE_BINARY_USAGE_FLUSH_INTERVAL_SECS 30
+
+/* Maximum number of memory-mapped binaries kept open by the process */
+#define SIEVE_BINARY_MMAP_MAX_CACHED 32
 
 /*
  * Binary file
@@ -29,6 +37,9 @@ struct sieve_binary_header {
 	struct {
 		uint64_t update_time;
 		uint32_t cpu_time_msecs;
+		/* Interpreter pool size hint; occupies what used to be
+		   padding, so the header size is unchanged */
+		uint32_t pool_size;
 	} resource_usage;
 };
 
@@ -44,6 +55,14 @@ struct sieve_binary_file {
 
 void sieve_binary_file_close(struct sieve_binary_file **_file);
 
+/* Memory-mapped binary file; shared by all binary objects opened from the same
+   file within this process. */
+struct sieve_binary_mmap;
+
+void sieve_binary_mmap_unref(struct sieve_binary_mmap **_map);
+void sieve_binary_mmap_invalidate(struct sieve_binary *sbin);
+void sieve_binary_mmaps_free(void);
+
 /*
  * Internal structures
  */
@@ -80,6 +99,16 @@ struct sieve_binary_block {
 	buffer_t *data;
 
 	uoff_t offset;
+
+	/* Data points into a memory-mapped binary */
+	bool mapped:1;
+
+	/* Decoded operations: code address -> operation cache entry. Small
+	   blocks use a table directly indexed by code address instead of the
+	   hash table. */
+	HASH_TABLE(void *, struct sieve_binary_op_cache_entry *) op_cache;
+	struct sieve_binary_op_cache_entry **op_table;
+	size_t op_cache_size;
 };
 
 /*
@@ -95,8 +124,13 @@ struct sieve_binary {
 	struct sieve_script *script;
 
 	struct sieve_binary_file *file;
+	struct sieve_binary_mmap *mmap;
 	struct sieve_binary_header header;
 	struct sieve_resource_usage rusage;
+	/* Largest interpreter pool usage seen by this process */
+	size_t pool_size;
+	/* Held while the binary is being compiled until it is saved */
+	struct dotlock *compile_lock;
 
 	/* When the binary is loaded into memory or when it is being constructed
 	   by the generator, extensions can be associated to the binary. The
@@ -118,19 +152,56 @@ struct sieve_binary {
 
 	/* Attributes of a loaded binary */
 	const char *path;
+	struct stat st;
 
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
 
+	/* Runtime objects */
+	HASH_TABLE(const char *,
+		   struct sieve_binary_runtime_object *) runtime_objects;
+
+	/* String table contents: string -> offset + 1 in the string block */
+	HASH_TABLE(const char *, void *) string_table;
+
+	/* Names of the tested header fields */
+	ARRAY_TYPE(const_string) message_headers;
+	enum sieve_message_fields message_fields;
+
+	/* Digest of the code blocks (see sieve_binary_get_code_digest()) */
+	unsigned char code_digest[SHA1_RESULTLEN];
+
 	bool rusage_updated:1;
+	bool loaded:1;
+	bool message_headers_read:1;
+	bool code_digest_valid:1;
+	bool program_checked:1;
+	bool program_empty:1;
+	/* Stored in the shared binary directory */
+	bool shared:1;
+	/* Loaded from an older (but compatible) binary or extension version */
+	bool outdated:1;
 };
 
 void sieve_binary_update_event(struct sieve_binary *sbin, const char *new_path)
 			       ATTR_NULL(2);
 
+void sieve_binary_compile_unlock(struct sieve_binary *sbin);
+
 struct sieve_binary *
 sieve_binary_create(struct sieve_instance *svinst, struct sieve_script *script);
 
+/* Replaces the script object the binary belongs to (used when a cached binary
+   is reused for a newly opened instance of the same script). */
+void sieve_binary_set_script(struct sieve_binary *sbin,
+			     struct sieve_script *script);
+/* Reads all blocks from the binary file, so that the binary remains usable
+   once the file is closed. */
+bool sieve_binary_load_blocks(struct sieve_binary *sbin);
+/* Returns the amount of memory held by the loaded blocks of the binary.
+   Blocks in a memory-mapped binary file are not counted. */
+size_t sieve_binary_get_memory_usage(struct sieve_binary *sbin);
+
 /* Blocks management */
 
 static inline struct sieve_binary_block *
@@ -232,7 +303,13 @@ bool sieve_binary_load_block(struct sieve_binary_block *);
  */
 
 bool sieve_binary_check_resource_usage(struct sieve_binary *sbin);
+/* Adds the usage recorded by this process for the binary's file that is not
+   yet written to it */
+void sieve_binary_usage_pending_apply(struct sieve_binary *sbin);
+void sieve_binary_usage_pending_free(void);
 
+/* Writes the recorded resource usage to the binary file. Returns 1 if
+   written, 0 if the file is locked by another process and -1 on error. */
 int sieve_binary_file_update_resource_usage(struct sieve_binary *sbin,
 					    enum sieve_error *error_r)
 					    ATTR_NULL(2);
@@ -11,6 +11,7 @@
 #include "ostream.h"
 #include "eacces-error.h"
 #include "safe-mkstemp.h"
+#include "file-dotlock.h"
 
 #include "sieve-error.h"
 #include "sieve-extensions.h"
@@ -123,6 +124,31 @@ void sieve_binary_ref(struct sieve_binary *sbin)
 	sbin->refcount++;
 }
 
+void sieve_binary_set_script(struct sieve_binary *sbin,
+			     struct sieve_script *script)
+{
+	if (sbin->script == script)
+		return;
+
+	sieve_script_ref(script);
+	sieve_script_unref(&sbin->script);
+	sbin->script = script;
+}
+
+void sieve_binary_rebind_script(struct sieve_binary *sbin,
+				struct sieve_script *script)
+{
+	struct sieve_binary_block *sblock;
+
+	sieve_binary_set_script(sbin, script);
+	sieve_binary_update_event(sbin, NULL);
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
+	i_assert(sblock != NULL);
+	sieve_binary_block_clear(sblock);
+	sieve_script_binary_write_metadata(script, sblock);
+}
+
 static inline void sieve_binary_extensions_free(struct sieve_binary *sbin)
 {
 	struct sieve_binary_extension_reg *const *regs;
@@ -140,18 +166,160 @@ static inline void sieve_binary_extensions_free(struct sieve_binary *sbin)
 	}
 }
 
+static void sieve_binary_blocks_free(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *const *blocks;
+	unsigned int blk_count, i;
+
+	/* Cleanup operation caches */
+	blocks = array_get(&sbin->blocks, &blk_count);
+	for (i = 0; i < blk_count; i++) {
+		if (blocks[i] == NULL)
+			continue;
+		if (hash_table_is_created(blocks[i]->op_cache))
+			hash_table_destroy(&blocks[i]->op_cache);
+		i_free(blocks[i]->op_table);
+	}
+
+	if (hash_table_is_created(sbin->string_table))
+		hash_table_destroy(&sbin->string_table);
+}
+
+static void sieve_binary_runtime_objects_free(struct sieve_binary *sbin);
+
+void sieve_binary_compile_unlock(struct sieve_binary *sbin)
+{
+	if (sbin->compile_lock == NULL)
+		return;
+	if (file_dotlock_delete(&sbin->compile_lock) < 0) {
+		e_error(sbin->event,
+			"Failed to delete compile lock: %m");
+	}
+}
+
+/* Resource usage recorded by this process that is not yet written to the
+   binary file, keyed by the binary path. This keeps frequently executed
+   expensive scripts from locking and rewriting their binary file for every
+   run. */
+struct sieve_binary_usage_pending {
+	char *path;
+
+	struct sieve_resource_usage rusage;
+	size_t pool_size;
+
+	time_t last_flush;
+};
+
+static HASH_TABLE(char *, struct sieve_binary_usage_pending *)
+	sieve_binary_usage_pending;
+
+static struct sieve_binary_usage_pending *
+sieve_binary_usage_pending_get(const char *path, bool create)
+{
+	struct sieve_binary_usage_pending *pending;
+
+	if (!hash_table_is_created(sieve_binary_usage_pending)) {
+		if (!create)
+			return NULL;
+		hash_table_create(&sieve_binary_usage_pending, default_pool, 0,
+				  str_hash, strcmp);
+	}
+
+	pending = hash_table_lookup(sieve_binary_usage_pending, path);
+	if (pending == NULL && create) {
+		pending = i_new(struct sieve_binary_usage_pending, 1);
+		pending->path = i_strdup(path);
+		sieve_resource_usage_init(&pending->rusage);
+		hash_table_insert(sieve_binary_usage_pending,
+				  pending->path, pending);
+	}
+	return pending;
+}
+
+void sieve_binary_usage_pending_apply(struct sieve_binary *sbin)
+{
+	struct sieve_binary_usage_pending *pending;
+
+	if (sbin->path == NULL)
+		return;
+	pending = sieve_binary_usage_pending_get(sbin->path, FALSE);
+	if (pending == NULL)
+		return;
+
+	/* The usage moves to this binary object; it is returned to the
+	   pending record (or written) once the binary is closed */
+	if (pending->rusage.cpu_time_msecs > 0 ||
+	    pending->pool_size > sbin->pool_size) {
+		sieve_resource_usage_add(&sbin->rusage, &pending->rusage);
+		sbin->pool_size = I_MAX(sbin->pool_size, pending->pool_size);
+		sbin->rusage_updated = TRUE;
+		(void)sieve_binary_check_resource_usage(sbin);
+	}
+	sieve_resource_usage_init(&pending->rusage);
+	pending->pool_size = 0;
+}
+
+void sieve_binary_usage_pending_free(void)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_binary_usage_pending *pending;
+	char *path;
+
+	if (!hash_table_is_created(sieve_binary_usage_pending))
+		return;
+
+	iter = hash_table_iterate_init(sieve_binary_usage_pending);
+	while (hash_table_iterate(iter, sieve_binary_usage_pending,
+				  &path, &pending)) {
+		i_free(pending->path);
+		i_free(pending);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&sieve_binary_usage_pending);
+}
+
 static void sieve_binary_update_resource_usage(struct sieve_binary *sbin)
 {
+	struct sieve_binary_usage_pending *pending;
 	enum sieve_error error;
 
-	if (sbin->rusage_updated)
-		(void)sieve_binary_file_update_resource_usage(sbin, &error);
+	if (!sbin->rusage_updated)
+		return;
 	sbin->rusage_updated = FALSE;
+	if (sbin->path == NULL)
+		return;
+
+	pending = sieve_binary_usage_pending_get(sbin->path, TRUE);
+
+	/* Write at most once per interval, unless the script just hit the
+	   resource limit; other processes need to know that right away. */
+	if (!HAS_ALL_BITS(sbin->header.flags,
+			  SIEVE_BINARY_FLAG_RESOURCE_LIMIT) &&
+	    pending->last_flush != 0 &&
+	    (ioloop_time - pending->last_flush) <
+	    SIEVE_BINARY_USAGE_FLUSH_INTERVAL_SECS) {
+		sieve_resource_usage_add(&pending->rusage, &sbin->rusage);
+		pending->pool_size = I_MAX(pending->pool_size,
+					   sbin->pool_size);
+		sieve_resource_usage_init(&sbin->rusage);
+		return;
+	}
+
+	if (sieve_binary_file_update_resource_usage(sbin, &error) > 0) {
+		pending->last_flush = ioloop_time;
+		return;
+	}
+
+	/* Locked or failed; try again later */
+	sieve_resource_usage_add(&pending->rusage, &sbin->rusage);
+	pending->pool_size = I_MAX(pending->pool_size, sbin->pool_size);
+	sieve_resource_usage_init(&sbin->rusage);
 }
 
 void sieve_binary_unref(struct sieve_binary **_sbin)
 {
 	struct sieve_binary *sbin = *_sbin;
+	struct sieve_binary_mmap *map;
 
 	*_sbin = NULL;
 	if (sbin == NULL)
@@ -163,13 +331,20 @@ void sieve_binary_unref(struct sieve_binary **_sbin)
 
 	sieve_binary_file_close(&sbin->file);
 	sieve_binary_update_resource_usage(sbin);
+	sieve_binary_compile_unlock(sbin);
 	sieve_binary_extensions_free(sbin);
+	sieve_binary_blocks_free(sbin);
+	sieve_binary_runtime_objects_free(sbin);
 
 	if (sbin->script != NULL)
 		sieve_script_unref(&sbin->script);
 
 	event_unref(&sbin->event);
+
+	/* Blocks may point into the mapping; drop it last */
+	map = sbin->mmap;
 	pool_unref(&sbin->pool);
+	sieve_binary_mmap_unref(&map);
 }
 
 void sieve_binary_close(struct sieve_binary **_sbin)
@@ -251,6 +426,37 @@ void sieve_binary_set_resource_usage(struct sieve_binary *sbin,
 	(void)sieve_binary_check_resource_usage(sbin);
 }
 
+/*
+ * Pool sizing
+ */
+
+size_t sieve_binary_get_pool_size_hint(struct sieve_binary *sbin)
+{
+	size_t pool_size;
+
+	pool_size = I_MAX(sbin->pool_size,
+			  sbin->header.resource_usage.pool_size);
+	return I_MIN(pool_size, SIEVE_BINARY_MAX_POOL_SIZE_HINT);
+}
+
+void sieve_binary_record_pool_usage(struct sieve_binary *sbin, size_t used)
+{
+	size_t stored = sbin->header.resource_usage.pool_size;
+
+	used = I_MIN(used, SIEVE_BINARY_MAX_POOL_SIZE_HINT);
+	if (used <= sbin->pool_size)
+		return;
+	sbin->pool_size = used;
+
+	/* Only write the header for significant growth, so that it is not
+	   rewritten for every delivery */
+	if (used > stored + stored / 2) {
+		e_debug(sbin->event, "Interpreter pool size hint raised "
+			"to %zu bytes", used);
+		sbin->rusage_updated = TRUE;
+	}
+}
+
 /*
  * Accessors
  */
@@ -277,12 +483,12 @@ bool sieve_binary_saved(struct sieve_binary *sbin)
 
 bool sieve_binary_loaded(struct sieve_binary *sbin)
 {
-	return (sbin->file != NULL);
+	return sbin->loaded;
 }
 
 const char *sieve_binary_source(struct sieve_binary *sbin)
 {
-	if (sbin->script != NULL && (sbin->path == NULL || sbin->file == NULL))
+	if (sbin->script != NULL && (sbin->path == NULL || !sbin->loaded))
 		return sieve_script_location(sbin->script);
 
 	return sbin->path;
@@ -295,14 +501,14 @@ struct sieve_instance *sieve_binary_svinst(struct sieve_binary *sbin)
 
 time_t sieve_binary_mtime(struct sieve_binary *sbin)
 {
-	i_assert(sbin->file != NULL);
-	return sbin->file->st.st_mtime;
+	i_assert(sbin->loaded);
+	return sbin->st.st_mtime;
 }
 
 const struct stat *sieve_binary_stat(struct sieve_binary *sbin)
 {
-	i_assert(sbin->file != NULL);
-	return &sbin->file->st;
+	i_assert(sbin->loaded);
+	return &sbin->st;
 }
 
 const char *sieve_binary_script_name(struct sieve_binary *sbin)
@@ -369,9 +575,10 @@ static bool sieve_binary_block_fetch(struct sieve_binary_block *sblock)
 {
 	struct sieve_binary *sbin = sblock->sbin;
 
-	if (sbin->file != NULL) {
+	if (sbin->file != NULL || sbin->mmap != NULL) {
 		/* Try to acces the block in the binary on disk (apparently we
-		   were lazy)
+		   were lazy). A mapped binary can still be read after its file
+		   is closed.
 		 */
 		if (!sieve_binary_load_block(sblock) || sblock->data == NULL)
 			return FALSE;
@@ -397,8 +604,43 @@ sieve_binary_block_get(struct sieve_binary *sbin, unsigned int id)
 	return sblock;
 }
 
+bool sieve_binary_load_blocks(struct sieve_binary *sbin)
+{
+	unsigned int count = sieve_binary_block_count(sbin), i;
+
+	for (i = 0; i < count; i++) {
+		if (sieve_binary_block_index(sbin, i) == NULL)
+			continue;
+		if (sieve_binary_block_get(sbin, i) == NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+size_t sieve_binary_get_memory_usage(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *const *blocks;
+	unsigned int count, i;
+	size_t size = 0;
+
+	blocks = array_get(&sbin->blocks, &count);
+	for (i = 0; i < count; i++) {
+		if (blocks[i] == NULL || blocks[i]->data == NULL ||
+		    blocks[i]->mapped)
+			continue;
+		size += buffer_get_size(blocks[i]->data);
+	}
+	return size;
+}
+
 void sieve_binary_block_clear(struct sieve_binary_block *sblock)
 {
+	if (sblock->mapped) {
+		/* Read-only mapping; continue in a private buffer */
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->mapped = FALSE;
+		return;
+	}
 	buffer_set_used_size(sblock->data, 0);
 }
 
@@ -426,6 +668,327 @@ size_t sieve_binary_block_get_size(const struct sieve_binary_block *sblock)
 	return _sieve_binary_block_get_size(sblock);
 }
 
+/*
+ * Code digest
+ */
+
+bool sieve_binary_get_code_digest(struct sieve_binary *sbin,
+				  unsigned char digest_r[SHA1_RESULTLEN])
+{
+	struct sha1_ctxt ctx;
+	unsigned int count = sieve_binary_block_count(sbin), i;
+
+	if (sbin->code_digest_valid) {
+		memcpy(digest_r, sbin->code_digest, SHA1_RESULTLEN);
+		return TRUE;
+	}
+
+	/* The script data block only holds metadata about the source (path,
+	   resource usage), which differs between otherwise identical binaries.
+	 */
+	sha1_init(&ctx);
+	for (i = SBIN_SYSBLOCK_SCRIPT_DATA + 1; i < count; i++) {
+		struct sieve_binary_block *sblock;
+		size_t hdr[2];
+
+		if (sieve_binary_block_index(sbin, i) == NULL)
+			continue;
+		sblock = sieve_binary_block_get(sbin, i);
+		if (sblock == NULL)
+			return FALSE;
+
+		hdr[0] = i;
+		hdr[1] = sblock->data->used;
+		sha1_loop(&ctx, hdr, sizeof(hdr));
+		sha1_loop(&ctx, sblock->data->data, sblock->data->used);
+	}
+	sha1_result(&ctx, sbin->code_digest);
+	sbin->code_digest_valid = TRUE;
+
+	memcpy(digest_r, sbin->code_digest, SHA1_RESULTLEN);
+	return TRUE;
+}
+
+/*
+ * Program shape
+ */
+
+bool sieve_binary_program_is_empty(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	sieve_size_t address = 0;
+	unsigned int debug_block_id, ext_count;
+
+	if (sbin->program_checked)
+		return sbin->program_empty;
+	sbin->program_checked = TRUE;
+	sbin->program_empty = FALSE;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MAIN_PROGRAM);
+	if (sblock == NULL)
+		return FALSE;
+
+	/* Program preamble: debug block id and linked extensions */
+	if (!sieve_binary_read_unsigned(sblock, &address, &debug_block_id) ||
+	    !sieve_binary_read_unsigned(sblock, &address, &ext_count) ||
+	    ext_count > 0)
+		return FALSE;
+
+	sbin->program_empty =
+		(address == _sieve_binary_block_get_size(sblock));
+	return sbin->program_empty;
+}
+
+/*
+ * Operation cache
+ */
+
+/* Blocks up to this size get a directly indexed operation table. This costs
+   one pointer per code byte, but avoids hashing the address for every
+   executed operation. */
+#define SIEVE_BINARY_OP_TABLE_MAX_SIZE (64 * 1024)
+
+static void
+sieve_binary_block_op_cache_reset(struct sieve_binary_block *sblock)
+{
+	if (hash_table_is_created(sblock->op_cache))
+		hash_table_destroy(&sblock->op_cache);
+	i_free(sblock->op_table);
+}
+
+const struct sieve_binary_op_cache_entry *
+sieve_binary_block_op_cache_lookup(struct sieve_binary_block *sblock,
+				   sieve_size_t address)
+{
+	if (sblock->op_table == NULL &&
+	    !hash_table_is_created(sblock->op_cache))
+		return NULL;
+
+	if (sblock->op_cache_size != _sieve_binary_block_get_size(sblock)) {
+		/* Block was modified since the cache was populated */
+		sieve_binary_block_op_cache_reset(sblock);
+		return NULL;
+	}
+
+	if (sblock->op_table != NULL) {
+		if (address >= sblock->op_cache_size)
+			return NULL;
+		return sblock->op_table[address];
+	}
+	return hash_table_lookup(sblock->op_cache, POINTER_CAST(address + 1));
+}
+
+void sieve_binary_block_op_cache_add(
+	struct sieve_binary_block *sblock, sieve_size_t address,
+	const struct sieve_binary_op_cache_entry *entry)
+{
+	struct sieve_binary_op_cache_entry *new_entry;
+	size_t size = _sieve_binary_block_get_size(sblock);
+
+	if (sblock->op_table == NULL &&
+	    !hash_table_is_created(sblock->op_cache)) {
+		if (size <= SIEVE_BINARY_OP_TABLE_MAX_SIZE) {
+			sblock->op_table = i_new(
+				struct sieve_binary_op_cache_entry *, size);
+		} else {
+			hash_table_create_direct(&sblock->op_cache,
+						 default_pool, 0);
+		}
+		sblock->op_cache_size = size;
+	}
+
+	new_entry = p_new(sblock->sbin->pool,
+			  struct sieve_binary_op_cache_entry, 1);
+	*new_entry = *entry;
+
+	if (sblock->op_table != NULL) {
+		i_assert(address < sblock->op_cache_size);
+		sblock->op_table[address] = new_entry;
+		return;
+	}
+	hash_table_insert(sblock->op_cache, POINTER_CAST(address + 1),
+			  new_entry);
+}
+
+/*
+ * Runtime objects
+ */
+
+#define SIEVE_BINARY_MAX_RUNTIME_OBJECTS 128
+
+struct sieve_binary_runtime_object {
+	void *object;
+	sieve_binary_object_free_func_t *free_func;
+};
+
+void *sieve_binary_runtime_object_lookup(struct sieve_binary *sbin,
+					 const char *key)
+{
+	struct sieve_binary_runtime_object *robj;
+
+	if (!hash_table_is_created(sbin->runtime_objects))
+		return NULL;
+
+	robj = hash_table_lookup(sbin->runtime_objects, key);
+	return (robj == NULL ? NULL : robj->object);
+}
+
+bool sieve_binary_runtime_object_add(
+	struct sieve_binary *sbin, const char *key, void *object,
+	sieve_binary_object_free_func_t *free_func)
+{
+	struct sieve_binary_runtime_object *robj;
+
+	if (!hash_table_is_created(sbin->runtime_objects)) {
+		hash_table_create(&sbin->runtime_objects, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	if (hash_table_count(sbin->runtime_objects) >=
+	    SIEVE_BINARY_MAX_RUNTIME_OBJECTS)
+		return FALSE;
+	i_assert(hash_table_lookup(sbin->runtime_objects, key) == NULL);
+
+	robj = p_new(sbin->pool, struct sieve_binary_runtime_object, 1);
+	robj->object = object;
+	robj->free_func = free_func;
+
+	hash_table_insert(sbin->runtime_objects,
+			  p_strdup(sbin->pool, key), robj);
+	return TRUE;
+}
+
+static void sieve_binary_runtime_objects_free(struct sieve_binary *sbin)
+{
+	struct hash_iterate_context *hctx;
+	const char *key;
+	struct sieve_binary_runtime_object *robj;
+
+	if (!hash_table_is_created(sbin->runtime_objects))
+		return;
+
+	hctx = hash_table_iterate_init(sbin->runtime_objects);
+	while (hash_table_iterate(hctx, sbin->runtime_objects, &key, &robj)) {
+		if (robj->free_func != NULL)
+			robj->free_func(robj->object);
+	}
+	hash_table_iterate_deinit(&hctx);
+	hash_table_destroy(&sbin->runtime_objects);
+}
+
+/*
+ * Message headers
+ */
+
+void sieve_binary_add_message_header(struct sieve_binary *sbin,
+				     const char *field_name)
+{
+	const char *const *namep, *name;
+
+	if (!array_is_created(&sbin->message_headers))
+		p_array_init(&sbin->message_headers, sbin->pool, 16);
+
+	array_foreach(&sbin->message_headers, namep) {
+		if (strcasecmp(*namep, field_name) == 0)
+			return;
+	}
+
+	name = p_strdup(sbin->pool, field_name);
+	array_append(&sbin->message_headers, &name, 1);
+}
+
+void sieve_binary_emit_message_headers(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	const char *const *namep;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MESSAGE_HEADERS);
+	i_assert(sblock != NULL);
+	sieve_binary_block_clear(sblock);
+
+	if (!array_is_created(&sbin->message_headers)) {
+		(void)sieve_binary_emit_unsigned(sblock, 0);
+	} else {
+		(void)sieve_binary_emit_unsigned(
+			sblock, array_count(&sbin->message_headers));
+		array_foreach(&sbin->message_headers, namep)
+			(void)sieve_binary_emit_cstring(sblock, *namep);
+	}
+	(void)sieve_binary_emit_unsigned(sblock, sbin->message_fields);
+	sbin->message_headers_read = TRUE;
+}
+
+static void sieve_binary_read_message_headers(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	sieve_size_t offset = 0;
+	unsigned int count, i;
+	string_t *name;
+
+	sbin->message_headers_read = TRUE;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_MESSAGE_HEADERS);
+	if (sblock == NULL || sieve_binary_block_get_size(sblock) == 0)
+		return;
+
+	if (!sieve_binary_read_unsigned(sblock, &offset, &count)) {
+		e_warning(sbin->event,
+			  "failed to read message header list");
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (!sieve_binary_read_string(sblock, &offset, &name)) {
+			e_warning(sbin->event,
+				  "failed to read message header list");
+			return;
+		}
+		sieve_binary_add_message_header(sbin, str_c(name));
+	}
+
+	/* Older binaries lack the message fields */
+	if (offset < sieve_binary_block_get_size(sblock)) {
+		unsigned int fields;
+
+		if (!sieve_binary_read_unsigned(sblock, &offset, &fields)) {
+			e_warning(sbin->event,
+				  "failed to read message field list");
+			return;
+		}
+		sbin->message_fields = fields;
+	}
+}
+
+const char *const *
+sieve_binary_get_message_headers(struct sieve_binary *sbin,
+				 unsigned int *count_r)
+{
+	if (!sbin->message_headers_read) T_BEGIN {
+		sieve_binary_read_message_headers(sbin);
+	} T_END;
+
+	if (!array_is_created(&sbin->message_headers) ||
+	    array_count(&sbin->message_headers) == 0) {
+		*count_r = 0;
+		return NULL;
+	}
+	return array_get(&sbin->message_headers, count_r);
+}
+
+void sieve_binary_add_message_fields(struct sieve_binary *sbin,
+				     enum sieve_message_fields fields)
+{
+	sbin->message_fields |= fields;
+}
+
+enum sieve_message_fields
+sieve_binary_get_message_fields(struct sieve_binary *sbin)
+{
+	if (!sbin->message_headers_read) T_BEGIN {
+		sieve_binary_read_message_headers(sbin);
+	} T_END;
+
+	return sbin->message_fields;
+}
+
 /*
  * Up-to-date checking
  */
@@ -439,14 +1002,28 @@ bool sieve_binary_up_to_date(struct sieve_binary *sbin,
 	unsigned int ext_count, i;
 	int ret;
 
-	i_assert(sbin->file != NULL);
+	i_assert(sbin->loaded);
 
 	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
 	if (sblock == NULL || sbin->script == NULL)
 		return FALSE;
 
-	if ((ret = sieve_script_binary_read_metadata(sbin->script, sblock,
-						     &offset)) <= 0) {
+	if (sbin->shared) {
+		const char *path =
+			sieve_script_binary_get_shared_path(sbin->script);
+
+		/* The metadata records the script of whichever user compiled
+		   the binary; the digest in the file name is what identifies
+		   the source. */
+		if (path == NULL || strcmp(path, sbin->path) != 0) {
+			e_debug(sbin->event, "up-to-date: "
+				"script source does not match shared binary");
+			return FALSE;
+		}
+	} else if ((ret = sieve_script_binary_read_metadata(
+			sbin->script, sblock, &offset)) <= 0) {
+		/* Binary will be replaced; don't let others reuse the mapping */
+		sieve_binary_mmap_invalidate(sbin);
 		if (ret < 0) {
 			e_debug(sbin->event, "up-to-date: "
 				"failed to read script metadata from binary");
@@ -464,6 +1041,7 @@ bool sieve_binary_up_to_date(struct sieve_binary *sbin,
 		if (binext != NULL && binext->binary_up_to_date != NULL &&
 		    !binext->binary_up_to_date(regs[i]->extension, sbin,
 					       regs[i]->context, cpflags)) {
+			sieve_binary_mmap_invalidate(sbin);
 			e_debug(sbin->event, "up-to-date: "
 				"the %s extension indicates binary is not up-to-date",
 				sieve_extension_name(regs[i]->extension));
@@ -473,6 +1051,11 @@ bool sieve_binary_up_to_date(struct sieve_binary *sbin,
 	return TRUE;
 }
 
+bool sieve_binary_is_outdated(struct sieve_binary *sbin)
+{
+	return sbin->outdated;
+}
+
 /*
  * Activate the binary (after code generation)
  */
@@ -2,6 +2,7 @@
 #define SIEVE_BINARY_H
 
 #include "lib.h"
+#include "sha1.h"
 
 #include "sieve-common.h"
 
@@ -9,7 +10,7 @@
  * Config
  */
 
-#define SIEVE_BINARY_VERSION_MAJOR     2
+#define SIEVE_BINARY_VERSION_MAJOR     6
 #define SIEVE_BINARY_VERSION_MINOR     0
 
 #define SIEVE_BINARY_BASE_HEADER_SIZE  20
@@ -37,6 +38,21 @@ bool sieve_binary_record_resource_usage(
 	ATTR_NULL(1);
 void sieve_binary_set_resource_usage(struct sieve_binary *sbin,
 				     const struct sieve_resource_usage *rusage);
+/*
+ * Pool sizing
+ */
+
+/* Upper bound for the recorded interpreter pool size */
+#define SIEVE_BINARY_MAX_POOL_SIZE_HINT (1024 * 1024)
+
+/* Returns the largest interpreter pool usage recorded for this binary, either
+   in this process or stored in the binary header by earlier deliveries, so
+   that the next interpreter pool can be allocated in one block. */
+size_t sieve_binary_get_pool_size_hint(struct sieve_binary *sbin);
+/* Records the interpreter pool usage of a finished run. Significant growth is
+   written to the binary header when it is closed. */
+void sieve_binary_record_pool_usage(struct sieve_binary *sbin, size_t used);
+
 /*
  * Accessors
  */
@@ -74,6 +90,20 @@ void sieve_binary_activate(struct sieve_binary *sbin);
 
 int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 		      mode_t save_mode, enum sieve_error *error_r);
+/* Makes the binary belong to another script with the same source, such as the
+   stored script once an uploaded temporary script is committed. The script
+   metadata is rewritten, so that the binary is accepted for the new script
+   once saved. */
+void sieve_binary_rebind_script(struct sieve_binary *sbin,
+				struct sieve_script *script);
+/* Saves the binary in the shared binary directory (sieve_binary_shared_dir).
+   Binaries that depend on anything other than the script source, such as
+   included scripts, are not shared and nothing is saved for those. */
+int sieve_binary_save_shared(struct sieve_binary *sbin, bool update,
+			     enum sieve_error *error_r);
+/* Returns whether the binary only depends on the script source (and the
+   enabled extensions), so that it can be shared with other users. */
+bool sieve_binary_is_shareable(struct sieve_binary *sbin);
 
 /*
  * Loading the binary
@@ -82,8 +112,18 @@ int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 struct sieve_binary *
 sieve_binary_open(struct sieve_instance *svinst, const char *path,
 		  struct sieve_script *script, enum sieve_error *error_r);
+/* Opens the binary for the script from the shared binary directory. Returns
+   NULL if there is none. */
+struct sieve_binary *
+sieve_binary_open_shared(struct sieve_script *script,
+			 enum sieve_error *error_r);
 bool sieve_binary_up_to_date(struct sieve_binary *sbin,
 			     enum sieve_compile_flags cpflags);
+/* Returns TRUE if the binary was stored with an older binary format revision
+   or extension version that can still be executed. Such a binary is up to
+   date as far as its script is concerned, but it should be recompiled when
+   convenient. */
+bool sieve_binary_is_outdated(struct sieve_binary *sbin);
 
 int sieve_binary_check_executable(struct sieve_binary *sbin,
 				  enum sieve_error *error_r,
@@ -97,6 +137,8 @@ enum sieve_binary_system_block {
 	SBIN_SYSBLOCK_SCRIPT_DATA,
 	SBIN_SYSBLOCK_EXTENSIONS,
 	SBIN_SYSBLOCK_MAIN_PROGRAM,
+	SBIN_SYSBLOCK_MESSAGE_HEADERS,
+	SBIN_SYSBLOCK_STRINGS,
 	SBIN_SYSBLOCK_LAST
 };
 
@@ -116,6 +158,95 @@ sieve_binary_block_get_binary(const struct sieve_binary_block *sblock);
 
 unsigned int sieve_binary_block_get_id(const struct sieve_binary_block *sblock);
 
+/*
+ * Code digest
+ */
+
+/* Returns a SHA1 digest over all code blocks of the binary, leaving out the
+   metadata about its source script. Binaries compiled from identical scripts
+   produce the same digest, regardless of where they are stored. Must only be
+   used once the binary is complete; the digest is computed once. Returns
+   FALSE if a block could not be read. */
+bool sieve_binary_get_code_digest(struct sieve_binary *sbin,
+				  unsigned char digest_r[SHA1_RESULTLEN]);
+
+/*
+ * Program shape
+ */
+
+/* Returns TRUE if the main program contains no operations and links no
+   extensions, e.g. for a script consisting only of comments. Running such a
+   program always results in the implicit keep. The outcome is computed once.
+ */
+bool sieve_binary_program_is_empty(struct sieve_binary *sbin);
+
+/*
+ * Operation cache
+ */
+
+/* Decoded operations are memoized per block, so that code executed repeatedly
+   (for each message or within loops) needs to resolve its operation only
+   once. */
+
+struct sieve_binary_op_cache_entry {
+	const struct sieve_operation_def *def;
+	const struct sieve_extension *ext;
+
+	/* Offset of the first operand relative to the operation address */
+	unsigned int operand_offset;
+};
+
+const struct sieve_binary_op_cache_entry *
+sieve_binary_block_op_cache_lookup(struct sieve_binary_block *sblock,
+				   sieve_size_t address);
+void sieve_binary_block_op_cache_add(
+	struct sieve_binary_block *sblock, sieve_size_t address,
+	const struct sieve_binary_op_cache_entry *entry);
+
+/*
+ * Runtime objects
+ */
+
+/* Objects derived from the binary's code at runtime (e.g. pre-processed match
+   keys) can be associated with the binary, so that these are shared by all
+   executions of the binary. The number of objects is bounded; when the limit
+   is reached, sieve_binary_runtime_object_add() returns FALSE and the caller
+   retains ownership of the object. */
+
+typedef void sieve_binary_object_free_func_t(void *object);
+
+void *sieve_binary_runtime_object_lookup(struct sieve_binary *sbin,
+					 const char *key);
+bool sieve_binary_runtime_object_add(
+	struct sieve_binary *sbin, const char *key, void *object,
+	sieve_binary_object_free_func_t *free_func);
+
+/*
+ * Message headers
+ */
+
+/* The names of the header fields tested by the script (insofar these are
+   known at compile time) are recorded in the binary. This way, all of these
+   can be requested from the mail storage before execution, so that the
+   message header is parsed only once. */
+
+void sieve_binary_add_message_header(struct sieve_binary *sbin,
+				     const char *field_name);
+/* Writes the recorded header field names to the binary (called once code
+   generation is finished). */
+void sieve_binary_emit_message_headers(struct sieve_binary *sbin);
+/* Returns the recorded header field names, or NULL when there are none. */
+const char *const *
+sieve_binary_get_message_headers(struct sieve_binary *sbin,
+				 unsigned int *count_r);
+
+/* Other message fields used by the script (e.g. the message size) are
+   recorded the same way. */
+void sieve_binary_add_message_fields(struct sieve_binary *sbin,
+				     enum sieve_message_fields fields);
+enum sieve_message_fields
+sieve_binary_get_message_fields(struct sieve_binary *sbin);
+
 /*
  * Extension support
  */
@@ -197,6 +328,11 @@ sieve_size_t sieve_binary_emit_string(struct sieve_binary_block *sblock,
 sieve_size_t sieve_binary_emit_cstring(struct sieve_binary_block *sblock,
 				       const char *str);
 
+/* Adds the string to the string table of the binary (once) and emits a
+   reference to it. */
+sieve_size_t sieve_binary_emit_string_ref(struct sieve_binary_block *sblock,
+					  const string_t *str);
+
 static inline sieve_size_t
 sieve_binary_emit_unsigned(struct sieve_binary_block *sblock,
 			   unsigned int count)
@@ -234,6 +370,9 @@ bool sieve_binary_read_integer(struct sieve_binary_block *sblock,
 bool sieve_binary_read_string(struct sieve_binary_block *sblock,
 			      sieve_size_t *address, string_t **str_r)
 			      ATTR_NULL(3);
+bool sieve_binary_read_string_ref(struct sieve_binary_block *sblock,
+				  sieve_size_t *address, string_t **str_r)
+				  ATTR_NULL(3);
 
 static inline bool ATTR_NULL(3)
 sieve_binary_read_unsigned(struct sieve_binary_block *sblock,
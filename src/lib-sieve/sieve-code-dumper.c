@@ -6,6 +6,8 @@
 
 #include "lib.h"
 #include "str.h"
+#include "array.h"
+#include "hash.h"
 #include "mempool.h"
 #include "ostream.h"
 
@@ -21,6 +23,33 @@
 
 #include "sieve-dump.h"
 
+/*
+ * Code statistics
+ */
+
+/* Upper bounds of the string operand size classes; the last class holds
+   everything larger */
+static const size_t sieve_code_dumper_string_classes[] = {
+	16, 64, 256, 1024, 4096
+};
+#define SIEVE_CODE_DUMPER_STRING_CLASSES \
+	(N_ELEMENTS(sieve_code_dumper_string_classes) + 1)
+
+struct sieve_code_dumper_op_stats {
+	const char *name;
+	unsigned int count;
+	sieve_size_t size;
+};
+
+struct sieve_code_dumper_stats {
+	HASH_TABLE(const char *, struct sieve_code_dumper_op_stats *) ops;
+	unsigned int op_count;
+
+	unsigned int string_count;
+	size_t string_size, string_max_size;
+	unsigned int string_classes[SIEVE_CODE_DUMPER_STRING_CLASSES];
+};
+
 /*
  * Code dumper extension
  */
@@ -47,6 +76,9 @@ struct sieve_code_dumper {
 	struct sieve_binary_debug_reader *dreader;
 
 	ARRAY(struct sieve_code_dumper_extension_reg) extensions;
+
+	/* Statistics (only collected when enabled; suppresses output) */
+	struct sieve_code_dumper_stats *stats;
 };
 
 struct sieve_code_dumper *sieve_code_dumper_create
@@ -91,6 +123,16 @@ pool_t sieve_code_dumper_pool(struct sieve_code_dumper *cdumper)
 	return cdumper->pool;
 }
 
+void sieve_code_dumper_enable_stats(struct sieve_code_dumper *cdumper)
+{
+	if ( cdumper->stats != NULL )
+		return;
+
+	cdumper->stats = p_new(cdumper->pool, struct sieve_code_dumper_stats, 1);
+	hash_table_create(&cdumper->stats->ops, cdumper->pool, 0,
+		str_hash, strcmp);
+}
+
 /* EXtension support */
 
 void sieve_dump_extension_register
@@ -139,10 +181,14 @@ void sieve_code_dumpf
 {
 	struct sieve_code_dumper *cdumper = denv->cdumper;
 	unsigned tab = cdumper->indent;
-
-	string_t *outbuf = t_str_new(128);
+	string_t *outbuf;
 	va_list args;
 
+	/* No listing is produced while collecting statistics */
+	if ( cdumper->stats != NULL )
+		return;
+
+	outbuf = t_str_new(128);
 	va_start(args, fmt);
 	str_printfa(outbuf, "%08llx: ", (unsigned long long) cdumper->mark_address);
 
@@ -199,6 +245,122 @@ void sieve_code_ascend(const struct sieve_dumptime_env *denv)
 		denv->cdumper->indent--;
 }
 
+/* Statistics */
+
+void sieve_code_dumper_count_string
+(const struct sieve_dumptime_env *denv, size_t size)
+{
+	struct sieve_code_dumper_stats *stats = denv->cdumper->stats;
+	unsigned int i;
+
+	if ( stats == NULL )
+		return;
+
+	stats->string_count++;
+	stats->string_size += size;
+	if ( size > stats->string_max_size )
+		stats->string_max_size = size;
+
+	for ( i = 0; i < N_ELEMENTS(sieve_code_dumper_string_classes); i++ ) {
+		if ( size <= sieve_code_dumper_string_classes[i] )
+			break;
+	}
+	stats->string_classes[i]++;
+}
+
+static void sieve_code_dumper_count_operation
+(struct sieve_code_dumper *cdumper, const struct sieve_operation *oprtn,
+	sieve_size_t size)
+{
+	struct sieve_code_dumper_stats *stats = cdumper->stats;
+	struct sieve_code_dumper_op_stats *opstats;
+	const char *name = oprtn->def->mnemonic;
+
+	if ( name == NULL )
+		name = "[unnamed]";
+
+	opstats = hash_table_lookup(stats->ops, name);
+	if ( opstats == NULL ) {
+		opstats = p_new(cdumper->pool, struct sieve_code_dumper_op_stats, 1);
+		opstats->name = p_strdup(cdumper->pool, name);
+		hash_table_insert(stats->ops, opstats->name, opstats);
+	}
+
+	opstats->count++;
+	opstats->size += size;
+	stats->op_count++;
+}
+
+static int sieve_code_dumper_op_stats_cmp
+(struct sieve_code_dumper_op_stats *const *op1,
+	struct sieve_code_dumper_op_stats *const *op2)
+{
+	if ( (*op1)->size != (*op2)->size )
+		return ( (*op1)->size > (*op2)->size ? -1 : 1 );
+	return strcmp((*op1)->name, (*op2)->name);
+}
+
+void sieve_code_dumper_write_stats(struct sieve_code_dumper *cdumper)
+{
+	struct sieve_dumptime_env *denv = cdumper->dumpenv;
+	struct sieve_code_dumper_stats *stats = cdumper->stats;
+	ARRAY(struct sieve_code_dumper_op_stats *) ops;
+	struct sieve_code_dumper_op_stats *const *opstats;
+	struct hash_iterate_context *iter;
+	struct sieve_code_dumper_op_stats *op;
+	const char *name;
+	sieve_size_t code_size;
+	unsigned int count, i;
+
+	if ( stats == NULL )
+		return;
+
+	code_size = sieve_binary_block_get_size(denv->sblock);
+
+	/* Operation histogram, largest share of the code first */
+	t_array_init(&ops, hash_table_count(stats->ops));
+	iter = hash_table_iterate_init(stats->ops);
+	while ( hash_table_iterate(iter, stats->ops, &name, &op) )
+		array_append(&ops, &op, 1);
+	hash_table_iterate_deinit(&iter);
+	array_sort(&ops, sieve_code_dumper_op_stats_cmp);
+
+	sieve_binary_dump_sectionf(denv,
+		"Operations (count: %u; code size: %llu bytes)",
+		stats->op_count, (unsigned long long)code_size);
+
+	opstats = array_get(&ops, &count);
+	for ( i = 0; i < count; i++ ) {
+		sieve_binary_dumpf(denv,
+			"%-24s count: %6u  size: %8llu bytes  (%5.1f%%)\n",
+			opstats[i]->name, opstats[i]->count,
+			(unsigned long long)opstats[i]->size,
+			( code_size == 0 ? 0.0 :
+				100.0 * opstats[i]->size / code_size ));
+	}
+
+	/* String operands */
+	sieve_binary_dump_sectionf(denv, "String operands (count: %u)",
+		stats->string_count);
+
+	sieve_binary_dumpf(denv,
+		"total size = %zu bytes\n"
+		"average size = %zu bytes\n"
+		"maximum size = %zu bytes\n",
+		stats->string_size,
+		( stats->string_count == 0 ? 0 :
+			stats->string_size / stats->string_count ),
+		stats->string_max_size);
+
+	for ( i = 0; i < N_ELEMENTS(sieve_code_dumper_string_classes); i++ ) {
+		sieve_binary_dumpf(denv, "  <= %5zu bytes: %u\n",
+			sieve_code_dumper_string_classes[i],
+			stats->string_classes[i]);
+	}
+	sieve_binary_dumpf(denv, "   > %5zu bytes: %u\n",
+		sieve_code_dumper_string_classes[i-1], stats->string_classes[i]);
+}
+
 /* Code Dump */
 
 static bool sieve_code_dumper_print_operation
@@ -217,14 +379,21 @@ static bool sieve_code_dumper_print_operation
 	/* Read operation */
 	if ( sieve_operation_read(denv->sblock, address, oprtn) ) {
 		const struct sieve_operation_def *opdef = oprtn->def;
+		sieve_size_t start = cdumper->mark_address;
 
-		if ( opdef->dump != NULL )
-			return opdef->dump(denv, address);
-		else if ( opdef->mnemonic != NULL )
+		if ( opdef->dump != NULL ) {
+			if ( !opdef->dump(denv, address) )
+				return FALSE;
+		} else if ( opdef->mnemonic != NULL ) {
 			sieve_code_dumpf(denv, "%s", opdef->mnemonic);
-		else
+		} else {
 			return FALSE;
+		}
 
+		if ( cdumper->stats != NULL ) {
+			sieve_code_dumper_count_operation
+				(cdumper, oprtn, *address - start);
+		}
 		return TRUE;
 	}
 
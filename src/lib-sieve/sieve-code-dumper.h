@@ -52,4 +52,14 @@ bool sieve_code_dumper_print_optional_operands
 
 void sieve_code_dumper_run(struct sieve_code_dumper *dumper);
 
+/* Statistics */
+
+/* Collects operation and operand statistics instead of producing a listing
+   while the dumper runs. */
+void sieve_code_dumper_enable_stats(struct sieve_code_dumper *dumper);
+void sieve_code_dumper_write_stats(struct sieve_code_dumper *dumper);
+
+void sieve_code_dumper_count_string
+	(const struct sieve_dumptime_env *denv, size_t size);
+
 #endif
@@ -2,8 +2,10 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "smtp-address.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
@@ -167,7 +169,8 @@ const struct sieve_operand_def *sieve_operands[] = {
 	&comparator_operand,
 	&match_type_operand,
 	&address_part_operand,
-	&catenated_string_operand
+	&catenated_string_operand,
+	&address_operand
 };
 
 const unsigned int sieve_operand_count =
@@ -491,7 +494,7 @@ static int opr_number_read
 void sieve_opr_string_emit(struct sieve_binary_block *sblock, string_t *str)
 {
 	(void) sieve_operand_emit(sblock, NULL, &string_operand);
-	(void) sieve_binary_emit_string(sblock, str);
+	(void) sieve_binary_emit_string_ref(sblock, str);
 }
 
 bool sieve_opr_string_dump_data
@@ -620,6 +623,8 @@ static void _dump_string
 (const struct sieve_dumptime_env *denv, string_t *str,
 	const char *field_name)
 {
+	sieve_code_dumper_count_string(denv, str_len(str));
+
 	if ( str_len(str) > 80 ) {
 		if ( field_name != NULL )
 			sieve_code_dumpf(denv, "%s: STR[%ld] \"%s",
@@ -643,7 +648,7 @@ bool opr_string_dump
 {
 	string_t *str;
 
-	if ( sieve_binary_read_string(denv->sblock, address, &str) ) {
+	if ( sieve_binary_read_string_ref(denv->sblock, address, &str) ) {
 		_dump_string(denv, str, oprnd->field_name);
 
 		return TRUE;
@@ -656,7 +661,7 @@ static int opr_string_read
 (const struct sieve_runtime_env *renv, 	const struct sieve_operand *oprnd,
 	sieve_size_t *address, string_t **str_r)
 {
-	if ( !sieve_binary_read_string(renv->sblock, address, str_r) ) {
+	if ( !sieve_binary_read_string_ref(renv->sblock, address, str_r) ) {
 		sieve_runtime_trace_operand_error(renv, oprnd,
 			"invalid string operand");
 		return SIEVE_EXEC_BIN_CORRUPT;
@@ -665,6 +670,114 @@ static int opr_string_read
 	return SIEVE_EXEC_OK;
 }
 
+/* Address */
+
+static bool opr_address_dump
+	(const struct sieve_dumptime_env *denv, const struct sieve_operand *oprnd,
+		sieve_size_t *address);
+static int opr_address_read
+	(const struct sieve_runtime_env *renv, const struct sieve_operand *oprnd,
+		sieve_size_t *address, string_t **str_r);
+
+const struct sieve_opr_string_interface address_interface ={
+	opr_address_dump,
+	opr_address_read
+};
+
+const struct sieve_operand_def address_operand = {
+	.name = "@address",
+	.code = SIEVE_OPERAND_ADDRESS,
+	.class = &string_class,
+	.interface = &address_interface
+};
+
+void sieve_opr_address_emit
+(struct sieve_binary_block *sblock, string_t *str,
+	const struct smtp_address *address)
+{
+	(void) sieve_operand_emit(sblock, NULL, &address_operand);
+	(void) sieve_binary_emit_string_ref(sblock, str);
+	(void) sieve_binary_emit_cstring(sblock, address->localpart);
+	(void) sieve_binary_emit_cstring(sblock,
+		(address->domain == NULL ? "" : address->domain));
+}
+
+static bool opr_address_read_data
+(struct sieve_binary_block *sblock, sieve_size_t *address,
+	string_t **str_r, struct smtp_address *address_r)
+{
+	string_t *localpart, *domain;
+
+	if ( !sieve_binary_read_string_ref(sblock, address, str_r) ||
+		!sieve_binary_read_string(sblock, address, &localpart) ||
+		!sieve_binary_read_string(sblock, address, &domain) )
+		return FALSE;
+
+	if ( address_r != NULL ) {
+		i_zero(address_r);
+		address_r->localpart = str_c(localpart);
+		address_r->domain =
+			(str_len(domain) == 0 ? NULL : str_c(domain));
+	}
+	return TRUE;
+}
+
+static bool opr_address_dump
+(const struct sieve_dumptime_env *denv, const struct sieve_operand *oprnd,
+	sieve_size_t *address)
+{
+	string_t *str;
+
+	if ( !opr_address_read_data(denv->sblock, address, &str, NULL) )
+		return FALSE;
+
+	_dump_string(denv, str, oprnd->field_name);
+	return TRUE;
+}
+
+static int opr_address_read
+(const struct sieve_runtime_env *renv, const struct sieve_operand *oprnd,
+	sieve_size_t *address, string_t **str_r)
+{
+	if ( !opr_address_read_data(renv->sblock, address, str_r, NULL) ) {
+		sieve_runtime_trace_operand_error(renv, oprnd,
+			"invalid address operand");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
+
+	return SIEVE_EXEC_OK;
+}
+
+int sieve_opr_address_read
+(const struct sieve_runtime_env *renv, sieve_size_t *address,
+	const char *field_name, string_t **str_r,
+	const struct smtp_address **address_r)
+{
+	struct sieve_operand operand;
+	struct smtp_address *parsed;
+	int ret;
+
+	*address_r = NULL;
+
+	if ( (ret=sieve_operand_runtime_read(renv, address, field_name, &operand))
+		<= 0 )
+		return ret;
+
+	if ( !sieve_operand_is(&operand, address_operand) ) {
+		return sieve_opr_string_read_data
+			(renv, &operand, address, field_name, str_r);
+	}
+
+	parsed = t_new(struct smtp_address, 1);
+	if ( !opr_address_read_data(renv->sblock, address, str_r, parsed) ) {
+		sieve_runtime_trace_operand_error(renv, &operand,
+			"invalid address operand");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
+	*address_r = parsed;
+	return SIEVE_EXEC_OK;
+}
+
 /* String list */
 
 void sieve_opr_stringlist_emit_start
@@ -967,22 +1080,28 @@ static int opr_catenated_string_read
 				return ret;
 		}
 	} else {
-		string_t *strelm;
-		string_t **elm = &strelm;
+		ARRAY(string_t *) parts;
+		string_t *strelm, *const *part;
+		size_t size = 0;
 
-		*str = t_str_new(128);
+		/* Read all elements first, so that the result can be allocated
+		   at its final size at once */
+		t_array_init(&parts, I_MIN(elements, 16));
 		for ( i = 0; i < (unsigned int) elements; i++ ) {
-
-			if ( (ret=sieve_opr_string_read(renv, address, NULL, elm)) <= 0 )
+			if ( (ret=sieve_opr_string_read(renv, address, NULL, &strelm)) <= 0 )
 				return ret;
 
-			if ( elm != NULL ) {
-				str_append_str(*str, strelm);
+			array_append(&parts, &strelm, 1);
+			size += str_len(strelm);
+		}
+
+		*str = t_str_new(I_MIN(size, SIEVE_MAX_STRING_LEN) + 1);
+		array_foreach(&parts, part) {
+			str_append_str(*str, *part);
 
-				if ( str_len(*str) > SIEVE_MAX_STRING_LEN ) {
-					str_truncate(*str, SIEVE_MAX_STRING_LEN);
-					elm = NULL;
-				}
+			if ( str_len(*str) > SIEVE_MAX_STRING_LEN ) {
+				str_truncate(*str, SIEVE_MAX_STRING_LEN);
+				break;
 			}
 		}
 	}
@@ -1005,6 +1124,8 @@ static int opc_jmptrue_execute
 	(const struct sieve_runtime_env *renv, sieve_size_t *address);
 static int opc_jmpfalse_execute
 	(const struct sieve_runtime_env *renv, sieve_size_t *address);
+static int opc_cached_test_execute
+	(const struct sieve_runtime_env *renv, sieve_size_t *address);
 
 /* Operation objects defined in this file */
 
@@ -1029,6 +1150,13 @@ const struct sieve_operation_def sieve_jmpfalse_operation = {
 	.execute = opc_jmpfalse_execute
 };
 
+const struct sieve_operation_def sieve_cached_test_operation = {
+	.mnemonic = "CACHED_TEST",
+	.code = SIEVE_OPERATION_CACHED_TEST,
+	.dump = opc_jmp_dump,
+	.execute = opc_cached_test_execute
+};
+
 /* Operation objects defined in other files */
 
 extern const struct sieve_operation_def cmd_stop_operation;
@@ -1058,7 +1186,10 @@ const struct sieve_operation_def *sieve_operations[] = {
 	&tst_header_operation,
 	&tst_exists_operation,
 	&tst_size_over_operation,
-	&tst_size_under_operation
+	&tst_size_under_operation,
+
+	&sieve_cached_test_operation,
+	&tst_header_switch_operation
 };
 
 const unsigned int sieve_operation_count =
@@ -1116,6 +1247,38 @@ bool sieve_operation_read
 	return ( oprtn->def != NULL );
 }
 
+/* Same as sieve_operation_read(), but the decoded operation is memoized in the
+ * binary block, so that subsequent reads at the same address skip resolving
+ * the extension and the operation definition.
+ */
+bool sieve_operation_read_cached
+(struct sieve_binary_block *sblock, sieve_size_t *address,
+	struct sieve_operation *oprtn)
+{
+	const struct sieve_binary_op_cache_entry *entry;
+	struct sieve_binary_op_cache_entry new_entry;
+	sieve_size_t op_address = *address;
+
+	entry = sieve_binary_block_op_cache_lookup(sblock, op_address);
+	if ( entry != NULL ) {
+		oprtn->address = op_address;
+		oprtn->def = entry->def;
+		oprtn->ext = entry->ext;
+		*address = op_address + entry->operand_offset;
+		return TRUE;
+	}
+
+	if ( !sieve_operation_read(sblock, address, oprtn) )
+		return FALSE;
+
+	i_zero(&new_entry);
+	new_entry.def = oprtn->def;
+	new_entry.ext = oprtn->ext;
+	new_entry.operand_offset = *address - op_address;
+	sieve_binary_block_op_cache_add(sblock, op_address, &new_entry);
+	return TRUE;
+}
+
 /*
  * Jump operations
  */
@@ -1167,3 +1330,9 @@ static int opc_jmpfalse_execute
 
 	return sieve_interpreter_program_jump(renv->interp, !result, FALSE);
 }
+
+static int opc_cached_test_execute
+(const struct sieve_runtime_env *renv, sieve_size_t *address ATTR_UNUSED)
+{
+	return sieve_interpreter_program_cached_test(renv->interp);
+}
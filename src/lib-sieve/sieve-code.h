@@ -109,6 +109,7 @@ enum sieve_core_operand {
 	SIEVE_OPERAND_MATCH_TYPE,
 	SIEVE_OPERAND_ADDRESS_PART,
 	SIEVE_OPERAND_CATENATED_STRING,
+	SIEVE_OPERAND_ADDRESS,
 
 	SIEVE_OPERAND_CUSTOM
 };
@@ -126,6 +127,7 @@ extern const struct sieve_operand_def number_operand;
 extern const struct sieve_operand_def string_operand;
 extern const struct sieve_operand_def stringlist_operand;
 extern const struct sieve_operand_def catenated_string_operand;
+extern const struct sieve_operand_def address_operand;
 
 extern const struct sieve_operand_def *sieve_operands[];
 extern const unsigned int sieve_operand_count;
@@ -231,9 +233,26 @@ static inline bool sieve_operand_is_string
 static inline bool sieve_operand_is_string_literal
 (const struct sieve_operand *operand)
 {
-	return ( operand != NULL && sieve_operand_is(operand, string_operand) );
+	return ( operand != NULL &&
+		(sieve_operand_is(operand, string_operand) ||
+		 sieve_operand_is(operand, address_operand)) );
 }
 
+/* Address: a string literal that holds a valid address, stored together with
+   its parsed form so that it need not be parsed again at runtime */
+
+struct smtp_address;
+
+void sieve_opr_address_emit
+	(struct sieve_binary_block *sblock, string_t *str,
+		const struct smtp_address *address);
+/* Reads a string operand; *address_r is set when the operand was parsed at
+   compile time and NULL otherwise */
+int sieve_opr_address_read
+	(const struct sieve_runtime_env *renv, sieve_size_t *address,
+		const char *field_name, string_t **str_r,
+		const struct smtp_address **address_r);
+
 /* String list */
 
 void sieve_opr_stringlist_emit_start
@@ -310,6 +329,9 @@ sieve_size_t sieve_operation_emit
 bool sieve_operation_read
 	(struct sieve_binary_block *sblock, sieve_size_t *address,
 		struct sieve_operation *oprtn);
+bool sieve_operation_read_cached
+	(struct sieve_binary_block *sblock, sieve_size_t *address,
+		struct sieve_operation *oprtn);
 const char *sieve_operation_read_string
 	(struct sieve_binary_block *sblock, sieve_size_t *address);
 
@@ -336,6 +358,9 @@ enum sieve_operation_code {
 	SIEVE_OPERATION_SIZE_OVER,
 	SIEVE_OPERATION_SIZE_UNDER,
 
+	SIEVE_OPERATION_CACHED_TEST,
+	SIEVE_OPERATION_HEADER_SWITCH,
+
 	SIEVE_OPERATION_CUSTOM
 };
 
@@ -344,6 +369,9 @@ enum sieve_operation_code {
 extern const struct sieve_operation_def sieve_jmp_operation;
 extern const struct sieve_operation_def sieve_jmptrue_operation;
 extern const struct sieve_operation_def sieve_jmpfalse_operation;
+extern const struct sieve_operation_def sieve_cached_test_operation;
+
+extern const struct sieve_operation_def tst_header_switch_operation;
 
 extern const struct sieve_operation_def *sieve_operations[];
 extern const unsigned int sieve_operations_count;
@@ -8,6 +8,7 @@
 #include "rfc2822.h"
 
 #include "sieve-common.h"
+#include "sieve-address.h"
 #include "sieve-ast.h"
 #include "sieve-validator.h"
 #include "sieve-generator.h"
@@ -47,6 +48,15 @@ const struct sieve_argument_def string_argument = {
 	.generate = arg_string_generate
 };
 
+static bool arg_address_generate
+	(const struct sieve_codegen_env *cgenv, struct sieve_ast_argument *arg,
+		struct sieve_command *context);
+
+const struct sieve_argument_def address_argument = {
+	.identifier = "@address",
+	.generate = arg_address_generate
+};
+
 const struct sieve_argument_def string_list_argument = {
 	.identifier = "@string-list",
 	.validate = arg_string_list_validate,
@@ -73,6 +83,28 @@ static bool arg_string_generate
 	return TRUE;
 }
 
+static bool arg_address_generate
+(const struct sieve_codegen_env *cgenv, struct sieve_ast_argument *arg,
+	struct sieve_command *cmd ATTR_UNUSED)
+{
+	string_t *str = sieve_ast_argument_str(arg);
+
+	T_BEGIN {
+		const struct smtp_address *address;
+		const char *error;
+
+		/* Validated before; parse it once more here to store the
+		   result */
+		address = sieve_address_parse_str(str, &error);
+		if ( address != NULL )
+			sieve_opr_address_emit(cgenv->sblock, str, address);
+		else
+			sieve_opr_string_emit(cgenv->sblock, str);
+	} T_END;
+
+	return TRUE;
+}
+
 static bool arg_string_list_validate
 (struct sieve_validator *valdtr, struct sieve_ast_argument **arg,
 	struct sieve_command *cmd)
@@ -61,7 +61,8 @@ struct sieve_argument {
 /* Utility macros */
 
 #define sieve_argument_is_string_literal(arg) \
-	( (arg)->argument->def == &string_argument )
+	( (arg)->argument->def == &string_argument || \
+		(arg)->argument->def == &address_argument )
 
 /* Error handling */
 
@@ -95,6 +96,9 @@ extern const struct sieve_argument_def number_argument;
 extern const struct sieve_argument_def string_argument;
 extern const struct sieve_argument_def string_list_argument;
 
+/* String literal that is a valid address; it is emitted in parsed form */
+extern const struct sieve_argument_def address_argument;
+
 /* Catenated string argument */
 
 bool sieve_arg_catenated_string_generate
@@ -145,6 +149,11 @@ struct sieve_command_def {
 	bool (*control_generate)
 		(const struct sieve_codegen_env *cgenv, struct sieve_command *cmd,
 		struct sieve_jumplist *jumps, bool jump_true);
+
+	/* The test only examines the message itself; its result is
+	   independent of the envelope and the recipient when all its
+	   arguments are constant */
+	bool message_only;
 };
 
 /*
@@ -167,6 +176,10 @@ struct sieve_command {
 	/* The child ast node that unconditionally exits this command's block */
 	struct sieve_command *block_exit_command;
 
+	/* The result of this test only depends on the message (assigned by the
+	   validator) */
+	bool recipient_independent:1;
+
 	/* Context data*/
 	void *data;
 };
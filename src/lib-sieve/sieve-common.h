@@ -2,6 +2,7 @@
 #define SIEVE_COMMON_H
 
 #include "lib.h"
+#include "hash.h"
 
 #include "sieve.h"
 
@@ -55,6 +56,9 @@ struct sieve_parser;
 /* sieve-validator.h */
 struct sieve_validator;
 
+/* sieve-optimizer.h */
+struct sieve_optimizer_profile;
+
 /* sieve-generator.h */
 struct sieve_jumplist;
 struct sieve_generator;
@@ -141,6 +145,11 @@ struct sieve_message_context;
 struct sieve_message_override;
 struct sieve_message_override_def;
 
+/* Message fields other than headers that a script accesses */
+enum sieve_message_fields {
+	SIEVE_MESSAGE_FIELD_SIZE = (1 << 0),
+};
+
 /* sieve-plugins.h */
 struct sieve_plugin;
 
@@ -164,6 +173,12 @@ extern struct event_category event_category_sieve;
 
 #include "sieve-address-source.h"
 
+/* Maximum number of bytes extracted from body parts of a content type */
+struct sieve_body_part_limit {
+	const char *content_type;
+	size_t max_size;
+};
+
 struct sieve_instance {
 	/* Main engine pool */
 	pool_t pool;
@@ -200,17 +215,72 @@ struct sieve_instance {
 	enum sieve_env_location env_location;
 	enum sieve_delivery_phase delivery_phase;
 
+	/* Settings retrieved from the environment so far */
+	pool_t settings_pool;
+	HASH_TABLE(const char *, struct sieve_setting_cache_entry *) settings;
+
 	/* Settings */
 	size_t max_script_size;
 	unsigned int max_actions;
 	unsigned int max_redirects;
 	unsigned int max_cpu_time_secs;
+	unsigned int trace_slow_msecs;
 	unsigned int resource_usage_timeout_secs;
 	const struct smtp_address *user_email, *user_email_implicit;
 	struct sieve_address_source redirect_from;
 	unsigned int redirect_duplicate_period;
+	size_t max_body_part_size;
+	ARRAY(struct sieve_body_part_limit) body_part_limits;
+	unsigned int binary_cache_size;
+	unsigned int binary_cache_trust_secs;
+	unsigned int binary_cache_idle_secs;
+	unsigned int binary_upgrade_interval_secs;
+	const char *binary_shared_dir;
+	bool binary_mmap;
+	bool binary_mmap_global;
+	bool optimize;
+	/* Execution profile guiding the optimizer (set by sievec) */
+	struct sieve_optimizer_profile *optimizer_profile;
+	size_t html_text_cache_size;
+
+	/* Recently opened binaries */
+	struct sieve_binary_cache *binary_cache;
+	/* Text extracted from HTML message parts */
+	struct sieve_html_text_cache *html_text_cache;
+	/* Raw storage for substituted messages, created for (and holding a
+	   reference to) the owner user */
+	struct mail_user *raw_mail_user, *raw_mail_user_owner;
+
+	/* Duplicate tracking (if sieve_duplicate_dict is configured) */
+	const char *duplicate_dict_uri;
+	struct sieve_duplicate_dict *duplicate_dict;
+	/* Binaries shared between nodes (if sieve_binary_dict is configured) */
+	const char *binary_dict_uri;
+	struct sieve_binary_dict *binary_dict;
+
+	/* Registry of the core commands, copied into each validator */
+	struct sieve_validator *validator_template;
+
+	/* Memory pool shared by all compiler stages */
+	pool_t compile_pool;
+	unsigned int compile_pool_users;
+
+	/* Memory pool reused for executing scripts on successive messages */
+	pool_t execute_pool;
+	unsigned int execute_pool_users;
 };
 
+/*
+ * Compile pool
+ */
+
+/* The parser, AST, validator and generator all allocate from a single pool
+   that is kept by the instance. It is cleared rather than destroyed once the
+   last of these is freed, so that compiling many scripts (e.g. ManageSieve
+   CHECKSCRIPT) does not create and destroy several pools each time. */
+pool_t sieve_compile_pool_get(struct sieve_instance *svinst);
+void sieve_compile_pool_put(struct sieve_instance *svinst, pool_t *_pool);
+
 /*
  * Script trace log
  */
@@ -219,6 +289,11 @@ void sieve_trace_log_write_line
 	(struct sieve_trace_log *trace_log, const string_t *line)
 	ATTR_NULL(2);
 
+bool sieve_trace_log_is_capture(struct sieve_trace_log *trace_log);
+void sieve_trace_log_capture_reset(struct sieve_trace_log *trace_log);
+void sieve_trace_log_capture_save(struct sieve_trace_log *trace_log,
+				  const char *header);
+
 /*
  * User e-mail address
  */
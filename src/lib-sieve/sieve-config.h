@@ -13,4 +13,6 @@
 
 #define DEFAULT_REDIRECT_DUPLICATE_PERIOD (3600 * 12)
 
+#define DEFAULT_BINARY_UPGRADE_INTERVAL_SECS 1
+
 #endif
@@ -0,0 +1,245 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "hex-binary.h"
+#include "ioloop.h"
+#include "dict.h"
+
+#include "sieve-common.h"
+
+#include "sieve-duplicate-dict.h"
+
+#define DICT_SIEVE_DUPLICATE_PATH DICT_PATH_PRIVATE"sieve/duplicate/"
+
+struct sieve_duplicate_dict {
+	struct sieve_instance *svinst;
+	struct event *event;
+
+	char *uri;
+	struct dict *dict;
+	bool init_failed:1;
+};
+
+struct sieve_duplicate_dict_mark {
+	const char *key;
+	time_t time;
+};
+
+struct sieve_duplicate_dict_transaction {
+	pool_t pool;
+	struct sieve_duplicate_dict *ddict;
+
+	const char *username;
+	ARRAY(struct sieve_duplicate_dict_mark) marks;
+};
+
+struct sieve_duplicate_dict *
+sieve_duplicate_dict_create(struct sieve_instance *svinst, const char *uri)
+{
+	struct sieve_duplicate_dict *ddict;
+
+	ddict = i_new(struct sieve_duplicate_dict, 1);
+	ddict->svinst = svinst;
+	ddict->uri = i_strdup(uri);
+
+	ddict->event = event_create(svinst->event);
+	event_set_append_log_prefix(ddict->event, "duplicate dict: ");
+
+	return ddict;
+}
+
+void sieve_duplicate_dict_free(struct sieve_duplicate_dict **_ddict)
+{
+	struct sieve_duplicate_dict *ddict = *_ddict;
+
+	*_ddict = NULL;
+	if (ddict == NULL)
+		return;
+
+	if (ddict->dict != NULL)
+		dict_deinit(&ddict->dict);
+	event_unref(&ddict->event);
+	i_free(ddict->uri);
+	i_free(ddict);
+}
+
+static struct dict *sieve_duplicate_dict_get(struct sieve_duplicate_dict *ddict)
+{
+	struct dict_legacy_settings dict_set;
+	const char *error;
+
+	if (ddict->dict != NULL || ddict->init_failed)
+		return ddict->dict;
+
+	/* Opened upon first use, so that instances that never check for
+	   duplicates do not connect to the dict */
+	i_zero(&dict_set);
+	dict_set.base_dir = ddict->svinst->base_dir;
+	if (dict_init_legacy(ddict->uri, &dict_set, &ddict->dict,
+			     &error) < 0) {
+		e_error(ddict->event, "Failed to initialize dict `%s': %s",
+			ddict->uri, error);
+		ddict->init_failed = TRUE;
+		return NULL;
+	}
+	return ddict->dict;
+}
+
+static const char *
+sieve_duplicate_dict_key(pool_t pool, const void *id, size_t id_size)
+{
+	return p_strconcat(pool, DICT_SIEVE_DUPLICATE_PATH,
+			   binary_to_hex(id, id_size), NULL);
+}
+
+/*
+ * Transaction
+ */
+
+struct sieve_duplicate_dict_transaction *
+sieve_duplicate_dict_transaction_begin(struct sieve_duplicate_dict *ddict,
+				       const char *username)
+{
+	struct sieve_duplicate_dict_transaction *dtrans;
+	pool_t pool;
+
+	if (sieve_duplicate_dict_get(ddict) == NULL)
+		return NULL;
+
+	pool = pool_alloconly_create("sieve_duplicate_dict_transaction", 512);
+	dtrans = p_new(pool, struct sieve_duplicate_dict_transaction, 1);
+	dtrans->pool = pool;
+	dtrans->ddict = ddict;
+	dtrans->username = p_strdup(pool, username);
+	p_array_init(&dtrans->marks, pool, 4);
+
+	return dtrans;
+}
+
+void sieve_duplicate_dict_transaction_rollback(
+	struct sieve_duplicate_dict_transaction **_dtrans)
+{
+	struct sieve_duplicate_dict_transaction *dtrans = *_dtrans;
+
+	*_dtrans = NULL;
+	if (dtrans == NULL)
+		return;
+
+	pool_unref(&dtrans->pool);
+}
+
+void sieve_duplicate_dict_transaction_commit(
+	struct sieve_duplicate_dict_transaction **_dtrans)
+{
+	struct sieve_duplicate_dict_transaction *dtrans = *_dtrans;
+	struct sieve_duplicate_dict *ddict;
+	struct dict_transaction_context *dctx;
+	const struct sieve_duplicate_dict_mark *mark;
+	time_t max_time = ioloop_time;
+	const char *error;
+
+	if (dtrans == NULL || array_count(&dtrans->marks) == 0) {
+		sieve_duplicate_dict_transaction_rollback(_dtrans);
+		return;
+	}
+	ddict = dtrans->ddict;
+
+	array_foreach(&dtrans->marks, mark) {
+		if (mark->time > max_time)
+			max_time = mark->time;
+	}
+
+	/* Let backends that support it expire the entries; the stored time is
+	   checked again upon lookup, so keeping an entry too long is harmless.
+	 */
+	struct dict_op_settings set = {
+		.username = dtrans->username,
+		.expire_secs = (unsigned int)(max_time - ioloop_time),
+	};
+	dctx = dict_transaction_begin(ddict->dict, &set);
+	array_foreach(&dtrans->marks, mark) {
+		dict_set(dctx, mark->key,
+			 dec2str((uintmax_t)mark->time));
+	}
+	if (dict_transaction_commit(&dctx, &error) < 0) {
+		e_error(ddict->event, "Failed to store %u duplicate IDs: %s",
+			array_count(&dtrans->marks), error);
+	} else {
+		e_debug(ddict->event, "Stored %u duplicate IDs",
+			array_count(&dtrans->marks));
+	}
+
+	sieve_duplicate_dict_transaction_rollback(_dtrans);
+}
+
+/*
+ * Checking for duplicates
+ */
+
+enum sieve_duplicate_check_result
+sieve_duplicate_dict_check(struct sieve_duplicate_dict_transaction *dtrans,
+			   const void *id, size_t id_size)
+{
+	struct sieve_duplicate_dict *ddict = dtrans->ddict;
+	const struct sieve_duplicate_dict_mark *mark;
+	const char *key, *value, *error;
+	uintmax_t time;
+	int ret;
+
+	key = sieve_duplicate_dict_key(pool_datastack_create(), id, id_size);
+
+	/* Marks made by this transaction are not yet in the dict */
+	array_foreach(&dtrans->marks, mark) {
+		if (strcmp(mark->key, key) == 0) {
+			return (mark->time > ioloop_time ?
+				SIEVE_DUPLICATE_CHECK_RESULT_EXISTS :
+				SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND);
+		}
+	}
+
+	struct dict_op_settings set = {
+		.username = dtrans->username,
+	};
+	ret = dict_lookup(ddict->dict, &set, pool_datastack_create(), key,
+			  &value, &error);
+	if (ret < 0) {
+		e_error(ddict->event, "Failed to lookup duplicate ID: %s",
+			error);
+		return SIEVE_DUPLICATE_CHECK_RESULT_TEMP_FAILURE;
+	}
+	if (ret == 0)
+		return SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND;
+
+	if (str_to_uintmax(value, &time) < 0) {
+		e_warning(ddict->event, "Ignoring invalid duplicate ID entry "
+			  "`%s' (value `%s')", key, value);
+		return SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND;
+	}
+	return ((time_t)time > ioloop_time ?
+		SIEVE_DUPLICATE_CHECK_RESULT_EXISTS :
+		SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND);
+}
+
+void sieve_duplicate_dict_mark(struct sieve_duplicate_dict_transaction *dtrans,
+			       const void *id, size_t id_size, time_t time)
+{
+	struct sieve_duplicate_dict_mark *marks, *mark;
+	unsigned int count, i;
+	const char *key;
+
+	key = sieve_duplicate_dict_key(dtrans->pool, id, id_size);
+	marks = array_get_modifiable(&dtrans->marks, &count);
+	for (i = 0; i < count; i++) {
+		if (strcmp(marks[i].key, key) == 0) {
+			marks[i].time = time;
+			return;
+		}
+	}
+
+	mark = array_append_space(&dtrans->marks);
+	mark->key = key;
+	mark->time = time;
+}
@@ -0,0 +1,38 @@
+#ifndef SIEVE_DUPLICATE_DICT_H
+#define SIEVE_DUPLICATE_DICT_H
+
+#include "sieve-common.h"
+
+/*
+ * Dict duplicate store
+ */
+
+/* When the sieve_duplicate_dict setting is configured, duplicate tracking
+   (e.g. for the duplicate extension, vacation and redirect) uses the
+   configured dict rather than the duplicate database provided by the
+   frontend. Marks are collected per execution and written to the dict all at
+   once as a single dict transaction. */
+
+struct sieve_duplicate_dict;
+struct sieve_duplicate_dict_transaction;
+
+struct sieve_duplicate_dict *
+sieve_duplicate_dict_create(struct sieve_instance *svinst, const char *uri);
+void sieve_duplicate_dict_free(struct sieve_duplicate_dict **_ddict);
+
+/* Returns NULL if the dict could not be initialized. */
+struct sieve_duplicate_dict_transaction *
+sieve_duplicate_dict_transaction_begin(struct sieve_duplicate_dict *ddict,
+				       const char *username);
+void sieve_duplicate_dict_transaction_commit(
+	struct sieve_duplicate_dict_transaction **_dtrans);
+void sieve_duplicate_dict_transaction_rollback(
+	struct sieve_duplicate_dict_transaction **_dtrans);
+
+enum sieve_duplicate_check_result
+sieve_duplicate_dict_check(struct sieve_duplicate_dict_transaction *dtrans,
+			   const void *id, size_t id_size);
+void sieve_duplicate_dict_mark(struct sieve_duplicate_dict_transaction *dtrans,
+			       const void *id, size_t id_size, time_t time);
+
+#endif
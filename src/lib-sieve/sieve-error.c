@@ -29,6 +29,8 @@
 
 /* Logfile error handler will rotate log when it exceeds 10k bytes */
 #define LOGFILE_MAX_SIZE (10 * 1024)
+/* Logfile error handler stops logging after this many distinct messages */
+#define LOGFILE_MAX_MESSAGES 100
 
 /*
  * Utility
@@ -819,16 +821,32 @@ struct sieve_logfile_ehandler {
 	bool started;
 	int fd;
 	struct ostream *stream;
+
+	/* Repeated identical messages are only written once */
+	string_t *last_message;
+	unsigned int last_repeats;
+	unsigned int messages, suppressed;
 };
 
+static void
+sieve_logfile_write_repeats(struct sieve_logfile_ehandler *ehandler)
+{
+	if (ehandler->last_repeats == 0)
+		return;
+
+	o_stream_nsend_str(ehandler->stream, t_strdup_printf(
+		"sieve: info: last message repeated %u time%s.\n",
+		ehandler->last_repeats,
+		(ehandler->last_repeats == 1 ? "" : "s")));
+	ehandler->last_repeats = 0;
+}
+
 static void
 sieve_logfile_write(struct sieve_logfile_ehandler *ehandler,
 		    const struct sieve_error_params *params,
 		    const char *message)
 {
 	string_t *outbuf;
-	ssize_t ret = 0, remain;
-	const char *data;
 
 	if (ehandler->stream == NULL)
 		return;
@@ -840,24 +858,20 @@ sieve_logfile_write(struct sieve_logfile_ehandler *ehandler,
 		str_append(outbuf, message);
 		str_append(outbuf, ".\n");
 
-		remain = str_len(outbuf);
-		data = (const char *) str_data(outbuf);
-
-		while (remain > 0) {
-			if ((ret = o_stream_send(ehandler->stream,
-						 data, remain)) < 0)
-				break;
+		if (str_equals(outbuf, ehandler->last_message)) {
+			ehandler->last_repeats++;
+		} else if (ehandler->messages >= LOGFILE_MAX_MESSAGES) {
+			ehandler->suppressed++;
+		} else {
+			sieve_logfile_write_repeats(ehandler);
+			o_stream_nsend(ehandler->stream,
+				       str_data(outbuf), str_len(outbuf));
 
-			remain -= ret;
-			data += ret;
+			str_truncate(ehandler->last_message, 0);
+			str_append_str(ehandler->last_message, outbuf);
+			ehandler->messages++;
 		}
 	} T_END;
-
-	if (ret < 0) {
-		e_error(ehandler->handler.svinst->event,
-			"o_stream_send() failed on logfile %s: %m",
-			ehandler->logfile);
-	}
 }
 
 inline static void ATTR_FORMAT(5, 6)
@@ -994,6 +1008,11 @@ static void sieve_logfile_start(struct sieve_logfile_ehandler *ehandler)
 	ehandler->stream = ostream;
 	ehandler->started = TRUE;
 
+	/* Messages are written in one go when the handler is freed (or once
+	   the stream buffer fills up), rather than with a write() each */
+	if (ostream != NULL)
+		o_stream_cork(ostream);
+
 	if (ostream != NULL) {
 		now = time(NULL);
 		tm = localtime(&now);
@@ -1026,6 +1045,17 @@ static void sieve_logfile_free(struct sieve_error_handler *ehandler)
 		(struct sieve_logfile_ehandler *) ehandler;
 
 	if (handler->stream != NULL) {
+		sieve_logfile_write_repeats(handler);
+		if (handler->suppressed > 0) {
+			o_stream_nsend_str(handler->stream, t_strdup_printf(
+				"sieve: info: %u further messages not logged.\n",
+				handler->suppressed));
+		}
+		if (o_stream_finish(handler->stream) < 0) {
+			e_error(ehandler->svinst->event,
+				"write(%s) failed: %s", handler->logfile,
+				o_stream_get_error(handler->stream));
+		}
 		o_stream_destroy(&(handler->stream));
 		if (handler->fd != STDERR_FILENO) {
 			if (close(handler->fd) < 0) {
@@ -1056,6 +1086,7 @@ sieve_logfile_ehandler_create(struct sieve_instance *svinst,
 	 * Let's not pullute the sieve directory with useless logfiles.
 	 */
 	ehandler->logfile = p_strdup(pool, logfile);
+	ehandler->last_message = str_new(pool, 128);
 	ehandler->started = FALSE;
 	ehandler->stream = NULL;
 	ehandler->fd = -1;
@@ -2,11 +2,24 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "mempool.h"
+
+#include "sieve-duplicate-dict.h"
 
 #include "sieve-execute.h"
 
+struct sieve_execute_pool_usage {
+	const char *name;
+	unsigned int count;
+	size_t used_size, alloc_size, max_alloc_size;
+};
+
 struct sieve_execute_state {
 	void *dup_trans;
+	struct sieve_duplicate_dict_transaction *dup_dict_trans;
+
+	ARRAY(struct sieve_execute_pool_usage) pool_usage;
 };
 
 struct event_category event_category_sieve_execute = {
@@ -29,8 +42,11 @@ sieve_execute_state_free(struct sieve_execute_state **_estate,
 
 	*_estate = NULL;
 
+	sieve_duplicate_dict_transaction_rollback(&estate->dup_dict_trans);
 	if (senv->duplicate_transaction_rollback != NULL)
 		senv->duplicate_transaction_rollback(&estate->dup_trans);
+	if (array_is_created(&estate->pool_usage))
+		array_free(&estate->pool_usage);
 }
 
 void sieve_execute_init(struct sieve_execute_env *eenv,
@@ -72,11 +88,15 @@ void sieve_execute_finish(struct sieve_execute_env *eenv, int status)
 	const struct sieve_script_env *senv = eenv->scriptenv;
 
 	if (status == SIEVE_EXEC_OK) {
+		sieve_duplicate_dict_transaction_commit(
+			&eenv->state->dup_dict_trans);
 		if (senv->duplicate_transaction_commit != NULL) {
 			senv->duplicate_transaction_commit(
 				&eenv->state->dup_trans);
 		}
 	} else {
+		sieve_duplicate_dict_transaction_rollback(
+			&eenv->state->dup_dict_trans);
 		if (senv->duplicate_transaction_rollback != NULL) {
 			senv->duplicate_transaction_rollback(
 				&eenv->state->dup_trans);
@@ -86,15 +106,94 @@ void sieve_execute_finish(struct sieve_execute_env *eenv, int status)
 
 void sieve_execute_deinit(struct sieve_execute_env *eenv)
 {
+	sieve_execute_pool_usage_add(eenv, "sieve execution", eenv->pool);
+	sieve_execute_pool_usage_report(eenv);
 	sieve_execute_state_free(&eenv->state, eenv);
 	event_unref(&eenv->event);
 	pool_unref(&eenv->pool);
 }
 
+/*
+ * Pool usage
+ */
+
+void sieve_execute_pool_usage_add(const struct sieve_execute_env *eenv,
+				  const char *name, pool_t pool)
+{
+	struct sieve_execute_state *estate = eenv->state;
+	struct sieve_execute_pool_usage *usage = NULL, *pusage;
+	size_t alloc_size;
+
+	if (!eenv->svinst->debug || pool == NULL)
+		return;
+
+	if (!array_is_created(&estate->pool_usage))
+		i_array_init(&estate->pool_usage, 8);
+	array_foreach_modifiable(&estate->pool_usage, pusage) {
+		if (strcmp(pusage->name, name) == 0) {
+			usage = pusage;
+			break;
+		}
+	}
+	if (usage == NULL) {
+		usage = array_append_space(&estate->pool_usage);
+		usage->name = name;
+	}
+
+	/* Only alloconly pools are used for this, which are the only ones
+	   that can tell their size */
+	alloc_size = pool_alloconly_get_total_alloc_size(pool);
+	usage->count++;
+	usage->used_size += pool_alloconly_get_total_used_size(pool);
+	usage->alloc_size += alloc_size;
+	if (alloc_size > usage->max_alloc_size)
+		usage->max_alloc_size = alloc_size;
+}
+
+void sieve_execute_pool_usage_report(const struct sieve_execute_env *eenv)
+{
+	struct sieve_execute_state *estate = eenv->state;
+	const struct sieve_execute_pool_usage *usage;
+
+	if (!array_is_created(&estate->pool_usage))
+		return;
+
+	array_foreach(&estate->pool_usage, usage) {
+		e_debug(eenv->event, "Pool usage: %s: "
+			"%u pools, %"PRIuSIZE_T" bytes used, "
+			"%"PRIuSIZE_T" bytes allocated "
+			"(largest pool %"PRIuSIZE_T" bytes)",
+			usage->name, usage->count, usage->used_size,
+			usage->alloc_size, usage->max_alloc_size);
+	}
+	array_clear(&estate->pool_usage);
+}
+
 /*
  * Checking for duplicates
  */
 
+/* The configured duplicate dict takes precedence over the duplicate database
+   provided by the script environment. */
+static bool
+sieve_execute_use_duplicate_dict(const struct sieve_execute_env *eenv)
+{
+	return (eenv->svinst->duplicate_dict != NULL &&
+		eenv->svinst->username != NULL);
+}
+
+static struct sieve_duplicate_dict_transaction *
+sieve_execute_get_dup_dict_transaction(const struct sieve_execute_env *eenv)
+{
+	if (eenv->state->dup_dict_trans == NULL) {
+		eenv->state->dup_dict_trans =
+			sieve_duplicate_dict_transaction_begin(
+				eenv->svinst->duplicate_dict,
+				eenv->svinst->username);
+	}
+	return eenv->state->dup_dict_trans;
+}
+
 static void *
 sieve_execute_get_dup_transaction(const struct sieve_execute_env *eenv)
 {
@@ -114,6 +213,8 @@ bool sieve_execute_duplicate_check_available(
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
 
+	if (sieve_execute_use_duplicate_dict(eenv))
+		return TRUE;
 	return (senv->duplicate_transaction_begin != NULL);
 }
 
@@ -122,17 +223,28 @@ int sieve_execute_duplicate_check(const struct sieve_execute_env *eenv,
 				  bool *duplicate_r)
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
-	void *dup_trans = sieve_execute_get_dup_transaction(eenv);
 	int ret;
 
 	*duplicate_r = FALSE;
 
-	if (senv->duplicate_check == NULL)
-		return SIEVE_EXEC_OK;
+	if (sieve_execute_use_duplicate_dict(eenv)) {
+		struct sieve_duplicate_dict_transaction *dtrans =
+			sieve_execute_get_dup_dict_transaction(eenv);
 
-	e_debug(eenv->svinst->event, "Check duplicate ID");
+		if (dtrans == NULL)
+			return SIEVE_EXEC_TEMP_FAILURE;
 
-	ret = senv->duplicate_check(dup_trans, senv, id, id_size);
+		e_debug(eenv->svinst->event, "Check duplicate ID in dict");
+		ret = sieve_duplicate_dict_check(dtrans, id, id_size);
+	} else {
+		void *dup_trans = sieve_execute_get_dup_transaction(eenv);
+
+		if (senv->duplicate_check == NULL)
+			return SIEVE_EXEC_OK;
+
+		e_debug(eenv->svinst->event, "Check duplicate ID");
+		ret = senv->duplicate_check(dup_trans, senv, id, id_size);
+	}
 	switch (ret) {
 	case SIEVE_DUPLICATE_CHECK_RESULT_EXISTS:
 		*duplicate_r = TRUE;
@@ -151,8 +263,21 @@ void sieve_execute_duplicate_mark(const struct sieve_execute_env *eenv,
 				  const void *id, size_t id_size, time_t time)
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
-	void *dup_trans = sieve_execute_get_dup_transaction(eenv);
+	void *dup_trans;
+
+	if (sieve_execute_use_duplicate_dict(eenv)) {
+		struct sieve_duplicate_dict_transaction *dtrans =
+			sieve_execute_get_dup_dict_transaction(eenv);
+
+		if (dtrans == NULL)
+			return;
+
+		e_debug(eenv->svinst->event, "Mark ID as duplicate in dict");
+		sieve_duplicate_dict_mark(dtrans, id, id_size, time);
+		return;
+	}
 
+	dup_trans = sieve_execute_get_dup_transaction(eenv);
 	if (senv->duplicate_mark == NULL)
 		return;
 
@@ -27,6 +27,17 @@ void sieve_execute_init(struct sieve_execute_env *eenv,
 void sieve_execute_finish(struct sieve_execute_env *eenv, int status);
 void sieve_execute_deinit(struct sieve_execute_env *eenv);
 
+/*
+ * Pool usage
+ */
+
+/* Records the size of an alloconly pool that is about to be freed. With
+   sieve_debug enabled, the sizes are summed per pool name and logged when the
+   execution environment is deinitialized. */
+void sieve_execute_pool_usage_add(const struct sieve_execute_env *eenv,
+				  const char *name, pool_t pool);
+void sieve_execute_pool_usage_report(const struct sieve_execute_env *eenv);
+
 /*
  * Checking for duplicates
  */
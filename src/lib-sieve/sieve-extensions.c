@@ -25,6 +25,7 @@ static void sieve_capability_registry_deinit(struct sieve_instance *svinst);
 static struct sieve_extension *_sieve_extension_register
 	(struct sieve_instance *svinst, const struct sieve_extension_def *extdef,
 		bool load, bool required);
+static void sieve_extensions_changed(struct sieve_instance *svinst);
 
 /*
  * Instance global context
@@ -42,8 +43,20 @@ struct sieve_extension_registry {
 
 	/* Preloaded extensions */
 	ARRAY(const struct sieve_extension *) preloaded_extensions;
+
+	/* Cached list of listable extensions; rebuilt on demand after the
+	   configuration changes */
+	char *extensions_string;
+
+	/* While the instance is being set up, extensions are only registered
+	   and enabled; their load() callback is deferred until first use */
+	bool defer_load:1;
 };
 
+/* Room reserved in the registry for extensions registered by plugins. This is
+   also plenty for the few extensions that register capabilities. */
+#define SIEVE_EXTENSIONS_PLUGIN_RESERVE 16
+
 /*
  * Pre-loaded 'extensions'
  */
@@ -92,6 +105,7 @@ extern const struct sieve_extension_def encoded_character_extension;
 extern const struct sieve_extension_def vacation_extension;
 extern const struct sieve_extension_def subaddress_extension;
 extern const struct sieve_extension_def comparator_i_ascii_numeric_extension;
+extern const struct sieve_extension_def comparator_i_unicode_casemap_extension;
 extern const struct sieve_extension_def relational_extension;
 extern const struct sieve_extension_def regex_extension;
 extern const struct sieve_extension_def imap4flags_extension;
@@ -120,6 +134,7 @@ const struct sieve_extension_def *sieve_core_extensions[] = {
 	/* 'Plugins' */
 	&vacation_extension, &subaddress_extension,
 	&comparator_i_ascii_numeric_extension,
+	&comparator_i_unicode_casemap_extension,
 	&relational_extension, &regex_extension, &imap4flags_extension,
 	&copy_extension, &include_extension, &body_extension,
 	&variables_extension, &enotify_extension, &environment_extension,
@@ -209,6 +224,9 @@ bool sieve_extensions_init(struct sieve_instance *svinst)
 	array_append(&ext_reg->preloaded_extensions,
 		&ext_reg->address_part_extension, 1);
 
+	/* All other extensions are loaded once they are first needed */
+	ext_reg->defer_load = TRUE;
+
 	/* Pre-load dummy extensions */
 	for ( i = 0; i < sieve_dummy_extensions_count; i++ ) {
 		if ( (ext=_sieve_extension_register
@@ -267,6 +285,10 @@ void sieve_extensions_configure(struct sieve_instance *svinst)
 	if ( (extensions=sieve_setting_get
 		(svinst, "sieve_implicit_extensions")) != NULL )
 		sieve_extensions_set_string(svinst, extensions, FALSE, TRUE);
+
+	/* Setup is complete; from now on extensions are loaded as soon as they
+	   are registered or enabled, just like those that are looked up */
+	svinst->ext_reg->defer_load = FALSE;
 }
 
 void sieve_extensions_deinit(struct sieve_instance *svinst)
@@ -305,6 +327,34 @@ static bool _sieve_extension_load(struct sieve_extension *ext)
 	return TRUE;
 }
 
+static bool sieve_extension_load_deferred(struct sieve_extension *ext)
+{
+	if ( ext->loaded || ext->def == NULL ||
+		(!ext->enabled && !ext->required) )
+		return TRUE;
+
+	ext->loaded = TRUE;
+	if ( !_sieve_extension_load(ext) ) {
+		/* Make it unavailable rather than using it half-initialized */
+		ext->enabled = FALSE;
+		ext->required = FALSE;
+		sieve_extensions_changed(ext->svinst);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void sieve_extensions_load_all(struct sieve_instance *svinst)
+{
+	struct sieve_extension_registry *ext_reg = svinst->ext_reg;
+	struct sieve_extension *const *exts;
+	unsigned int i, ext_count;
+
+	exts = array_get(&ext_reg->extensions, &ext_count);
+	for ( i = 0; i < ext_count; i++ )
+		(void)sieve_extension_load_deferred(exts[i]);
+}
+
 static void _sieve_extension_unload(struct sieve_extension *ext)
 {
 	/* Call unload handler */
@@ -313,13 +363,33 @@ static void _sieve_extension_unload(struct sieve_extension *ext)
 	ext->context = NULL;
 }
 
+static unsigned int sieve_extensions_get_builtin_count(void)
+{
+	unsigned int count;
+
+	/* Preloaded, dummy, core and extra extensions */
+	count = 3 + sieve_dummy_extensions_count + sieve_core_extensions_count +
+		sieve_extra_extensions_count;
+#ifdef HAVE_SIEVE_UNFINISHED
+	count += sieve_unfinished_extensions_count;
+#endif
+	return count;
+}
+
 static void sieve_extension_registry_init(struct sieve_instance *svinst)
 {
 	struct sieve_extension_registry *ext_reg = svinst->ext_reg;
-
-	p_array_init(&ext_reg->extensions, svinst->pool, 50);
+	unsigned int count = sieve_extensions_get_builtin_count() +
+		SIEVE_EXTENSIONS_PLUGIN_RESERVE;
+
+	/* Every instance registers all built-in extensions right away, so size
+	   the registry for those up front. This way it is not regrown in the
+	   instance pool, which would leave the old array unused in there for
+	   the lifetime of the instance. */
+	p_array_init(&ext_reg->extensions, svinst->pool, count);
 	hash_table_create
-		(&ext_reg->extension_index, default_pool, 0, str_hash, strcmp);
+		(&ext_reg->extension_index, default_pool, count,
+			str_hash, strcmp);
 }
 
 static void sieve_extension_registry_deinit(struct sieve_instance *svinst)
@@ -328,11 +398,14 @@ static void sieve_extension_registry_deinit(struct sieve_instance *svinst)
 	struct sieve_extension * const *exts;
     unsigned int i, ext_count;
 
+	i_free(ext_reg->extensions_string);
+
 	if ( !hash_table_is_created(ext_reg->extension_index) ) return;
 
     exts = array_get_modifiable(&ext_reg->extensions, &ext_count);
 	for ( i = 0; i < ext_count; i++ ) {
-		_sieve_extension_unload(exts[i]);
+		if ( exts[i]->loaded )
+			_sieve_extension_unload(exts[i]);
 	}
 
 	hash_table_destroy(&ext_reg->extension_index);
@@ -348,6 +421,7 @@ bool sieve_extension_reload(const struct sieve_extension *ext)
 	if ( ext_id >= 0 && ext_id < (int) array_count(&ext_reg->extensions) ) {
 		mod_ext = array_idx(&ext_reg->extensions, ext_id);
 
+		(*mod_ext)->loaded = TRUE;
 		return _sieve_extension_load(*mod_ext);
 	}
 
@@ -362,6 +436,11 @@ static struct sieve_extension *sieve_extension_lookup
 	return 	hash_table_lookup(ext_reg->extension_index, name);
 }
 
+static void sieve_extensions_changed(struct sieve_instance *svinst)
+{
+	i_free(svinst->ext_reg->extensions_string);
+}
+
 static struct sieve_extension *sieve_extension_alloc
 (struct sieve_instance *svinst,
 	const struct sieve_extension_def *extdef)
@@ -408,20 +487,21 @@ static struct sieve_extension *_sieve_extension_register
 	}
 
 	/* Enable extension */
-	if ( load || required ) {
+	if ( load || required )
 		ext->enabled = ( ext->enabled || load );
+	ext->required = ( ext->required || required );
 
-		/* Call load handler if extension was not loaded already */
-		if ( !ext->loaded ) {
-			if ( !_sieve_extension_load(ext) )
-				return NULL;
-		}
-
+	/* Call load handler if extension was not loaded already; an enabled
+	   extension registered again is about to be used by another
+	   extension */
+	if ( !svinst->ext_reg->defer_load && !ext->loaded &&
+		(ext->enabled || ext->required) ) {
+		if ( !_sieve_extension_load(ext) )
+			return NULL;
 		ext->loaded = TRUE;
 	}
 
-	ext->required = ( ext->required || required );
-
+	sieve_extensions_changed(svinst);
 	return ext;
 }
 
@@ -446,6 +526,7 @@ void sieve_extension_unregister(const struct sieve_extension *ext)
 		(*mod_ext)->loaded = FALSE;
 		(*mod_ext)->enabled = FALSE;
 		(*mod_ext)->def = NULL;
+		sieve_extensions_changed(ext->svinst);
 	}
 }
 
@@ -489,6 +570,7 @@ void sieve_extension_override
 		(ext_reg->extension_index, name, *mod_ext);
 	if ( old_ext != NULL )
 		old_ext->overridden = TRUE;
+	sieve_extensions_changed(svinst);
 }
 
 unsigned int sieve_extensions_get_count(struct sieve_instance *svinst)
@@ -517,7 +599,8 @@ const struct sieve_extension *sieve_extension_get_by_id
 	if ( ext_id < array_count(&ext_reg->extensions) ) {
 		ext = array_idx(&ext_reg->extensions, ext_id);
 
-		if ( (*ext)->def != NULL && ((*ext)->enabled || (*ext)->required) )
+		if ( (*ext)->def != NULL && ((*ext)->enabled || (*ext)->required) &&
+			sieve_extension_load_deferred(*ext) )
 			return *ext;
 	}
 
@@ -527,7 +610,7 @@ const struct sieve_extension *sieve_extension_get_by_id
 const struct sieve_extension *sieve_extension_get_by_name
 (struct sieve_instance *svinst, const char *name)
 {
-	const struct sieve_extension *ext;
+	struct sieve_extension *ext;
 
 	if ( *name == '@' )
 		return NULL;
@@ -538,6 +621,8 @@ const struct sieve_extension *sieve_extension_get_by_name
 	ext = sieve_extension_lookup(svinst, name);
 	if ( ext == NULL || ext->def == NULL || (!ext->enabled && !ext->required))
 		return NULL;
+	if ( !sieve_extension_load_deferred(ext) )
+		return NULL;
 
 	return ext;
 }
@@ -551,10 +636,16 @@ static inline bool _sieve_extension_listable(const struct sieve_extension *ext)
 const char *sieve_extensions_get_string(struct sieve_instance *svinst)
 {
 	struct sieve_extension_registry *ext_reg = svinst->ext_reg;
-	string_t *extstr = t_str_new(256);
+	string_t *extstr;
 	struct sieve_extension * const *exts;
 	unsigned int i, ext_count;
 
+	/* This is needed for every script compiled or stored and for every
+	   binary cache key, but it only changes with the configuration */
+	if ( ext_reg->extensions_string != NULL )
+		return ext_reg->extensions_string;
+
+	extstr = t_str_new(256);
 	exts = array_get(&ext_reg->extensions, &ext_count);
 
 	if ( ext_count > 0 ) {
@@ -579,7 +670,8 @@ const char *sieve_extensions_get_string(struct sieve_instance *svinst)
 		}
 	}
 
-	return str_c(extstr);
+	ext_reg->extensions_string = i_strdup(str_c(extstr));
+	return ext_reg->extensions_string;
 }
 
 static void sieve_extension_set_enabled
@@ -588,14 +680,14 @@ static void sieve_extension_set_enabled
 	if ( enabled ) {
 		ext->enabled = TRUE;
 
-		if ( !ext->loaded ) {
+		if ( !ext->loaded && !ext->svinst->ext_reg->defer_load ) {
 			(void)_sieve_extension_load(ext);
+			ext->loaded = TRUE;
 		}
-
-		ext->loaded = TRUE;
 	} else {
 		ext->enabled = FALSE;
 	}
+	sieve_extensions_changed(ext->svinst);
 }
 
 static void sieve_extension_set_global
@@ -607,6 +699,7 @@ static void sieve_extension_set_global
 	} else {
 		ext->global = FALSE;
 	}
+	sieve_extensions_changed(ext->svinst);
 }
 
 static void sieve_extension_set_implicit
@@ -782,7 +875,8 @@ void sieve_capability_registry_init(struct sieve_instance *svinst)
 	struct sieve_extension_registry *ext_reg = svinst->ext_reg;
 
 	hash_table_create
-		(&ext_reg->capabilities_index, default_pool, 0, str_hash, strcmp);
+		(&ext_reg->capabilities_index, default_pool,
+			SIEVE_EXTENSIONS_PLUGIN_RESERVE, str_hash, strcmp);
 }
 
 void sieve_capability_registry_deinit(struct sieve_instance *svinst)
@@ -839,6 +933,13 @@ const char *sieve_extension_capabilities_get_string
 		hash_table_lookup(ext_reg->capabilities_index, cap_name);
 	const struct sieve_extension_capabilities *cap;
 
+	if ( cap_reg == NULL ) {
+		/* Capabilities are registered by the load() callback of the
+		   extension, which may not have been called yet */
+		sieve_extensions_load_all(svinst);
+		cap_reg = hash_table_lookup(ext_reg->capabilities_index,
+			cap_name);
+	}
 	if ( cap_reg == NULL || cap_reg->capabilities == NULL )
 		return NULL;
 
@@ -22,6 +22,11 @@ struct sieve_extension_def {
 
 	/* Version */
 	unsigned int version;
+	/* Oldest version of this extension for which binaries can still be
+	   executed. Such binaries are marked outdated and recompiled lazily
+	   (see sieve_binary_is_outdated()). If 0, only binaries compiled with
+	   the current version are accepted. */
+	unsigned int min_binary_version;
 
 	/* Registration */
 	bool (*load)(const struct sieve_extension *ext, void **context);
@@ -106,6 +111,11 @@ struct sieve_extension {
 	((ext)->def->version)
 #define sieve_extension_version_is(ext, _version) \
 	((ext)->def->version == (_version))
+#define sieve_extension_version_is_compatible(ext, _version) \
+	((ext)->def->version == (_version) || \
+	 ((ext)->def->min_binary_version > 0 && \
+	  (_version) >= (ext)->def->min_binary_version && \
+	  (_version) < (ext)->def->version))
 
 /*
  * Extensions init/deinit
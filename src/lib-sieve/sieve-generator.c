@@ -84,7 +84,8 @@ sieve_generator_create(struct sieve_ast *ast,
 	struct sieve_script *script;
 	struct sieve_instance *svinst;
 
-	pool = pool_alloconly_create("sieve_generator", 4096);
+	pool = sieve_compile_pool_get(
+		sieve_script_svinst(sieve_ast_script(ast)));
 	gentr = p_new(pool, struct sieve_generator, 1);
 	gentr->pool = pool;
 
@@ -118,7 +119,7 @@ void sieve_generator_free(struct sieve_generator **gentr)
 
 	sieve_binary_unref(&(*gentr)->genenv.sbin);
 
-	pool_unref(&((*gentr)->pool));
+	sieve_compile_pool_put((*gentr)->genenv.svinst, &((*gentr)->pool));
 
 	*gentr = NULL;
 }
@@ -331,6 +332,27 @@ bool sieve_generate_argument_parameters(const struct sieve_codegen_env *cgenv,
 	return TRUE;
 }
 
+static int
+sieve_generate_message_header_item(void *context,
+				   struct sieve_ast_argument *arg)
+{
+	struct sieve_binary *sbin = context;
+
+	if (arg->argument != NULL && sieve_argument_is_string_literal(arg))
+		sieve_binary_add_message_header(sbin,
+						sieve_ast_argument_strc(arg));
+	return 1;
+}
+
+void sieve_generate_message_headers(const struct sieve_codegen_env *cgenv,
+				    struct sieve_ast_argument *arg)
+{
+	if (arg == NULL)
+		return;
+	(void)sieve_ast_stringlist_map(&arg, cgenv->sbin,
+				       sieve_generate_message_header_item);
+}
+
 bool sieve_generate_test(const struct sieve_codegen_env *cgenv,
 			 struct sieve_ast_node *tst_node,
 			 struct sieve_jumplist *jlist, bool jump_true)
@@ -353,9 +375,23 @@ bool sieve_generate_test(const struct sieve_codegen_env *cgenv,
 	}
 
 	if (tst_def->generate != NULL) {
+		sieve_size_t cached_test = 0;
+		bool cached = test->recipient_independent;
+
 		sieve_generate_debug_from_ast_node(cgenv, tst_node);
 
+		if (cached) {
+			/* Result can be shared between executions for the
+			   same message */
+			sieve_operation_emit(cgenv->sblock, NULL,
+					     &sieve_cached_test_operation);
+			cached_test = sieve_binary_emit_offset(cgenv->sblock, 0);
+		}
+
 		if (tst_def->generate(cgenv, test)) {
+			if (cached)
+				sieve_binary_resolve_offset(cgenv->sblock,
+							    cached_test);
 
 			if (jump_true) {
 				sieve_operation_emit(cgenv->sblock, NULL,
@@ -480,6 +516,7 @@ sieve_generator_run(struct sieve_generator *gentr,
 					  sieve_ast_root(gentr->genenv.ast))) {
 			result = FALSE;
 		} else if (topmost) {
+			sieve_binary_emit_message_headers(sbin);
 			sieve_binary_activate(sbin);
 		}
 	}
@@ -83,6 +83,12 @@ bool sieve_generate_argument_parameters(const struct sieve_codegen_env *cgenv,
 					struct sieve_command *cmd,
 					struct sieve_ast_argument *arg);
 
+/* Records the header field names listed in the (string or string-list)
+   argument, so that these can be prefetched at runtime. Names that are not
+   string literals are not known until runtime and are skipped. */
+void sieve_generate_message_headers(const struct sieve_codegen_env *cgenv,
+				    struct sieve_ast_argument *arg);
+
 bool sieve_generate_block(const struct sieve_codegen_env *cgenv,
 			  struct sieve_ast_node *block);
 bool sieve_generate_test(const struct sieve_codegen_env *cgenv,
@@ -0,0 +1,171 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+
+#include "sieve-common.h"
+
+#include "sieve-html-text-cache.h"
+
+struct sieve_html_text_cache_entry {
+	struct sieve_html_text_cache_entry *prev, *next;
+
+	char *key;
+	/* NUL-terminated */
+	char *text;
+	size_t size;
+};
+
+struct sieve_html_text_cache {
+	struct event *event;
+
+	HASH_TABLE(char *, struct sieve_html_text_cache_entry *) entries;
+	/* Most recently used first */
+	struct sieve_html_text_cache_entry *head, *tail;
+	unsigned int count;
+	size_t used_size, max_size;
+
+	uint64_t hits, misses, evictions;
+};
+
+static const char *
+sieve_html_text_cache_key(const char *guid, unsigned int part_idx)
+{
+	return t_strdup_printf("%s/%u", guid, part_idx);
+}
+
+struct sieve_html_text_cache *
+sieve_html_text_cache_create(struct sieve_instance *svinst, size_t max_size)
+{
+	struct sieve_html_text_cache *cache;
+
+	cache = i_new(struct sieve_html_text_cache, 1);
+	cache->max_size = max_size;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+
+	cache->event = event_create(svinst->event);
+	event_set_append_log_prefix(cache->event, "html text cache: ");
+
+	return cache;
+}
+
+static void
+sieve_html_text_cache_entry_free(struct sieve_html_text_cache *cache,
+				 struct sieve_html_text_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	i_assert(cache->count > 0);
+	cache->count--;
+	i_assert(cache->used_size >= entry->size);
+	cache->used_size -= entry->size;
+
+	i_free(entry->key);
+	i_free(entry->text);
+	i_free(entry);
+}
+
+void sieve_html_text_cache_clear(struct sieve_html_text_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	while (cache->head != NULL)
+		sieve_html_text_cache_entry_free(cache, cache->head);
+}
+
+void sieve_html_text_cache_get_statistics(
+	struct sieve_html_text_cache *cache,
+	struct sieve_cache_statistics *stats_r)
+{
+	i_zero(stats_r);
+	if (cache == NULL)
+		return;
+
+	stats_r->hits = cache->hits;
+	stats_r->misses = cache->misses;
+	stats_r->evictions = cache->evictions;
+	stats_r->entries = cache->count;
+	stats_r->memory = cache->used_size;
+}
+
+void sieve_html_text_cache_free(struct sieve_html_text_cache **_cache)
+{
+	struct sieve_html_text_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (cache == NULL)
+		return;
+
+	sieve_html_text_cache_clear(cache);
+	hash_table_destroy(&cache->entries);
+	event_unref(&cache->event);
+	i_free(cache);
+}
+
+const char *
+sieve_html_text_cache_lookup(struct sieve_html_text_cache *cache,
+			     const char *guid, unsigned int part_idx,
+			     size_t *size_r)
+{
+	struct sieve_html_text_cache_entry *entry;
+
+	if (cache == NULL || guid == NULL || *guid == '\0')
+		return NULL;
+
+	entry = hash_table_lookup(cache->entries,
+				  sieve_html_text_cache_key(guid, part_idx));
+	if (entry == NULL) {
+		cache->misses++;
+		return NULL;
+	}
+	cache->hits++;
+
+	/* Move to front */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+
+	e_debug(cache->event, "Hit for part %u of message %s",
+		part_idx, guid);
+
+	*size_r = entry->size;
+	return entry->text;
+}
+
+void sieve_html_text_cache_add(struct sieve_html_text_cache *cache,
+			       const char *guid, unsigned int part_idx,
+			       const char *text, size_t size)
+{
+	struct sieve_html_text_cache_entry *entry;
+	const char *key;
+
+	if (cache == NULL || guid == NULL || *guid == '\0')
+		return;
+	if (size > cache->max_size)
+		return;
+
+	key = sieve_html_text_cache_key(guid, part_idx);
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry != NULL)
+		sieve_html_text_cache_entry_free(cache, entry);
+
+	/* Evict least recently used text */
+	while (cache->tail != NULL &&
+	       cache->used_size + size > cache->max_size) {
+		sieve_html_text_cache_entry_free(cache, cache->tail);
+		cache->evictions++;
+	}
+
+	entry = i_new(struct sieve_html_text_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->text = i_malloc(size + 1);
+	memcpy(entry->text, text, size);
+	entry->size = size;
+
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+	cache->used_size += size;
+}
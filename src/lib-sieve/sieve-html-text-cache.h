@@ -0,0 +1,40 @@
+#ifndef SIEVE_HTML_TEXT_CACHE_H
+#define SIEVE_HTML_TEXT_CACHE_H
+
+#include "sieve-common.h"
+
+/*
+ * HTML text cache
+ */
+
+/* The HTML text cache keeps the text extracted from HTML message parts in
+   memory for a Sieve instance, so that the conversion is not repeated when the
+   same message is evaluated again (e.g. by the next IMAPSIEVE script or by a
+   sieve-filter rerun). Entries are keyed by message GUID and part index and
+   the cache is limited by the total size of the cached text. */
+
+struct sieve_html_text_cache;
+
+struct sieve_html_text_cache *
+sieve_html_text_cache_create(struct sieve_instance *svinst, size_t max_size);
+void sieve_html_text_cache_free(struct sieve_html_text_cache **_cache);
+/* Drops all cached text. */
+void sieve_html_text_cache_clear(struct sieve_html_text_cache *cache);
+/* Returns the lookup and eviction counters of the cache. */
+void sieve_html_text_cache_get_statistics(
+	struct sieve_html_text_cache *cache,
+	struct sieve_cache_statistics *stats_r);
+
+/* Returns the cached text for the part, or NULL if it is not cached. The
+   returned text is valid until the cache is next modified. */
+const char *
+sieve_html_text_cache_lookup(struct sieve_html_text_cache *cache,
+			     const char *guid, unsigned int part_idx,
+			     size_t *size_r);
+/* Adds the text for the part. Text larger than the whole cache is not
+   cached. */
+void sieve_html_text_cache_add(struct sieve_html_text_cache *cache,
+			       const char *guid, unsigned int part_idx,
+			       const char *text, size_t size);
+
+#endif
@@ -2,11 +2,13 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "ostream.h"
 #include "mempool.h"
 #include "array.h"
 #include "hash.h"
 #include "cpu-limit.h"
+#include "time-util.h"
 #include "mail-storage.h"
 
 #include "sieve-common.h"
@@ -23,10 +25,12 @@
 #include "sieve-result.h"
 #include "sieve-comparators.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-test-cache.h"
 
 #include "sieve-interpreter.h"
 
 #include <string.h>
+#include <sys/resource.h>
 
 static struct event_category event_category_sieve_runtime = {
 	.parent = &event_category_sieve,
@@ -59,6 +63,16 @@ struct sieve_interpreter_loop {
 	void *context;
 };
 
+/*
+ * Profile
+ */
+
+struct sieve_interpreter_profile_line {
+	unsigned int line;
+	unsigned int count;
+	uint64_t wall_usecs, cpu_usecs;
+};
+
 /*
  * Interpreter
  */
@@ -79,6 +93,9 @@ struct sieve_interpreter {
 	ARRAY(struct sieve_interpreter_loop) loop_stack;
 	sieve_size_t loop_limit;
 	unsigned int parent_loop_level;
+	/* Loop frame pools, one per nesting level; these are kept across
+	   loop iterations and cleared for reuse when a new loop starts */
+	pool_t loop_pools[SIEVE_MAX_LOOP_DEPTH];
 
 	/* Runtime environment */
 	struct sieve_runtime_env runenv;
@@ -88,13 +105,33 @@ struct sieve_interpreter {
 	/* Current operation */
 	struct sieve_operation oprtn;
 
+	/* Suspended operation */
+	sieve_size_t suspend_address;
+	void *suspend_context;
+	void (*suspend_context_free)(void *context);
+	sieve_interpreter_resume_callback_t *resume_callback;
+	void *resume_context;
+	struct ioloop *wait_ioloop;
+
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
 	unsigned int command_line;
 
+	/* Profile (indexed by source line) */
+	ARRAY(struct sieve_interpreter_profile_line) profile;
+	unsigned int profile_depth;
+
+	/* Statistics for the finished event */
+	struct timeval start_time;
+	unsigned int operation_count;
+	unsigned int test_count;
+
 	bool running:1;		    /* Interpreter is running
 				       (may be interrupted) */
 	bool interrupted:1;         /* Interpreter interrupt requested */
+	bool suspended:1;           /* Waiting for asynchronous I/O */
+	bool resumed:1;             /* I/O finished, operation is re-executed */
+	bool executing:1;           /* Inside sieve_interpreter_continue() */
 	bool test_result:1;         /* Result of previous test command */
 };
 
@@ -116,7 +153,9 @@ _sieve_interpreter_create(struct sieve_binary *sbin,
 	sieve_size_t *address;
 	bool success = TRUE;
 
-	pool = pool_alloconly_create("sieve_interpreter", 4096);
+	pool = pool_alloconly_create(
+		"sieve_interpreter",
+		I_MAX(4096, sieve_binary_get_pool_size_hint(sbin)));
 	interp = p_new(pool, struct sieve_interpreter, 1);
 	interp->parent = parent;
 	interp->pool = pool;
@@ -147,6 +186,10 @@ _sieve_interpreter_create(struct sieve_binary *sbin,
 		interp->trace.config = senv->trace_config;
 		interp->trace.indent = 0;
 		interp->runenv.trace = &interp->trace;
+
+		/* A captured trace only covers the current top-level script */
+		if (parent == NULL && sieve_trace_log_is_capture(senv->trace_log))
+			sieve_trace_log_capture_reset(senv->trace_log);
 	}
 
 	if (script == NULL)
@@ -284,12 +327,13 @@ sieve_interpreter_create_for_block(struct sieve_binary_block *sblock,
 					 ehandler);
 }
 
+static void sieve_interpreter_profile_report(struct sieve_interpreter *interp);
+
 void sieve_interpreter_free(struct sieve_interpreter **_interp)
 {
 	struct sieve_interpreter *interp = *_interp;
 	struct sieve_runtime_env *renv = &interp->runenv;
 	const struct sieve_interpreter_extension_reg *eregs;
-	struct sieve_interpreter_loop *loops;
 	unsigned int count, i;
 
 	if (interp->running) {
@@ -303,13 +347,18 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 		interp->running = FALSE;
 	}
 
-	if (array_is_created(&interp->loop_stack)) {
-		loops = array_get_modifiable(&interp->loop_stack, &count);
-		for (i = 0; i < count; i++)
-			pool_unref(&loops[i].pool);
-	}
+	for (i = 0; i < N_ELEMENTS(interp->loop_pools); i++)
+		pool_unref(&interp->loop_pools[i]);
+
+	/* Abort pending asynchronous operation */
+	if (interp->suspend_context != NULL &&
+	    interp->suspend_context_free != NULL)
+		interp->suspend_context_free(interp->suspend_context);
+	interp->suspend_context = NULL;
 
 	interp->trace.indent = 0;
+	if (array_is_created(&interp->profile))
+		sieve_interpreter_profile_report(interp);
 	sieve_runtime_trace_end(renv);
 
 	/* Signal registered extensions that the interpreter is being destroyed */
@@ -322,10 +371,14 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 	}
 
 	sieve_binary_debug_reader_deinit(&interp->dreader);
+	sieve_binary_record_pool_usage(
+		renv->sbin, pool_alloconly_get_total_used_size(interp->pool));
 	sieve_binary_unref(&renv->sbin);
 	sieve_error_handler_unref(&renv->ehandler);
 	event_unref(&renv->event);
 
+	sieve_execute_pool_usage_add(renv->exec_env, "sieve_interpreter",
+				     interp->pool);
 	pool_unref(&interp->pool);
 	*_interp = NULL;
 }
@@ -374,6 +427,19 @@ void sieve_interpreter_set_result(struct sieve_interpreter *interp,
 	sieve_result_ref(result);
 }
 
+/*
+ * Resource usage
+ */
+
+void sieve_interpreter_add_resource_usage(
+	struct sieve_interpreter *interp,
+	const struct sieve_resource_usage *rusage)
+{
+	while (interp->parent != NULL)
+		interp = interp->parent;
+	sieve_resource_usage_add(&interp->rusage, rusage);
+}
+
 /*
  * Source location
  */
@@ -528,7 +594,8 @@ int sieve_interpreter_loop_start(struct sieve_interpreter *interp,
 
 	/* Check loop nesting limit */
 	if (!array_is_created(&interp->loop_stack))
-		p_array_init(&interp->loop_stack, interp->pool, 8);
+		p_array_init(&interp->loop_stack, interp->pool,
+			     SIEVE_MAX_LOOP_DEPTH);
 	if ((interp->parent_loop_level +
 	     array_count(&interp->loop_stack)) >= SIEVE_MAX_LOOP_DEPTH) {
 		/* Should normally be caught at compile time */
@@ -545,7 +612,14 @@ int sieve_interpreter_loop_start(struct sieve_interpreter *interp,
 	loop->ext_def = ext_def;
 	loop->begin = interp->runenv.pc;
 	loop->end = loop_end;
-	loop->pool =  pool_alloconly_create("sieve_interpreter", 128);
+	i_assert(loop->level < N_ELEMENTS(interp->loop_pools));
+	if (interp->loop_pools[loop->level] == NULL) {
+		interp->loop_pools[loop->level] =
+			pool_alloconly_create("sieve_interpreter_loop", 128);
+	} else {
+		p_clear(interp->loop_pools[loop->level]);
+	}
+	loop->pool = interp->loop_pools[loop->level];
 
 	/* Set new loop limit */
 	interp->loop_limit = loop_end;
@@ -628,9 +702,10 @@ int sieve_interpreter_loop_break(struct sieve_interpreter *interp,
 	loops = array_get_modifiable(&interp->loop_stack, &count);
 	i_assert(count > 0);
 
+	/* The loop pools are owned by the interpreter and reused */
 	i = count;
 	do {
-		pool_unref(&loops[i-1].pool);
+		loops[i-1].pool = NULL;
 		i--;
 	} while (i > 0 && &loops[i] != loop);
 	i_assert(&loops[i] == loop);
@@ -748,6 +823,8 @@ void sieve_interpreter_loop_set_context(struct sieve_interpreter_loop *loop,
 
 void sieve_interpreter_reset(struct sieve_interpreter *interp)
 {
+	i_assert(!interp->suspended);
+
 	interp->runenv.pc = interp->reset_vector;
 	interp->interrupted = FALSE;
 	interp->test_result = FALSE;
@@ -759,6 +836,78 @@ void sieve_interpreter_interrupt(struct sieve_interpreter *interp)
 	interp->interrupted = TRUE;
 }
 
+/* Asynchronous operations */
+
+void sieve_interpreter_suspend(struct sieve_interpreter *interp,
+			       void *op_context,
+			       void (*op_context_free)(void *context))
+{
+	i_assert(!interp->suspended);
+
+	/* Rewind to the start of the operation, so that it is executed again
+	   once resumed; it then picks up its result from the context */
+	interp->runenv.pc = interp->oprtn.address;
+	interp->suspend_address = interp->oprtn.address;
+	interp->suspend_context = op_context;
+	interp->suspend_context_free = op_context_free;
+	interp->suspended = TRUE;
+	interp->resumed = FALSE;
+
+	sieve_runtime_trace(&interp->runenv, SIEVE_TRLVL_COMMANDS,
+			    "suspended for asynchronous operation");
+}
+
+void sieve_interpreter_resume(struct sieve_interpreter *interp)
+{
+	i_assert(interp->suspended);
+
+	interp->suspended = FALSE;
+	interp->resumed = TRUE;
+
+	if (interp->wait_ioloop != NULL)
+		io_loop_stop(interp->wait_ioloop);
+	else if (!interp->executing && interp->resume_callback != NULL)
+		interp->resume_callback(interp, interp->resume_context);
+}
+
+bool sieve_interpreter_is_suspended(struct sieve_interpreter *interp)
+{
+	return interp->suspended;
+}
+
+void *sieve_interpreter_get_suspended_context(struct sieve_interpreter *interp)
+{
+	void *context;
+
+	if (!interp->resumed ||
+	    interp->suspend_address != interp->oprtn.address)
+		return NULL;
+
+	context = interp->suspend_context;
+	interp->suspend_context = NULL;
+	interp->suspend_context_free = NULL;
+	interp->resumed = FALSE;
+	return context;
+}
+
+void sieve_interpreter_set_resume_callback(
+	struct sieve_interpreter *interp,
+	sieve_interpreter_resume_callback_t *callback, void *context)
+{
+	interp->resume_callback = callback;
+	interp->resume_context = context;
+}
+
+static void sieve_interpreter_wait(struct sieve_interpreter *interp)
+{
+	/* Nobody is going to continue the interpreter from the ioloop, so
+	   wait here for the operation to finish */
+	interp->wait_ioloop = current_ioloop;
+	while (interp->suspended)
+		io_loop_run(interp->wait_ioloop);
+	interp->wait_ioloop = NULL;
+}
+
 sieve_size_t sieve_interpreter_program_counter(struct sieve_interpreter *interp)
 {
 	return interp->runenv.pc;
@@ -861,6 +1010,69 @@ int sieve_interpreter_program_jump(struct sieve_interpreter *interp,
 		interp, jmp_target, break_loops);
 }
 
+static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp);
+
+static struct sieve_test_cache *
+sieve_interpreter_get_test_cache(struct sieve_interpreter *interp)
+{
+	const struct sieve_runtime_env *renv = &interp->runenv;
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	struct sieve_test_cache *cache = eenv->scriptenv->test_cache;
+
+	if (cache == NULL)
+		return NULL;
+	/* Skipped tests would be missing from the trace */
+	if (renv->trace != NULL)
+		return NULL;
+	/* Cached results apply to the original message only */
+	if (sieve_message_get_mail(renv->msgctx) != eenv->msgdata->mail)
+		return NULL;
+	return cache;
+}
+
+int sieve_interpreter_program_cached_test(struct sieve_interpreter *interp)
+{
+	const struct sieve_runtime_env *renv = &interp->runenv;
+	sieve_size_t *address = &(interp->runenv.pc);
+	sieve_size_t test_address = interp->oprtn.address;
+	sieve_size_t test_start = *address, test_end;
+	struct sieve_test_cache *cache;
+	sieve_offset_t test_offset;
+	bool result;
+	int ret;
+
+	if (!sieve_binary_read_offset(renv->sblock, address, &test_offset)) {
+		sieve_runtime_trace_error(renv, "invalid cached test offset");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
+	test_end = test_start + test_offset;
+	if (test_end <= *address ||
+	    test_end > sieve_binary_block_get_size(renv->sblock)) {
+		sieve_runtime_trace_error(renv, "cached test end out of range");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
+
+	cache = sieve_interpreter_get_test_cache(interp);
+	if (cache == NULL) {
+		/* Just continue with the test itself */
+		return SIEVE_EXEC_OK;
+	}
+
+	if (sieve_test_cache_lookup(cache, renv->sblock, test_address,
+				    &result)) {
+		interp->test_result = result;
+		*address = test_end;
+		return SIEVE_EXEC_OK;
+	}
+
+	ret = sieve_interpreter_operation_execute(interp);
+	if (ret == SIEVE_EXEC_OK && *address == test_end) {
+		sieve_test_cache_add(cache, renv->sblock, test_address,
+				     interp->test_result);
+	}
+	return ret;
+}
+
 /*
  * Test results
  */
@@ -869,6 +1081,7 @@ void sieve_interpreter_set_test_result(struct sieve_interpreter *interp,
 				       bool result)
 {
 	interp->test_result = result;
+	interp->test_count++;
 }
 
 bool sieve_interpreter_get_test_result(struct sieve_interpreter *interp)
@@ -876,25 +1089,122 @@ bool sieve_interpreter_get_test_result(struct sieve_interpreter *interp)
 	return interp->test_result;
 }
 
+/*
+ * Profile
+ */
+
+static uint64_t sieve_interpreter_profile_cpu_usecs(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+	return ((uint64_t)usage.ru_utime.tv_sec * 1000000 +
+		usage.ru_utime.tv_usec +
+		(uint64_t)usage.ru_stime.tv_sec * 1000000 +
+		usage.ru_stime.tv_usec);
+}
+
+static void
+sieve_interpreter_profile_add(struct sieve_interpreter *interp,
+			      unsigned int line, const struct timeval *start,
+			      uint64_t cpu_start)
+{
+	struct sieve_interpreter_profile_line *pline;
+	struct timeval end;
+
+	i_gettimeofday(&end);
+
+	if (!array_is_created(&interp->profile))
+		p_array_init(&interp->profile, interp->pool, 64);
+	pline = array_idx_get_space(&interp->profile, line);
+	pline->line = line;
+	pline->count++;
+	pline->wall_usecs += timeval_diff_usecs(&end, start);
+	pline->cpu_usecs += sieve_interpreter_profile_cpu_usecs() - cpu_start;
+}
+
+static int
+sieve_interpreter_profile_line_cmp(
+	const struct sieve_interpreter_profile_line *pline1,
+	const struct sieve_interpreter_profile_line *pline2)
+{
+	if (pline1->wall_usecs != pline2->wall_usecs)
+		return (pline1->wall_usecs > pline2->wall_usecs ? -1 : 1);
+	if (pline1->line != pline2->line)
+		return (pline1->line < pline2->line ? -1 : 1);
+	return 0;
+}
+
+static void sieve_interpreter_profile_report(struct sieve_interpreter *interp)
+{
+	struct sieve_trace_log *trace_log = interp->trace.log;
+	const struct sieve_interpreter_profile_line *pline;
+	ARRAY(struct sieve_interpreter_profile_line) lines;
+
+	if (trace_log == NULL)
+		return;
+
+	T_BEGIN {
+		t_array_init(&lines, array_count(&interp->profile));
+		array_foreach(&interp->profile, pline) {
+			if (pline->count > 0)
+				array_append(&lines, pline, 1);
+		}
+		array_sort(&lines, sieve_interpreter_profile_line_cmp);
+
+		sieve_trace_log_printf(trace_log,
+			"## Profile for script `%s' "
+			"(line: count, wall time, cpu time):\n",
+			sieve_binary_source(interp->runenv.sbin));
+		array_foreach(&lines, pline) {
+			sieve_trace_log_printf(trace_log,
+				"%6u: %8u %10"PRIu64" us %10"PRIu64" us\n",
+				pline->line, pline->count,
+				pline->wall_usecs, pline->cpu_usecs);
+		}
+	} T_END;
+}
+
 /*
  * Code execute
  */
 
 static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 {
+	const struct sieve_runtime_env *renv = &interp->runenv;
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
+	struct timeval profile_start;
+	uint64_t profile_cpu_start = 0;
+	unsigned int profile_line = 0;
+	bool profile;
 
 	sieve_runtime_trace_toplevel(&interp->runenv);
 
 	/* Read the operation */
-	if (sieve_operation_read(interp->runenv.sblock, address, oprtn)) {
+	if (sieve_operation_read_cached(interp->runenv.sblock, address,
+					oprtn)) {
 		const struct sieve_operation_def *op = oprtn->def;
 		int result = SIEVE_EXEC_OK;
 
 		/* Reset cached command location */
 		interp->command_line = 0;
 
+		/* Operations executed from within another one (cached tests)
+		   are accounted to the outer operation */
+		profile = (interp->profile_depth == 0 &&
+			   sieve_runtime_trace_hasflag(renv,
+						       SIEVE_TRFLG_PROFILE));
+		if (profile) {
+			profile_line = sieve_runtime_get_command_location(renv);
+			profile_cpu_start =
+				sieve_interpreter_profile_cpu_usecs();
+			i_gettimeofday(&profile_start);
+		}
+		interp->profile_depth++;
+		interp->operation_count++;
+
 		/* Execute the operation */
 		if (op->execute != NULL) { /* Noop ? */
 			T_BEGIN {
@@ -908,6 +1218,12 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 					    sieve_operation_mnemonic(oprtn));
 		}
 
+		interp->profile_depth--;
+		if (profile) {
+			sieve_interpreter_profile_add(interp, profile_line,
+						      &profile_start,
+						      profile_cpu_start);
+		}
 		return result;
 	}
 
@@ -917,6 +1233,35 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 	return SIEVE_EXEC_BIN_CORRUPT;
 }
 
+static void sieve_interpreter_slow_script(struct sieve_interpreter *interp)
+{
+	const struct sieve_runtime_env *renv = &interp->runenv;
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	const char *msgid = eenv->msgdata->id;
+
+	e_warning(renv->event, "Script `%s' is slow: "
+		  "used %u ms of CPU time (threshold is %u ms)",
+		  sieve_binary_source(renv->sbin),
+		  interp->rusage.cpu_time_msecs,
+		  eenv->svinst->trace_slow_msecs);
+
+	if (renv->trace == NULL ||
+	    !sieve_trace_log_is_capture(renv->trace->log))
+		return;
+
+	sieve_trace_log_capture_save(renv->trace->log, t_strdup_printf(
+		"Sieve trace log for slow script:\n"
+		"\n"
+		"  Script: %s\n"
+		"  Binary: %s\n"
+		"  Message ID: %s\n"
+		"  CPU time: %u ms\n\n",
+		sieve_binary_source(renv->sbin),
+		sieve_binary_path(renv->sbin),
+		(msgid == NULL ? "(none)" : msgid),
+		interp->rusage.cpu_time_msecs));
+}
+
 int sieve_interpreter_continue(struct sieve_interpreter *interp,
 			       bool *interrupted)
 {
@@ -927,6 +1272,7 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 	struct sieve_instance *svinst = eenv->svinst;
 	struct sieve_exec_status *exec_status = eenv->exec_status;
 	struct sieve_resource_usage rusage;
+	uint64_t cpu_start = 0;
 	int ret = SIEVE_EXEC_OK;
 
 	sieve_result_ref(renv->result);
@@ -938,10 +1284,20 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 	if (svinst->max_cpu_time_secs > 0) {
 		climit = cpu_limit_init(svinst->max_cpu_time_secs,
 					CPU_LIMIT_TYPE_USER);
+	} else if (svinst->trace_slow_msecs > 0) {
+		/* No CPU limit, but CPU time is still needed to detect slow
+		   scripts */
+		cpu_start = sieve_interpreter_profile_cpu_usecs();
 	}
 
+	interp->executing = TRUE;
 	while (ret == SIEVE_EXEC_OK && !interp->interrupted &&
 	       *address < sieve_binary_block_get_size(renv->sblock)) {
+		if (interp->suspended) {
+			if (interp->resume_callback != NULL)
+				break;
+			sieve_interpreter_wait(interp);
+		}
 		if (climit != NULL && cpu_limit_exceeded(climit)) {
 			sieve_runtime_error(
 				renv, NULL,
@@ -958,6 +1314,7 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 
 		ret = sieve_interpreter_operation_execute(interp);
 	}
+	interp->executing = FALSE;
 
 	if (climit != NULL) {
 		sieve_resource_usage_init(&rusage);
@@ -966,6 +1323,12 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 		sieve_resource_usage_add(&interp->rusage, &rusage);
 
 		cpu_limit_deinit(&climit);
+	} else if (svinst->trace_slow_msecs > 0) {
+		sieve_resource_usage_init(&rusage);
+		rusage.cpu_time_msecs =
+			(sieve_interpreter_profile_cpu_usecs() -
+			 cpu_start) / 1000;
+		sieve_resource_usage_add(&interp->rusage, &rusage);
 	}
 
 	if (ret != SIEVE_EXEC_OK) {
@@ -974,14 +1337,28 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 	}
 
 	if (interrupted != NULL)
-		*interrupted = interp->interrupted;
+		*interrupted = (interp->interrupted || interp->suspended);
+
+	if (!interp->interrupted && !interp->suspended) {
+		struct timeval end_time;
 
-	if (!interp->interrupted) {
 		exec_status->resource_usage = interp->rusage;
 
+		i_gettimeofday(&end_time);
 		struct event_passthrough *e =
 			event_create_passthrough(interp->runenv.event)->
-			set_name("sieve_runtime_script_finished");
+			set_name("sieve_runtime_script_finished")->
+			add_int("operations", interp->operation_count)->
+			add_int("tests", interp->test_count)->
+			add_int("header_fetches",
+				interp->rusage.header_fetches)->
+			add_int("actions",
+				sieve_result_get_action_count(renv->result))->
+			add_int("cpu_time_msecs",
+				interp->rusage.cpu_time_msecs)->
+			add_int("running_usecs",
+				timeval_diff_usecs(&end_time,
+						   &interp->start_time));
 		switch (ret) {
 		case SIEVE_EXEC_OK:
 			break;
@@ -1006,6 +1383,10 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 			sieve_binary_source(interp->runenv.sbin),
 			sieve_execution_exitcode_to_str(ret),
 			sieve_resource_usage_get_summary(&interp->rusage));
+
+		if (interp->parent == NULL && svinst->trace_slow_msecs > 0 &&
+		    interp->rusage.cpu_time_msecs >= svinst->trace_slow_msecs)
+			sieve_interpreter_slow_script(interp);
 		interp->running = FALSE;
 	}
 
@@ -1028,8 +1409,25 @@ int sieve_interpreter_start(struct sieve_interpreter *interp,
 
 	interp->running = TRUE;
 	interp->runenv.result = result;
+	i_gettimeofday(&interp->start_time);
 	interp->runenv.msgctx = sieve_result_get_message_context(result);
 
+	/* Request the header fields tested by this script all at once */
+	if (interp->runenv.msgctx != NULL) {
+		const char *const *headers;
+		unsigned int count;
+
+		headers = sieve_binary_get_message_headers(
+			interp->runenv.sbin, &count);
+		if (headers != NULL) {
+			sieve_message_prefetch_headers(interp->runenv.msgctx,
+						       headers, count);
+		}
+		sieve_message_prefetch_fields(
+			interp->runenv.msgctx,
+			sieve_binary_get_message_fields(interp->runenv.sbin));
+	}
+
 	sieve_resource_usage_init(&interp->rusage);
 
 	/* Signal registered extensions that the interpreter is being run */
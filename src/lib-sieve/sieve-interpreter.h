@@ -45,6 +45,16 @@ sieve_interpreter_svinst(struct sieve_interpreter *interp);
 void sieve_interpreter_set_result(struct sieve_interpreter *interp,
 				  struct sieve_result *result);
 
+/*
+ * Resource usage
+ */
+
+/* Accounts resource usage to the top-level interpreter, so that usage by
+   included scripts is part of the totals */
+void sieve_interpreter_add_resource_usage(
+	struct sieve_interpreter *interp,
+	const struct sieve_resource_usage *rusage);
+
 /*
  * Loop handling
  */
@@ -89,6 +99,34 @@ void sieve_interpreter_loop_set_context(struct sieve_interpreter_loop *loop,
 
 void sieve_interpreter_reset(struct sieve_interpreter *interp);
 void sieve_interpreter_interrupt(struct sieve_interpreter *interp);
+
+/* Asynchronous operations: An operation that needs to wait for I/O starts
+   it, calls sieve_interpreter_suspend() and returns SIEVE_EXEC_OK. Once the
+   I/O finishes, its callback stores the outcome in op_context and calls
+   sieve_interpreter_resume(). The operation is then executed again, and
+   sieve_interpreter_get_suspended_context() returns op_context to it (it
+   returns NULL for a fresh execution). If the interpreter is freed before
+   that, op_context_free() is called to abort the I/O.
+
+   When a resume callback is set, sieve_interpreter_continue() returns with
+   *interrupted=TRUE while suspended, and the callback is expected to call
+   sieve_interpreter_continue() again. Otherwise, the interpreter runs the
+   current ioloop until the operation is resumed. */
+typedef void
+sieve_interpreter_resume_callback_t(struct sieve_interpreter *interp,
+				    void *context);
+
+void sieve_interpreter_suspend(struct sieve_interpreter *interp,
+			       void *op_context,
+			       void (*op_context_free)(void *context));
+void sieve_interpreter_resume(struct sieve_interpreter *interp);
+bool sieve_interpreter_is_suspended(struct sieve_interpreter *interp);
+void *
+sieve_interpreter_get_suspended_context(struct sieve_interpreter *interp);
+
+void sieve_interpreter_set_resume_callback(
+	struct sieve_interpreter *interp,
+	sieve_interpreter_resume_callback_t *callback, void *context);
 sieve_size_t
 sieve_interpreter_program_counter(struct sieve_interpreter *interp);
 
@@ -98,6 +136,10 @@ int sieve_interpreter_program_jump_to(struct sieve_interpreter *interp,
 int sieve_interpreter_program_jump(struct sieve_interpreter *interp, bool jump,
 				   bool break_loops);
 
+/* Executes the test following a CACHED_TEST operation, unless its result is
+   already known from an earlier execution for the same message. */
+int sieve_interpreter_program_cached_test(struct sieve_interpreter *interp);
+
 /*
  * Test results
  */
@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "compat.h"
+#include "buffer.h"
 #include "str.h"
 #include "str-sanitize.h"
 #include "istream.h"
@@ -27,6 +28,12 @@
 
 #define DIGIT_VAL(c) (c - '0')
 
+/* Characters that can continue an identifier */
+static const char sieve_lexer_identifier_chars[] =
+	"abcdefghijklmnopqrstuvwxyz"
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"0123456789_";
+
 /*
  * Lexer object
  */
@@ -45,6 +52,11 @@ struct sieve_lexical_scanner {
 	size_t buffer_size;
 	size_t buffer_pos;
 
+	/* The whole script when it is read into memory at once; this is
+	   NUL-terminated, so that spans can be scanned with strspn() and
+	   friends */
+	buffer_t *block;
+
 	struct sieve_lexer lexer;
 
 	int current_line;
@@ -59,6 +71,7 @@ sieve_lexer_create(struct sieve_script *script,
 	struct sieve_instance *svinst = sieve_script_svinst(script);
 	struct istream *stream;
 	const struct stat *st;
+	buffer_t *block = NULL;
 
 	/* Open script as stream */
 	if (sieve_script_get_stream(script, &stream, error_r) < 0)
@@ -76,8 +89,36 @@ sieve_lexer_create(struct sieve_script *script,
 		return NULL;
 	}
 
+	/* Read the script into memory at once when its size is known and
+	   bounded; this avoids going through the stream for each character */
+	if (stream->blocking && svinst->max_script_size > 0 &&
+	    i_stream_stat(stream, TRUE, &st) >= 0 && st->st_size > 0 &&
+	    (uoff_t)st->st_size <= svinst->max_script_size) {
+		const unsigned char *data;
+		size_t size;
+
+		block = buffer_create_dynamic(default_pool, st->st_size + 1);
+		while (i_stream_read_more(stream, &data, &size) > 0) {
+			buffer_append(block, data, size);
+			i_stream_skip(stream, size);
+		}
+		if (stream->stream_errno != 0) {
+			sieve_critical(svinst, ehandler,
+				       sieve_script_name(script),
+				       "error reading script",
+				       "error reading script: %s",
+				       i_stream_get_error(stream));
+			buffer_free(&block);
+			if (error_r != NULL)
+				*error_r = SIEVE_ERROR_TEMP_FAILURE;
+			return NULL;
+		}
+		i_assert(stream->eof);
+	}
+
 	scanner = i_new(struct sieve_lexical_scanner, 1);
 	scanner->lexer.scanner = scanner;
+	scanner->svinst = svinst;
 
 	scanner->ehandler = ehandler;
 	sieve_error_handler_ref(ehandler);
@@ -92,6 +133,14 @@ sieve_lexer_create(struct sieve_script *script,
 	scanner->buffer_size = 0;
 	scanner->buffer_pos = 0;
 
+	if (block != NULL) {
+		scanner->buffer_size = block->used;
+		/* Terminate for the span scanning functions */
+		buffer_append_c(block, '\0');
+		scanner->buffer = block->data;
+		scanner->block = block;
+	}
+
 	scanner->lexer.token_type = STT_NONE;
 	scanner->lexer.token_str_value = str_new(default_pool, 256);
 	scanner->lexer.token_int_value = 0;
@@ -111,6 +160,7 @@ void sieve_lexer_free(const struct sieve_lexer **_lexer)
 	sieve_script_unref(&scanner->script);
 	sieve_error_handler_unref(&scanner->ehandler);
 	str_free(&scanner->lexer.token_str_value);
+	buffer_free(&scanner->block);
 
 	i_free(scanner);
 	*_lexer = NULL;
@@ -315,7 +365,11 @@ static void sieve_lexer_shift(struct sieve_lexical_scanner *scanner)
 	if (scanner->buffer_size > 0 &&
 	    scanner->buffer_pos + 1 < scanner->buffer_size)
 		scanner->buffer_pos++;
-	else {
+	else if (scanner->block != NULL) {
+		/* Whole script is in memory: end of file */
+		scanner->buffer_size = 0;
+		scanner->buffer_pos = 0;
+	} else {
 		if (scanner->buffer_size > 0)
 			i_stream_skip(scanner->input, scanner->buffer_size);
 
@@ -340,6 +394,69 @@ static inline int sieve_lexer_curchar(struct sieve_lexical_scanner *scanner)
 	return scanner->buffer[scanner->buffer_pos];
 }
 
+/* Skips the next count characters of an in-memory script at once, appending
+   them to str (if not NULL) for as long as it is at most max_len long. */
+static void
+sieve_lexer_skip_span(struct sieve_lexical_scanner *scanner, size_t count,
+		      string_t *str, size_t max_len)
+{
+	const unsigned char *p, *pend;
+
+	if (count == 0)
+		return;
+	i_assert(scanner->buffer_pos + count <= scanner->buffer_size);
+
+	p = scanner->buffer + scanner->buffer_pos;
+	pend = p + count;
+
+	if (str != NULL && str_len(str) <= max_len) {
+		size_t avail = max_len + 1 - str_len(str);
+
+		str_append_data(str, p, I_MIN(count, avail));
+	}
+
+	while ((p = memchr(p, '\n', pend - p)) != NULL) {
+		scanner->current_line++;
+		p++;
+	}
+
+	scanner->buffer_pos += count;
+	if (scanner->buffer_pos == scanner->buffer_size) {
+		/* End of file */
+		scanner->buffer_size = 0;
+		scanner->buffer_pos = 0;
+	}
+}
+
+/* Scans a span of characters that are in accept (or that are not in reject,
+   respectively) for an in-memory script. Does nothing when the script is
+   read through the stream. NUL characters always end the span. */
+static void
+sieve_lexer_scan_accept(struct sieve_lexical_scanner *scanner,
+			const char *accept, string_t *str, size_t max_len)
+{
+	if (scanner->block == NULL || scanner->buffer_size == 0)
+		return;
+
+	sieve_lexer_skip_span(
+		scanner, strspn((const char *)scanner->buffer +
+				scanner->buffer_pos, accept),
+		str, max_len);
+}
+
+static void
+sieve_lexer_scan_reject(struct sieve_lexical_scanner *scanner,
+			const char *reject, string_t *str, size_t max_len)
+{
+	if (scanner->block == NULL || scanner->buffer_size == 0)
+		return;
+
+	sieve_lexer_skip_span(
+		scanner, strcspn((const char *)scanner->buffer +
+				 scanner->buffer_pos, reject),
+		str, max_len);
+}
+
 static inline const char *_char_sanitize(int ch)
 {
 	if (ch > 31 && ch < 127)
@@ -418,6 +535,7 @@ sieve_lexer_scan_hash_comment(struct sieve_lexical_scanner *scanner)
 {
 	struct sieve_lexer *lexer = &scanner->lexer;
 
+	sieve_lexer_scan_reject(scanner, "\n", NULL, 0);
 	while (sieve_lexer_curchar(scanner) != '\n') {
 		switch(sieve_lexer_curchar(scanner)) {
 		case -1:
@@ -459,7 +577,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 	int ret;
 
 	/* Read first character */
-	if (lexer->token_type == STT_NONE) {
+	if (lexer->token_type == STT_NONE && scanner->block == NULL) {
 		if ((ret = i_stream_read(scanner->input)) < 0) {
 			i_assert(ret != -2);
 			if (!scanner->input->eof) {
@@ -493,6 +611,8 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 			sieve_lexer_shift(scanner);
 
 			while (TRUE) {
+				sieve_lexer_scan_reject(scanner, "*", NULL, 0);
+
 				switch (sieve_lexer_curchar(scanner)) {
 				case -1:
 					if (scanner->input->eof) {
@@ -548,6 +668,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 	case ' ':
 		sieve_lexer_shift(scanner);
 
+		sieve_lexer_scan_accept(scanner, " \t\r\n", NULL, 0);
 		while (sieve_lexer_curchar(scanner) == '\t' ||
 		       sieve_lexer_curchar(scanner) == '\r' ||
 		       sieve_lexer_curchar(scanner) == '\n' ||
@@ -566,6 +687,8 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 		str_truncate(lexer->token_str_value, 0);
 		str = lexer->token_str_value;
 
+		sieve_lexer_scan_reject(scanner, "\"\\\r\n", str,
+					SIEVE_MAX_STRING_LEN);
 		while (sieve_lexer_curchar(scanner) != '"') {
 			if (sieve_lexer_curchar(scanner) == '\\')
 				sieve_lexer_shift(scanner);
@@ -620,6 +743,8 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 			}
 
 			sieve_lexer_shift(scanner);
+			sieve_lexer_scan_reject(scanner, "\"\\\r\n", str,
+						SIEVE_MAX_STRING_LEN);
 		}
 
 		sieve_lexer_shift(scanner);
@@ -716,6 +841,9 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 			}
 
 			/* Scan the rest of the identifier */
+			sieve_lexer_scan_accept(scanner,
+						sieve_lexer_identifier_chars,
+						str, SIEVE_MAX_IDENTIFIER_LEN);
 			while (i_isalnum(sieve_lexer_curchar(scanner)) ||
 			       sieve_lexer_curchar(scanner) == '_') {
 
@@ -744,12 +872,11 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 				case '#':
 					if (!sieve_lexer_scan_hash_comment(scanner))
 						return FALSE;
-					if (scanner->input->eof) {
-						sieve_lexer_error(lexer,
-							"end of file before end of multi-line string");
-						lexer->token_type = STT_ERROR;
-						return FALSE;
-					} else if (scanner->input->stream_errno != 0) {
+					if (sieve_lexer_curchar(scanner) == -1) {
+						if (scanner->input->eof) {
+							sieve_lexer_error(lexer,
+								"end of file before end of multi-line string");
+						}
 						lexer->token_type = STT_ERROR;
 						return FALSE;
 					}
@@ -828,6 +955,8 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 					}
 
 					/* Scan the rest of the line */
+					sieve_lexer_scan_reject(scanner, "\r\n", str,
+								SIEVE_MAX_STRING_LEN);
 					while (sieve_lexer_curchar(scanner) != '\n' &&
 					       sieve_lexer_curchar(scanner) != '\r') {
 
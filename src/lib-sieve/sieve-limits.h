@@ -18,6 +18,14 @@
 #define SIEVE_MAX_STRING_LEN                            (1 << 20)
 #define SIEVE_MAX_IDENTIFIER_LEN                        32
 
+/*
+ * Compilation
+ */
+
+/* How long to wait for another process compiling the same script */
+#define SIEVE_COMPILE_LOCK_TIMEOUT_SECS                 10
+#define SIEVE_COMPILE_LOCK_STALE_TIMEOUT_SECS           60
+
 /*
  * AST
  */
@@ -35,6 +43,8 @@
 #define SIEVE_DEFAULT_MAX_CPU_TIME_SECS                 30
 #define SIEVE_DEFAULT_RESOURCE_USAGE_TIMEOUT_SECS       (60 * 60)
 
+#define SIEVE_TRACE_CAPTURE_MAX_SIZE                    (256 * 1024)
+
 /*
  * Actions
  */
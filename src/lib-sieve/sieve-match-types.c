@@ -28,9 +28,9 @@
  */
 
 struct sieve_match_values {
-	pool_t pool;
-	ARRAY(string_t *) values;
-	unsigned count;
+	/* Allocated on first use and reused for every later match */
+	string_t *values[SIEVE_MAX_MATCH_VALUES];
+	unsigned count, limit;
 };
 
 /*
@@ -127,11 +127,25 @@ bool mtch_validator_load
  * Interpreter context
  */
 
+/* Match values are kept in two sets of buffers: the committed values and
+   the values of the match in progress. Committing swaps them. */
 struct mtch_interpreter_context {
+	struct sieve_match_values buffers[2];
 	struct sieve_match_values *match_values;
+	unsigned int match_values_limit;
 	bool match_values_enabled;
 };
 
+static void mtch_match_values_free(struct sieve_match_values *mvalues)
+{
+	unsigned int i;
+
+	for ( i = 0; i < N_ELEMENTS(mvalues->values); i++ ) {
+		if ( mvalues->values[i] != NULL )
+			str_free(&mvalues->values[i]);
+	}
+}
+
 static void mtch_interpreter_free
 (const struct sieve_extension *ext ATTR_UNUSED,
 	struct sieve_interpreter *interp ATTR_UNUSED, void *context)
@@ -139,9 +153,8 @@ static void mtch_interpreter_free
 	struct mtch_interpreter_context *mctx =
 		(struct mtch_interpreter_context *) context;
 
-	if ( mctx->match_values != NULL ) {
-		pool_unref(&mctx->match_values->pool);
-	}
+	mtch_match_values_free(&mctx->buffers[0]);
+	mtch_match_values_free(&mctx->buffers[1]);
 }
 
 struct sieve_interpreter_extension
@@ -166,6 +179,7 @@ static inline struct mtch_interpreter_context *get_interpreter_context
 	if ( ctx == NULL && create ) {
 		pool_t pool = sieve_interpreter_pool(interp);
 		ctx = p_new(pool, struct mtch_interpreter_context, 1);
+		ctx->match_values_limit = SIEVE_MAX_MATCH_VALUES;
 
 		sieve_interpreter_extension_register
 			(interp, mcht_ext, &mtch_interpreter_extension, (void *) ctx);
@@ -200,7 +214,28 @@ bool sieve_match_values_are_enabled
 	struct mtch_interpreter_context *ctx =
 		get_interpreter_context(renv->interp, FALSE);
 
-	return ( ctx == NULL ? FALSE : ctx->match_values_enabled );
+	return ( ctx == NULL ? FALSE :
+		(ctx->match_values_enabled && ctx->match_values_limit > 0) );
+}
+
+void sieve_match_values_set_limit
+(const struct sieve_runtime_env *renv, unsigned int limit)
+{
+	struct mtch_interpreter_context *ctx =
+		get_interpreter_context(renv->interp, TRUE);
+
+	ctx->match_values_limit = I_MIN(limit, SIEVE_MAX_MATCH_VALUES);
+}
+
+unsigned int sieve_match_values_get_limit
+(const struct sieve_runtime_env *renv)
+{
+	struct mtch_interpreter_context *ctx =
+		get_interpreter_context(renv->interp, FALSE);
+
+	if ( ctx == NULL || !ctx->match_values_enabled )
+		return 0;
+	return ctx->match_values_limit;
 }
 
 struct sieve_match_values *sieve_match_values_start
@@ -210,16 +245,18 @@ struct sieve_match_values *sieve_match_values_start
 		get_interpreter_context(renv->interp, FALSE);
 	struct sieve_match_values *match_values;
 
-	if ( ctx == NULL || !ctx->match_values_enabled )
+	if ( ctx == NULL || !ctx->match_values_enabled ||
+		ctx->match_values_limit == 0 )
 		return NULL;
 
-	pool_t pool = pool_alloconly_create("sieve_match_values", 1024);
+	/* Use whichever buffer set does not hold the committed values; any
+	   match left unfinished in it is simply overwritten */
+	match_values = &ctx->buffers[0];
+	if ( match_values == ctx->match_values )
+		match_values = &ctx->buffers[1];
 
-	match_values = p_new(pool, struct sieve_match_values, 1);
-	match_values->pool = pool;
 	match_values->count = 0;
-
-	p_array_init(&match_values->values, pool, 4);
+	match_values->limit = ctx->match_values_limit;
 
 	return match_values;
 }
@@ -231,13 +268,14 @@ static string_t *sieve_match_values_add_entry
 
 	if ( mvalues == NULL ) return NULL;
 
-	if ( mvalues->count >= SIEVE_MAX_MATCH_VALUES ) return NULL;
+	/* Values beyond the limit are never referenced */
+	if ( mvalues->count >= mvalues->limit ) return NULL;
 
-	if ( mvalues->count >= array_count(&mvalues->values) ) {
-		entry = str_new(mvalues->pool, 64);
-		array_append(&mvalues->values, &entry, 1);	} else {
-		string_t * const *ep = array_idx(&mvalues->values, mvalues->count);
-		entry = *ep;
+	entry = mvalues->values[mvalues->count];
+	if ( entry == NULL ) {
+		entry = str_new(default_pool, 64);
+		mvalues->values[mvalues->count] = entry;
+	} else {
 		str_truncate(entry, 0);
 	}
 
@@ -249,9 +287,8 @@ static string_t *sieve_match_values_add_entry
 void sieve_match_values_set
 (struct sieve_match_values *mvalues, unsigned int index, string_t *value)
 {
-	if ( mvalues != NULL && index < array_count(&mvalues->values) ) {
-		string_t * const *ep = array_idx(&mvalues->values, index);
-    	string_t *entry = *ep;
+	if ( mvalues != NULL && index < mvalues->count ) {
+		string_t *entry = mvalues->values[index];
 
 	    if ( entry != NULL && value != NULL ) {
 			str_truncate(entry, 0);
@@ -295,14 +332,12 @@ void sieve_match_values_commit
 	if ( (*mvalues) == NULL ) return;
 
 	ctx = get_interpreter_context(renv->interp, FALSE);
-	if ( ctx == NULL || !ctx->match_values_enabled )
+	if ( ctx == NULL || !ctx->match_values_enabled ) {
+		sieve_match_values_abort(mvalues);
 		return;
-
-	if ( ctx->match_values != NULL ) {
-		pool_unref(&ctx->match_values->pool);
-		ctx->match_values = NULL;
 	}
 
+	/* Previously committed values become the spare buffer set */
 	ctx->match_values = *mvalues;
 	*mvalues = NULL;
 }
@@ -312,7 +347,7 @@ void sieve_match_values_abort
 {
 	if ( (*mvalues) == NULL ) return;
 
-	pool_unref(&(*mvalues)->pool);
+	/* Buffers are reused by the next match */
 	*mvalues = NULL;
 }
 
@@ -329,10 +364,8 @@ void sieve_match_values_get
 	}
 
 	mvalues = ctx->match_values;
-	if ( index < array_count(&mvalues->values) && index < mvalues->count ) {
-		string_t * const *entry = array_idx(&mvalues->values, index);
-
-		*value_r = *entry;
+	if ( index < mvalues->count ) {
+		*value_r = mvalues->values[index];
 		return;
 	}
 
@@ -63,6 +63,15 @@ struct sieve_match_type_def {
 		(struct sieve_match_context *mctx, const char *val, size_t val_size,
 			const char *key, size_t key_size);
 
+	/* Chunked matching (optional): the value is presented in consecutive
+	   chunks, starting at mctx->chunk_offset. Any state that needs to carry
+	   across chunk boundaries is kept by the match type itself. Returns 1
+	   once the value is known to match; before the last chunk, 0 means that
+	   the result is not yet known. */
+	int (*match_chunk)
+		(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+			bool last, struct sieve_stringlist *key_list);
+
 	void (*match_deinit)(struct sieve_match_context *mctx);
 };
 
@@ -133,6 +142,13 @@ bool sieve_match_values_set_enabled
 bool sieve_match_values_are_enabled
 	(const struct sieve_runtime_env *renv);
 
+/* Limit the number of match values that are recorded to those the script
+   can actually reference (returns 0 when match values are disabled) */
+void sieve_match_values_set_limit
+	(const struct sieve_runtime_env *renv, unsigned int limit);
+unsigned int sieve_match_values_get_limit
+	(const struct sieve_runtime_env *renv);
+
 struct sieve_match_values *sieve_match_values_start
 	(const struct sieve_runtime_env *renv);
 void sieve_match_values_set
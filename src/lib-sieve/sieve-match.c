@@ -5,6 +5,7 @@
 #include "mempool.h"
 #include "hash.h"
 #include "array.h"
+#include "buffer.h"
 #include "str-sanitize.h"
 
 #include "sieve-extensions.h"
@@ -125,6 +126,56 @@ int sieve_match_value
 	return match;
 }
 
+bool sieve_match_can_chunk
+(const struct sieve_runtime_env *renv, const struct sieve_match_type *mcht)
+{
+	/* Tracing shows the complete value */
+	return ( mcht->def != NULL && mcht->def->match_chunk != NULL &&
+		!sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING) );
+}
+
+int sieve_match_value_chunk
+(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+	bool last, struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	int match;
+
+	if ( mcht->def->match_chunk == NULL || mctx->trace ) {
+		/* Collect the value and match it as a whole */
+		if ( mctx->chunk_value == NULL )
+			mctx->chunk_value = buffer_create_dynamic(default_pool, 4096);
+		buffer_append(mctx->chunk_value, chunk, chunk_size);
+		if ( !last )
+			return 0;
+
+		match = sieve_match_value(mctx, mctx->chunk_value->data,
+			mctx->chunk_value->used, key_list);
+		buffer_set_used_size(mctx->chunk_value, 0);
+		return match;
+	}
+
+	sieve_stringlist_reset(key_list);
+
+	T_BEGIN {
+		match = mcht->def->match_chunk
+			(mctx, chunk, chunk_size, last, key_list);
+	} T_END;
+
+	if ( match == 0 && !last ) {
+		mctx->chunk_offset += chunk_size;
+		return 0;
+	}
+	mctx->chunk_offset = 0;
+
+	if ( mctx->match_status < 0 || match < 0 )
+		mctx->match_status = -1;
+	else
+		mctx->match_status =
+			( mctx->match_status > match ? mctx->match_status : match );
+	return match;
+}
+
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 {
 	const struct sieve_match_type *mcht = (*mctx)->match_type;
@@ -137,6 +188,8 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 	if ( exec_status != NULL )
 		*exec_status = (*mctx)->exec_status;
 
+	if ( (*mctx)->chunk_value != NULL )
+		buffer_free(&(*mctx)->chunk_value);
 	pool_unref(&(*mctx)->pool);
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
@@ -156,7 +209,8 @@ int sieve_match
 	int *exec_status)
 {
 	struct sieve_match_context *mctx;
-	string_t *value_item = NULL;
+	const char *value_data;
+	size_t value_size;
 	int match, ret;
 
 	if ( (mctx=sieve_match_begin(renv, mcht, cmp)) == NULL )
@@ -179,10 +233,11 @@ int sieve_match
 
 		match = 0;
 		while ( match == 0 &&
-			(ret=sieve_stringlist_next_item(value_list, &value_item)) > 0 ) {
+			(ret=sieve_stringlist_next_item_data
+				(value_list, &value_data, &value_size)) > 0 ) {
 
 			match = sieve_match_value
-				(mctx, str_c(value_item), str_len(value_item), key_list);
+				(mctx, value_data, value_size, key_list);
 		}
 
 		if ( ret < 0 ) {
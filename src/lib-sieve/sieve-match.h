@@ -17,6 +17,11 @@ struct sieve_match_context {
 
 	void *data;
 
+	/* Chunked matching: offset of the current chunk within the value, and
+	   the value collected for match types that cannot match in chunks */
+	size_t chunk_offset;
+	buffer_t *chunk_value;
+
 	int match_status;
 	int exec_status;
 
@@ -37,6 +42,19 @@ int sieve_match_value
 		struct sieve_stringlist *key_list);
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status);
 
+/* Chunked value matching: a large value is passed in consecutive chunks, with
+   last set for the final one. Returns 1 as soon as the value matches, in
+   which case the remaining chunks can be skipped. Once 1 is returned or the
+   last chunk is passed, the next call starts a new value. Match types
+   without chunked matching support (see sieve_match_can_chunk()) get the
+   value as a whole at the end. */
+bool sieve_match_can_chunk
+	(const struct sieve_runtime_env *renv,
+		const struct sieve_match_type *mcht);
+int sieve_match_value_chunk
+	(struct sieve_match_context *mctx, const char *chunk, size_t chunk_size,
+		bool last, struct sieve_stringlist *key_list);
+
 /* Default matching operation */
 int sieve_match
 	(const struct sieve_runtime_env *renv,
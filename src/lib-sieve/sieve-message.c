@@ -5,11 +5,14 @@
 #include "ioloop.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "unichar.h"
 #include "istream.h"
 #include "time-util.h"
 #include "rfc822-parser.h"
+#include "message-address.h"
 #include "message-date.h"
 #include "message-parser.h"
 #include "message-decoder.h"
@@ -18,6 +21,8 @@
 #include "mail-storage.h"
 #include "mail-storage-service.h"
 #include "mail-user.h"
+#include "mail-namespace.h"
+#include "mailbox-list-iter.h"
 #include "smtp-params.h"
 #include "master-service.h"
 #include "master-service-settings.h"
@@ -36,6 +41,7 @@
 #include "sieve-runtime-trace.h"
 #include "sieve-match.h"
 #include "sieve-interpreter.h"
+#include "sieve-html-text-cache.h"
 
 #include "sieve-message.h"
 
@@ -58,9 +64,14 @@ const char *sieve_message_get_new_id(const struct sieve_instance *svinst)
 
 struct sieve_message_header {
 	const char *name;
+	unsigned int name_hash;
 
 	const unsigned char *value, *utf8_value;
 	size_t value_len, utf8_value_len;
+
+	/* Parsed value of Content-Type and Content-Disposition headers, as
+	   also assigned to the part; NULL for other headers */
+	const char *content;
 };
 
 struct sieve_message_part {
@@ -71,6 +82,9 @@ struct sieve_message_part {
 	const char *content_type;
 	const char *content_disposition;
 
+	/* Position in the message (used as HTML text cache key) */
+	unsigned int index;
+
 	const char *decoded_body;
 	const char *text_body;
 	size_t decoded_body_size;
@@ -80,6 +94,8 @@ struct sieve_message_part {
 	bool epilogue:1;  /* this is a multipart epilogue */
 };
 
+ARRAY_DEFINE_TYPE(sieve_message_part, struct sieve_message_part *);
+
 struct sieve_message_version {
 	struct mail *mail;
 	struct mailbox *box;
@@ -87,6 +103,47 @@ struct sieve_message_version {
 	struct edit_mail *edit_mail;
 };
 
+/* Header field values of the current message version, right-trimmed */
+struct sieve_message_header_values {
+	const char *const *values;
+	const size_t *sizes;
+	unsigned int count;
+};
+
+struct sieve_message_header_entry {
+	/* Indexed by mime_decode */
+	const struct sieve_message_header_values *values[2];
+};
+
+struct sieve_message_address_list {
+	const struct message_address *addresses;
+};
+
+/* Data derived from the message alone; possibly shared with the message
+   contexts of other executions for the same message */
+struct sieve_message_analysis {
+	pool_t pool;
+	int refcount;
+
+	/* Body */
+
+	ARRAY_TYPE(sieve_message_part) body_parts;
+	/* NULL-terminated lists of the body part data returned for a particular
+	   set of wanted content types; these point into the body parts */
+	HASH_TABLE(const char *, struct sieve_message_part_data *)
+		body_part_lists;
+
+	/* Header index */
+
+	HASH_TABLE(const char *, struct sieve_message_header_entry *) header_index;
+	/* Parsed address lists, indexed by header field value */
+	HASH_TABLE(const char *, struct sieve_message_address_list *)
+		address_index;
+
+	/* All cached body parts have their headers */
+	bool have_part_headers:1;
+};
+
 struct sieve_message_context {
 	pool_t pool;
 	pool_t context_pool;
@@ -100,23 +157,102 @@ struct sieve_message_context {
 
 	/* Message versioning */
 
-	struct mail_user *raw_mail_user;
 	ARRAY(struct sieve_message_version) versions;
 
 	/* Context data for extensions */
 
 	ARRAY(void *) ext_contexts;
 
+	/* Parsed message data for the current message version */
+
+	struct sieve_message_analysis *analysis;
+	/* Analysis shared with other executions for the original message */
+	struct sieve_message_analysis *shared_analysis;
+
 	/* Body */
 
-	ARRAY(struct sieve_message_part *) cached_body_parts;
-	ARRAY(struct sieve_message_part_data) return_body_parts;
+	struct sieve_message_part_data *raw_body_parts;
 	buffer_t *raw_body;
 
+	/* Private mailboxes of the user, mapped to their special-use flags */
+	pool_t mailbox_list_pool;
+	HASH_TABLE(const char *, const char *) mailbox_list;
+
 	bool edit_snapshot:1;
 	bool substitute_snapshot:1;
 };
 
+/*
+ * Message analysis
+ */
+
+struct sieve_message_analysis *sieve_message_analysis_create(void)
+{
+	struct sieve_message_analysis *analysis;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_message_analysis", 2048);
+	analysis = p_new(pool, struct sieve_message_analysis, 1);
+	analysis->pool = pool;
+	analysis->refcount = 1;
+	p_array_init(&analysis->body_parts, pool, 8);
+
+	return analysis;
+}
+
+void sieve_message_analysis_ref(struct sieve_message_analysis *analysis)
+{
+	analysis->refcount++;
+}
+
+void sieve_message_analysis_unref(struct sieve_message_analysis **_analysis)
+{
+	struct sieve_message_analysis *analysis = *_analysis;
+
+	*_analysis = NULL;
+	if (analysis == NULL)
+		return;
+
+	i_assert(analysis->refcount > 0);
+	if (--analysis->refcount != 0)
+		return;
+
+	if (hash_table_is_created(analysis->body_part_lists))
+		hash_table_destroy(&analysis->body_part_lists);
+	if (hash_table_is_created(analysis->header_index))
+		hash_table_destroy(&analysis->header_index);
+	if (hash_table_is_created(analysis->address_index))
+		hash_table_destroy(&analysis->address_index);
+	pool_unref(&analysis->pool);
+}
+
+/* Selects the analysis for the current message version: the shared one for
+   the original message, a private one for anything else. */
+static void
+sieve_message_context_init_analysis(struct sieve_message_context *msgctx)
+{
+	sieve_message_analysis_unref(&msgctx->analysis);
+
+	if (msgctx->shared_analysis != NULL &&
+	    sieve_message_get_mail(msgctx) == msgctx->msgdata->mail) {
+		msgctx->analysis = msgctx->shared_analysis;
+		sieve_message_analysis_ref(msgctx->analysis);
+	} else {
+		msgctx->analysis = sieve_message_analysis_create();
+	}
+}
+
+void sieve_message_context_set_analysis(struct sieve_message_context *msgctx,
+					struct sieve_message_analysis *analysis)
+{
+	sieve_message_analysis_unref(&msgctx->shared_analysis);
+	msgctx->shared_analysis = analysis;
+	if (analysis != NULL)
+		sieve_message_analysis_ref(analysis);
+
+	sieve_message_context_init_analysis(msgctx);
+}
+
 /*
  * Message versions
  */
@@ -190,6 +326,12 @@ static void sieve_message_context_clear(struct sieve_message_context *msgctx)
 	struct sieve_message_version *versions;
 	unsigned int count, i;
 
+	if ( msgctx->mailbox_list_pool != NULL ) {
+		if ( hash_table_is_created(msgctx->mailbox_list) )
+			hash_table_destroy(&msgctx->mailbox_list);
+		pool_unref(&msgctx->mailbox_list_pool);
+	}
+
 	if ( msgctx->pool != NULL ) {
 		versions = array_get_modifiable(&msgctx->versions, &count);
 
@@ -208,11 +350,10 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 	if (--(*msgctx)->refcount != 0)
 		return;
 
-	if ( (*msgctx)->raw_mail_user != NULL )
-		mail_user_unref(&(*msgctx)->raw_mail_user);
-
 	sieve_message_context_clear(*msgctx);
 
+	sieve_message_analysis_unref(&(*msgctx)->analysis);
+	sieve_message_analysis_unref(&(*msgctx)->shared_analysis);
 	if ( (*msgctx)->context_pool != NULL )
 		pool_unref(&((*msgctx)->context_pool));
 
@@ -233,9 +374,10 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->ext_contexts, pool,
 		sieve_extensions_get_count(msgctx->svinst));
 
-	p_array_init(&msgctx->cached_body_parts, pool, 8);
-	p_array_init(&msgctx->return_body_parts, pool, 8);
+	msgctx->raw_body_parts = NULL;
 	msgctx->raw_body = NULL;
+
+	sieve_message_context_init_analysis(msgctx);
 }
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx)
@@ -324,6 +466,46 @@ const struct smtp_address *sieve_message_get_sender
  * Mail
  */
 
+/* Returns the raw storage user for substituted and edited messages. It is
+   shared by all message contexts of the same user, so that the raw storage is
+   set up only once for a whole batch of messages. */
+static struct mail_user *
+sieve_message_get_raw_user(struct sieve_message_context *msgctx)
+{
+	struct sieve_instance *svinst = msgctx->svinst;
+	struct mail_user *mail_user = msgctx->mail_user;
+	struct mail_storage_service_ctx *storage_service;
+	struct settings_instance *set_instance;
+
+	if ( mail_user == NULL )
+		return NULL;
+	if ( svinst->raw_mail_user != NULL &&
+		svinst->raw_mail_user_owner == mail_user )
+		return svinst->raw_mail_user;
+
+	sieve_message_raw_user_free(svinst);
+
+	storage_service = mail_storage_service_user_get_service_ctx(
+		mail_user->service_user);
+	set_instance = mail_storage_service_user_get_settings_instance(
+		mail_user->service_user);
+	svinst->raw_mail_user =
+		raw_storage_create_from_set(storage_service, set_instance);
+	/* Keep the owner referenced, so that it is not confused with a new
+	   user allocated at the same address */
+	svinst->raw_mail_user_owner = mail_user;
+	mail_user_ref(mail_user);
+	return svinst->raw_mail_user;
+}
+
+void sieve_message_raw_user_free(struct sieve_instance *svinst)
+{
+	if ( svinst->raw_mail_user != NULL )
+		mail_user_unref(&svinst->raw_mail_user);
+	if ( svinst->raw_mail_user_owner != NULL )
+		mail_user_unref(&svinst->raw_mail_user_owner);
+}
+
 int sieve_message_substitute
 (struct sieve_message_context *msgctx, struct istream *input)
 {
@@ -334,7 +516,6 @@ int sieve_message_substitute
 		.localpart = DEFAULT_ENVELOPE_SENDER,
 		.domain = NULL,
 	};
-	struct mail_user *mail_user = msgctx->mail_user;
 	struct sieve_message_version *version;
 	struct mailbox_header_lookup_ctx *headers_ctx;
 	struct mailbox *box = NULL;
@@ -343,20 +524,11 @@ int sieve_message_substitute
 
 	i_assert(input->blocking);
 
-	if ( msgctx->raw_mail_user == NULL ) {
-		struct mail_storage_service_ctx *storage_service =
-			mail_storage_service_user_get_service_ctx(
-				mail_user->service_user);
-		struct settings_instance *set_instance =
-			mail_storage_service_user_get_settings_instance(mail_user->service_user);
-		msgctx->raw_mail_user =
-			raw_storage_create_from_set(storage_service, set_instance);
-	}
-
 	i_stream_seek(input, 0);
 	sender = sieve_message_get_sender(msgctx);
 	sender = (sender == NULL ? &default_sender : sender);
-	ret = raw_mailbox_alloc_stream(msgctx->raw_mail_user, input, (time_t)-1,
+	ret = raw_mailbox_alloc_stream(sieve_message_get_raw_user(msgctx),
+		input, (time_t)-1,
 		smtp_address_encode(sender), &box);
 
 	if ( ret < 0 ) {
@@ -404,6 +576,45 @@ struct mail *sieve_message_get_mail
 	return versions[count-1].mail;
 }
 
+void sieve_message_prefetch_headers
+(struct sieve_message_context *msgctx, const char *const *headers,
+	unsigned int count)
+{
+	struct mailbox_header_lookup_ctx *headers_ctx;
+	struct mail *mail;
+	const char **names;
+
+	mail = sieve_message_get_mail(msgctx);
+	if ( mail == NULL || count == 0 )
+		return;
+
+	T_BEGIN {
+		/* Lookup list needs to be NULL-terminated */
+		names = t_new(const char *, count + 1);
+		memcpy(names, headers, sizeof(*names) * count);
+
+		headers_ctx = mailbox_header_lookup_init(mail->box, names);
+		mail_add_temp_wanted_fields(mail, 0, headers_ctx);
+		mailbox_header_lookup_unref(&headers_ctx);
+	} T_END;
+}
+
+void sieve_message_prefetch_fields
+(struct sieve_message_context *msgctx, enum sieve_message_fields fields)
+{
+	enum mail_fetch_field wanted = 0;
+	struct mail *mail;
+
+	mail = sieve_message_get_mail(msgctx);
+	if ( mail == NULL )
+		return;
+
+	if ( (fields & SIEVE_MESSAGE_FIELD_SIZE) != 0 )
+		wanted |= MAIL_FETCH_PHYSICAL_SIZE;
+	if ( wanted != 0 )
+		mail_add_temp_wanted_fields(mail, wanted, NULL);
+}
+
 struct edit_mail *sieve_message_edit
 (struct sieve_message_context *msgctx)
 {
@@ -412,14 +623,21 @@ struct edit_mail *sieve_message_edit
 	version = sieve_message_version_get(msgctx);
 
 	if ( version->edit_mail == NULL ) {
-		version->edit_mail = edit_mail_wrap
-			(( version->mail == NULL ? msgctx->msgdata->mail : version->mail ));
+		version->edit_mail = edit_mail_wrap_user
+			(( version->mail == NULL ? msgctx->msgdata->mail : version->mail ),
+				sieve_message_get_raw_user(msgctx));
 	} else if ( msgctx->edit_snapshot ) {
 		version->edit_mail = edit_mail_snapshot(version->edit_mail);
 	}
 
 	msgctx->edit_snapshot = FALSE;
 
+	/* The caller is about to modify the headers */
+	if ( msgctx->analysis == msgctx->shared_analysis )
+		sieve_message_context_init_analysis(msgctx);
+	else if ( hash_table_is_created(msgctx->analysis->header_index) )
+		hash_table_clear(msgctx->analysis->header_index, TRUE);
+
 	return version->edit_mail;
 }
 
@@ -430,6 +648,107 @@ void sieve_message_snapshot
 	msgctx->substitute_snapshot = TRUE;
 }
 
+/*
+ * Mailbox list
+ */
+
+static bool sieve_message_mailbox_list_init
+(struct sieve_message_context *msgctx)
+{
+	static const char *const patterns[] = { "*", NULL };
+	struct mail_user *user = msgctx->mail_user;
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+
+	if ( msgctx->mailbox_list_pool != NULL )
+		return hash_table_is_created(msgctx->mailbox_list);
+	if ( user == NULL )
+		return FALSE;
+
+	msgctx->mailbox_list_pool =
+		pool_alloconly_create("sieve_message_mailbox_list", 1024);
+	hash_table_create(&msgctx->mailbox_list, msgctx->mailbox_list_pool,
+		0, str_hash, strcmp);
+
+	iter = mailbox_list_iter_init_namespaces(user->namespaces, patterns,
+		MAIL_NAMESPACE_TYPE_PRIVATE, MAILBOX_LIST_ITER_RETURN_SPECIALUSE);
+	while ( (info=mailbox_list_iter_next(iter)) != NULL ) {
+		if ( (info->flags & (MAILBOX_NOSELECT | MAILBOX_NONEXISTENT)) != 0 )
+			continue;
+		hash_table_insert(msgctx->mailbox_list,
+			p_strdup(msgctx->mailbox_list_pool, info->vname),
+			p_strdup(msgctx->mailbox_list_pool,
+				( info->special_use == NULL ? "" : info->special_use )));
+	}
+	if ( mailbox_list_iter_deinit(&iter) < 0 ) {
+		/* Fall back to opening mailboxes */
+		hash_table_destroy(&msgctx->mailbox_list);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int sieve_message_mailbox_exists
+(struct sieve_message_context *msgctx, const char *mailbox)
+{
+	struct mail_namespace *ns;
+
+	if ( !sieve_message_mailbox_list_init(msgctx) )
+		return -1;
+
+	/* Only private namespaces are listed */
+	ns = mail_namespace_find(msgctx->mail_user->namespaces, mailbox);
+	if ( ns == NULL || ns->type != MAIL_NAMESPACE_TYPE_PRIVATE )
+		return -1;
+
+	if ( hash_table_lookup(msgctx->mailbox_list, mailbox) != NULL )
+		return 1;
+
+	/* INBOX is case-insensitive, which the listed names do not reflect */
+	if ( strncasecmp(mailbox, "INBOX", 5) == 0 )
+		return -1;
+	return 0;
+}
+
+int sieve_message_mailbox_special_use_exists
+(struct sieve_message_context *msgctx, const char *special_use)
+{
+	struct hash_iterate_context *iter;
+	const char *vname, *flags;
+	bool found = FALSE;
+
+	if ( !sieve_message_mailbox_list_init(msgctx) )
+		return -1;
+
+	iter = hash_table_iterate_init(msgctx->mailbox_list);
+	while ( !found &&
+		hash_table_iterate(iter, msgctx->mailbox_list, &vname, &flags) ) {
+		if ( *flags == '\0' )
+			continue;
+		T_BEGIN {
+			const char *const *uses = t_strsplit_spaces(flags, " ");
+
+			found = str_array_icase_find(uses, special_use);
+		} T_END;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	return ( found ? 1 : 0 );
+}
+
+void sieve_message_mailbox_created
+(struct sieve_message_context *msgctx, const char *mailbox)
+{
+	if ( msgctx->mailbox_list_pool == NULL ||
+		!hash_table_is_created(msgctx->mailbox_list) )
+		return;
+	if ( hash_table_lookup(msgctx->mailbox_list, mailbox) != NULL )
+		return;
+
+	hash_table_insert(msgctx->mailbox_list,
+		p_strdup(msgctx->mailbox_list_pool, mailbox), "");
+}
+
 /*
  * Message header list
  */
@@ -441,8 +760,15 @@ static int sieve_message_header_list_next_item
 		string_t **value_r);
 static int sieve_message_header_list_next_value
 	(struct sieve_stringlist *_strlist, string_t **value_r);
+static int sieve_message_header_list_next_value_data
+	(struct sieve_stringlist *_strlist, const char **data_r,
+		size_t *size_r);
 static void sieve_message_header_list_reset
 	(struct sieve_stringlist *_strlist);
+static int sieve_message_header_list_get_length
+	(struct sieve_stringlist *_strlist);
+static int sieve_message_header_list_skip_items
+	(struct sieve_stringlist *_strlist, unsigned int count);
 
 /* String list object */
 
@@ -452,8 +778,8 @@ struct sieve_message_header_list {
 	struct sieve_stringlist *field_names;
 
 	const char *header_name;
-	const char *const *headers;
-	int headers_index;
+	const struct sieve_message_header_values *headers;
+	unsigned int headers_index;
 
 	bool mime_decode:1;
 };
@@ -469,7 +795,13 @@ struct sieve_header_list *sieve_message_header_list_create
 	hdrlist->hdrlist.strlist.runenv = renv;
 	hdrlist->hdrlist.strlist.exec_status = SIEVE_EXEC_OK;
 	hdrlist->hdrlist.strlist.next_item = sieve_message_header_list_next_value;
+	hdrlist->hdrlist.strlist.next_item_data =
+		sieve_message_header_list_next_value_data;
 	hdrlist->hdrlist.strlist.reset = sieve_message_header_list_reset;
+	hdrlist->hdrlist.strlist.get_length =
+		sieve_message_header_list_get_length;
+	hdrlist->hdrlist.strlist.skip_items =
+		sieve_message_header_list_skip_items;
 	hdrlist->hdrlist.next_item = sieve_message_header_list_next_item;
 	hdrlist->field_names = field_names;
 	hdrlist->mime_decode = mime_decode;
@@ -477,44 +809,174 @@ struct sieve_header_list *sieve_message_header_list_create
 	return &hdrlist->hdrlist;
 }
 
-// NOTE: get rid of this once we have a proper Sieve string type
-static inline string_t *_header_right_trim(const char *raw)
+/* Header index */
+
+static const struct sieve_message_header_values *
+sieve_message_header_values_create(pool_t pool, const char *const *headers)
 {
-	string_t *result;
-	const char *p, *pend;
+	struct sieve_message_header_values *hvalues;
+	const char **values;
+	size_t *sizes;
+	unsigned int count, i;
 
-	pend = raw + strlen(raw);
-	if (raw == pend) {
-		result = t_str_new(1);
-	} else {
-		for ( p = pend-1; p >= raw; p-- ) {
-			if ( *p != ' ' && *p != '\t' ) break;
+	count = (headers == NULL ? 0 : str_array_length(headers));
+
+	hvalues = p_new(pool, struct sieve_message_header_values, 1);
+	hvalues->count = count;
+	hvalues->values = values = p_new(pool, const char *, count + 1);
+	hvalues->sizes = sizes = p_new(pool, size_t, count + 1);
+
+	for ( i = 0; i < count; i++ ) {
+		const char *raw = headers[i];
+		size_t size = strlen(raw);
+
+		// NOTE: get rid of this once we have a proper Sieve string type
+		while ( size > 0 && (raw[size-1] == ' ' || raw[size-1] == '\t') )
+			size--;
+
+		values[i] = p_strndup(pool, raw, size);
+		sizes[i] = size;
+	}
+
+	return hvalues;
+}
+
+/* Returns the values of the header field in the current message version.
+   These are fetched, decoded and trimmed only once; the index is kept until
+   the message is substituted or its header is edited. */
+static int sieve_message_get_header_values
+(const struct sieve_runtime_env *renv, struct mail *mail,
+	const char *field_name, bool mime_decode,
+	const struct sieve_message_header_values **values_r)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	pool_t pool = msgctx->analysis->pool;
+	struct sieve_message_header_entry *header;
+	struct sieve_resource_usage rusage;
+	const char *const *headers;
+	unsigned int idx = (mime_decode ? 1 : 0);
+	int ret;
+
+	if ( !hash_table_is_created(msgctx->analysis->header_index) ) {
+		hash_table_create(&msgctx->analysis->header_index, pool, 0,
+			strcase_hash, strcasecmp);
+	}
+
+	header = hash_table_lookup(msgctx->analysis->header_index, field_name);
+	if ( header == NULL ) {
+		header = p_new(pool, struct sieve_message_header_entry, 1);
+		hash_table_insert(msgctx->analysis->header_index,
+			p_strdup(pool, field_name), header);
+	} else if ( header->values[idx] != NULL ) {
+		*values_r = header->values[idx];
+		return 0;
+	}
+
+	/* Fetch all matching headers from the e-mail */
+	if ( mime_decode )
+		ret = mail_get_headers_utf8(mail, field_name, &headers);
+	else
+		ret = mail_get_headers(mail, field_name, &headers);
+	if ( ret < 0 )
+		return -1;
+
+	sieve_resource_usage_init(&rusage);
+	rusage.header_fetches = 1;
+	sieve_interpreter_add_resource_usage(renv->interp, &rusage);
+
+	header->values[idx] = sieve_message_header_values_create
+		(pool, (ret == 0 ? NULL : headers));
+	*values_r = header->values[idx];
+	return 0;
+}
+
+/* Checks whether the header field is present in the current message
+   version. Values already in the header index are used when available;
+   otherwise only the first value is looked up, without decoding, trimming or
+   copying any of them. */
+int sieve_message_header_exists
+(const struct sieve_runtime_env *renv, const char *field_name,
+	bool *exists_r)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	struct sieve_message_header_entry *header = NULL;
+	struct sieve_resource_usage rusage;
+	const char *value;
+	unsigned int idx;
+	int ret;
+
+	if ( hash_table_is_created(msgctx->analysis->header_index) )
+		header = hash_table_lookup(msgctx->analysis->header_index, field_name);
+	if ( header != NULL ) {
+		for ( idx = 0; idx < N_ELEMENTS(header->values); idx++ ) {
+			if ( header->values[idx] != NULL ) {
+				*exists_r = ( header->values[idx]->count > 0 );
+				return 0;
+			}
 		}
-		result = t_str_new(p - raw + 1);
-		str_append_data(result, raw, p - raw + 1);
 	}
-	return result;
+
+	if ( (ret=mail_get_first_header(mail, field_name, &value)) < 0 )
+		return -1;
+
+	sieve_resource_usage_init(&rusage);
+	rusage.header_fetches = 1;
+	sieve_interpreter_add_resource_usage(renv->interp, &rusage);
+
+	*exists_r = ( ret > 0 );
+	return 0;
+}
+
+/* Parsed address lists */
+
+const struct message_address *sieve_message_parse_address_list
+(struct sieve_message_context *msgctx, const char *value, size_t size)
+{
+	pool_t pool = msgctx->analysis->pool;
+	struct sieve_message_address_list *alist;
+
+	if ( strlen(value) != size ) {
+		/* Value with NULs cannot be used as a key */
+		return message_address_parse(pool_datastack_create(),
+			(const unsigned char *)value, size, 256, 0);
+	}
+
+	if ( !hash_table_is_created(msgctx->analysis->address_index) ) {
+		hash_table_create(&msgctx->analysis->address_index, pool, 0,
+			str_hash, strcmp);
+	}
+
+	alist = hash_table_lookup(msgctx->analysis->address_index, value);
+	if ( alist == NULL ) {
+		alist = p_new(pool, struct sieve_message_address_list, 1);
+		alist->addresses = message_address_parse(pool,
+			(const unsigned char *)value, size, 256, 0);
+		hash_table_insert(msgctx->analysis->address_index,
+			p_strndup(pool, value, size), alist);
+	}
+	return alist->addresses;
 }
 
 /* String list implementation */
 
-static int sieve_message_header_list_next_item
+static int sieve_message_header_list_next_data
 (struct sieve_header_list *_hdrlist, const char **name_r,
-	string_t **value_r)
+	const char **data_r, size_t *size_r)
 {
 	struct sieve_message_header_list *hdrlist =
 		(struct sieve_message_header_list *) _hdrlist;
 	const struct sieve_runtime_env *renv = _hdrlist->strlist.runenv;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	unsigned int index;
 
 	if ( name_r != NULL )
 		*name_r = NULL;
-	*value_r = NULL;
 
 	/* Check for end of current header list */
 	if ( hdrlist->headers == NULL ) {
 		hdrlist->headers_index = 0;
- 	} else if ( hdrlist->headers[hdrlist->headers_index] == NULL ) {
+ 	} else if ( hdrlist->headers_index >= hdrlist->headers->count ) {
 		hdrlist->headers = NULL;
 		hdrlist->headers_index = 0;
 	}
@@ -538,31 +1000,43 @@ static int sieve_message_header_list_next_item
 		}
 
 		/* Fetch all matching headers from the e-mail */
-		if ( hdrlist->mime_decode ) {
-			ret = mail_get_headers_utf8(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		}
-
-		if (ret < 0) {
+		if ( sieve_message_get_header_values(renv, mail,
+			str_c(hdr_item), hdrlist->mime_decode, &hdrlist->headers) < 0 ) {
 			_hdrlist->strlist.exec_status =
 				sieve_runtime_mail_error(renv, mail,
 					"failed to read header field `%s'", str_c(hdr_item));
 			return -1;
 		}
 
-		if ( ret == 0 || hdrlist->headers[0] == NULL ) {
+		if ( hdrlist->headers->count == 0 ) {
 			/* Try next item when no headers found */
 			hdrlist->headers = NULL;
 		}
 	}
 
-	/* Return next item */
+	/* Return next item; the values stay in the header index */
 	if ( name_r != NULL )
 		*name_r = hdrlist->header_name;
-	*value_r = _header_right_trim(hdrlist->headers[hdrlist->headers_index++]);
+	index = hdrlist->headers_index++;
+	*data_r = hdrlist->headers->values[index];
+	*size_r = hdrlist->headers->sizes[index];
+	return 1;
+}
+
+static int sieve_message_header_list_next_item
+(struct sieve_header_list *_hdrlist, const char **name_r,
+	string_t **value_r)
+{
+	const char *data;
+	size_t size;
+	int ret;
+
+	*value_r = NULL;
+	if ( (ret=sieve_message_header_list_next_data
+		(_hdrlist, name_r, &data, &size)) <= 0 )
+		return ret;
+
+	*value_r = str_new_const(pool_datastack_create(), data, size);
 	return 1;
 }
 
@@ -576,6 +1050,16 @@ static int sieve_message_header_list_next_value
 		(hdrlist, NULL, value_r);
 }
 
+static int sieve_message_header_list_next_value_data
+(struct sieve_stringlist *_strlist, const char **data_r, size_t *size_r)
+{
+	struct sieve_header_list *hdrlist =
+		(struct sieve_header_list *) _strlist;
+
+	return sieve_message_header_list_next_data
+		(hdrlist, NULL, data_r, size_r);
+}
+
 static void sieve_message_header_list_reset
 (struct sieve_stringlist *strlist)
 {
@@ -587,6 +1071,90 @@ static void sieve_message_header_list_reset
 	sieve_stringlist_reset(hdrlist->field_names);
 }
 
+static int sieve_message_header_list_get_length
+(struct sieve_stringlist *_strlist)
+{
+	struct sieve_message_header_list *hdrlist =
+		(struct sieve_message_header_list *) _strlist;
+	const struct sieve_runtime_env *renv = _strlist->runenv;
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	const struct sieve_message_header_values *headers;
+	string_t *hdr_item = NULL;
+	int count = 0, ret;
+
+	/* Count the indexed header values (e.g. for :count) without creating
+	   a string for each of them */
+	sieve_message_header_list_reset(_strlist);
+	while ( (ret=sieve_stringlist_next_item
+		(hdrlist->field_names, &hdr_item)) > 0 ) {
+		if ( sieve_message_get_header_values(renv, mail,
+			str_c(hdr_item), hdrlist->mime_decode, &headers) < 0 ) {
+			_strlist->exec_status =
+				sieve_runtime_mail_error(renv, mail,
+					"failed to read header field `%s'", str_c(hdr_item));
+			return -1;
+		}
+		count += headers->count;
+	}
+	sieve_message_header_list_reset(_strlist);
+
+	if ( ret < 0 ) {
+		_strlist->exec_status = hdrlist->field_names->exec_status;
+		return -1;
+	}
+	return count;
+}
+
+static int sieve_message_header_list_skip_items
+(struct sieve_stringlist *_strlist, unsigned int count)
+{
+	struct sieve_message_header_list *hdrlist =
+		(struct sieve_message_header_list *) _strlist;
+	const struct sieve_runtime_env *renv = _strlist->runenv;
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	unsigned int left;
+
+	/* Values of each field are indexed, so only the field names need
+	   to be iterated (e.g. for :index) */
+	while ( count > 0 ) {
+		if ( hdrlist->headers == NULL ) {
+			string_t *hdr_item = NULL;
+			int ret;
+
+			if ( (ret=sieve_stringlist_next_item
+				(hdrlist->field_names, &hdr_item)) <= 0 ) {
+				if ( ret < 0 ) {
+					_strlist->exec_status =
+						hdrlist->field_names->exec_status;
+				}
+				return ret;
+			}
+
+			hdrlist->header_name = str_c(hdr_item);
+			hdrlist->headers_index = 0;
+			if ( sieve_message_get_header_values(renv, mail,
+				str_c(hdr_item), hdrlist->mime_decode,
+				&hdrlist->headers) < 0 ) {
+				_strlist->exec_status =
+					sieve_runtime_mail_error(renv, mail,
+						"failed to read header field `%s'",
+						str_c(hdr_item));
+				return -1;
+			}
+		}
+
+		left = hdrlist->headers->count - hdrlist->headers_index;
+		if ( count < left ) {
+			hdrlist->headers_index += count;
+			break;
+		}
+		count -= left;
+		hdrlist->headers = NULL;
+		hdrlist->headers_index = 0;
+	}
+	return 1;
+}
+
 /*
  * Header override operand
  */
@@ -821,11 +1389,12 @@ int sieve_message_part_get_first_header
 	const char **value_r)
 {
 	const struct sieve_message_header *headers;
-	unsigned int i, count;
+	unsigned int i, count, hash = strcase_hash(field);
 
 	headers = array_get(&mpart->headers, &count);
 	for ( i = 0; i < count; i++ ) {
-		if ( strcasecmp( headers[i].name, field) == 0 ) {
+		if ( headers[i].name_hash == hash &&
+			strcasecmp( headers[i].name, field) == 0 ) {
 			i_assert( headers[i].value[headers[i].value_len] == '\0' );
 			*value_r = (const char *)headers[i].value;
 			return 1;
@@ -856,6 +1425,49 @@ void sieve_message_part_get_data
 	}
 }
 
+struct sieve_message_body_stream;
+
+static int sieve_message_parts_add_missing
+	(const struct sieve_runtime_env *renv,
+		const char *const *content_types,
+		bool extract_text, bool iter_all,
+		struct sieve_message_body_stream *stream)
+	ATTR_NULL(2, 5);
+
+int sieve_message_part_read_data
+(const struct sieve_runtime_env *renv, struct sieve_message_part *mpart,
+	struct sieve_message_part_data *data, bool text)
+{
+	const char *content_types[2];
+	bool missing;
+	int status;
+
+	if ( !text )
+		missing = ( mpart->decoded_body == NULL );
+	else
+		missing = ( mpart->children == NULL && mpart->text_body == NULL );
+
+	if ( missing && mpart->have_body ) {
+		/* Read the bodies of all parts with this content type */
+		content_types[0] = mpart->content_type;
+		content_types[1] = NULL;
+		T_BEGIN {
+			status = sieve_message_parts_add_missing
+				(renv, content_types, text, FALSE, NULL);
+		} T_END;
+
+		if ( status <= 0 )
+			return status;
+	}
+
+	sieve_message_part_get_data(mpart, data, text);
+	if ( data->content == NULL ) {
+		data->content = "";
+		data->size = 0;
+	}
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Message body
  */
@@ -910,25 +1522,52 @@ ATTR_NULL(1)
 	return FALSE;
 }
 
-static bool sieve_message_body_get_return_parts
+static const char * const sieve_message_text_content_types[] =
+	{ "application/xhtml+xml", "text", NULL };
+/* Used to parse only the part structure and headers */
+static const char * const sieve_message_no_content_types[] = { NULL };
+
+static const char *
+sieve_message_body_part_list_key(const char * const *wanted_types,
+	bool extract_text)
+{
+	string_t *key = t_str_new(64);
+
+	str_append_c(key, ( extract_text ? 'T' : 'C' ));
+	for (; *wanted_types != NULL; wanted_types++) {
+		str_append(key, t_str_lcase(*wanted_types));
+		str_append_c(key, '\n');
+	}
+	return str_c(key);
+}
+
+static struct sieve_message_part_data *
+sieve_message_body_get_return_parts
 (const struct sieve_runtime_env *renv,
 	const char * const *wanted_types,
 	bool extract_text)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
+	struct sieve_message_analysis *analysis = msgctx->analysis;
 	struct sieve_message_part *const *body_parts;
-	unsigned int i, count;
-	struct sieve_message_part_data *return_part;
+	struct sieve_message_part_data *parts, *return_part;
+	unsigned int i, count, parts_count = 0;
+	const char *key;
 
 	/* Check whether any body parts are cached already */
-	body_parts = array_get(&msgctx->cached_body_parts, &count);
+	body_parts = array_get(&analysis->body_parts, &count);
 	if ( count == 0 )
-		return FALSE;
+		return NULL;
 
-	/* Clear result array */
-	array_clear(&msgctx->return_body_parts);
+	/* Check whether the list was assembled before */
+	key = sieve_message_body_part_list_key(wanted_types, extract_text);
+	if ( hash_table_is_created(analysis->body_part_lists) ) {
+		parts = hash_table_lookup(analysis->body_part_lists, key);
+		if ( parts != NULL )
+			return parts;
+	}
 
-	/* Fill result array with requested content_types */
+	/* Count the requested content_types */
 	for (i = 0; i < count; i++) {
 		if (!body_parts[i]->have_body) {
 			/* Part has no body; according to RFC this MUST not match to anything and
@@ -942,29 +1581,50 @@ static bool sieve_message_body_get_return_parts
 			(wanted_types, body_parts[i]->content_type))
 			continue;
 
-		/* Add new item to the result */
-		return_part = array_append_space(&msgctx->return_body_parts);
-		return_part->content_type = body_parts[i]->content_type;
-		return_part->content_disposition = body_parts[i]->content_disposition;
-
 		/* Depending on whether a decoded body part is requested, the appropriate
-		 * cache item is read. If it is missing, this function fails and the cache
+		 * cache item is checked. If it is missing, this function fails and the cache
 		 * needs to be completed by sieve_message_parts_add_missing().
 		 */
 		if (extract_text) {
 			if (body_parts[i]->text_body == NULL)
-				return FALSE;
+				return NULL;
+		} else {
+			if (body_parts[i]->decoded_body == NULL)
+				return NULL;
+		}
+		parts_count++;
+	}
+
+	/* Assemble the (NULL-terminated) list once; the cached part contents
+	   are not copied */
+	parts = p_new(analysis->pool, struct sieve_message_part_data,
+		parts_count + 1);
+	return_part = parts;
+	for (i = 0; i < count; i++) {
+		if (!body_parts[i]->have_body ||
+			!_is_wanted_content_type
+				(wanted_types, body_parts[i]->content_type))
+			continue;
+
+		return_part->content_type = body_parts[i]->content_type;
+		return_part->content_disposition = body_parts[i]->content_disposition;
+		if (extract_text) {
 			return_part->content = body_parts[i]->text_body;
 			return_part->size = body_parts[i]->text_body_size;
 		} else {
-			if (body_parts[i]->decoded_body == NULL)
-				return FALSE;
 			return_part->content = body_parts[i]->decoded_body;
-			return_part->size = body_parts[i]->decoded_body_size;				
+			return_part->size = body_parts[i]->decoded_body_size;
 		}
+		return_part++;
 	}
 
-	return TRUE;
+	if ( !hash_table_is_created(analysis->body_part_lists) ) {
+		hash_table_create(&analysis->body_part_lists, analysis->pool, 0,
+			str_hash, strcmp);
+	}
+	hash_table_insert(analysis->body_part_lists,
+		p_strdup(analysis->pool, key), parts);
+	return parts;
 }
 
 static void sieve_message_part_save
@@ -973,7 +1633,8 @@ static void sieve_message_part_save
 	bool extract_text)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
+	pool_t pool = msgctx->analysis->pool;
+	struct sieve_resource_usage rusage;
 	buffer_t *result_buf, *text_buf = NULL;
 	char *part_data;
 	size_t part_size;
@@ -985,14 +1646,34 @@ static void sieve_message_part_save
 
 		if ( buf->used > 0 && mail_html2text_content_type_match
 			(body_part->content_type) ) {
+			struct sieve_html_text_cache *cache =
+				msgctx->svinst->html_text_cache;
 			struct mail_html2text *html2text;
+			const char *guid = NULL, *text;
+			size_t text_size;
 
 			text_buf = buffer_create_dynamic(default_pool, 4096);
 
-			/* Remove HTML markup */
-			html2text = mail_html2text_init(0);
-			mail_html2text_more(html2text, buf->data, buf->used, text_buf);
-			mail_html2text_deinit(&html2text);
+			/* Only the original message has a stable GUID */
+			if ( cache != NULL && msgctx->msgdata->mail != NULL &&
+				sieve_message_get_mail(msgctx) == msgctx->msgdata->mail &&
+				mail_get_special(msgctx->msgdata->mail,
+					MAIL_FETCH_GUID, &guid) < 0 )
+				guid = NULL;
+
+			text = sieve_html_text_cache_lookup
+				(cache, guid, body_part->index, &text_size);
+			if ( text != NULL ) {
+				buffer_append(text_buf, text, text_size);
+			} else {
+				/* Remove HTML markup */
+				html2text = mail_html2text_init(0);
+				mail_html2text_more(html2text, buf->data, buf->used, text_buf);
+				mail_html2text_deinit(&html2text);
+
+				sieve_html_text_cache_add(cache, guid, body_part->index,
+					text_buf->data, text_buf->used);
+			}
 
 			result_buf = text_buf;
 		}
@@ -1006,6 +1687,10 @@ static void sieve_message_part_save
 	memcpy(part_data, result_buf->data, result_buf->used);
 	part_size = result_buf->used - 1;
 
+	sieve_resource_usage_init(&rusage);
+	rusage.body_bytes = (part_size > UINT_MAX ? UINT_MAX : part_size);
+	sieve_interpreter_add_resource_usage(renv->interp, &rusage);
+
 	/* Free text buffer if used */
 	if ( text_buf != NULL)
 		buffer_free(&text_buf);
@@ -1073,23 +1758,116 @@ _parse_content_disposition(const struct message_header_line *hdr)
 	return str_c(content_disp);
 }
 
+/* Streamed body parts are passed to a callback while the message is parsed,
+ * rather than being stored in the cache.
+ */
+
+struct sieve_message_body_stream {
+	pool_t pool;
+	const char *const *content_types;
+	bool extract_text;
+
+	sieve_message_body_stream_func_t *callback;
+	void *context;
+
+	/* Only stream the part at this position (when single_part is set) */
+	unsigned int part_index;
+	bool single_part;
+
+	struct mail_html2text *html2text;
+	buffer_t *text_buf;
+
+	/* Last result of the callback; parsing stops once it is not 0 */
+	int ret;
+};
+
+static void sieve_message_body_stream_part
+(struct sieve_message_body_stream *stream,
+	struct sieve_message_part *body_part,
+	const unsigned char *data, size_t size, bool last)
+{
+	if ( stream->ret != 0 )
+		return;
+	if ( stream->single_part && body_part->index != stream->part_index )
+		return;
+	if ( !_is_wanted_content_type
+		(stream->content_types, body_part->content_type) )
+		return;
+	if ( last && !body_part->have_body ) {
+		/* Part has no body; it does not match anything */
+		return;
+	}
+
+	/* Extract text if requested */
+	if ( stream->extract_text && !body_part->epilogue &&
+		mail_html2text_content_type_match(body_part->content_type) ) {
+		if ( stream->html2text == NULL ) {
+			stream->html2text = mail_html2text_init(0);
+			if ( stream->text_buf == NULL ) {
+				stream->text_buf =
+					buffer_create_dynamic(default_pool, 4096);
+			}
+		}
+
+		buffer_set_used_size(stream->text_buf, 0);
+		if ( size > 0 ) {
+			mail_html2text_more(stream->html2text, data, size,
+				stream->text_buf);
+		}
+		if ( last )
+			mail_html2text_deinit(&stream->html2text);
+
+		data = stream->text_buf->data;
+		size = stream->text_buf->used;
+	}
+
+	stream->ret = stream->callback
+		(stream->context, (const char *)data, size, last);
+}
+
+static void sieve_message_part_append
+(struct sieve_message_body_stream *stream, buffer_t *buf,
+	struct sieve_message_part *body_part,
+	const unsigned char *data, size_t size)
+{
+	if ( stream == NULL )
+		buffer_append(buf, data, size);
+	else
+		sieve_message_body_stream_part(stream, body_part, data, size, FALSE);
+}
+
+static void sieve_message_part_finish
+(const struct sieve_runtime_env *renv,
+	struct sieve_message_body_stream *stream, buffer_t *buf,
+	struct sieve_message_part *body_part, bool extract_text)
+{
+	if ( stream == NULL )
+		sieve_message_part_save(renv, buf, body_part, extract_text);
+	else
+		sieve_message_body_stream_part(stream, body_part, NULL, 0, TRUE);
+}
+
 /* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
+ *   Add requested message body parts to the cache that are missing. When
+ *   stream is not NULL, the parts are passed to its callback instead.
  */
 static int sieve_message_parts_add_missing
 (const struct sieve_runtime_env *renv,
 	const char *const *content_types,
-	bool extract_text, bool iter_all)
-	ATTR_NULL(2)
+	bool extract_text, bool iter_all,
+	struct sieve_message_body_stream *stream)
+	ATTR_NULL(2, 5)
 {
 	struct sieve_message_context *msgctx = renv->msgctx;
-	pool_t pool = msgctx->context_pool;
+	pool_t pool = ( stream == NULL ?
+		msgctx->analysis->pool : stream->pool );
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
 	struct message_parser_settings mparser_set = {
 		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_SKIP_INITIAL_LWSP,
 		.flags = MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS,
 	};
 	ARRAY(struct sieve_message_header) headers;
+	ARRAY_TYPE(sieve_message_part) stream_parts, *parts;
 	struct sieve_message_part *body_part, *header_part, *last_part;
 	struct message_parser_ctx *parser;
 	struct message_decoder_context *decoder;
@@ -1098,12 +1876,13 @@ static int sieve_message_parts_add_missing
 	buffer_t *buf;
 	struct istream *input;
 	unsigned int idx = 0;
-	bool save_body = FALSE, have_all;
+	size_t body_limit = 0, body_size = 0;
+	bool save_body = FALSE, body_full = FALSE, have_all;
 	string_t *hdr_content = NULL;
 
 	/* First check whether any are missing */
-	if ( !iter_all && sieve_message_body_get_return_parts
-		(renv, content_types, extract_text) ) {
+	if ( !iter_all && stream == NULL && sieve_message_body_get_return_parts
+		(renv, content_types, extract_text) != NULL ) {
 		/* Cache hit; all are present */
 		return SIEVE_EXEC_OK;
 	}
@@ -1121,6 +1900,13 @@ static int sieve_message_parts_add_missing
 	buf = buffer_create_dynamic(default_pool, 4096);
 	body_part = header_part = last_part = NULL;
 
+	if ( stream == NULL ) {
+		parts = &msgctx->analysis->body_parts;
+	} else {
+		t_array_init(&stream_parts, 8);
+		parts = &stream_parts;
+	}
+
 	if (iter_all) {
 		t_array_init(&headers, 64);
 		hdr_content = t_str_new(512);
@@ -1137,10 +1923,11 @@ static int sieve_message_parts_add_missing
 		// hparser_flags, mparser_flags);
 	parser = message_parser_init(pool_datastack_create(),
 		input, &mparser_set);
-	while ( message_parser_parse_next_block(parser, &block) > 0 ) {
+	while ( (stream == NULL || stream->ret == 0) &&
+		message_parser_parse_next_block(parser, &block) > 0 ) {
 		struct sieve_message_part **body_part_idx;
 		struct message_header_line *hdr = block.hdr;
-		struct sieve_message_header *header;
+		struct sieve_message_header *header = NULL;
 		unsigned char *data;
 
 		if ( block.part != prev_mpart ) {
@@ -1154,8 +1941,8 @@ static int sieve_message_parts_add_missing
 					message_rfc822 = TRUE;
 				} else {
 					if ( save_body ) {
-						sieve_message_part_save
-							(renv, buf, body_part, extract_text);
+						sieve_message_part_finish
+							(renv, stream, buf, body_part, extract_text);
 					}
 				}
 				if ( iter_all && !array_is_created(&body_part->headers) &&
@@ -1167,11 +1954,11 @@ static int sieve_message_parts_add_missing
 			}
 
 			/* Start processing next part */
-			body_part_idx = array_idx_get_space
-				(&msgctx->cached_body_parts, idx);
+			body_part_idx = array_idx_get_space(parts, idx);
 			if ( *body_part_idx == NULL )
 				*body_part_idx = p_new(pool, struct sieve_message_part, 1);
 			body_part = *body_part_idx;
+			body_part->index = idx;
 			body_part->content_type = "text/plain";
 			if ( iter_all )
 				array_clear(&headers);
@@ -1186,8 +1973,12 @@ static int sieve_message_parts_add_missing
 				body_part->content_type = epipart->content_type;
 				body_part->have_body = TRUE;
 				body_part->epilogue = TRUE;
-				save_body = iter_all || _is_wanted_content_type
+				save_body = _is_wanted_content_type
 					(content_types, body_part->content_type);
+				body_limit = sieve_max_body_part_size
+					(msgctx->svinst, body_part->content_type);
+				body_size = 0;
+				body_full = FALSE;
 
 			} else {
 				struct sieve_message_part *parent = NULL;
@@ -1223,8 +2014,7 @@ static int sieve_message_parts_add_missing
 			 */
 			if ( message_rfc822 ) {
 				i_assert(idx > 0);
-				body_part_idx = array_idx_modifiable
-					(&msgctx->cached_body_parts, idx-1);
+				body_part_idx = array_idx_modifiable(parts, idx-1);
 				header_part = *body_part_idx;
 			} else {
 				header_part = NULL;
@@ -1252,14 +2042,20 @@ static int sieve_message_parts_add_missing
 			if ( hdr == NULL ) {
 				/* Save headers for message/rfc822 part */
 				if ( header_part != NULL ) {
-					sieve_message_part_save
-						(renv, buf, header_part, FALSE);
+					sieve_message_part_finish
+						(renv, stream, buf, header_part, FALSE);
 					header_part = NULL;
 				}
 
 				/* Save bodies only if we have a wanted content-type */
-				save_body = iter_all || _is_wanted_content_type
+				save_body = _is_wanted_content_type
 					(content_types, body_part->content_type);
+				if ( save_body ) {
+					body_limit = sieve_max_body_part_size
+						(msgctx->svinst, body_part->content_type);
+					body_size = 0;
+					body_full = FALSE;
+				}
 				continue;
 			}
 
@@ -1272,14 +2068,19 @@ static int sieve_message_parts_add_missing
 			} else if ( header_part != NULL ) {
 				/* Save message/rfc822 header as part content */
 				if ( hdr->continued ) {
-					buffer_append(buf, hdr->value, hdr->value_len);
+					sieve_message_part_append(stream, buf, header_part,
+						hdr->value, hdr->value_len);
 				} else {
-					buffer_append(buf, hdr->name, hdr->name_len);
-					buffer_append(buf, hdr->middle, hdr->middle_len);
-					buffer_append(buf, hdr->value, hdr->value_len);
+					sieve_message_part_append(stream, buf, header_part,
+						(const unsigned char *)hdr->name, hdr->name_len);
+					sieve_message_part_append(stream, buf, header_part,
+						hdr->middle, hdr->middle_len);
+					sieve_message_part_append(stream, buf, header_part,
+						hdr->value, hdr->value_len);
 				}
 				if ( !hdr->no_newline ) {
-					buffer_append(buf, "\r\n", 2);
+					sieve_message_part_append(stream, buf, header_part,
+						(const unsigned char *)"\r\n", 2);
 				}
 			}
 
@@ -1309,6 +2110,7 @@ static int sieve_message_parts_add_missing
 				/* Add header */
 				header = array_append_space(&headers);
 				header->name = p_strdup(pool, hdr->name);
+				header->name_hash = strcase_hash(hdr->name);
 
 				/* Trim end of field value (not done by parser) */
 				value = hdr->full_value;
@@ -1359,10 +2161,14 @@ static int sieve_message_parts_add_missing
 				case _HDR_CONTENT_TYPE:
 					body_part->content_type =
 						p_strdup(pool, _parse_content_type(block.hdr));
+					if ( header != NULL )
+						header->content = body_part->content_type;
 					break;
 				case _HDR_CONTENT_DISPOSITION:
 					body_part->content_disposition =
 						p_strdup(pool, _parse_content_disposition(block.hdr));
+					if ( header != NULL )
+						header->content = body_part->content_disposition;
 					break;
 				default:
 					i_unreached();
@@ -1372,11 +2178,26 @@ static int sieve_message_parts_add_missing
 			continue;
 		}
 
-		/* Reading body */
-		if ( save_body ) {
+		/* Reading body; once the configured limit is reached, the rest of
+		   the part is not decoded at all */
+		if ( save_body && !body_full ) {
+			size_t size;
+
 			(void)message_decoder_decode_next_block
 					(decoder, &block, &decoded);
-			buffer_append(buf, decoded.data, decoded.size);
+			size = decoded.size;
+			if ( body_limit > 0 && size > body_limit - body_size ) {
+				/* Don't cut a character in half */
+				size = uni_utf8_data_truncate
+					(decoded.data, size, body_limit - body_size);
+				body_full = TRUE;
+				e_debug(renv->event, "Body part with content type `%s' "
+					"truncated to %"PRIuSIZE_T" bytes",
+					str_sanitize(body_part->content_type, 80), body_limit);
+			}
+			sieve_message_part_append
+				(stream, buf, body_part, decoded.data, size);
+			body_size += size;
 		}
 	}
 
@@ -1386,11 +2207,11 @@ static int sieve_message_parts_add_missing
 
 	/* Save last body part if necessary */
 	if ( header_part != NULL ) {
-		sieve_message_part_save
-			(renv, buf, header_part, FALSE);
+		sieve_message_part_finish
+			(renv, stream, buf, header_part, FALSE);
 	} else if ( save_body ) {
-		sieve_message_part_save
-			(renv, buf, body_part, extract_text);
+		sieve_message_part_finish
+			(renv, stream, buf, body_part, extract_text);
 	}
 	if ( iter_all && !array_is_created(&body_part->headers) &&
 		array_count(&headers) > 0 ) {
@@ -1399,9 +2220,10 @@ static int sieve_message_parts_add_missing
 			&headers.arr, 0, array_count(&headers));
 	}
 
-	/* Try to fill the return_body_parts array once more */
-	have_all = iter_all || sieve_message_body_get_return_parts
-		(renv, content_types, extract_text);
+	/* Try to assemble the returned body parts once more */
+	have_all = iter_all || stream != NULL ||
+		sieve_message_body_get_return_parts
+			(renv, content_types, extract_text) != NULL;
 
 	/* This time, failure is a bug */
 	i_assert(have_all);
@@ -1428,13 +2250,12 @@ int sieve_message_body_get_content
 	const char * const *content_types,
 	struct sieve_message_part_data **parts_r)
 {
-	struct sieve_message_context *msgctx = renv->msgctx;
 	int status;
 
 	T_BEGIN {
-		/* Fill the return_body_parts array */
+		/* Read the missing body parts */
 		status = sieve_message_parts_add_missing
-			(renv, content_types, FALSE, FALSE);
+			(renv, content_types, FALSE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1442,8 +2263,9 @@ int sieve_message_body_get_content
 		return status;
 
 	/* Return the array of body items */
-	(void) array_append_space(&msgctx->return_body_parts); /* NULL-terminate */
-	*parts_r = array_idx_modifiable(&msgctx->return_body_parts, 0);
+	*parts_r = sieve_message_body_get_return_parts
+		(renv, content_types, FALSE);
+	i_assert(*parts_r != NULL);
 
 	return status;
 }
@@ -1452,9 +2274,6 @@ int sieve_message_body_get_text
 (const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data **parts_r)
 {
-	static const char * const _text_content_types[] =
-		{ "application/xhtml+xml", "text", NULL };
-	struct sieve_message_context *msgctx = renv->msgctx;
 	int status;
 
 	/* We currently only support extracting plain text from:
@@ -1466,9 +2285,9 @@ int sieve_message_body_get_text
 	 */
 
 	T_BEGIN {
-		/* Fill the return_body_parts array */
+		/* Read the missing body parts */
 		status = sieve_message_parts_add_missing
-			(renv, _text_content_types, TRUE, FALSE);
+			(renv, sieve_message_text_content_types, TRUE, FALSE, NULL);
 	} T_END;
 
 	/* Check status */
@@ -1476,12 +2295,110 @@ int sieve_message_body_get_text
 		return status;
 
 	/* Return the array of body items */
-	(void) array_append_space(&msgctx->return_body_parts); /* NULL-terminate */
-	*parts_r = array_idx_modifiable(&msgctx->return_body_parts, 0);
+	*parts_r = sieve_message_body_get_return_parts
+		(renv, sieve_message_text_content_types, TRUE);
+	i_assert(*parts_r != NULL);
+
+	return status;
+}
+
+static int sieve_message_body_stream_run
+(const struct sieve_runtime_env *renv,
+	struct sieve_message_body_stream *stream)
+{
+	int status;
+
+	stream->pool = pool_alloconly_create("sieve_message_body_stream", 4096);
+
+	T_BEGIN {
+		status = sieve_message_parts_add_missing
+			(renv, stream->content_types, stream->extract_text, FALSE,
+				stream);
+	} T_END;
 
+	if ( stream->html2text != NULL )
+		mail_html2text_deinit(&stream->html2text);
+	if ( stream->text_buf != NULL )
+		buffer_free(&stream->text_buf);
+	pool_unref(&stream->pool);
+
+	if ( status > 0 && stream->ret < 0 )
+		return SIEVE_EXEC_FAILURE;
 	return status;
 }
 
+int sieve_message_body_stream
+(const struct sieve_runtime_env *renv,
+	const char * const *content_types, bool extract_text,
+	sieve_message_body_stream_func_t *callback, void *context)
+{
+	static const char * const _no_content_types[] = { "", NULL };
+	struct sieve_message_body_stream stream;
+	const struct sieve_message_part_data *part;
+
+	if ( extract_text )
+		content_types = sieve_message_text_content_types;
+	else if ( content_types == NULL )
+		content_types = _no_content_types;
+
+	/* Use the cached body parts if these are all present already */
+	part = sieve_message_body_get_return_parts
+		(renv, content_types, extract_text);
+	if ( part != NULL ) {
+		int ret = 0;
+
+		for (; part->content != NULL; part++) {
+			ret = callback(context, part->content, part->size, TRUE);
+			if ( ret != 0 )
+				break;
+		}
+		return ( ret < 0 ? SIEVE_EXEC_FAILURE : SIEVE_EXEC_OK );
+	}
+
+	i_zero(&stream);
+	stream.content_types = content_types;
+	stream.extract_text = extract_text;
+	stream.callback = callback;
+	stream.context = context;
+
+	return sieve_message_body_stream_run(renv, &stream);
+}
+
+int sieve_message_part_stream_data
+(const struct sieve_runtime_env *renv, struct sieve_message_part *mpart,
+	bool text, sieve_message_body_stream_func_t *callback, void *context)
+{
+	struct sieve_message_body_stream stream;
+	struct sieve_message_part_data data;
+	const char *content_types[2];
+
+	if ( (text && mpart->children != NULL) || !mpart->have_body ||
+		(text ? mpart->text_body != NULL : mpart->decoded_body != NULL) ) {
+		/* Content is available already (or there is none) */
+		sieve_message_part_get_data(mpart, &data, text);
+		if ( data.content == NULL ) {
+			data.content = "";
+			data.size = 0;
+		}
+		if ( callback(context, data.content, data.size, TRUE) < 0 )
+			return SIEVE_EXEC_FAILURE;
+		return SIEVE_EXEC_OK;
+	}
+
+	content_types[0] = mpart->content_type;
+	content_types[1] = NULL;
+
+	i_zero(&stream);
+	stream.content_types = content_types;
+	stream.extract_text = text;
+	stream.callback = callback;
+	stream.context = context;
+	stream.part_index = mpart->index;
+	stream.single_part = TRUE;
+
+	return sieve_message_body_stream_run(renv, &stream);
+}
+
 int sieve_message_body_get_raw
 (const struct sieve_runtime_env *renv,
 	struct sieve_message_part_data **parts_r)
@@ -1533,28 +2450,85 @@ int sieve_message_body_get_raw
 		buf = msgctx->raw_body;
 	}
 
-	/* Clear result array */
-	array_clear(&msgctx->return_body_parts);
+	/* Assemble the result once */
+	if ( msgctx->raw_body_parts == NULL ) {
+		msgctx->raw_body_parts = return_part = p_new(msgctx->context_pool,
+			struct sieve_message_part_data, 2);
 
-	if ( buf->used > 1  ) {
-		const char *data = (const char *)buf->data;
-		size_t size = buf->used - 1;
+		if ( buf->used > 1  ) {
+			const char *data = (const char *)buf->data;
+			size_t size = buf->used - 1;
 
-		i_assert( data[size] == '\0' );
+			i_assert( data[size] == '\0' );
 
-		/* Add single item to the result */
-		return_part = array_append_space(&msgctx->return_body_parts);
-		return_part->content = data;
-		return_part->size = size;
+			/* Add single item to the result */
+			return_part->content = data;
+			return_part->size = size;
+		}
 	}
 
 	/* Return the array of body items */
-	(void) array_append_space(&msgctx->return_body_parts); /* NULL-terminate */
-	*parts_r = array_idx_modifiable(&msgctx->return_body_parts, 0);
+	*parts_r = msgctx->raw_body_parts;
 
 	return SIEVE_EXEC_OK;
 }
 
+int sieve_message_body_stream_raw
+(const struct sieve_runtime_env *renv,
+	sieve_message_body_stream_func_t *callback, void *context)
+{
+	struct sieve_message_context *msgctx = renv->msgctx;
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+	const unsigned char *data;
+	size_t size;
+	bool empty = TRUE;
+	int ret, cret = 0;
+
+	/* Use the raw body if it was read before */
+	if ( msgctx->raw_body != NULL ) {
+		if ( msgctx->raw_body->used <= 1 )
+			return SIEVE_EXEC_OK;
+		cret = callback(context, msgctx->raw_body->data,
+			msgctx->raw_body->used - 1, TRUE);
+		return ( cret < 0 ? SIEVE_EXEC_FAILURE : SIEVE_EXEC_OK );
+	}
+
+	/* Get stream for message */
+	if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
+		return sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+	}
+
+	/* Skip stream to beginning of body */
+	i_stream_seek(input, hdr_size.physical_size);
+
+	/* Pass the body as it is read; the stream's buffer is used directly */
+	while ( (ret=i_stream_read_more(input, &data, &size)) > 0 ) {
+		empty = FALSE;
+		cret = callback(context, (const char *)data, size, FALSE);
+		if ( cret != 0 )
+			break;
+		i_stream_skip(input, size);
+	}
+
+	if ( cret == 0 && ret < 0 && input->stream_errno != 0 ) {
+		sieve_runtime_critical(renv, NULL,
+			"failed to read input message",
+			"read(%s) failed: %s",
+			i_stream_get_name(input),
+			i_stream_get_error(input));
+		return SIEVE_EXEC_TEMP_FAILURE;
+	}
+
+	/* An empty body yields no value at all (as with
+	   sieve_message_body_get_raw()) */
+	if ( cret == 0 && !empty )
+		cret = callback(context, "", 0, TRUE);
+	return ( cret < 0 ? SIEVE_EXEC_FAILURE : SIEVE_EXEC_OK );
+}
+
 /*
  * Message part iterator
  */
@@ -1568,22 +2542,27 @@ int sieve_message_part_iter_init
 	unsigned int count;
 	int status;
 
-	T_BEGIN {
-		/* Fill the return_body_parts array */
-		status = sieve_message_parts_add_missing
-			(renv, NULL, TRUE, TRUE);
-	} T_END;
-
-	/* Check status */
-	if ( status <= 0 )
-		return status;
+	/* Only the part structure and headers are read here; part bodies are
+	   read once these are actually needed (see
+	   sieve_message_part_read_data()). */
+	if ( !msgctx->analysis->have_part_headers ) {
+		T_BEGIN {
+			status = sieve_message_parts_add_missing
+				(renv, sieve_message_no_content_types, FALSE, TRUE, NULL);
+		} T_END;
+
+		/* Check status */
+		if ( status <= 0 )
+			return status;
+		msgctx->analysis->have_part_headers = TRUE;
+	}
 
 	i_zero(iter);
 	iter->renv = renv;
 	iter->index = 0;
 	iter->offset = 0;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->analysis->body_parts, &count);
 	if (count == 0)
 		iter->root = NULL;
 	else
@@ -1602,7 +2581,7 @@ void sieve_message_part_iter_subtree(struct sieve_message_part_iter *iter,
 
 	*subtree = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->analysis->body_parts, &count);
 	if ( subtree->index >= count)
 		subtree->root = NULL;
 	else
@@ -1620,7 +2599,7 @@ void sieve_message_part_iter_children(struct sieve_message_part_iter *iter,
 
 	*child = *iter;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);	
+	parts = array_get(&msgctx->analysis->body_parts, &count);	
 	if ( (child->index+1) >= count || parts[child->index]->children == NULL)
 		child->root = NULL;
 	else
@@ -1639,7 +2618,7 @@ struct sieve_message_part *sieve_message_part_iter_current
 	if ( iter->root == NULL )
 		return NULL;
 
-	parts = array_get(&msgctx->cached_body_parts, &count);
+	parts = array_get(&msgctx->analysis->body_parts, &count);
 	if ( iter->index >= count )
 		return NULL;
 	do {
@@ -1659,7 +2638,7 @@ struct sieve_message_part *sieve_message_part_iter_next
 	const struct sieve_runtime_env *renv = iter->renv;
 	struct sieve_message_context *msgctx = renv->msgctx;
 
-	if ( iter->index >= array_count(&msgctx->cached_body_parts) )
+	if ( iter->index >= array_count(&msgctx->analysis->body_parts) )
 		return NULL;
 	iter->index++;
 
@@ -1681,6 +2660,9 @@ void sieve_message_part_iter_reset
 static int sieve_mime_header_list_next_item
 	(struct sieve_header_list *_hdrlist, const char **name_r,
 		string_t **value_r);
+static int sieve_mime_header_list_next_item_content
+	(struct sieve_header_list *_hdrlist, const char **name_r,
+		string_t **value_r, const char **content_r);
 static int sieve_mime_header_list_next_value
 	(struct sieve_stringlist *_strlist, string_t **value_r);
 static void sieve_mime_header_list_reset
@@ -1696,6 +2678,7 @@ struct sieve_mime_header_list {
 	struct sieve_message_part_iter part_iter;
 
 	const char *header_name;
+	unsigned int header_hash;
 	const struct sieve_message_header *headers;
 	unsigned int headers_index, headers_count;
 
@@ -1717,6 +2700,8 @@ struct sieve_header_list *sieve_mime_header_list_create
 	hdrlist->hdrlist.strlist.next_item = sieve_mime_header_list_next_value;
 	hdrlist->hdrlist.strlist.reset = sieve_mime_header_list_reset;
 	hdrlist->hdrlist.next_item = sieve_mime_header_list_next_item;
+	hdrlist->hdrlist.next_item_content =
+		sieve_mime_header_list_next_item_content;
 	hdrlist->field_names = field_names;
 	hdrlist->mime_decode = mime_decode;
 	hdrlist->children = children;
@@ -1743,9 +2728,9 @@ static void sieve_mime_header_list_next_name
 	}
 }
 
-static int sieve_mime_header_list_next_item
+static int sieve_mime_header_list_next_item_content
 (struct sieve_header_list *_hdrlist, const char **name_r,
-	string_t **value_r)
+	string_t **value_r, const char **content_r)
 {
 	struct sieve_mime_header_list *hdrlist =
 		(struct sieve_mime_header_list *) _hdrlist;
@@ -1754,6 +2739,7 @@ static int sieve_mime_header_list_next_item
 	if ( name_r != NULL )
 		*name_r = NULL;
 	*value_r = NULL;
+	*content_r = NULL;
 
 	for (;;) {
 		/* Check for end of current header list */
@@ -1793,6 +2779,7 @@ static int sieve_mime_header_list_next_item
 				return ret;
 
 			hdrlist->header_name = str_c(hdr_item);
+			hdrlist->header_hash = strcase_hash(hdrlist->header_name);
 
 			if ( _hdrlist->strlist.trace ) {
 				sieve_runtime_trace(renv, 0,
@@ -1808,7 +2795,8 @@ static int sieve_mime_header_list_next_item
 			const struct sieve_message_header *header =
 				&hdrlist->headers[hdrlist->headers_index];
 
-			if ( strcasecmp(header->name, hdrlist->header_name) == 0 ) {
+			if ( header->name_hash == hdrlist->header_hash &&
+				strcasecmp(header->name, hdrlist->header_name) == 0 ) {
 				if ( name_r != NULL )
 					*name_r = hdrlist->header_name;
 				if ( hdrlist->mime_decode ) {
@@ -1818,6 +2806,10 @@ static int sieve_mime_header_list_next_item
 					*value_r = t_str_new_const
 						((const char *)header->value, header->value_len);
 				}
+				/* The parsed content was obtained from the raw value */
+				if ( !hdrlist->mime_decode ||
+					header->utf8_value == header->value )
+					*content_r = header->content;
 				hdrlist->headers_index++;
 				return 1;
 			}
@@ -1828,6 +2820,16 @@ static int sieve_mime_header_list_next_item
 	return -1;
 }
 
+static int sieve_mime_header_list_next_item
+(struct sieve_header_list *_hdrlist, const char **name_r,
+	string_t **value_r)
+{
+	const char *content;
+
+	return sieve_mime_header_list_next_item_content
+		(_hdrlist, name_r, value_r, &content);
+}
+
 static int sieve_mime_header_list_next_value
 (struct sieve_stringlist *_strlist, string_t **value_r)
 {
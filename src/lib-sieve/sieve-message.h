@@ -11,6 +11,21 @@
 
 const char *sieve_message_get_new_id(const struct sieve_instance *svinst);
 
+/*
+ * Message analysis
+ */
+
+/* Parsed message data that depends only on the message: the header index,
+   parsed address lists and the MIME part structure with decoded and text
+   bodies. One analysis can be shared by the message contexts of several
+   executions for the same message, e.g. for all recipients of an LMTP
+   transaction. It is only used while the message is unmodified. */
+struct sieve_message_analysis;
+
+struct sieve_message_analysis *sieve_message_analysis_create(void);
+void sieve_message_analysis_ref(struct sieve_message_analysis *analysis);
+void sieve_message_analysis_unref(struct sieve_message_analysis **_analysis);
+
 /*
  * Message context
  */
@@ -24,6 +39,9 @@ void sieve_message_context_ref(struct sieve_message_context *msgctx);
 void sieve_message_context_unref(struct sieve_message_context **msgctx);
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx);
+/* Use the given (shared) analysis for the original message */
+void sieve_message_context_set_analysis(struct sieve_message_context *msgctx,
+					struct sieve_message_analysis *analysis);
 
 pool_t sieve_message_context_pool
 	(struct sieve_message_context *msgctx) ATTR_PURE;
@@ -55,8 +73,33 @@ struct mail *sieve_message_get_mail
 
 int sieve_message_substitute
 	(struct sieve_message_context *msgctx, struct istream *input);
+/* Releases the raw storage user shared by substituted messages */
+void sieve_message_raw_user_free(struct sieve_instance *svinst);
+/* Tells the mail storage which header fields are going to be accessed, so
+   that these are all parsed in a single pass over the message header. */
+void sieve_message_prefetch_headers
+	(struct sieve_message_context *msgctx, const char *const *headers,
+		unsigned int count);
+/* Same for the message fields (e.g. the size) that are going to be accessed */
+void sieve_message_prefetch_fields
+	(struct sieve_message_context *msgctx,
+		enum sieve_message_fields fields);
 struct edit_mail *sieve_message_edit
 	(struct sieve_message_context *msgctx);
+
+/* Mailbox list
+
+   The user's private mailboxes are listed once per message context. These
+   return 1 when the mailbox (or a mailbox with the special-use flag) is
+   listed, 0 when it is not and -1 when the list cannot answer the question,
+   in which case the caller needs to open the mailbox itself.
+ */
+int sieve_message_mailbox_exists
+	(struct sieve_message_context *msgctx, const char *mailbox);
+int sieve_message_mailbox_special_use_exists
+	(struct sieve_message_context *msgctx, const char *special_use);
+void sieve_message_mailbox_created
+	(struct sieve_message_context *msgctx, const char *mailbox);
 void sieve_message_snapshot
 	(struct sieve_message_context *msgctx);
 
@@ -70,6 +113,12 @@ struct sieve_header_list {
 	int (*next_item)
 		(struct sieve_header_list *_hdrlist, const char **name_r,
 			string_t **value_r) ATTR_NULL(2);
+	/* Optional: same as next_item(), but also returns the value of
+	   Content-Type and Content-Disposition headers as it was already parsed
+	   for the message part (NULL when not available) */
+	int (*next_item_content)
+		(struct sieve_header_list *_hdrlist, const char **name_r,
+			string_t **value_r, const char **content_r) ATTR_NULL(2);
 };
 
 static inline int sieve_header_list_next_item
@@ -79,6 +128,17 @@ static inline int sieve_header_list_next_item
 	return hdrlist->next_item(hdrlist, name_r, value_r);
 }
 
+static inline int sieve_header_list_next_item_content
+(struct sieve_header_list *hdrlist, const char **name_r,
+	string_t **value_r, const char **content_r) ATTR_NULL(2)
+{
+	if ( hdrlist->next_item_content == NULL ) {
+		*content_r = NULL;
+		return hdrlist->next_item(hdrlist, name_r, value_r);
+	}
+	return hdrlist->next_item_content(hdrlist, name_r, value_r, content_r);
+}
+
 static inline void sieve_header_list_reset
 (struct sieve_header_list *hdrlist)
 {
@@ -191,6 +251,23 @@ int sieve_message_get_header_fields
 		struct sieve_stringlist *field_names,
 		ARRAY_TYPE(sieve_message_override) *svmos,
 		bool mime_decode, struct sieve_stringlist **fields_r);
+/* Checks whether the header field exists in the current message version,
+   without fetching and decoding all of its values. */
+int sieve_message_header_exists
+	(const struct sieve_runtime_env *renv, const char *field_name,
+		bool *exists_r);
+
+/*
+ * Parsed address lists
+ */
+
+struct message_address;
+
+/* Returns the RFC 2822 address list parsed from the header field value. Each
+   distinct value is parsed only once for the current message, so that tests
+   on the same address header share the result. */
+const struct message_address *sieve_message_parse_address_list
+	(struct sieve_message_context *msgctx, const char *value, size_t size);
 
 /*
  * Message part
@@ -225,6 +302,11 @@ int sieve_message_part_get_first_header
 void sieve_message_part_get_data
 	(struct sieve_message_part *mpart,
 		struct sieve_message_part_data *data, bool text);
+/* Same as sieve_message_part_get_data(), but reads the body of the part from
+   the message first when it is not available yet. */
+int sieve_message_part_read_data
+	(const struct sieve_runtime_env *renv, struct sieve_message_part *mpart,
+		struct sieve_message_part_data *data, bool text);
 
 /*
  * Message body
@@ -237,9 +319,33 @@ int sieve_message_body_get_content
 int sieve_message_body_get_text
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
+/* Passes the content of the requested body parts to the callback in chunks
+   while the message is parsed, without keeping the decoded parts in memory.
+   The callback returns 0 to continue, 1 to stop and -1 to stop with an
+   error. With extract_text, the text body parts are passed (like for
+   sieve_message_body_get_text()). */
+typedef int sieve_message_body_stream_func_t
+	(void *context, const char *data, size_t size, bool last);
+
+int sieve_message_body_stream
+	(const struct sieve_runtime_env *renv,
+		const char * const *content_types, bool extract_text,
+		sieve_message_body_stream_func_t *callback, void *context)
+		ATTR_NULL(2);
+/* Streams the content of a single message part in the same way. Decoding
+   stops as soon as the callback returns non-zero. */
+int sieve_message_part_stream_data
+	(const struct sieve_runtime_env *renv, struct sieve_message_part *mpart,
+		bool text, sieve_message_body_stream_func_t *callback,
+		void *context);
 int sieve_message_body_get_raw
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
+/* Streams the raw message body directly from the message's input stream,
+   without copying it into memory first. */
+int sieve_message_body_stream_raw
+	(const struct sieve_runtime_env *renv,
+		sieve_message_body_stream_func_t *callback, void *context);
 
 /*
  * Message part iterator
@@ -0,0 +1,685 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+
+#include "sieve-common.h"
+#include "sieve-ast.h"
+#include "sieve-commands.h"
+#include "sieve-comparators.h"
+#include "sieve-match-types.h"
+
+#include "sieve-optimizer.h"
+
+/*
+ * Profile
+ */
+
+struct sieve_optimizer_profile {
+	/* Number of operations executed per script line */
+	ARRAY(uint64_t) line_counts;
+};
+
+static bool
+sieve_optimizer_profile_parse_line(const char *line, unsigned int *line_r,
+				   unsigned int *count_r)
+{
+	const char *const *args = t_strsplit_spaces(line, " ");
+	const char *p;
+
+	/* <line>: <count> <wall> us <cpu> us */
+	if (str_array_length(args) < 2)
+		return FALSE;
+	p = strchr(args[0], ':');
+	if (p == NULL || p[1] != '\0')
+		return FALSE;
+	return (str_to_uint(t_strdup_until(args[0], p), line_r) >= 0 &&
+		str_to_uint(args[1], count_r) >= 0);
+}
+
+int sieve_optimizer_profile_read(const char *path,
+				 struct sieve_optimizer_profile **profile_r,
+				 const char **error_r)
+{
+	struct sieve_optimizer_profile *profile;
+	struct istream *input;
+	const char *line;
+	unsigned int reports = 0, line_num, count;
+	bool in_report = FALSE;
+	int ret = 0;
+
+	*profile_r = NULL;
+
+	profile = i_new(struct sieve_optimizer_profile, 1);
+	i_array_init(&profile->line_counts, 256);
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (str_begins_with(line, "## Profile for script ")) {
+			in_report = TRUE;
+			reports++;
+			continue;
+		}
+		if (!in_report)
+			continue;
+
+		T_BEGIN {
+			if (!sieve_optimizer_profile_parse_line(
+				line, &line_num, &count)) {
+				/* End of the report */
+				in_report = FALSE;
+			} else {
+				*array_idx_get_space(&profile->line_counts,
+						     line_num) += count;
+			}
+		} T_END;
+	}
+	if (input->stream_errno != 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %s", path,
+					   i_stream_get_error(input));
+		ret = -1;
+	} else if (reports == 0) {
+		*error_r = t_strdup_printf("%s contains no profile report",
+					   path);
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+
+	if (ret < 0) {
+		sieve_optimizer_profile_free(&profile);
+		return -1;
+	}
+	*profile_r = profile;
+	return 0;
+}
+
+void sieve_optimizer_profile_free(struct sieve_optimizer_profile **_profile)
+{
+	struct sieve_optimizer_profile *profile = *_profile;
+
+	if (profile == NULL)
+		return;
+	*_profile = NULL;
+
+	array_free(&profile->line_counts);
+	i_free(profile);
+}
+
+static uint64_t
+sieve_optimizer_profile_count(const struct sieve_optimizer_profile *profile,
+			      unsigned int line)
+{
+	const uint64_t *count;
+
+	if (line >= array_count(&profile->line_counts))
+		return 0;
+	count = array_idx(&profile->line_counts, line);
+	return *count;
+}
+
+/*
+ * Argument inspection
+ */
+
+static bool
+sieve_optimizer_literal_list(struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *item;
+
+	switch (sieve_ast_argument_type(arg)) {
+	case SAAT_STRING:
+		return sieve_argument_is_string_literal(arg);
+	case SAAT_STRING_LIST:
+		item = sieve_ast_strlist_first(arg);
+		for (; item != NULL; item = sieve_ast_strlist_next(item)) {
+			if (!sieve_argument_is_string_literal(item))
+				return FALSE;
+		}
+		return TRUE;
+	default:
+		break;
+	}
+	return FALSE;
+}
+
+static const string_t *
+sieve_optimizer_list_item(struct sieve_ast_argument *arg, unsigned int index)
+{
+	struct sieve_ast_argument *item;
+
+	if (sieve_ast_argument_type(arg) == SAAT_STRING)
+		return (index == 0 ? sieve_ast_argument_str(arg) : NULL);
+
+	item = sieve_ast_strlist_first(arg);
+	for (; item != NULL && index > 0; index--)
+		item = sieve_ast_strlist_next(item);
+	return (item == NULL ? NULL : sieve_ast_argument_str(item));
+}
+
+bool sieve_optimizer_header_lists_equal(struct sieve_ast_argument *arg1,
+					struct sieve_ast_argument *arg2)
+{
+	const string_t *str1, *str2;
+	unsigned int i;
+
+	for (i = 0;; i++) {
+		str1 = sieve_optimizer_list_item(arg1, i);
+		str2 = sieve_optimizer_list_item(arg2, i);
+		if (str1 == NULL || str2 == NULL)
+			return (str1 == str2);
+		/* Header field names are case-insensitive */
+		if (strcasecmp(str_c((string_t *)str1),
+			       str_c((string_t *)str2)) != 0)
+			return FALSE;
+	}
+}
+
+struct sieve_optimizer_match {
+	const struct sieve_comparator_def *cmp_def;
+	const struct sieve_match_type_def *mcht_def;
+};
+
+static bool
+sieve_optimizer_get_match(struct sieve_command *tst,
+			  struct sieve_optimizer_match *match_r)
+{
+	struct sieve_ast_argument *arg = sieve_ast_argument_first(tst->ast_node);
+
+	i_zero(match_r);
+	for (; arg != NULL && arg != tst->first_positional;
+	     arg = sieve_ast_argument_next(arg)) {
+		if (sieve_argument_is_comparator(arg)) {
+			match_r->cmp_def = sieve_comparator_tag_get(arg)->def;
+		} else if (sieve_argument_is_match_type(arg)) {
+			const struct sieve_match_type_context *mtctx =
+				arg->argument->data;
+
+			match_r->mcht_def = mtctx->match_type->def;
+		} else {
+			/* Any other tag is not understood here */
+			return FALSE;
+		}
+	}
+	if (match_r->cmp_def == NULL)
+		match_r->cmp_def = &i_ascii_casemap_comparator;
+	if (match_r->mcht_def == NULL)
+		match_r->mcht_def = &is_match_type;
+	return TRUE;
+}
+
+bool sieve_optimizer_header_is_literal(struct sieve_command *tst,
+				       struct sieve_ast_argument **hdrs_r,
+				       struct sieve_ast_argument **keys_r)
+{
+	struct sieve_optimizer_match match;
+	struct sieve_ast_argument *hdrs, *keys;
+
+	if (!sieve_command_is(tst, tst_header))
+		return FALSE;
+	if (!sieve_optimizer_get_match(tst, &match) ||
+	    match.mcht_def != &is_match_type ||
+	    match.cmp_def != &i_ascii_casemap_comparator)
+		return FALSE;
+
+	hdrs = tst->first_positional;
+	if (hdrs == NULL)
+		return FALSE;
+	keys = sieve_ast_argument_next(hdrs);
+	if (keys == NULL || sieve_ast_argument_next(keys) != NULL)
+		return FALSE;
+	if (!sieve_optimizer_literal_list(hdrs) ||
+	    !sieve_optimizer_literal_list(keys))
+		return FALSE;
+
+	*hdrs_r = hdrs;
+	*keys_r = keys;
+	return TRUE;
+}
+
+/*
+ * Test merging
+ */
+
+/* anyof(header :is "X" "a", header :is "X" "b") is equivalent to
+   header :is "X" ["a", "b"] */
+static bool
+sieve_optimizer_merge_header(struct sieve_command *tst1,
+			     struct sieve_command *tst2)
+{
+	struct sieve_optimizer_match match1, match2;
+	struct sieve_ast_argument *hdrs1, *hdrs2, *keys1, *keys2;
+
+	if (!sieve_command_is(tst1, tst_header) ||
+	    !sieve_command_is(tst2, tst_header))
+		return FALSE;
+	if (!sieve_optimizer_get_match(tst1, &match1) ||
+	    !sieve_optimizer_get_match(tst2, &match2))
+		return FALSE;
+	if (match1.mcht_def != &is_match_type ||
+	    match2.mcht_def != &is_match_type ||
+	    match1.cmp_def != match2.cmp_def)
+		return FALSE;
+
+	hdrs1 = tst1->first_positional;
+	hdrs2 = tst2->first_positional;
+	if (hdrs1 == NULL || hdrs2 == NULL)
+		return FALSE;
+	keys1 = sieve_ast_argument_next(hdrs1);
+	keys2 = sieve_ast_argument_next(hdrs2);
+	if (keys1 == NULL || keys2 == NULL ||
+	    sieve_ast_argument_next(keys1) != NULL ||
+	    sieve_ast_argument_next(keys2) != NULL)
+		return FALSE;
+
+	if (!sieve_optimizer_literal_list(hdrs1) ||
+	    !sieve_optimizer_literal_list(hdrs2) ||
+	    !sieve_optimizer_literal_list(keys1) ||
+	    !sieve_optimizer_literal_list(keys2))
+		return FALSE;
+	if (!sieve_optimizer_header_lists_equal(hdrs1, hdrs2))
+		return FALSE;
+
+	keys1 = sieve_ast_stringlist_join(keys1, keys2);
+	if (keys1 == NULL)
+		return FALSE;
+
+	/* Joining two strings creates a new list argument */
+	keys1 = sieve_ast_argument_next(hdrs1);
+	if (keys1->argument == NULL) {
+		keys1->argument = sieve_argument_create(
+			keys1->ast, &string_list_argument, NULL, 0);
+	}
+	tst1->recipient_independent =
+		tst1->recipient_independent && tst2->recipient_independent;
+	return TRUE;
+}
+
+/*
+ * Test ordering
+ */
+
+/* Rough evaluation cost of tests without side effects. Subtests of anyof and
+   allof are evaluated cheapest first, so that e.g. a header test can decide
+   the outcome before the body is decoded. */
+static const struct {
+	const char *identifier;
+	int cost;
+} sieve_optimizer_test_costs[] = {
+	{ "true", 0 },
+	{ "false", 0 },
+	{ "envelope", 1 },
+	{ "exists", 2 },
+	{ "header", 2 },
+	{ "size", 2 },
+	{ "address", 3 },
+	{ "body", 4 },
+};
+
+/* Returns -1 when the test must not be moved */
+static int sieve_optimizer_test_cost(struct sieve_ast_node *test)
+{
+	struct sieve_command *tst = test->command;
+	struct sieve_ast_argument *arg;
+	struct sieve_ast_node *subtest;
+	int cost = -1, subcost;
+	unsigned int i;
+
+	if (tst == NULL)
+		return -1;
+
+	if (sieve_command_is(tst, tst_not) ||
+	    sieve_command_is(tst, tst_anyof) ||
+	    sieve_command_is(tst, tst_allof)) {
+		cost = 0;
+		subtest = sieve_ast_test_first(test);
+		for (; subtest != NULL; subtest = sieve_ast_test_next(subtest)) {
+			subcost = sieve_optimizer_test_cost(subtest);
+			if (subcost < 0)
+				return -1;
+			cost = I_MAX(cost, subcost);
+		}
+		return cost;
+	}
+
+	for (i = 0; i < N_ELEMENTS(sieve_optimizer_test_costs); i++) {
+		if (strcmp(tst->def->identifier,
+			   sieve_optimizer_test_costs[i].identifier) == 0) {
+			cost = sieve_optimizer_test_costs[i].cost;
+			break;
+		}
+	}
+	if (cost < 0)
+		return -1;
+
+	/* The match values set by :matches and :regex would come from a
+	   different test */
+	arg = sieve_ast_argument_first(test);
+	for (; arg != NULL && arg != tst->first_positional;
+	     arg = sieve_ast_argument_next(arg)) {
+		if (sieve_argument_is_match_type(arg)) {
+			const struct sieve_match_type_context *mtctx =
+				arg->argument->data;
+			const char *name =
+				mtctx->match_type->def->obj_def.identifier;
+
+			if (strcmp(name, "matches") == 0 ||
+			    strcmp(name, "regex") == 0)
+				return -1;
+		}
+	}
+	return cost;
+}
+
+static void sieve_optimize_test_order(struct sieve_ast_node *node)
+{
+	ARRAY(struct sieve_ast_node *) tests;
+	ARRAY(int) costs;
+	struct sieve_ast_node *test, *const *sorted;
+	const int *cost_items;
+	unsigned int count, i, j;
+	bool moved = FALSE;
+
+	count = sieve_ast_test_count(node);
+	if (count < 2)
+		return;
+
+	t_array_init(&tests, count);
+	t_array_init(&costs, count);
+	test = sieve_ast_test_first(node);
+	for (; test != NULL; test = sieve_ast_test_next(test)) {
+		int cost = sieve_optimizer_test_cost(test);
+
+		/* Only reorder when none of the tests has side effects */
+		if (cost < 0)
+			return;
+
+		/* Stable insertion by cost */
+		cost_items = array_get(&costs, &j);
+		while (j > 0 && cost_items[j - 1] > cost)
+			j--;
+		if (j < array_count(&costs))
+			moved = TRUE;
+		array_insert(&tests, j, &test, 1);
+		array_insert(&costs, j, &cost, 1);
+	}
+
+	if (!moved)
+		return;
+
+	sorted = array_get(&tests, &i);
+	sieve_ast_node_reorder_tests(node, sorted, i);
+}
+
+static void sieve_optimize_test_list(struct sieve_ast_node *node)
+{
+	struct sieve_command *cmd = node->command;
+	struct sieve_ast_node *test, *next;
+
+	test = sieve_ast_test_first(node);
+	while (test != NULL) {
+		next = sieve_ast_test_next(test);
+
+		sieve_optimize_test_list(test);
+
+		if (next != NULL && test->command != NULL &&
+		    next->command != NULL && cmd != NULL &&
+		    sieve_command_is(cmd, tst_anyof) &&
+		    sieve_optimizer_merge_header(test->command,
+						 next->command)) {
+			/* Merged; try the next one as well */
+			(void)sieve_ast_node_detach(next);
+			continue;
+		}
+		test = next;
+	}
+
+	if (cmd != NULL && (sieve_command_is(cmd, tst_anyof) ||
+			    sieve_command_is(cmd, tst_allof))) T_BEGIN {
+		sieve_optimize_test_order(node);
+	} T_END;
+}
+
+/*
+ * Branch ordering
+ */
+
+/* The arms of an if/elsif chain are tested in order until one matches. When
+   the tests of consecutive arms can never match at the same time and have no
+   side effects, at most one of these arms is taken whatever their order. These
+   are then ordered by how often each was taken according to the profile, so
+   that the common cases need the fewest tests.
+
+   Only envelope tests qualify: the envelope sender and recipient have exactly
+   one value, so :is tests against different keys exclude each other. Header
+   fields may occur more than once in a message. */
+
+struct sieve_optimizer_branch {
+	struct sieve_ast_node *node;
+	const string_t *part;
+	struct sieve_ast_argument *keys;
+	uint64_t hits;
+};
+ARRAY_DEFINE_TYPE(sieve_optimizer_branch, struct sieve_optimizer_branch);
+
+static bool
+sieve_optimizer_envelope_is_literal(struct sieve_command *tst,
+				    const string_t **part_r,
+				    struct sieve_ast_argument **keys_r)
+{
+	struct sieve_optimizer_match match;
+	struct sieve_ast_argument *parts, *keys;
+	const string_t *part;
+
+	if (strcmp(sieve_command_identifier(tst), "envelope") != 0)
+		return FALSE;
+	/* Address parts other than the default :all are not understood */
+	if (!sieve_optimizer_get_match(tst, &match) ||
+	    match.mcht_def != &is_match_type ||
+	    (match.cmp_def != &i_ascii_casemap_comparator &&
+	     match.cmp_def != &i_octet_comparator))
+		return FALSE;
+
+	parts = tst->first_positional;
+	if (parts == NULL)
+		return FALSE;
+	keys = sieve_ast_argument_next(parts);
+	if (keys == NULL || sieve_ast_argument_next(keys) != NULL)
+		return FALSE;
+	if (!sieve_optimizer_literal_list(parts) ||
+	    !sieve_optimizer_literal_list(keys))
+		return FALSE;
+
+	part = sieve_optimizer_list_item(parts, 0);
+	if (sieve_optimizer_list_item(parts, 1) != NULL)
+		return FALSE;
+	if (strcasecmp(str_c((string_t *)part), "from") != 0 &&
+	    strcasecmp(str_c((string_t *)part), "to") != 0)
+		return FALSE;
+
+	*part_r = part;
+	*keys_r = keys;
+	return TRUE;
+}
+
+/* Returns TRUE when no key occurs in both lists, ignoring case (which covers
+   both allowed comparators) */
+static bool
+sieve_optimizer_keys_disjoint(struct sieve_ast_argument *keys1,
+			      struct sieve_ast_argument *keys2)
+{
+	const string_t *str1, *str2;
+	unsigned int i, j;
+
+	for (i = 0; (str1 = sieve_optimizer_list_item(keys1, i)) != NULL; i++) {
+		for (j = 0;
+		     (str2 = sieve_optimizer_list_item(keys2, j)) != NULL;
+		     j++) {
+			if (strcasecmp(str_c((string_t *)str1),
+				       str_c((string_t *)str2)) == 0)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static bool
+sieve_optimizer_branch_init(const struct sieve_optimizer_profile *profile,
+			    struct sieve_ast_node *node,
+			    struct sieve_optimizer_branch *branch_r)
+{
+	struct sieve_ast_node *test, *first;
+
+	i_zero(branch_r);
+	branch_r->node = node;
+
+	test = sieve_ast_test_first(node);
+	if (test == NULL || test->command == NULL ||
+	    !sieve_optimizer_envelope_is_literal(test->command,
+						 &branch_r->part,
+						 &branch_r->keys))
+		return FALSE;
+
+	/* The branch is taken as often as its first command is executed.
+	   When that shares its line with the test, the count would include
+	   the test as well. */
+	first = sieve_ast_command_first(node);
+	if (first == NULL || first->source_line == test->source_line)
+		return FALSE;
+	branch_r->hits = sieve_optimizer_profile_count(profile,
+						       first->source_line);
+	return TRUE;
+}
+
+static bool
+sieve_optimizer_branch_excludes(const ARRAY_TYPE(sieve_optimizer_branch) *run,
+				const struct sieve_optimizer_branch *branch)
+{
+	const struct sieve_optimizer_branch *other;
+
+	array_foreach(run, other) {
+		if (strcasecmp(str_c((string_t *)other->part),
+			       str_c((string_t *)branch->part)) != 0 ||
+		    !sieve_optimizer_keys_disjoint(other->keys, branch->keys))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+sieve_optimizer_branch_swap(struct sieve_optimizer_branch *branch1,
+			    struct sieve_optimizer_branch *branch2)
+{
+	struct sieve_command *cmd1 = branch1->node->command;
+	struct sieve_command *cmd2 = branch2->node->command;
+	struct sieve_command *exit_cmd = cmd1->block_exit_command;
+	struct sieve_optimizer_branch tmp;
+
+	/* The if/elsif commands stay in place, so that their chain is kept
+	   intact; only their tests and blocks are exchanged */
+	sieve_ast_node_swap_children(branch1->node, branch2->node);
+	cmd1->block_exit_command = cmd2->block_exit_command;
+	cmd2->block_exit_command = exit_cmd;
+
+	tmp = *branch1;
+	branch1->part = branch2->part;
+	branch1->keys = branch2->keys;
+	branch1->hits = branch2->hits;
+	branch2->part = tmp.part;
+	branch2->keys = tmp.keys;
+	branch2->hits = tmp.hits;
+}
+
+static void
+sieve_optimizer_branch_sort(ARRAY_TYPE(sieve_optimizer_branch) *run)
+{
+	struct sieve_optimizer_branch *branches;
+	unsigned int count, i, j;
+
+	/* Stable insertion by descending hit count */
+	branches = array_get_modifiable(run, &count);
+	for (i = 1; i < count; i++) {
+		for (j = i; j > 0 && branches[j - 1].hits < branches[j].hits;
+		     j--)
+			sieve_optimizer_branch_swap(&branches[j - 1],
+						    &branches[j]);
+	}
+	array_clear(run);
+}
+
+static void
+sieve_optimize_branch_order(const struct sieve_optimizer_profile *profile,
+			    struct sieve_ast_node *if_node)
+{
+	ARRAY_TYPE(sieve_optimizer_branch) run;
+	struct sieve_optimizer_branch branch;
+	struct sieve_ast_node *node = if_node;
+
+	t_array_init(&run, 8);
+	do {
+		if (!sieve_optimizer_branch_init(profile, node, &branch)) {
+			sieve_optimizer_branch_sort(&run);
+			continue;
+		}
+		if (!sieve_optimizer_branch_excludes(&run, &branch))
+			sieve_optimizer_branch_sort(&run);
+		array_append(&run, &branch, 1);
+	} while ((node = sieve_ast_command_next(node)) != NULL &&
+		 node->command != NULL &&
+		 sieve_command_is(node->command, cmd_elsif));
+	sieve_optimizer_branch_sort(&run);
+}
+
+/*
+ * Unreachable code
+ */
+
+static bool sieve_optimizer_command_exits(struct sieve_command *cmd)
+{
+	struct sieve_command *parent = sieve_command_parent(cmd);
+
+	if (sieve_command_is(cmd, cmd_stop))
+		return TRUE;
+	return (parent != NULL && parent->block_exit_command == cmd);
+}
+
+static void
+sieve_optimize_block(const struct sieve_optimizer_profile *profile,
+		     struct sieve_ast_node *block)
+{
+	struct sieve_ast_node *cmd_node;
+
+	cmd_node = sieve_ast_command_first(block);
+	while (cmd_node != NULL) {
+		struct sieve_command *cmd = cmd_node->command;
+
+		if (profile != NULL && cmd != NULL &&
+		    sieve_command_is(cmd, cmd_if)) T_BEGIN {
+			sieve_optimize_branch_order(profile, cmd_node);
+		} T_END;
+
+		sieve_optimize_test_list(cmd_node);
+		sieve_optimize_block(profile, cmd_node);
+
+		if (cmd != NULL && sieve_optimizer_command_exits(cmd)) {
+			/* Remaining commands in this block are never
+			   executed */
+			struct sieve_ast_node *next =
+				sieve_ast_command_next(cmd_node);
+
+			while (next != NULL)
+				next = sieve_ast_node_detach(next);
+			break;
+		}
+		cmd_node = sieve_ast_command_next(cmd_node);
+	}
+}
+
+void sieve_optimizer_run(struct sieve_ast *ast,
+			 const struct sieve_optimizer_profile *profile)
+{
+	sieve_optimize_block(profile, sieve_ast_root(ast));
+}
@@ -0,0 +1,47 @@
+#ifndef SIEVE_OPTIMIZER_H
+#define SIEVE_OPTIMIZER_H
+
+#include "sieve-common.h"
+
+/*
+ * Profile
+ */
+
+/* Reads the profile reports (as written to a trace log with
+   sieve_trace_profile enabled) contained in the file at path. The hit counts
+   of all reports in the file are added up, so the traces of several sampled
+   runs can simply be concatenated. */
+int sieve_optimizer_profile_read(const char *path,
+				 struct sieve_optimizer_profile **profile_r,
+				 const char **error_r);
+void sieve_optimizer_profile_free(struct sieve_optimizer_profile **_profile);
+
+/*
+ * Optimizer
+ */
+
+/* Simplifies a validated AST before code generation. Constant tests are
+   already folded by the validator; this pass additionally removes commands
+   that can never be reached and merges adjacent tests into a single test where
+   that does not change the outcome. When a profile is provided, mutually
+   exclusive branches of if/elsif chains are also ordered by how often they
+   were taken. */
+void sieve_optimizer_run(struct sieve_ast *ast,
+			 const struct sieve_optimizer_profile *profile)
+			 ATTR_NULL(2);
+
+/*
+ * Test inspection
+ */
+
+/* Returns TRUE when tst is a header test using :is and the default comparator
+   with only string literals for header names and keys. These are returned in
+   hdrs_r and keys_r. */
+bool sieve_optimizer_header_is_literal(struct sieve_command *tst,
+				       struct sieve_ast_argument **hdrs_r,
+				       struct sieve_ast_argument **keys_r);
+/* Returns TRUE when both literal header name lists are equal, ignoring case */
+bool sieve_optimizer_header_lists_equal(struct sieve_ast_argument *arg1,
+					struct sieve_ast_argument *arg2);
+
+#endif
@@ -48,7 +48,8 @@ sieve_parser_create(struct sieve_script *script,
 
 	lexer = sieve_lexer_create(script, ehandler, error_r);
 	if (lexer != NULL) {
-		pool_t pool = pool_alloconly_create("sieve_parser", 4096);
+		pool_t pool =
+			sieve_compile_pool_get(sieve_script_svinst(script));
 
 		parser = p_new(pool, struct sieve_parser, 1);
 		parser->pool = pool;
@@ -71,6 +72,8 @@ sieve_parser_create(struct sieve_script *script,
 
 void sieve_parser_free(struct sieve_parser **parser)
 {
+	struct sieve_instance *svinst = sieve_script_svinst((*parser)->script);
+
 	if ((*parser)->ast != NULL)
 		sieve_ast_unref(&(*parser)->ast);
 
@@ -79,7 +82,7 @@ void sieve_parser_free(struct sieve_parser **parser)
 
 	sieve_error_handler_unref(&(*parser)->ehandler);
 
-	pool_unref(&(*parser)->pool);
+	sieve_compile_pool_put(svinst, &(*parser)->pool);
 
 	*parser = NULL;
 }
@@ -8,6 +8,7 @@
 #include "str.h"
 #include "llist.h"
 #include "strfuncs.h"
+#include "time-util.h"
 #include "str-sanitize.h"
 #include "var-expand.h"
 #include "message-address.h"
@@ -47,6 +48,12 @@ struct sieve_result_action {
 	struct sieve_side_effects_list *seffects;
 
 	struct sieve_result_action *prev, *next;
+	/* Actions with the same definition, in result order */
+	struct sieve_result_action *def_prev, *def_next;
+};
+
+struct sieve_result_action_index {
+	struct sieve_result_action *head, *tail;
 };
 
 struct sieve_side_effects_list {
@@ -94,6 +101,12 @@ struct sieve_result {
 	unsigned int action_count;
 	struct sieve_result_action *actions_head, *actions_tail;
 
+	/* Index of result actions by action definition and the number of
+	   result actions that can conflict with others */
+	HASH_TABLE(const struct sieve_action_def *,
+		   struct sieve_result_action_index *) action_index;
+	unsigned int conflict_action_count;
+
 	HASH_TABLE(const struct sieve_action_def *,
 		   struct sieve_result_action_context *) action_contexts;
 };
@@ -135,6 +148,10 @@ sieve_result_create(struct sieve_instance *svinst, pool_t pool,
 	result->exec_env = eenv;
 	result->msgctx =
 		sieve_message_context_create(svinst, senv->user, msgdata);
+	if (senv->message_analysis != NULL) {
+		sieve_message_context_set_analysis(result->msgctx,
+						   senv->message_analysis);
+	}
 
 	result->keep_action.def = &act_store;
 	result->keep_action.ext = NULL;
@@ -169,9 +186,13 @@ void sieve_result_unref(struct sieve_result **_result)
 	if (--result->refcount != 0)
 		return;
 
+	sieve_execute_pool_usage_add(
+		result->exec_env, "sieve_message_context_data",
+		sieve_message_context_pool(result->msgctx));
 	sieve_message_context_unref(&result->msgctx);
 
 	hash_table_destroy(&result->action_contexts);
+	hash_table_destroy(&result->action_index);
 
 	ract = result->actions_head;
 	while (ract != NULL) {
@@ -189,6 +210,11 @@ pool_t sieve_result_pool(struct sieve_result *result)
 	return result->pool;
 }
 
+unsigned int sieve_result_get_action_count(struct sieve_result *result)
+{
+	return result->action_count;
+}
+
 /*
  * Getters/Setters
  */
@@ -395,10 +421,72 @@ sieve_result_side_effects_merge(const struct sieve_runtime_env *renv,
 	return 1;
 }
 
+static struct sieve_result_action_index *
+sieve_result_action_index_get(struct sieve_result *result,
+			      const struct sieve_action_def *act_def,
+			      bool create)
+{
+	struct sieve_result_action_index *index;
+
+	if (!hash_table_is_created(result->action_index)) {
+		if (!create)
+			return NULL;
+		hash_table_create_direct(&result->action_index,
+					 result->pool, 0);
+	}
+
+	index = hash_table_lookup(result->action_index, act_def);
+	if (index == NULL && create) {
+		index = p_new(result->pool,
+			      struct sieve_result_action_index, 1);
+		hash_table_insert(result->action_index, act_def, index);
+	}
+	return index;
+}
+
+static void
+sieve_result_action_index_add(struct sieve_result *result,
+			      struct sieve_result_action *raction)
+{
+	const struct sieve_action_def *act_def = raction->action.def;
+	struct sieve_result_action_index *index;
+
+	if (act_def == NULL)
+		return;
+
+	index = sieve_result_action_index_get(result, act_def, TRUE);
+	DLLIST2_APPEND_FULL(&index->head, &index->tail, raction,
+			    def_prev, def_next);
+	if (act_def->check_conflict != NULL)
+		result->conflict_action_count++;
+}
+
+static void
+sieve_result_action_index_remove(struct sieve_result *result,
+				 struct sieve_result_action *raction)
+{
+	const struct sieve_action_def *act_def = raction->action.def;
+	struct sieve_result_action_index *index;
+
+	if (act_def == NULL)
+		return;
+
+	index = sieve_result_action_index_get(result, act_def, FALSE);
+	i_assert(index != NULL);
+	DLLIST2_REMOVE_FULL(&index->head, &index->tail, raction,
+			    def_prev, def_next);
+	if (act_def->check_conflict != NULL) {
+		i_assert(result->conflict_action_count > 0);
+		result->conflict_action_count--;
+	}
+}
+
 static void
 sieve_result_action_detach(struct sieve_result *result,
 			   struct sieve_result_action *raction)
 {
+	sieve_result_action_index_remove(result, raction);
+
 	if (result->actions_head == raction)
 		result->actions_head = raction->next;
 
@@ -417,6 +505,45 @@ sieve_result_action_detach(struct sieve_result *result,
 		result->action_count--;
 }
 
+static int
+sieve_result_check_duplicate(const struct sieve_runtime_env *renv,
+			     const struct sieve_action *action,
+			     struct sieve_side_effects_list *seffects,
+			     unsigned int *instance_count,
+			     bool *duplicate_r)
+{
+	const struct sieve_action_def *act_def = action->def;
+	struct sieve_result_action_index *index;
+	struct sieve_result_action *raction;
+	int ret;
+
+	*duplicate_r = FALSE;
+	if (act_def == NULL)
+		return 0;
+
+	index = sieve_result_action_index_get(renv->result, act_def, FALSE);
+	raction = (index == NULL ? NULL : index->head);
+	while (raction != NULL) {
+		(*instance_count)++;
+
+		if (act_def->check_duplicate != NULL) {
+			if ((ret = act_def->check_duplicate(
+				renv, action, &raction->action)) < 0)
+				return ret;
+
+			/* Duplicate: merge side-effects, but don't add new
+			   action */
+			if (ret == 1) {
+				*duplicate_r = TRUE;
+				return sieve_result_side_effects_merge(
+					renv, action, raction, seffects);
+			}
+		}
+		raction = raction->def_next;
+	}
+	return 0;
+}
+
 static int
 _sieve_result_add_action(const struct sieve_runtime_env *renv,
 			 const struct sieve_extension *ext, const char *name,
@@ -441,7 +568,20 @@ _sieve_result_add_action(const struct sieve_runtime_env *renv,
 	action.exec_seq = result->exec_seq;
 
 	/* First, check for duplicates or conflicts */
-	raction = result->actions_head;
+	if (!keep && result->conflict_action_count == 0 &&
+	    (act_def == NULL || act_def->check_conflict == NULL)) {
+		bool duplicate = FALSE;
+
+		/* Nothing can conflict, so only actions with the same
+		   definition need to be checked */
+		ret = sieve_result_check_duplicate(renv, &action, seffects,
+						   &instance_count, &duplicate);
+		if (ret < 0 || duplicate)
+			return ret;
+		raction = NULL;
+	} else {
+		raction = result->actions_head;
+	}
 	while (raction != NULL) {
 		const struct sieve_action *oact = &raction->action;
 		bool oact_new = (oact->exec_seq == result->exec_seq);
@@ -588,6 +728,7 @@ _sieve_result_add_action(const struct sieve_runtime_env *renv,
 			raction->next = NULL;
 		}
 		result->action_count++;
+		sieve_result_action_index_add(result, raction);
 
 		/* Apply any implicit side effects */
 		if (hash_table_is_created(result->action_contexts)) {
@@ -1107,6 +1248,8 @@ sieve_result_action_execute(struct sieve_result_execution *rexec,
 	struct sieve_result_action *rac = aexec->action;
 	struct sieve_action *act = &rac->action;
 	struct sieve_side_effect_execution *seexec;
+	struct timeval exec_start, exec_end;
+	unsigned int seffect_count = 0;
 	int status = start_status;
 	bool impl_keep = TRUE;
 
@@ -1140,6 +1283,7 @@ sieve_result_action_execute(struct sieve_result_execution *rexec,
 	}
 
 	sieve_action_execution_pre(rexec, aexec);
+	i_gettimeofday(&exec_start);
 
 	/* Execute pre-execute event of side effects */
 	seexec = aexec->seffects_head;
@@ -1147,6 +1291,7 @@ sieve_result_action_execute(struct sieve_result_execution *rexec,
 		status = sieve_result_side_effect_pre_execute(
 			rexec, aexec, seexec);
 		seexec = seexec->next;
+		seffect_count++;
 	}
 
 	/* Execute the action itself */
@@ -1167,6 +1312,14 @@ sieve_result_action_execute(struct sieve_result_execution *rexec,
 		seexec = seexec->next;
 	}
 
+	/* Record execution statistics on the action event, so that the
+	   sieve_action_finished event emitted at commit carries them */
+	i_gettimeofday(&exec_end);
+	event_add_int(act->event, "side_effects", seffect_count);
+	event_add_int(act->event, "exec_seq", aexec->exec_seq);
+	event_add_int(act->event, "running_usecs",
+		      timeval_diff_usecs(&exec_end, &exec_start));
+
 	if (aexec == &rexec->keep) {
 		e_debug(rexec->event,
 			"Finished executing implicit keep action (status=%s)",
@@ -1930,6 +2083,17 @@ sieve_result_execution_update(struct sieve_result_execution *rexec)
 	}
 }
 
+static bool sieve_result_has_new_actions(struct sieve_result *result)
+{
+	struct sieve_result_action *rac;
+
+	for (rac = result->actions_head; rac != NULL; rac = rac->next) {
+		if (rac->action.exec_seq == result->exec_seq)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 int sieve_result_execute(struct sieve_result_execution *rexec, int status,
 			 bool commit, struct sieve_error_handler *ehandler,
 			 bool *keep_r)
@@ -1944,6 +2108,27 @@ int sieve_result_execute(struct sieve_result_execution *rexec, int status,
 
 	if (keep_r != NULL)
 		*keep_r = FALSE;
+
+	if (!commit && status == SIEVE_EXEC_OK &&
+	    !sieve_result_has_new_actions(result)) {
+		/* Intermediate execution (e.g. between scripts of a sequence)
+		   without any new actions: nothing is executed and the keep
+		   status is unchanged, so skip the transaction altogether. */
+		sieve_result_mark_executed(result);
+		rexec->keep_implicit = (rexec->keep_explicit ||
+					rexec->keep_implicit);
+		rexec->keep_explicit = FALSE;
+
+		e_debug(rexec->event, "Finished executing result "
+			"(no commit, no new actions, status=%s, keep=%s)",
+			sieve_execution_exitcode_to_str(rexec->status),
+			(rexec->keep_implicit ? "yes" : "no"));
+
+		if (keep_r != NULL)
+			*keep_r = rexec->keep_implicit;
+		return rexec->status;
+	}
+
 	sieve_result_mark_executed(result);
 
 	/* Prepare environment */
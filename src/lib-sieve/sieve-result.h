@@ -27,6 +27,8 @@ void sieve_result_unref(struct sieve_result **result);
 
 pool_t sieve_result_pool(struct sieve_result *result);
 
+unsigned int sieve_result_get_action_count(struct sieve_result *result);
+
 /*
  * Getters/Setters
  */
@@ -103,21 +103,29 @@ static inline void ATTR_FORMAT(4, 5) _sieve_runtime_trace_printf
 	va_end(args);
 }
 
-void ATTR_FORMAT(2, 0) _sieve_runtime_trace
-(const struct sieve_runtime_env *renv, const char *fmt, va_list args)
+void _sieve_runtime_trace
+(const struct sieve_runtime_env *renv, const char *fmt, ...)
 {
+	va_list args;
+
+	va_start(args, fmt);
 	_sieve_runtime_trace_vprintf
 		(renv, renv->oprtn->address, sieve_runtime_get_command_location(renv),
 			fmt, args);
+	va_end(args);
 }
 
 void _sieve_runtime_trace_address
 (const struct sieve_runtime_env *renv, sieve_size_t address,
-	const char *fmt, va_list args)
+	const char *fmt, ...)
 {
+	va_list args;
+
+	va_start(args, fmt);
 	_sieve_runtime_trace_vprintf
 		(renv, address, sieve_runtime_get_source_location(renv, address), fmt,
 			args);
+	va_end(args);
 }
 
 /*
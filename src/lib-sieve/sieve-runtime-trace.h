@@ -91,66 +91,35 @@ static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace_operand_error
 
 /* Trace info */
 
-void _sieve_runtime_trace
-	(const struct sieve_runtime_env *renv, const char *fmt, va_list args)
-		ATTR_FORMAT(2, 0);
-
-static inline void sieve_runtime_trace
-	(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-		const char *fmt, ...) ATTR_FORMAT(3, 4);
-
-static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace
-(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-	const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
+/* These are macros, so that the arguments (often sanitized or formatted
+   strings) are only evaluated when the trace level is actually active.
+   Don't pass arguments with side effects. */
 
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
-		_sieve_runtime_trace(renv, fmt, args);
-	}
+void _sieve_runtime_trace
+	(const struct sieve_runtime_env *renv, const char *fmt, ...)
+		ATTR_FORMAT(2, 3);
 
-	va_end(args);
-}
+#define sieve_runtime_trace(renv, trace_level, ...) \
+	STMT_START { \
+		if ( unlikely(sieve_runtime_trace_active(renv, trace_level)) ) \
+			_sieve_runtime_trace(renv, __VA_ARGS__); \
+	} STMT_END
 
 void _sieve_runtime_trace_address
 	(const struct sieve_runtime_env *renv, sieve_size_t address,
-		const char *fmt, va_list args) ATTR_FORMAT(3, 0);
-
-static inline void sieve_runtime_trace_address
-	(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-		sieve_size_t address, const char *fmt, ...) ATTR_FORMAT(4, 5);
-
-static inline void ATTR_FORMAT(4, 5) sieve_runtime_trace_address
-(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-	sieve_size_t address, const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
-
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
-		_sieve_runtime_trace_address(renv, address, fmt, args);
-	}
-
-	va_end(args);
-}
-
-static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace_here
-(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-	const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
-
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
-		_sieve_runtime_trace_address(renv, renv->pc, fmt, args);
-	}
+		const char *fmt, ...) ATTR_FORMAT(3, 4);
 
-	va_end(args);
-}
+#define sieve_runtime_trace_address(renv, trace_level, address, ...) \
+	STMT_START { \
+		if ( unlikely(sieve_runtime_trace_active(renv, trace_level)) ) \
+			_sieve_runtime_trace_address(renv, address, __VA_ARGS__); \
+	} STMT_END
+
+#define sieve_runtime_trace_here(renv, trace_level, ...) \
+	STMT_START { \
+		if ( unlikely(sieve_runtime_trace_active(renv, trace_level)) ) \
+			_sieve_runtime_trace_address(renv, (renv)->pc, __VA_ARGS__); \
+	} STMT_END
 
 /* Trace boundaries */
 
@@ -63,6 +63,11 @@ struct sieve_script {
 	/* Stream */
 	struct istream *stream;
 
+	/* Digest of the script source and the enabled extensions */
+	const char *bin_digest;
+	/* Location of the binary in the shared binary directory */
+	const char *bin_shared_path;
+
 	bool open:1;
 };
 
@@ -9,6 +9,8 @@
 #include "hash.h"
 #include "array.h"
 #include "eacces-error.h"
+#include "hex-binary.h"
+#include "sha2.h"
 #include "istream.h"
 
 #include "sieve-common.h"
@@ -16,6 +18,7 @@
 #include "sieve-settings.h"
 #include "sieve-error.h"
 #include "sieve-dump.h"
+#include "sieve-extensions.h"
 #include "sieve-binary.h"
 
 #include "sieve-storage-private.h"
@@ -299,6 +302,11 @@ bool sieve_script_is_default(const struct sieve_script *script)
 	return script->storage->is_default;
 }
 
+bool sieve_script_is_personal(const struct sieve_script *script)
+{
+	return script->storage->main_storage;
+}
+
 /*
  * Stream management
  */
@@ -557,6 +565,68 @@ const char *sieve_script_binary_get_prefix(struct sieve_script *script)
 	return script->v.binary_get_prefix(script);
 }
 
+const char *sieve_script_binary_get_digest(struct sieve_script *script)
+{
+	struct sieve_instance *svinst = script->storage->svinst;
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_RESULTLEN];
+	struct istream *input;
+	const unsigned char *data;
+	const char *extstr;
+	size_t size;
+
+	if (script->bin_digest != NULL)
+		return script->bin_digest;
+
+	if (sieve_script_get_stream(script, &input, NULL) < 0)
+		return NULL;
+
+	/* The compiled program only depends on the script source and on the
+	   extensions available to the compiler */
+	sha256_init(&ctx);
+	extstr = sieve_extensions_get_string(svinst);
+	sha256_loop(&ctx, extstr, strlen(extstr) + 1);
+
+	i_stream_seek(input, 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		sha256_loop(&ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		sieve_storage_set_critical(script->storage,
+			"read(%s) failed: %s", i_stream_get_name(input),
+			i_stream_get_error(input));
+		return NULL;
+	}
+	/* Leave the stream for the compiler */
+	i_stream_seek(input, 0);
+
+	sha256_result(&ctx, digest);
+	script->bin_digest = p_strdup(script->pool,
+		binary_to_hex(digest, sizeof(digest)));
+	return script->bin_digest;
+}
+
+const char *sieve_script_binary_get_shared_path(struct sieve_script *script)
+{
+	struct sieve_instance *svinst = script->storage->svinst;
+	const char *digest;
+
+	if (svinst->binary_shared_dir == NULL)
+		return NULL;
+	if (script->bin_shared_path != NULL)
+		return script->bin_shared_path;
+
+	digest = sieve_script_binary_get_digest(script);
+	if (digest == NULL)
+		return NULL;
+
+	script->bin_shared_path = p_strconcat(
+		script->pool, svinst->binary_shared_dir, "/", digest,
+		"."SIEVE_BINARY_FILEEXT, NULL);
+	return script->bin_shared_path;
+}
+
 /*
  * Management
  */
@@ -760,7 +830,8 @@ int sieve_script_activate(struct sieve_script *script, time_t mtime)
 			e_debug(e->event(), "Script activated");
 
 			sieve_storage_set_modified(storage, mtime);
-			(void)sieve_storage_sync_script_activate(storage);
+			(void)sieve_storage_sync_script_activate(storage,
+								 script->name);
 		} else {
 			struct event_passthrough *e =
 				event_create_passthrough(script->event)->
@@ -85,6 +85,15 @@ int sieve_script_binary_save(struct sieve_script *script,
 			     enum sieve_error *error_r) ATTR_NULL(4);
 
 const char *sieve_script_binary_get_prefix(struct sieve_script *script);
+/* Returns a hex digest of the script source and the enabled extensions,
+   which identifies the compiled binary. Returns NULL if the script could not
+   be read. */
+const char *sieve_script_binary_get_digest(struct sieve_script *script);
+/* Returns the path of the binary for this script in the shared binary
+   directory (sieve_binary_shared_dir), which is named after a digest of the
+   script source and the enabled extensions. Returns NULL if no shared
+   directory is configured or the script could not be read. */
+const char *sieve_script_binary_get_shared_path(struct sieve_script *script);
 
 /*
  * Stream management
@@ -117,6 +126,8 @@ sieve_script_svinst(const struct sieve_script *script) ATTR_PURE;
 int sieve_script_get_size(struct sieve_script *script, uoff_t *size_r);
 bool sieve_script_is_open(const struct sieve_script *script) ATTR_PURE;
 bool sieve_script_is_default(const struct sieve_script *script) ATTR_PURE;
+/* Returns TRUE if the script comes from the user's main personal storage */
+bool sieve_script_is_personal(const struct sieve_script *script) ATTR_PURE;
 
 const char *
 sieve_file_script_get_dirpath(const struct sieve_script *script) ATTR_PURE;
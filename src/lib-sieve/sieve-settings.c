@@ -2,6 +2,8 @@
  */
 
 #include "lib.h"
+#include "array.h"
+#include "hash.h"
 
 #include "sieve-common.h"
 #include "sieve-limits.h"
@@ -13,17 +15,90 @@
 #include <ctype.h>
 
 /*
- * Access to settings
+ * Settings cache
  */
 
-bool sieve_setting_get_uint_value(struct sieve_instance *svinst,
-				  const char *setting,
-				  unsigned long long int *value_r)
+/* Settings don't change during the lifetime of an instance (which is a user
+   session or a single delivery), so each setting is retrieved through the
+   environment callback only once. The parsed value is kept along with it for
+   the last type it was requested as. */
+
+enum sieve_setting_type {
+	SIEVE_SETTING_TYPE_STRING = 0,
+	SIEVE_SETTING_TYPE_UINT,
+	SIEVE_SETTING_TYPE_INT,
+	SIEVE_SETTING_TYPE_SIZE,
+	SIEVE_SETTING_TYPE_BOOL,
+	SIEVE_SETTING_TYPE_DURATION,
+};
+
+struct sieve_setting_cache_entry {
+	const char *value;
+
+	enum sieve_setting_type type;
+	bool valid;
+	union {
+		unsigned long long int uint;
+		long long int sint;
+		size_t size;
+		bool boolean;
+		sieve_number_t duration;
+	} parsed;
+};
+
+static struct sieve_setting_cache_entry *
+sieve_setting_lookup(struct sieve_instance *svinst, const char *identifier)
 {
-	const char *str_value;
+	const struct sieve_callbacks *callbacks = svinst->callbacks;
+	struct sieve_setting_cache_entry *entry;
+	const char *value = NULL;
+
+	if (svinst->settings_pool == NULL) {
+		svinst->settings_pool =
+			pool_alloconly_create("sieve settings", 1024);
+		hash_table_create(&svinst->settings, svinst->settings_pool, 0,
+				  str_hash, strcmp);
+	}
 
-	str_value = sieve_setting_get(svinst, setting);
+	entry = hash_table_lookup(svinst->settings, identifier);
+	if (entry != NULL)
+		return entry;
+
+	if (callbacks != NULL && callbacks->get_setting != NULL)
+		value = callbacks->get_setting(svinst->context, identifier);
+
+	entry = p_new(svinst->settings_pool,
+		      struct sieve_setting_cache_entry, 1);
+	entry->value = p_strdup(svinst->settings_pool, value);
+	hash_table_insert(svinst->settings,
+			  p_strdup(svinst->settings_pool, identifier), entry);
+	return entry;
+}
+
+void sieve_settings_cache_clear(struct sieve_instance *svinst)
+{
+	if (svinst->settings_pool == NULL)
+		return;
+
+	hash_table_destroy(&svinst->settings);
+	pool_unref(&svinst->settings_pool);
+}
 
+/*
+ * Access to settings
+ */
+
+const char *
+sieve_setting_get(struct sieve_instance *svinst, const char *identifier)
+{
+	return sieve_setting_lookup(svinst, identifier)->value;
+}
+
+static bool
+sieve_setting_parse_uint_value(struct sieve_instance *svinst,
+			       const char *setting, const char *str_value,
+			       unsigned long long int *value_r)
+{
 	if (str_value == NULL || *str_value == '\0')
 		return FALSE;
 
@@ -36,12 +111,28 @@ bool sieve_setting_get_uint_value(struct sieve_instance *svinst,
 	return TRUE;
 }
 
-bool sieve_setting_get_int_value(struct sieve_instance *svinst,
-				 const char *setting, long long int *value_r)
+bool sieve_setting_get_uint_value(struct sieve_instance *svinst,
+				  const char *setting,
+				  unsigned long long int *value_r)
 {
-	const char *str_value;
+	struct sieve_setting_cache_entry *entry =
+		sieve_setting_lookup(svinst, setting);
 
-	str_value = sieve_setting_get(svinst, setting);
+	if (entry->type != SIEVE_SETTING_TYPE_UINT) {
+		entry->valid = sieve_setting_parse_uint_value(
+			svinst, setting, entry->value, &entry->parsed.uint);
+		entry->type = SIEVE_SETTING_TYPE_UINT;
+	}
+	if (entry->valid)
+		*value_r = entry->parsed.uint;
+	return entry->valid;
+}
+
+static bool
+sieve_setting_parse_int_value(struct sieve_instance *svinst,
+			      const char *setting, const char *str_value,
+			      long long int *value_r)
+{
 	if (str_value == NULL || *str_value == '\0')
 		return FALSE;
 
@@ -54,17 +145,30 @@ bool sieve_setting_get_int_value(struct sieve_instance *svinst,
 	return TRUE;
 }
 
-bool sieve_setting_get_size_value(struct sieve_instance *svinst,
-				  const char *setting, size_t *value_r)
+bool sieve_setting_get_int_value(struct sieve_instance *svinst,
+				 const char *setting, long long int *value_r)
+{
+	struct sieve_setting_cache_entry *entry =
+		sieve_setting_lookup(svinst, setting);
+
+	if (entry->type != SIEVE_SETTING_TYPE_INT) {
+		entry->valid = sieve_setting_parse_int_value(
+			svinst, setting, entry->value, &entry->parsed.sint);
+		entry->type = SIEVE_SETTING_TYPE_INT;
+	}
+	if (entry->valid)
+		*value_r = entry->parsed.sint;
+	return entry->valid;
+}
+
+static bool
+sieve_setting_parse_size_value(struct sieve_instance *svinst,
+			       const char *setting, const char *str_value,
+			       size_t *value_r)
 {
-	const char *str_value;
 	uintmax_t value, multiply = 1;
 	const char *endp;
 
-	str_value = sieve_setting_get(svinst, setting);
-	if (str_value == NULL || *str_value == '\0')
-		return FALSE;
-
 	if (str_parse_uintmax(str_value, &value, &endp) < 0) {
 		e_warning(svinst->event,
 			  "invalid size value for setting '%s': '%s'",
@@ -106,12 +210,30 @@ bool sieve_setting_get_size_value(struct sieve_instance *svinst,
 	return TRUE;
 }
 
-bool sieve_setting_get_bool_value(struct sieve_instance *svinst,
-				  const char *setting, bool *value_r)
+bool sieve_setting_get_size_value(struct sieve_instance *svinst,
+				  const char *setting, size_t *value_r)
 {
-	const char *str_value;
+	struct sieve_setting_cache_entry *entry =
+		sieve_setting_lookup(svinst, setting);
+
+	if (entry->type != SIEVE_SETTING_TYPE_SIZE) {
+		entry->valid = (entry->value != NULL &&
+				*entry->value != '\0' &&
+				sieve_setting_parse_size_value(
+					svinst, setting, entry->value,
+					&entry->parsed.size));
+		entry->type = SIEVE_SETTING_TYPE_SIZE;
+	}
+	if (entry->valid)
+		*value_r = entry->parsed.size;
+	return entry->valid;
+}
 
-	str_value = sieve_setting_get(svinst, setting);
+static bool
+sieve_setting_parse_bool_value(struct sieve_instance *svinst,
+			       const char *setting, const char *str_value,
+			       bool *value_r)
+{
 	if (str_value == NULL)
 		return FALSE;
 
@@ -135,15 +257,30 @@ bool sieve_setting_get_bool_value(struct sieve_instance *svinst,
 	return FALSE;
 }
 
-bool sieve_setting_get_duration_value(struct sieve_instance *svinst,
-				      const char *setting,
-				      sieve_number_t *value_r)
+bool sieve_setting_get_bool_value(struct sieve_instance *svinst,
+				  const char *setting, bool *value_r)
+{
+	struct sieve_setting_cache_entry *entry =
+		sieve_setting_lookup(svinst, setting);
+
+	if (entry->type != SIEVE_SETTING_TYPE_BOOL) {
+		entry->valid = sieve_setting_parse_bool_value(
+			svinst, setting, entry->value, &entry->parsed.boolean);
+		entry->type = SIEVE_SETTING_TYPE_BOOL;
+	}
+	if (entry->valid)
+		*value_r = entry->parsed.boolean;
+	return entry->valid;
+}
+
+static bool
+sieve_setting_parse_duration_value(struct sieve_instance *svinst,
+				   const char *setting, const char *str_value,
+				   sieve_number_t *value_r)
 {
-	const char *str_value;
 	uintmax_t value, multiply = 1;
 	const char *endp;
 
-	str_value = sieve_setting_get(svinst, setting);
 	if (str_value == NULL)
 		return FALSE;
 
@@ -190,10 +327,69 @@ bool sieve_setting_get_duration_value(struct sieve_instance *svinst,
 	return TRUE;
 }
 
+bool sieve_setting_get_duration_value(struct sieve_instance *svinst,
+				      const char *setting,
+				      sieve_number_t *value_r)
+{
+	struct sieve_setting_cache_entry *entry =
+		sieve_setting_lookup(svinst, setting);
+
+	if (entry->type != SIEVE_SETTING_TYPE_DURATION) {
+		entry->valid = sieve_setting_parse_duration_value(
+			svinst, setting, entry->value,
+			&entry->parsed.duration);
+		entry->type = SIEVE_SETTING_TYPE_DURATION;
+	}
+	if (entry->valid)
+		*value_r = entry->parsed.duration;
+	return entry->valid;
+}
+
 /*
  * Main Sieve engine settings
  */
 
+static void sieve_settings_load_body_part_limits(struct sieve_instance *svinst)
+{
+	static const char *setting = "sieve_max_body_part_size";
+	const char *str_value, *const *items;
+	struct sieve_body_part_limit *limit;
+	size_t size;
+
+	str_value = sieve_setting_get(svinst, setting);
+	if (str_value == NULL)
+		return;
+
+	/* A space-separated list of [<content-type>:]<size> items; an item
+	   without content type sets the limit for all other types. */
+	items = t_strsplit_spaces(str_value, " ");
+	for (; *items != NULL; items++) {
+		const char *item = *items, *sep = strrchr(item, ':');
+
+		if (sep == NULL) {
+			if (sieve_setting_parse_size_value(svinst, setting,
+							   item, &size))
+				svinst->max_body_part_size = size;
+			continue;
+		}
+		if (sep == item || strchr(item, '/') == sep - 1) {
+			e_warning(svinst->event,
+				  "invalid content type for setting '%s': "
+				  "'%s'", setting, item);
+			continue;
+		}
+		if (!sieve_setting_parse_size_value(svinst, setting,
+						    sep + 1, &size))
+			continue;
+
+		if (!array_is_created(&svinst->body_part_limits))
+			p_array_init(&svinst->body_part_limits, svinst->pool, 4);
+		limit = array_append_space(&svinst->body_part_limits);
+		limit->content_type = p_strdup_until(svinst->pool, item, sep);
+		limit->max_size = size;
+	}
+}
+
 void sieve_settings_load(struct sieve_instance *svinst)
 {
 	const char *str_setting, *error;
@@ -238,6 +434,15 @@ void sieve_settings_load(struct sieve_instance *svinst)
 		}
 	}
 
+	svinst->trace_slow_msecs = 0;
+	if (sieve_setting_get_uint_value(svinst, "sieve_trace_slow_cpu_time",
+					 &uint_setting)) {
+		if (uint_setting > UINT_MAX)
+			svinst->trace_slow_msecs = UINT_MAX;
+		else
+			svinst->trace_slow_msecs = (unsigned int)uint_setting;
+	}
+
 	(void)sieve_address_source_parse_from_setting(
 		svinst,	svinst->pool, "sieve_redirect_envelope_from",
 		&svinst->redirect_from);
@@ -253,6 +458,68 @@ void sieve_settings_load(struct sieve_instance *svinst)
 		}
 	}
 
+	svinst->max_body_part_size = 0;
+	sieve_settings_load_body_part_limits(svinst);
+
+	svinst->binary_cache_size = 0;
+	(void)sieve_setting_get_uint_value(svinst, "sieve_binary_cache_size",
+					   &svinst->binary_cache_size);
+
+	svinst->binary_cache_trust_secs = 0;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_binary_cache_trust", &period)) {
+		svinst->binary_cache_trust_secs =
+			(period > UINT_MAX ? UINT_MAX : (unsigned int)period);
+	}
+
+	svinst->binary_cache_idle_secs = 0;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_binary_cache_idle", &period)) {
+		svinst->binary_cache_idle_secs =
+			(period > UINT_MAX ? UINT_MAX : (unsigned int)period);
+	}
+
+	svinst->binary_upgrade_interval_secs =
+		DEFAULT_BINARY_UPGRADE_INTERVAL_SECS;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_binary_upgrade_interval", &period)) {
+		svinst->binary_upgrade_interval_secs =
+			(period > UINT_MAX ? UINT_MAX : (unsigned int)period);
+	}
+
+	svinst->html_text_cache_size = 0;
+	if (sieve_setting_get_size_value(svinst, "sieve_html_text_cache_size",
+					 &size_setting))
+		svinst->html_text_cache_size = size_setting;
+
+	str_setting = sieve_setting_get(svinst, "sieve_binary_shared_dir");
+	svinst->binary_shared_dir = (str_setting == NULL || *str_setting == '\0' ?
+				     NULL : p_strdup(svinst->pool, str_setting));
+
+	str_setting = sieve_setting_get(svinst, "sieve_binary_dict");
+	svinst->binary_dict_uri = (str_setting == NULL || *str_setting == '\0' ||
+				   svinst->binary_shared_dir == NULL ?
+				   NULL : p_strdup(svinst->pool, str_setting));
+
+	str_setting = sieve_setting_get(svinst, "sieve_duplicate_dict");
+	svinst->duplicate_dict_uri = (str_setting == NULL || *str_setting == '\0' ?
+				      NULL : p_strdup(svinst->pool, str_setting));
+
+	svinst->optimize = FALSE;
+	(void)sieve_setting_get_bool_value(svinst, "sieve_optimize",
+					   &svinst->optimize);
+
+	svinst->binary_mmap = FALSE;
+	svinst->binary_mmap_global = FALSE;
+	str_setting = sieve_setting_get(svinst, "sieve_binary_mmap");
+	if (str_setting != NULL &&
+	    strcasecmp(t_str_trim(str_setting, "\t "), "global") == 0)
+		svinst->binary_mmap_global = TRUE;
+	else {
+		(void)sieve_setting_get_bool_value(svinst, "sieve_binary_mmap",
+						   &svinst->binary_mmap);
+	}
+
 	str_setting = sieve_setting_get(svinst, "sieve_user_email");
 	if (str_setting != NULL && *str_setting != '\0') {
 		struct smtp_address *address;
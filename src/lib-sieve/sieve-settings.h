@@ -7,16 +7,10 @@
  * Access to settings
  */
 
-static inline const char *
-sieve_setting_get(struct sieve_instance *svinst, const char *identifier)
-{
-	const struct sieve_callbacks *callbacks = svinst->callbacks;
-
-	if (callbacks == NULL || callbacks->get_setting == NULL)
-		return NULL;
-
-	return callbacks->get_setting(svinst->context, identifier);
-}
+/* Settings are retrieved from the environment once and cached in the
+   instance; the returned string is valid until the cache is cleared. */
+const char *
+sieve_setting_get(struct sieve_instance *svinst, const char *identifier);
 
 bool sieve_setting_get_uint_value(struct sieve_instance *svinst,
 				  const char *setting,
@@ -31,6 +25,10 @@ bool sieve_setting_get_duration_value(struct sieve_instance *svinst,
 				      const char *setting,
 				      sieve_number_t *value_r);
 
+/* Forget all cached settings (needed only when the environment changes its
+   settings during the lifetime of the instance). */
+void sieve_settings_cache_clear(struct sieve_instance *svinst);
+
 /*
  * Main Sieve engine settings
  */
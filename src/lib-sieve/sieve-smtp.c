@@ -93,3 +93,17 @@ int sieve_smtp_finish
 	return senv->smtp_finish(senv, handle, error_r);
 }
 
+int sieve_smtp_finish_async
+(struct sieve_smtp_context *sctx, const char *description,
+	const char **error_r)
+{
+	const struct sieve_script_env *senv = sctx->senv;
+	void *handle = sctx->handle;
+
+	if ( senv->smtp_finish_async == NULL )
+		return sieve_smtp_finish(sctx, error_r);
+
+	i_free(sctx);
+	senv->smtp_finish_async(senv, handle, description);
+	return 1;
+}
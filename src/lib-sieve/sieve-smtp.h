@@ -27,5 +27,11 @@ void sieve_smtp_abort
 	(struct sieve_smtp_context *sctx);
 int sieve_smtp_finish
 	(struct sieve_smtp_context *sctx, const char **error_r);
+/* Like sieve_smtp_finish(), but returns 1 as soon as the message is handed
+   over when the environment supports background submission. Only use this
+   when the outcome does not affect further processing. */
+int sieve_smtp_finish_async
+	(struct sieve_smtp_context *sctx, const char *description,
+		const char **error_r);
 
 #endif
@@ -29,9 +29,13 @@ struct sieve_storage_vfuncs {
 	int (*get_last_change)(struct sieve_storage *storage,
 			       time_t *last_change_r);
 	void (*set_modified)(struct sieve_storage *storage, time_t mtime);
+	int (*changelog_append)(struct sieve_storage *storage,
+				const char *entry);
 
 	int (*is_singular)(struct sieve_storage *storage);
 
+	void (*release_memory)(struct sieve_storage *storage);
+
 	/* script access */
 	struct sieve_script *(*get_script)(struct sieve_storage *storage,
 					   const char *name);
@@ -118,6 +122,13 @@ struct sieve_storage {
 	bool main_storage:1;
 	bool allows_synchronization:1;
 	bool is_default:1;
+	/* append changes to the storage's change log */
+	bool changelog:1;
+
+	/* sieve_storage_save_batch_begin() nesting level */
+	unsigned int save_batch;
+	/* finished saves are not yet flushed to disk */
+	bool save_sync_pending:1;
 };
 
 struct event *
@@ -166,6 +177,8 @@ struct sieve_storage_save_context {
 
 	const char *scriptname, *active_scriptname;
 	struct sieve_script *scriptobject;
+	/* Binary compiled from the uploaded script, saved upon commit */
+	struct sieve_binary *binary;
 
 	struct istream *input;
 
@@ -183,6 +196,8 @@ struct sieve_storage_class_registry;
 
 void sieve_storages_init(struct sieve_instance *svinst);
 void sieve_storages_deinit(struct sieve_instance *svinst);
+/* Frees the process-wide caches of the storage drivers */
+void sieve_storages_caches_free(void);
 
 void sieve_storage_class_register(struct sieve_instance *svinst,
 				  const struct sieve_storage *storage_class);
@@ -213,18 +228,24 @@ sieve_file_storage_init_default(struct sieve_instance *svinst,
 				enum sieve_storage_flags flags,
 				enum sieve_error *error_r) ATTR_NULL(4);
 
+void sieve_file_storage_caches_free(void);
+
 /* dict */
 
 #define SIEVE_DICT_STORAGE_DRIVER_NAME "dict"
 
 extern const struct sieve_storage sieve_dict_storage;
 
+void sieve_dict_storage_caches_free(void);
+
 /* ldap */
 
 #define SIEVE_LDAP_STORAGE_DRIVER_NAME "ldap"
 
 extern const struct sieve_storage sieve_ldap_storage;
 
+void sieve_ldap_storage_caches_free(void);
+
 /*
  * Error handling
  */
@@ -249,7 +270,8 @@ int sieve_storage_sync_script_rename(struct sieve_storage *storage,
 int sieve_storage_sync_script_delete(struct sieve_storage *storage,
 				     const char *name);
 
-int sieve_storage_sync_script_activate(struct sieve_storage *storage);
+int sieve_storage_sync_script_activate(struct sieve_storage *storage,
+				       const char *name);
 int sieve_storage_sync_deactivate(struct sieve_storage *storage);
 
 #endif
@@ -3,6 +3,11 @@
 
 #include "lib.h"
 #include "array.h"
+#include "str.h"
+#include "strescape.h"
+#include "hex-binary.h"
+#include "sha2.h"
+#include "istream.h"
 #include "str-sanitize.h"
 #include "home-expand.h"
 #include "eacces-error.h"
@@ -26,10 +31,19 @@ int sieve_storage_sync_init
 {
 	enum sieve_storage_flags sflags = storage->flags;
 
+	bool changelog;
+
 	if ( (sflags & SIEVE_STORAGE_FLAG_SYNCHRONIZING) == 0 &&
 		(sflags & SIEVE_STORAGE_FLAG_READWRITE) == 0 )
 		return 0;
 
+	if ( storage->v.changelog_append != NULL &&
+		sieve_setting_get_bool_value(storage->svinst,
+			"sieve_storage_changelog", &changelog) && changelog ) {
+		e_debug(storage->event, "sync: Change log enabled");
+		storage->changelog = TRUE;
+	}
+
 	if ( !storage->allows_synchronization ) {
 		if ( (sflags & SIEVE_STORAGE_FLAG_SYNCHRONIZING) != 0 )
 			return -1;
@@ -48,6 +62,68 @@ void sieve_storage_sync_deinit
 	/* nothing */
 }
 
+/*
+ * Change log
+ */
+
+/* Each change is recorded as one line with tab-separated fields:
+   <unix time> <operation> <script name> <old name> <sha256 of content>.
+   Fields that don't apply to the operation are written as "-". */
+
+static const char *
+sieve_storage_changelog_hash(struct sieve_storage *storage, const char *name)
+{
+	struct sieve_script *script;
+	struct istream *input;
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_RESULTLEN];
+	const unsigned char *data;
+	size_t size;
+	const char *hash = "-";
+
+	script = sieve_storage_open_script(storage, name, NULL);
+	if ( script == NULL )
+		return hash;
+
+	if ( sieve_script_get_stream(script, &input, NULL) >= 0 ) {
+		sha256_init(&ctx);
+		i_stream_seek(input, 0);
+		while ( i_stream_read_more(input, &data, &size) > 0 ) {
+			sha256_loop(&ctx, data, size);
+			i_stream_skip(input, size);
+		}
+		if ( input->stream_errno == 0 ) {
+			sha256_result(&ctx, digest);
+			hash = binary_to_hex(digest, sizeof(digest));
+		}
+	}
+
+	sieve_script_unref(&script);
+	return hash;
+}
+
+static void sieve_storage_changelog_add
+(struct sieve_storage *storage, const char *operation,
+	const char *name, const char *oldname, bool hash)
+{
+	string_t *entry;
+
+	if ( !storage->changelog )
+		return;
+
+	entry = t_str_new(256);
+	str_printfa(entry, "%ld\t%s\t", (long)ioloop_time, operation);
+	str_append_tabescaped(entry, (name == NULL ? "-" : name));
+	str_append_c(entry, '\t');
+	str_append_tabescaped(entry, (oldname == NULL ? "-" : oldname));
+	str_append_c(entry, '\t');
+	str_append(entry, (hash && name != NULL ?
+		sieve_storage_changelog_hash(storage, name) : "-"));
+	str_append_c(entry, '\n');
+
+	(void)storage->v.changelog_append(storage, str_c(entry));
+}
+
 /*
  * Sync attributes
  */
@@ -106,6 +182,8 @@ int sieve_storage_sync_script_save
 	const char *key;
 	int ret;
 
+	sieve_storage_changelog_add(storage, "save", name, NULL, TRUE);
+
 	if ((ret=sieve_storage_sync_transaction_begin
 		(storage, &trans)) <= 0)
 		return ret;
@@ -126,6 +204,8 @@ int sieve_storage_sync_script_rename
 	const char *oldkey, *newkey;
 	int ret;
 
+	sieve_storage_changelog_add(storage, "rename", newname, oldname, FALSE);
+
 	if ((ret=sieve_storage_sync_transaction_begin
 		(storage, &trans)) <= 0)
 		return ret;
@@ -148,6 +228,8 @@ int sieve_storage_sync_script_delete
 	const char *key;
 	int ret;
 
+	sieve_storage_changelog_add(storage, "delete", name, NULL, FALSE);
+
 	if ((ret=sieve_storage_sync_transaction_begin
 		(storage, &trans)) <= 0)
 		return ret;
@@ -161,11 +243,13 @@ int sieve_storage_sync_script_delete
 }
 
 int sieve_storage_sync_script_activate
-(struct sieve_storage *storage)
+(struct sieve_storage *storage, const char *name)
 {
 	struct mailbox_transaction_context *trans;
 	int ret;
 
+	sieve_storage_changelog_add(storage, "activate", name, NULL, FALSE);
+
 	if ((ret=sieve_storage_sync_transaction_begin
 		(storage, &trans)) <= 0)
 		return ret;
@@ -182,6 +266,8 @@ int sieve_storage_sync_deactivate
 	struct mailbox_transaction_context *trans;
 	int ret;
 
+	sieve_storage_changelog_add(storage, "deactivate", NULL, NULL, FALSE);
+
 	if ((ret=sieve_storage_sync_transaction_begin
 		(storage, &trans)) <= 0)
 		return ret;
@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "str-sanitize.h"
 #include "home-expand.h"
 #include "eacces-error.h"
@@ -11,6 +12,7 @@
 
 #include "sieve-common.h"
 #include "sieve-settings.h"
+#include "sieve-binary.h"
 #include "sieve-error-private.h"
 
 #include "sieve-script-private.h"
@@ -471,6 +473,155 @@ sieve_storage_do_create_main(struct sieve_instance *svinst,
 	return storage;
 }
 
+/*
+ * Absent personal storage
+ */
+
+/* Users found to have no personal storage are remembered by the process for
+   sieve_personal_absent_cache_ttl, so that repeated deliveries for them need
+   not probe the storage location again */
+
+#define SIEVE_STORAGE_ABSENT_CACHE_MAX_ENTRIES 4096
+
+struct sieve_storage_absent_entry {
+	char *key;
+	time_t expires;
+};
+
+static HASH_TABLE(char *, struct sieve_storage_absent_entry *) absent_cache;
+
+static void sieve_storage_absent_entry_free(struct sieve_storage_absent_entry *entry)
+{
+	hash_table_remove(absent_cache, entry->key);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+static void sieve_storage_absent_cache_expire(void)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_storage_absent_entry *entry;
+	char *key;
+
+	iter = hash_table_iterate_init(absent_cache);
+	while (hash_table_iterate(iter, absent_cache, &key, &entry)) {
+		if (entry->expires <= ioloop_time)
+			sieve_storage_absent_entry_free(entry);
+	}
+	hash_table_iterate_deinit(&iter);
+}
+
+static unsigned int
+sieve_storage_absent_cache_ttl(struct sieve_instance *svinst)
+{
+	sieve_number_t ttl;
+
+	if (svinst->username == NULL ||
+	    !sieve_setting_get_duration_value(
+		svinst, "sieve_personal_absent_cache_ttl", &ttl))
+		return 0;
+	return (ttl > UINT_MAX ? UINT_MAX : (unsigned int)ttl);
+}
+
+static const char *sieve_storage_absent_key(struct sieve_instance *svinst)
+{
+	const char *set_sieve = sieve_setting_get(svinst, "sieve");
+
+	return t_strconcat(svinst->username, "\n",
+			   (set_sieve == NULL ? "" : set_sieve), NULL);
+}
+
+static bool sieve_storage_main_is_absent(struct sieve_instance *svinst)
+{
+	struct sieve_storage_absent_entry *entry;
+	bool absent = FALSE;
+
+	/* Explicit marker, e.g. returned by userdb */
+	if (sieve_setting_get_bool_value(svinst, "sieve_personal_absent",
+					 &absent) && absent) {
+		e_debug(svinst->event, "storage: "
+			"User has no personal storage (sieve_personal_absent)");
+		return TRUE;
+	}
+
+	if (!hash_table_is_created(absent_cache) ||
+	    sieve_storage_absent_cache_ttl(svinst) == 0)
+		return FALSE;
+
+	entry = hash_table_lookup(absent_cache,
+				  sieve_storage_absent_key(svinst));
+	if (entry == NULL)
+		return FALSE;
+	if (entry->expires <= ioloop_time) {
+		sieve_storage_absent_entry_free(entry);
+		return FALSE;
+	}
+
+	e_debug(svinst->event, "storage: "
+		"User is known to have no personal storage");
+	return TRUE;
+}
+
+static void sieve_storage_main_set_absent(struct sieve_instance *svinst)
+{
+	struct sieve_storage_absent_entry *entry;
+	unsigned int ttl = sieve_storage_absent_cache_ttl(svinst);
+	const char *key;
+
+	if (ttl == 0)
+		return;
+
+	if (!hash_table_is_created(absent_cache)) {
+		hash_table_create(&absent_cache, default_pool, 0,
+				  str_hash, strcmp);
+	} else if (hash_table_count(absent_cache) >=
+		   SIEVE_STORAGE_ABSENT_CACHE_MAX_ENTRIES) {
+		sieve_storage_absent_cache_expire();
+		if (hash_table_count(absent_cache) >=
+		    SIEVE_STORAGE_ABSENT_CACHE_MAX_ENTRIES)
+			return;
+	}
+
+	key = sieve_storage_absent_key(svinst);
+	entry = hash_table_lookup(absent_cache, key);
+	if (entry == NULL) {
+		entry = i_new(struct sieve_storage_absent_entry, 1);
+		entry->key = i_strdup(key);
+		hash_table_insert(absent_cache, entry->key, entry);
+	}
+	entry->expires = ioloop_time + ttl;
+}
+
+static void sieve_storage_absent_cache_free(void)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_storage_absent_entry *entry;
+	char *key;
+
+	if (!hash_table_is_created(absent_cache))
+		return;
+
+	iter = hash_table_iterate_init(absent_cache);
+	while (hash_table_iterate(iter, absent_cache, &key, &entry)) {
+		i_free(entry->key);
+		i_free(entry);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&absent_cache);
+}
+
+void sieve_storages_caches_free(void)
+{
+	sieve_storage_absent_cache_free();
+	sieve_file_storage_caches_free();
+	sieve_dict_storage_caches_free();
+	sieve_ldap_storage_caches_free();
+}
+
+/*
+ * Main storage
+ */
+
 struct sieve_storage *
 sieve_storage_create_main(struct sieve_instance *svinst, struct mail_user *user,
 			  enum sieve_storage_flags flags,
@@ -479,11 +630,14 @@ sieve_storage_create_main(struct sieve_instance *svinst, struct mail_user *user,
 	struct sieve_storage *storage;
 	const char *set_enabled, *set_default, *set_default_name;
 	enum sieve_error error;
+	bool readonly;
 
 	if (error_r != NULL)
 		*error_r = SIEVE_ERROR_NONE;
 	else
 		error_r = &error;
+	readonly = ((flags & SIEVE_STORAGE_FLAG_SYNCHRONIZING) == 0 &&
+		    (flags & SIEVE_STORAGE_FLAG_READWRITE) == 0);
 
 	/* Check whether Sieve is disabled for this user */
 	if ((set_enabled = sieve_setting_get(svinst, "sieve_enabled")) != NULL &&
@@ -497,8 +651,18 @@ sieve_storage_create_main(struct sieve_instance *svinst, struct mail_user *user,
 	/* Determine location for default script */
 	set_default = sieve_setting_get(svinst, "sieve_default");
 
-	/* Attempt to locate user's main storage */
-	storage = sieve_storage_do_create_main(svinst, user, flags, error_r);
+	/* Attempt to locate user's main storage (scripts can still be created
+	   for users marked as absent) */
+	if (readonly && sieve_storage_main_is_absent(svinst)) {
+		storage = NULL;
+		*error_r = SIEVE_ERROR_NOT_FOUND;
+	} else {
+		storage = sieve_storage_do_create_main(svinst, user, flags,
+						       error_r);
+		if (storage == NULL && readonly &&
+		    *error_r == SIEVE_ERROR_NOT_FOUND)
+			sieve_storage_main_set_absent(svinst);
+	}
 	if (storage != NULL) {
 		/* Success; record default script location for later use */
 		storage->default_location =
@@ -522,9 +686,7 @@ sieve_storage_create_main(struct sieve_instance *svinst, struct mail_user *user,
 				"Default script at `%s' is visible by name `%s'",
 				storage->default_location, storage->default_name);
 		}
-	} else if (*error_r != SIEVE_ERROR_TEMP_FAILURE &&
-		   (flags & SIEVE_STORAGE_FLAG_SYNCHRONIZING) == 0 &&
-		   (flags & SIEVE_STORAGE_FLAG_READWRITE) == 0) {
+	} else if (*error_r != SIEVE_ERROR_TEMP_FAILURE && readonly) {
 
 		/* Failed; try using default script location
 		   (not for temporary failures, read/write access, or dsync) */
@@ -652,6 +814,13 @@ int sieve_storage_is_singular(struct sieve_storage *storage)
 	return storage->v.is_singular(storage);
 }
 
+void sieve_storage_release_memory(struct sieve_storage *storage)
+{
+	if (storage->v.release_memory == NULL)
+		return;
+	storage->v.release_memory(storage);
+}
+
 int sieve_storage_get_last_change(struct sieve_storage *storage,
 				  time_t *last_change_r)
 {
@@ -1062,6 +1231,41 @@ static void sieve_storage_save_cleanup(struct sieve_storage_save_context *sctx)
 		sieve_script_unref(&sctx->scriptobject);
 }
 
+void sieve_storage_save_set_binary(struct sieve_storage_save_context *sctx,
+				   struct sieve_binary *sbin)
+{
+	i_assert(sctx->binary == NULL);
+
+	sieve_binary_ref(sbin);
+	sctx->binary = sbin;
+}
+
+static void
+sieve_storage_save_binary(struct sieve_storage_save_context *sctx,
+			  const char *scriptname)
+{
+	struct sieve_storage *storage = sctx->storage;
+	struct sieve_script *script;
+	enum sieve_error error;
+
+	script = sieve_storage_open_script(storage, scriptname, &error);
+	if (script == NULL) {
+		e_debug(sctx->event, "Not saving binary: "
+			"Failed to open stored script: %s",
+			sieve_storage_get_last_error(storage, NULL));
+		return;
+	}
+
+	sieve_binary_rebind_script(sctx->binary, script);
+	if (sieve_script_binary_save(script, sctx->binary, FALSE, &error) < 0) {
+		e_debug(sctx->event, "Failed to save binary for script "
+			"(will be compiled at first use)");
+	} else {
+		e_debug(sctx->event, "Saved binary for script");
+	}
+	sieve_script_unref(&script);
+}
+
 static void sieve_storage_save_deinit(struct sieve_storage_save_context **_sctx)
 {
 	struct sieve_storage_save_context *sctx = *_sctx;
@@ -1071,6 +1275,8 @@ static void sieve_storage_save_deinit(struct sieve_storage_save_context **_sctx)
 		return;
 
 	sieve_storage_save_cleanup(sctx);
+	if (sctx->binary != NULL)
+		sieve_binary_unref(&sctx->binary);
 	event_unref(&sctx->event);
 	pool_unref(&sctx->pool);
 }
@@ -1265,6 +1471,9 @@ int sieve_storage_save_commit(struct sieve_storage_save_context **_sctx)
 		}
 	}
 
+	if (ret >= 0 && sctx->binary != NULL)
+		sieve_storage_save_binary(sctx, scriptname);
+
 	if (ret >= 0) {
 		struct event_passthrough *e =
 			event_create_passthrough(sctx->event)->
@@ -1287,6 +1496,17 @@ int sieve_storage_save_commit(struct sieve_storage_save_context **_sctx)
 	return ret;
 }
 
+void sieve_storage_save_batch_begin(struct sieve_storage *storage)
+{
+	storage->save_batch++;
+}
+
+void sieve_storage_save_batch_end(struct sieve_storage *storage)
+{
+	i_assert(storage->save_batch > 0);
+	storage->save_batch--;
+}
+
 void sieve_storage_save_cancel(struct sieve_storage_save_context **_sctx)
 {
 	struct sieve_storage_save_context *sctx = *_sctx;
@@ -109,10 +109,23 @@ bool sieve_storage_save_will_activate(struct sieve_storage_save_context *sctx);
 void sieve_storage_save_set_mtime(struct sieve_storage_save_context *sctx,
 				  time_t mtime);
 
+/* Saves the binary compiled from the uploaded script along with the script
+   when the save is committed, so that the script is not compiled again when
+   it is first executed. Failing to save the binary does not fail the
+   commit. */
+void sieve_storage_save_set_binary(struct sieve_storage_save_context *sctx,
+				   struct sieve_binary *sbin);
+
 void sieve_storage_save_cancel(struct sieve_storage_save_context **sctx);
 
 int sieve_storage_save_commit(struct sieve_storage_save_context **sctx);
 
+/* Within a save batch, the storage may skip flushing each finished script to
+   disk individually. All finished scripts are then flushed at once before the
+   first of them is committed, so each commit is still atomic and durable. */
+void sieve_storage_save_batch_begin(struct sieve_storage *storage);
+void sieve_storage_save_batch_end(struct sieve_storage *storage);
+
 int sieve_storage_save_as(struct sieve_storage *storage, struct istream *input,
 			  const char *name);
 
@@ -159,6 +172,10 @@ bool sieve_storage_is_default(const struct sieve_storage *storage) ATTR_PURE;
 
 int sieve_storage_is_singular(struct sieve_storage *storage);
 
+/* Drop cached state (e.g. directory listings) that is only kept to speed up
+   subsequent requests; it is rebuilt when needed. */
+void sieve_storage_release_memory(struct sieve_storage *storage);
+
 /*
  * Error handling
  */
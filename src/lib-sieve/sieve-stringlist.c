@@ -61,6 +61,24 @@ int sieve_stringlist_get_length
 	return strlist->get_length(strlist);
 }
 
+int sieve_stringlist_skip_items
+(struct sieve_stringlist *strlist, unsigned int count)
+{
+	const char *data;
+	size_t size;
+	int ret;
+
+	if ( strlist->skip_items != NULL )
+		return strlist->skip_items(strlist, count);
+
+	for ( ; count > 0; count-- ) {
+		if ( (ret=sieve_stringlist_next_item_data
+			(strlist, &data, &size)) <= 0 )
+			return ret;
+	}
+	return 1;
+}
+
 /*
  * Single Stringlist
  */
@@ -219,16 +237,23 @@ static int sieve_index_stringlist_next_item
 	}
 
 	i_assert(index > 0);
-	while ( index > 0 ) {
-		if ( (ret=sieve_stringlist_next_item(strlist->source, str_r)) <= 0 ) {
+	if ( index > 1 ) {
+		/* Sources with random access jump to the item directly */
+		if ( (ret=sieve_stringlist_skip_items
+			(strlist->source, index - 1)) <= 0 ) {
 			if (ret < 0)
 				_strlist->exec_status = strlist->source->exec_status;
+			*str_r = NULL;
+			strlist->end = TRUE;
 			return ret;
 		}
-	
-		index--;
 	}
-		
+	if ( (ret=sieve_stringlist_next_item(strlist->source, str_r)) <= 0 ) {
+		if (ret < 0)
+			_strlist->exec_status = strlist->source->exec_status;
+		return ret;
+	}
+
 	strlist->end = TRUE;
 	return 1;
 }
@@ -1,6 +1,8 @@
 #ifndef SIEVE_STRINGLIST_H
 #define SIEVE_STRINGLIST_H
 
+#include "str.h"
+
 /*
  * Stringlist API
  */
@@ -8,10 +10,17 @@
 struct sieve_stringlist {
 	int (*next_item)
 		(struct sieve_stringlist *strlist, string_t **str_r);
+	/* Optional: return the next item without creating a string for it */
+	int (*next_item_data)
+		(struct sieve_stringlist *strlist, const char **data_r,
+			size_t *size_r);
 	void (*reset)
 		(struct sieve_stringlist *strlist);
 	int (*get_length)
 		(struct sieve_stringlist *strlist);
+	/* Optional: skip items without retrieving them */
+	int (*skip_items)
+		(struct sieve_stringlist *strlist, unsigned int count);
 
 	int (*read_all)
 		(struct sieve_stringlist *strlist, pool_t pool,
@@ -41,6 +50,25 @@ static inline int sieve_stringlist_next_item
 	return strlist->next_item(strlist, str_r);
 }
 
+/* Returns the next item as borrowed data, which is NUL-terminated and only
+   valid until the next call for this list. Lists that keep their items in
+   memory return these directly; for others a string is created as usual. */
+static inline int sieve_stringlist_next_item_data
+(struct sieve_stringlist *strlist, const char **data_r, size_t *size_r)
+{
+	string_t *str;
+	int ret;
+
+	if ( strlist->next_item_data != NULL )
+		return strlist->next_item_data(strlist, data_r, size_r);
+
+	if ( (ret=strlist->next_item(strlist, &str)) <= 0 )
+		return ret;
+	*data_r = str_c(str);
+	*size_r = str_len(str);
+	return 1;
+}
+
 static inline void sieve_stringlist_reset
 (struct sieve_stringlist *strlist)
 {
@@ -50,6 +78,11 @@ static inline void sieve_stringlist_reset
 int sieve_stringlist_get_length
 	(struct sieve_stringlist *strlist);
 
+/* Skips the next count items. Returns 1 when all were skipped, 0 when the
+   list ended before that and -1 on error. */
+int sieve_stringlist_skip_items
+	(struct sieve_stringlist *strlist, unsigned int count);
+
 int sieve_stringlist_read_all
 	(struct sieve_stringlist *strlist, pool_t pool,
 		const char * const **list_r);
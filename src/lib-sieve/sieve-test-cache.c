@@ -0,0 +1,101 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "hash.h"
+#include "hex-binary.h"
+
+#include "sieve-common.h"
+#include "sieve-binary.h"
+
+#include "sieve-test-cache.h"
+
+struct sieve_test_cache {
+	pool_t pool;
+
+	/* "<code digest>:<block id>:<address>" => result + 1 */
+	HASH_TABLE(char *, void *) results;
+};
+
+struct sieve_test_cache *sieve_test_cache_create(void)
+{
+	struct sieve_test_cache *cache;
+
+	cache = i_new(struct sieve_test_cache, 1);
+	cache->pool = pool_alloconly_create("sieve_test_cache", 1024);
+	hash_table_create(&cache->results, default_pool, 0, str_hash, strcmp);
+
+	return cache;
+}
+
+void sieve_test_cache_free(struct sieve_test_cache **_cache)
+{
+	struct sieve_test_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (cache == NULL)
+		return;
+
+	hash_table_destroy(&cache->results);
+	pool_unref(&cache->pool);
+	i_free(cache);
+}
+
+void sieve_test_cache_clear(struct sieve_test_cache *cache)
+{
+	hash_table_clear(cache->results, TRUE);
+	p_clear(cache->pool);
+}
+
+static const char *
+sieve_test_cache_key(struct sieve_binary_block *sblock, sieve_size_t address)
+{
+	struct sieve_binary *sbin = sieve_binary_block_get_binary(sblock);
+	unsigned char digest[SHA1_RESULTLEN];
+
+	/* Binaries are identified by their code rather than their location, so
+	   that scripts generated from the same template share their results */
+	if (!sieve_binary_get_code_digest(sbin, digest))
+		return NULL;
+
+	return t_strdup_printf("%s:%u:%llu",
+			       binary_to_hex(digest, sizeof(digest)),
+			       sieve_binary_block_get_id(sblock),
+			       (unsigned long long)address);
+}
+
+bool sieve_test_cache_lookup(struct sieve_test_cache *cache,
+			     struct sieve_binary_block *sblock,
+			     sieve_size_t address, bool *result_r)
+{
+	const char *key;
+	void *value;
+
+	*result_r = FALSE;
+
+	key = sieve_test_cache_key(sblock, address);
+	if (key == NULL)
+		return FALSE;
+
+	value = hash_table_lookup(cache->results, key);
+	if (value == NULL)
+		return FALSE;
+
+	*result_r = (POINTER_CAST_TO(value, unsigned int) - 1) != 0;
+	return TRUE;
+}
+
+void sieve_test_cache_add(struct sieve_test_cache *cache,
+			  struct sieve_binary_block *sblock,
+			  sieve_size_t address, bool result)
+{
+	const char *key;
+
+	key = sieve_test_cache_key(sblock, address);
+	if (key == NULL)
+		return;
+
+	hash_table_update(cache->results, p_strdup(cache->pool, key),
+			  POINTER_CAST((result ? 1 : 0) + 1));
+}
@@ -0,0 +1,33 @@
+#ifndef SIEVE_TEST_CACHE_H
+#define SIEVE_TEST_CACHE_H
+
+#include "sieve-common.h"
+
+/*
+ * Test result cache
+ */
+
+/* The test result cache records the outcome of tests that were marked as
+   recipient-independent by the validator (only examining the message itself
+   using constant arguments). The delivery agent can keep a cache for the
+   duration of a transaction, so that scripts executed for each recipient of
+   the same message evaluate these tests only once. Results are keyed by the
+   code digest of the binary, program block and code address; personal
+   scripts with identical content therefore share their results as well. */
+
+struct sieve_test_cache;
+
+struct sieve_test_cache *sieve_test_cache_create(void);
+void sieve_test_cache_free(struct sieve_test_cache **_cache);
+
+/* Forget all results (e.g. when the next message is processed) */
+void sieve_test_cache_clear(struct sieve_test_cache *cache);
+
+bool sieve_test_cache_lookup(struct sieve_test_cache *cache,
+			     struct sieve_binary_block *sblock,
+			     sieve_size_t address, bool *result_r);
+void sieve_test_cache_add(struct sieve_test_cache *cache,
+			  struct sieve_binary_block *sblock,
+			  sieve_size_t address, bool result);
+
+#endif
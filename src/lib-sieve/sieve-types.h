@@ -180,7 +180,9 @@ typedef enum {
 
 enum {
 	SIEVE_TRFLG_DEBUG = (1 << 0),
-	SIEVE_TRFLG_ADDRESSES = (1 << 1)
+	SIEVE_TRFLG_ADDRESSES = (1 << 1),
+	/* Report time spent per source line at the end of the script */
+	SIEVE_TRFLG_PROFILE = (1 << 2)
 };
 
 struct sieve_trace_config {
@@ -213,6 +215,10 @@ struct sieve_script_env {
 	bool mailbox_autocreate;
 	bool mailbox_autosubscribe;
 
+	/* Store actions of successive executions share one mailbox transaction
+	   per target mailbox when set (see sieve_store_batch_create()) */
+	struct sieve_store_batch *store_batch;
+
 	/* External context data */
 
 	void *script_context;
@@ -238,6 +244,13 @@ struct sieve_script_env {
 	int (*smtp_finish)
 		(const struct sieve_script_env *senv, void *handle,
 			const char **error_r);
+	/* Optional: like smtp_finish(), but the environment may return before
+	   the submission is complete. The message is then submitted in the
+	   background and any failure is logged by the environment using the
+	   provided description. */
+	void (*smtp_finish_async)
+		(const struct sieve_script_env *senv, void *handle,
+			const char *description);
 
 	/* Interface for marking and checking duplicates */
 	void *(*duplicate_transaction_begin)(
@@ -268,6 +281,13 @@ struct sieve_script_env {
 	/* Runtime trace*/
 	struct sieve_trace_log *trace_log;
 	struct sieve_trace_config trace_config;
+
+	/* Results of recipient-independent tests shared between executions
+	   for the same message (sieve-test-cache.h); NULL to disable */
+	struct sieve_test_cache *test_cache;
+	/* Parsed message data shared between executions for the same message
+	   (sieve-message.h); NULL to disable */
+	struct sieve_message_analysis *message_analysis;
 };
 
 #define SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) \
@@ -281,6 +301,33 @@ struct sieve_resource_usage {
 	/* The total amount of system + user CPU time consumed while executing
 	   the Sieve script. */
 	unsigned int cpu_time_msecs;
+
+	/* The number of header field lookups that went to the mail (repeated
+	   lookups of the same field are served from a cache) */
+	unsigned int header_fetches;
+	/* The number of (decoded) message body bytes extracted for tests */
+	unsigned int body_bytes;
+	/* The number of external programs run from the script */
+	unsigned int program_runs;
+};
+
+/*
+ * Cache statistics
+ */
+
+struct sieve_cache_statistics {
+	/* Lookups that found a (valid) entry and those that did not */
+	uint64_t hits, misses;
+	/* Entries dropped to make room or because these were idle */
+	uint64_t evictions;
+
+	unsigned int entries;
+	size_t memory;
+};
+
+struct sieve_statistics {
+	struct sieve_cache_statistics binary_cache;
+	struct sieve_cache_statistics html_text_cache;
 };
 
 /*
@@ -17,6 +17,7 @@
 #include "sieve-validator.h"
 
 #include "sieve-comparators.h"
+#include "sieve-match-types.h"
 #include "sieve-address-parts.h"
 
 /*
@@ -41,6 +42,7 @@ struct sieve_tag_registration {
 	const char *identifier;
 	int id_code;
 };
+ARRAY_DEFINE_TYPE(sieve_tag_registration, struct sieve_tag_registration *);
 
 /* Command registration */
 
@@ -48,9 +50,11 @@ struct sieve_command_registration {
 	const struct sieve_command_def *cmd_def;
 	const struct sieve_extension *ext;
 
-	ARRAY(struct sieve_tag_registration *) normal_tags;
-	ARRAY(struct sieve_tag_registration *) instanced_tags;
-	ARRAY(struct sieve_tag_registration *) persistent_tags;
+	ARRAY_TYPE(sieve_tag_registration) normal_tags;
+	ARRAY_TYPE(sieve_tag_registration) instanced_tags;
+	ARRAY_TYPE(sieve_tag_registration) persistent_tags;
+	/* Owned by the instance's template; copied before modification */
+	bool shared:1;
 };
 
 /* Default (literal) arguments */
@@ -111,6 +115,72 @@ struct sieve_validator {
  * Validator object
  */
 
+/* The core commands and their tags are the same for every script, so these
+   are registered only once per instance. Each validator starts with a copy of
+   this table that points to the shared registrations; a registration is
+   duplicated before it is modified (e.g. by an extension adding a tag). */
+
+static struct sieve_validator *
+sieve_validator_template_get(struct sieve_instance *svinst)
+{
+	struct sieve_validator *tmpl = svinst->validator_template;
+	struct hash_iterate_context *hctx;
+	struct sieve_command_registration *cmd_reg;
+	const char *identifier;
+	pool_t pool;
+
+	if (tmpl != NULL)
+		return tmpl;
+
+	pool = pool_alloconly_create("sieve_validator_template", 4096);
+	tmpl = p_new(pool, struct sieve_validator, 1);
+	tmpl->pool = pool;
+	tmpl->svinst = svinst;
+
+	hash_table_create(&tmpl->commands, pool, 0, strcase_hash, strcasecmp);
+	sieve_validator_register_core_commands(tmpl);
+	sieve_validator_register_core_tests(tmpl);
+
+	/* Freeze */
+	hctx = hash_table_iterate_init(tmpl->commands);
+	while (hash_table_iterate(hctx, tmpl->commands, &identifier, &cmd_reg))
+		cmd_reg->shared = TRUE;
+	hash_table_iterate_deinit(&hctx);
+
+	svinst->validator_template = tmpl;
+	return tmpl;
+}
+
+void sieve_validator_template_free(struct sieve_instance *svinst)
+{
+	struct sieve_validator *tmpl = svinst->validator_template;
+
+	if (tmpl == NULL)
+		return;
+	svinst->validator_template = NULL;
+
+	hash_table_destroy(&tmpl->commands);
+	pool_unref(&tmpl->pool);
+}
+
+static void sieve_validator_commands_init(struct sieve_validator *valdtr)
+{
+	struct sieve_validator *tmpl =
+		sieve_validator_template_get(valdtr->svinst);
+	struct hash_iterate_context *hctx;
+	struct sieve_command_registration *cmd_reg;
+	const char *identifier;
+
+	hash_table_create(&valdtr->commands, valdtr->pool,
+			  hash_table_count(tmpl->commands) + 16,
+			  strcase_hash, strcasecmp);
+
+	hctx = hash_table_iterate_init(tmpl->commands);
+	while (hash_table_iterate(hctx, tmpl->commands, &identifier, &cmd_reg))
+		hash_table_insert(valdtr->commands, identifier, cmd_reg);
+	hash_table_iterate_deinit(&hctx);
+}
+
 struct sieve_validator *
 sieve_validator_create(struct sieve_ast *ast,
 		       struct sieve_error_handler *ehandler,
@@ -121,7 +191,8 @@ sieve_validator_create(struct sieve_ast *ast,
 	const struct sieve_extension *const *ext_preloaded;
 	unsigned int i, ext_count;
 
-	pool = pool_alloconly_create("sieve_validator", 16384);
+	pool = sieve_compile_pool_get(
+		sieve_script_svinst(sieve_ast_script(ast)));
 	valdtr = p_new(pool, struct sieve_validator, 1);
 	valdtr->pool = pool;
 
@@ -150,9 +221,7 @@ sieve_validator_create(struct sieve_ast *ast,
 		     sieve_extensions_get_count(valdtr->svinst));
 
 	/* Setup command registry */
-	hash_table_create(&valdtr->commands, pool, 0, strcase_hash, strcasecmp);
-	sieve_validator_register_core_commands(valdtr);
-	sieve_validator_register_core_tests(valdtr);
+	sieve_validator_commands_init(valdtr);
 
 	/* Pre-load core language features implemented as 'extensions' */
 	ext_preloaded =
@@ -186,7 +255,7 @@ void sieve_validator_free(struct sieve_validator **valdtr)
 					      extrs[i].context);
 	}
 
-	pool_unref(&(*valdtr)->pool);
+	sieve_compile_pool_put((*valdtr)->svinst, &(*valdtr)->pool);
 
 	*valdtr = NULL;
 }
@@ -285,6 +354,42 @@ sieve_validator_find_command_registration(struct sieve_validator *valdtr,
 	return hash_table_lookup(valdtr->commands, command);
 }
 
+static void
+sieve_validator_copy_tags(struct sieve_validator *valdtr,
+			  ARRAY_TYPE(sieve_tag_registration) *dest,
+			  const ARRAY_TYPE(sieve_tag_registration) *src)
+{
+	if (!array_is_created(src))
+		return;
+	p_array_init(dest, valdtr->pool, array_count(src) + 4);
+	array_append_array(dest, src);
+}
+
+/* Returns a registration that may be modified by this validator */
+static struct sieve_command_registration *
+sieve_validator_command_registration_own(
+	struct sieve_validator *valdtr, const char *identifier,
+	struct sieve_command_registration *cmd_reg)
+{
+	struct sieve_command_registration *new_reg;
+
+	if (!cmd_reg->shared)
+		return cmd_reg;
+
+	new_reg = p_new(valdtr->pool, struct sieve_command_registration, 1);
+	new_reg->cmd_def = cmd_reg->cmd_def;
+	new_reg->ext = cmd_reg->ext;
+	sieve_validator_copy_tags(valdtr, &new_reg->normal_tags,
+				  &cmd_reg->normal_tags);
+	sieve_validator_copy_tags(valdtr, &new_reg->instanced_tags,
+				  &cmd_reg->instanced_tags);
+	sieve_validator_copy_tags(valdtr, &new_reg->persistent_tags,
+				  &cmd_reg->persistent_tags);
+
+	hash_table_update(valdtr->commands, identifier, new_reg);
+	return new_reg;
+}
+
 static struct sieve_command_registration *
 _sieve_validator_register_command(struct sieve_validator *valdtr,
 				  const struct sieve_extension *ext,
@@ -314,6 +419,8 @@ void sieve_validator_register_command(struct sieve_validator *valdtr,
 		cmd_reg = _sieve_validator_register_command(
 			valdtr, ext, cmd_def, cmd_def->identifier);
 	} else {
+		cmd_reg = sieve_validator_command_registration_own(
+			valdtr, cmd_def->identifier, cmd_reg);
 		cmd_reg->cmd_def = cmd_def;
 		cmd_reg->ext = ext;
 	}
@@ -334,6 +441,8 @@ sieve_validator_register_unknown_command(struct sieve_validator *valdtr,
 			valdtr, NULL, &unknown_command, command);
 	} else {
 		i_assert(cmd_reg->cmd_def == NULL);
+		cmd_reg = sieve_validator_command_registration_own(
+			valdtr, command, cmd_reg);
 		cmd_reg->cmd_def = &unknown_command;
 	}
 }
@@ -384,6 +493,8 @@ _sieve_validator_register_tag(struct sieve_validator *valdtr,
 {
 	struct sieve_tag_registration *reg;
 
+	i_assert(!cmd_reg->shared);
+
 	reg = p_new(valdtr->pool, struct sieve_tag_registration, 1);
 	reg->ext = ext;
 	reg->tag_def = tag_def;
@@ -413,6 +524,9 @@ void sieve_validator_register_persistent_tag(
 		if (cmd_reg == NULL) {
 			cmd_reg = _sieve_validator_register_command(
 				valdtr, NULL, NULL, command);
+		} else {
+			cmd_reg = sieve_validator_command_registration_own(
+				valdtr, command, cmd_reg);
 		}
 
 		struct sieve_tag_registration *reg;
@@ -450,6 +564,9 @@ void sieve_validator_register_external_tag(
 	if (cmd_reg == NULL) {
 		cmd_reg = _sieve_validator_register_command(
 			valdtr, NULL, NULL, command);
+	} else {
+		cmd_reg = sieve_validator_command_registration_own(
+			valdtr, command, cmd_reg);
 	}
 
 	_sieve_validator_register_tag(valdtr, cmd_reg, ext, tag_def,
@@ -468,6 +585,8 @@ void sieve_validator_register_tag(
 	} else {
 		struct sieve_tag_registration *reg =
 			p_new(valdtr->pool, struct sieve_tag_registration, 1);
+
+		i_assert(!cmd_reg->shared);
 		reg->ext = ext;
 		reg->tag_def = tag_def;
 		reg->id_code = id_code;
@@ -481,10 +600,12 @@ void sieve_validator_register_tag(
 
 static void
 sieve_validator_register_unknown_tag(struct sieve_validator *valdtr,
-				     struct sieve_command_registration *cmd_reg,
+				     struct sieve_command *cmd,
 				     const char *tag)
 {
-	_sieve_validator_register_tag(valdtr, cmd_reg, NULL,
+	cmd->reg = sieve_validator_command_registration_own(
+		valdtr, sieve_command_identifier(cmd), cmd->reg);
+	_sieve_validator_register_tag(valdtr, cmd->reg, NULL,
 				      &_unknown_tag, tag, 0);
 }
 
@@ -1023,7 +1144,7 @@ sieve_validate_command_arguments(struct sieve_validator *valdtr,
 				sieve_command_identifier(cmd),
 				sieve_command_type_name(cmd));
 			sieve_validator_register_unknown_tag(
-				valdtr, cmd_reg, sieve_ast_argument_tag(arg));
+				valdtr, cmd, sieve_ast_argument_tag(arg));
 			return FALSE;
 		}
 
@@ -1368,6 +1489,83 @@ sieve_validate_command_context(struct sieve_validator *valdtr,
 	return TRUE;
 }
 
+static bool
+sieve_validate_constant_arguments(struct sieve_command *cmd,
+				  struct sieve_ast_argument *arg)
+{
+	struct sieve_ast_argument *item;
+
+	for (; arg != NULL; arg = sieve_ast_argument_next(arg)) {
+		switch (sieve_ast_argument_type(arg)) {
+		case SAAT_NUMBER:
+			break;
+		case SAAT_STRING:
+			if (!sieve_argument_is_string_literal(arg))
+				return FALSE;
+			break;
+		case SAAT_STRING_LIST:
+			item = sieve_ast_strlist_first(arg);
+			for (; item != NULL; item = sieve_ast_strlist_next(item)) {
+				if (!sieve_argument_is_string_literal(item))
+					return FALSE;
+			}
+			break;
+		case SAAT_TAG:
+			if (arg->argument == NULL)
+				return FALSE;
+			if (sieve_argument_is(arg, match_type_tag)) {
+				const struct sieve_match_type_context *mtctx =
+					arg->argument->data;
+				const struct sieve_match_type_def *mcht_def =
+					mtctx->match_type->def;
+
+				/* Other match types may assign match values */
+				if (mcht_def != &is_match_type &&
+				    mcht_def != &contains_match_type)
+					return FALSE;
+			} else if (!sieve_argument_is(arg, comparator_tag) &&
+				   !sieve_argument_is(arg, address_part_tag) &&
+				   sieve_argument_ext(arg) != cmd->ext) {
+				/* Tags added by other extensions (e.g. :mime)
+				   may change what part of the message is
+				   examined */
+				return FALSE;
+			}
+			if (!sieve_validate_constant_arguments(
+				cmd, arg->parameters))
+				return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static bool
+sieve_validate_recipient_independent(struct sieve_command *tst)
+{
+	struct sieve_ast_node *node;
+
+	if (!tst->def->message_only)
+		return FALSE;
+
+	/* Loops provided by extensions (e.g. foreverypart) evaluate the same
+	   test repeatedly in a different context */
+	for (node = sieve_ast_node_parent(tst->ast_node);
+	     node != NULL && sieve_ast_node_type(node) != SAT_ROOT;
+	     node = sieve_ast_node_parent(node)) {
+		const struct sieve_command *cmd = node->command;
+
+		if (cmd == NULL ||
+		    (cmd->ext != NULL && cmd->def->block_allowed))
+			return FALSE;
+	}
+
+	return sieve_validate_constant_arguments(
+		tst, sieve_ast_argument_first(tst->ast_node));
+}
+
 static bool
 sieve_validate_command(struct sieve_validator *valdtr,
 		       struct sieve_ast_node *cmd_node, int *const_r)
@@ -1418,6 +1616,11 @@ sieve_validate_command(struct sieve_validator *valdtr,
 		}
 
 		result = result && sieve_validate_arguments_context(valdtr, cmd);
+
+		if (result && ast_type == SAT_TEST) {
+			cmd->recipient_independent =
+				sieve_validate_recipient_independent(cmd);
+		}
 	}
 
 	/*
@@ -1531,9 +1734,16 @@ sieve_validate_block(struct sieve_validator *valdtr,
 				/* Load implicit extensions */
 				exts = sieve_extensions_get_all(valdtr->svinst, &ext_count);
 				for (i = 0; i < ext_count; i++) {
-					if (exts[i]->implicit) {
+					const struct sieve_extension *ext;
+
+					if (!exts[i]->implicit)
+						continue;
+					/* Lookup triggers deferred loading */
+					ext = sieve_extension_get_by_id(
+						valdtr->svinst, exts[i]->id);
+					if (ext != NULL) {
 						(void)sieve_validator_extension_load(
-							valdtr, NULL, NULL, exts[i], TRUE);
+							valdtr, NULL, NULL, ext, TRUE);
 					}
 				}
 
@@ -31,6 +31,10 @@ sieve_validator_create(struct sieve_ast *ast,
 		       struct sieve_error_handler *ehandler,
 		       enum sieve_compile_flags flags);
 void sieve_validator_free(struct sieve_validator **valdtr);
+
+/* Frees the registry of core commands that is built once per instance and
+   shared by all validators. */
+void sieve_validator_template_free(struct sieve_instance *svinst);
 pool_t sieve_validator_pool(struct sieve_validator *valdtr);
 
 bool sieve_validator_run(struct sieve_validator *valdtr);
@@ -3,11 +3,14 @@
 
 #include "lib.h"
 #include "str.h"
+#include "array.h"
 #include "istream.h"
 #include "ostream.h"
 #include "buffer.h"
+#include "ioloop.h"
 #include "time-util.h"
 #include "eacces-error.h"
+#include "file-dotlock.h"
 #include "home-expand.h"
 #include "hostpid.h"
 #include "message-address.h"
@@ -21,15 +24,21 @@
 #include "sieve-script.h"
 #include "sieve-storage-private.h"
 #include "sieve-ast.h"
-#include "sieve-binary.h"
+#include "sieve-binary-private.h"
 #include "sieve-actions.h"
 #include "sieve-result.h"
 
 #include "sieve-parser.h"
 #include "sieve-validator.h"
 #include "sieve-generator.h"
+#include "sieve-optimizer.h"
 #include "sieve-interpreter.h"
 #include "sieve-binary-dumper.h"
+#include "sieve-binary-cache.h"
+#include "sieve-html-text-cache.h"
+#include "sieve-message.h"
+#include "sieve-duplicate-dict.h"
+#include "sieve-binary-dict.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -129,6 +138,23 @@ sieve_init(const struct sieve_environment *env,
 	/* Configure extensions */
 	sieve_extensions_configure(svinst);
 
+	if (svinst->binary_cache_size > 0) {
+		svinst->binary_cache = sieve_binary_cache_create(
+			svinst, svinst->binary_cache_size);
+	}
+	if (svinst->html_text_cache_size > 0) {
+		svinst->html_text_cache = sieve_html_text_cache_create(
+			svinst, svinst->html_text_cache_size);
+	}
+	if (svinst->duplicate_dict_uri != NULL) {
+		svinst->duplicate_dict = sieve_duplicate_dict_create(
+			svinst, svinst->duplicate_dict_uri);
+	}
+	if (svinst->binary_dict_uri != NULL) {
+		svinst->binary_dict = sieve_binary_dict_create(
+			svinst, svinst->binary_dict_uri);
+	}
+
 	return svinst;
 }
 
@@ -136,12 +162,29 @@ void sieve_deinit(struct sieve_instance **_svinst)
 {
 	struct sieve_instance *svinst = *_svinst;
 
+	sieve_instance_finished_event(svinst);
+
+	/* Cached binaries refer to extensions and storages */
+	sieve_binary_cache_free(&svinst->binary_cache);
+	sieve_html_text_cache_free(&svinst->html_text_cache);
+	sieve_message_raw_user_free(svinst);
+	sieve_duplicate_dict_free(&svinst->duplicate_dict);
+	sieve_binary_dict_free(&svinst->binary_dict);
+	sieve_optimizer_profile_free(&svinst->optimizer_profile);
+	sieve_validator_template_free(svinst);
+
+	if (svinst->compile_pool != NULL)
+		pool_unref(&svinst->compile_pool);
+	if (svinst->execute_pool != NULL)
+		pool_unref(&svinst->execute_pool);
+
 	sieve_plugins_unload(svinst);
 	sieve_storages_deinit(svinst);
 	sieve_extensions_deinit(svinst);
 	sieve_errors_deinit(svinst);
 
 	event_unref(&svinst->event);
+	sieve_settings_cache_clear(svinst);
 
 	pool_unref(&(svinst)->pool);
 	*_svinst = NULL;
@@ -161,6 +204,68 @@ sieve_get_capabilities(struct sieve_instance *svinst, const char *name)
 	return sieve_extension_capabilities_get_string(svinst, name);
 }
 
+void sieve_caches_free(void)
+{
+	sieve_binary_mmaps_free();
+	sieve_binary_usage_pending_free();
+	sieve_storages_caches_free();
+}
+
+void sieve_release_memory(struct sieve_instance *svinst)
+{
+	sieve_binary_cache_clear(svinst->binary_cache);
+	sieve_html_text_cache_clear(svinst->html_text_cache);
+
+	/* Pools that are still in use are left alone */
+	if (svinst->compile_pool != NULL && svinst->compile_pool_users == 0)
+		pool_unref(&svinst->compile_pool);
+	if (svinst->execute_pool != NULL && svinst->execute_pool_users == 0)
+		pool_unref(&svinst->execute_pool);
+}
+
+void sieve_get_statistics(struct sieve_instance *svinst,
+			  struct sieve_statistics *stats_r)
+{
+	i_zero(stats_r);
+	sieve_binary_cache_get_statistics(svinst->binary_cache,
+					  &stats_r->binary_cache);
+	sieve_html_text_cache_get_statistics(svinst->html_text_cache,
+					     &stats_r->html_text_cache);
+}
+
+static void sieve_instance_finished_event(struct sieve_instance *svinst)
+{
+	struct sieve_statistics stats;
+	struct event_passthrough *e;
+
+	if (svinst->binary_cache == NULL && svinst->html_text_cache == NULL)
+		return;
+
+	sieve_get_statistics(svinst, &stats);
+	e = event_create_passthrough(svinst->event)->
+		set_name("sieve_instance_finished")->
+		add_int("binary_cache_hits", stats.binary_cache.hits)->
+		add_int("binary_cache_misses", stats.binary_cache.misses)->
+		add_int("binary_cache_evictions", stats.binary_cache.evictions)->
+		add_int("binary_cache_entries", stats.binary_cache.entries)->
+		add_int("binary_cache_memory", stats.binary_cache.memory)->
+		add_int("html_text_cache_hits", stats.html_text_cache.hits)->
+		add_int("html_text_cache_misses", stats.html_text_cache.misses)->
+		add_int("html_text_cache_evictions",
+			stats.html_text_cache.evictions)->
+		add_int("html_text_cache_entries",
+			stats.html_text_cache.entries)->
+		add_int("html_text_cache_memory",
+			stats.html_text_cache.memory);
+	e_debug(e->event(), "Finished (binary cache: hits=%"PRIu64", "
+		"misses=%"PRIu64", evictions=%"PRIu64"; "
+		"html text cache: hits=%"PRIu64", misses=%"PRIu64", "
+		"evictions=%"PRIu64")",
+		stats.binary_cache.hits, stats.binary_cache.misses,
+		stats.binary_cache.evictions, stats.html_text_cache.hits,
+		stats.html_text_cache.misses, stats.html_text_cache.evictions);
+}
+
 struct event *sieve_get_event(struct sieve_instance *svinst)
 {
 	return svinst->event;
@@ -250,6 +355,7 @@ sieve_compile_script(struct sieve_script *script,
 		     enum sieve_compile_flags flags,
 		     enum sieve_error *error_r)
 {
+	struct sieve_instance *svinst = sieve_script_svinst(script);
 	struct sieve_ast *ast;
 	struct sieve_binary *sbin;
 	enum sieve_error error, *errorp;
@@ -286,6 +392,10 @@ sieve_compile_script(struct sieve_script *script,
  		return NULL;
  	}
 
+	/* Optimize */
+	if (svinst->optimize)
+		sieve_optimizer_run(ast, svinst->optimizer_profile);
+
 	/* Generate */
 	sbin = sieve_generate(ast, ehandler, flags, errorp);
 	if (sbin == NULL) {
@@ -300,6 +410,20 @@ sieve_compile_script(struct sieve_script *script,
 	return sbin;
 }
 
+int sieve_set_optimizer_profile(struct sieve_instance *svinst,
+				const char *path, const char **error_r)
+{
+	struct sieve_optimizer_profile *profile;
+
+	if (sieve_optimizer_profile_read(path, &profile, error_r) < 0)
+		return -1;
+
+	sieve_optimizer_profile_free(&svinst->optimizer_profile);
+	svinst->optimizer_profile = profile;
+	svinst->optimize = TRUE;
+	return 0;
+}
+
 struct sieve_binary *
 sieve_compile(struct sieve_instance *svinst, const char *script_location,
 	      const char *script_name, struct sieve_error_handler *ehandler,
@@ -348,6 +472,15 @@ sieve_run(struct sieve_binary *sbin, struct sieve_result *result,
 	struct sieve_interpreter *interp;
 	int ret = 0;
 
+	/* Nothing to evaluate; the result stays empty, which means implicit
+	   keep. Traces are still produced by the interpreter. */
+	if (eenv->scriptenv->trace_log == NULL &&
+	    sieve_binary_program_is_empty(sbin)) {
+		e_debug(eenv->event, "Script `%s' contains no commands",
+			sieve_binary_script_name(sbin));
+		return SIEVE_EXEC_OK;
+	}
+
 	/* Create the interpreter */
 	interp = sieve_interpreter_create(sbin, NULL, eenv, ehandler);
 	if (interp == NULL)
@@ -373,6 +506,107 @@ sieve_load(struct sieve_instance *svinst, const char *bin_path,
 	return sieve_binary_open(svinst, bin_path, NULL, error_r);
 }
 
+static const struct dotlock_settings sieve_compile_dotlock_set = {
+	.timeout = SIEVE_COMPILE_LOCK_TIMEOUT_SECS,
+	.stale_timeout = SIEVE_COMPILE_LOCK_STALE_TIMEOUT_SECS,
+};
+
+/* Serializes compilation of the same script by several processes, e.g. when
+   a global script was updated and all delivery processes notice it at once.
+   Returns 1 if the lock was obtained immediately, 0 if another process held
+   it until now (so that the binary may have been updated meanwhile) and -1 if
+   locking is not possible. */
+static int
+sieve_compile_lock(struct sieve_script *script, struct dotlock **dotlock_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	const char *prefix, *path;
+	int ret;
+
+	*dotlock_r = NULL;
+
+	prefix = sieve_script_binary_get_prefix(script);
+	if (prefix == NULL)
+		return -1;
+	path = t_strconcat(prefix, "."SIEVE_BINARY_FILEEXT, NULL);
+
+	ret = file_dotlock_create(&sieve_compile_dotlock_set, path,
+				  DOTLOCK_CREATE_FLAG_NONBLOCK, dotlock_r);
+	if (ret > 0)
+		return 1;
+	if (ret < 0) {
+		/* Typically no permission to write in the binary directory;
+		   the binary cannot be saved there either */
+		e_debug(svinst->event,
+			"Cannot lock %s for compilation: %m", path);
+		return -1;
+	}
+
+	e_debug(svinst->event,
+		"Waiting for another process compiling %s", path);
+	ret = file_dotlock_create(&sieve_compile_dotlock_set, path, 0,
+				  dotlock_r);
+	if (ret <= 0) {
+		e_warning(svinst->event,
+			  "Timed out waiting for compile lock of %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static struct sieve_binary *
+sieve_compile_script_locked(struct sieve_script *script,
+			    struct sieve_error_handler *ehandler,
+			    enum sieve_compile_flags flags,
+			    enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary *sbin;
+	struct dotlock *dotlock;
+	enum sieve_error error;
+
+	if (sieve_compile_lock(script, &dotlock) == 0) {
+		/* The other process may have saved an up-to-date binary */
+		sbin = sieve_script_binary_load(script, &error);
+		if (sbin != NULL && sieve_binary_up_to_date(sbin, flags) &&
+		    !sieve_binary_is_outdated(sbin)) {
+			e_debug(svinst->event,
+				"Script binary %s was compiled by another "
+				"process", sieve_binary_path(sbin));
+			file_dotlock_delete(&dotlock);
+			return sbin;
+		}
+		sieve_binary_close(&sbin);
+	}
+
+	sbin = sieve_compile_script(script, ehandler, flags, error_r);
+	if (dotlock != NULL) {
+		if (sbin == NULL)
+			file_dotlock_delete(&dotlock);
+		else {
+			/* Released once the binary is saved */
+			sbin->compile_lock = dotlock;
+		}
+	}
+	return sbin;
+}
+
+/* Binaries stored with an older binary format revision or extension version
+   are recompiled at most once per interval by each process, so that an
+   upgrade does not make all users' binaries recompile at once. Until then,
+   these are executed as they are. */
+static time_t sieve_binary_last_upgrade = 0;
+
+static bool sieve_binary_upgrade_due(struct sieve_instance *svinst)
+{
+	if (sieve_binary_last_upgrade != 0 &&
+	    ioloop_time < sieve_binary_last_upgrade +
+			  (time_t)svinst->binary_upgrade_interval_secs)
+		return FALSE;
+	sieve_binary_last_upgrade = ioloop_time;
+	return TRUE;
+}
+
 static struct sieve_binary *
 sieve_open_script_real(struct sieve_script *script,
 		       struct sieve_error_handler *ehandler,
@@ -384,6 +618,7 @@ sieve_open_script_real(struct sieve_script *script,
 	struct sieve_binary *sbin;
 	enum sieve_error error;
 	const char *errorstr = NULL;
+	bool cached = FALSE;
 	int ret;
 
 	if (error_r == NULL)
@@ -391,9 +626,18 @@ sieve_open_script_real(struct sieve_script *script,
 
 	sieve_resource_usage_init(&rusage);
 
-	/* Try to open the matching binary */
-	sbin = sieve_script_binary_load(script, error_r);
+	/* Try the binaries opened earlier by this instance */
+	sbin = sieve_binary_cache_lookup(svinst->binary_cache, script, flags);
 	if (sbin != NULL) {
+		e_debug(svinst->event,
+			"Script binary %s reused from cache",
+			sieve_binary_path(sbin));
+		cached = TRUE;
+	} else {
+		/* Try to open the matching binary */
+		sbin = sieve_script_binary_load(script, error_r);
+	}
+	if (sbin != NULL && !cached) {
 		sieve_binary_get_resource_usage(sbin, &rusage);
 
 		/* Ok, it exists; now let's see if it is up to date */
@@ -404,18 +648,34 @@ sieve_open_script_real(struct sieve_script *script,
 				"Script binary %s is not up-to-date",
 				sieve_binary_path(sbin));
 			sieve_binary_close(&sbin);
+		} else if (sieve_binary_is_outdated(sbin) &&
+			   sieve_binary_upgrade_due(svinst)) {
+			e_debug(svinst->event,
+				"Script binary %s is outdated; upgrading",
+				sieve_binary_path(sbin));
+			sieve_binary_close(&sbin);
 		}
 	}
 
+	/* Try the binaries shared by other nodes */
+	if (sbin == NULL && svinst->binary_dict != NULL) {
+		sbin = sieve_binary_dict_open(svinst->binary_dict, script);
+		if (sbin != NULL && !sieve_binary_up_to_date(sbin, flags))
+			sieve_binary_close(&sbin);
+	}
+
 	/* If the binary does not exist or is not up-to-date, we need
 	 * to (re-)compile.
 	 */
-	if (sbin != NULL) {
+	if (cached) {
+		/* Already reported */
+	} else if (sbin != NULL) {
 		e_debug(svinst->event,
 			"Script binary %s successfully loaded",
 			sieve_binary_path(sbin));
 	} else {
-		sbin = sieve_compile_script(script, ehandler, flags, error_r);
+		sbin = sieve_compile_script_locked(script, ehandler, flags,
+						   error_r);
 		if (sbin == NULL)
 			return NULL;
 
@@ -424,7 +684,9 @@ sieve_open_script_real(struct sieve_script *script,
 			sieve_script_name(script),
 			sieve_script_location(script));
 
-		sieve_binary_set_resource_usage(sbin, &rusage);
+		/* Not when it was loaded after waiting for another process */
+		if (!sieve_binary_loaded(sbin))
+			sieve_binary_set_resource_usage(sbin, &rusage);
 	}
 
 	/* Check whether binary can be executed. */
@@ -450,6 +712,8 @@ sieve_open_script_real(struct sieve_script *script,
 				    "%s", errorstr);
 		}
 		sieve_binary_close(&sbin);
+	} else if (!cached && sieve_binary_loaded(sbin)) {
+		sieve_binary_cache_add(svinst->binary_cache, script, sbin);
 	}
 
 	return sbin;
@@ -529,11 +793,18 @@ int sieve_save(struct sieve_binary *sbin, bool update,
 	       enum sieve_error *error_r)
 {
 	struct sieve_script *script = sieve_binary_script(sbin);
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	int ret;
 
 	if (script == NULL)
 		return sieve_binary_save(sbin, NULL, update, 0600, error_r);
 
-	return sieve_script_binary_save(script, sbin, update, error_r);
+	ret = sieve_script_binary_save(script, sbin, update, error_r);
+	if (ret > 0 && svinst->binary_dict != NULL) T_BEGIN {
+		/* Make it available to the other nodes */
+		sieve_binary_dict_store(svinst->binary_dict, sbin);
+	} T_END;
+	return ret;
 }
 
 bool sieve_record_resource_usage(struct sieve_binary *sbin,
@@ -567,6 +838,15 @@ void sieve_dump(struct sieve_binary *sbin, struct ostream *stream, bool verbose)
 	sieve_binary_dumper_free(&dumpr);
 }
 
+void sieve_dump_stats(struct sieve_binary *sbin, struct ostream *stream)
+{
+	struct sieve_binary_dumper *dumpr = sieve_binary_dumper_create(sbin);
+
+	sieve_binary_dumper_stats(dumpr, stream);
+
+	sieve_binary_dumper_free(&dumpr);
+}
+
 void sieve_hexdump(struct sieve_binary *sbin, struct ostream *stream)
 {
 	struct sieve_binary_dumper *dumpr = sieve_binary_dumper_create(sbin);
@@ -576,6 +856,41 @@ void sieve_hexdump(struct sieve_binary *sbin, struct ostream *stream)
 	sieve_binary_dumper_free(&dumpr);
 }
 
+/*
+ * Execution pool
+ */
+
+/* Executing a script for a message (sieve-filter, imapsieve, LMTP sessions
+   with many recipients) allocates the execution environment, result and
+   result execution from this pool. It is cleared rather than destroyed once
+   the last execution is finished, so that its memory is reused for the next
+   message. */
+
+static pool_t sieve_execute_pool_get(struct sieve_instance *svinst)
+{
+	if (svinst->execute_pool == NULL) {
+		svinst->execute_pool = pool_alloconly_create(
+			"sieve execution", 4096);
+	}
+	svinst->execute_pool_users++;
+	pool_ref(svinst->execute_pool);
+	return svinst->execute_pool;
+}
+
+static void
+sieve_execute_pool_put(struct sieve_instance *svinst, pool_t *_pool)
+{
+	pool_t pool = *_pool;
+
+	*_pool = NULL;
+	i_assert(pool == svinst->execute_pool);
+	i_assert(svinst->execute_pool_users > 0);
+
+	pool_unref(&pool);
+	if (--svinst->execute_pool_users == 0)
+		p_clear(svinst->execute_pool);
+}
+
 int sieve_test(struct sieve_binary *sbin,
 	       const struct sieve_message_data *msgdata,
 	       const struct sieve_script_env *senv,
@@ -588,7 +903,7 @@ int sieve_test(struct sieve_binary *sbin,
 	pool_t pool;
 	int ret;
 
-	pool = pool_alloconly_create("sieve execution", 4096);
+	pool = sieve_execute_pool_get(svinst);
 	sieve_execute_init(&eenv, svinst, pool, msgdata, senv, flags);
 
 	/* Create result object */
@@ -607,7 +922,7 @@ int sieve_test(struct sieve_binary *sbin,
 	if (result != NULL)
 		sieve_result_unref(&result);
 	sieve_execute_deinit(&eenv);
-	pool_unref(&pool);
+	sieve_execute_pool_put(svinst, &pool);
 
 	return ret;
 }
@@ -640,44 +955,120 @@ int sieve_execute(struct sieve_binary *sbin,
 		  struct sieve_error_handler *exec_ehandler,
 		  struct sieve_error_handler *action_ehandler,
 		  enum sieve_execute_flags flags)
+{
+	struct sieve_evaluation *seval;
+
+	seval = sieve_evaluate(sbin, msgdata, senv, exec_ehandler, flags);
+	return sieve_evaluation_execute(&seval, action_ehandler);
+}
+
+/*
+ * Deferred execution
+ */
+
+struct sieve_evaluation {
+	pool_t pool;
+	struct sieve_instance *svinst;
+	struct sieve_execute_env exec_env;
+	struct sieve_result *result;
+
+	int status;
+};
+
+struct sieve_evaluation *
+sieve_evaluate(struct sieve_binary *sbin,
+	       const struct sieve_message_data *msgdata,
+	       const struct sieve_script_env *senv,
+	       struct sieve_error_handler *exec_ehandler,
+	       enum sieve_execute_flags flags)
 {
 	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
-	struct sieve_result *result = NULL;
-	struct sieve_result_execution *rexec;
-	struct sieve_execute_env eenv;
+	struct sieve_evaluation *seval;
 	pool_t pool;
-	int ret;
 
-	pool = pool_alloconly_create("sieve execution", 4096);
-	sieve_execute_init(&eenv, svinst, pool, msgdata, senv, flags);
+	pool = sieve_execute_pool_get(svinst);
+	seval = p_new(pool, struct sieve_evaluation, 1);
+	seval->pool = pool;
+	seval->svinst = svinst;
+
+	sieve_execute_init(&seval->exec_env, svinst, pool, msgdata, senv,
+			   flags);
 
 	/* Create result object */
-	result = sieve_result_create(svinst, pool, &eenv);
+	seval->result = sieve_result_create(svinst, pool, &seval->exec_env);
 
 	/* Run the script */
-	ret = sieve_run(sbin, result, &eenv, exec_ehandler);
+	seval->status = sieve_run(sbin, seval->result, &seval->exec_env,
+				  exec_ehandler);
+	return seval;
+}
+
+int sieve_evaluation_status(struct sieve_evaluation *seval)
+{
+	return seval->status;
+}
+
+bool sieve_evaluation_print(struct sieve_evaluation *seval,
+			    struct ostream *stream, bool *keep_r)
+{
+	if (seval->status <= 0) {
+		if (keep_r != NULL)
+			*keep_r = TRUE;
+		return FALSE;
+	}
+	return sieve_result_print(seval->result, seval->exec_env.scriptenv,
+				  stream, keep_r);
+}
 
-	rexec = sieve_result_execution_create(result, pool);
+static void sieve_evaluation_destroy(struct sieve_evaluation *seval, int status)
+{
+	struct sieve_instance *svinst = seval->svinst;
+	pool_t pool = seval->pool;
+
+	sieve_result_unref(&seval->result);
+	sieve_execute_finish(&seval->exec_env, status);
+	sieve_execute_deinit(&seval->exec_env);
+	sieve_execute_pool_put(svinst, &pool);
+}
+
+int sieve_evaluation_execute(struct sieve_evaluation **_seval,
+			     struct sieve_error_handler *action_ehandler)
+{
+	struct sieve_evaluation *seval = *_seval;
+	struct sieve_result_execution *rexec;
+	int ret;
+
+	*_seval = NULL;
+
+	rexec = sieve_result_execution_create(seval->result, seval->pool);
 
 	/* Evaluate status and execute the result:
 	   Strange situations, e.g. currupt binaries, must be handled by the
 	   caller. In that case no implicit keep is attempted, because the
 	   situation may be resolved.
 	 */
-	ret = sieve_result_execute(rexec, ret, TRUE, action_ehandler, NULL);
+	ret = sieve_result_execute(rexec, seval->status, TRUE,
+				   action_ehandler, NULL);
 
 	sieve_result_execution_destroy(&rexec);
 
 	/* Cleanup */
-	if (result != NULL)
-		sieve_result_unref(&result);
-	sieve_execute_finish(&eenv, ret);
-	sieve_execute_deinit(&eenv);
-	pool_unref(&pool);
-
+	sieve_evaluation_destroy(seval, ret);
 	return ret;
 }
 
+void sieve_evaluation_free(struct sieve_evaluation **_seval)
+{
+	struct sieve_evaluation *seval = *_seval;
+
+	if (seval == NULL)
+		return;
+	*_seval = NULL;
+
+	/* Nothing was executed, so duplicate marks are rolled back */
+	sieve_evaluation_destroy(seval, SIEVE_EXEC_FAILURE);
+}
+
 /*
  * Multiscript support
  */
@@ -707,7 +1098,7 @@ sieve_multiscript_start_execute(struct sieve_instance *svinst,
 	struct sieve_result *result;
 	struct sieve_multiscript *mscript;
 
-	pool = pool_alloconly_create("sieve execution", 4096);
+	pool = sieve_execute_pool_get(svinst);
 	mscript = p_new(pool, struct sieve_multiscript, 1);
 	mscript->pool = pool;
 	sieve_execute_init(&mscript->exec_env, svinst, pool, msgdata, senv, 0);
@@ -733,6 +1124,8 @@ sieve_multiscript_start_execute(struct sieve_instance *svinst,
 static void sieve_multiscript_destroy(struct sieve_multiscript **_mscript)
 {
 	struct sieve_multiscript *mscript = *_mscript;
+	struct sieve_instance *svinst;
+	pool_t pool;
 
 	if (mscript == NULL)
 		return;
@@ -744,8 +1137,10 @@ static void sieve_multiscript_destroy(struct sieve_multiscript **_mscript)
 
 	sieve_result_execution_destroy(&mscript->rexec);
 	sieve_result_unref(&mscript->result);
+	svinst = mscript->exec_env.svinst;
+	pool = mscript->pool;
 	sieve_execute_deinit(&mscript->exec_env);
-	pool_unref(&mscript->pool);
+	sieve_execute_pool_put(svinst, &pool);
 }
 
 struct sieve_multiscript *
@@ -943,6 +1338,41 @@ int sieve_multiscript_finish(struct sieve_multiscript **_mscript,
 	return status;
 }
 
+/*
+ * Compile pool
+ */
+
+/* Memory initially allocated for the compile pool; this is retained between
+   compilations, so most scripts need no further allocations */
+#define SIEVE_COMPILE_POOL_INITIAL_SIZE (64*1024)
+
+pool_t sieve_compile_pool_get(struct sieve_instance *svinst)
+{
+	if (svinst->compile_pool == NULL) {
+		svinst->compile_pool = pool_alloconly_create(
+			"sieve_compile", SIEVE_COMPILE_POOL_INITIAL_SIZE);
+	}
+	svinst->compile_pool_users++;
+	pool_ref(svinst->compile_pool);
+	return svinst->compile_pool;
+}
+
+void sieve_compile_pool_put(struct sieve_instance *svinst, pool_t *_pool)
+{
+	pool_t pool = *_pool;
+
+	*_pool = NULL;
+	i_assert(pool == svinst->compile_pool);
+	i_assert(svinst->compile_pool_users > 0);
+
+	pool_unref(&pool);
+	if (--svinst->compile_pool_users == 0) {
+		/* All compiler objects are gone; only the initial block is
+		   retained */
+		p_clear(svinst->compile_pool);
+	}
+}
+
 /*
  * Configured Limits
  */
@@ -962,6 +1392,38 @@ size_t sieve_max_script_size(struct sieve_instance *svinst)
 	return svinst->max_script_size;
 }
 
+size_t sieve_max_body_part_size(struct sieve_instance *svinst,
+				const char *content_type)
+{
+	const struct sieve_body_part_limit *limit;
+	const char *subtype;
+	size_t type_len, max_size = svinst->max_body_part_size;
+	bool type_match = FALSE;
+
+	if (!array_is_created(&svinst->body_part_limits))
+		return max_size;
+
+	subtype = strchr(content_type, '/');
+	type_len = (subtype == NULL ? strlen(content_type) :
+		    (size_t)(subtype - content_type));
+
+	/* A limit for the full type/subtype takes precedence over a limit
+	   for the main type only */
+	array_foreach(&svinst->body_part_limits, limit) {
+		if (strchr(limit->content_type, '/') != NULL) {
+			if (strcasecmp(limit->content_type, content_type) == 0)
+				return limit->max_size;
+		} else if (!type_match &&
+			   strlen(limit->content_type) == type_len &&
+			   strncasecmp(limit->content_type, content_type,
+				       type_len) == 0) {
+			max_size = limit->max_size;
+			type_match = TRUE;
+		}
+	}
+	return max_size;
+}
+
 /*
  * User log
  */
@@ -1009,6 +1471,10 @@ sieve_user_get_log_path(struct sieve_instance *svinst,
 struct sieve_trace_log {
 	struct sieve_instance *svinst;
 	struct ostream *output;
+
+	/* Trace captured in memory for slow scripts */
+	buffer_t *capture;
+	bool capture_truncated:1;
 };
 
 int sieve_trace_log_create(struct sieve_instance *svinst, const char *path,
@@ -1031,6 +1497,9 @@ int sieve_trace_log_create(struct sieve_instance *svinst, const char *path,
 		}
 		output = o_stream_create_fd_autoclose(&fd, 0);
 		o_stream_set_name(output, path);
+		/* Nobody reads the file while the script runs, so write the
+		   trace in blocks rather than with one write() per line */
+		o_stream_cork(output);
 	}
 
 	trace_log = i_new(struct sieve_trace_log, 1);
@@ -1067,15 +1536,13 @@ int sieve_trace_log_create_dir(struct sieve_instance *svinst, const char *dir,
 	return sieve_trace_log_create(svinst, prefix, trace_log_r);
 }
 
-int sieve_trace_log_open(struct sieve_instance *svinst,
-			 struct sieve_trace_log **trace_log_r)
+static const char *sieve_trace_dir_get(struct sieve_instance *svinst)
 {
 	const char *trace_dir =
 		sieve_setting_get(svinst, "sieve_trace_dir");
 
-	*trace_log_r = NULL;
 	if (trace_dir == NULL)
-		return -1;
+		return NULL;
 
 	if (svinst->home_dir != NULL) {
 		/* Expand home dir if necessary */
@@ -1087,15 +1554,39 @@ int sieve_trace_log_open(struct sieve_instance *svinst,
 						trace_dir, NULL);
 		}
 	}
+	return trace_dir;
+}
+
+int sieve_trace_log_open(struct sieve_instance *svinst,
+			 struct sieve_trace_log **trace_log_r)
+{
+	const char *trace_dir = sieve_trace_dir_get(svinst);
+
+	*trace_log_r = NULL;
+	if (trace_dir == NULL)
+		return -1;
 
 	return sieve_trace_log_create_dir(svinst, trace_dir, trace_log_r);
 }
 
+static bool sieve_trace_log_capture_full(struct sieve_trace_log *trace_log)
+{
+	if (trace_log->capture == NULL)
+		return FALSE;
+	if (trace_log->capture->used < SIEVE_TRACE_CAPTURE_MAX_SIZE)
+		return FALSE;
+	trace_log->capture_truncated = TRUE;
+	return TRUE;
+}
+
 void sieve_trace_log_write_line(struct sieve_trace_log *trace_log,
 				const string_t *line)
 {
 	struct const_iovec iov[2];
 
+	if (sieve_trace_log_capture_full(trace_log))
+		return;
+
 	if (line == NULL) {
 		o_stream_nsend_str(trace_log->output, "\n");
 		return;
@@ -1114,6 +1605,9 @@ void sieve_trace_log_printf(struct sieve_trace_log *trace_log,
 {
 	va_list args;
 
+	if (sieve_trace_log_capture_full(trace_log))
+		return;
+
 	va_start(args, fmt);
 	T_BEGIN {
 		o_stream_nsend_str(trace_log->output,
@@ -1134,15 +1628,105 @@ void sieve_trace_log_free(struct sieve_trace_log **_trace_log)
 			o_stream_get_error(trace_log->output));
 	}
 	o_stream_destroy(&trace_log->output);
+	if (trace_log->capture != NULL)
+		buffer_free(&trace_log->capture);
 	i_free(trace_log);
 }
 
+static int
+sieve_trace_level_parse(struct sieve_instance *svinst, const char *tr_level,
+			sieve_trace_level_t *level_r)
+{
+	if (strcasecmp(tr_level, "actions") == 0)
+		*level_r = SIEVE_TRLVL_ACTIONS;
+	else if (strcasecmp(tr_level, "commands") == 0)
+		*level_r = SIEVE_TRLVL_COMMANDS;
+	else if (strcasecmp(tr_level, "tests") == 0)
+		*level_r = SIEVE_TRLVL_TESTS;
+	else if (strcasecmp(tr_level, "matching") == 0)
+		*level_r = SIEVE_TRLVL_MATCHING;
+	else {
+		e_error(svinst->event, "Unknown trace level: %s", tr_level);
+		return -1;
+	}
+	return 0;
+}
+
+int sieve_trace_capture_open(struct sieve_instance *svinst,
+			     struct sieve_trace_config *tr_config,
+			     struct sieve_trace_log **trace_log_r)
+{
+	struct sieve_trace_log *trace_log;
+	const char *tr_level;
+
+	i_zero(tr_config);
+	*trace_log_r = NULL;
+
+	if (svinst->trace_slow_msecs == 0 ||
+	    sieve_trace_dir_get(svinst) == NULL)
+		return -1;
+
+	tr_config->level = SIEVE_TRLVL_COMMANDS;
+	tr_level = sieve_setting_get(svinst, "sieve_trace_slow_level");
+	if (tr_level != NULL && *tr_level != '\0' &&
+	    sieve_trace_level_parse(svinst, tr_level, &tr_config->level) < 0)
+		return -1;
+
+	trace_log = i_new(struct sieve_trace_log, 1);
+	trace_log->svinst = svinst;
+	trace_log->capture = buffer_create_dynamic(default_pool, 4096);
+	trace_log->output = o_stream_create_buffer(trace_log->capture);
+
+	*trace_log_r = trace_log;
+	return 0;
+}
+
+bool sieve_trace_log_is_capture(struct sieve_trace_log *trace_log)
+{
+	return (trace_log->capture != NULL);
+}
+
+void sieve_trace_log_capture_reset(struct sieve_trace_log *trace_log)
+{
+	i_assert(trace_log->capture != NULL);
+
+	/* Recreate the stream, so that it starts writing at the beginning of
+	   the buffer again */
+	o_stream_destroy(&trace_log->output);
+	buffer_set_used_size(trace_log->capture, 0);
+	trace_log->output = o_stream_create_buffer(trace_log->capture);
+	trace_log->capture_truncated = FALSE;
+}
+
+void sieve_trace_log_capture_save(struct sieve_trace_log *trace_log,
+				  const char *header)
+{
+	struct sieve_instance *svinst = trace_log->svinst;
+	struct sieve_trace_log *file_log;
+	const char *trace_dir = sieve_trace_dir_get(svinst);
+
+	i_assert(trace_log->capture != NULL);
+
+	if (trace_dir == NULL ||
+	    sieve_trace_log_create_dir(svinst, trace_dir, &file_log) < 0)
+		return;
+
+	o_stream_nsend_str(file_log->output, header);
+	o_stream_nsend(file_log->output, trace_log->capture->data,
+		       trace_log->capture->used);
+	if (trace_log->capture_truncated) {
+		o_stream_nsend_str(file_log->output,
+				   "\n[[TRACE TRUNCATED]]\n");
+	}
+	sieve_trace_log_free(&file_log);
+}
+
 int sieve_trace_config_get(struct sieve_instance *svinst,
 			   struct sieve_trace_config *tr_config)
 {
 	const char *tr_level =
 		sieve_setting_get(svinst, "sieve_trace_level");
-	bool tr_debug, tr_addresses;
+	bool tr_debug, tr_addresses, tr_profile;
 
 	i_zero(tr_config);
 
@@ -1150,18 +1734,8 @@ int sieve_trace_config_get(struct sieve_instance *svinst,
 	    strcasecmp(tr_level, "none") == 0)
 		return -1;
 
-	if (strcasecmp(tr_level, "actions") == 0)
-		tr_config->level = SIEVE_TRLVL_ACTIONS;
-	else if (strcasecmp(tr_level, "commands") == 0)
-		tr_config->level = SIEVE_TRLVL_COMMANDS;
-	else if (strcasecmp(tr_level, "tests") == 0)
-		tr_config->level = SIEVE_TRLVL_TESTS;
-	else if (strcasecmp(tr_level, "matching") == 0)
-		tr_config->level = SIEVE_TRLVL_MATCHING;
-	else {
-		e_error(svinst->event, "Unknown trace level: %s", tr_level);
+	if (sieve_trace_level_parse(svinst, tr_level, &tr_config->level) < 0)
 		return -1;
-	}
 
 	tr_debug = FALSE;
 	(void)sieve_setting_get_bool_value(svinst, "sieve_trace_debug",
@@ -1169,11 +1743,16 @@ int sieve_trace_config_get(struct sieve_instance *svinst,
 	tr_addresses = FALSE;
 	(void)sieve_setting_get_bool_value(svinst, "sieve_trace_addresses",
 					   &tr_addresses);
+	tr_profile = FALSE;
+	(void)sieve_setting_get_bool_value(svinst, "sieve_trace_profile",
+					   &tr_profile);
 
 	if (tr_debug)
 		tr_config->flags |= SIEVE_TRFLG_DEBUG;
 	if (tr_addresses)
 		tr_config->flags |= SIEVE_TRFLG_ADDRESSES;
+	if (tr_profile)
+		tr_config->flags |= SIEVE_TRFLG_PROFILE;
 	return 0;
 }
 
@@ -1270,13 +1849,25 @@ void sieve_resource_usage_init(struct sieve_resource_usage *rusage_r)
 	i_zero(rusage_r);
 }
 
+static inline void
+sieve_resource_usage_add_counter(unsigned int *dst, unsigned int src)
+{
+	if ((UINT_MAX - *dst) < src)
+		*dst = UINT_MAX;
+	else
+		*dst += src;
+}
+
 void sieve_resource_usage_add(struct sieve_resource_usage *dst,
 			      const struct sieve_resource_usage *src)
 {
-	if ((UINT_MAX - dst->cpu_time_msecs) < src->cpu_time_msecs)
-		dst->cpu_time_msecs = UINT_MAX;
-	else
-		dst->cpu_time_msecs += src->cpu_time_msecs;
+	sieve_resource_usage_add_counter(&dst->cpu_time_msecs,
+					 src->cpu_time_msecs);
+	sieve_resource_usage_add_counter(&dst->header_fetches,
+					 src->header_fetches);
+	sieve_resource_usage_add_counter(&dst->body_bytes, src->body_bytes);
+	sieve_resource_usage_add_counter(&dst->program_runs,
+					 src->program_runs);
 }
 
 bool sieve_resource_usage_is_high(struct sieve_instance *svinst ATTR_UNUSED,
@@ -1298,8 +1889,23 @@ bool sieve_resource_usage_is_excessive(
 const char *
 sieve_resource_usage_get_summary(const struct sieve_resource_usage *rusage)
 {
-	if (rusage->cpu_time_msecs == 0)
+	string_t *summary;
+
+	if (rusage->cpu_time_msecs == 0 && rusage->header_fetches == 0 &&
+	    rusage->body_bytes == 0 && rusage->program_runs == 0)
 		return "no usage recorded";
 
-	return t_strdup_printf("cpu time = %u ms", rusage->cpu_time_msecs);
+	summary = t_str_new(128);
+	str_printfa(summary, "cpu time = %u ms", rusage->cpu_time_msecs);
+	if (rusage->header_fetches > 0) {
+		str_printfa(summary, ", header fetches = %u",
+			    rusage->header_fetches);
+	}
+	if (rusage->body_bytes > 0)
+		str_printfa(summary, ", body = %u bytes", rusage->body_bytes);
+	if (rusage->program_runs > 0) {
+		str_printfa(summary, ", program runs = %u",
+			    rusage->program_runs);
+	}
+	return str_c(summary);
 }
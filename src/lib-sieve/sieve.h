@@ -31,6 +31,21 @@ void sieve_set_extensions(struct sieve_instance *svinst,
 			  const char *extensions);
 
 
+/* Free the process-wide caches shared between Sieve instances, such as
+   memory-mapped binaries. Call this once the process no longer uses the Sieve
+   engine (e.g. upon plugin deinit). */
+void sieve_caches_free(void);
+
+/* Release memory held by this Sieve instance merely to speed up subsequent
+   use, such as cached binaries and idle compiler/execution pools. These are
+   recreated on demand. Useful for long-lived sessions that go idle. */
+void sieve_release_memory(struct sieve_instance *svinst);
+
+/* Get the statistics of the caches kept by this Sieve instance. These are
+   also sent with the sieve_instance_finished event upon sieve_deinit(). */
+void sieve_get_statistics(struct sieve_instance *svinst,
+			  struct sieve_statistics *stats_r);
+
 /* Get top-level event for this Sieve instance. */
 struct event *sieve_get_event(struct sieve_instance *svinst) ATTR_PURE;
 
@@ -46,6 +61,13 @@ sieve_compile_script(struct sieve_script *script,
 		     enum sieve_compile_flags flags, enum sieve_error *error_r)
 		     ATTR_NULL(2, 4);
 
+/* Read an execution profile (the profile report produced when tracing with
+   sieve_trace_profile) and use it to order the branches of scripts compiled
+   from now on. This enables the optimizer. Returns -1 when the profile cannot
+   be read. */
+int sieve_set_optimizer_profile(struct sieve_instance *svinst,
+				const char *path, const char **error_r);
+
 /* Compile a Sieve script from a Sieve script location string. Returns Sieve
    binary upon success and NULL upon failure. The provided script_name is used
    for the internally created Sieve script object. */
@@ -125,6 +147,9 @@ bool sieve_is_loaded(struct sieve_binary *sbin);
 /* Dumps the byte code in human-readable form to the specified ostream. */
 void sieve_dump(struct sieve_binary *sbin,
 		struct ostream *stream, bool verbose);
+/* Dumps statistics about the byte code (block sizes, operation histogram,
+   string operand sizes) to the specified ostream. */
+void sieve_dump_stats(struct sieve_binary *sbin, struct ostream *stream);
 /* Dumps the byte code in hexdump form to the specified ostream. */
 void sieve_hexdump(struct sieve_binary *sbin, struct ostream *stream);
 
@@ -151,6 +176,57 @@ int sieve_execute(struct sieve_binary *sbin,
 		  struct sieve_error_handler *action_ehandler,
 		  enum sieve_execute_flags flags);
 
+/*
+ * Deferred execution
+ */
+
+/* Evaluating a script and executing its result are separate steps, which
+   allows the caller to decide what happens in between (e.g. to inspect the
+   actions or to open the target mailboxes). The message data and script
+   environment must stay valid until the evaluation is executed or freed.
+   sieve_execute() is equivalent to sieve_evaluate() immediately followed by
+   sieve_evaluation_execute(). */
+struct sieve_evaluation;
+
+/* Runs the binary without executing any actions. Never returns NULL; failures
+   are reported through sieve_evaluation_status(). */
+struct sieve_evaluation *
+sieve_evaluate(struct sieve_binary *sbin,
+	       const struct sieve_message_data *msgdata,
+	       const struct sieve_script_env *senv,
+	       struct sieve_error_handler *exec_ehandler,
+	       enum sieve_execute_flags flags);
+/* Returns the SIEVE_EXEC_* status of the script run. */
+int sieve_evaluation_status(struct sieve_evaluation *seval);
+/* Prints the pending actions in the same format as sieve_test(). Returns
+   FALSE if the evaluation failed or the result could not be printed. */
+bool sieve_evaluation_print(struct sieve_evaluation *seval,
+			    struct ostream *stream, bool *keep_r);
+
+/* Executes the result (or the implicit keep when the evaluation failed) and
+   frees the evaluation. */
+int sieve_evaluation_execute(struct sieve_evaluation **_seval,
+			     struct sieve_error_handler *action_ehandler);
+/* Frees the evaluation without executing anything. */
+void sieve_evaluation_free(struct sieve_evaluation **_seval);
+
+/*
+ * Store batch
+ */
+
+/* A store batch keeps the target mailboxes of fileinto/keep open across the
+   executions for many messages (e.g. sieve-filter) and saves all messages
+   for one mailbox in a single mailbox transaction. Assign it to
+   sieve_script_env->store_batch. Messages reported as saved by
+   sieve_execute() are only stored once sieve_store_batch_commit() succeeds.
+ */
+struct sieve_store_batch *sieve_store_batch_create(void);
+/* Commits all mailbox transactions of the batch. Returns -1 and sets error_r
+   if any of the commits failed. */
+int sieve_store_batch_commit(struct sieve_store_batch **_batch,
+			     const char **error_r);
+void sieve_store_batch_rollback(struct sieve_store_batch **_batch);
+
 /*
  * Multiscript support
  */
@@ -193,6 +269,10 @@ int sieve_multiscript_finish(struct sieve_multiscript **_mscript,
 unsigned int sieve_max_redirects(struct sieve_instance *svinst);
 unsigned int sieve_max_actions(struct sieve_instance *svinst);
 size_t sieve_max_script_size(struct sieve_instance *svinst);
+/* Returns the maximum number of bytes extracted from a body part with the
+   given content type, or 0 if unlimited. */
+size_t sieve_max_body_part_size(struct sieve_instance *svinst,
+				const char *content_type);
 
 /*
  * User log
@@ -225,6 +305,13 @@ void sieve_trace_log_free(struct sieve_trace_log **_trace_log);
 int sieve_trace_config_get(struct sieve_instance *svinst,
 			   struct sieve_trace_config *tr_config);
 
+/* Opens a trace log that is kept in memory. It is written to the trace
+   directory only for scripts that exceed the sieve_trace_slow_cpu_time
+   threshold. */
+int sieve_trace_capture_open(struct sieve_instance *svinst,
+			     struct sieve_trace_config *tr_config,
+			     struct sieve_trace_log **trace_log_r);
+
 /*
  * Execution exit codes
  */
@@ -4,6 +4,8 @@
 #include "lib.h"
 #include "str.h"
 #include "strfuncs.h"
+#include "llist.h"
+#include "hash.h"
 #include "istream.h"
 #include "dict.h"
 
@@ -14,6 +16,116 @@
 
 #include "sieve-dict-storage.h"
 
+/*
+ * Script data cache
+ */
+
+/* The script text stored for a data ID never changes; modifying a script means
+   creating a new data item with a new ID. This makes it safe to keep the texts
+   read by this process, so that scripts needing recompilation (or without any
+   bindir at all) are not fetched from the dict again on every delivery. */
+
+#define SIEVE_DICT_DATA_CACHE_MAX_SIZE (1024 * 1024)
+
+struct sieve_dict_data_cache_entry {
+	struct sieve_dict_data_cache_entry *prev, *next;
+
+	char *key;
+	char *data;
+	size_t size;
+};
+
+static HASH_TABLE(char *, struct sieve_dict_data_cache_entry *) data_cache;
+/* Most recently used first */
+static struct sieve_dict_data_cache_entry *data_cache_head = NULL;
+static struct sieve_dict_data_cache_entry *data_cache_tail = NULL;
+static size_t data_cache_size = 0;
+
+static const char *
+sieve_dict_data_cache_key(struct sieve_dict_storage *dstorage,
+	const char *data_id)
+{
+	return t_strconcat(dstorage->uri, "\n", dstorage->username, "\n",
+		data_id, NULL);
+}
+
+static void
+sieve_dict_data_cache_entry_free(struct sieve_dict_data_cache_entry *entry)
+{
+	hash_table_remove(data_cache, entry->key);
+	DLLIST2_REMOVE(&data_cache_head, &data_cache_tail, entry);
+	i_assert(data_cache_size >= entry->size);
+	data_cache_size -= entry->size;
+
+	i_free(entry->key);
+	i_free(entry->data);
+	i_free(entry);
+}
+
+static const char *
+sieve_dict_data_cache_lookup(struct sieve_dict_storage *dstorage,
+	const char *data_id)
+{
+	struct sieve_dict_data_cache_entry *entry;
+
+	if ( !hash_table_is_created(data_cache) )
+		return NULL;
+
+	entry = hash_table_lookup(data_cache,
+		sieve_dict_data_cache_key(dstorage, data_id));
+	if ( entry == NULL )
+		return NULL;
+
+	DLLIST2_REMOVE(&data_cache_head, &data_cache_tail, entry);
+	DLLIST2_PREPEND(&data_cache_head, &data_cache_tail, entry);
+	return entry->data;
+}
+
+static void
+sieve_dict_data_cache_add(struct sieve_dict_storage *dstorage,
+	const char *data_id, const char *data)
+{
+	struct sieve_dict_data_cache_entry *entry;
+	size_t size = strlen(data);
+	const char *key;
+
+	if ( size > SIEVE_DICT_DATA_CACHE_MAX_SIZE / 4 )
+		return;
+
+	if ( !hash_table_is_created(data_cache) ) {
+		hash_table_create(&data_cache, default_pool, 0,
+			str_hash, strcmp);
+	}
+
+	key = sieve_dict_data_cache_key(dstorage, data_id);
+	entry = hash_table_lookup(data_cache, key);
+	if ( entry != NULL )
+		sieve_dict_data_cache_entry_free(entry);
+
+	entry = i_new(struct sieve_dict_data_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->data = i_strdup(data);
+	entry->size = size;
+
+	hash_table_insert(data_cache, entry->key, entry);
+	DLLIST2_PREPEND(&data_cache_head, &data_cache_tail, entry);
+	data_cache_size += size;
+
+	/* Evict least recently used texts */
+	while ( data_cache_size > SIEVE_DICT_DATA_CACHE_MAX_SIZE )
+		sieve_dict_data_cache_entry_free(data_cache_tail);
+}
+
+void sieve_dict_storage_caches_free(void)
+{
+	if ( !hash_table_is_created(data_cache) )
+		return;
+
+	while ( data_cache_head != NULL )
+		sieve_dict_data_cache_entry_free(data_cache_head);
+	hash_table_destroy(&data_cache);
+}
+
 /*
  * Script dict implementation
  */
@@ -117,8 +229,20 @@ static int sieve_dict_script_get_stream
 	const char *path, *name = script->name, *data, *error;
 	int ret;
 
-	dscript->data_pool =
-		pool_alloconly_create("sieve_dict_script data pool", 1024);
+	data = sieve_dict_data_cache_lookup(dstorage, dscript->data_id);
+	if ( data != NULL ) {
+		e_debug(script->event,
+			"Using cached data with id `%s'", dscript->data_id);
+		dscript->data = p_strdup(script->pool, data);
+		*stream_r = i_stream_create_from_data(dscript->data,
+			strlen(dscript->data));
+		return 0;
+	}
+
+	if ( dscript->data_pool == NULL ) {
+		dscript->data_pool =
+			pool_alloconly_create("sieve_dict_script data pool", 1024);
+	}
 
 	path = t_strconcat
 		(DICT_SIEVE_DATA_PATH, dict_escape_string(dscript->data_id), NULL);
@@ -145,6 +269,7 @@ static int sieve_dict_script_get_stream
 	}
 	
 	dscript->data = p_strdup(script->pool, data);
+	sieve_dict_data_cache_add(dstorage, dscript->data_id, dscript->data);
 	*stream_r = i_stream_create_from_data(dscript->data, strlen(dscript->data));
 	return 0;
 }
@@ -226,8 +351,10 @@ static struct sieve_binary *sieve_dict_script_binary_load
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
 
+	/* Without a bin directory, binaries are shared among all users
+	   with identical scripts (if a shared directory is configured) */
 	if ( sieve_dict_script_get_binpath(dscript) == NULL )
-		return NULL;
+		return sieve_binary_open_shared(script, error_r);
 
 	return sieve_binary_open(script->storage->svinst,
 		dscript->binpath, script, error_r);
@@ -241,7 +368,7 @@ static int sieve_dict_script_binary_save
 		(struct sieve_dict_script *)script;
 
 	if ( sieve_dict_script_get_binpath(dscript) == NULL )
-		return 0;
+		return sieve_binary_save_shared(sbin, update, error_r);
 	if ( sieve_storage_setup_bindir(script->storage, 0700) < 0 )
 		return -1;
 
@@ -4,6 +4,8 @@
 #include "lib.h"
 #include "str.h"
 #include "array.h"
+#include "hash.h"
+#include "ioloop.h"
 #include "eacces-error.h"
 
 #include "sieve-common.h"
@@ -14,10 +16,6 @@
 #include <stdio.h>
 #include <dirent.h>
 
-/*
- * Script sequence
- */
-
 struct sieve_file_script_sequence {
 	struct sieve_script_sequence seq;
 	pool_t pool;
@@ -25,16 +23,156 @@ struct sieve_file_script_sequence {
 	ARRAY_TYPE(const_string) script_files;
 	unsigned int index;
 
+	/* Pool of the cache entry the file names were borrowed from */
+	pool_t cache_pool;
+
 	bool storage_is_file:1;
 };
 
+/*
+ * Directory listing cache
+ */
+
+/* Global script sequences (sieve_before, sieve_after) are read from the same
+   directories for every recipient. Adding, removing or renaming a script
+   changes the directory's mtime, so the sorted list of script files read by
+   this process is reused as long as the directory is unchanged. */
+
+#define SIEVE_FILE_SEQUENCE_CACHE_MAX_ENTRIES 32
+
+struct sieve_file_sequence_cache_entry {
+	pool_t pool;
+	char *path;
+
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	unsigned long mtime_nsec;
+
+	ARRAY_TYPE(const_string) files;
+};
+
+static HASH_TABLE(char *, struct sieve_file_sequence_cache_entry *)
+	sequence_cache;
+
+static void
+sieve_file_sequence_cache_entry_free(
+	struct sieve_file_sequence_cache_entry *entry)
+{
+	hash_table_remove(sequence_cache, entry->path);
+	pool_unref(&entry->pool);
+}
+
+static bool
+sieve_file_sequence_cache_lookup(struct sieve_file_script_sequence *fseq,
+				 const char *path, const struct stat *st)
+{
+	struct sieve_file_sequence_cache_entry *entry;
+
+	if ( !hash_table_is_created(sequence_cache) )
+		return FALSE;
+
+	entry = hash_table_lookup(sequence_cache, path);
+	if ( entry == NULL )
+		return FALSE;
+
+	if ( entry->dev != st->st_dev || entry->ino != st->st_ino ||
+		entry->mtime != st->st_mtime ||
+		entry->mtime_nsec != (unsigned long)ST_MTIME_NSEC(*st) ) {
+		sieve_file_sequence_cache_entry_free(entry);
+		return FALSE;
+	}
+
+	/* The file names are borrowed from the entry, which is kept alive by
+	   referencing its pool even if it is dropped from the cache. */
+	i_assert(fseq->cache_pool == NULL);
+	fseq->cache_pool = entry->pool;
+	pool_ref(fseq->cache_pool);
+	array_append_array(&fseq->script_files, &entry->files);
+	return TRUE;
+}
+
+static void
+sieve_file_sequence_cache_add(struct sieve_file_script_sequence *fseq,
+			      const char *path, const struct stat *st)
+{
+	struct sieve_file_sequence_cache_entry *entry;
+	const char *const *files;
+	unsigned int count, i;
+	pool_t pool;
+
+	/* The directory could still change within the same second without
+	   its mtime changing (without nanosecond resolution) */
+	if ( st->st_mtime >= ioloop_time )
+		return;
+
+	if ( !hash_table_is_created(sequence_cache) ) {
+		hash_table_create(&sequence_cache, default_pool, 0,
+			str_hash, strcmp);
+	} else if ( hash_table_count(sequence_cache) >=
+		SIEVE_FILE_SEQUENCE_CACHE_MAX_ENTRIES ) {
+		return;
+	}
+
+	entry = hash_table_lookup(sequence_cache, path);
+	if ( entry != NULL )
+		sieve_file_sequence_cache_entry_free(entry);
+
+	pool = pool_alloconly_create("sieve_file_sequence_cache_entry", 512);
+	entry = p_new(pool, struct sieve_file_sequence_cache_entry, 1);
+	entry->pool = pool;
+	entry->path = p_strdup(pool, path);
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->mtime = st->st_mtime;
+	entry->mtime_nsec = ST_MTIME_NSEC(*st);
+
+	files = array_get(&fseq->script_files, &count);
+	p_array_init(&entry->files, pool, count);
+	for ( i = 0; i < count; i++ ) {
+		const char *file = p_strdup(pool, files[i]);
+
+		array_append(&entry->files, &file, 1);
+	}
+
+	hash_table_insert(sequence_cache, entry->path, entry);
+}
+
+void sieve_file_storage_caches_free(void)
+{
+	struct hash_iterate_context *iter;
+	struct sieve_file_sequence_cache_entry *entry;
+	char *path;
+
+	if ( !hash_table_is_created(sequence_cache) )
+		return;
+
+	iter = hash_table_iterate_init(sequence_cache);
+	while ( hash_table_iterate(iter, sequence_cache, &path, &entry) )
+		pool_unref(&entry->pool);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&sequence_cache);
+}
+
+/*
+ * Script sequence
+ */
+
 static int sieve_file_script_sequence_read_dir
-(struct sieve_file_script_sequence *fseq, const char *path)
+(struct sieve_file_script_sequence *fseq, const char *path,
+	const struct stat *dir_st)
 {
 	struct sieve_storage *storage = fseq->seq.storage;
 	DIR *dirp;
 	int ret = 0;
 
+	if ( sieve_file_sequence_cache_lookup(fseq, path, dir_st) ) {
+		e_debug(storage->event,
+			"Using cached listing of sequence directory `%s'",
+			path);
+		return 0;
+	}
+
 	/* Open the directory */
 	if ( (dirp = opendir(path)) == NULL ) {
 		switch ( errno ) {
@@ -117,6 +255,9 @@ static int sieve_file_script_sequence_read_dir
 			"Failed to close sequence directory: "
 			"closedir(%s) failed: %m", path);
 	}
+
+	if ( ret == 0 )
+		sieve_file_sequence_cache_add(fseq, path, dir_st);
 	return ret;
 }
 
@@ -170,7 +311,7 @@ struct sieve_script_sequence *sieve_file_storage_get_script_sequence
 		if (name == 0 || *name == '\0') {
 			/* Read all '.sieve' files in directory */
 			if (sieve_file_script_sequence_read_dir
-				(fseq, fstorage->path) < 0) {
+				(fseq, fstorage->path, &st) < 0) {
 				*error_r = storage->error_code;
 				sieve_file_script_sequence_destroy(&fseq->seq);
 				return NULL;
@@ -240,5 +381,7 @@ void sieve_file_script_sequence_destroy(struct sieve_script_sequence *seq)
 
 	if ( array_is_created(&fseq->script_files) )
 		array_free(&fseq->script_files);
+	if ( fseq->cache_pool != NULL )
+		pool_unref(&fseq->cache_pool);
 	pool_unref(&fseq->pool);
 }
@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "str.h"
+#include "array.h"
 #include "eacces-error.h"
 
 #include "sieve-common.h"
@@ -13,24 +14,25 @@
 #include <stdio.h>
 #include <dirent.h>
 
-struct sieve_file_list_context {
-	struct sieve_storage_list_context context;
-	pool_t pool;
+/*
+ * Directory cache
+ */
 
-	const char *active;
-	const char *dir;
-	DIR *dirp;
-};
+/* Scanning the script directory is expensive for large numbers of scripts,
+   especially on networked file systems, and doveadm sync lists the scripts
+   many times. Scripts are always saved, deleted and renamed through
+   directory operations, so the directory mtime tells whether the last scan
+   is still accurate. */
 
-struct sieve_storage_list_context *sieve_file_storage_list_init
-(struct sieve_storage *storage)
+static struct sieve_file_storage_dir_cache *
+sieve_file_storage_dir_scan(struct sieve_file_storage *fstorage, bool sizes)
 {
-	struct sieve_file_storage *fstorage =
-		(struct sieve_file_storage *)storage;
-	struct sieve_file_list_context *flctx;
-	const char *active = NULL;
-	pool_t pool;
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_storage_dir_cache *cache;
+	struct dirent *dp;
 	DIR *dirp;
+	pool_t pool;
+	bool failed = FALSE;
 
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
@@ -56,6 +58,158 @@ struct sieve_storage_list_context *sieve_file_storage_list_init
 		return NULL;
 	}
 
+	pool = pool_alloconly_create("sieve_file_storage_dir_cache", 1024);
+	cache = p_new(pool, struct sieve_file_storage_dir_cache, 1);
+	cache->pool = pool;
+	cache->have_sizes = sizes;
+	p_array_init(&cache->entries, pool, 16);
+
+	/* Scan all files */
+	for (;;) {
+		struct sieve_file_storage_dir_entry *entry;
+		const char *name;
+		uoff_t size = 0;
+
+		/* Read next entry */
+		errno = 0;
+		if ( (dp = readdir(dirp)) == NULL ) {
+			if ( errno != 0 ) {
+				sieve_storage_set_critical(storage,
+					"Failed to list scripts: "
+					"readdir(%s) failed: %m", fstorage->path);
+				failed = TRUE;
+			}
+			break;
+		}
+
+		/* Parse filename */
+		name = sieve_script_file_get_scriptname(dp->d_name);
+
+		/* Ignore non-script files */
+		if ( name == NULL )
+			continue;
+
+		/* Don't list our active sieve script link if the link
+		 * resides in the script dir (generally a bad idea).
+		 */
+		i_assert( fstorage->link_path != NULL );
+		if ( *(fstorage->link_path) == '\0' &&
+			strcmp(fstorage->active_fname, dp->d_name) == 0 )
+			continue;
+
+		if ( sizes ) {
+			const char *path;
+			struct stat st;
+
+			path = t_strconcat(fstorage->path, "/", dp->d_name, NULL);
+			if ( stat(path, &st) < 0 ) {
+				e_warning(storage->event,
+					  "stat(%s) failed: %m", path);
+				continue;
+			}
+			size = st.st_size;
+		}
+
+		entry = array_append_space(&cache->entries);
+		entry->name = p_strdup(pool, name);
+		entry->fname = p_strdup(pool, dp->d_name);
+		entry->size = size;
+	}
+
+	/* Close directory */
+	if ( closedir(dirp) < 0 ) {
+		e_error(storage->event,
+			"closedir(%s) failed: %m", fstorage->path);
+	}
+
+	if ( failed ) {
+		pool_unref(&pool);
+		return NULL;
+	}
+	return cache;
+}
+
+struct sieve_file_storage_dir_cache *sieve_file_storage_dir_cache_get
+(struct sieve_file_storage *fstorage, bool sizes)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_storage_dir_cache *cache = fstorage->dir_cache;
+	struct timespec mtime;
+	struct stat st;
+
+	if ( stat(fstorage->path, &st) < 0 ) {
+		if ( errno != ENOENT ) {
+			sieve_storage_set_critical(storage,
+				"Failed to list scripts: "
+				"stat(%s) failed: %m", fstorage->path);
+			return NULL;
+		}
+		/* Let the scan report the missing directory */
+		i_zero(&mtime);
+	} else {
+		mtime.tv_sec = st.st_mtime;
+		mtime.tv_nsec = ST_MTIME_NSEC(st);
+	}
+
+	if ( cache != NULL && cache->valid &&
+		(cache->have_sizes || !sizes) &&
+		cache->mtime.tv_sec == mtime.tv_sec &&
+		cache->mtime.tv_nsec == mtime.tv_nsec )
+		return cache;
+
+	sieve_file_storage_dir_cache_invalidate(fstorage);
+	if ( (cache = sieve_file_storage_dir_scan(fstorage, sizes)) == NULL )
+		return NULL;
+
+	/* Changes made within the same second as the scan may not be visible
+	   in the mtime on all file systems; don't rely on the scan result
+	   in that case. */
+	cache->mtime = mtime;
+	cache->valid = ( mtime.tv_sec > 0 && mtime.tv_sec < time(NULL) );
+	fstorage->dir_cache = cache;
+	return cache;
+}
+
+void sieve_file_storage_dir_cache_invalidate
+(struct sieve_file_storage *fstorage)
+{
+	pool_t pool;
+
+	if ( fstorage->dir_cache == NULL )
+		return;
+
+	pool = fstorage->dir_cache->pool;
+	fstorage->dir_cache = NULL;
+	pool_unref(&pool);
+}
+
+/*
+ * Script listing
+ */
+
+struct sieve_file_list_context {
+	struct sieve_storage_list_context context;
+	pool_t pool;
+
+	const char *active;
+	struct sieve_file_storage_dir_cache *cache;
+	unsigned int index;
+};
+
+struct sieve_storage_list_context *sieve_file_storage_list_init
+(struct sieve_storage *storage)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	struct sieve_file_storage_dir_cache *cache;
+	struct sieve_file_list_context *flctx;
+	const char *active = NULL;
+	pool_t pool;
+
+	/* List the directory */
+	if ( (cache = sieve_file_storage_dir_cache_get(fstorage, FALSE)) == NULL )
+		return NULL;
+
 	T_BEGIN {
 		/* Get the name of the active script */
 		if ( sieve_file_storage_active_script_get_file(fstorage, &active) < 0) {
@@ -64,18 +218,17 @@ struct sieve_storage_list_context *sieve_file_storage_list_init
 			pool = pool_alloconly_create("sieve_file_list_context", 1024);
 			flctx = p_new(pool, struct sieve_file_list_context, 1);
 			flctx->pool = pool;
-			flctx->dirp = dirp;
 			flctx->active = ( active != NULL ? p_strdup(pool, active) : NULL );
+
+			/* Keep the listing, even if the cache is refreshed while
+			   iterating */
+			pool_ref(cache->pool);
+			flctx->cache = cache;
 		}
 	} T_END;
 
-	if ( flctx == NULL ) {
-		if ( closedir(dirp) < 0) {
-			e_error(storage->event,
-				"closedir(%s) failed: %m", fstorage->path);	
-		}
+	if ( flctx == NULL )
 		return NULL;
-	}
 	return &flctx->context;
 }
 
@@ -84,57 +237,31 @@ const char *sieve_file_storage_list_next
 {
 	struct sieve_file_list_context *flctx =
 		(struct sieve_file_list_context *)ctx;
-	const struct sieve_file_storage *fstorage =
-		(const struct sieve_file_storage *)ctx->storage;
-	struct dirent *dp;
-	const char *scriptname;
+	const struct sieve_file_storage_dir_entry *entry;
 
 	*active = FALSE;
 
-	for (;;) {
-		if ( (dp = readdir(flctx->dirp)) == NULL )
-			return NULL;
-
-		scriptname = sieve_script_file_get_scriptname(dp->d_name);
-		if (scriptname != NULL ) {
-			/* Don't list our active sieve script link if the link
-			 * resides in the script dir (generally a bad idea).
-			 */
-			i_assert( fstorage->link_path != NULL );
-			if ( *(fstorage->link_path) == '\0' &&
-				strcmp(fstorage->active_fname, dp->d_name) == 0 )
-				continue;
-
-			break;
-		}
-	}
+	if ( flctx->index >= array_count(&flctx->cache->entries) )
+		return NULL;
+	entry = array_idx(&flctx->cache->entries, flctx->index++);
 
-	if ( flctx->active != NULL && strcmp(dp->d_name, flctx->active) == 0 ) {
+	if ( flctx->active != NULL && strcmp(entry->fname, flctx->active) == 0 ) {
 		*active = TRUE;
 		flctx->active = NULL;
 	}
 
-	return scriptname;
+	return entry->name;
 }
 
 int sieve_file_storage_list_deinit(struct sieve_storage_list_context *lctx)
 {
 	struct sieve_file_list_context *flctx =
 		(struct sieve_file_list_context *)lctx;
-	const struct sieve_file_storage *fstorage =
-		(const struct sieve_file_storage *)lctx->storage;
-
-	if (closedir(flctx->dirp) < 0) {
-		e_error(lctx->storage->event,
-			"closedir(%s) failed: %m", fstorage->path);
-	}
+	pool_t cache_pool = flctx->cache->pool;
 
+	pool_unref(&cache_pool);
 	pool_unref(&flctx->pool);
 
 	// FIXME: return error here if something went wrong during listing
 	return 0;
 }
-
-
-
-
@@ -278,6 +278,50 @@ int sieve_file_storage_save_continue
 	return 0;
 }
 
+static bool
+sieve_file_storage_save_defer_sync(struct sieve_storage *storage ATTR_UNUSED)
+{
+#ifdef HAVE_SYNCFS
+	return ( storage->save_batch > 0 );
+#else
+	return FALSE;
+#endif
+}
+
+static int sieve_file_storage_save_sync(struct sieve_storage *storage)
+{
+#ifdef HAVE_SYNCFS
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	int fd, ret = 0;
+
+	if ( !storage->save_sync_pending )
+		return 0;
+
+	/* One syncfs() flushes all scripts saved in this batch; they all
+	   reside in the storage's tmp directory on the same filesystem. */
+	fd = open(fstorage->path, O_RDONLY);
+	if ( fd == -1 ) {
+		sieve_storage_set_critical(storage, "save: "
+			"open(%s) failed: %m", fstorage->path);
+		return -1;
+	}
+	if ( syncfs(fd) < 0 ) {
+		sieve_storage_set_critical(storage, "save: "
+			"syncfs(%s) failed: %m", fstorage->path);
+		ret = -1;
+	}
+	i_close_fd(&fd);
+
+	if ( ret == 0 )
+		storage->save_sync_pending = FALSE;
+	return ret;
+#else
+	i_assert(!storage->save_sync_pending);
+	return 0;
+#endif
+}
+
 int sieve_file_storage_save_finish
 (struct sieve_storage_save_context *sctx)
 {
@@ -295,7 +339,11 @@ int sieve_file_storage_save_finish
 		output_errno = fsctx->output->stream_errno;
 		o_stream_destroy(&fsctx->output);
 
-		if ( fsync(fsctx->fd) < 0 ) {
+		if ( sieve_file_storage_save_defer_sync(storage) ) {
+			/* Flushed together with the rest of the batch before
+			   the first commit */
+			storage->save_sync_pending = TRUE;
+		} else if ( fsync(fsctx->fd) < 0 ) {
 			sieve_storage_set_critical(storage, "save: "
 				"fsync(%s) failed: %m", fsctx->tmp_path);
 			sctx->failed = TRUE;
@@ -403,6 +451,14 @@ int sieve_file_storage_save_commit
 
 	i_assert(fsctx->output == NULL);
 
+	if ( sieve_file_storage_save_sync(storage) < 0 ) {
+		if ( unlink(fsctx->tmp_path) < 0 && errno != ENOENT ) {
+			e_warning(storage->event, "save: "
+				  "unlink(%s) failed: %m", fsctx->tmp_path);
+		}
+		return -1;
+	}
+
 	T_BEGIN {
 		dest_path = t_strconcat(fstorage->path, "/",
 			sieve_script_file_from_name(sctx->scriptname), NULL);
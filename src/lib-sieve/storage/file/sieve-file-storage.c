@@ -8,6 +8,7 @@
 #include "mkdir-parents.h"
 #include "eacces-error.h"
 #include "unlink-old-files.h"
+#include "write-full.h"
 #include "mail-storage-private.h"
 
 #include "sieve.h"
@@ -22,6 +23,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <utime.h>
+#include <fcntl.h>
 #include <sys/time.h>
 
 
@@ -230,6 +232,22 @@ static struct sieve_storage *sieve_file_storage_alloc(void)
 	return &fstorage->storage;
 }
 
+static void sieve_file_storage_destroy(struct sieve_storage *storage)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+
+	sieve_file_storage_dir_cache_invalidate(fstorage);
+}
+
+static void sieve_file_storage_release_memory(struct sieve_storage *storage)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+
+	sieve_file_storage_dir_cache_invalidate(fstorage);
+}
+
 static int
 sieve_file_storage_get_full_path(struct sieve_file_storage *fstorage,
 				 const char **storage_path,
@@ -811,6 +829,9 @@ int sieve_file_storage_pre_modify(struct sieve_storage *storage)
 {
 	i_assert((storage->flags & SIEVE_STORAGE_FLAG_READWRITE) != 0);
 
+	sieve_file_storage_dir_cache_invalidate(
+		(struct sieve_file_storage *)storage);
+
 	return sieve_storage_get_last_change(storage, NULL);
 }
 
@@ -849,6 +870,42 @@ sieve_file_storage_set_modified(struct sieve_storage *storage, time_t mtime)
 	}
 }
 
+static int
+sieve_file_storage_changelog_append(struct sieve_storage *storage,
+				    const char *entry)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	const char *path;
+	int fd, ret = 0;
+
+	path = sieve_file_storage_path_extend(
+		fstorage, SIEVE_FILE_STORAGE_CHANGELOG_FNAME);
+
+	/* Entries are short, so a single O_APPEND write keeps concurrent
+	   writers from interleaving */
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT,
+		  fstorage->file_create_mode);
+	if (fd == -1) {
+		if (errno == EACCES) {
+			e_error(storage->event, "%s",
+				eacces_error_get_creating("open", path));
+		} else {
+			e_error(storage->event, "open(%s) failed: %m", path);
+		}
+		return -1;
+	}
+	if (write_full(fd, entry, strlen(entry)) < 0) {
+		e_error(storage->event, "write(%s) failed: %m", path);
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		e_error(storage->event, "close(%s) failed: %m", path);
+		ret = -1;
+	}
+	return ret;
+}
+
 /*
  * Script access
  */
@@ -877,12 +934,15 @@ const struct sieve_storage sieve_file_storage = {
 	.allows_synchronization = TRUE,
 	.v = {
 		.alloc = sieve_file_storage_alloc,
+		.destroy = sieve_file_storage_destroy,
 		.init = sieve_file_storage_init,
 
 		.get_last_change = sieve_file_storage_get_last_change,
 		.set_modified = sieve_file_storage_set_modified,
+		.changelog_append = sieve_file_storage_changelog_append,
 
 		.is_singular = sieve_file_storage_is_singular,
+		.release_memory = sieve_file_storage_release_memory,
 
 		.get_script = sieve_file_storage_get_script,
 
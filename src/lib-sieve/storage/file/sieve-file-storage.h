@@ -20,10 +20,33 @@
 /* Delete files having ctime older than this from tmp/. 36h is standard. */
 #define SIEVE_FILE_STORAGE_TMP_DELETE_SECS (36*60*60)
 
+/* Change log kept in the storage directory (when enabled) */
+#define SIEVE_FILE_STORAGE_CHANGELOG_FNAME ".dovecot-sieve.changelog"
+
 /*
  * Storage class
  */
 
+/* Scripts found in the storage directory by the last scan. This is reused
+   for listing scripts and checking quota for as long as the mtime of the
+   directory is unchanged. */
+struct sieve_file_storage_dir_entry {
+	const char *name;
+	const char *fname;
+	/* Only determined when requested */
+	uoff_t size;
+};
+
+struct sieve_file_storage_dir_cache {
+	pool_t pool;
+
+	ARRAY(struct sieve_file_storage_dir_entry) entries;
+	struct timespec mtime;
+
+	bool have_sizes:1;
+	bool valid:1;
+};
+
 struct sieve_file_storage {
 	struct sieve_storage storage;
 
@@ -40,6 +63,8 @@ struct sieve_file_storage {
 	gid_t file_create_gid;
 
 	time_t prev_mtime;
+
+	struct sieve_file_storage_dir_cache *dir_cache;
 };
 
 const char *sieve_file_storage_path_extend
@@ -53,6 +78,15 @@ struct sieve_file_storage *sieve_file_storage_init_from_path
 int sieve_file_storage_pre_modify
 	(struct sieve_storage *storage);
 
+/* Directory cache */
+
+/* Returns the up-to-date directory listing, or NULL on error. The result is
+   valid until the next call; reference the pool to keep it longer. */
+struct sieve_file_storage_dir_cache *sieve_file_storage_dir_cache_get
+	(struct sieve_file_storage *fstorage, bool sizes);
+void sieve_file_storage_dir_cache_invalidate
+	(struct sieve_file_storage *fstorage);
+
 /* Active script */
 
 int sieve_file_storage_active_replace_link
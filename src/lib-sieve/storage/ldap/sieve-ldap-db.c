@@ -16,6 +16,7 @@
 #include "ioloop.h"
 #include "array.h"
 #include "hash.h"
+#include "llist.h"
 #include "aqueue.h"
 #include "str.h"
 #include "time-util.h"
@@ -56,9 +57,11 @@ struct db_ldap_sasl_bind_context {
 };
 
 static struct ldap_connection *ldap_connections = NULL;
+static unsigned int ldap_idle_connections_count = 0;
 
 static int db_ldap_bind(struct ldap_connection *conn);
 static void db_ldap_conn_close(struct ldap_connection *conn);
+static void db_ldap_connect_failed(struct ldap_connection *conn);
 
 int ldap_deref_from_str(const char *str, int *deref_r)
 {
@@ -324,6 +327,8 @@ static int db_ldap_connect_finish(struct ldap_connection *conn, int ret)
 
 	timeout_remove(&conn->to);
 	conn->conn_state = LDAP_CONN_STATE_BOUND;
+	conn->reconnect_time = 0;
+	conn->reconnect_backoff_secs = 0;
 	e_debug(storage->event, "db: "
 		"Successfully bound (dn %s)",
 		set->dn == NULL ? "(none)" : set->dn);
@@ -343,6 +348,7 @@ static void db_ldap_default_bind_finished(struct ldap_connection *conn,
 	ret = ldap_result2error(conn->ld, res->msg, FALSE);
 	if (db_ldap_connect_finish(conn, ret) < 0) {
 		/* lost connection, close it */
+		db_ldap_connect_failed(conn);
 		db_ldap_conn_close(conn);
 	}
 }
@@ -785,7 +791,21 @@ static int db_ldap_set_options(struct ldap_connection *conn)
 	return 0;
 }
 
-int sieve_ldap_db_connect(struct ldap_connection *conn)
+static void db_ldap_connect_failed(struct ldap_connection *conn)
+{
+	/* Avoid hammering the servers with connection attempts when they
+	   are down or refuse us */
+	if (conn->reconnect_backoff_secs == 0)
+		conn->reconnect_backoff_secs = 1;
+	else {
+		conn->reconnect_backoff_secs =
+			I_MIN(conn->reconnect_backoff_secs * 2,
+			      DB_LDAP_RECONNECT_MAX_BACKOFF_SECS);
+	}
+	conn->reconnect_time = ioloop_time + conn->reconnect_backoff_secs;
+}
+
+static int db_ldap_connect(struct ldap_connection *conn)
 {
 	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
 	struct sieve_storage *storage = &conn->lstorage->storage;
@@ -796,9 +816,6 @@ int sieve_ldap_db_connect(struct ldap_connection *conn)
 	int ret;
 #endif
 
-	if (conn->conn_state != LDAP_CONN_STATE_DISCONNECTED)
-		return 0;
-
 	debug = FALSE;
 	if (str_to_int(set->debug_level, &debug_level) >= 0)
 		debug = debug_level > 0;
@@ -893,6 +910,26 @@ int sieve_ldap_db_connect(struct ldap_connection *conn)
 	return 0;
 }
 
+int sieve_ldap_db_connect(struct ldap_connection *conn)
+{
+	struct sieve_storage *storage = &conn->lstorage->storage;
+
+	if (conn->conn_state != LDAP_CONN_STATE_DISCONNECTED)
+		return 0;
+
+	if (conn->reconnect_time > ioloop_time) {
+		e_debug(storage->event, "db: "
+			"Not connecting for another %ld secs after failure",
+			(long)(conn->reconnect_time - ioloop_time));
+		return -1;
+	}
+	if (db_ldap_connect(conn) < 0) {
+		db_ldap_connect_failed(conn);
+		return -1;
+	}
+	return 0;
+}
+
 void db_ldap_enable_input(struct ldap_connection *conn, bool enable)
 {
 	if (!enable) {
@@ -986,17 +1023,74 @@ const char *ldap_escape(const char *str)
 	return str_c(ret);
 }
 
+static const char *
+db_ldap_conn_key(const struct sieve_ldap_storage_settings *set)
+{
+	const char *const values[] = {
+		set->hosts, set->uris, set->dn, set->dnpass,
+		set->sasl_mech, set->sasl_realm, set->sasl_authz_id,
+		set->tls_ca_cert_file, set->tls_ca_cert_dir,
+		set->tls_cert_file, set->tls_key_file,
+		set->tls_cipher_suite, set->tls_require_cert,
+		set->deref, set->ldaprc_path, set->debug_level,
+	};
+	string_t *key = t_str_new(256);
+	unsigned int i;
+
+	str_printfa(key, "%d %d %u", set->tls ? 1 : 0,
+		    set->sasl_bind ? 1 : 0, set->ldap_version);
+	for (i = 0; i < N_ELEMENTS(values); i++) {
+		str_append_c(key, '\n');
+		if (values[i] != NULL)
+			str_append(key, values[i]);
+	}
+	return str_c(key);
+}
+
+static struct ldap_connection *
+db_ldap_conn_find_idle(struct sieve_ldap_storage *lstorage, const char *key)
+{
+	struct ldap_connection *conn;
+
+	for (conn = ldap_connections; conn != NULL; conn = conn->next) {
+		if (conn->refcount == 0 && strcmp(conn->key, key) == 0)
+			break;
+	}
+	if (conn == NULL)
+		return NULL;
+
+	i_assert(ldap_idle_connections_count > 0);
+	ldap_idle_connections_count--;
+
+	conn->refcount = 1;
+	conn->lstorage = lstorage;
+	if (conn->fd != -1)
+		conn->io = io_add(conn->fd, IO_READ, ldap_input, conn);
+
+	e_debug(lstorage->storage.event, "db: Reusing idle connection");
+	return conn;
+}
+
 struct ldap_connection *
 sieve_ldap_db_init(struct sieve_ldap_storage *lstorage)
 {
 	struct ldap_connection *conn;
+	const char *key;
 	pool_t pool;
 
+	/* Reuse a bound connection left behind by an earlier storage with
+	   the same settings, e.g. for the previous recipient */
+	key = db_ldap_conn_key(&lstorage->set);
+	conn = db_ldap_conn_find_idle(lstorage, key);
+	if (conn != NULL)
+		return conn;
+
 	pool = pool_alloconly_create("ldap_connection", 1024);
 	conn = p_new(pool, struct ldap_connection, 1);
 	conn->pool = pool;
 	conn->refcount = 1;
 	conn->lstorage = lstorage;
+	conn->key = p_strdup(pool, key);
 
 	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
 	conn->default_bind_msgid = -1;
@@ -1010,16 +1104,10 @@ sieve_ldap_db_init(struct sieve_ldap_storage *lstorage)
 	return conn;
 }
 
-void sieve_ldap_db_unref(struct ldap_connection **_conn)
+static void db_ldap_conn_free(struct ldap_connection *conn)
 {
-	struct ldap_connection *conn = *_conn;
 	struct ldap_connection **p;
 
-	*_conn = NULL;
-	i_assert(conn->refcount >= 0);
-	if (--conn->refcount > 0)
-		return;
-
 	for (p = &ldap_connections; *p != NULL; p = &(*p)->next) {
 		if (*p == conn) {
 			*p = conn->next;
@@ -1027,8 +1115,6 @@ void sieve_ldap_db_unref(struct ldap_connection **_conn)
 		}
 	}
 
-	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
-	i_assert(conn->pending_count == 0);
 	db_ldap_conn_close(conn);
 	i_assert(conn->to == NULL);
 
@@ -1038,6 +1124,47 @@ void sieve_ldap_db_unref(struct ldap_connection **_conn)
 	pool_unref(&conn->pool);
 }
 
+void sieve_ldap_db_unref(struct ldap_connection **_conn)
+{
+	struct ldap_connection *conn = *_conn;
+
+	*_conn = NULL;
+	i_assert(conn->refcount > 0);
+	if (--conn->refcount > 0)
+		return;
+
+	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
+	i_assert(conn->pending_count == 0);
+
+	if (conn->conn_state == LDAP_CONN_STATE_BOUND &&
+	    ldap_idle_connections_count < DB_LDAP_MAX_IDLE_CONNECTIONS) {
+		/* Keep the connection bound for the next storage. It isn't
+		   watched while idle; if the server closed it meanwhile, the
+		   next request notices and reconnects. */
+		timeout_remove(&conn->to);
+		io_remove(&conn->io);
+		conn->lstorage = NULL;
+		ldap_idle_connections_count++;
+		return;
+	}
+
+	db_ldap_conn_free(conn);
+}
+
+void sieve_ldap_db_connections_deinit(void)
+{
+	struct ldap_connection *conn, *next;
+
+	for (conn = ldap_connections; conn != NULL; conn = next) {
+		next = conn->next;
+		if (conn->refcount == 0) {
+			i_assert(ldap_idle_connections_count > 0);
+			ldap_idle_connections_count--;
+			db_ldap_conn_free(conn);
+		}
+	}
+}
+
 static void db_ldap_switch_ioloop(struct ldap_connection *conn)
 {
 	if (conn->to != NULL)
@@ -1083,6 +1210,20 @@ static void sieve_ldap_db_script_free(unsigned char *script)
 	i_free(script);
 }
 
+static struct istream *
+sieve_ldap_db_script_stream(const void *data, size_t size)
+{
+	struct istream *input;
+	unsigned char *copy;
+
+	copy = i_malloc(I_MAX(size, 1));
+	memcpy(copy, data, size);
+
+	input = i_stream_create_from_data(copy, size);
+	i_stream_add_destroy_callback(input, sieve_ldap_db_script_free, copy);
+	return input;
+}
+
 static int
 sieve_ldap_db_get_script_modattr(struct ldap_connection *conn,
 	LDAPMessage *entry, pool_t pool, const char **modattr_r)
@@ -1128,7 +1269,6 @@ sieve_ldap_db_get_script(struct ldap_connection *conn,
 	const struct sieve_ldap_storage_settings *set = &conn->lstorage->set;
 	struct sieve_storage *storage = &conn->lstorage->storage;
 	char *attr;
-	unsigned char *data;
 	size_t size;
 	struct berval **vals;
 	BerElement *ber;
@@ -1147,19 +1287,15 @@ sieve_ldap_db_get_script(struct ldap_connection *conn,
 			}
 
 			size = vals[0]->bv_len;
-			data = i_malloc(size);
 
 			e_debug(storage->event, "db: "
 				"Found script with length %zu", size);
 
-			memcpy(data, vals[0]->bv_val, size);
+			*script_r = sieve_ldap_db_script_stream(
+				vals[0]->bv_val, size);
 
 			ldap_value_free_len(vals);
 			ldap_memfree(attr);
-
-			*script_r = i_stream_create_from_data(data, size);
-			i_stream_add_destroy_callback
-				(*script_r,	sieve_ldap_db_script_free, data);
 			return 1;
 		}
 		ldap_memfree(attr);
@@ -1207,12 +1343,153 @@ db_ldap_get_var_expand_table(struct ldap_connection *conn,
 	return tab;
 }
 
+/*
+ * Lookup cache
+ */
+
+#define SIEVE_LDAP_CACHE_MAX_ENTRIES 1024
+
+struct sieve_ldap_cache_entry {
+	struct sieve_ldap_cache_entry *prev, *next;
+
+	char *key;
+	time_t expires;
+
+	/* dn is NULL when no entry was found for the script */
+	char *dn, *modattr;
+	/* Script source, if it was fetched along with the lookup; script is
+	   NULL when the entry has no script attribute */
+	buffer_t *script;
+	bool have_script:1;
+};
+
+/* The cache is kept per process, so that it outlives the storage of an
+   individual delivery */
+static HASH_TABLE(char *, struct sieve_ldap_cache_entry *) ldap_cache;
+/* Least recently added first */
+static struct sieve_ldap_cache_entry *ldap_cache_head = NULL;
+static struct sieve_ldap_cache_entry *ldap_cache_tail = NULL;
+static unsigned int ldap_cache_count = 0;
+
+static const char *
+sieve_ldap_cache_key(struct ldap_connection *conn, const char *name)
+{
+	struct sieve_ldap_storage *lstorage = conn->lstorage;
+
+	return t_strconcat(lstorage->config_file, "\n",
+			   lstorage->username, "\n", name, NULL);
+}
+
+static void sieve_ldap_cache_entry_free(struct sieve_ldap_cache_entry *entry)
+{
+	hash_table_remove(ldap_cache, entry->key);
+	DLLIST2_REMOVE(&ldap_cache_head, &ldap_cache_tail, entry);
+	i_assert(ldap_cache_count > 0);
+	ldap_cache_count--;
+
+	if (entry->script != NULL)
+		buffer_free(&entry->script);
+	i_free(entry->key);
+	i_free(entry->dn);
+	i_free(entry->modattr);
+	i_free(entry);
+}
+
+void sieve_ldap_db_cache_deinit(void)
+{
+	if (!hash_table_is_created(ldap_cache))
+		return;
+
+	while (ldap_cache_head != NULL)
+		sieve_ldap_cache_entry_free(ldap_cache_head);
+	hash_table_destroy(&ldap_cache);
+}
+
+static struct sieve_ldap_cache_entry *
+sieve_ldap_cache_lookup(struct ldap_connection *conn, const char *name,
+			bool want_script)
+{
+	struct sieve_storage *storage = &conn->lstorage->storage;
+	struct sieve_ldap_cache_entry *entry;
+
+	if (conn->lstorage->set.sieve_ldap_cache_ttl == 0 ||
+	    !hash_table_is_created(ldap_cache))
+		return NULL;
+
+	entry = hash_table_lookup(ldap_cache,
+				  sieve_ldap_cache_key(conn, name));
+	if (entry == NULL)
+		return NULL;
+	if (entry->expires <= ioloop_time) {
+		sieve_ldap_cache_entry_free(entry);
+		return NULL;
+	}
+	if (want_script && entry->dn != NULL && !entry->have_script)
+		return NULL;
+
+	e_debug(storage->event, "db: "
+		"Using cached lookup result for script `%s'", name);
+	return entry;
+}
+
+static void
+sieve_ldap_cache_add(struct ldap_connection *conn, const char *name,
+		     const char *dn, const char *modattr, bool have_script,
+		     struct istream *script)
+{
+	unsigned int ttl = conn->lstorage->set.sieve_ldap_cache_ttl;
+	struct sieve_ldap_cache_entry *entry;
+	const unsigned char *data;
+	const char *key;
+	size_t size;
+
+	if (ttl == 0)
+		return;
+
+	if (!hash_table_is_created(ldap_cache)) {
+		hash_table_create(&ldap_cache, default_pool, 0,
+				  str_hash, strcmp);
+	}
+
+	key = sieve_ldap_cache_key(conn, name);
+	entry = hash_table_lookup(ldap_cache, key);
+	if (entry != NULL)
+		sieve_ldap_cache_entry_free(entry);
+
+	entry = i_new(struct sieve_ldap_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->expires = ioloop_time + ttl;
+	entry->dn = i_strdup(dn);
+	entry->modattr = i_strdup(modattr);
+	entry->have_script = have_script;
+	if (script != NULL) {
+		/* The stream is created from a single memory block */
+		(void)i_stream_read_more(script, &data, &size);
+		entry->script = buffer_create_dynamic(default_pool, size);
+		buffer_append(entry->script, data, size);
+	}
+
+	hash_table_insert(ldap_cache, entry->key, entry);
+	DLLIST2_APPEND(&ldap_cache_head, &ldap_cache_tail, entry);
+	if (++ldap_cache_count > SIEVE_LDAP_CACHE_MAX_ENTRIES)
+		sieve_ldap_cache_entry_free(ldap_cache_head);
+}
+
+/*
+ * Script lookup
+ */
+
 struct sieve_ldap_script_lookup_request {
 	struct ldap_request request;
 
 	unsigned int entries;
 	const char *result_dn;
 	const char *result_modattr;
+
+	bool want_script;
+	struct istream *result_script;
+
+	bool failed:1;
 };
 
 static void
@@ -1224,6 +1501,7 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 		(struct sieve_ldap_script_lookup_request *)request;
 
 	if (res == NULL) {
+		srequest->failed = TRUE;
 		io_loop_stop(conn->ioloop);
 		return;
 	}
@@ -1234,6 +1512,10 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 				(request->pool, ldap_get_dn(conn->ld, res));
 			(void)sieve_ldap_db_get_script_modattr
 				(conn, res, request->pool, &srequest->result_modattr);
+			if (srequest->want_script) {
+				(void)sieve_ldap_db_get_script(
+					conn, res, &srequest->result_script);
+			}
 		} else if (srequest->entries++ == 0) {
 			e_warning(storage->event, "db: "
 				  "Search returned more than one entry for Sieve script; "
@@ -1246,17 +1528,39 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 }
 
 int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
-	const char *name, const char **dn_r, const char **modattr_r)
+	const char *name, const char **dn_r, const char **modattr_r,
+	struct istream **script_r)
 {
 	struct sieve_ldap_storage *lstorage = conn->lstorage;
 	struct sieve_storage *storage = &lstorage->storage;
 	const struct sieve_ldap_storage_settings *set = &lstorage->set;
 	struct sieve_ldap_script_lookup_request *request;
+	struct sieve_ldap_cache_entry *entry;
 	const struct var_expand_table *tab;
 	char **attr_names;
 	const char *error;
 	string_t *str;
 
+	if (script_r != NULL)
+		*script_r = NULL;
+
+	entry = sieve_ldap_cache_lookup(conn, name, script_r != NULL);
+	if (entry != NULL) {
+		*dn_r = t_strdup(entry->dn);
+		*modattr_r = t_strdup(entry->modattr);
+		if (script_r != NULL && entry->script != NULL) {
+			*script_r = sieve_ldap_db_script_stream(
+				entry->script->data, entry->script->used);
+		}
+		return (*dn_r == NULL ? 0 : 1);
+	}
+
+	if (sieve_ldap_db_connect(conn) < 0) {
+		e_error(storage->event, "db: "
+			"Failed to connect to LDAP database");
+		return -1;
+	}
+
 	pool_t pool = pool_alloconly_create
 		("sieve_ldap_script_lookup_request", 512);
 	request = p_new(pool, struct sieve_ldap_script_lookup_request, 1);
@@ -1275,6 +1579,11 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 
 	attr_names = p_new(pool, char *, 3);
 	attr_names[0] = p_strdup(pool, set->sieve_ldap_mod_attr);
+	if (script_r != NULL) {
+		/* Saves a second round trip for reading the script */
+		attr_names[1] = p_strdup(pool, set->sieve_ldap_script_attr);
+		request->want_script = TRUE;
+	}
 
 	str_truncate(str, 0);
 	if (var_expand(str, set->sieve_ldap_filter, tab, &error) <= 0) {
@@ -1299,6 +1608,18 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 
 	*dn_r = t_strdup(request->result_dn);
 	*modattr_r = t_strdup(request->result_modattr);
+	if (request->failed) {
+		if (request->result_script != NULL)
+			i_stream_unref(&request->result_script);
+	} else {
+		sieve_ldap_cache_add(conn, name, *dn_r, *modattr_r,
+				     request->want_script,
+				     request->result_script);
+	}
+	if (script_r != NULL)
+		*script_r = request->result_script;
+	else
+		i_assert(request->result_script == NULL);
 	pool_unref(&request->request.pool);
 	return (*dn_r == NULL ? 0 : 1);
 }
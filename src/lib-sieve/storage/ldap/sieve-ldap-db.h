@@ -15,6 +15,12 @@
 /* If server disconnects us, don't reconnect if no requests have been sent
    for this many seconds. */
 #define DB_LDAP_IDLE_RECONNECT_SECS 60
+/* Maximum number of unreferenced connections kept bound for reuse by later
+   storages with the same connection settings. */
+#define DB_LDAP_MAX_IDLE_CONNECTIONS 4
+/* Connection attempts after a failure are delayed exponentially, starting at
+   one second, up to this many seconds. */
+#define DB_LDAP_RECONNECT_MAX_BACKOFF_SECS 60
 
 #include <ldap.h>
 
@@ -108,6 +114,14 @@ struct ldap_connection {
 
 	/* Timestamp when we last received a reply */
 	time_t last_reply_stamp;
+
+	/* Connection settings this connection was created with; only idle
+	   connections with the same key are reused */
+	const char *key;
+
+	/* Don't try to connect before this time after a failure */
+	time_t reconnect_time;
+	unsigned int reconnect_backoff_secs;
 };
 
 
@@ -132,9 +146,17 @@ struct ldap_connection *
 sieve_ldap_db_init(struct sieve_ldap_storage *lstorage);
 void sieve_ldap_db_unref(struct ldap_connection **conn);
 
+/* Finds the entry of the script. If script_r is not NULL, the script source
+   is fetched along with it; *script_r is then NULL if the entry has no
+   script attribute. */
 int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
-	const char *name, const char **dn_r, const char **modattr_r);
+	const char *name, const char **dn_r, const char **modattr_r,
+	struct istream **script_r) ATTR_NULL(5);
 int sieve_ldap_db_read_script(struct ldap_connection *conn,
 	const char *dn, struct istream **script_r);
 
+void sieve_ldap_db_cache_deinit(void);
+/* Closes the connections kept for reuse */
+void sieve_ldap_db_connections_deinit(void);
+
 #endif
@@ -54,6 +54,15 @@ struct sieve_ldap_script *sieve_ldap_script_init
 	return lscript;
 }
 
+static void sieve_ldap_script_destroy(struct sieve_script *script)
+{
+	struct sieve_ldap_script *lscript =
+		(struct sieve_ldap_script *)script;
+
+	if ( lscript->input != NULL )
+		i_stream_unref(&lscript->input);
+}
+
 static int sieve_ldap_script_open
 (struct sieve_script *script, enum sieve_error *error_r)
 {
@@ -64,15 +73,14 @@ static int sieve_ldap_script_open
 		(struct sieve_ldap_storage *)storage;
 	int ret;
 
-	if ( sieve_ldap_db_connect(lstorage->conn) < 0 ) {
-		sieve_storage_set_critical(storage,
-			"Failed to connect to LDAP database");
-		*error_r = storage->error_code;
-		return -1;
-	}
+	/* Without a bin directory the script source is always needed, so it
+	   is fetched by the same search */
+	if ( storage->bin_dir == NULL )
+		lscript->have_input = TRUE;
 
 	if ( (ret=sieve_ldap_db_lookup_script(lstorage->conn,
-		script->name, &lscript->dn, &lscript->modattr)) <= 0 ) {
+		script->name, &lscript->dn, &lscript->modattr,
+		(lscript->have_input ? &lscript->input : NULL))) <= 0 ) {
 		if ( ret == 0 ) {
 			e_debug(script->event, "Script entry not found");
 			sieve_script_set_error(script,
@@ -101,8 +109,15 @@ static int sieve_ldap_script_get_stream
 
 	i_assert(lscript->dn != NULL);
 
-	if ( (ret=sieve_ldap_db_read_script(
-		lstorage->conn, lscript->dn, stream_r)) <= 0 ) {
+	if ( lscript->have_input ) {
+		ret = ( lscript->input == NULL ? 0 : 1 );
+		*stream_r = lscript->input;
+		lscript->input = NULL;
+	} else {
+		ret = sieve_ldap_db_read_script(
+			lstorage->conn, lscript->dn, stream_r);
+	}
+	if ( ret <= 0 ) {
 		if ( ret == 0 ) {
 			e_debug(script->event, "Script attribute not found");
 			sieve_script_set_error(script,
@@ -250,8 +265,10 @@ static struct sieve_binary *sieve_ldap_script_binary_load
 	struct sieve_ldap_script *lscript =
 		(struct sieve_ldap_script *)script;
 
+	/* Without a bin directory, binaries are shared among all users
+	   with identical scripts (if a shared directory is configured) */
 	if ( sieve_ldap_script_get_binpath(lscript) == NULL )
-		return NULL;
+		return sieve_binary_open_shared(script, error_r);
 
 	return sieve_binary_open(storage->svinst,
 		lscript->binpath, script, error_r);
@@ -265,7 +282,7 @@ static int sieve_ldap_script_binary_save
 		(struct sieve_ldap_script *)script;
 
 	if ( sieve_ldap_script_get_binpath(lscript) == NULL )
-		return 0;
+		return sieve_binary_save_shared(sbin, update, error_r);
 
 	if ( sieve_storage_setup_bindir(script->storage, 0700) < 0 )
 		return -1;
@@ -291,6 +308,8 @@ static bool sieve_ldap_script_equals
 const struct sieve_script sieve_ldap_script = {
 	.driver_name = SIEVE_LDAP_STORAGE_DRIVER_NAME,
 	.v = {
+		.destroy = sieve_ldap_script_destroy,
+
 		.open = sieve_ldap_script_open,
 
 		.get_stream = sieve_ldap_script_get_stream,
@@ -158,6 +158,12 @@ int sieve_ldap_storage_active_script_get_name
  */
 
 #ifndef PLUGIN_BUILD
+void sieve_ldap_storage_caches_free(void)
+{
+	sieve_ldap_db_cache_deinit();
+	sieve_ldap_db_connections_deinit();
+}
+
 const struct sieve_storage sieve_ldap_storage = {
 #else
 const struct sieve_storage sieve_ldap_storage_plugin = {
@@ -220,11 +226,17 @@ void sieve_storage_ldap_plugin_init(void)
 
 void sieve_storage_ldap_plugin_deinit(void)
 {
-	/* Nothing */
+	sieve_ldap_db_cache_deinit();
+	sieve_ldap_db_connections_deinit();
 }
 #endif
 
 #else /* !defined(SIEVE_BUILTIN_LDAP) && !defined(PLUGIN_BUILD) */
+void sieve_ldap_storage_caches_free(void)
+{
+	/* Nothing */
+}
+
 const struct sieve_storage sieve_ldap_storage = {
 	.driver_name = SIEVE_LDAP_STORAGE_DRIVER_NAME
 };
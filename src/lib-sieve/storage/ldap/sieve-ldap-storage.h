@@ -47,6 +47,7 @@ struct sieve_ldap_storage_settings {
 	const char *sieve_ldap_script_attr;
 	const char *sieve_ldap_mod_attr;
 	const char *sieve_ldap_filter;
+	unsigned int sieve_ldap_cache_ttl;
 
 	/* ... */
 	int ldap_deref, ldap_scope, ldap_tls_require_cert;
@@ -86,6 +87,10 @@ struct sieve_ldap_script {
 	const char *dn;
 	const char *modattr;
 
+	/* Script source obtained together with the lookup */
+	struct istream *input;
+	bool have_input:1;
+
 	const char *binpath;
 };
 
@@ -48,7 +48,8 @@ const struct sieve_command_def tst_address = {
 	.block_required = FALSE,
 	.registered = tst_address_registered,
 	.validate = tst_address_validate,
-	.generate = tst_address_generate
+	.generate = tst_address_generate,
+	.message_only = TRUE
 };
 
 /*
@@ -201,6 +202,7 @@ tst_address_generate(const struct sieve_codegen_env *cgenv,
 		     struct sieve_command *tst)
 {
 	sieve_operation_emit(cgenv->sblock, NULL, &tst_address_operation);
+	sieve_generate_message_headers(cgenv, tst->first_positional);
 
 	/* Generate arguments */
 	return sieve_generate_arguments(cgenv, tst, NULL);
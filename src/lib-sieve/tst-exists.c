@@ -34,7 +34,8 @@ const struct sieve_command_def tst_exists = {
 	.block_allowed = FALSE,
 	.block_required = FALSE,
 	.validate = tst_exists_validate,
-	.generate = tst_exists_generate
+	.generate = tst_exists_generate,
+	.message_only = TRUE
 };
 
 /*
@@ -81,6 +82,7 @@ static bool tst_exists_generate
 (const struct sieve_codegen_env *cgenv, struct sieve_command *tst)
 {
 	sieve_operation_emit(cgenv->sblock, NULL, &tst_exists_operation);
+	sieve_generate_message_headers(cgenv, tst->first_positional);
 
  	/* Generate arguments */
     return sieve_generate_arguments(cgenv, tst, NULL);
@@ -145,18 +147,31 @@ static int tst_exists_operation_execute
 		(ret=sieve_stringlist_next_item(hdr_list, &hdr_item)) > 0 ) {
 		struct sieve_stringlist *value_list;
 		string_t *dummy;
-
-		/* Get header */
-		if ( (ret=sieve_message_get_header_fields
-			(renv, sieve_single_stringlist_create(renv, hdr_item, FALSE),
-				&svmos, FALSE, &value_list)) <= 0 )
-			return ret;
-
-		if ( (ret=sieve_stringlist_next_item(value_list, &dummy)) < 0)
-			return value_list->exec_status;
-
-		if ( ret == 0 )
-			matched = FALSE;
+		bool exists;
+
+		if ( !array_is_created(&svmos) || array_count(&svmos) == 0 ) {
+			/* Plain header presence check; no values needed */
+			if ( sieve_message_header_exists
+				(renv, str_c(hdr_item), &exists) < 0 ) {
+				return sieve_runtime_mail_error(renv,
+					sieve_message_get_mail(renv->msgctx),
+					"failed to read header field `%s'",
+					str_sanitize(str_c(hdr_item), 80));
+			}
+			matched = exists;
+		} else {
+			/* Get header */
+			if ( (ret=sieve_message_get_header_fields
+				(renv, sieve_single_stringlist_create(renv, hdr_item, FALSE),
+					&svmos, FALSE, &value_list)) <= 0 )
+				return ret;
+
+			if ( (ret=sieve_stringlist_next_item(value_list, &dummy)) < 0)
+				return value_list->exec_status;
+
+			if ( ret == 0 )
+				matched = FALSE;
+		}
 
 		sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
 			"header `%s' %s", str_sanitize(str_c(hdr_item), 80),
@@ -7,6 +7,8 @@
 #include "sieve-common.h"
 #include "sieve-commands.h"
 #include "sieve-code.h"
+#include "sieve-binary.h"
+#include "sieve-stringlist.h"
 #include "sieve-message.h"
 #include "sieve-comparators.h"
 #include "sieve-match-types.h"
@@ -41,7 +43,8 @@ const struct sieve_command_def tst_header = {
 	.block_required = FALSE,
 	.registered = tst_header_registered,
 	.validate = tst_header_validate,
-	.generate = tst_header_generate
+	.generate = tst_header_generate,
+	.message_only = TRUE
 };
 
 /*
@@ -60,6 +63,30 @@ const struct sieve_operation_def tst_header_operation = {
 	.execute = tst_header_operation_execute
 };
 
+/*
+ * Header switch operation
+ *
+ * Replaces a chain of if/elsif header :is tests on the same header (see
+ * cmd-if.c). Each key is followed by the offset of the branch it selects; the
+ * final offset is taken when no key matches.
+ *
+ * Operands:
+ *   <header-names: string-list> <count: number>
+ *   (<key: string> <branch: offset>)* <no-match: offset>
+ */
+
+static bool tst_header_switch_operation_dump
+	(const struct sieve_dumptime_env *denv, sieve_size_t *address);
+static int tst_header_switch_operation_execute
+	(const struct sieve_runtime_env *renv, sieve_size_t *address);
+
+const struct sieve_operation_def tst_header_switch_operation = {
+	.mnemonic = "HEADER_SWITCH",
+	.code = SIEVE_OPERATION_HEADER_SWITCH,
+	.dump = tst_header_switch_operation_dump,
+	.execute = tst_header_switch_operation_execute
+};
+
 /*
  * Test registration
  */
@@ -122,6 +149,7 @@ static bool tst_header_generate
 (const struct sieve_codegen_env *cgenv, struct sieve_command *tst)
 {
 	sieve_operation_emit(cgenv->sblock, NULL, &tst_header_operation);
+	sieve_generate_message_headers(cgenv, tst->first_positional);
 
  	/* Generate arguments */
 	return sieve_generate_arguments(cgenv, tst, NULL);
@@ -202,3 +230,150 @@ static int tst_header_operation_execute
 	sieve_interpreter_set_test_result(renv->interp, match > 0);
 	return SIEVE_EXEC_OK;
 }
+
+/*
+ * Header switch
+ */
+
+static bool tst_header_switch_dump_offset
+(const struct sieve_dumptime_env *denv, sieve_size_t *address,
+	const char *field_name)
+{
+	sieve_size_t pc = *address;
+	sieve_offset_t offset;
+
+	if ( !sieve_binary_read_offset(denv->sblock, address, &offset) )
+		return FALSE;
+
+	sieve_code_dumpf(denv, "%s: %d [%08llx]", field_name, offset,
+		(unsigned long long)(pc + offset));
+	return TRUE;
+}
+
+static bool tst_header_switch_operation_dump
+(const struct sieve_dumptime_env *denv, sieve_size_t *address)
+{
+	unsigned int count, i;
+
+	sieve_code_dumpf(denv, "HEADER_SWITCH");
+	sieve_code_descend(denv);
+
+	if ( !sieve_opr_stringlist_dump(denv, address, "header names") )
+		return FALSE;
+
+	sieve_code_mark(denv);
+	if ( !sieve_binary_read_unsigned(denv->sblock, address, &count) )
+		return FALSE;
+	sieve_code_dumpf(denv, "branches: %u", count);
+
+	for ( i = 0; i < count; i++ ) {
+		if ( !sieve_opr_string_dump(denv, address, "key") )
+			return FALSE;
+		sieve_code_mark(denv);
+		if ( !tst_header_switch_dump_offset(denv, address, "branch") )
+			return FALSE;
+	}
+
+	sieve_code_mark(denv);
+	return tst_header_switch_dump_offset(denv, address, "no match");
+}
+
+static int tst_header_switch_read_target
+(const struct sieve_runtime_env *renv, sieve_size_t *address,
+	sieve_size_t *target_r)
+{
+	sieve_size_t pc = *address;
+	sieve_offset_t offset;
+
+	if ( !sieve_binary_read_offset(renv->sblock, address, &offset) ) {
+		sieve_runtime_trace_error(renv, "invalid branch offset");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
+	*target_r = pc + offset;
+	return SIEVE_EXEC_OK;
+}
+
+static int tst_header_switch_operation_execute
+(const struct sieve_runtime_env *renv, sieve_size_t *address)
+{
+	struct sieve_comparator cmp =
+		SIEVE_COMPARATOR_DEFAULT(i_ascii_casemap_comparator);
+	struct sieve_stringlist *hdr_list, *value_list;
+	ARRAY_TYPE(sieve_message_override) svmos;
+	ARRAY(string_t *) values;
+	string_t *value, *key;
+	string_t *const *vals;
+	unsigned int count, val_count, i, j;
+	sieve_size_t target;
+	int ret;
+
+	/*
+	 * Read operands
+	 */
+
+	/* Read header-list */
+	if ( (ret=sieve_opr_stringlist_read(renv, address, "header-list", &hdr_list))
+		<= 0 )
+		return ret;
+
+	/* Read number of branches */
+	if ( !sieve_binary_read_unsigned(renv->sblock, address, &count) ) {
+		sieve_runtime_trace_error(renv, "invalid branch count");
+		return SIEVE_EXEC_BIN_CORRUPT;
+	}
+
+	/*
+	 * Perform test
+	 */
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS, "header switch");
+
+	/* Get header values once for all branches */
+	sieve_runtime_trace_descend(renv);
+	i_zero(&svmos);
+	if ( (ret=sieve_message_get_header_fields
+		(renv, hdr_list, &svmos, TRUE, &value_list)) <= 0 )
+		return ret;
+
+	t_array_init(&values, 4);
+	while ( (ret=sieve_stringlist_next_item(value_list, &value)) > 0 )
+		array_append(&values, &value, 1);
+	if ( ret < 0 )
+		return value_list->exec_status;
+	vals = array_get(&values, &val_count);
+
+	/* Keys are stored in branch order, so the first key that matches
+	   selects the same branch the if/elsif chain would have taken */
+	for ( i = 0; i < count; i++ ) {
+		if ( (ret=sieve_opr_string_read(renv, address, "key", &key)) <= 0 )
+			return ret;
+		if ( (ret=tst_header_switch_read_target
+			(renv, address, &target)) <= 0 )
+			return ret;
+
+		for ( j = 0; j < val_count; j++ ) {
+			/* Same as :is; an empty value only matches an empty key */
+			if ( str_len(vals[j]) == 0 ?
+				str_len(key) == 0 :
+				cmp.def->compare(&cmp, str_c(vals[j]), str_len(vals[j]),
+					str_c(key), str_len(key)) == 0 )
+				break;
+		}
+		if ( j < val_count ) {
+			sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+				"matched key `%s'", str_sanitize(str_c(key), 80));
+			sieve_runtime_trace_ascend(renv);
+			sieve_interpreter_set_test_result(renv->interp, TRUE);
+			return sieve_interpreter_program_jump_to
+				(renv->interp, target, FALSE);
+		}
+	}
+	sieve_runtime_trace_ascend(renv);
+
+	if ( (ret=tst_header_switch_read_target(renv, address, &target)) <= 0 )
+		return ret;
+
+	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING, "no key matched");
+	sieve_interpreter_set_test_result(renv->interp, FALSE);
+	return sieve_interpreter_program_jump_to(renv->interp, target, FALSE);
+}
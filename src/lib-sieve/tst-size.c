@@ -6,6 +6,7 @@
 
 #include "sieve-common.h"
 #include "sieve-code.h"
+#include "sieve-binary.h"
 #include "sieve-message.h"
 #include "sieve-commands.h"
 #include "sieve-validator.h"
@@ -43,7 +44,8 @@ const struct sieve_command_def tst_size = {
 	.registered = tst_size_registered,
 	.pre_validate = tst_size_pre_validate,
 	.validate = tst_size_validate,
-	.generate = tst_size_generate
+	.generate = tst_size_generate,
+	.message_only = TRUE
 };
 
 /*
@@ -214,6 +216,7 @@ bool tst_size_generate(const struct sieve_codegen_env *cgenv,
 		sieve_operation_emit(cgenv->sblock, NULL,
 				     &tst_size_under_operation);
 	}
+	sieve_binary_add_message_fields(cgenv->sbin, SIEVE_MESSAGE_FIELD_SIZE);
 
  	/* Generate arguments */
 	if (!sieve_generate_arguments(cgenv, tst, NULL))
@@ -244,10 +247,25 @@ static inline bool
 tst_size_get(const struct sieve_runtime_env *renv, sieve_number_t *size)
 {
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	enum mail_lookup_abort orig_lookup_abort;
+	enum mail_error error;
 	uoff_t psize;
+	int ret;
 
-	if (mail_get_physical_size(mail, &psize) < 0)
-		return FALSE;
+	/* Try the index/cache first, so that the message is not opened just
+	   to determine its size */
+	orig_lookup_abort = mail->lookup_abort;
+	mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
+	ret = mail_get_physical_size(mail, &psize);
+	mail->lookup_abort = orig_lookup_abort;
+
+	if (ret < 0) {
+		(void)mail_get_last_internal_error(mail, &error);
+		if (error != MAIL_ERROR_LOOKUP_ABORTED)
+			return FALSE;
+		if (mail_get_physical_size(mail, &psize) < 0)
+			return FALSE;
+	}
 
 	*size = psize;
 	return TRUE;
@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "mempool.h"
 #include "llist.h"
@@ -191,7 +192,13 @@ struct edit_mail {
 	struct istream *wrapped_stream;
 	struct istream *stream;
 
+	/* Raw storage user provided by the caller (NULL when the shared
+	   edit_mail_user is used) */
+	struct mail_user *raw_user;
+
 	struct _header_index *headers_head, *headers_tail;
+	/* Case-insensitive header name => header index item */
+	HASH_TABLE(const char *, struct _header_index *) headers_by_name;
 	struct _header_field_index *header_fields_head, *header_fields_tail;
 	struct message_size hdr_size, body_size;
 
@@ -209,6 +216,12 @@ struct edit_mail {
 };
 
 struct edit_mail *edit_mail_wrap(struct mail *mail)
+{
+	return edit_mail_wrap_user(mail, NULL);
+}
+
+struct edit_mail *
+edit_mail_wrap_user(struct mail *mail, struct mail_user *raw_user)
 {
 	struct mail_private *mailp = (struct mail_private *) mail;
 	struct edit_mail *edmail;
@@ -225,14 +238,23 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 
 	/* Create dummy raw mailbox for our wrapper */
 
-	raw_mail_user = edit_mail_raw_storage_get(mail->box->storage->user);
+	if (raw_user != NULL) {
+		raw_mail_user = raw_user;
+		mail_user_ref(raw_mail_user);
+	} else {
+		raw_mail_user =
+			edit_mail_raw_storage_get(mail->box->storage->user);
+	}
 
 	if (raw_mailbox_alloc_stream(raw_mail_user, wrapped_stream, (time_t)-1,
 				     "editor@example.com", &raw_box) < 0) {
 		i_error("edit-mail: failed to open raw box: %s",
 			mailbox_get_last_internal_error(raw_box, NULL));
 		mailbox_free(&raw_box);
-		edit_mail_raw_storage_drop();
+		if (raw_user != NULL)
+			mail_user_unref(&raw_mail_user);
+		else
+			edit_mail_raw_storage_drop();
 		return NULL;
 	}
 
@@ -252,6 +274,9 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 	edmail->wrapped_stream = wrapped_stream;
 	i_stream_ref(edmail->wrapped_stream);
 
+	if (raw_user != NULL)
+		edmail->raw_user = raw_mail_user;
+
 	/* Determine whether we should use CRLF or LF for the physical message
 	 */
 	size_diff = ((hdr_size.virtual_size + body_size.virtual_size) -
@@ -260,6 +285,8 @@ struct edit_mail *edit_mail_wrap(struct mail *mail)
 		edmail->crlf = edmail->eoh_crlf = TRUE;
 
 	array_create(&edmail->mail.module_contexts, pool, sizeof(void *), 5);
+	hash_table_create(&edmail->headers_by_name, default_pool, 0,
+			  strcase_hash, strcasecmp);
 
 	edmail->mail.v = edit_mail_vfuncs;
 	edmail->mail.mail.seq = 1;
@@ -300,6 +327,10 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 
 	array_create(&edmail_new->mail.module_contexts, pool,
 		     sizeof(void *), 5);
+	/* The snapshot starts out with the same set of headers */
+	hash_table_create(&edmail_new->headers_by_name, default_pool,
+			  hash_table_count(edmail->headers_by_name),
+			  strcase_hash, strcasecmp);
 
 	edmail_new->mail.v = edit_mail_vfuncs;
 	edmail_new->mail.mail.seq = 1;
@@ -376,6 +407,7 @@ void edit_mail_reset(struct edit_mail *edmail)
 
 		header_idx = next;
 	}
+	hash_table_clear(edmail->headers_by_name, FALSE);
 
 	edmail->modified = FALSE;
 }
@@ -389,6 +421,7 @@ void edit_mail_unwrap(struct edit_mail **edmail)
 		return;
 
 	edit_mail_reset(*edmail);
+	hash_table_destroy(&(*edmail)->headers_by_name);
 	i_stream_unref(&(*edmail)->wrapped_stream);
 
 	parent = (*edmail)->parent;
@@ -396,7 +429,10 @@ void edit_mail_unwrap(struct edit_mail **edmail)
 	if (parent == NULL) {
 		mailbox_transaction_rollback(&(*edmail)->mail.mail.transaction);
 		mailbox_free(&(*edmail)->mail.mail.box);
-		edit_mail_raw_storage_drop();
+		if ((*edmail)->raw_user != NULL)
+			mail_user_unref(&(*edmail)->raw_user);
+		else
+			edit_mail_raw_storage_drop();
 	}
 
 	pool_unref(&(*edmail)->mail.pool);
@@ -468,17 +504,30 @@ static inline char *_header_value_unfold(const char *value)
 static struct _header_index *
 edit_mail_header_find(struct edit_mail *edmail, const char *field_name)
 {
-	struct _header_index *header_idx;
-
-	header_idx = edmail->headers_head;
-	while (header_idx != NULL) {
-		if (strcasecmp(header_idx->header->name, field_name) == 0)
-			return header_idx;
+	if (field_name == NULL)
+		return NULL;
+	return hash_table_lookup(edmail->headers_by_name, field_name);
+}
 
-		header_idx = header_idx->next;
-	}
+static void
+edit_mail_header_index_add(struct edit_mail *edmail,
+			   struct _header_index *header_idx)
+{
+	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail,
+		       header_idx);
+	hash_table_insert(edmail->headers_by_name,
+			  header_idx->header->name, header_idx);
+}
 
-	return NULL;
+static void
+edit_mail_header_index_remove(struct edit_mail *edmail,
+			      struct _header_index *header_idx)
+{
+	hash_table_remove(edmail->headers_by_name, header_idx->header->name);
+	DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail,
+		       header_idx);
+	_header_unref(header_idx->header);
+	i_free(header_idx);
 }
 
 static struct _header_index *
@@ -491,8 +540,7 @@ edit_mail_header_create(struct edit_mail *edmail, const char *field_name)
 		header_idx = i_new(struct _header_index, 1);
 		header_idx->header = _header_create(field_name);
 
-		DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail,
-			       header_idx);
+		edit_mail_header_index_add(edmail, header_idx);
 	}
 
 	return header_idx;
@@ -503,19 +551,16 @@ edit_mail_header_clone(struct edit_mail *edmail, struct _header *header)
 {
 	struct _header_index *header_idx;
 
-	header_idx = edmail->headers_head;
-	while (header_idx != NULL) {
-		if (header_idx->header == header)
-			return header_idx;
-
-		header_idx = header_idx->next;
+	header_idx = edit_mail_header_find(edmail, header->name);
+	if (header_idx != NULL) {
+		i_assert(header_idx->header == header);
+		return header_idx;
 	}
 
 	header_idx = i_new(struct _header_index, 1);
 	header_idx->header = header;
 	_header_ref(header);
-	DLLIST2_APPEND(&edmail->headers_head, &edmail->headers_tail,
-		       header_idx);
+	edit_mail_header_index_add(edmail, header_idx);
 
 	return header_idx;
 }
@@ -583,10 +628,7 @@ edit_mail_header_field_delete(struct edit_mail *edmail,
 	header_idx->count--;
 	if (update_index) {
 		if (header_idx->count == 0) {
-			DLLIST2_REMOVE(&edmail->headers_head,
-				       &edmail->headers_tail, header_idx);
-			_header_unref(header_idx->header);
-			i_free(header_idx);
+			edit_mail_header_index_remove(edmail, header_idx);
 		} else if (header_idx->first == field_idx) {
 			struct _header_field_index *hfield =
 				header_idx->first->next;
@@ -667,11 +709,8 @@ edit_mail_header_field_replace(struct edit_mail *edmail,
 
 		if (update_index) {
 			if (header_idx->count == 0) {
-				DLLIST2_REMOVE(&edmail->headers_head,
-					       &edmail->headers_tail,
-					       header_idx);
-				_header_unref(header_idx->header);
-				i_free(header_idx);
+				edit_mail_header_index_remove(edmail,
+							      header_idx);
 			} else if (header_idx->first == field_idx) {
 				struct _header_field_index *hfield =
 					header_idx->first->next;
@@ -912,6 +951,22 @@ static int edit_mail_headers_parse(struct edit_mail *edmail)
 	return 1;
 }
 
+static int
+edit_mail_header_exists(struct edit_mail *edmail, const char *field_name)
+{
+	const char *value;
+
+	/* Anything added or already parsed is in the index */
+	if (edmail->headers_parsed ||
+	    edit_mail_header_find(edmail, field_name) != NULL)
+		return 1;
+
+	/* Otherwise, ask the original message before parsing all its headers;
+	   the wrapped mail will typically have its headers cached already */
+	return edmail->wrapped->v.get_first_header(
+		&edmail->wrapped->mail, field_name, FALSE, &value);
+}
+
 void edit_mail_header_add(struct edit_mail *edmail, const char *field_name,
 			  const char *value, bool last)
 {
@@ -968,6 +1023,12 @@ int edit_mail_header_delete(struct edit_mail *edmail, const char *field_name,
 	int pos = 0;
 	int ret = 0;
 
+	/* Don't parse the headers when the header doesn't exist at all */
+	ret = edit_mail_header_exists(edmail, field_name);
+	if (ret <= 0)
+		return ret;
+	ret = 0;
+
 	/* Make sure headers are parsed */
 	if (edit_mail_headers_parse(edmail) <= 0)
 		return -1;
@@ -1017,10 +1078,7 @@ int edit_mail_header_delete(struct edit_mail *edmail, const char *field_name,
 	}
 
 	if (index == 0 || header_idx->count == 0) {
-		DLLIST2_REMOVE(&edmail->headers_head,
-			       &edmail->headers_tail, header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+		edit_mail_header_index_remove(edmail, header_idx);
 	} else if (header_idx->first == NULL || header_idx->last == NULL) {
 		struct _header_field_index *current =
 			edmail->header_fields_head;
@@ -1047,6 +1105,12 @@ int edit_mail_header_replace(struct edit_mail *edmail,
 	int pos = 0;
 	int ret = 0;
 
+	/* Don't parse the headers when the header doesn't exist at all */
+	ret = edit_mail_header_exists(edmail, field_name);
+	if (ret <= 0)
+		return ret;
+	ret = 0;
+
 	/* Make sure headers are parsed */
 	if (edit_mail_headers_parse(edmail) <= 0)
 		return -1;
@@ -1099,10 +1163,7 @@ int edit_mail_header_replace(struct edit_mail *edmail,
 
 	/* Update old header index */
 	if (header_idx->count == 0) {
-		DLLIST2_REMOVE(&edmail->headers_head, &edmail->headers_tail,
-			       header_idx);
-		_header_unref(header_idx->header);
-		i_free(header_idx);
+		edit_mail_header_index_remove(edmail, header_idx);
 	} else if (header_idx->first == NULL || header_idx->last == NULL) {
 		struct _header_field_index *current =
 			edmail->header_fields_head;
@@ -1152,6 +1213,14 @@ int edit_mail_headers_iterate_init(struct edit_mail *edmail,
 	struct edit_mail_header_iter *edhiter;
 	struct _header_index *header_idx = NULL;
 	struct _header_field_index *current = NULL;
+	int ret;
+
+	/* Don't parse the headers when the header doesn't exist at all */
+	if (field_name != NULL) {
+		ret = edit_mail_header_exists(edmail, field_name);
+		if (ret <= 0)
+			return ret;
+	}
 
 	/* Make sure headers are parsed */
 	if (edit_mail_headers_parse(edmail) <= 0) {
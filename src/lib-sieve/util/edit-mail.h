@@ -4,6 +4,10 @@
 struct edit_mail;
 
 struct edit_mail *edit_mail_wrap(struct mail *mail);
+/* Same as edit_mail_wrap(), but the wrapper mailbox is created in the
+   provided raw storage user rather than in one shared by all edit mails. */
+struct edit_mail *
+edit_mail_wrap_user(struct mail *mail, struct mail_user *raw_user);
 void edit_mail_unwrap(struct edit_mail **edmail);
 struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail);
 
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <sys/stat.h>
 
 /*
  * Configuration
@@ -31,7 +32,7 @@
 #define DEFAULT_ENVELOPE_SENDER "MAILER-DAEMON"
 
 /* After buffer grows larger than this, create a temporary file to /tmp
-   where to read the mail. */
+   where to read the mail (default). */
 #define MAIL_MAX_MEMORY_BUFFER (1024*128)
 
 static const char *wanted_headers[] = {
@@ -79,10 +80,12 @@ static int seekable_fd_callback
 }
 
 static struct istream *mail_raw_create_stream
-(struct mail_user *ruser, int fd, time_t *mtime_r, const char **sender)
+(struct mail_user *ruser, int fd, size_t max_memory_buffer,
+	time_t *mtime_r, const char **sender)
 {
 	struct istream *input, *input2, *input_list[2];
 	const unsigned char *data;
+	struct stat st;
 	size_t i, size;
 	int ret, tz;
 	char *env_sender = NULL;
@@ -124,8 +127,15 @@ static struct istream *mail_raw_create_stream
 	}
 	i_stream_unref(&input);
 
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		/* Redirected from a file; it can be read again directly, so
+		   there is no need to buffer it */
+		input2->blocking = TRUE;
+		return input2;
+	}
+
 	input_list[0] = input2; input_list[1] = NULL;
-	input = i_stream_create_seekable(input_list, MAIL_MAX_MEMORY_BUFFER,
+	input = i_stream_create_seekable(input_list, max_memory_buffer,
 		seekable_fd_callback, (void*)ruser);
 	i_stream_unref(&input2);
 	return input;
@@ -221,6 +231,12 @@ struct mail_raw *mail_raw_open_data
 
 struct mail_raw *mail_raw_open_file
 (struct mail_user *ruser, const char *path)
+{
+	return mail_raw_open_file_buffered(ruser, path, MAIL_MAX_MEMORY_BUFFER);
+}
+
+struct mail_raw *mail_raw_open_file_buffered
+(struct mail_user *ruser, const char *path, size_t max_memory_buffer)
 {
 	struct mail_raw *mailr;
 	struct istream *input = NULL;
@@ -229,7 +245,8 @@ struct mail_raw *mail_raw_open_file
 
 	if ( path == NULL || strcmp(path, "-") == 0 ) {
 		path = NULL;
-		input = mail_raw_create_stream(ruser, 0, &mtime, &sender);
+		input = mail_raw_create_stream(ruser, 0, max_memory_buffer,
+			&mtime, &sender);
 	}
 
 	mailr = mail_raw_create(ruser, input, path, sender, mtime);
@@ -19,6 +19,11 @@ struct mail_raw *mail_raw_open_stream
 	(struct mail_user *ruser, struct istream *input);
 struct mail_raw *mail_raw_open_file
 	(struct mail_user *ruser, const char *path);
+/* Same as mail_raw_open_file(), but a message read from standard input is
+   kept in memory up to the given size before it is spooled to a temporary
+   file. */
+struct mail_raw *mail_raw_open_file_buffered
+	(struct mail_user *ruser, const char *path, size_t max_memory_buffer);
 struct mail_raw *mail_raw_open_data
 	(struct mail_user *ruser, string_t *mail_data);
 void mail_raw_close(struct mail_raw **mailr);
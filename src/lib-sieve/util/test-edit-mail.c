@@ -865,6 +865,84 @@ static void test_edit_mail_empty(void)
 	test_end();
 }
 
+static void test_edit_mail_many_headers(void)
+{
+	static const unsigned int received_count = 250;
+	struct istream *input_msg, *input_mail;
+	buffer_t *buffer;
+	string_t *message;
+	struct mail_raw *rawmail;
+	struct edit_mail *edmail;
+	struct mail *mail;
+	const char *const *values;
+	const char *value;
+	unsigned int i;
+
+	test_begin("edit-mail - many headers");
+	test_init();
+
+	/* Compose the message */
+
+	message = str_new(default_pool, 16384);
+	for (i = 0; i < received_count; i++) {
+		str_printfa(message, "%s: from host%u.example.com\n",
+			    (i % 2 == 0 ? "Received" : "RECEIVED"), i);
+	}
+	str_append(message, "X-A: AAAA\n\nFrop!\n");
+
+	input_msg = i_stream_create_from_data(str_data(message),
+					      str_len(message));
+
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input_msg);
+
+	edmail = edit_mail_wrap(rawmail->mail);
+
+	/* Delete the first and last occurrences and a header name that
+	   is not present at all */
+
+	test_assert(edit_mail_header_delete(edmail, "received", 1) == 1);
+	test_assert(edit_mail_header_delete(edmail, "Received", -1) == 1);
+	test_assert(edit_mail_header_delete(edmail, "X-Z", 0) == 0);
+	edit_mail_header_add(edmail, "receiveD", "from added", FALSE);
+	mail = edit_mail_get_mail(edmail);
+
+	/* Evaluate modified headers */
+
+	test_assert(mail_get_headers_utf8(mail, "Received", &values) > 0);
+	test_assert(str_array_length(values) == received_count - 1);
+	test_assert(values[0] != NULL &&
+		    strcmp(values[0], "from added") == 0);
+	test_assert(values[1] != NULL &&
+		    strcmp(values[1], "from host1.example.com") == 0);
+	test_assert(mail_get_first_header_utf8(mail, "X-A", &value) > 0 &&
+		    strcmp(value, "AAAA") == 0);
+
+	test_assert(edit_mail_header_delete(edmail, "RECEIVED", 0) ==
+		    (int)received_count - 1);
+	test_assert(mail_get_first_header_utf8(mail, "Received", &value) == 0);
+
+	/* Check stream read */
+
+	if (mail_get_stream(mail, NULL, NULL, &input_mail) < 0) {
+		i_fatal("Failed to open mail stream: %s",
+			mailbox_get_last_internal_error(mail->box, NULL));
+	}
+
+	buffer = buffer_create_dynamic(default_pool, 1024);
+	test_stream_data(input_mail, buffer);
+	test_assert(strcmp(str_c(buffer), "X-A: AAAA\n\nFrop!\n") == 0);
+
+	/* Clean up */
+
+	buffer_free(&buffer);
+	edit_mail_unwrap(&edmail);
+	mail_raw_close(&rawmail);
+	i_stream_unref(&input_msg);
+	str_free(&message);
+	test_deinit();
+	test_end();
+}
+
 int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
@@ -872,6 +950,7 @@ int main(int argc, char *argv[])
 		test_edit_mail_big_header,
 		test_edit_mail_small_buffer,
 		test_edit_mail_empty,
+		test_edit_mail_many_headers,
 		NULL
 	};
 	const enum master_service_flags service_flags =
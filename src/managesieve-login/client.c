@@ -88,6 +88,9 @@ static void client_send_capabilities(struct client *client)
 		/* Protocol version */
 		client_send_raw(client, "\"VERSION\" \"1.0\"\r\n");
 
+		/* Batch upload */
+		client_send_raw(client, "\"XPUTSCRIPTS\"\r\n");
+
 		/* XCLIENT */
 		if (client->connection_trusted)
 			client_send_raw(client, "\"XCLIENT\"\r\n");
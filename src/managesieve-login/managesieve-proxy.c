@@ -154,6 +154,21 @@ proxy_write_auth(struct managesieve_client *client, string_t *str)
 	return 0;
 }
 
+static int
+proxy_write_login(struct managesieve_client *client, string_t *str)
+{
+	if (client->proxy_xclient) {
+		/* Send AUTHENTICATE right behind XCLIENT rather than waiting
+		   for its reply; the remote handles both in order, which
+		   saves a round trip for each proxied session. */
+		proxy_write_xclient(client, str);
+		client->proxy_state = MSIEVE_PROXY_STATE_XCLIENT;
+	} else {
+		client->proxy_state = MSIEVE_PROXY_STATE_AUTH;
+	}
+	return proxy_write_auth(client, str);
+}
+
 static int
 proxy_input_auth_challenge(struct managesieve_client *client, const char *line,
 			   const char **challenge_r)
@@ -530,13 +545,8 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 
 				str_append(command, "STARTTLS\r\n");
 				msieve_client->proxy_state = MSIEVE_PROXY_STATE_TLS_START;
-			} else if (msieve_client->proxy_xclient) {
-				proxy_write_xclient(msieve_client, command);
-				msieve_client->proxy_state = MSIEVE_PROXY_STATE_XCLIENT;
-			} else {
-				if (proxy_write_auth(msieve_client, command) < 0)
-					return -1;
-				msieve_client->proxy_state = MSIEVE_PROXY_STATE_AUTH;
+			} else if (proxy_write_login(msieve_client, command) < 0) {
+				return -1;
 			}
 
 			o_stream_nsend(output, str_data(command), str_len(command));
@@ -577,24 +587,15 @@ int managesieve_proxy_parse_line(struct client *client, const char *line)
 			}
 
 			command = t_str_new(128);
-			if (msieve_client->proxy_xclient) {
-				proxy_write_xclient(msieve_client, command);
-				msieve_client->proxy_state = MSIEVE_PROXY_STATE_XCLIENT;
-			} else {
-				if (proxy_write_auth(msieve_client, command) < 0)
-					return -1;
-				msieve_client->proxy_state = MSIEVE_PROXY_STATE_AUTH;
-			}
+			if (proxy_write_login(msieve_client, command) < 0)
+				return -1;
 			o_stream_nsend(output, str_data(command), str_len(command));
 		}
 		return 0;
 	case MSIEVE_PROXY_STATE_XCLIENT:
 		if (str_begins_icase(line, "OK", &suffix) &&
 		    (*suffix == '\0' || *suffix == ' ')) {
-			command = t_str_new(128);
-			if (proxy_write_auth(msieve_client, command) < 0)
-				return -1;
-			o_stream_nsend(output, str_data(command), str_len(command));
+			/* AUTHENTICATE was already sent along with XCLIENT */
 			msieve_client->proxy_state = MSIEVE_PROXY_STATE_AUTH;
 			return 0;
 		}
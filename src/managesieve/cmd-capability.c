@@ -50,6 +50,9 @@ static void send_capability(struct client_command_context *cmd)
 
 	/* Protocol version */
 	client_send_line(client, "\"VERSION\" \"1.0\"");
+
+	/* Batch upload */
+	client_send_line(client, "\"XPUTSCRIPTS\"");
 }
 
 bool cmd_capability(struct client_command_context *cmd)
@@ -5,6 +5,7 @@
 #include "ostream.h"
 #include "istream.h"
 #include "iostream.h"
+#include "time-util.h"
 
 #include "sieve-script.h"
 #include "sieve-storage.h"
@@ -62,6 +63,9 @@ static bool cmd_getscript_continue(struct client_command_context *cmd)
 	struct client *client = cmd->client;
 	struct cmd_getscript_context *ctx = cmd->context;
 
+	/* The file driver provides a plain fd stream, which the client's fd
+	   ostream passes to sendfile() without copying it through userspace
+	   buffers. Don't wrap the script stream here, or that is lost. */
 	switch (o_stream_send_istream(client->output, ctx->script_stream)) {
 	case OSTREAM_SEND_ISTREAM_RESULT_FINISHED:
 		if (ctx->script_stream->v_offset != ctx->script_size &&
@@ -104,7 +108,9 @@ bool cmd_getscript(struct client_command_context *cmd)
 	struct client *client = cmd->client;
 	struct cmd_getscript_context *ctx;
 	const char *scriptname;
+	struct timeval start, end;
 	enum sieve_error error;
+	int ret;
 
 	/* <scriptname> */
 	if (!client_read_string_args(cmd, TRUE, 1, &scriptname))
@@ -119,15 +125,21 @@ bool cmd_getscript(struct client_command_context *cmd)
 	ctx->storage = client->storage;
 	ctx->failed = FALSE;
 
+	i_gettimeofday(&start);
 	ctx->script = sieve_storage_open_script(client->storage, scriptname,
 						NULL);
+	ret = (ctx->script == NULL ? -1 :
+	       sieve_script_get_stream(ctx->script, &ctx->script_stream,
+				       &error));
+	i_gettimeofday(&end);
+	cmd->stats.storage_usecs = timeval_diff_usecs(&end, &start);
+
 	if (ctx->script == NULL) {
 		ctx->failed = TRUE;
 		return cmd_getscript_finish(ctx);
 	}
 
-	if (sieve_script_get_stream(ctx->script, &ctx->script_stream,
-				    &error) < 0 ) {
+	if (ret < 0) {
 		if (error == SIEVE_ERROR_NOT_FOUND) {
 			sieve_storage_set_error(client->storage, error,
 						"Script does not exist.");
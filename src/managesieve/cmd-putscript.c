@@ -8,12 +8,16 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "istream-tee.h"
 #include "ostream.h"
 #include "iostream.h"
 #include "str.h"
+#include "time-util.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
+#include "sieve-extensions.h"
 #include "sieve-storage.h"
 
 #include "managesieve-parser.h"
@@ -21,16 +25,24 @@
 #include "managesieve-common.h"
 #include "managesieve-client.h"
 #include "managesieve-commands.h"
+#include "managesieve-check-cache.h"
 #include "managesieve-quota.h"
 
 #include <sys/time.h>
 
+/* Scripts up to this size are kept in memory while they are uploaded, so that
+   they can be compiled without reading the stored script back */
+#define CMD_PUTSCRIPT_MAX_COPY_SIZE (1024*1024)
+
 struct cmd_putscript_context {
 	struct client *client;
 	struct client_command_context *cmd;
 	struct sieve_storage *storage;
 
 	struct istream *input;
+	/* Tee children when the script is copied during the upload */
+	struct istream *save_input, *copy_input;
+	buffer_t *script_copy;
 
 	const char *scriptname;
 	uoff_t script_size, max_script_size;
@@ -81,6 +93,7 @@ static void client_input_putscript(struct client *client)
 		return;
 	}
 
+	o_stream_cork(client->output);
 	if (cmd->func(cmd)) {
 		/* command execution was finished. Note that if cmd_sync()
 		   didn't finish, we didn't get here but the input handler
@@ -90,9 +103,63 @@ static void client_input_putscript(struct client *client)
 		   reset command once again to reset cmd_sync()'s changes. */
 		_client_reset_command(client);
 
-		if (client->input_pending)
+		if (client->input_pending) {
+			/* Commands pipelined behind this one are handled
+			   right away; client_input() flushes their replies
+			   together with this one. */
 			client_input(client);
+			return;
+		}
 	}
+	o_stream_uncork(client->output);
+}
+
+static void cmd_putscript_copy_start(struct cmd_putscript_context *ctx)
+{
+	struct tee_istream *tee;
+
+	if (ctx->script_size_valid &&
+	    ctx->script_size > CMD_PUTSCRIPT_MAX_COPY_SIZE)
+		return;
+
+	tee = tee_i_stream_create(ctx->input);
+	ctx->save_input = tee_i_stream_create_child(tee);
+	ctx->copy_input = tee_i_stream_create_child(tee);
+	ctx->script_copy = buffer_create_dynamic(
+		default_pool, (ctx->script_size_valid ?
+			       ctx->script_size : 1024));
+	ctx->input = ctx->save_input;
+}
+
+static void cmd_putscript_copy_abort(struct cmd_putscript_context *ctx)
+{
+	i_stream_unref(&ctx->copy_input);
+	buffer_free(&ctx->script_copy);
+}
+
+static void cmd_putscript_copy_continue(struct cmd_putscript_context *ctx)
+{
+	const unsigned char *data;
+	size_t size;
+	uoff_t left;
+
+	if (ctx->copy_input == NULL)
+		return;
+
+	/* Only copy what the storage has consumed already; that part is still
+	   buffered by the tee stream, so no new input is read here */
+	while (ctx->copy_input->v_offset < ctx->save_input->v_offset) {
+		if (i_stream_read_more(ctx->copy_input, &data, &size) <= 0)
+			break;
+		left = ctx->save_input->v_offset - ctx->copy_input->v_offset;
+		if (size > left)
+			size = left;
+		buffer_append(ctx->script_copy, data, size);
+		i_stream_skip(ctx->copy_input, size);
+	}
+
+	if (ctx->script_copy->used > CMD_PUTSCRIPT_MAX_COPY_SIZE)
+		cmd_putscript_copy_abort(ctx);
 }
 
 static void cmd_putscript_finish(struct cmd_putscript_context *ctx)
@@ -107,6 +174,11 @@ static void cmd_putscript_finish(struct cmd_putscript_context *ctx)
 		ctx->client->input_skip_line = TRUE;
 		sieve_storage_save_cancel(&ctx->save_ctx);
 	}
+
+	cmd_putscript_copy_abort(ctx);
+	if (ctx->input == ctx->save_input)
+		ctx->input = NULL;
+	i_stream_unref(&ctx->save_input);
 }
 
 static bool cmd_putscript_continue_cancel(struct client_command_context *cmd)
@@ -135,6 +207,9 @@ static bool cmd_putscript_cancel(struct cmd_putscript_context *ctx, bool skip)
 		return TRUE;
 	}
 
+	/* Nothing is kept; don't let the copy hold back the tee stream */
+	cmd_putscript_copy_abort(ctx);
+
 	/* we have to read the nonsynced literal so we don't treat the uploaded
 	   script as commands. */
 	ctx->client->command_pending = TRUE;
@@ -155,52 +230,163 @@ static void cmd_putscript_storage_error(struct cmd_putscript_context *ctx)
 	}
 }
 
+static int cmd_putscript_save_finish(struct cmd_putscript_context *ctx)
+{
+	struct timeval start, end;
+	int ret;
+
+	i_gettimeofday(&start);
+	ret = sieve_storage_save_finish(ctx->save_ctx);
+	i_gettimeofday(&end);
+	ctx->cmd->stats.storage_usecs += timeval_diff_usecs(&end, &start);
+	return ret;
+}
+
 static bool cmd_putscript_save(struct cmd_putscript_context *ctx)
 {
+	struct timeval start, end;
+	int ret;
+
 	/* Commit to save only when this is a putscript command */
 	if (ctx->scriptname == NULL)
 		return TRUE;
 
 	/* Check commit */
-	if (sieve_storage_save_commit(&ctx->save_ctx) < 0) {
+	i_gettimeofday(&start);
+	ret = sieve_storage_save_commit(&ctx->save_ctx);
+	i_gettimeofday(&end);
+	ctx->cmd->stats.storage_usecs += timeval_diff_usecs(&end, &start);
+
+	if (ret < 0) {
 		cmd_putscript_storage_error(ctx);
 		return FALSE;
 	}
 	return TRUE;
 }
 
+static bool
+cmd_putscript_check_cacheable(struct cmd_putscript_context *ctx,
+			      struct sieve_binary *sbin)
+{
+	const struct sieve_extension *include_ext;
+
+	/* The result for a script that includes others depends on those too.
+	   For a script that failed to compile, this is not known. */
+	if (sbin == NULL) {
+		return (strstr(t_strndup(ctx->script_copy->data,
+					 ctx->script_copy->used),
+			       "include") == NULL);
+	}
+
+	include_ext = sieve_extension_get_by_name(ctx->client->svinst,
+						  "include");
+	return (include_ext == NULL ||
+		sieve_binary_extension_get_index(sbin, include_ext) < 0);
+}
+
 static void
 cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 			    struct sieve_script *script)
 {
 	struct client *client = ctx->client;
 	struct client_command_context *cmd = ctx->cmd;
-	struct sieve_error_handler *ehandler;
+	const struct managesieve_check_result *cached = NULL;
+	unsigned char digest[SHA1_RESULTLEN];
 	enum sieve_compile_flags cpflags =
 		SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
+	struct sieve_script *cscript = script;
+	const char *scriptname = sieve_script_name(script);
+	struct timeval start, end;
 	struct sieve_binary *sbin;
-	bool success = TRUE;
+	unsigned int errors_count, warnings_count;
+	bool success = TRUE, have_copy;
 	enum sieve_error error;
 	string_t *errors;
 
+	errors = str_new(default_pool, 1024);
+
+	/* Scripts are only cached if they don't include others, which is the
+	   only thing activation changes at compile time */
+	have_copy = (ctx->script_copy != NULL &&
+		     ctx->script_copy->used == ctx->script_size);
+	if (have_copy) {
+		managesieve_check_cache_digest(ctx->script_copy->data,
+					       ctx->script_copy->used,
+					       cpflags, digest);
+		cached = managesieve_check_cache_lookup(client->check_cache,
+							digest);
+	}
+
+	/* The reported messages mention the script name; a result for the
+	   same content under another name can only be used when there are
+	   none */
+	if (cached != NULL &&
+	    null_strcmp(cached->scriptname, scriptname) != 0 &&
+	    (cached->sbin == NULL || cached->warnings > 0))
+		cached = NULL;
+
 	/* Mark this as an activation when we are replacing the
 	   active script */
 	if (sieve_storage_save_will_activate(ctx->save_ctx))
 		cpflags |= SIEVE_COMPILE_FLAG_ACTIVATED;
 
-	/* Prepare error handler */
-	errors = str_new(default_pool, 1024);
-	ehandler = sieve_strbuf_ehandler_create(
-		client->svinst, errors, TRUE,
-		client->set->managesieve_max_compile_errors);
+	if (cached != NULL) {
+		e_debug(cmd->event, "Reusing result of earlier compilation");
+		cmd->stats.compile_usecs = 0;
+		sbin = cached->sbin;
+		if (sbin != NULL)
+			sieve_binary_ref(sbin);
+		error = (sbin == NULL ? SIEVE_ERROR_NOT_VALID :
+			 SIEVE_ERROR_NONE);
+		str_append(errors, cached->messages);
+		errors_count = cached->errors;
+		warnings_count = cached->warnings;
+	} else {
+		struct sieve_error_handler *ehandler;
+
+		/* Prepare error handler */
+		ehandler = sieve_strbuf_ehandler_create(
+			client->svinst, errors, TRUE,
+			client->set->managesieve_max_compile_errors);
+
+		/* Compile the copy made during the upload, if it is
+		   complete */
+		if (have_copy) {
+			struct istream *input;
+
+			input = i_stream_create_from_data(
+				ctx->script_copy->data,
+				ctx->script_copy->used);
+			cscript = sieve_data_script_create_from_input(
+				client->svinst, scriptname, input);
+			i_stream_unref(&input);
+		}
+
+		/* Compile */
+		i_gettimeofday(&start);
+		sbin = sieve_compile_script(cscript, ehandler, cpflags, &error);
+		i_gettimeofday(&end);
+		cmd->stats.compile_usecs = timeval_diff_usecs(&end, &start);
+
+		errors_count = sieve_get_errors(ehandler);
+		warnings_count = sieve_get_warnings(ehandler);
+		sieve_error_handler_unref(&ehandler);
+
+		if (have_copy &&
+		    (sbin != NULL || error == SIEVE_ERROR_NOT_VALID) &&
+		    cmd_putscript_check_cacheable(ctx, sbin)) {
+			managesieve_check_cache_add(
+				client->check_cache, digest, scriptname,
+				str_c(errors), errors_count, warnings_count,
+				sbin);
+		}
+	}
 
-	/* Compile */
-	sbin = sieve_compile_script(script, ehandler, cpflags, &error);
 	if (sbin == NULL) {
 		const char *errormsg = NULL, *action;
 
 		if (error != SIEVE_ERROR_NOT_VALID) {
-			errormsg = sieve_script_get_last_error(script, &error);
+			errormsg = sieve_script_get_last_error(cscript, &error);
 			if (error == SIEVE_ERROR_NONE)
 				errormsg = NULL;
 		}
@@ -214,14 +400,11 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 			struct event_passthrough *e =
 				client_command_create_finish_event(cmd)->
 				add_str("error", "Compilation failed")->
-				add_int("compile_errors",
-					sieve_get_errors(ehandler))->
-				add_int("compile_warnings",
-					sieve_get_warnings(ehandler));
+				add_int("compile_errors", errors_count)->
+				add_int("compile_warnings", warnings_count);
 			e_debug(e->event(), "Failed to %s: "
 				"Compilation failed (%u errors, %u warnings)",
-				action, sieve_get_errors(ehandler),
-				sieve_get_warnings(ehandler));
+				action, errors_count, warnings_count);
 
 			client_send_no(client, str_c(errors));
 		} else {
@@ -236,11 +419,17 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 
 		success = FALSE;
 	} else {
+		/* Store the binary with the script, so that it need not be
+		   compiled again at the first delivery */
+		if (ctx->scriptname != NULL)
+			sieve_storage_save_set_binary(ctx->save_ctx, sbin);
 		sieve_close(&sbin);
 
 		if (!cmd_putscript_save(ctx))
 			success = FALSE;
 	}
+	if (cscript != script)
+		sieve_script_unref(&cscript);
 
 	/* Finish up */
 	cmd_putscript_finish(ctx);
@@ -258,18 +447,17 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 		struct event_passthrough *e =
 			client_command_create_finish_event(cmd)->
 			add_int("script_size", ctx->script_size)->
-			add_int("compile_warnings",
-				sieve_get_warnings(ehandler));
+			add_int("compile_warnings", warnings_count);
 		if (ctx->scriptname != NULL) {
 			e_debug(e->event(), "Stored script `%s' successfully "
 				"(%u warnings)", ctx->scriptname,
-				sieve_get_warnings(ehandler));
+				warnings_count);
 		} else {
 			e_debug(e->event(), "Checked script successfully "
-				"(%u warnings)", sieve_get_warnings(ehandler));
+				"(%u warnings)", warnings_count);
 		}
 
-		if (sieve_get_warnings(ehandler) > 0)
+		if (warnings_count > 0)
 			client_send_okresp(client, "WARNINGS", str_c(errors));
 		else if (ctx->scriptname != NULL)
 			client_send_ok(client, "PUTSCRIPT completed.");
@@ -277,7 +465,6 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 			client_send_ok(client, "Script checked successfully.");
 	}
 
-	sieve_error_handler_unref(&ehandler);
 	str_free(&errors);
 }
 
@@ -413,6 +600,7 @@ static bool cmd_putscript_continue_parsing(struct client_command_context *cmd)
 	}
 
 	/* save the script */
+	cmd_putscript_copy_start(ctx);
 	ctx->save_ctx = sieve_storage_save_init(ctx->storage, ctx->scriptname,
 						ctx->input);
 
@@ -456,8 +644,10 @@ static bool cmd_putscript_continue_script(struct client_command_context *cmd)
 				/* we still have to finish reading the script
 			   	  from client */
 				sieve_storage_save_cancel(&ctx->save_ctx);
+				cmd_putscript_copy_abort(ctx);
 				break;
 			}
+			cmd_putscript_copy_continue(ctx);
 			if (ret == -1 || ret == 0)
 				break;
 		}
@@ -508,7 +698,7 @@ static bool cmd_putscript_continue_script(struct client_command_context *cmd)
 					io_stream_get_disconnect_reason(client->input,
 									client->output));
 				client_disconnect(client, reason);
-			} else if (sieve_storage_save_finish(ctx->save_ctx) < 0) {
+			} else if (cmd_putscript_save_finish(ctx) < 0) {
 				failed = TRUE;
 				cmd_putscript_storage_error(ctx);
 			} else {
@@ -0,0 +1,340 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+/* XPUTSCRIPTS <active-scriptname> 1*(<scriptname> <script>)
+
+   Stores a set of scripts at once, e.g. when provisioning a user. All scripts
+   are compiled before any of them is saved, so that an invalid script leaves
+   the storage untouched. After all scripts are committed, the script named by
+   <active-scriptname> is activated; an empty name leaves the active script
+   unchanged. The whole command must fit in managesieve_max_line_length.
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "str.h"
+#include "time-util.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-storage.h"
+
+#include "managesieve-common.h"
+#include "managesieve-client.h"
+#include "managesieve-commands.h"
+#include "managesieve-quota.h"
+
+struct cmd_putscripts_script {
+	const char *name;
+	const char *data;
+	size_t size;
+
+	struct sieve_storage_save_context *save_ctx;
+};
+
+struct cmd_putscripts_context {
+	struct client *client;
+	struct client_command_context *cmd;
+	struct sieve_storage *storage;
+
+	const char *active_name;
+	ARRAY(struct cmd_putscripts_script) scripts;
+
+	/* Accumulated compile warnings of all scripts */
+	string_t *warnings;
+	unsigned int warning_count;
+};
+
+static bool
+cmd_putscripts_parse_args(struct cmd_putscripts_context *ctx,
+			  const struct managesieve_arg *args)
+{
+	struct client_command_context *cmd = ctx->cmd;
+	struct cmd_putscripts_script *script;
+	const char *name, *data;
+
+	/* <active-scriptname> */
+	if (!managesieve_arg_get_string(&args[0], &ctx->active_name)) {
+		client_send_command_error(cmd, "Invalid arguments.");
+		return FALSE;
+	}
+	args++;
+
+	/* 1*(<scriptname> <script>) */
+	p_array_init(&ctx->scripts, cmd->pool, 4);
+	while (!MANAGESIEVE_ARG_IS_EOL(&args[0])) {
+		if (MANAGESIEVE_ARG_IS_EOL(&args[1])) {
+			client_send_command_error(cmd, "Missing arguments.");
+			return FALSE;
+		}
+		if (!managesieve_arg_get_string(&args[0], &name) ||
+		    !managesieve_arg_get_string(&args[1], &data)) {
+			client_send_command_error(cmd, "Invalid arguments.");
+			return FALSE;
+		}
+
+		script = array_append_space(&ctx->scripts);
+		script->name = name;
+		script->data = data;
+		script->size = args[1].str_len;
+		args += 2;
+	}
+	if (array_count(&ctx->scripts) == 0) {
+		client_send_command_error(cmd, "Missing arguments.");
+		return FALSE;
+	}
+
+	if (*ctx->active_name != '\0') {
+		const struct cmd_putscripts_script *uscript;
+		bool found = FALSE;
+
+		array_foreach(&ctx->scripts, uscript) {
+			if (strcmp(uscript->name, ctx->active_name) == 0)
+				found = TRUE;
+		}
+		if (!found) {
+			client_send_command_error(
+				cmd, "Active script is not among the "
+				     "uploaded scripts.");
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static bool
+cmd_putscripts_compile(struct cmd_putscripts_context *ctx,
+		       struct cmd_putscripts_script *script)
+{
+	struct client *client = ctx->client;
+	struct client_command_context *cmd = ctx->cmd;
+	struct sieve_error_handler *ehandler;
+	enum sieve_compile_flags cpflags =
+		SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
+	struct sieve_script *cscript;
+	struct sieve_binary *sbin;
+	struct istream *input;
+	enum sieve_error error;
+	const char *errormsg = NULL;
+	bool success = TRUE;
+	string_t *errors;
+
+	if (strcmp(script->name, ctx->active_name) == 0)
+		cpflags |= SIEVE_COMPILE_FLAG_ACTIVATED;
+
+	/* Prepare error handler */
+	errors = str_new(default_pool, 1024);
+	ehandler = sieve_strbuf_ehandler_create(
+		client->svinst, errors, TRUE,
+		client->set->managesieve_max_compile_errors);
+
+	/* Compile */
+	input = i_stream_create_from_data(script->data, script->size);
+	cscript = sieve_data_script_create_from_input(
+		client->svinst, script->name, input);
+	i_stream_unref(&input);
+
+	sbin = sieve_compile_script(cscript, ehandler, cpflags, &error);
+	if (sbin == NULL) {
+		if (error != SIEVE_ERROR_NOT_VALID) {
+			errormsg = sieve_script_get_last_error(cscript, &error);
+			if (error == SIEVE_ERROR_NONE)
+				errormsg = NULL;
+		}
+		if (errormsg == NULL)
+			errormsg = str_c(errors);
+
+		struct event_passthrough *e =
+			client_command_create_finish_event(cmd)->
+			add_str("error", "Compilation failed")->
+			add_int("compile_errors", sieve_get_errors(ehandler))->
+			add_int("compile_warnings",
+				sieve_get_warnings(ehandler));
+		e_debug(e->event(), "Failed to store script `%s': "
+			"Compilation failed (%u errors, %u warnings)",
+			script->name, sieve_get_errors(ehandler),
+			sieve_get_warnings(ehandler));
+
+		client_send_no(client, t_strdup_printf(
+			"Script `%s': %s", script->name, errormsg));
+		success = FALSE;
+	} else {
+		sieve_close(&sbin);
+
+		if (sieve_get_warnings(ehandler) > 0) {
+			str_printfa(ctx->warnings, "Script `%s': %s",
+				    script->name, str_c(errors));
+			ctx->warning_count += sieve_get_warnings(ehandler);
+		}
+	}
+	sieve_script_unref(&cscript);
+
+	sieve_error_handler_unref(&ehandler);
+	str_free(&errors);
+	return success;
+}
+
+static bool
+cmd_putscripts_save(struct cmd_putscripts_context *ctx,
+		    struct cmd_putscripts_script *script)
+{
+	struct istream *input;
+	int ret = 0;
+
+	input = i_stream_create_from_data(script->data, script->size);
+	script->save_ctx = sieve_storage_save_init(ctx->storage, script->name,
+						   input);
+	if (script->save_ctx != NULL) {
+		while (ret == 0 && !input->eof)
+			ret = sieve_storage_save_continue(script->save_ctx);
+		if (ret == 0)
+			ret = sieve_storage_save_finish(script->save_ctx);
+	} else {
+		ret = -1;
+	}
+	i_stream_unref(&input);
+
+	if (ret < 0) {
+		client_command_storage_error(
+			ctx->cmd, "Failed to store script `%s'", script->name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void cmd_putscripts_cancel(struct cmd_putscripts_context *ctx)
+{
+	struct cmd_putscripts_script *script;
+
+	array_foreach_modifiable(&ctx->scripts, script) {
+		if (script->save_ctx != NULL)
+			sieve_storage_save_cancel(&script->save_ctx);
+	}
+}
+
+static bool cmd_putscripts_store(struct cmd_putscripts_context *ctx)
+{
+	struct client_command_context *cmd = ctx->cmd;
+	struct cmd_putscripts_script *script;
+	struct timeval start, end;
+	bool success = TRUE;
+
+	/* Check sizes and quota for each script before doing anything */
+	array_foreach_modifiable(&ctx->scripts, script) {
+		if (!managesieve_quota_check_all(cmd, script->name,
+						 script->size))
+			return FALSE;
+	}
+
+	/* Compile all scripts first, so that nothing is stored when any of
+	   them is invalid */
+	i_gettimeofday(&start);
+	array_foreach_modifiable(&ctx->scripts, script) {
+		if (!cmd_putscripts_compile(ctx, script)) {
+			success = FALSE;
+			break;
+		}
+	}
+	i_gettimeofday(&end);
+	cmd->stats.compile_usecs = timeval_diff_usecs(&end, &start);
+	if (!success)
+		return FALSE;
+
+	/* Write all scripts before committing any. They are flushed to disk
+	   together before the first commit. */
+	i_gettimeofday(&start);
+	sieve_storage_save_batch_begin(ctx->storage);
+	array_foreach_modifiable(&ctx->scripts, script) {
+		if (!cmd_putscripts_save(ctx, script)) {
+			success = FALSE;
+			break;
+		}
+	}
+	array_foreach_modifiable(&ctx->scripts, script) {
+		if (!success)
+			break;
+		if (sieve_storage_save_commit(&script->save_ctx) < 0) {
+			client_command_storage_error(
+				cmd, "Failed to store script `%s'",
+				script->name);
+			success = FALSE;
+		}
+	}
+	cmd_putscripts_cancel(ctx);
+	sieve_storage_save_batch_end(ctx->storage);
+	i_gettimeofday(&end);
+	cmd->stats.storage_usecs = timeval_diff_usecs(&end, &start);
+	return success;
+}
+
+static bool cmd_putscripts_activate(struct cmd_putscripts_context *ctx)
+{
+	struct sieve_script *script;
+	int ret;
+
+	if (*ctx->active_name == '\0')
+		return TRUE;
+
+	script = sieve_storage_open_script(ctx->storage, ctx->active_name,
+					   NULL);
+	ret = (script == NULL ? -1 :
+	       sieve_script_activate(script, (time_t)-1));
+	if (script != NULL)
+		sieve_script_unref(&script);
+	if (ret < 0) {
+		client_command_storage_error(
+			ctx->cmd, "Failed to activate script `%s'",
+			ctx->active_name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool cmd_putscripts(struct client_command_context *cmd)
+{
+	struct client *client = cmd->client;
+	struct cmd_putscripts_context *ctx;
+	const struct managesieve_arg *args;
+	const struct cmd_putscripts_script *script;
+
+	if (!client_read_args(cmd, 0, 0, FALSE, &args))
+		return FALSE;
+
+	ctx = p_new(cmd->pool, struct cmd_putscripts_context, 1);
+	ctx->cmd = cmd;
+	ctx->client = client;
+	ctx->storage = client->storage;
+
+	if (!cmd_putscripts_parse_args(ctx, args))
+		return TRUE;
+
+	ctx->warnings = str_new(default_pool, 256);
+	if (cmd_putscripts_store(ctx) && cmd_putscripts_activate(ctx)) {
+		size_t total_size = 0;
+
+		array_foreach(&ctx->scripts, script) {
+			client->put_count++;
+			client->put_bytes += script->size;
+			total_size += script->size;
+		}
+
+		struct event_passthrough *e =
+			client_command_create_finish_event(cmd)->
+			add_int("script_count", array_count(&ctx->scripts))->
+			add_int("script_size", total_size)->
+			add_int("compile_warnings", ctx->warning_count);
+		e_debug(e->event(), "Stored %u scripts successfully "
+			"(%u warnings)", array_count(&ctx->scripts),
+			ctx->warning_count);
+
+		if (ctx->warning_count > 0) {
+			client_send_okresp(client, "WARNINGS",
+					   str_c(ctx->warnings));
+		} else {
+			client_send_ok(client, "XPUTSCRIPTS completed.");
+		}
+	}
+	str_free(&ctx->warnings);
+	return TRUE;
+}
@@ -22,6 +22,8 @@
 #include "mail-user.h"
 #include "mail-storage-service.h"
 
+#include "sieve.h"
+
 #include "managesieve-common.h"
 #include "managesieve-commands.h"
 #include "managesieve-capabilities.h"
@@ -405,6 +407,7 @@ int main(int argc, char *argv[])
 	if (io_loop_is_running(current_ioloop))
 		master_service_run(master_service, client_connected);
 	clients_destroy_all();
+	sieve_caches_free();
 
 	if (login_server != NULL)
 		login_server_deinit(&login_server);
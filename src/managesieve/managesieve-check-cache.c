@@ -0,0 +1,133 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "sha1.h"
+
+#include "sieve.h"
+#include "sieve-binary.h"
+
+#include "managesieve-check-cache.h"
+
+/* Only the last few uploads are likely to be submitted again */
+#define MANAGESIEVE_CHECK_CACHE_MAX_ENTRIES 8
+
+struct managesieve_check_cache_entry {
+	struct managesieve_check_cache_entry *prev, *next;
+
+	struct managesieve_check_result result;
+};
+
+struct managesieve_check_cache {
+	/* Most recently used first */
+	struct managesieve_check_cache_entry *head, *tail;
+	unsigned int count;
+};
+
+struct managesieve_check_cache *managesieve_check_cache_create(void)
+{
+	return i_new(struct managesieve_check_cache, 1);
+}
+
+static void
+managesieve_check_cache_entry_free(struct managesieve_check_cache *cache,
+				   struct managesieve_check_cache_entry *entry)
+{
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	i_assert(cache->count > 0);
+	cache->count--;
+
+	if (entry->result.sbin != NULL)
+		sieve_close(&entry->result.sbin);
+	i_free(entry->result.scriptname);
+	i_free(entry->result.messages);
+	i_free(entry);
+}
+
+void managesieve_check_cache_clear(struct managesieve_check_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	while (cache->head != NULL)
+		managesieve_check_cache_entry_free(cache, cache->head);
+}
+
+void managesieve_check_cache_free(struct managesieve_check_cache **_cache)
+{
+	struct managesieve_check_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (cache == NULL)
+		return;
+
+	managesieve_check_cache_clear(cache);
+	i_free(cache);
+}
+
+void managesieve_check_cache_digest(const void *data, size_t size,
+				    enum sieve_compile_flags cpflags,
+				    unsigned char digest_r[SHA1_RESULTLEN])
+{
+	struct sha1_ctxt ctx;
+	uint32_t flags = (uint32_t)(cpflags & ENUM_NEGATE(
+		SIEVE_COMPILE_FLAG_ACTIVATED));
+
+	sha1_init(&ctx);
+	sha1_loop(&ctx, &flags, sizeof(flags));
+	sha1_loop(&ctx, data, size);
+	sha1_result(&ctx, digest_r);
+}
+
+const struct managesieve_check_result *
+managesieve_check_cache_lookup(struct managesieve_check_cache *cache,
+			       const unsigned char digest[SHA1_RESULTLEN])
+{
+	struct managesieve_check_cache_entry *entry;
+
+	if (cache == NULL)
+		return NULL;
+
+	for (entry = cache->head; entry != NULL; entry = entry->next) {
+		if (memcmp(entry->result.digest, digest, SHA1_RESULTLEN) == 0)
+			break;
+	}
+	if (entry == NULL)
+		return NULL;
+
+	/* Move to front */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	return &entry->result;
+}
+
+void managesieve_check_cache_add(struct managesieve_check_cache *cache,
+				 const unsigned char digest[SHA1_RESULTLEN],
+				 const char *scriptname, const char *messages, unsigned int errors,
+				 unsigned int warnings,
+				 struct sieve_binary *sbin)
+{
+	struct managesieve_check_cache_entry *entry;
+
+	if (cache == NULL)
+		return;
+
+	entry = i_new(struct managesieve_check_cache_entry, 1);
+	memcpy(entry->result.digest, digest, SHA1_RESULTLEN);
+	entry->result.scriptname = i_strdup(scriptname);
+	entry->result.messages = i_strdup(messages);
+	entry->result.errors = errors;
+	entry->result.warnings = warnings;
+	if (sbin != NULL) {
+		sieve_binary_ref(sbin);
+		entry->result.sbin = sbin;
+	}
+
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+
+	/* Evict least recently used results */
+	while (cache->count > MANAGESIEVE_CHECK_CACHE_MAX_ENTRIES)
+		managesieve_check_cache_entry_free(cache, cache->tail);
+}
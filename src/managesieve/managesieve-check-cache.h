@@ -0,0 +1,55 @@
+#ifndef MANAGESIEVE_CHECK_CACHE_H
+#define MANAGESIEVE_CHECK_CACHE_H
+
+#include "sha1.h"
+
+#include "sieve.h"
+
+/* The check cache keeps the results of recently compiled uploads for a
+   session, keyed by a digest of the script content and the compile flags.
+   Clients (notably web interfaces) tend to submit the same script repeatedly
+   with CHECKSCRIPT and then store it with PUTSCRIPT; the cached result answers
+   the repeated checks, and the cached binary is stored along with the script.
+   Results of scripts that include other scripts are not cached, since these
+   depend on more than the content. */
+
+struct managesieve_check_result {
+	unsigned char digest[SHA1_RESULTLEN];
+	/* Name the script was compiled under (mentioned in messages) */
+	char *scriptname;
+
+	/* Error handler output and counts */
+	char *messages;
+	unsigned int errors, warnings;
+
+	/* Compiled binary; NULL if compilation failed */
+	struct sieve_binary *sbin;
+};
+
+struct managesieve_check_cache;
+
+struct managesieve_check_cache *managesieve_check_cache_create(void);
+void managesieve_check_cache_free(struct managesieve_check_cache **_cache);
+/* Drops all cached results. */
+void managesieve_check_cache_clear(struct managesieve_check_cache *cache);
+
+/* The digest covers the script content and the compile flags, except
+   SIEVE_COMPILE_FLAG_ACTIVATED (which only matters to included scripts). */
+void managesieve_check_cache_digest(const void *data, size_t size,
+				    enum sieve_compile_flags cpflags,
+				    unsigned char digest_r[SHA1_RESULTLEN]);
+
+/* Returns the cached result, or NULL if there is none. The result is valid
+   until the cache is next modified. */
+const struct managesieve_check_result *
+managesieve_check_cache_lookup(struct managesieve_check_cache *cache,
+			       const unsigned char digest[SHA1_RESULTLEN]);
+/* Adds the result of compiling the script. A reference to the binary (if
+   any) is kept by the cache. */
+void managesieve_check_cache_add(struct managesieve_check_cache *cache,
+				 const unsigned char digest[SHA1_RESULTLEN],
+				 const char *scriptname, const char *messages, unsigned int errors,
+				 unsigned int warnings,
+				 struct sieve_binary *sbin);
+
+#endif
@@ -24,6 +24,7 @@
 #include "managesieve-quote.h"
 #include "managesieve-common.h"
 #include "managesieve-commands.h"
+#include "managesieve-check-cache.h"
 #include "managesieve-client.h"
 
 #include <unistd.h>
@@ -61,6 +62,30 @@ static void client_idle_timeout(struct client *client)
 	}
 }
 
+static void client_idle_release(struct client *client)
+{
+	timeout_remove(&client->to_idle_release);
+	if (client->command_pending)
+		return;
+
+	/* The session is idle; nothing of this is needed until the next
+	   command, and all of it is recreated on demand then. */
+	e_debug(client->event, "Releasing memory of idle session");
+	managesieve_check_cache_clear(client->check_cache);
+	sieve_storage_release_memory(client->storage);
+	sieve_release_memory(client->svinst);
+}
+
+static void client_idle_release_reset(struct client *client)
+{
+	if (client->to_idle_release != NULL) {
+		timeout_reset(client->to_idle_release);
+		return;
+	}
+	client->to_idle_release = timeout_add(CLIENT_IDLE_RELEASE_MSECS,
+					      client_idle_release, client);
+}
+
 static struct sieve_storage *
 client_get_storage(struct sieve_instance *svinst, struct event *event,
 		   struct mail_user *user, int fd_out)
@@ -155,6 +180,7 @@ client_create(int fd_in, int fd_out, const char *session_id,
 	client->last_input = ioloop_time;
 	client->to_idle = timeout_add(CLIENT_IDLE_TIMEOUT_MSECS,
 				      client_idle_timeout, client);
+	client_idle_release_reset(client);
 
 	client->cmd.pool = pool_alloconly_create(
 		MEMPOOL_GROWING"client command", 1024*12);
@@ -163,6 +189,7 @@ client_create(int fd_in, int fd_out, const char *session_id,
 	client->user = user;
 
 	client->svinst = svinst;
+	client->check_cache = managesieve_check_cache_create();
 	client->storage = storage;
 
 	struct master_service_anvil_session anvil_session;
@@ -263,6 +290,7 @@ void client_destroy(struct client *client, const char *reason)
 	managesieve_parser_destroy(&client->parser);
 	io_remove(&client->io);
 	timeout_remove(&client->to_idle_output);
+	timeout_remove(&client->to_idle_release);
 	timeout_remove(&client->to_idle);
 
 	/* i/ostreams are already closed at this stage, so fd can be closed */
@@ -276,6 +304,8 @@ void client_destroy(struct client *client, const char *reason)
 	i_stream_destroy(&client->input);
 	o_stream_destroy(&client->output);
 
+	/* Cached binaries refer to the Sieve instance */
+	managesieve_check_cache_free(&client->check_cache);
 	sieve_storage_unref(&client->storage);
 	sieve_deinit(&client->svinst);
 
@@ -317,6 +347,7 @@ void client_disconnect(struct client *client, const char *reason)
 	i_stream_close(client->input);
 	o_stream_close(client->output);
 
+	timeout_remove(&client->to_idle_release);
 	timeout_remove(&client->to_idle);
 	if (!client->destroyed)
 		client->to_idle = timeout_add(0, client_destroy_timeout, client);
@@ -385,7 +416,12 @@ client_command_create_finish_event(struct client_command_context *cmd)
 		event_create_passthrough(cmd->event)->
 		set_name("managesieve_command_finished")->
 		add_int("net_in_bytes", bytes_in)->
-		add_int("net_out_bytes", bytes_out);
+		add_int("net_out_bytes", bytes_out)->
+		add_int("queue_wait_usecs", cmd->stats.queue_wait_usecs);
+	if (cmd->stats.storage_usecs > 0)
+		e->add_int("storage_usecs", cmd->stats.storage_usecs);
+	if (cmd->stats.compile_usecs > 0)
+		e->add_int("compile_usecs", cmd->stats.compile_usecs);
 	return e;
 }
 
@@ -573,6 +609,8 @@ void _client_reset_command(struct client *client)
 	   time and we don't want to disconnect client immediately then */
 	client->last_input = ioloop_time;
 	timeout_reset(client->to_idle);
+	if (!client->disconnected)
+		client_idle_release_reset(client);
 
 	client->command_pending = FALSE;
 	if (client->io == NULL && !client->disconnected) {
@@ -685,11 +723,25 @@ static bool client_handle_input(struct client_command_context *cmd)
 		client_send_command_error(cmd, "Unknown command.");
 		_client_reset_command(client);
 	} else {
+		struct timeval now;
+		long long wait_usecs;
+
 		i_assert(!client->disconnected);
 
+		/* The event was created when the previous command finished;
+		   start a new one, so that its duration only covers this
+		   command. */
+		event_unref(&cmd->event);
+		cmd->event = event_create(client->event);
+
 		event_add_str(cmd->event, "cmd_name", t_str_ucase(cmd->name));
 		cmd->stats.bytes_in = i_stream_get_absolute_offset(client->input);
 		cmd->stats.bytes_out = client->output->offset;
+
+		i_gettimeofday(&now);
+		wait_usecs = timeval_diff_usecs(&now, &client->last_input_tv);
+		cmd->stats.queue_wait_usecs = (wait_usecs > 0 ? wait_usecs : 0);
+
 		client_handle_input(cmd);
 	}
 
@@ -709,6 +761,7 @@ void client_input(struct client *client)
 
 	client->input_pending = FALSE;
 	client->last_input = ioloop_time;
+	client->last_input_tv = ioloop_timeval;
 	timeout_reset(client->to_idle);
 
 	switch (i_stream_read(client->input)) {
@@ -774,16 +827,21 @@ int client_output(struct client *client)
 	if (!finished && client->output_pending)
 		o_stream_set_flush_pending(client->output, TRUE);
 
-	o_stream_uncork(client->output);
-
 	if (finished) {
 		/* command execution was finished */
 		client->bad_counter = 0;
 		_client_reset_command(client);
 
-		if (client->input_pending)
+		if (client->input_pending) {
+			/* Continue with the pipelined commands before
+			   uncorking, so that their replies go out in the same
+			   flush; client_input() uncorks the output. */
 			client_input(client);
+			return ret;
+		}
 	}
+
+	o_stream_uncork(client->output);
 	return ret;
 }
 
@@ -24,6 +24,11 @@ struct client_command_context {
 	struct {
 		uint64_t bytes_in;
 		uint64_t bytes_out;
+		/* Time the command waited behind earlier pipelined commands */
+		uint64_t queue_wait_usecs;
+		/* Set by the commands that access the storage or compile */
+		uint64_t storage_usecs;
+		uint64_t compile_usecs;
 	} stats;
 	command_func_t *func;
 	void *context;
@@ -50,6 +55,7 @@ struct client {
 	struct istream *input;
 	struct ostream *output;
 	struct timeout *to_idle, *to_idle_output;
+	struct timeout *to_idle_release;
 	guid_128_t anvil_conn_guid;
 
 	pool_t pool;
@@ -59,8 +65,12 @@ struct client {
 
 	struct sieve_instance *svinst;
 	struct sieve_storage *storage;
+	/* Results of recently checked or stored scripts */
+	struct managesieve_check_cache *check_cache;
 
 	time_t last_input, last_output;
+	/* When input was last read from the client */
+	struct timeval last_input_tv;
 	unsigned int bad_counter;
 
 	struct managesieve_parser *parser;
@@ -23,7 +23,8 @@ static const struct command managesieve_base_commands[] = {
 	{ "LISTSCRIPTS", cmd_listscripts },
 	{ "HAVESPACE", cmd_havespace },
 	{ "RENAMESCRIPT", cmd_renamescript },
-	{ "NOOP", cmd_noop }
+	{ "NOOP", cmd_noop },
+	{ "XPUTSCRIPTS", cmd_putscripts }
 };
 
 #define MANAGESIEVE_COMMANDS_COUNT N_ELEMENTS(managesieve_base_commands)
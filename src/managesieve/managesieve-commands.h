@@ -35,6 +35,7 @@ extern bool cmd_noop(struct client_command_context *cmd);
 
 /* Authenticated State */
 extern bool cmd_putscript(struct client_command_context *cmd);
+extern bool cmd_putscripts(struct client_command_context *cmd);
 extern bool cmd_checkscript(struct client_command_context *cmd);
 extern bool cmd_getscript(struct client_command_context *cmd);
 extern bool cmd_setactive(struct client_command_context *cmd);
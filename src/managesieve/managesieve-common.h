@@ -6,6 +6,11 @@
 /* Disconnect client after idling this many milliseconds */
 #define CLIENT_IDLE_TIMEOUT_MSECS (60*30*1000)
 
+/* Release memory held only for speeding up subsequent commands (cached
+   binaries, directory listings, idle pools) after idling this many
+   milliseconds */
+#define CLIENT_IDLE_RELEASE_MSECS (60*1000)
+
 /* If we can't send anything to client for this long, disconnect the client */
 #define CLIENT_OUTPUT_TIMEOUT_MSECS (5*60*1000)
 
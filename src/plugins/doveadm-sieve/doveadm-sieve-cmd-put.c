@@ -2,10 +2,17 @@
  */
 
 #include "lib.h"
+#include "str.h"
+#include "hash.h"
+#include "sha2.h"
+#include "hex-binary.h"
 #include "istream.h"
+#include "mail-user.h"
 #include "doveadm-mail.h"
 
 #include "sieve.h"
+#include "sieve-extensions.h"
+#include "sieve-binary.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
 
@@ -16,9 +23,72 @@ struct doveadm_sieve_put_cmd_context {
 
 	const char *scriptname;
 
+	/* Scripts already found to compile for an earlier user with the same
+	   Sieve configuration (e.g. with -A); see cmd_sieve_put_compile_key() */
+	HASH_TABLE(char *, char *) compiled;
+
 	bool activate:1;
 };
 
+static const char *
+cmd_sieve_put_compile_key(struct doveadm_sieve_put_cmd_context *ctx,
+			  struct sieve_script *script,
+			  enum sieve_compile_flags cpflags)
+{
+	struct mail_user *user = ctx->ctx.ctx.cur_mail_user;
+	struct sha256_ctx hctx;
+	unsigned char digest[SHA256_RESULTLEN];
+	const char *const *envs, *extstr;
+	struct istream *input;
+	const unsigned char *data;
+	unsigned int i, count;
+	size_t size;
+
+	if (sieve_script_get_stream(script, &input, NULL) < 0)
+		return NULL;
+
+	/* Whether the script compiles depends on the script source, the
+	   enabled extensions and the Sieve settings of the user */
+	sha256_init(&hctx);
+	sha256_loop(&hctx, &cpflags, sizeof(cpflags));
+	extstr = sieve_extensions_get_string(ctx->ctx.svinst);
+	sha256_loop(&hctx, extstr, strlen(extstr) + 1);
+	if (array_is_created(&user->set->plugin_envs)) {
+		envs = array_get(&user->set->plugin_envs, &count);
+		for (i = 0; i + 1 < count; i += 2) {
+			if (!str_begins(envs[i], "sieve"))
+				continue;
+			sha256_loop(&hctx, envs[i], strlen(envs[i]) + 1);
+			sha256_loop(&hctx, envs[i+1], strlen(envs[i+1]) + 1);
+		}
+	}
+
+	i_stream_seek(input, 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		sha256_loop(&hctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		return NULL;
+	i_stream_seek(input, 0);
+
+	sha256_result(&hctx, digest);
+	return binary_to_hex(digest, sizeof(digest));
+}
+
+static bool
+cmd_sieve_put_binary_is_portable(struct doveadm_sieve_put_cmd_context *ctx,
+				 struct sieve_binary *sbin)
+{
+	const struct sieve_extension *include_ext;
+
+	/* Included scripts are resolved in the user's own storage, so the
+	   result cannot be carried over to another user */
+	include_ext = sieve_extension_get_by_name(ctx->ctx.svinst, "include");
+	return (include_ext == NULL ||
+		sieve_binary_extension_get_index(sbin, include_ext) < 0);
+}
+
 static int cmd_sieve_put_run(struct doveadm_sieve_cmd_context *_ctx)
 {
 	struct doveadm_sieve_put_cmd_context *ctx =
@@ -73,6 +143,8 @@ static int cmd_sieve_put_run(struct doveadm_sieve_cmd_context *_ctx)
 			SIEVE_COMPILE_FLAG_UPLOADED;
 		struct sieve_script *script;
 		struct sieve_binary *sbin;
+		const char *key;
+		bool compiled;
 
 		/* Obtain script object for uploaded script */
 		script = sieve_storage_save_get_tempscript(save_ctx);
@@ -92,16 +164,46 @@ static int cmd_sieve_put_run(struct doveadm_sieve_cmd_context *_ctx)
 			    sieve_storage_save_will_activate(save_ctx))
 				cpflags |= SIEVE_COMPILE_FLAG_ACTIVATED;
 
-			/* Compile */
-			ehandler = sieve_master_ehandler_create(
-				ctx->ctx.svinst, 0);
-			sbin = sieve_compile_script(script, ehandler, cpflags,
-						    &error);
-			if (sbin == NULL) {
+			/* Compile, unless the same script already compiled
+			   with the same configuration */
+			key = cmd_sieve_put_compile_key(ctx, script, cpflags);
+			if (key != NULL && hash_table_is_created(ctx->compiled) &&
+			    hash_table_lookup(ctx->compiled, key) != NULL) {
+				e_debug(event, "Script already verified "
+					"for an earlier user");
+				sbin = NULL;
+				compiled = TRUE;
+			} else {
+				ehandler = sieve_master_ehandler_create(
+					ctx->ctx.svinst, 0);
+				sbin = sieve_compile_script(
+					script, ehandler, cpflags, &error);
+				sieve_error_handler_unref(&ehandler);
+				compiled = (sbin != NULL);
+			}
+			if (!compiled) {
 				doveadm_sieve_cmd_failed_error(_ctx, error);
 				ret = -1;
 			} else {
-				sieve_close(&sbin);
+				if (sbin != NULL && key != NULL &&
+				    cmd_sieve_put_binary_is_portable(ctx, sbin)) {
+					char *key_dup =
+						p_strdup(_ctx->ctx.pool, key);
+
+					if (!hash_table_is_created(ctx->compiled)) {
+						hash_table_create(
+							&ctx->compiled,
+							_ctx->ctx.pool, 0,
+							str_hash, strcmp);
+					}
+					hash_table_insert(ctx->compiled,
+							  key_dup, key_dup);
+				}
+				if (sbin != NULL) {
+					sieve_storage_save_set_binary(save_ctx,
+								      sbin);
+					sieve_close(&sbin);
+				}
 
 				/* Script is valid; commit it to storage */
 				ret = sieve_storage_save_commit(&save_ctx);
@@ -114,7 +216,6 @@ static int cmd_sieve_put_run(struct doveadm_sieve_cmd_context *_ctx)
 					ret = -1;
 				}
 			}
-			sieve_error_handler_unref(&ehandler);
 		}
 	}
 
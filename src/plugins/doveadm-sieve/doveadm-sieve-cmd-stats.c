@@ -0,0 +1,147 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "doveadm-print.h"
+#include "doveadm-mail.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-binary.h"
+#include "sieve-storage.h"
+
+#include "doveadm-sieve-cmd.h"
+
+struct doveadm_sieve_stats_script {
+	const char *name;
+	const char *binary;
+	unsigned int cpu_time_msecs;
+	bool active;
+};
+ARRAY_DEFINE_TYPE(doveadm_sieve_stats_script,
+		  struct doveadm_sieve_stats_script);
+
+static int
+doveadm_sieve_stats_script_cmp(const struct doveadm_sieve_stats_script *s1,
+			       const struct doveadm_sieve_stats_script *s2)
+{
+	if (s1->cpu_time_msecs != s2->cpu_time_msecs)
+		return (s1->cpu_time_msecs > s2->cpu_time_msecs ? -1 : 1);
+	return strcmp(s1->name, s2->name);
+}
+
+static void
+cmd_sieve_stats_script(struct doveadm_sieve_cmd_context *_ctx,
+		       struct doveadm_sieve_stats_script *stats)
+{
+	struct sieve_resource_usage rusage;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	const char *client_error;
+
+	stats->binary = "none";
+
+	script = sieve_storage_open_script(_ctx->storage, stats->name, &error);
+	if (script == NULL) {
+		stats->binary = "error";
+		return;
+	}
+
+	/* The cumulative usage is kept in the binary */
+	sbin = sieve_script_binary_load(script, &error);
+	if (sbin != NULL) {
+		sieve_binary_get_resource_usage(sbin, &rusage);
+		stats->cpu_time_msecs = rusage.cpu_time_msecs;
+
+		if (!sieve_binary_up_to_date(sbin, 0))
+			stats->binary = "stale";
+		else if (sieve_binary_check_executable(
+				sbin, &error, &client_error) <= 0)
+			stats->binary = "blocked";
+		else if (sieve_binary_is_outdated(sbin))
+			stats->binary = "outdated";
+		else
+			stats->binary = "ok";
+		sieve_binary_close(&sbin);
+	}
+	sieve_script_unref(&script);
+}
+
+static int cmd_sieve_stats_run(struct doveadm_sieve_cmd_context *_ctx)
+{
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_storage *storage = _ctx->storage;
+	struct sieve_storage_list_context *lctx;
+	ARRAY_TYPE(doveadm_sieve_stats_script) scripts;
+	struct doveadm_sieve_stats_script *stats;
+	enum sieve_error error;
+	const char *scriptname;
+	bool active;
+
+	lctx = sieve_storage_list_init(storage);
+	if (lctx == NULL) {
+		e_error(event, "Listing Sieve scripts failed: %s",
+			sieve_storage_get_last_error(storage, &error));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		return -1;
+	}
+
+	t_array_init(&scripts, 16);
+	while ((scriptname = sieve_storage_list_next(lctx, &active)) != NULL) {
+		stats = array_append_space(&scripts);
+		stats->name = t_strdup(scriptname);
+		stats->active = active;
+	}
+
+	if (sieve_storage_list_deinit(&lctx) < 0) {
+		e_error(event, "Listing Sieve scripts failed: %s",
+			sieve_storage_get_last_error(storage, &error));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		return -1;
+	}
+
+	array_foreach_modifiable(&scripts, stats)
+		cmd_sieve_stats_script(_ctx, stats);
+
+	/* Most expensive scripts first */
+	array_sort(&scripts, doveadm_sieve_stats_script_cmp);
+
+	array_foreach_modifiable(&scripts, stats) {
+		doveadm_print(stats->name);
+		doveadm_print(stats->active ? "ACTIVE" : "");
+		doveadm_print(stats->binary);
+		doveadm_print_num(stats->cpu_time_msecs);
+	}
+	return 0;
+}
+
+static void
+cmd_sieve_stats_init(struct doveadm_mail_cmd_context *_ctx ATTR_UNUSED)
+{
+	doveadm_print_header_simple("script");
+	doveadm_print_header_simple("active");
+	doveadm_print_header_simple("binary");
+	doveadm_print_header_simple("cpu_time_msecs");
+}
+
+static struct doveadm_mail_cmd_context *cmd_sieve_stats_alloc(void)
+{
+	struct doveadm_sieve_cmd_context *ctx;
+
+	ctx = doveadm_sieve_cmd_alloc(struct doveadm_sieve_cmd_context);
+	ctx->ctx.v.init = cmd_sieve_stats_init;
+	ctx->v.run = cmd_sieve_stats_run;
+	doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+	return &ctx->ctx;
+}
+
+struct doveadm_cmd_ver2 doveadm_sieve_cmd_stats = {
+	.name = "sieve stats",
+	.mail_cmd = cmd_sieve_stats_alloc,
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX,
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAMS_END
+};
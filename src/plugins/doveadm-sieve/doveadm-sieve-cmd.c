@@ -161,6 +161,7 @@ static struct doveadm_cmd_ver2 *doveadm_sieve_commands[] = {
 	&doveadm_sieve_cmd_activate,
 	&doveadm_sieve_cmd_deactivate,
 	&doveadm_sieve_cmd_rename,
+	&doveadm_sieve_cmd_stats,
 };
 
 void doveadm_sieve_cmds_init(void)
@@ -37,6 +37,7 @@ extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_delete;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_activate;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_deactivate;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_rename;
+extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_stats;
 
 void doveadm_sieve_cmds_init(void);
 
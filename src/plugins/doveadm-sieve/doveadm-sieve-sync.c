@@ -15,6 +15,11 @@
 
 #include "doveadm-sieve-plugin.h"
 
+/* Incoming scripts up to this size are compared with the stored script
+   before saving, so that unchanged scripts are neither rewritten nor
+   recompiled. */
+#define SIEVE_ATTRIBUTE_COMPARE_MAX_SIZE (1024*1024)
+
 #define SIEVE_MAIL_CONTEXT(obj) \
 	MODULE_CONTEXT_REQUIRE(obj, sieve_storage_module)
 #define SIEVE_USER_CONTEXT(obj) \
@@ -276,13 +281,86 @@ sieve_attribute_set_default(struct mail_storage *storage,
 	return -1;
 }
 
+static int
+sieve_attribute_script_equals(struct sieve_storage *svstorage,
+			      const char *scriptname,
+			      const unsigned char *content, size_t size)
+{
+	struct sieve_script *script;
+	struct istream *input;
+	enum sieve_error error;
+	const unsigned char *data;
+	size_t data_size, offset = 0;
+	bool equal = TRUE;
+
+	script = sieve_storage_open_script(svstorage, scriptname, NULL);
+	if (script == NULL)
+		return 0;
+	if (sieve_script_get_stream(script, &input, &error) < 0) {
+		sieve_script_unref(&script);
+		return 0;
+	}
+
+	while (i_stream_read_more(input, &data, &data_size) > 0) {
+		if (data_size > size - offset ||
+		    memcmp(data, content + offset, data_size) != 0) {
+			equal = FALSE;
+			break;
+		}
+		offset += data_size;
+		i_stream_skip(input, data_size);
+	}
+	if (input->stream_errno != 0 || offset != size)
+		equal = FALSE;
+
+	sieve_script_unref(&script);
+	return (equal ? 1 : 0);
+}
+
+static int
+sieve_attribute_read_value(struct mail_storage *storage,
+			   struct istream *input, buffer_t **content_r)
+{
+	const unsigned char *data;
+	uoff_t size;
+	size_t data_size;
+	buffer_t *content;
+
+	*content_r = NULL;
+
+	/* Only small values of known size are read into memory for
+	   comparison; others are streamed directly into the storage */
+	if (i_stream_get_size(input, TRUE, &size) <= 0 ||
+	    size > SIEVE_ATTRIBUTE_COMPARE_MAX_SIZE)
+		return 0;
+
+	content = buffer_create_dynamic(default_pool, size);
+	while (i_stream_read_more(input, &data, &data_size) > 0) {
+		buffer_append(content, data, data_size);
+		i_stream_skip(input, data_size);
+	}
+	if (input->stream_errno != 0) {
+		errno = input->stream_errno;
+		mail_storage_set_critical(
+			storage, "Saving sieve script: read(%s) failed: %m",
+			i_stream_get_name(input));
+		buffer_free(&content);
+		return -1;
+	}
+
+	*content_r = content;
+	return 1;
+}
+
 static int
 sieve_attribute_set_sieve(struct mail_storage *storage,
 			  const char *key,
 			  const struct mail_attribute_value *value)
 {
+	struct sieve_mail_user *suser = SIEVE_USER_CONTEXT(storage->user);
 	struct sieve_storage *svstorage;
 	struct sieve_storage_save_context *save_ctx;
+	buffer_t *content = NULL;
 	struct istream *input;
 	const char *scriptname;
 	int ret;
@@ -307,18 +385,42 @@ sieve_attribute_set_sieve(struct mail_storage *storage,
 	if (value->value != NULL) {
 		input = i_stream_create_from_data(value->value,
 						  strlen(value->value));
-		save_ctx = sieve_storage_save_init(svstorage, scriptname,
-						   input);
+		ret = sieve_attribute_script_equals(
+			svstorage, scriptname,
+			(const unsigned char *)value->value,
+			strlen(value->value));
 	} else if (value->value_stream != NULL) {
-		input = value->value_stream;
-		i_stream_ref(input);
-		save_ctx = sieve_storage_save_init(svstorage, scriptname,
-						   input);
+		ret = sieve_attribute_read_value(storage, value->value_stream,
+						 &content);
+		if (ret < 0)
+			return -1;
+		if (content != NULL) {
+			input = i_stream_create_from_data(content->data,
+							  content->used);
+			ret = sieve_attribute_script_equals(
+				svstorage, scriptname,
+				content->data, content->used);
+		} else {
+			input = value->value_stream;
+			i_stream_ref(input);
+		}
 	} else {
 		return sieve_attribute_unset_script(storage, svstorage,
 						    scriptname);
 	}
 
+	if (ret > 0) {
+		/* Identical to the stored script; keep it and its binary */
+		e_debug(suser->event,
+			"Sieve script '%s' is unchanged; not saving it",
+			scriptname);
+		i_stream_unref(&input);
+		if (content != NULL)
+			buffer_free(&content);
+		return 0;
+	}
+
+	save_ctx = sieve_storage_save_init(svstorage, scriptname, input);
 	if (save_ctx == NULL) {
 		/* Save initialization failed */
 		mail_storage_set_critical(
@@ -326,6 +428,8 @@ sieve_attribute_set_sieve(struct mail_storage *storage,
 			scriptname,
 			sieve_storage_get_last_error(svstorage, NULL));
 		i_stream_unref(&input);
+		if (content != NULL)
+			buffer_free(&content);
 		return -1;
 	}
 
@@ -369,6 +473,8 @@ sieve_attribute_set_sieve(struct mail_storage *storage,
 		ret = -1;
 	}
 	i_stream_unref(&input);
+	if (content != NULL)
+		buffer_free(&content);
 	return ret;
 }
 
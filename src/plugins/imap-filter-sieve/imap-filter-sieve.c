@@ -2,6 +2,10 @@
 
 #include "imap-common.h"
 #include "str.h"
+#include "hash.h"
+#include "sha2.h"
+#include "hex-binary.h"
+#include "istream.h"
 #include "ioloop.h"
 #include "time-util.h"
 #include "module-context.h"
@@ -14,11 +18,16 @@
 #include "sieve.h"
 #include "sieve-storage.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
 
 #include "imap-filter-sieve.h"
 
 #define DUPLICATE_DB_NAME "lda-dupes"
 
+/* Maximum number of compiled scripts kept for reuse by later FILTER commands
+   in the same session. The cache is simply flushed when it is full. */
+#define IMAP_FILTER_SIEVE_MAX_CACHED_BINARIES 8
+
 #define IMAP_FILTER_SIEVE_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, imap_filter_sieve_user_module)
 #define IMAP_FILTER_SIEVE_USER_CONTEXT_REQUIRE(obj) \
@@ -38,6 +47,12 @@ struct imap_filter_sieve_script {
 	bool rusage_exceeded:1;
 };
 
+struct imap_filter_sieve_cached_binary {
+	struct sieve_binary *binary;
+	/* Compile warnings, reported again when the binary is reused */
+	char *warnings;
+};
+
 struct imap_filter_sieve_user {
 	union mail_user_module_context module_ctx;
 	struct client *client;
@@ -46,6 +61,10 @@ struct imap_filter_sieve_user {
 	struct sieve_storage *storage;
 	struct sieve_storage *global_storage;
 
+	/* Binaries of earlier FILTER commands, keyed by script location, name
+	   and a digest of the script source */
+	HASH_TABLE(char *, struct imap_filter_sieve_cached_binary *) binaries;
+
 	struct mail_duplicate_db *dup_db;
 
 	struct sieve_error_handler *master_ehandler;
@@ -411,6 +430,104 @@ imap_sieve_filter_open_script(struct imap_filter_sieve_context *sctx,
 	return sbin;
 }
 
+/*
+ * Binary cache
+ */
+
+static const char *
+imap_filter_sieve_binary_cache_key(struct sieve_script *script)
+{
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_RESULTLEN];
+	struct istream *input;
+	const unsigned char *data;
+	const char *name = sieve_script_name(script);
+	size_t size;
+
+	if (sieve_script_get_stream(script, &input, NULL) < 0)
+		return NULL;
+
+	sha256_init(&ctx);
+	i_stream_seek(input, 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		sha256_loop(&ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		return NULL;
+	/* Leave the stream for the compiler */
+	i_stream_seek(input, 0);
+	sha256_result(&ctx, digest);
+
+	return t_strconcat(sieve_script_location(script), "\n",
+			   (name == NULL ? "" : name), "\n",
+			   binary_to_hex(digest, sizeof(digest)), NULL);
+}
+
+static void
+imap_filter_sieve_binary_cache_clear(struct imap_filter_sieve_user *ifsuser)
+{
+	struct hash_iterate_context *iter;
+	struct imap_filter_sieve_cached_binary *cbin;
+	char *key;
+
+	if (!hash_table_is_created(ifsuser->binaries))
+		return;
+
+	iter = hash_table_iterate_init(ifsuser->binaries);
+	while (hash_table_iterate(iter, ifsuser->binaries, &key, &cbin)) {
+		sieve_close(&cbin->binary);
+		i_free(cbin->warnings);
+		i_free(cbin);
+		i_free(key);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_clear(ifsuser->binaries, FALSE);
+}
+
+static struct imap_filter_sieve_cached_binary *
+imap_filter_sieve_binary_cache_lookup(struct imap_filter_sieve_context *sctx,
+				      const char *key)
+{
+	struct imap_filter_sieve_user *ifsuser =
+		IMAP_FILTER_SIEVE_USER_CONTEXT_REQUIRE(sctx->user);
+
+	if (key == NULL || !hash_table_is_created(ifsuser->binaries))
+		return NULL;
+	return hash_table_lookup(ifsuser->binaries, key);
+}
+
+static void
+imap_filter_sieve_binary_cache_add(struct imap_filter_sieve_context *sctx,
+				   const char *key, struct sieve_binary *sbin,
+				   const char *warnings)
+{
+	struct imap_filter_sieve_user *ifsuser =
+		IMAP_FILTER_SIEVE_USER_CONTEXT_REQUIRE(sctx->user);
+	struct imap_filter_sieve_cached_binary *cbin;
+
+	if (key == NULL)
+		return;
+
+	if (!hash_table_is_created(ifsuser->binaries)) {
+		hash_table_create(&ifsuser->binaries, default_pool, 0,
+				  str_hash, strcmp);
+	} else if (hash_table_count(ifsuser->binaries) >=
+		   IMAP_FILTER_SIEVE_MAX_CACHED_BINARIES) {
+		imap_filter_sieve_binary_cache_clear(ifsuser);
+	}
+
+	cbin = i_new(struct imap_filter_sieve_cached_binary, 1);
+	cbin->binary = sbin;
+	sieve_binary_ref(sbin);
+	cbin->warnings = i_strdup_empty(warnings);
+	hash_table_insert(ifsuser->binaries, i_strdup(key), cbin);
+}
+
+/*
+ * Compile
+ */
+
 int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 			      string_t **errors_r, bool *have_warnings_r)
 {
@@ -418,6 +535,7 @@ int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 	unsigned int count = sctx->scripts_count, i;
 	struct sieve_error_handler *ehandler;
 	enum sieve_error error;
+	bool cached_warnings = FALSE;
 	int ret = 0;
 
 	*errors_r = NULL;
@@ -428,13 +546,41 @@ int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 
 	for (i = 0; i < count; i++) {
 		struct sieve_script *script = scripts[i].script;
+		struct imap_filter_sieve_cached_binary *cbin;
+		size_t errors_before;
+		const char *key;
 
 		i_assert(script != NULL);
 
+		/* Clients tend to repeat the same FILTER; reuse the binary
+		   when the script source is unchanged */
+		key = imap_filter_sieve_binary_cache_key(script);
+		cbin = imap_filter_sieve_binary_cache_lookup(sctx, key);
+		if (cbin != NULL) {
+			e_debug(sieve_get_event(
+					imap_filter_sieve_get_svinst(sctx)),
+				"Reusing compiled script %s",
+				sieve_script_location(script));
+			scripts[i].binary = cbin->binary;
+			sieve_binary_ref(cbin->binary);
+			if (cbin->warnings != NULL) {
+				str_append(sctx->errors, cbin->warnings);
+				cached_warnings = TRUE;
+			}
+			continue;
+		}
+
+		errors_before = str_len(sctx->errors);
 		scripts[i].binary =
 			imap_sieve_filter_open_script(sctx, script, 0, ehandler,
 						     FALSE, &error);
-		if (scripts[i].binary == NULL) {
+		if (scripts[i].binary != NULL) {
+			imap_filter_sieve_binary_cache_add(
+				sctx, key, scripts[i].binary,
+				(sieve_get_warnings(ehandler) > 0 ?
+				 t_strdup(str_c(sctx->errors) + errors_before) :
+				 NULL));
+		} else {
 			if (error != SIEVE_ERROR_NOT_VALID) {
 				const char *errormsg =
 					sieve_script_get_last_error(
@@ -455,13 +601,62 @@ int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 		sieve_internal_error(ehandler, NULL, NULL);
 	}
 
-	*have_warnings_r = (sieve_get_warnings(ehandler) > 0);
+	*have_warnings_r = (sieve_get_warnings(ehandler) > 0 ||
+			    cached_warnings);
 	*errors_r = sctx->errors;
 
 	sieve_error_handler_unref(&ehandler);
 	return ret;
 }
 
+void imap_filter_sieve_get_wanted_headers(
+	struct imap_filter_sieve_context *sctx,
+	ARRAY_TYPE(const_string) *headers)
+{
+	const char *const *names, *const *hdrp;
+	unsigned int i, j, count;
+
+	for (i = 0; i < sctx->scripts_count; i++) {
+		struct sieve_binary *sbin = sctx->scripts[i].binary;
+
+		if (sbin == NULL)
+			continue;
+
+		names = sieve_binary_get_message_headers(sbin, &count);
+		for (j = 0; j < count; j++) {
+			bool found = FALSE;
+
+			array_foreach(headers, hdrp) {
+				if (strcasecmp(*hdrp, names[j]) == 0) {
+					found = TRUE;
+					break;
+				}
+			}
+			if (!found)
+				array_append(headers, &names[j], 1);
+		}
+	}
+}
+
+enum mail_fetch_field
+imap_filter_sieve_get_wanted_fields(struct imap_filter_sieve_context *sctx)
+{
+	enum mail_fetch_field wanted = 0;
+	unsigned int i;
+
+	for (i = 0; i < sctx->scripts_count; i++) {
+		struct sieve_binary *sbin = sctx->scripts[i].binary;
+
+		if (sbin == NULL)
+			continue;
+
+		if ((sieve_binary_get_message_fields(sbin) &
+		     SIEVE_MESSAGE_FIELD_SIZE) != 0)
+			wanted |= MAIL_FETCH_PHYSICAL_SIZE;
+	}
+	return wanted;
+}
+
 void imap_filter_sieve_open_input(struct imap_filter_sieve_context *sctx,
 				  struct istream *input)
 {
@@ -1120,6 +1315,10 @@ static void imap_filter_sieve_user_deinit(struct mail_user *user)
 
 	sieve_error_handler_unref(&ifsuser->master_ehandler);
 
+	imap_filter_sieve_binary_cache_clear(ifsuser);
+	if (hash_table_is_created(ifsuser->binaries))
+		hash_table_destroy(&ifsuser->binaries);
+
 	if (ifsuser->storage != NULL)
 		sieve_storage_unref(&ifsuser->storage);
 	if (ifsuser->global_storage != NULL)
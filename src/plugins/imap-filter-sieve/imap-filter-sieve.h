@@ -60,6 +60,15 @@ void imap_filter_sieve_context_free(struct imap_filter_sieve_context **_sctx);
 int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 			      string_t **errors_r, bool *have_warnings_r);
 
+/* Adds the header fields that the compiled scripts (may) look at to the
+   provided array, so that they can be prefetched along with the messages. */
+void imap_filter_sieve_get_wanted_headers(
+	struct imap_filter_sieve_context *sctx,
+	ARRAY_TYPE(const_string) *headers);
+/* Returns the other message fields the compiled scripts (may) look at. */
+enum mail_fetch_field
+imap_filter_sieve_get_wanted_fields(struct imap_filter_sieve_context *sctx);
+
 /*
  * Open
  */
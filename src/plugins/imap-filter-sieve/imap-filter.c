@@ -1,15 +1,21 @@
 /* Copyright (c) 2017-2018 Pigeonhole authors, see the included COPYING file */
 
 #include "imap-common.h"
+#include "array.h"
 #include "str.h"
+#include "ioloop.h"
 #include "ostream.h"
 #include "time-util.h"
+#include "imap-quote.h"
 #include "imap-resp-code.h"
 #include "imap-search-args.h"
 
 #include "imap-filter.h"
 #include "imap-filter-sieve.h"
 
+/* Maximum time spent filtering messages before returning to the ioloop */
+#define IMAP_FILTER_MAX_BATCH_MSECS 200
+
 static void imap_filter_args_check(struct imap_filter_context *ctx,
 				   const struct mail_search_arg *sargs)
 {
@@ -73,11 +79,23 @@ imap_filter_mail(struct client_command_context *cmd, struct mail *mail)
 	return !fatal;
 }
 
+static void imap_filter_send_progress(struct client_command_context *cmd)
+{
+	struct imap_filter_context *ctx = cmd->context;
+	string_t *str = t_str_new(128);
+
+	str_append(str, "* OK [INPROGRESS (");
+	imap_append_quoted(str, cmd->tag);
+	str_printfa(str, " %u NIL)] Filtering\r\n", ctx->filtered_count);
+	o_stream_nsend(cmd->client->output, str_data(str), str_len(str));
+}
+
 static bool imap_filter_more(struct client_command_context *cmd)
 {
 	struct imap_filter_context *ctx = cmd->context;
 	struct mail *mail;
 	enum mailbox_sync_flags sync_flags;
+	struct timeval start, now;
 	const char *ok_reply;
 	bool tryagain, lost_data;
 
@@ -86,6 +104,10 @@ static bool imap_filter_more(struct client_command_context *cmd)
 		return TRUE;
 	}
 
+	/* Running the script is synchronous, so bound the number of messages
+	   handled in one go; the rest of the process (and the client) would be
+	   kept waiting otherwise. */
+	i_gettimeofday(&start);
 	while (mailbox_search_next_nonblock(ctx->search_ctx,
 					    &mail, &tryagain)) {
 		bool ret;
@@ -94,6 +116,14 @@ static bool imap_filter_more(struct client_command_context *cmd)
 		} T_END;
 		if (!ret)
 			break;
+
+		ctx->filtered_count++;
+		i_gettimeofday(&now);
+		if (timeval_diff_msecs(&now, &start) >=
+		    IMAP_FILTER_MAX_BATCH_MSECS) {
+			imap_filter_send_progress(cmd);
+			return FALSE;
+		}
 	}
 	if (tryagain)
 		return FALSE;
@@ -137,7 +167,13 @@ static bool
 imap_filter_start(struct imap_filter_context *ctx,
 		  struct mail_search_args *sargs)
 {
+	static const char *const default_wanted_headers[] = {
+		"From", "To", "Message-ID", "Subject", "Return-Path",
+	};
 	struct client_command_context *cmd = ctx->cmd;
+	ARRAY_TYPE(const_string) wanted_headers;
+	struct mailbox_header_lookup_ctx *headers_ctx;
+	enum mail_fetch_field wanted_fields;
 
 	imap_filter_args_check(ctx, sargs->args);
 
@@ -148,7 +184,20 @@ imap_filter_start(struct imap_filter_context *ctx,
 	ctx->trans = mailbox_transaction_begin(ctx->box, 0,
 					       imap_client_command_get_reason(cmd));
 	ctx->sargs = sargs;
-	ctx->search_ctx = mailbox_search_init(ctx->trans, sargs, NULL, 0, NULL);
+
+	/* Prefetch what the scripts are going to look at */
+	t_array_init(&wanted_headers, 16);
+	array_append(&wanted_headers, default_wanted_headers,
+		     N_ELEMENTS(default_wanted_headers));
+	imap_filter_sieve_get_wanted_headers(ctx->sieve, &wanted_headers);
+	array_append_zero(&wanted_headers);
+	headers_ctx = mailbox_header_lookup_init(
+		ctx->box, array_front(&wanted_headers));
+	wanted_fields = MAIL_FETCH_VIRTUAL_SIZE |
+		imap_filter_sieve_get_wanted_fields(ctx->sieve);
+	ctx->search_ctx = mailbox_search_init(ctx->trans, sargs, NULL,
+					      wanted_fields, headers_ctx);
+	mailbox_header_lookup_unref(&headers_ctx);
 
 	if (imap_sieve_filter_run_init(ctx->sieve) < 0) {
 		const char *error = t_strflocaltime(
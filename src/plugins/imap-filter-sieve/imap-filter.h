@@ -23,6 +23,7 @@ struct imap_filter_context {
 	struct mail_search_args *sargs;
 
 	struct timeout *to;
+	unsigned int filtered_count;
 
 	bool failed:1;
 	bool compile_failure:1;
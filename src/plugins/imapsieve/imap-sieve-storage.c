@@ -54,6 +54,13 @@ ARRAY_DEFINE_TYPE(imap_sieve_mailbox_event,
 HASH_TABLE_DEFINE_TYPE(imap_sieve_mailbox_rule,
 	struct imap_sieve_mailbox_rule *,
 	struct imap_sieve_mailbox_rule *);
+HASH_TABLE_DEFINE_TYPE(imap_sieve_mailbox_rule_match,
+	const char *, struct imap_sieve_mailbox_rule_match *);
+
+/* Maximum number of distinct (mailbox, source, cause) combinations for which
+   the matching rules are remembered. The cache is simply flushed when it
+   grows beyond this. */
+#define IMAP_SIEVE_RULE_MATCH_CACHE_MAX 128
 
 struct imap_sieve_mailbox_rule {
 	unsigned int index;
@@ -64,6 +71,10 @@ struct imap_sieve_mailbox_rule {
 	const char *copy_source_after;
 };
 
+struct imap_sieve_mailbox_rule_match {
+	ARRAY_TYPE(imap_sieve_mailbox_rule) rules;
+};
+
 struct imap_sieve_user {
 	union mail_user_module_context module_ctx;
 	struct client *client;
@@ -75,6 +86,11 @@ struct imap_sieve_user {
 	HASH_TABLE_TYPE(imap_sieve_mailbox_rule) mbox_rules;
 	ARRAY_TYPE(imap_sieve_mailbox_rule) mbox_patterns;
 
+	/* Matched rules per (mailbox, source, cause); the rules themselves are
+	   fixed for the lifetime of the user */
+	pool_t rule_match_pool;
+	HASH_TABLE_TYPE(imap_sieve_mailbox_rule_match) rule_matches;
+
 	bool sieve_active:1;
 	bool user_script:1;
 	bool expunge_discarded:1;
@@ -103,12 +119,19 @@ struct imap_sieve_mailbox_transaction {
 	struct mailbox_transaction_context *src_mail_trans;
 
 	ARRAY_TYPE(imap_sieve_mailbox_event) events;
+
+	/* No script can run for flag changes in this transaction */
+	bool no_flag_events:1;
 };
 
 struct imap_sieve_mail {
 	union mail_module_context module_ctx;
 
-	string_t *flags;
+	/* Flags and keywords (space-terminated) before the first change */
+	enum mail_flags old_flags;
+	string_t *old_keywords;
+
+	bool flags_saved:1;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(imap_sieve_user_module,
@@ -262,25 +285,38 @@ imap_sieve_add_mailbox_copy_event(struct mailbox_transaction_context *t,
  * Mail
  */
 
+static void imap_sieve_mail_save_flags(struct imap_sieve_mail *ismail,
+				       struct mail *_mail)
+{
+	const char *const *keywords;
+
+	if (ismail->flags_saved)
+		return;
+
+	/* Remember the state before the first change; the event is only
+	   queued when the flags differ from this when the mail is closed */
+	ismail->old_flags = mail_get_flags(_mail);
+	if (ismail->old_keywords == NULL)
+		ismail->old_keywords = str_new(default_pool, 64);
+	else
+		str_truncate(ismail->old_keywords, 0);
+	for (keywords = mail_get_keywords(_mail); *keywords != NULL;
+	     keywords++) {
+		str_append(ismail->old_keywords, *keywords);
+		str_append_c(ismail->old_keywords, ' ');
+	}
+	ismail->flags_saved = TRUE;
+}
+
 static void
 imap_sieve_mail_update_flags(struct mail *_mail, enum modify_type modify_type,
 			     enum mail_flags flags)
 {
 	struct mail_private *mail = (struct mail_private *)_mail;
 	struct imap_sieve_mail *ismail = IMAP_SIEVE_MAIL_CONTEXT(mail);
-	enum mail_flags old_flags, new_flags, changed_flags;
 
-	old_flags = mail_get_flags(_mail);
+	imap_sieve_mail_save_flags(ismail, _mail);
 	ismail->module_ctx.super.update_flags(_mail, modify_type, flags);
-	new_flags = mail_get_flags(_mail);
-
-	changed_flags = old_flags ^ new_flags;
-	if (changed_flags == 0)
-		return;
-
-	if (ismail->flags == NULL)
-		ismail->flags = str_new(default_pool, 64);
-	imap_write_flags(ismail->flags, changed_flags, NULL);
 }
 
 static void
@@ -290,15 +326,25 @@ imap_sieve_mail_update_keywords(struct mail *_mail,
 {
 	struct mail_private *mail = (struct mail_private *)_mail;
 	struct imap_sieve_mail *ismail = IMAP_SIEVE_MAIL_CONTEXT(mail);
+
+	imap_sieve_mail_save_flags(ismail, _mail);
+	ismail->module_ctx.super.update_keywords(_mail, modify_type, keywords);
+}
+
+static void
+imap_sieve_mail_get_changed_flags(struct imap_sieve_mail *ismail,
+				  struct mail *_mail, string_t *str)
+{
+	enum mail_flags changed_flags;
 	const char *const *old_keywords, *const *new_keywords;
 	unsigned int i, j;
 
-	old_keywords = mail_get_keywords(_mail);
-	ismail->module_ctx.super.update_keywords(_mail, modify_type, keywords);
-	new_keywords = mail_get_keywords(_mail);
+	changed_flags = ismail->old_flags ^ mail_get_flags(_mail);
+	if (changed_flags != 0)
+		imap_write_flags(str, changed_flags, NULL);
 
-	if (ismail->flags == NULL)
-		ismail->flags = str_new(default_pool, 64);
+	old_keywords = t_strsplit_spaces(str_c(ismail->old_keywords), " ");
+	new_keywords = mail_get_keywords(_mail);
 
 	/* Removed flags */
 	for (i = 0; old_keywords[i] != NULL; i++) {
@@ -307,9 +353,9 @@ imap_sieve_mail_update_keywords(struct mail *_mail,
 				break;
 		}
 		if (new_keywords[j] == NULL) {
-			if (str_len(ismail->flags) > 0)
-				str_append_c(ismail->flags, ' ');
-			str_append(ismail->flags, old_keywords[i]);
+			if (str_len(str) > 0)
+				str_append_c(str, ' ');
+			str_append(str, old_keywords[i]);
 		}
 	}
 
@@ -320,9 +366,9 @@ imap_sieve_mail_update_keywords(struct mail *_mail,
 				break;
 		}
 		if (old_keywords[j] == NULL) {
-			if (str_len(ismail->flags) > 0)
-				str_append_c(ismail->flags, ' ');
-			str_append(ismail->flags, new_keywords[i]);
+			if (str_len(str) > 0)
+				str_append_c(str, ' ');
+			str_append(str, new_keywords[i]);
 		}
 	}
 }
@@ -335,16 +381,21 @@ static void imap_sieve_mail_close(struct mail *_mail)
 		IMAP_SIEVE_CONTEXT_REQUIRE(_mail->box);
 	struct imap_sieve_mail *ismail = IMAP_SIEVE_MAIL_CONTEXT(mail);
 
-	if (ismail->flags != NULL && str_len(ismail->flags) > 0) {
-		if (!_mail->expunged) {
+	if (ismail->flags_saved && !_mail->expunged) T_BEGIN {
+		string_t *changed = t_str_new(64);
+
+		/* Flags that were changed and then changed back, or that
+		   were set while already present, are no event */
+		imap_sieve_mail_get_changed_flags(ismail, _mail, changed);
+		if (str_len(changed) > 0) {
 			e_debug(isbox->event, "FLAG event (changed flags: %s)",
-				str_c(ismail->flags));
+				str_c(changed));
 
 			imap_sieve_add_mailbox_event(
-				t, _mail, _mail->box, str_c(ismail->flags));
+				t, _mail, _mail->box, str_c(changed));
 		}
-		str_truncate(ismail->flags, 0);
-	}
+	} T_END;
+	ismail->flags_saved = FALSE;
 
 	ismail->module_ctx.super.close(_mail);
 }
@@ -353,12 +404,12 @@ static void imap_sieve_mail_free(struct mail *_mail)
 {
 	struct mail_private *mail = (struct mail_private *)_mail;
 	struct imap_sieve_mail *ismail = IMAP_SIEVE_MAIL_CONTEXT(mail);
-	string_t *flags = ismail->flags;
+	string_t *old_keywords = ismail->old_keywords;
 
 	ismail->module_ctx.super.free(_mail);
 
-	if (flags != NULL)
-		str_free(&flags);
+	if (old_keywords != NULL)
+		str_free(&old_keywords);
 }
 
 static void imap_sieve_mail_allocated(struct mail *_mail)
@@ -372,7 +423,7 @@ static void imap_sieve_mail_allocated(struct mail *_mail)
 	struct mail_vfuncs *v = mail->vlast;
 	struct imap_sieve_mail *ismail;
 
-	if (ismt == NULL || isuser->sieve_active)
+	if (ismt == NULL || isuser->sieve_active || ismt->no_flag_events)
 		return;
 
 	ismail = p_new(mail->pool, struct imap_sieve_mail, 1);
@@ -469,6 +520,19 @@ imap_sieve_mailbox_transaction_begin(struct mailbox *box,
 	ismt->pool = pool;
 	MODULE_CONTEXT_SET(t, imap_sieve_storage_module, ismt);
 
+	/* Collecting the changed flags for each message is wasted effort when
+	   no rule applies to flag changes in this mailbox. A script assigned
+	   through mailbox metadata could apply, however. */
+	if ((isuser->cur_cmd == IMAP_SIEVE_CMD_STORE ||
+	     isuser->cur_cmd == IMAP_SIEVE_CMD_OTHER) &&
+	    !isuser->user_script) T_BEGIN {
+		ARRAY_TYPE(imap_sieve_mailbox_rule) mbrules;
+
+		t_array_init(&mbrules, 4);
+		imap_sieve_mailbox_rules_get(user, box, box, "FLAG", &mbrules);
+		ismt->no_flag_events = (array_count(&mbrules) == 0);
+	} T_END;
+
 	return t;
 }
 
@@ -527,10 +591,10 @@ imap_sieve_mailbox_transaction_run(
 	struct imap_sieve_mailbox_transaction *ismt, struct mailbox *dest_box,
 	struct mail_transaction_commit_changes *changes)
 {
-	static const char *wanted_headers[] = {
+	static const char *const default_wanted_headers[] = {
 		"From", "To", "Message-ID", "Subject", "Return-Path",
-		NULL
 	};
+	ARRAY_TYPE(const_string) wanted_headers;
 	struct mailbox *src_box = ismt->src_box;
 	struct mail_user *user = dest_box->storage->user;
 	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT_REQUIRE(user);
@@ -650,9 +714,21 @@ imap_sieve_mailbox_transaction_run(
 		return -1;
 	}
 
+	/* Request the header fields that are always needed, along with the
+	   ones the scripts test, so that these are fetched at once for each
+	   message */
+	t_array_init(&wanted_headers, 16);
+	array_append(&wanted_headers, default_wanted_headers,
+		     N_ELEMENTS(default_wanted_headers));
+	imap_sieve_run_get_wanted_headers(isrun, &wanted_headers);
+	if (isrun_src != NULL)
+		imap_sieve_run_get_wanted_headers(isrun_src, &wanted_headers);
+	array_append_zero(&wanted_headers);
+
 	/* Create transaction for event messages */
 	st = mailbox_transaction_begin(sbox, 0, __func__);
-	headers_ctx = mailbox_header_lookup_init(sbox, wanted_headers);
+	headers_ctx = mailbox_header_lookup_init(
+		sbox, array_front(&wanted_headers));
 	mail = mail_alloc(st, 0, headers_ctx);
 	mailbox_header_lookup_unref(&headers_ctx);
 
@@ -850,6 +926,11 @@ static void imap_sieve_mailbox_rules_init(struct mail_user *user)
 			  imap_sieve_mailbox_rule_cmp);
 	i_array_init(&isuser->mbox_patterns, 8);
 
+	isuser->rule_match_pool = pool_alloconly_create(
+		"imap sieve mailbox rule matches", 1024);
+	hash_table_create(&isuser->rule_matches, default_pool, 0,
+			  str_hash, strcmp);
+
 	identifier = t_str_new(256);
 	str_append(identifier, "imapsieve_mailbox");
 	prefix_len = str_len(identifier);
@@ -1064,23 +1145,55 @@ imap_sieve_mailbox_rules_get(struct mail_user *user,
 			     const char *cause,
 			     ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
 {
-	const char *dst_name, *src_name;
+	struct imap_sieve_user *isuser = IMAP_SIEVE_USER_CONTEXT_REQUIRE(user);
+	struct imap_sieve_mailbox_rule_match *match;
+	const char *dst_name, *src_name, *key;
+	char *key_dup;
 
 	imap_sieve_mailbox_rules_init(user);
 
-	imap_sieve_mailbox_rules_match_patterns(user, dst_box, src_box,
-						cause, rules);
-
 	dst_name = mailbox_get_vname(dst_box);
 	src_name = (src_box == NULL ? NULL : mailbox_get_vname(src_box));
 
-	imap_sieve_mailbox_rules_match(user, dst_name, src_name, cause, rules);
-	imap_sieve_mailbox_rules_match(user, "*", src_name, cause, rules);
+	/* Mailbox names cannot contain newlines; the source is prefixed so
+	   that a missing source differs from an empty name */
+	key = t_strdup_printf("%s\n%s\n%c%s", cause, dst_name,
+			      (src_name == NULL ? '-' : '+'),
+			      (src_name == NULL ? "" : src_name));
+	match = hash_table_lookup(isuser->rule_matches, key);
+	if (match != NULL) {
+		array_append_array(rules, &match->rules);
+		return;
+	}
+
+	if (hash_table_count(isuser->rule_matches) >=
+	    IMAP_SIEVE_RULE_MATCH_CACHE_MAX) {
+		hash_table_clear(isuser->rule_matches, TRUE);
+		p_clear(isuser->rule_match_pool);
+	}
+
+	match = p_new(isuser->rule_match_pool,
+		      struct imap_sieve_mailbox_rule_match, 1);
+	p_array_init(&match->rules, isuser->rule_match_pool, 2);
+
+	imap_sieve_mailbox_rules_match_patterns(user, dst_box, src_box,
+						cause, &match->rules);
+
+	imap_sieve_mailbox_rules_match(user, dst_name, src_name, cause,
+				       &match->rules);
+	imap_sieve_mailbox_rules_match(user, "*", src_name, cause,
+				       &match->rules);
 	if (src_name != NULL) {
 		imap_sieve_mailbox_rules_match(user, dst_name, NULL,
-					       cause, rules);
-		imap_sieve_mailbox_rules_match(user, "*", NULL, cause, rules);
+					       cause, &match->rules);
+		imap_sieve_mailbox_rules_match(user, "*", NULL, cause,
+					       &match->rules);
 	}
+
+	key_dup = p_strdup(isuser->rule_match_pool, key);
+	hash_table_insert(isuser->rule_matches, key_dup, match);
+
+	array_append_array(rules, &match->rules);
 }
 
 /*
@@ -1097,6 +1210,8 @@ static void imap_sieve_user_deinit(struct mail_user *user)
 	hash_table_destroy(&isuser->mbox_rules);
 	if (array_is_created(&isuser->mbox_patterns))
 		array_free(&isuser->mbox_patterns);
+	hash_table_destroy(&isuser->rule_matches);
+	pool_unref(&isuser->rule_match_pool);
 
 	event_unref(&isuser->event);
 
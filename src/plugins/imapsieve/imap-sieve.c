@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "home-expand.h"
 #include "smtp-address.h"
@@ -15,6 +16,7 @@
 
 #include "sieve.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
 #include "sieve-storage.h"
 
 #include "ext-imapsieve-common.h"
@@ -324,7 +326,11 @@ struct imap_sieve_run {
 	struct imap_sieve_run_script *scripts;
 	unsigned int scripts_count;
 
+	/* Script environment shared by all messages of this run */
+	struct sieve_script_env scriptenv;
+
 	bool trace_log_initialized:1;
+	bool scriptenv_initialized:1;
 };
 
 static void
@@ -360,11 +366,15 @@ imap_sieve_run_init_trace_log(struct imap_sieve_run *isrun,
 
 	if (sieve_trace_config_get(svinst, &isrun->trace_config) < 0 ||
 	    sieve_trace_log_open(svinst, &isrun->trace_log) < 0) {
-		i_zero(&isrun->trace_config);
-		isrun->trace_log = NULL;
+		/* Only keep a trace for slow scripts (if configured) */
+		if (sieve_trace_capture_open(svinst, &isrun->trace_config,
+					     &isrun->trace_log) < 0) {
+			i_zero(&isrun->trace_config);
+			isrun->trace_log = NULL;
+		}
 
-		i_zero(trace_config_r);
-		*trace_log_r = NULL;
+		*trace_config_r = isrun->trace_config;
+		*trace_log_r = isrun->trace_log;
 		return;
 	}
 
@@ -610,6 +620,71 @@ imap_sieve_run_open_script(struct imap_sieve_run *isrun,
 	return sbin;
 }
 
+static struct sieve_binary *
+imap_sieve_run_get_binary(struct imap_sieve_run *isrun, unsigned int index,
+			  enum sieve_error *compile_error_r)
+{
+	struct imap_sieve_run_script *rscript = &isrun->scripts[index];
+	struct sieve_script *script = rscript->script;
+	enum sieve_compile_flags cpflags;
+
+	if (rscript->binary != NULL)
+		return rscript->binary;
+
+	e_debug(sieve_get_event(isrun->isieve->svinst),
+		"Opening script %d of %d from `%s'",
+		index+1, isrun->scripts_count, sieve_script_location(script));
+
+	/* Already known to fail */
+	if (rscript->compile_error != SIEVE_ERROR_NONE) {
+		*compile_error_r = rscript->compile_error;
+		return NULL;
+	}
+
+	if (script == isrun->user_script)
+		cpflags = SIEVE_COMPILE_FLAG_NOGLOBAL;
+	else
+		cpflags = SIEVE_COMPILE_FLAG_NO_ENVELOPE;
+
+	/* Try to open/compile binary */
+	rscript->binary = imap_sieve_run_open_script(
+		isrun, script, cpflags, FALSE, compile_error_r);
+	if (rscript->binary == NULL)
+		rscript->compile_error = *compile_error_r;
+	return rscript->binary;
+}
+
+void imap_sieve_run_get_wanted_headers(struct imap_sieve_run *isrun,
+				       ARRAY_TYPE(const_string) *headers)
+{
+	const char *const *names, *const *hdrp;
+	enum sieve_error compile_error;
+	unsigned int i, j, count;
+
+	for (i = 0; i < isrun->scripts_count; i++) {
+		struct sieve_binary *sbin;
+
+		/* Scripts after one that fails to compile are not executed */
+		sbin = imap_sieve_run_get_binary(isrun, i, &compile_error);
+		if (sbin == NULL)
+			break;
+
+		names = sieve_binary_get_message_headers(sbin, &count);
+		for (j = 0; j < count; j++) {
+			bool found = FALSE;
+
+			array_foreach(headers, hdrp) {
+				if (strcasecmp(*hdrp, names[j]) == 0) {
+					found = TRUE;
+					break;
+				}
+			}
+			if (!found)
+				array_append(headers, &names[j], 1);
+		}
+	}
+}
+
 static int
 imap_sieve_handle_exec_status(struct imap_sieve_run *isrun,
 			      struct sieve_script *script, int status,
@@ -746,23 +821,10 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 
 		/* Open */
 		if (sbin == NULL) {
-			e_debug(sieve_get_event(svinst),
-				"Opening script %d of %d from `%s'",
-				i+1, count, sieve_script_location(script));
-
-			/* Already known to fail */
-			if (scripts[i].compile_error != SIEVE_ERROR_NONE) {
-				compile_error = scripts[i].compile_error;
+			sbin = imap_sieve_run_get_binary(isrun, i,
+							 &compile_error);
+			if (sbin == NULL)
 				break;
-			}
-
-			/* Try to open/compile binary */
-			scripts[i].binary = sbin = imap_sieve_run_open_script(
-				isrun, script, cpflags, FALSE, &compile_error);
-			if (sbin == NULL) {
-				scripts[i].compile_error = compile_error;
-				break;
-			}
 		}
 
 		/* Execute */
@@ -843,6 +905,39 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 					     scriptenv->exec_status, fatal_r);
 }
 
+static int
+imap_sieve_run_init_scriptenv(struct imap_sieve_run *isrun,
+			      const char **error_r)
+{
+	struct sieve_script_env *scriptenv = &isrun->scriptenv;
+	struct mail_user *user = isrun->isieve->client->user;
+
+	if (isrun->scriptenv_initialized)
+		return 0;
+
+	if (sieve_script_env_init(scriptenv, user, error_r) < 0)
+		return -1;
+
+	scriptenv->smtp_start = imap_sieve_smtp_start;
+	scriptenv->smtp_add_rcpt = imap_sieve_smtp_add_rcpt;
+	scriptenv->smtp_send = imap_sieve_smtp_send;
+	scriptenv->smtp_abort = imap_sieve_smtp_abort;
+	scriptenv->smtp_finish = imap_sieve_smtp_finish;
+	scriptenv->duplicate_transaction_begin =
+		imap_sieve_duplicate_transaction_begin;
+	scriptenv->duplicate_transaction_commit =
+		imap_sieve_duplicate_transaction_commit;
+	scriptenv->duplicate_transaction_rollback =
+		imap_sieve_duplicate_transaction_rollback;
+	scriptenv->duplicate_mark = imap_sieve_duplicate_mark;
+	scriptenv->duplicate_check = imap_sieve_duplicate_check;
+	scriptenv->result_amend_log_message =
+		imap_sieve_result_amend_log_message;
+
+	isrun->scriptenv_initialized = TRUE;
+	return 0;
+}
+
 int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 			const char *changed_flags, bool *fatal_r)
 {
@@ -893,29 +988,15 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 
 		/* Compose script execution environment */
 
-		if (sieve_script_env_init(&scriptenv, user, &error) < 0) {
+		if (imap_sieve_run_init_scriptenv(isrun, &error) < 0) {
 			e_error(sieve_get_event(svinst),
 				"Failed to initialize script execution: %s",
 				error);
 			ret = -1;
 		} else {
+			scriptenv = isrun->scriptenv;
 			scriptenv.default_mailbox =
 				mailbox_get_vname(mail->box);
-			scriptenv.smtp_start = imap_sieve_smtp_start;
-			scriptenv.smtp_add_rcpt = imap_sieve_smtp_add_rcpt;
-			scriptenv.smtp_send = imap_sieve_smtp_send;
-			scriptenv.smtp_abort = imap_sieve_smtp_abort;
-			scriptenv.smtp_finish = imap_sieve_smtp_finish;
-			scriptenv.duplicate_transaction_begin =
-				imap_sieve_duplicate_transaction_begin;
-			scriptenv.duplicate_transaction_commit =
-				imap_sieve_duplicate_transaction_commit;
-			scriptenv.duplicate_transaction_rollback =
-				imap_sieve_duplicate_transaction_rollback;
-			scriptenv.duplicate_mark = imap_sieve_duplicate_mark;
-			scriptenv.duplicate_check = imap_sieve_duplicate_check;
-			scriptenv.result_amend_log_message =
-				imap_sieve_result_amend_log_message;
 			scriptenv.trace_log = trace_log;
 			scriptenv.trace_config = trace_config;
 			scriptenv.script_context = &context;
@@ -56,4 +56,11 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 
 void imap_sieve_run_deinit(struct imap_sieve_run **_isrun);
 
+/* Adds the names of the header fields tested by the scripts of this run to
+   the headers array (if not present already). This opens the script binaries
+   right away, rather than upon the first message. The names are valid until
+   the run is deinitialized. */
+void imap_sieve_run_get_wanted_headers(struct imap_sieve_run *isrun,
+				       ARRAY_TYPE(const_string) *headers);
+
 #endif
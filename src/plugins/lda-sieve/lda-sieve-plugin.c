@@ -2,8 +2,12 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
 #include "array.h"
+#include "time-util.h"
+#include "istream.h"
+#include "sha1.h"
 #include "home-expand.h"
 #include "var-expand.h"
 #include "eacces-error.h"
@@ -19,8 +23,11 @@
 #include "lda-settings.h"
 
 #include "sieve.h"
+#include "sieve-settings.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
+#include "sieve-test-cache.h"
+#include "sieve-message.h"
 
 #include "lda-sieve-plugin.h"
 
@@ -35,12 +42,63 @@
 
 #define LDA_SIEVE_MAX_USER_ERRORS 30
 
+#define LDA_SIEVE_MAX_PENDING_SUBMISSIONS 16
+
 /*
  * Global variables
  */
 
 static deliver_mail_func_t *next_deliver_mail;
 
+/* Results of recipient-independent tests in global scripts and the parsed
+   message, shared by all recipients of the current delivery session (LMTP
+   transaction) */
+struct lda_sieve_transaction_cache {
+	struct mail_deliver_session *session;
+	unsigned char digest[SHA1_RESULTLEN];
+
+	struct sieve_test_cache *test_cache;
+	struct sieve_message_analysis *analysis;
+};
+
+static struct lda_sieve_transaction_cache lda_sieve_transaction_cache;
+
+/* Time spent on Sieve for all recipients of the current delivery session
+   (LMTP transaction). A reference to the session pool is held, so that a new
+   session cannot be allocated at the same address while this is in use. */
+struct lda_sieve_budget {
+	struct mail_deliver_session *session;
+	pool_t session_pool;
+
+	struct timeval start_time;
+	unsigned int cpu_time_msecs;
+
+	bool exhausted:1;
+};
+
+static struct lda_sieve_budget lda_sieve_budget;
+
+/* Messages submitted in the background (vacation responses, notifications)
+   while the scripts are executing. These run on a private ioloop and are
+   waited for once execution is finished. All messages sent for a delivery
+   share one submission session. */
+struct lda_sieve_smtp_queue {
+	struct smtp_submit_session *session;
+
+	struct ioloop *ioloop;
+	unsigned int pending;
+};
+
+struct lda_sieve_smtp_submission {
+	struct lda_sieve_smtp_queue *queue;
+	struct smtp_submit *submit;
+	struct event *event;
+	char *description;
+	struct timeval start_time;
+};
+
+static struct lda_sieve_smtp_queue lda_sieve_smtp_queue;
+
 /*
  * Settings handling
  */
@@ -81,13 +139,19 @@ lda_sieve_smtp_start(const struct sieve_script_env *senv,
 	struct mail_deliver_context *dctx =
 		(struct mail_deliver_context *)senv->script_context;
 	struct mail_user *user = dctx->rcpt_user;
-	struct smtp_submit_input submit_input;
+	struct lda_sieve_smtp_queue *queue = &lda_sieve_smtp_queue;
+
+	if (queue->session == NULL) {
+		struct smtp_submit_input submit_input;
 
-	i_zero(&submit_input);
-	submit_input.ssl = user->ssl_set;
+		i_zero(&submit_input);
+		submit_input.ssl = user->ssl_set;
 
-	return (void *)smtp_submit_init_simple(&submit_input, dctx->smtp_set,
-					       mail_from);
+		queue->session = smtp_submit_session_init(&submit_input,
+							  dctx->smtp_set);
+	}
+
+	return (void *)smtp_submit_init(queue->session, mail_from);
 }
 
 static void
@@ -129,6 +193,102 @@ lda_sieve_smtp_finish(const struct sieve_script_env *senv ATTR_UNUSED,
 	return ret;
 }
 
+static void
+lda_sieve_smtp_submitted(const struct smtp_submit_result *result,
+			 struct lda_sieve_smtp_submission *subm)
+{
+	struct lda_sieve_smtp_queue *queue = subm->queue;
+	struct event_passthrough *e;
+
+	i_assert(queue->pending > 0);
+	queue->pending--;
+
+	e = event_create_passthrough(subm->event)->
+		set_name("sieve_smtp_submitted")->
+		add_int("duration_msecs",
+			timeval_diff_msecs(&ioloop_timeval,
+					   &subm->start_time))->
+		add_int("pending", queue->pending);
+	if (result->status > 0) {
+		e_debug(e->event(), "Submitted %s", subm->description);
+	} else {
+		e->add_str("error", result->error);
+		e_error(e->event(), "Failed to submit %s: %s (%s failure)",
+			subm->description, result->error,
+			(result->status < 0 ? "temporary" : "permanent"));
+	}
+
+	smtp_submit_deinit(&subm->submit);
+	event_unref(&subm->event);
+	i_free(subm->description);
+	i_free(subm);
+
+	io_loop_stop(queue->ioloop);
+}
+
+static void
+lda_sieve_smtp_wait_pending(struct lda_sieve_smtp_queue *queue,
+			    unsigned int max_pending)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	if (queue->pending <= max_pending)
+		return;
+
+	io_loop_set_current(queue->ioloop);
+	while (queue->pending > max_pending)
+		io_loop_run(queue->ioloop);
+	io_loop_set_current(prev_ioloop);
+}
+
+static void
+lda_sieve_smtp_finish_async(const struct sieve_script_env *senv,
+			    void *handle, const char *description)
+{
+	struct mail_deliver_context *dctx =
+		(struct mail_deliver_context *)senv->script_context;
+	struct lda_sieve_smtp_queue *queue = &lda_sieve_smtp_queue;
+	struct smtp_submit *smtp_submit = (struct smtp_submit *) handle;
+	struct lda_sieve_smtp_submission *subm;
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	subm = i_new(struct lda_sieve_smtp_submission, 1);
+	subm->queue = queue;
+	subm->submit = smtp_submit;
+	subm->event = event_create(dctx->event);
+	subm->description = i_strdup(description);
+	subm->start_time = ioloop_timeval;
+
+	/* Start the submission on our own ioloop, so that it only makes
+	   progress while we are waiting for it */
+	if (queue->ioloop == NULL) {
+		queue->ioloop = io_loop_create();
+		io_loop_set_current(prev_ioloop);
+	}
+	lda_sieve_smtp_wait_pending(queue,
+				    LDA_SIEVE_MAX_PENDING_SUBMISSIONS - 1);
+
+	io_loop_set_current(queue->ioloop);
+	queue->pending++;
+	smtp_submit_run_async(smtp_submit, lda_sieve_smtp_submitted, subm);
+	io_loop_set_current(prev_ioloop);
+}
+
+static void lda_sieve_smtp_wait(void)
+{
+	struct lda_sieve_smtp_queue *queue = &lda_sieve_smtp_queue;
+
+	if (queue->ioloop != NULL) {
+		lda_sieve_smtp_wait_pending(queue, 0);
+		i_assert(queue->pending == 0);
+
+		io_loop_set_current(queue->ioloop);
+		io_loop_destroy(&queue->ioloop);
+	}
+	if (queue->session != NULL)
+		smtp_submit_session_deinit(&queue->session);
+}
+
 static int
 lda_sieve_reject_mail(const struct sieve_script_env *senv,
 		      const struct smtp_address *recipient,
@@ -244,7 +404,9 @@ struct lda_sieve_run_context {
 	struct sieve_script *discard_script;
 
 	const struct sieve_message_data *msgdata;
-	const struct sieve_script_env *scriptenv;
+	struct sieve_script_env *scriptenv;
+	struct sieve_test_cache *test_cache;
+	struct lda_sieve_budget *budget;
 
 	struct sieve_error_handler *user_ehandler;
 	struct sieve_error_handler *master_ehandler;
@@ -509,6 +671,162 @@ lda_sieve_handle_exec_status(struct lda_sieve_run_context *srctx,
 	return ret;
 }
 
+/*
+ * Transaction test cache
+ */
+
+static int
+lda_sieve_message_digest(struct mail *mail, unsigned char digest_r[])
+{
+	struct message_size hdr_size;
+	struct istream *input;
+	const unsigned char *data;
+	struct sha1_ctxt ctx;
+	uoff_t size, left;
+	size_t dsize;
+
+	if (mail_get_physical_size(mail, &size) < 0 ||
+	    mail_get_hdr_stream(mail, &hdr_size, &input) < 0)
+		return -1;
+
+	sha1_init(&ctx);
+	sha1_loop(&ctx, &size, sizeof(size));
+	left = hdr_size.physical_size;
+	while (left > 0 && i_stream_read_more(input, &data, &dsize) > 0) {
+		if (dsize > left)
+			dsize = left;
+		sha1_loop(&ctx, data, dsize);
+		i_stream_skip(input, dsize);
+		left -= dsize;
+	}
+	if (input->stream_errno != 0)
+		return -1;
+	sha1_result(&ctx, digest_r);
+	return 0;
+}
+
+static void
+lda_sieve_init_transaction_cache(struct lda_sieve_run_context *srctx)
+{
+	struct mail_deliver_context *mdctx = srctx->mdctx;
+	struct lda_sieve_transaction_cache *tcache =
+		&lda_sieve_transaction_cache;
+	unsigned char digest[SHA1_RESULTLEN];
+	bool use_test_cache, use_message_cache;
+
+	use_test_cache = mail_user_plugin_getenv_bool(
+		mdctx->rcpt_user, "sieve_transaction_test_cache");
+	use_message_cache = mail_user_plugin_getenv_bool(
+		mdctx->rcpt_user, "sieve_transaction_message_cache");
+	if (!use_test_cache && !use_message_cache)
+		return;
+	if (mdctx->session == NULL ||
+	    lda_sieve_message_digest(mdctx->src_mail, digest) < 0)
+		return;
+
+	/* The message is identified by both the session and its content, so
+	   that a session object reused at the same address for a different
+	   transaction is not mistaken for the previous one. */
+	if (tcache->session != mdctx->session ||
+	    memcmp(tcache->digest, digest, sizeof(digest)) != 0) {
+		if (tcache->test_cache != NULL || tcache->analysis != NULL) {
+			e_debug(sieve_get_event(srctx->svinst),
+				"Starting new transaction cache");
+		}
+		if (tcache->test_cache != NULL)
+			sieve_test_cache_clear(tcache->test_cache);
+		sieve_message_analysis_unref(&tcache->analysis);
+	}
+	tcache->session = mdctx->session;
+	memcpy(tcache->digest, digest, sizeof(digest));
+
+	if (use_test_cache) {
+		if (tcache->test_cache == NULL)
+			tcache->test_cache = sieve_test_cache_create();
+		srctx->test_cache = tcache->test_cache;
+	}
+	if (use_message_cache) {
+		if (tcache->analysis == NULL)
+			tcache->analysis = sieve_message_analysis_create();
+		srctx->scriptenv->message_analysis = tcache->analysis;
+	}
+}
+
+/*
+ * Transaction time budget
+ */
+
+static void lda_sieve_budget_free(struct lda_sieve_budget *budget)
+{
+	if (budget->session_pool != NULL)
+		pool_unref(&budget->session_pool);
+	i_zero(budget);
+}
+
+static struct lda_sieve_budget *
+lda_sieve_get_budget(struct lda_sieve_run_context *srctx)
+{
+	struct mail_deliver_context *mdctx = srctx->mdctx;
+	struct lda_sieve_budget *budget = &lda_sieve_budget;
+
+	if (mdctx->session == NULL)
+		return NULL;
+	if (budget->session != mdctx->session) {
+		lda_sieve_budget_free(budget);
+		budget->session = mdctx->session;
+		budget->session_pool = mdctx->session->pool;
+		pool_ref(budget->session_pool);
+		i_gettimeofday(&budget->start_time);
+	}
+	return budget;
+}
+
+static bool
+lda_sieve_budget_check(struct lda_sieve_run_context *srctx)
+{
+	struct sieve_instance *svinst = srctx->svinst;
+	struct lda_sieve_budget *budget = srctx->budget;
+	sieve_number_t max_cpu_time = 0, max_time = 0;
+	struct timeval now;
+	long long elapsed_msecs;
+
+	if (budget == NULL)
+		return TRUE;
+	if (budget->exhausted)
+		return FALSE;
+
+	(void)sieve_setting_get_duration_value(
+		svinst, "sieve_transaction_max_cpu_time", &max_cpu_time);
+	(void)sieve_setting_get_duration_value(
+		svinst, "sieve_transaction_max_time", &max_time);
+
+	/* Recipients are delivered one after the other without returning to
+	   the ioloop, so ioloop_timeval is not current here */
+	i_gettimeofday(&now);
+	elapsed_msecs = timeval_diff_msecs(&now, &budget->start_time);
+	if (max_cpu_time > 0 &&
+	    budget->cpu_time_msecs >= max_cpu_time * 1000) {
+		e_warning(sieve_get_event(svinst),
+			  "Sieve CPU time for this transaction exceeded "
+			  "sieve_transaction_max_cpu_time (%u ms used); "
+			  "skipping personal scripts for remaining recipients",
+			  budget->cpu_time_msecs);
+		budget->exhausted = TRUE;
+	} else if (max_time > 0 && elapsed_msecs >= (long long)max_time * 1000) {
+		e_warning(sieve_get_event(svinst),
+			  "Time spent on this transaction exceeded "
+			  "sieve_transaction_max_time (%lld ms elapsed); "
+			  "skipping personal scripts for remaining recipients",
+			  elapsed_msecs);
+		budget->exhausted = TRUE;
+	}
+	return !budget->exhausted;
+}
+
+/*
+ * Script execution
+ */
+
 static int
 lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 			 struct sieve_multiscript *mscript,
@@ -530,13 +848,32 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 
 	user_script = (script == srctx->user_script);
 
+	if (user_script && !lda_sieve_budget_check(srctx)) {
+		/* Leave the implicit keep in place and continue with the
+		   sieve_after scripts */
+		e_info(sieve_get_event(svinst),
+		       "Skipped personal script `%s': "
+		       "transaction time budget exceeded",
+		       sieve_script_location(script));
+		return 1;
+	}
+
 	sieve_resource_usage_init(rusage);
 	if (user_script) {
 		cpflags |= SIEVE_COMPILE_FLAG_NOGLOBAL;
 		exflags |= SIEVE_EXECUTE_FLAG_NOGLOBAL;
 		exec_ehandler = srctx->user_ehandler;
+		/* Personal scripts generated from a common template share the
+		   cached results through their identical code digest */
+		srctx->scriptenv->test_cache =
+			(mail_user_plugin_getenv_bool(
+				srctx->mdctx->rcpt_user,
+				"sieve_transaction_test_cache_personal") ?
+			 srctx->test_cache : NULL);
 	} else {
 		exec_ehandler = srctx->master_ehandler;
+		/* Global scripts are the same for all recipients */
+		srctx->scriptenv->test_cache = srctx->test_cache;
 	}
 
 	/* Open */
@@ -608,6 +945,8 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 
 	if (user_script)
 		(void)sieve_record_resource_usage(sbin, rusage);
+	if (srctx->budget != NULL)
+		srctx->budget->cpu_time_msecs += rusage->cpu_time_msecs;
 
 	sieve_close(&sbin);
 
@@ -893,8 +1232,12 @@ lda_sieve_init_trace_log(struct lda_sieve_run_context *srctx,
 
 	if (sieve_trace_config_get(svinst, trace_config_r) < 0 ||
 	    sieve_trace_log_open(svinst, &trace_log) < 0) {
-		i_zero(trace_config_r);
-		*trace_log_r = NULL;
+		/* Only keep a trace for slow scripts (if configured) */
+		if (sieve_trace_capture_open(svinst, trace_config_r,
+					     trace_log_r) < 0) {
+			i_zero(trace_config_r);
+			*trace_log_r = NULL;
+		}
 		return;
 	}
 
@@ -1006,6 +1349,7 @@ lda_sieve_execute(struct lda_sieve_run_context *srctx,
 	scriptenv.smtp_send = lda_sieve_smtp_send;
 	scriptenv.smtp_abort = lda_sieve_smtp_abort;
 	scriptenv.smtp_finish = lda_sieve_smtp_finish;
+	scriptenv.smtp_finish_async = lda_sieve_smtp_finish_async;
 	scriptenv.duplicate_transaction_begin =
 		lda_sieve_duplicate_transaction_begin;
 	scriptenv.duplicate_transaction_commit =
@@ -1024,11 +1368,17 @@ lda_sieve_execute(struct lda_sieve_run_context *srctx,
 	scriptenv.exec_status = &estatus;
 
 	srctx->scriptenv = &scriptenv;
+	lda_sieve_init_transaction_cache(srctx);
+	srctx->budget = lda_sieve_get_budget(srctx);
 
 	/* Execute script(s) */
 
 	ret = lda_sieve_execute_scripts(srctx);
 
+	/* Wait for background submissions */
+
+	lda_sieve_smtp_wait();
+
 	/* Record status */
 
 	mdctx->tried_default_save = estatus.tried_default_save;
@@ -1040,6 +1390,12 @@ lda_sieve_execute(struct lda_sieve_run_context *srctx,
 	return ret;
 }
 
+/* Called by the LDA/LMTP delivery code once for each recipient, one after the
+   other. Script evaluation cannot be moved to other threads: the Sieve
+   instance, the message context and the mail storage objects it reads from
+   are not thread-safe. Work that is the same for all recipients of a
+   transaction is shared through the transaction test cache instead (see
+   lda_sieve_init_transaction_cache()). */
 static int
 lda_sieve_deliver_mail(struct mail_deliver_context *mdctx,
 		       struct mail_storage **storage_r)
@@ -1119,4 +1475,9 @@ void sieve_plugin_deinit(void)
 {
 	/* Remove hook */
 	mail_deliver_hook_set(next_deliver_mail);
+
+	sieve_test_cache_free(&lda_sieve_transaction_cache.test_cache);
+	sieve_message_analysis_unref(&lda_sieve_transaction_cache.analysis);
+	lda_sieve_budget_free(&lda_sieve_budget);
+	sieve_caches_free();
 }
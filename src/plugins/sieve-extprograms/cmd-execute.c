@@ -309,6 +309,39 @@ cmd_execute_operation_dump(const struct sieve_dumptime_env *denv,
  * Code execution
  */
 
+/* The program runs asynchronously while the interpreter is suspended */
+struct cmd_execute_job {
+	struct sieve_extprogram *sprog;
+	buffer_t *inbuf, *outbuf;
+	struct sieve_interpreter *interp;
+
+	int ret;
+};
+
+static void cmd_execute_job_free(struct cmd_execute_job *job)
+{
+	if (job->sprog != NULL)
+		sieve_extprogram_destroy(&job->sprog);
+	if (job->inbuf != NULL)
+		buffer_free(&job->inbuf);
+	if (job->outbuf != NULL)
+		buffer_free(&job->outbuf);
+	i_free(job);
+}
+
+static void cmd_execute_job_abort(void *context)
+{
+	cmd_execute_job_free(context);
+}
+
+static void cmd_execute_job_callback(int ret, void *context)
+{
+	struct cmd_execute_job *job = context;
+
+	job->ret = ret;
+	sieve_interpreter_resume(job->interp);
+}
+
 static int
 cmd_execute_operation_execute(const struct sieve_runtime_env *renv,
 			      sieve_size_t *address)
@@ -328,6 +361,8 @@ cmd_execute_operation_execute(const struct sieve_runtime_env *renv,
 	enum sieve_error error = SIEVE_ERROR_NONE;
 	buffer_t *outbuf = NULL;
 	struct sieve_extprogram *sprog = NULL;
+	struct cmd_execute_job *job;
+	struct sieve_resource_usage rusage;
 	int ret;
 
 	/*
@@ -399,16 +434,30 @@ cmd_execute_operation_execute(const struct sieve_runtime_env *renv,
 			    "execute program `%s'",
 			    str_sanitize(program_name, 128));
 
-	sprog = sieve_extprogram_create(this_ext, eenv->scriptenv,
-					eenv->msgdata, "execute",
-					program_name, args, &error);
-	if (sprog != NULL) {
+	job = sieve_interpreter_get_suspended_context(renv->interp);
+	if (job != NULL) {
+		/* Resumed: program has finished */
+		ret = job->ret;
+		outbuf = job->outbuf;
+		job->outbuf = NULL;
+		cmd_execute_job_free(job);
+
+		sieve_resource_usage_init(&rusage);
+		rusage.program_runs = 1;
+		sieve_interpreter_add_resource_usage(renv->interp, &rusage);
+	} else if ((sprog = sieve_extprogram_create(
+			this_ext, eenv->scriptenv, eenv->msgdata, "execute",
+			program_name, args, &error)) != NULL) {
+		job = i_new(struct cmd_execute_job, 1);
+		job->interp = renv->interp;
+		job->sprog = sprog;
+
 		if (var_storage != NULL) {
 			// FIXME: limit output size
 			struct ostream *outdata;
 
-			outbuf = buffer_create_dynamic(default_pool, 1024);
-			outdata = o_stream_create_buffer(outbuf);
+			job->outbuf = buffer_create_dynamic(default_pool, 1024);
+			outdata = o_stream_create_buffer(job->outbuf);
 			sieve_extprogram_set_output(sprog, outdata);
 			o_stream_unref(&outdata);
 		}
@@ -417,26 +466,31 @@ cmd_execute_operation_execute(const struct sieve_runtime_env *renv,
 			struct mail *mail = sieve_message_get_mail(renv->msgctx);
 
 			if (sieve_extprogram_set_input_mail(sprog, mail) < 0) {
-				sieve_extprogram_destroy(&sprog);
-				if (outbuf != NULL)
-					buffer_free(&outbuf);
+				cmd_execute_job_free(job);
 				return sieve_runtime_mail_error(
 					renv, mail, "execute action: "
 					"failed to read input message");
 			}
-			ret = 1;
 		} else if (input != NULL) {
-			struct istream *indata =
-				i_stream_create_from_data(str_data(input),
-							  str_len(input));
+			struct istream *indata;
+
+			/* The input string lives on the data stack, which
+			   does not survive the suspension */
+			job->inbuf = buffer_create_dynamic(default_pool,
+							   str_len(input));
+			buffer_append_buf(job->inbuf, input, 0, SIZE_MAX);
+			indata = i_stream_create_from_data(job->inbuf->data,
+							   job->inbuf->used);
 			sieve_extprogram_set_input(sprog, indata);
 			i_stream_unref(&indata);
-			ret = 1;
 		}
 
-		if (ret >= 0)
-			ret = sieve_extprogram_run(sprog);
-		sieve_extprogram_destroy(&sprog);
+		/* Suspend first; the program may fail immediately */
+		sieve_interpreter_suspend(renv->interp, job,
+					  cmd_execute_job_abort);
+		sieve_extprogram_run_async(sprog, cmd_execute_job_callback,
+					   job);
+		return SIEVE_EXEC_OK;
 	} else {
 		ret = -1;
 	}
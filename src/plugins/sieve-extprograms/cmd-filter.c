@@ -140,6 +140,7 @@ cmd_filter_operation_execute(const struct sieve_runtime_env *renv,
 	const char *const *args = NULL;
 	struct istream *newmsg = NULL;
 	struct sieve_extprogram *sprog;
+	struct sieve_resource_usage rusage;
 	int ret;
 
 	/*
@@ -198,6 +199,10 @@ cmd_filter_operation_execute(const struct sieve_runtime_env *renv,
 		}
 		sieve_extprogram_set_output_seekable(sprog);
 		ret = sieve_extprogram_run(sprog);
+
+		sieve_resource_usage_init(&rusage);
+		rusage.program_runs = 1;
+		sieve_interpreter_add_resource_usage(renv->interp, &rusage);
 	} else {
 		ret = -1;
 	}
@@ -13,6 +13,7 @@
 #include "istream.h"
 #include "istream-crlf.h"
 #include "istream-header-filter.h"
+#include "message-size.h"
 #include "ostream.h"
 #include "mail-user.h"
 #include "mail-storage.h"
@@ -375,6 +376,9 @@ struct sieve_extprogram {
 	const struct sieve_script_env *scriptenv;
 	struct program_client_settings set;
 	struct program_client *program_client;
+
+	sieve_extprogram_callback_t *callback;
+	void *context;
 };
 
 void sieve_extprogram_exec_error
@@ -586,10 +590,15 @@ void sieve_extprogram_set_output
 	program_client_set_output(sprog->program_client, output);
 }
 
-void sieve_extprogram_set_input
-(struct sieve_extprogram *sprog, struct istream *input)
+static void
+sieve_extprogram_set_input_eol(struct sieve_extprogram *sprog,
+			       struct istream *input, bool convert)
 {
-	switch (sprog->ext_config->default_input_eol) {
+	if (!convert) {
+		/* Passed unwrapped, so that the program client can hand the
+		   (file) stream to the kernel without copying */
+		i_stream_ref(input);
+	} else switch (sprog->ext_config->default_input_eol) {
 	case SIEVE_EXTPROGRAMS_EOL_LF:
 		input = i_stream_create_lf(input);
 		break;
@@ -605,6 +614,12 @@ void sieve_extprogram_set_input
 	i_stream_unref(&input);
 }
 
+void sieve_extprogram_set_input
+(struct sieve_extprogram *sprog, struct istream *input)
+{
+	sieve_extprogram_set_input_eol(sprog, input, TRUE);
+}
+
 void sieve_extprogram_set_output_seekable
 (struct sieve_extprogram *sprog)
 {
@@ -624,18 +639,38 @@ struct istream *sieve_extprogram_get_output_seekable
 int sieve_extprogram_set_input_mail
 (struct sieve_extprogram *sprog, struct mail *mail)
 {
+	struct message_size hdr_size, body_size;
 	struct istream *input;
+	uoff_t physical_size, virtual_size, lines;
+	bool convert = TRUE;
 
-	if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+	if (mail_get_stream(mail, &hdr_size, &body_size, &input) < 0)
 		return -1;
 
-	sieve_extprogram_set_input(sprog, input);
+	/* The virtual size counts all line endings as CRLF, so the sizes show
+	   whether the message already has the configured line endings */
+	physical_size = hdr_size.physical_size + body_size.physical_size;
+	virtual_size = hdr_size.virtual_size + body_size.virtual_size;
+	lines = hdr_size.lines + body_size.lines;
+	switch (sprog->ext_config->default_input_eol) {
+	case SIEVE_EXTPROGRAMS_EOL_LF:
+		convert = (virtual_size != physical_size + lines);
+		break;
+	case SIEVE_EXTPROGRAMS_EOL_CRLF:
+		convert = (virtual_size != physical_size);
+		break;
+	default:
+		i_unreached();
+	}
+
+	sieve_extprogram_set_input_eol(sprog, input, convert);
 	return 1;
 }
 
-int sieve_extprogram_run(struct sieve_extprogram *sprog)
+static int
+sieve_extprogram_exit_status(enum program_client_exit_status status)
 {
-	switch (program_client_run(sprog->program_client)) {
+	switch (status) {
 	case PROGRAM_CLIENT_EXIT_STATUS_INTERNAL_FAILURE:
 		return -1;
 	case PROGRAM_CLIENT_EXIT_STATUS_FAILURE:
@@ -646,3 +681,26 @@ int sieve_extprogram_run(struct sieve_extprogram *sprog)
 	i_unreached();
 }
 
+int sieve_extprogram_run(struct sieve_extprogram *sprog)
+{
+	return sieve_extprogram_exit_status(
+		program_client_run(sprog->program_client));
+}
+
+static void
+sieve_extprogram_run_callback(enum program_client_exit_status status,
+			      struct sieve_extprogram *sprog)
+{
+	sprog->callback(sieve_extprogram_exit_status(status), sprog->context);
+}
+
+void sieve_extprogram_run_async(struct sieve_extprogram *sprog,
+				sieve_extprogram_callback_t *callback,
+				void *context)
+{
+	sprog->callback = callback;
+	sprog->context = context;
+	program_client_run_async(sprog->program_client,
+				 sieve_extprogram_run_callback, sprog);
+}
+
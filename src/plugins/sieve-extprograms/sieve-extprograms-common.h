@@ -104,4 +104,12 @@ int sieve_extprogram_set_input_mail
 
 int sieve_extprogram_run(struct sieve_extprogram *sprog);
 
+/* Runs the program from the ioloop; callback receives the same result
+   values as returned by sieve_extprogram_run() */
+typedef void sieve_extprogram_callback_t(int ret, void *context);
+
+void sieve_extprogram_run_async(struct sieve_extprogram *sprog,
+				sieve_extprogram_callback_t *callback,
+				void *context);
+
 #endif
@@ -0,0 +1,65 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "restrict-access.h"
+#include "settings.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "mail-storage-service.h"
+
+#include "sieve-eval-settings.h"
+#include "sieve-eval-user.h"
+#include "sieve-eval-client.h"
+
+static struct mail_storage_service_ctx *storage_service;
+
+static void client_connected(struct master_service_connection *conn)
+{
+	master_service_client_connection_accept(conn);
+	sieve_eval_client_create(conn->fd);
+}
+
+int main(int argc, char *argv[])
+{
+	/* All users are served by one long-running process, so the user's
+	   privileges are not assumed. The service needs to run as the
+	   (virtual) mail user that owns the scripts. */
+	enum mail_storage_service_flags storage_service_flags =
+		MAIL_STORAGE_SERVICE_FLAG_USERDB_LOOKUP |
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR;
+	const struct sieve_eval_settings *set;
+	const char *error;
+
+	master_service = master_service_init("sieve-eval", 0,
+					     &argc, &argv, "");
+	if (master_getopt(master_service) > 0)
+		return FATAL_DEFAULT;
+
+	if (master_service_settings_read_simple(master_service, &error) < 0)
+		i_fatal("%s", error);
+	if (settings_get(master_service_get_event(master_service),
+			 &sieve_eval_setting_parser_info, 0,
+			 &set, &error) < 0)
+		i_fatal("%s", error);
+
+	restrict_access_by_env(RESTRICT_ACCESS_FLAG_ALLOW_ROOT, NULL);
+	restrict_access_allow_coredumps(TRUE);
+
+	storage_service = mail_storage_service_init(master_service,
+						    storage_service_flags);
+	sieve_eval_users_init(storage_service,
+			      set->sieve_eval_max_cached_users);
+	sieve_eval_clients_init();
+	master_service_init_finish(master_service);
+
+	master_service_run(master_service, client_connected);
+
+	sieve_eval_clients_deinit();
+	sieve_eval_users_deinit();
+	mail_storage_service_deinit(&storage_service);
+	settings_free(set);
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -0,0 +1,312 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "strescape.h"
+#include "istream.h"
+#include "istream-unix.h"
+#include "ostream.h"
+#include "connection.h"
+#include "master-service.h"
+#include "smtp-address.h"
+#include "smtp-params.h"
+#include "mail-storage.h"
+
+#include "sieve.h"
+#include "mail-raw.h"
+
+#include "sieve-eval-user.h"
+#include "sieve-eval-client.h"
+
+#include <unistd.h>
+
+struct sieve_eval_client {
+	struct connection conn;
+};
+
+static struct connection_list *sieve_eval_clients = NULL;
+
+/*
+ * Script environment
+ */
+
+static void *
+duplicate_transaction_begin(const struct sieve_script_env *senv ATTR_UNUSED)
+{
+	return NULL;
+}
+
+static void duplicate_transaction_commit(void **_dup_trans ATTR_UNUSED)
+{
+}
+
+static void duplicate_transaction_rollback(void **_dup_trans ATTR_UNUSED)
+{
+}
+
+static int
+duplicate_check(void *_dup_trans ATTR_UNUSED,
+		const struct sieve_script_env *senv ATTR_UNUSED,
+		const void *id ATTR_UNUSED, size_t id_size ATTR_UNUSED)
+{
+	return 0;
+}
+
+static void
+duplicate_mark(void *_dup_trans ATTR_UNUSED,
+	       const struct sieve_script_env *senv ATTR_UNUSED,
+	       const void *id ATTR_UNUSED, size_t id_size ATTR_UNUSED,
+	       time_t time ATTR_UNUSED)
+{
+}
+
+static const char *sieve_eval_status_name(int ret)
+{
+	switch (ret) {
+	case SIEVE_EXEC_OK:
+		return "success";
+	case SIEVE_EXEC_RESOURCE_LIMIT:
+		return "resource-limit";
+	case SIEVE_EXEC_BIN_CORRUPT:
+		return "corrupt-binary";
+	case SIEVE_EXEC_FAILURE:
+		return "failure";
+	case SIEVE_EXEC_TEMP_FAILURE:
+		return "temporary-failure";
+	case SIEVE_EXEC_KEEP_FAILED:
+		return "keep-failed";
+	}
+	return "unknown";
+}
+
+/*
+ * Evaluation
+ */
+
+static int
+sieve_eval_parse_address(const char *str, bool allow_empty,
+			 const struct smtp_address **address_r,
+			 const char **error_r)
+{
+	struct smtp_address *address;
+	enum smtp_address_parse_flags flags =
+		SMTP_ADDRESS_PARSE_FLAG_BRACKETS_OPTIONAL;
+
+	if (allow_empty)
+		flags |= SMTP_ADDRESS_PARSE_FLAG_ALLOW_EMPTY;
+	if (smtp_address_parse_path(pool_datastack_create(), str, flags,
+				    &address, error_r) < 0)
+		return -1;
+	*address_r = address;
+	return 0;
+}
+
+static int
+sieve_eval_message(struct sieve_eval_user *user, const char *script_location,
+		   struct istream *input,
+		   const struct smtp_address *mail_from,
+		   const struct smtp_address *rcpt_to,
+		   const struct smtp_address *orig_rcpt_to,
+		   string_t *result, const char **status_r,
+		   const char **error_r)
+{
+	struct sieve_message_data msgdata;
+	struct sieve_script_env scriptenv;
+	struct sieve_exec_status estatus;
+	struct smtp_params_rcpt *rcpt_params;
+	struct sieve_error_handler *ehandler;
+	struct sieve_binary *sbin;
+	struct mail_raw *mailr;
+	struct ostream *output;
+	enum sieve_error error_code;
+	string_t *errors;
+	int ret;
+
+	errors = t_str_new(256);
+	ehandler = sieve_strbuf_ehandler_create(user->svinst, errors,
+						FALSE, 10);
+
+	sbin = sieve_eval_user_get_binary(user, script_location, ehandler,
+					  &error_code);
+	if (sbin == NULL) {
+		sieve_error_handler_unref(&ehandler);
+		*error_r = (str_len(errors) > 0 ? str_c(errors) :
+			    "Failed to open script");
+		return -1;
+	}
+
+	mailr = mail_raw_open_stream(user->raw_user, input);
+
+	i_zero(&msgdata);
+	msgdata.mail = mailr->mail;
+	msgdata.auth_user = user->username;
+	(void)mail_get_message_id(mailr->mail, &msgdata.id);
+	msgdata.envelope.mail_from = mail_from;
+	msgdata.envelope.rcpt_to = rcpt_to;
+	rcpt_params = t_new(struct smtp_params_rcpt, 1);
+	rcpt_params->orcpt.addr = orig_rcpt_to;
+	msgdata.envelope.rcpt_params = rcpt_params;
+
+	if (sieve_script_env_init(&scriptenv, user->mail_user, error_r) < 0) {
+		mail_raw_close(&mailr);
+		sieve_error_handler_unref(&ehandler);
+		return -1;
+	}
+	scriptenv.duplicate_transaction_begin = duplicate_transaction_begin;
+	scriptenv.duplicate_transaction_commit = duplicate_transaction_commit;
+	scriptenv.duplicate_transaction_rollback =
+		duplicate_transaction_rollback;
+	scriptenv.duplicate_mark = duplicate_mark;
+	scriptenv.duplicate_check = duplicate_check;
+	scriptenv.script_context = &msgdata;
+	i_zero(&estatus);
+	scriptenv.exec_status = &estatus;
+
+	output = o_stream_create_buffer(result);
+	ret = sieve_test(sbin, &msgdata, &scriptenv, ehandler, output, 0);
+	o_stream_destroy(&output);
+
+	mail_raw_close(&mailr);
+	sieve_error_handler_unref(&ehandler);
+
+	*status_r = sieve_eval_status_name(ret);
+	return 0;
+}
+
+static int
+sieve_eval_client_cmd_eval(struct sieve_eval_client *client,
+			   const char *const *args, const char **error_r)
+{
+	const struct smtp_address *mail_from, *rcpt_to, *orig_rcpt_to;
+	struct sieve_eval_user *user;
+	struct istream *input;
+	const char *status;
+	string_t *reply, *result;
+	int fd;
+
+	if (str_array_length(args) < 4) {
+		*error_r = "EVAL: Missing parameters";
+		return -1;
+	}
+	if (sieve_eval_parse_address(args[2], TRUE, &mail_from, error_r) < 0 ||
+	    sieve_eval_parse_address(args[3], FALSE, &rcpt_to, error_r) < 0)
+		return -1;
+	orig_rcpt_to = rcpt_to;
+	if (args[4] != NULL &&
+	    sieve_eval_parse_address(args[4], FALSE,
+				     &orig_rcpt_to, error_r) < 0)
+		return -1;
+
+	fd = i_stream_unix_get_read_fd(client->conn.input);
+	if (fd == -1) {
+		*error_r = "EVAL: Message file descriptor missing";
+		return -1;
+	}
+	i_stream_unix_set_read_fd(client->conn.input);
+
+	if (sieve_eval_user_get(args[0], &user, error_r) < 0) {
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	input = i_stream_create_fd_autoclose(&fd, IO_BLOCK_SIZE);
+	i_stream_set_name(input, "(message)");
+
+	result = t_str_new(1024);
+	if (sieve_eval_message(user, args[1], input, mail_from,
+			       rcpt_to, orig_rcpt_to, result,
+			       &status, error_r) < 0) {
+		i_stream_unref(&input);
+		return -1;
+	}
+	i_stream_unref(&input);
+
+	reply = t_str_new(128 + str_len(result));
+	str_append(reply, "OK\t");
+	str_append(reply, status);
+	str_append_c(reply, '\t');
+	str_append_tabescaped(reply, str_c(result));
+	str_append_c(reply, '\n');
+	o_stream_nsend(client->conn.output, str_data(reply), str_len(reply));
+	return 0;
+}
+
+/*
+ * Connection
+ */
+
+static int
+sieve_eval_client_input_args(struct connection *conn, const char *const *args)
+{
+	struct sieve_eval_client *client =
+		container_of(conn, struct sieve_eval_client, conn);
+	const char *error;
+	int ret;
+
+	if (args[0] == NULL) {
+		e_error(conn->event, "Empty command");
+		return -1;
+	}
+	if (strcmp(args[0], "EVAL") != 0) {
+		e_error(conn->event, "Unknown command: %s", args[0]);
+		return -1;
+	}
+
+	T_BEGIN {
+		ret = sieve_eval_client_cmd_eval(client, args + 1, &error);
+		if (ret < 0) {
+			e_debug(conn->event, "EVAL failed: %s", error);
+			o_stream_nsend_str(conn->output, t_strconcat(
+				"FAIL\t", str_tabescape(error), "\n", NULL));
+		}
+	} T_END;
+	return 1;
+}
+
+static void sieve_eval_client_destroy(struct connection *conn)
+{
+	struct sieve_eval_client *client =
+		container_of(conn, struct sieve_eval_client, conn);
+
+	connection_deinit(conn);
+	i_free(client);
+
+	master_service_client_connection_destroyed(master_service);
+}
+
+static const struct connection_settings sieve_eval_client_set = {
+	.service_name_in = "sieve-eval-client",
+	.service_name_out = "sieve-eval-server",
+	.major_version = SIEVE_EVAL_PROTOCOL_MAJOR_VERSION,
+	.minor_version = SIEVE_EVAL_PROTOCOL_MINOR_VERSION,
+	.input_max_size = SIZE_MAX,
+	.output_max_size = SIZE_MAX,
+	.client = FALSE,
+};
+
+static const struct connection_vfuncs sieve_eval_client_vfuncs = {
+	.destroy = sieve_eval_client_destroy,
+	.input_args = sieve_eval_client_input_args,
+};
+
+void sieve_eval_client_create(int fd)
+{
+	struct sieve_eval_client *client;
+
+	client = i_new(struct sieve_eval_client, 1);
+	connection_init_server(sieve_eval_clients, &client->conn,
+			       "sieve-eval", fd, fd);
+	i_stream_unix_set_read_fd(client->conn.input);
+}
+
+void sieve_eval_clients_init(void)
+{
+	sieve_eval_clients = connection_list_init(&sieve_eval_client_set,
+						  &sieve_eval_client_vfuncs);
+}
+
+void sieve_eval_clients_deinit(void)
+{
+	connection_list_deinit(&sieve_eval_clients);
+}
@@ -0,0 +1,23 @@
+#ifndef SIEVE_EVAL_CLIENT_H
+#define SIEVE_EVAL_CLIENT_H
+
+/* Protocol (tab-separated lines, after the usual VERSION handshake):
+
+   C: EVAL <username> <script location> <mail-from> <rcpt-to> [<orig-rcpt>]
+      (the message itself is passed as a file descriptor with this line)
+   S: OK <status> <result>
+   S: FAIL <error>
+
+   Evaluation happens in test mode: the result lists the actions the script
+   would perform without performing them. The status is one of the names
+   also used by sieve-test -B (e.g. "success", "failure"). */
+
+#define SIEVE_EVAL_PROTOCOL_MAJOR_VERSION 1
+#define SIEVE_EVAL_PROTOCOL_MINOR_VERSION 0
+
+void sieve_eval_client_create(int fd);
+
+void sieve_eval_clients_init(void);
+void sieve_eval_clients_deinit(void);
+
+#endif
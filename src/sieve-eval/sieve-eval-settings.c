@@ -0,0 +1,77 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "settings-parser.h"
+#include "service-settings.h"
+
+#include "sieve-eval-settings.h"
+
+#include <stddef.h>
+
+/* The service is meant to be long-running, so that the compiled binaries and
+   per-user Sieve instances it caches survive between requests. */
+struct service_settings sieve_eval_settings_service_settings = {
+	.name = "sieve-eval",
+	.protocol = "sieve",
+	.type = "",
+	.executable = "sieve-eval",
+	.user = "",
+	.group = "",
+	.privileged_group = "",
+	.extra_groups = "",
+	.chroot = "",
+
+	.drop_priv_before_exec = FALSE,
+
+	.process_min_avail = 0,
+	.process_limit = 0,
+	.client_limit = 1,
+	.service_count = 0,
+	.idle_kill = 0,
+	.vsz_limit = (uoff_t)-1,
+
+	.unix_listeners = ARRAY_INIT,
+	.fifo_listeners = ARRAY_INIT,
+	.inet_listeners = ARRAY_INIT
+};
+
+const struct setting_keyvalue sieve_eval_settings_service_settings_defaults[] = {
+	{ "unix_listener", "sieve-eval" },
+
+	{ "unix_listener/sieve-eval/path", "sieve-eval" },
+	{ "unix_listener/sieve-eval/mode", "0600" },
+
+	{ NULL, NULL }
+};
+
+#undef DEF
+#define DEF(type, name) \
+	SETTING_DEFINE_STRUCT_##type(#name, name, struct sieve_eval_settings)
+
+static struct setting_define sieve_eval_setting_defines[] = {
+	DEF(UINT, sieve_eval_max_cached_users),
+
+	SETTING_DEFINE_LIST_END
+};
+
+static struct sieve_eval_settings sieve_eval_default_settings = {
+	.sieve_eval_max_cached_users = 64,
+};
+
+const struct setting_parser_info sieve_eval_setting_parser_info = {
+	.name = "sieve_eval",
+
+	.defines = sieve_eval_setting_defines,
+	.defaults = &sieve_eval_default_settings,
+
+	.struct_size = sizeof(struct sieve_eval_settings),
+	.pool_offset1 = 1 + offsetof(struct sieve_eval_settings, pool),
+};
+
+const struct setting_parser_info *sieve_eval_settings_set_infos[] = {
+	&sieve_eval_setting_parser_info,
+	NULL
+};
+
+const char *sieve_eval_settings_version = DOVECOT_ABI_VERSION;
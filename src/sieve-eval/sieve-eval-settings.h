@@ -0,0 +1,14 @@
+#ifndef SIEVE_EVAL_SETTINGS_H
+#define SIEVE_EVAL_SETTINGS_H
+
+struct sieve_eval_settings {
+	pool_t pool;
+
+	/* Number of users for which the Sieve instance and compiled binaries
+	   are kept around between requests. */
+	unsigned int sieve_eval_max_cached_users;
+};
+
+extern const struct setting_parser_info sieve_eval_setting_parser_info;
+
+#endif
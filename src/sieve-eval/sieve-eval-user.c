@@ -0,0 +1,216 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+#include "hostpid.h"
+#include "mail-user.h"
+#include "mail-storage-service.h"
+
+#include "sieve.h"
+#include "sieve-binary.h"
+#include "mail-raw.h"
+
+#include "sieve-eval-user.h"
+
+static struct mail_storage_service_ctx *sieve_eval_storage_service;
+static unsigned int sieve_eval_max_cached_users;
+
+/* Most recently used user first */
+static struct sieve_eval_user *sieve_eval_users_head, *sieve_eval_users_tail;
+static unsigned int sieve_eval_users_count;
+
+/*
+ * Sieve engine callbacks
+ */
+
+static const char *sieve_eval_get_homedir(void *context)
+{
+	struct sieve_eval_user *user = context;
+
+	return user->home_dir;
+}
+
+static const char *
+sieve_eval_get_setting(void *context, const char *identifier)
+{
+	struct sieve_eval_user *user = context;
+
+	return mail_user_plugin_getenv(user->mail_user, identifier);
+}
+
+static const struct sieve_callbacks sieve_eval_callbacks = {
+	sieve_eval_get_homedir,
+	sieve_eval_get_setting
+};
+
+/*
+ * User cache
+ */
+
+static void sieve_eval_user_free(struct sieve_eval_user **_user)
+{
+	struct sieve_eval_user *user = *_user;
+	struct hash_iterate_context *hctx;
+	struct sieve_binary *sbin;
+	char *location;
+
+	*_user = NULL;
+
+	DLLIST2_REMOVE(&sieve_eval_users_head, &sieve_eval_users_tail, user);
+	i_assert(sieve_eval_users_count > 0);
+	sieve_eval_users_count--;
+
+	hctx = hash_table_iterate_init(user->binaries);
+	while (hash_table_iterate(hctx, user->binaries, &location, &sbin)) {
+		sieve_close(&sbin);
+		i_free(location);
+	}
+	hash_table_iterate_deinit(&hctx);
+	hash_table_destroy(&user->binaries);
+
+	sieve_deinit(&user->svinst);
+	mail_user_unref(&user->raw_user);
+	mail_user_unref(&user->mail_user);
+	i_free(user->home_dir);
+	i_free(user->username);
+	i_free(user);
+}
+
+static int
+sieve_eval_user_create(const char *username,
+		       struct sieve_eval_user **user_r, const char **error_r)
+{
+	struct mail_storage_service_input input;
+	struct sieve_environment svenv;
+	struct sieve_eval_user *user;
+	struct mail_user *mail_user;
+	const char *home_dir = NULL;
+
+	i_zero(&input);
+	input.service = "sieve-eval";
+	input.username = username;
+
+	if (mail_storage_service_lookup_next(sieve_eval_storage_service,
+					     &input, &mail_user, error_r) <= 0)
+		return -1;
+
+	user = i_new(struct sieve_eval_user, 1);
+	user->username = i_strdup(username);
+	user->mail_user = mail_user;
+	if (mail_user_get_home(mail_user, &home_dir) > 0)
+		user->home_dir = i_strdup(home_dir);
+	user->raw_user = mail_raw_user_create(mail_user);
+	hash_table_create(&user->binaries, default_pool, 0, str_hash, strcmp);
+
+	i_zero(&svenv);
+	svenv.username = user->username;
+	svenv.home_dir = user->home_dir;
+	svenv.hostname = my_hostdomain();
+	svenv.base_dir = mail_user->set->base_dir;
+	svenv.temp_dir = mail_user->set->mail_temp_dir;
+	svenv.event_parent = mail_user->event;
+	svenv.flags = SIEVE_FLAG_HOME_RELATIVE;
+	svenv.location = SIEVE_ENV_LOCATION_MS;
+	svenv.delivery_phase = SIEVE_DELIVERY_PHASE_POST;
+
+	user->svinst = sieve_init(&svenv, &sieve_eval_callbacks, user,
+				  mail_user->set->mail_debug);
+	if (user->svinst == NULL) {
+		*error_r = "Failed to initialize Sieve engine";
+		hash_table_destroy(&user->binaries);
+		mail_user_unref(&user->raw_user);
+		mail_user_unref(&user->mail_user);
+		i_free(user->home_dir);
+		i_free(user->username);
+		i_free(user);
+		return -1;
+	}
+
+	DLLIST2_PREPEND(&sieve_eval_users_head, &sieve_eval_users_tail, user);
+	sieve_eval_users_count++;
+
+	*user_r = user;
+	return 0;
+}
+
+int sieve_eval_user_get(const char *username,
+			struct sieve_eval_user **user_r, const char **error_r)
+{
+	struct sieve_eval_user *user;
+
+	for (user = sieve_eval_users_head; user != NULL; user = user->next) {
+		if (strcmp(user->username, username) == 0)
+			break;
+	}
+
+	if (user != NULL) {
+		/* Move to the front */
+		DLLIST2_REMOVE(&sieve_eval_users_head, &sieve_eval_users_tail,
+			       user);
+		DLLIST2_PREPEND(&sieve_eval_users_head, &sieve_eval_users_tail,
+				user);
+		*user_r = user;
+		return 0;
+	}
+
+	while (sieve_eval_users_count > 0 &&
+	       sieve_eval_users_count >= sieve_eval_max_cached_users) {
+		struct sieve_eval_user *lru_user = sieve_eval_users_tail;
+
+		sieve_eval_user_free(&lru_user);
+	}
+
+	return sieve_eval_user_create(username, user_r, error_r);
+}
+
+struct sieve_binary *
+sieve_eval_user_get_binary(struct sieve_eval_user *user,
+			   const char *script_location,
+			   struct sieve_error_handler *ehandler,
+			   enum sieve_error *error_r)
+{
+	struct sieve_binary *sbin;
+	char *location;
+
+	if (hash_table_lookup_full(user->binaries, script_location,
+				   &location, &sbin)) {
+		if (sieve_binary_up_to_date(sbin, 0))
+			return sbin;
+
+		/* Script changed; recompile */
+		hash_table_remove(user->binaries, script_location);
+		sieve_close(&sbin);
+		i_free(location);
+	}
+
+	sbin = sieve_open(user->svinst, script_location, NULL, ehandler,
+			  0, error_r);
+	if (sbin == NULL)
+		return NULL;
+	(void)sieve_save(sbin, FALSE, NULL);
+
+	hash_table_insert(user->binaries, i_strdup(script_location), sbin);
+	return sbin;
+}
+
+/*
+ * Initialization
+ */
+
+void sieve_eval_users_init(struct mail_storage_service_ctx *storage_service,
+			   unsigned int max_cached_users)
+{
+	sieve_eval_storage_service = storage_service;
+	sieve_eval_max_cached_users = I_MAX(max_cached_users, 1);
+}
+
+void sieve_eval_users_deinit(void)
+{
+	while (sieve_eval_users_head != NULL) {
+		struct sieve_eval_user *user = sieve_eval_users_head;
+
+		sieve_eval_user_free(&user);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef SIEVE_EVAL_USER_H
+#define SIEVE_EVAL_USER_H
+
+#include "hash.h"
+
+#include "sieve.h"
+
+struct mail_storage_service_ctx;
+
+struct sieve_eval_user {
+	struct sieve_eval_user *prev, *next;
+
+	char *username;
+	char *home_dir;
+	struct mail_user *mail_user;
+	struct mail_user *raw_user;
+
+	struct sieve_instance *svinst;
+	/* script location => compiled binary */
+	HASH_TABLE(char *, struct sieve_binary *) binaries;
+};
+
+void sieve_eval_users_init(struct mail_storage_service_ctx *storage_service,
+			   unsigned int max_cached_users);
+void sieve_eval_users_deinit(void);
+
+/* Returns the cached user, or looks it up and initializes the Sieve engine
+   for it. The least recently used user is dropped when the cache is full. */
+int sieve_eval_user_get(const char *username,
+			struct sieve_eval_user **user_r, const char **error_r);
+
+/* Returns the binary for the script, reusing the cached one as long as it is
+   still up-to-date with the script. The returned binary stays owned by the
+   user cache. */
+struct sieve_binary *
+sieve_eval_user_get_binary(struct sieve_eval_user *user,
+			   const char *script_location,
+			   struct sieve_error_handler *ehandler,
+			   enum sieve_error *error_r);
+
+#endif
@@ -0,0 +1,294 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "ostream.h"
+#include "time-util.h"
+#include "mail-storage.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "mail-storage-service.h"
+
+#include "sieve.h"
+#include "sieve-binary.h"
+#include "sieve-extensions.h"
+
+#include "sieve-tool.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sysexits.h>
+#include <sys/resource.h>
+
+/*
+ * Configuration
+ */
+
+#define SIEVE_BENCH_DEFAULT_ITERATIONS 1000
+
+/*
+ * Print help
+ */
+
+static void print_help(void)
+{
+	printf(
+"Usage: sieve-bench [-c <config-file>] [-C] [-D] [-m <default-mailbox>]\n"
+"                   [-n <iterations>] [-P <plugin>] [-x <extensions>]\n"
+"                   <script-file> <mail-file> [<mail-file> ...]\n"
+	);
+}
+
+/*
+ * Measurements
+ */
+
+struct sieve_bench_stats {
+	ARRAY(unsigned long long) usecs;
+	unsigned long long total_usecs;
+	unsigned int failures;
+};
+
+static int
+sieve_bench_usecs_cmp(const unsigned long long *u1,
+		      const unsigned long long *u2)
+{
+	if (*u1 < *u2)
+		return -1;
+	if (*u1 > *u2)
+		return 1;
+	return 0;
+}
+
+static unsigned long long
+sieve_bench_percentile(struct sieve_bench_stats *stats, unsigned int pct)
+{
+	const unsigned long long *usecs;
+	unsigned int count;
+
+	usecs = array_get(&stats->usecs, &count);
+	if (count == 0)
+		return 0;
+	return usecs[(count - 1) * pct / 100];
+}
+
+static void sieve_bench_stats_init(struct sieve_bench_stats *stats,
+				   unsigned int iterations)
+{
+	i_zero(stats);
+	i_array_init(&stats->usecs, iterations);
+}
+
+static void
+sieve_bench_stats_add(struct sieve_bench_stats *stats,
+		      const struct timeval *start, const struct timeval *end)
+{
+	unsigned long long usecs = timeval_diff_usecs(end, start);
+
+	array_append(&stats->usecs, &usecs, 1);
+	stats->total_usecs += usecs;
+}
+
+static void
+sieve_bench_stats_report(struct sieve_bench_stats *stats, const char *what,
+			 const char *name)
+{
+	unsigned int count = array_count(&stats->usecs);
+	struct rusage rusage;
+
+	array_sort(&stats->usecs, sieve_bench_usecs_cmp);
+
+	printf("%s %s: runs=%u failures=%u", what, name,
+	       count, stats->failures);
+	if (stats->total_usecs > 0) {
+		printf(" per_sec=%.1f",
+		       (double)count * 1000000 / stats->total_usecs);
+	}
+	printf(" p50=%lluus p99=%lluus max=%lluus",
+	       sieve_bench_percentile(stats, 50),
+	       sieve_bench_percentile(stats, 99),
+	       sieve_bench_percentile(stats, 100));
+	if (getrusage(RUSAGE_SELF, &rusage) == 0)
+		printf(" maxrss=%ldkB", rusage.ru_maxrss);
+	printf("\n");
+
+	array_free(&stats->usecs);
+}
+
+/*
+ * Benchmarks
+ */
+
+static void
+sieve_bench_compile(struct sieve_instance *svinst, const char *scriptfile,
+		    unsigned int iterations)
+{
+	struct sieve_bench_stats stats;
+	struct sieve_error_handler *ehandler;
+	struct timeval start, end;
+	unsigned int i;
+
+	ehandler = sieve_stderr_ehandler_create(svinst, 0);
+
+	sieve_bench_stats_init(&stats, iterations);
+	for (i = 0; i < iterations; i++) T_BEGIN {
+		struct sieve_binary *sbin;
+
+		i_gettimeofday(&start);
+		sbin = sieve_compile(svinst, scriptfile, NULL, ehandler,
+				     0, NULL);
+		i_gettimeofday(&end);
+
+		if (sbin == NULL)
+			stats.failures++;
+		else
+			sieve_close(&sbin);
+		sieve_bench_stats_add(&stats, &start, &end);
+	} T_END;
+
+	sieve_bench_stats_report(&stats, "compile", scriptfile);
+	sieve_error_handler_unref(&ehandler);
+}
+
+static void
+sieve_bench_test(struct sieve_tool *tool, struct sieve_binary *sbin,
+		 const char *mailbox, const char *mailfile,
+		 struct ostream *output, unsigned int iterations)
+{
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	struct sieve_bench_stats stats;
+	struct sieve_error_handler *ehandler;
+	struct timeval start, end;
+	const char *errstr;
+	unsigned int i;
+
+	ehandler = sieve_stderr_ehandler_create(svinst, 0);
+
+	sieve_bench_stats_init(&stats, iterations);
+	for (i = 0; i < iterations; i++) T_BEGIN {
+		struct sieve_message_data msgdata;
+		struct sieve_script_env scriptenv;
+		struct sieve_exec_status estatus;
+		struct mail *mail;
+		int ret;
+
+		/* Reopen the message each time, so that nothing is served from
+		   the previous run's parsed headers and body parts */
+		mail = sieve_tool_open_file_as_mail(tool, mailfile);
+
+		i_zero(&msgdata);
+		msgdata.mail = mail;
+		msgdata.auth_user = sieve_tool_get_username(tool);
+		(void)mail_get_message_id(mail, &msgdata.id);
+		sieve_tool_get_envelope_data(&msgdata, mail, NULL, NULL, NULL);
+
+		if (sieve_script_env_init(&scriptenv,
+					  sieve_tool_get_mail_user(tool),
+					  &errstr) < 0) {
+			i_fatal("Failed to initialize script execution: %s",
+				errstr);
+		}
+		scriptenv.default_mailbox = mailbox;
+		i_zero(&estatus);
+		scriptenv.exec_status = &estatus;
+
+		i_gettimeofday(&start);
+		ret = sieve_test(sbin, &msgdata, &scriptenv, ehandler,
+				 output, 0);
+		i_gettimeofday(&end);
+
+		if (ret != SIEVE_EXEC_OK)
+			stats.failures++;
+		sieve_bench_stats_add(&stats, &start, &end);
+	} T_END;
+
+	sieve_bench_stats_report(&stats, "test", mailfile);
+	sieve_error_handler_unref(&ehandler);
+}
+
+/*
+ * Tool implementation
+ */
+
+int main(int argc, char **argv)
+{
+	struct sieve_instance *svinst;
+	const char *scriptfile, *mailbox;
+	struct sieve_binary *sbin;
+	struct ostream *output;
+	unsigned int iterations = SIEVE_BENCH_DEFAULT_ITERATIONS;
+	bool bench_compile = FALSE;
+	int fd, c;
+
+	sieve_tool = sieve_tool_init("sieve-bench", &argc, &argv,
+				     "m:n:CDP:x:", FALSE);
+
+	/* Parse arguments */
+	mailbox = "INBOX";
+	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
+		switch (c) {
+		case 'm':
+			/* default mailbox (keep box) */
+			mailbox = optarg;
+			break;
+		case 'n':
+			/* number of runs */
+			if (str_to_uint(optarg, &iterations) < 0 ||
+			    iterations == 0)
+				i_fatal("Invalid -n parameter: %s", optarg);
+			break;
+		case 'C':
+			/* also benchmark compiling the script */
+			bench_compile = TRUE;
+			break;
+		default:
+			/* unrecognized option */
+			print_help();
+			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
+			break;
+		}
+	}
+
+	if (optind < argc)
+		scriptfile = argv[optind++];
+	else {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <script-file> argument");
+	}
+
+	if (optind >= argc) {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <mail-file> argument");
+	}
+
+	/* Finish tool initialization */
+	svinst = sieve_tool_init_finish(sieve_tool, TRUE, FALSE);
+
+	/* Compile once up front, reporting any errors */
+	sbin = sieve_tool_script_compile(svinst, scriptfile, NULL);
+
+	if (bench_compile)
+		sieve_bench_compile(svinst, scriptfile, iterations);
+
+	/* The test output is not of interest, only the time it takes to
+	   produce it */
+	fd = open("/dev/null", O_WRONLY);
+	if (fd == -1)
+		i_fatal("open(/dev/null) failed: %m");
+	output = o_stream_create_fd_autoclose(&fd, 0);
+	o_stream_set_no_error_handling(output, TRUE);
+
+	for (; optind < argc; optind++) {
+		sieve_bench_test(sieve_tool, sbin, mailbox, argv[optind],
+				 output, iterations);
+	}
+
+	o_stream_destroy(&output);
+	sieve_close(&sbin);
+
+	sieve_tool_deinit(&sieve_tool);
+	return EXIT_SUCCESS;
+}
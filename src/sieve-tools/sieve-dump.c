@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ostream.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "mail-storage-service.h"
@@ -27,8 +28,8 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-dump [-c <config-file>] [-D] [-h] [-P <plugin>] [-x <extensions>]\n"
-"                  <sieve-binary> [<out-file>]\n"
+"Usage: sieve-dump [-c <config-file>] [-D] [-h] [-P <plugin>] [-s]\n"
+"                  [-x <extensions>] <sieve-binary> [<out-file>]\n"
 	);
 }
 
@@ -41,11 +42,11 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	struct sieve_binary *sbin;
 	const char *binfile, *outfile;
-	bool hexdump = FALSE;
+	bool hexdump = FALSE, stats = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int c;
 
-	sieve_tool = sieve_tool_init("sieve-dump", &argc, &argv, "DhP:x:", FALSE);
+	sieve_tool = sieve_tool_init("sieve-dump", &argc, &argv, "DhP:sx:", FALSE);
 
 	outfile = NULL;
 
@@ -55,6 +56,10 @@ int main(int argc, char **argv)
 			/* produce hexdump */
 			hexdump = TRUE;
 			break;
+		case 's':
+			/* produce statistics */
+			stats = TRUE;
+			break;
 		default:
 			print_help();
 			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
@@ -81,7 +86,24 @@ int main(int argc, char **argv)
 
 	/* Dump binary */
 	sbin = sieve_load(svinst, binfile, NULL);
-	if ( sbin != NULL ) {
+	if ( sbin != NULL && stats ) {
+		struct ostream *stream;
+
+		if ( outfile == NULL )
+			outfile = "-";
+		stream = sieve_tool_open_output_stream(outfile);
+		if ( stream == NULL )
+			i_fatal("Failed to create stream for sieve statistics.");
+
+		sieve_dump_stats(sbin, stream);
+		if ( o_stream_finish(stream) < 0 ) {
+			i_fatal("write(%s) failed: %s", outfile,
+				o_stream_get_error(stream));
+		}
+		o_stream_destroy(&stream);
+
+		sieve_close(&sbin);
+	} else if ( sbin != NULL ) {
 		sieve_tool_dump_binary_to(sbin, outfile == NULL ? "-" : outfile, hexdump);
 
 		sieve_close(&sbin);
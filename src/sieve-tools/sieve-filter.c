@@ -7,11 +7,14 @@
 #include "env-util.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "write-full.h"
+#include "seq-range-array.h"
 #include "ostream.h"
 #include "array.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
+#include "imap-seqset.h"
 
 #include "sieve.h"
 #include "sieve-extensions.h"
@@ -34,11 +37,15 @@ static void print_help(void)
 	printf(
 "Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
 "                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
-"                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
+"                    [-r <uid-set>] [-R <state-file>] [-s <script-file>]\n"
+"                    [-u <user>] [-v] [-W] [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
 }
 
+/* Changes are committed after filtering this many messages */
+#define SIEVE_FILTER_CHECKPOINT_INTERVAL 1000
+
 enum sieve_filter_discard_action {
 	SIEVE_FILTER_DACT_KEEP,   /* Keep discarded messages in source folder */
 	SIEVE_FILTER_DACT_MOVE,   /* Move discarded messages to Trash folder */
@@ -54,6 +61,11 @@ struct sieve_filter_data {
 	struct sieve_binary *main_sbin;
 	struct sieve_error_handler *ehandler;
 
+	/* Only filter messages with these UIDs (if not NULL) */
+	const ARRAY_TYPE(seq_range) *uidset;
+	/* File recording the progress, for resuming an interrupted run */
+	const char *state_path;
+
 	bool execute:1;
 	bool source_write:1;
 	bool default_move:1;
@@ -285,77 +297,315 @@ mail_search_build_add_flags(struct mail_search_args *args,
 	args->args = arg;
 }
 
-static int
-filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+static struct mailbox_header_lookup_ctx *
+filter_mailbox_wanted_headers(const struct sieve_filter_data *sfdata,
+			      struct mailbox *src_box)
 {
-	struct sieve_filter_context sfctx;
-	struct mailbox *move_box = sfdata->move_mailbox;
-	struct sieve_error_handler *ehandler = sfdata->ehandler;
-	struct mail_search_args *search_args;
-	struct mailbox_transaction_context *t;
-	struct mail_search_context *search_ctx;
-	struct mail *mail;
-	int ret = 1;
+	/* Header fields read for each message by the tool itself */
+	static const char *const default_wanted_headers[] = {
+		"Message-ID", "Date", "Subject", "Return-Path", "Sender",
+		"From", "Envelope-To", "To",
+	};
+	ARRAY_TYPE(const_string) wanted_headers;
+	const char *const *names, *const *hdrp;
+	unsigned int count, i;
+
+	t_array_init(&wanted_headers, 16);
+	array_append(&wanted_headers, default_wanted_headers,
+		     N_ELEMENTS(default_wanted_headers));
+
+	/* Add the header fields tested by the script */
+	names = sieve_binary_get_message_headers(sfdata->main_sbin, &count);
+	for (i = 0; i < count; i++) {
+		bool found = FALSE;
+
+		array_foreach(&wanted_headers, hdrp) {
+			if (strcasecmp(*hdrp, names[i]) == 0) {
+				found = TRUE;
+				break;
+			}
+		}
+		if (!found)
+			array_append(&wanted_headers, &names[i], 1);
+	}
+	array_append_zero(&wanted_headers);
 
-	/* Sync source mailbox */
+	return mailbox_header_lookup_init(src_box,
+					  array_front(&wanted_headers));
+}
 
-	if (mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0) {
-		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+/*
+ * Checkpointing
+ */
+
+/* The state file records the UIDVALIDITY of the source mailbox and the first
+   UID that is not yet filtered, so that an interrupted run can be resumed. */
+
+static int
+filter_state_read(const struct sieve_filter_data *sfdata,
+		  uint32_t *uid_validity_r, uint32_t *next_uid_r)
+{
+	const char *path = sfdata->state_path;
+	const char *const *args;
+	char buf[64];
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		sieve_error(sfdata->ehandler, NULL,
+			    "open(%s) failed: %m", path);
 		return -1;
 	}
+	ret = read(fd, buf, sizeof(buf) - 1);
+	if (ret < 0) {
+		sieve_error(sfdata->ehandler, NULL,
+			    "read(%s) failed: %m", path);
+	}
+	i_close_fd(&fd);
+	if (ret < 0)
+		return -1;
+	buf[ret] = '\0';
+
+	args = t_strsplit_spaces(buf, " \n");
+	if (str_array_length(args) != 2 ||
+	    str_to_uint32(args[0], uid_validity_r) < 0 ||
+	    str_to_uint32(args[1], next_uid_r) < 0) {
+		sieve_error(sfdata->ehandler, NULL,
+			    "state file %s is corrupt", path);
+		return -1;
+	}
+	return 1;
+}
 
-	/* Initialize */
+static int
+filter_state_write(const struct sieve_filter_data *sfdata,
+		   uint32_t uid_validity, uint32_t next_uid)
+{
+	const char *path = sfdata->state_path;
+	const char *tmp_path = t_strconcat(path, ".tmp", NULL);
+	const char *data;
+	int fd, ret = 0;
 
-	i_zero(&sfctx);
-	sfctx.data = sfdata;
+	data = t_strdup_printf("%u %u\n", uid_validity, next_uid);
 
-	/* Create test stream */
-	if (!sfdata->execute) {
-		sfctx.teststream = o_stream_create_fd(1, 0);
-		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		sieve_error(sfdata->ehandler, NULL,
+			    "open(%s) failed: %m", tmp_path);
+		return -1;
 	}
+	if (write_full(fd, data, strlen(data)) < 0) {
+		sieve_error(sfdata->ehandler, NULL,
+			    "write(%s) failed: %m", tmp_path);
+		ret = -1;
+	} else if (fdatasync(fd) < 0) {
+		sieve_error(sfdata->ehandler, NULL,
+			    "fdatasync(%s) failed: %m", tmp_path);
+		ret = -1;
+	}
+	i_close_fd(&fd);
+
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		sieve_error(sfdata->ehandler, NULL,
+			    "rename(%s, %s) failed: %m", tmp_path, path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink_if_exists(tmp_path);
+	return ret;
+}
+
+/*
+ * Mailbox filtering
+ */
+
+/* Filters at most SIEVE_FILTER_CHECKPOINT_INTERVAL messages, beginning at
+   *next_uid and commits the result. Returns 1 when all messages are done, 0
+   when there are more and -1 upon error. */
+static int
+filter_mailbox_chunk(struct sieve_filter_context *sfctx,
+		     struct mailbox *src_box, uint32_t *next_uid)
+{
+	const struct sieve_filter_data *sfdata = sfctx->data;
+	struct mailbox *move_box = sfdata->move_mailbox;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	struct mail_search_args *search_args;
+	struct mail_search_arg *sarg;
+	struct mailbox_header_lookup_ctx *headers_ctx;
+	enum mail_fetch_field wanted_fields;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct sieve_store_batch *store_batch = NULL;
+	struct mail *mail;
+	const char *error;
+	unsigned int count = 0;
+	uint32_t last_uid = 0;
+	int ret = 1;
 
 	/* Start move mailbox transaction */
 
 	if (move_box != NULL) {
-		sfctx.move_trans = mailbox_transaction_begin(
+		sfctx->move_trans = mailbox_transaction_begin(
 			move_box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
 			"sieve_filter_data move_box");
 	}
 
-	/* Search non-deleted messages in the source folder */
+	/* Save messages filed into the same mailbox in one transaction */
+
+	if (sfdata->execute) {
+		store_batch = sieve_store_batch_create();
+		sfdata->senv->store_batch = store_batch;
+	}
+
+	/* Search non-deleted messages in the source folder, beginning at
+	   *next_uid */
 
 	search_args = mail_search_build_init();
 	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	if (sfdata->uidset != NULL) {
+		sarg = mail_search_build_add(search_args, SEARCH_UIDSET);
+		p_array_init(&sarg->value.seqset, search_args->pool,
+			     array_count(sfdata->uidset));
+		array_append_array(&sarg->value.seqset, sfdata->uidset);
+	}
+	sarg = mail_search_build_add(search_args, SEARCH_UIDSET);
+	p_array_init(&sarg->value.seqset, search_args->pool, 1);
+	seq_range_array_add_range(&sarg->value.seqset, *next_uid, (uint32_t)-1);
 
 	t = mailbox_transaction_begin(src_box, 0,
 				      "sieve_filter_data src_box");
-	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+
+	/* Have the storage fetch what the script needs for each message at
+	   once */
+	T_BEGIN {
+		headers_ctx = filter_mailbox_wanted_headers(sfdata, src_box);
+	} T_END;
+	wanted_fields = MAIL_FETCH_VIRTUAL_SIZE;
+	if ((sieve_binary_get_message_fields(sfdata->main_sbin) &
+	     SIEVE_MESSAGE_FIELD_SIZE) != 0)
+		wanted_fields |= MAIL_FETCH_PHYSICAL_SIZE;
+	search_ctx = mailbox_search_init(t, search_args, NULL,
+					 wanted_fields, headers_ctx);
+	mailbox_header_lookup_unref(&headers_ctx);
 	mail_search_args_unref(&search_args);
 
-	/* Iterate through all requested messages */
+	/* Iterate through the requested messages */
 
-	while (ret >= 0 && mailbox_search_next(search_ctx, &mail))
-		ret = filter_message(&sfctx, mail);
+	while (ret >= 0 && count < SIEVE_FILTER_CHECKPOINT_INTERVAL &&
+	       mailbox_search_next(search_ctx, &mail)) {
+		if (filter_message(sfctx, mail) < 0)
+			ret = -1;
+		last_uid = mail->uid;
+		count++;
+	}
+	if (ret > 0 && count == SIEVE_FILTER_CHECKPOINT_INTERVAL)
+		ret = 0;
 
 	/* Cleanup */
 
 	if (mailbox_search_deinit(&search_ctx) < 0)
 		ret = -1;
 
-	if (sfctx.move_trans != NULL) {
-		if (mailbox_transaction_commit(&sfctx.move_trans) < 0)
+	if (store_batch != NULL) {
+		sfdata->senv->store_batch = NULL;
+		if (sieve_store_batch_commit(&store_batch, &error) < 0) {
+			/* Keep the source messages that were not stored */
+			sieve_error(ehandler, NULL, "%s; "
+				    "source mailbox left unchanged", error);
+			if (sfctx->move_trans != NULL)
+				mailbox_transaction_rollback(&sfctx->move_trans);
+			mailbox_transaction_rollback(&t);
+			ret = -1;
+		}
+	}
+
+	if (sfctx->move_trans != NULL) {
+		if (mailbox_transaction_commit(&sfctx->move_trans) < 0)
 			ret = -1;
 	}
 
-	if (mailbox_transaction_commit(&t) < 0)
+	if (t != NULL && mailbox_transaction_commit(&t) < 0)
 		ret = -1;
 
+	if (ret >= 0 && last_uid > 0)
+		*next_uid = last_uid + 1;
+	return ret;
+}
+
+static int
+filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+{
+	struct sieve_filter_context sfctx;
+	struct sieve_error_handler *ehandler = sfdata->ehandler;
+	struct mailbox_status status;
+	uint32_t state_uid_validity, next_uid = 1;
+	bool checkpoint = (sfdata->execute && sfdata->state_path != NULL);
+	int ret;
+
+	/* Sync source mailbox */
+
+	if (mailbox_sync(src_box, MAILBOX_SYNC_FLAG_FULL_READ) < 0) {
+		sieve_error(ehandler, NULL, "failed to sync source mailbox");
+		return -1;
+	}
+	mailbox_get_open_status(src_box, STATUS_UIDVALIDITY, &status);
+
+	/* Resume an interrupted run */
+
+	if (checkpoint) {
+		ret = filter_state_read(sfdata, &state_uid_validity,
+					&next_uid);
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			next_uid = 1;
+		} else if (state_uid_validity != status.uidvalidity) {
+			sieve_warning(ehandler, NULL,
+				      "UIDVALIDITY of source mailbox changed "
+				      "since last run; starting from the "
+				      "beginning");
+			next_uid = 1;
+		} else {
+			sieve_info(ehandler, NULL,
+				   "resuming at UID %u", next_uid);
+		}
+	}
+
+	/* Initialize */
+
+	i_zero(&sfctx);
+	sfctx.data = sfdata;
+
+	/* Create test stream */
+	if (!sfdata->execute) {
+		sfctx.teststream = o_stream_create_fd(1, 0);
+		o_stream_set_no_error_handling(sfctx.teststream, TRUE);
+	}
+
+	/* Filter the messages in chunks, committing the changes for each of
+	   these. This bounds the size of the transactions and allows resuming
+	   from the last checkpoint. */
+
+	do {
+		ret = filter_mailbox_chunk(&sfctx, src_box, &next_uid);
+		if (ret == 0 && checkpoint &&
+		    filter_state_write(sfdata, status.uidvalidity,
+				       next_uid) < 0)
+			ret = -1;
+	} while (ret == 0);
+
 	if (sfctx.teststream != NULL)
 		o_stream_destroy(&sfctx.teststream);
 
 	if (ret < 0) return ret;
 
+	/* Finished; a rerun starts from the beginning */
+	if (checkpoint)
+		i_unlink_if_exists(sfdata->state_path);
+
 	/* Sync mailbox */
 
 	if (sfdata->execute) {
@@ -377,6 +627,7 @@ int main(int argc, char **argv)
 {
 	struct sieve_instance *svinst;
 	ARRAY_TYPE(const_string) scriptfiles;
+	ARRAY_TYPE(seq_range) uidset;
 	const char *scriptfile,	*src_mailbox, *dst_mailbox, *move_mailbox;
 	struct sieve_filter_data sfdata;
 	enum sieve_filter_discard_action discard_action =
@@ -386,6 +637,8 @@ int main(int argc, char **argv)
 	struct sieve_script_env scriptenv;
 	struct sieve_error_handler *ehandler;
 	bool force_compile, execute, source_write, verbose, default_move;
+	const char *state_path = NULL;
+	bool have_uidset = FALSE;
 	struct mail_namespace *ns;
 	struct mailbox *src_box = NULL, *move_box = NULL;
 	enum mailbox_flags open_flags = MAILBOX_FLAG_IGNORE_ACLS;
@@ -394,9 +647,10 @@ int main(int argc, char **argv)
 	int c;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-				     "m:s:x:P:u:q:Q:DCevW", FALSE);
+				     "m:s:x:P:u:q:Q:r:R:DCevW", FALSE);
 
 	t_array_init(&scriptfiles, 16);
+	t_array_init(&uidset, 16);
 
 	/* Parse arguments */
 	dst_mailbox = move_mailbox = NULL;
@@ -432,6 +686,21 @@ int main(int argc, char **argv)
 				EX_USAGE,
 				"The -Q argument is currently NOT IMPLEMENTED");
 			break;
+		case 'r':
+			/* only filter messages in this UID range; allows
+			   splitting up a large mailbox among several
+			   concurrent sieve-filter runs */
+			if (imap_seq_set_parse(optarg, &uidset) < 0) {
+				i_fatal_status(EX_USAGE,
+					       "Invalid -r <uid-set> argument");
+			}
+			have_uidset = TRUE;
+			break;
+		case 'R':
+			/* record progress in this file and resume from
+			   there */
+			state_path = optarg;
+			break;
 		case 'e':
 			/* execution mode */
 			execute = TRUE;
@@ -589,6 +858,9 @@ int main(int argc, char **argv)
 	sfdata.execute = execute;
 	sfdata.source_write = source_write;
 	sfdata.default_move = default_move;
+	if (have_uidset)
+		sfdata.uidset = &uidset;
+	sfdata.state_path = state_path;
 
 	/* Apply Sieve filter to all messages found */
 	(void)filter_mailbox(&sfdata, src_box);
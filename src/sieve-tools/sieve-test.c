@@ -6,8 +6,11 @@
 #include "ioloop.h"
 #include "env-util.h"
 #include "str.h"
+#include "istream.h"
 #include "ostream.h"
 #include "array.h"
+#include "time-util.h"
+#include "json-parser.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "master-service.h"
@@ -24,6 +27,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <sysexits.h>
 
 
@@ -40,13 +45,17 @@
 static void print_help(void)
 {
 	printf(
-"Usage: sieve-test [-a <orig-recipient-address] [-c <config-file>]\n"
+"Usage: sieve-test [-a <orig-recipient-address] [-B] [-c <config-file>]\n"
 "                  [-C] [-D] [-d <dump-filename>] [-e]\n"
 "                  [-f <envelope-sender>] [-l <mail-location>]\n"
 "                  [-m <default-mailbox>] [-P <plugin>]\n"
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
+"\n"
+"With -B, <mail-file> is a directory of message files or an mbox file. The\n"
+"script is tested against each message and the outcome is printed as one\n"
+"JSON object per line.\n"
 	);
 }
 
@@ -162,6 +171,232 @@ result_amend_log_message(const struct sieve_script_env *senv,
 	return str_c(str);
 }
 
+/*
+ * Batch mode
+ */
+
+struct sieve_test_batch {
+	struct sieve_tool *tool;
+	struct sieve_binary *sbin;
+	struct sieve_error_handler *ehandler;
+
+	const char *mailbox;
+	const struct smtp_address *mail_from, *rcpt_to, *final_rcpt_to;
+	struct sieve_trace_log *trace_log;
+	struct sieve_trace_config trace_config;
+
+	buffer_t *result;
+	unsigned int failures;
+};
+
+static const char *sieve_test_status_name(int ret)
+{
+	switch (ret) {
+	case SIEVE_EXEC_OK:
+		return "success";
+	case SIEVE_EXEC_RESOURCE_LIMIT:
+		return "resource-limit";
+	case SIEVE_EXEC_BIN_CORRUPT:
+		return "corrupt-binary";
+	case SIEVE_EXEC_FAILURE:
+		return "failure";
+	case SIEVE_EXEC_TEMP_FAILURE:
+		return "temporary-failure";
+	case SIEVE_EXEC_KEEP_FAILED:
+		return "keep-failed";
+	}
+	return "unknown";
+}
+
+static void
+sieve_test_batch_message(struct sieve_test_batch *batch, const char *name,
+			 struct mail *mail)
+{
+	struct sieve_message_data msgdata;
+	struct sieve_script_env scriptenv;
+	struct sieve_exec_status estatus;
+	struct ostream *output;
+	struct timeval start, end;
+	const char *errstr;
+	string_t *line;
+	int ret;
+
+	i_zero(&msgdata);
+	msgdata.mail = mail;
+	msgdata.auth_user = sieve_tool_get_username(batch->tool);
+	(void)mail_get_message_id(mail, &msgdata.id);
+	sieve_tool_get_envelope_data(&msgdata, mail, batch->mail_from,
+				     batch->rcpt_to, batch->final_rcpt_to);
+
+	if (sieve_script_env_init(&scriptenv,
+				  sieve_tool_get_mail_user(batch->tool),
+				  &errstr) < 0) {
+		i_fatal("Failed to initialize script execution: %s",
+			errstr);
+	}
+	scriptenv.default_mailbox = batch->mailbox;
+	scriptenv.duplicate_transaction_begin = duplicate_transaction_begin;
+	scriptenv.duplicate_transaction_commit = duplicate_transaction_commit;
+	scriptenv.duplicate_transaction_rollback =
+		duplicate_transaction_rollback;
+	scriptenv.duplicate_mark = duplicate_mark;
+	scriptenv.duplicate_check = duplicate_check;
+	scriptenv.result_amend_log_message = result_amend_log_message;
+	scriptenv.trace_log = batch->trace_log;
+	scriptenv.trace_config = batch->trace_config;
+	scriptenv.script_context = &msgdata;
+	i_zero(&estatus);
+	scriptenv.exec_status = &estatus;
+
+	buffer_set_used_size(batch->result, 0);
+	output = o_stream_create_buffer(batch->result);
+
+	i_gettimeofday(&start);
+	ret = sieve_test(batch->sbin, &msgdata, &scriptenv, batch->ehandler,
+			 output, 0);
+	i_gettimeofday(&end);
+
+	o_stream_destroy(&output);
+	if (ret != SIEVE_EXEC_OK)
+		batch->failures++;
+
+	line = t_str_new(256 + batch->result->used);
+	str_append(line, "{\"message\":\"");
+	json_append_escaped(line, name);
+	str_append(line, "\",\"msgid\":");
+	if (msgdata.id == NULL)
+		str_append(line, "null");
+	else {
+		str_append_c(line, '"');
+		json_append_escaped(line, msgdata.id);
+		str_append_c(line, '"');
+	}
+	str_printfa(line, ",\"status\":\"%s\",\"usecs\":%lld,\"result\":\"",
+		    sieve_test_status_name(ret),
+		    timeval_diff_usecs(&end, &start));
+	json_append_escaped(line, str_c(batch->result));
+	str_append(line, "\"}\n");
+
+	fwrite(str_data(line), 1, str_len(line), stdout);
+}
+
+static void
+sieve_test_batch_file(struct sieve_test_batch *batch, const char *path)
+{
+	T_BEGIN {
+		struct mail *mail;
+
+		mail = sieve_tool_open_file_as_mail(batch->tool, path);
+		sieve_test_batch_message(batch, path, mail);
+	} T_END;
+}
+
+static void
+sieve_test_batch_data(struct sieve_test_batch *batch, const char *path,
+		      unsigned int seq, string_t *data)
+{
+	T_BEGIN {
+		struct mail *mail;
+
+		mail = sieve_tool_open_data_as_mail(batch->tool, data);
+		sieve_test_batch_message(
+			batch, t_strdup_printf("%s:%u", path, seq), mail);
+	} T_END;
+}
+
+static void
+sieve_test_batch_mbox(struct sieve_test_batch *batch, const char *path)
+{
+	struct istream *input;
+	string_t *data;
+	const char *line;
+	unsigned int seq = 0;
+	bool separator = TRUE;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	data = str_new(default_pool, 8192);
+
+	/* Messages are separated by "From " lines following an empty line (or
+	   at the start of the file) */
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (separator && str_begins_with(line, "From ")) {
+			if (seq > 0)
+				sieve_test_batch_data(batch, path, seq, data);
+			str_truncate(data, 0);
+			seq++;
+			separator = FALSE;
+			continue;
+		}
+		separator = (*line == '\0');
+
+		str_append(data, line);
+		str_append_c(data, '\n');
+	}
+	if (input->stream_errno != 0) {
+		i_fatal("read(%s) failed: %s",
+			path, i_stream_get_error(input));
+	}
+	if (seq > 0)
+		sieve_test_batch_data(batch, path, seq, data);
+
+	str_free(&data);
+	i_stream_unref(&input);
+}
+
+static void
+sieve_test_batch_dir(struct sieve_test_batch *batch, const char *path)
+{
+	ARRAY_TYPE(const_string) files;
+	const char *const *fnames;
+	unsigned int count, i;
+	struct dirent *dp;
+	struct stat st;
+	DIR *dirp;
+
+	dirp = opendir(path);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", path);
+
+	t_array_init(&files, 256);
+	while ((dp = readdir(dirp)) != NULL) {
+		const char *file;
+
+		if (dp->d_name[0] == '.')
+			continue;
+		file = t_strconcat(path, "/", dp->d_name, NULL);
+		if (stat(file, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		array_append(&files, &file, 1);
+	}
+	if (closedir(dirp) < 0)
+		i_error("closedir(%s) failed: %m", path);
+
+	/* Test in a stable order */
+	array_sort(&files, i_strcmp_p);
+
+	fnames = array_get(&files, &count);
+	for (i = 0; i < count; i++)
+		sieve_test_batch_file(batch, fnames[i]);
+}
+
+static int
+sieve_test_batch_run(struct sieve_test_batch *batch, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+
+	batch->result = buffer_create_dynamic(default_pool, 1024);
+	if (S_ISDIR(st.st_mode))
+		sieve_test_batch_dir(batch, path);
+	else
+		sieve_test_batch_mbox(batch, path);
+	buffer_free(&batch->result);
+
+	return (batch->failures > 0 ? -1 : 0);
+}
+
 /*
  * Tool implementation
  */
@@ -183,12 +418,12 @@ int main(int argc, char **argv)
 	struct sieve_error_handler *ehandler;
 	struct ostream *teststream = NULL;
 	struct sieve_trace_log *trace_log = NULL;
-	bool force_compile = FALSE, execute = FALSE;
+	bool force_compile = FALSE, execute = FALSE, batch = FALSE;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init("sieve-test", &argc, &argv,
-				     "r:a:f:m:d:l:s:eCt:T:DP:x:u:", FALSE);
+				     "r:a:f:m:d:l:s:eBCt:T:DP:x:u:", FALSE);
 
 	ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
@@ -256,6 +491,10 @@ int main(int argc, char **argv)
 		case 'e':
 			execute = TRUE;
 			break;
+			/* batch mode */
+		case 'B':
+			batch = TRUE;
+			break;
 			/* force script compile */
 		case 'C':
 			force_compile = TRUE;
@@ -287,6 +526,12 @@ int main(int argc, char **argv)
 		i_fatal_status(EX_USAGE, "Unknown argument: %s", argv[optind]);
 	}
 
+	if (batch && (execute || array_count(&scriptfiles) > 0)) {
+		print_help();
+		i_fatal_status(EX_USAGE,
+			       "The -B option cannot be combined with -e or -s");
+	}
+
 	/* Finish tool initialization */
 	svinst = sieve_tool_init_finish(sieve_tool, mailloc == NULL, FALSE);
 
@@ -309,6 +554,38 @@ int main(int argc, char **argv)
 
 	if (main_sbin == NULL) {
 		exit_status = EXIT_FAILURE;
+	} else if (batch) {
+		struct sieve_test_batch tbatch;
+
+		sieve_tool_dump_binary_to(main_sbin, dumpfile, FALSE);
+
+		if (mailloc != NULL)
+			sieve_tool_init_mail_user(sieve_tool, mailloc);
+		if (tracefile != NULL) {
+			(void)sieve_trace_log_create(
+				svinst, (strcmp(tracefile, "-") == 0 ?
+					 NULL : tracefile), &trace_log);
+		}
+
+		/* The binary and the raw mail user are shared by all
+		   messages */
+		i_zero(&tbatch);
+		tbatch.tool = sieve_tool;
+		tbatch.sbin = main_sbin;
+		tbatch.ehandler = ehandler;
+		tbatch.mailbox = (mailbox == NULL ? "INBOX" : mailbox);
+		tbatch.mail_from = mail_from;
+		tbatch.rcpt_to = rcpt_to;
+		tbatch.final_rcpt_to = final_rcpt_to;
+		tbatch.trace_log = trace_log;
+		tbatch.trace_config = trace_config;
+
+		if (sieve_test_batch_run(&tbatch, mailfile) < 0)
+			exit_status = EXIT_FAILURE;
+
+		if (trace_log != NULL)
+			sieve_trace_log_free(&trace_log);
+		sieve_close(&main_sbin);
 	} else {
 		/* Dump script */
 		sieve_tool_dump_binary_to(main_sbin, dumpfile, FALSE);
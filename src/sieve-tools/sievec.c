@@ -3,6 +3,9 @@
 
 #include "lib.h"
 #include "array.h"
+#include "istream.h"
+#include "time-util.h"
+#include "write-full.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "mail-storage-service.h"
@@ -11,6 +14,7 @@
 #include "sieve.h"
 #include "sieve-extensions.h"
 #include "sieve-script.h"
+#include "sieve-error.h"
 #include "sieve-tool.h"
 
 #include <stdio.h>
@@ -21,6 +25,7 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <sysexits.h>
+#include <sys/wait.h>
 
 /*
  * Print help
@@ -30,10 +35,224 @@ static void print_help(void)
 {
 	printf(
 "Usage: sievec  [-c <config-file>] [-d] [-D] [-P <plugin>] [-x <extensions>] \n"
-"              <script-file> [<out-file>]\n"
+"              [-p <profile-file>] <script-file> [<out-file>]\n"
+"       sievec  [-c <config-file>] [-D] [-P <plugin>] [-x <extensions>] \n"
+"              [-j <workers>] [-l <list-file>] [<script-location> ...]\n"
 	);
 }
 
+/*
+ * Bulk compilation
+ */
+
+/* In bulk mode, a list of script locations (e.g. those of all users) is
+   compiled by a number of worker processes. Binaries that are still up-to-date
+   are left alone, so this can be used to recompile all stale binaries after an
+   upgrade before deliveries resume. */
+
+struct sievec_bulk_stats {
+	unsigned int compiled;
+	unsigned int up_to_date;
+	unsigned int failed;
+};
+
+static void sievec_bulk_add_directory
+(ARRAY_TYPE(const_string) *locations, const char *path)
+{
+	DIR *dirp;
+	struct dirent *dp;
+
+	if ( (dirp = opendir(path)) == NULL )
+		i_fatal("opendir(%s) failed: %m", path);
+
+	for (;;) {
+		const char *file;
+
+		errno = 0;
+		if ( (dp = readdir(dirp)) == NULL ) {
+			if ( errno != 0 )
+				i_fatal("readdir(%s) failed: %m", path);
+			break;
+		}
+		if ( !sieve_script_file_has_extension(dp->d_name) )
+			continue;
+
+		if ( path[strlen(path)-1] == '/' )
+			file = t_strconcat(path, dp->d_name, NULL);
+		else
+			file = t_strconcat(path, "/", dp->d_name, NULL);
+		array_append(locations, &file, 1);
+	}
+
+	if ( closedir(dirp) < 0 )
+		i_fatal("closedir(%s) failed: %m", path);
+}
+
+static void sievec_bulk_add
+(ARRAY_TYPE(const_string) *locations, const char *location)
+{
+	struct stat st;
+
+	if ( stat(location, &st) == 0 && S_ISDIR(st.st_mode) )
+		sievec_bulk_add_directory(locations, location);
+	else
+		array_append(locations, &location, 1);
+}
+
+static void sievec_bulk_read_list
+(ARRAY_TYPE(const_string) *locations, const char *list_file)
+{
+	struct istream *input;
+	const char *line;
+	int fd;
+
+	if ( strcmp(list_file, "-") == 0 )
+		fd = 0;
+	else if ( (fd = open(list_file, O_RDONLY)) < 0 )
+		i_fatal("open(%s) failed: %m", list_file);
+
+	input = i_stream_create_fd(fd, 1024);
+	while ( (line = i_stream_read_next_line(input)) != NULL ) {
+		if ( *line == '\0' || *line == '#' )
+			continue;
+		sievec_bulk_add(locations, t_strdup(line));
+	}
+	if ( input->stream_errno != 0 ) {
+		i_fatal("read(%s) failed: %s", list_file,
+			i_stream_get_error(input));
+	}
+	i_stream_destroy(&input);
+
+	if ( fd != 0 && close(fd) < 0 )
+		i_error("close(%s) failed: %m", list_file);
+}
+
+static void sievec_bulk_compile
+(struct sieve_instance *svinst, const char *const *locations,
+	unsigned int count, unsigned int worker, unsigned int workers,
+	struct sievec_bulk_stats *stats)
+{
+	struct sieve_error_handler *ehandler;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	unsigned int i;
+
+	ehandler = sieve_stderr_ehandler_create(svinst, 0);
+	sieve_error_handler_accept_infolog(ehandler, TRUE);
+	sieve_error_handler_accept_debuglog(ehandler, svinst->debug);
+
+	for ( i = worker; i < count; i += workers ) {
+		sbin = sieve_open(svinst, locations[i], NULL, ehandler,
+			0, &error);
+		if ( sbin == NULL ) {
+			i_error("failed to compile sieve script `%s'",
+				locations[i]);
+			stats->failed++;
+			continue;
+		}
+
+		if ( sieve_is_loaded(sbin) )
+			stats->up_to_date++;
+		else if ( sieve_save(sbin, FALSE, &error) < 0 ) {
+			i_error("failed to save binary for sieve script `%s'",
+				locations[i]);
+			stats->failed++;
+		} else {
+			stats->compiled++;
+		}
+		sieve_close(&sbin);
+	}
+
+	sieve_error_handler_unref(&ehandler);
+}
+
+static int sievec_bulk
+(struct sieve_instance *svinst, const ARRAY_TYPE(const_string) *locations,
+	unsigned int workers)
+{
+	struct sievec_bulk_stats stats, wstats;
+	const char *const *locs;
+	struct timeval start, end;
+	unsigned int count, i, running = 0, processed;
+	long long msecs;
+	int fd[2], status;
+	pid_t pid;
+
+	locs = array_get(locations, &count);
+	if ( workers > count )
+		workers = I_MAX(count, 1);
+
+	i_zero(&stats);
+	i_gettimeofday(&start);
+
+	if ( workers == 1 ) {
+		sievec_bulk_compile(svinst, locs, count, 0, 1, &stats);
+	} else {
+		/* Each worker reports its counts through the pipe */
+		if ( pipe(fd) < 0 )
+			i_fatal("pipe() failed: %m");
+
+		for ( i = 0; i < workers; i++ ) {
+			if ( (pid = fork()) < 0 ) {
+				i_error("fork() failed: %m");
+				break;
+			}
+			if ( pid == 0 ) {
+				i_close_fd(&fd[0]);
+				i_zero(&wstats);
+				sievec_bulk_compile(svinst, locs, count,
+					i, workers, &wstats);
+				if ( write_full(fd[1], &wstats, sizeof(wstats)) < 0 )
+					i_error("write(pipe) failed: %m");
+				i_close_fd(&fd[1]);
+				sieve_tool_deinit(&sieve_tool);
+				exit(wstats.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+			}
+			running++;
+		}
+		i_close_fd(&fd[1]);
+
+		for ( i = 0; i < running; i++ ) {
+			if ( read(fd[0], &wstats, sizeof(wstats)) !=
+				(ssize_t)sizeof(wstats) ) {
+				i_error("worker exited without reporting results");
+				continue;
+			}
+			stats.compiled += wstats.compiled;
+			stats.up_to_date += wstats.up_to_date;
+			stats.failed += wstats.failed;
+		}
+		i_close_fd(&fd[0]);
+
+		while ( running > 0 ) {
+			if ( wait(&status) < 0 ) {
+				if ( errno == EINTR )
+					continue;
+				i_error("wait() failed: %m");
+				break;
+			}
+			running--;
+		}
+
+		/* Locations of workers that could not be started or that did
+		   not finish count as failed */
+		processed = stats.compiled + stats.up_to_date + stats.failed;
+		if ( processed < count )
+			stats.failed += count - processed;
+	}
+
+	i_gettimeofday(&end);
+	msecs = timeval_diff_msecs(&end, &start);
+
+	printf("%u scripts: %u compiled, %u up-to-date, %u failed "
+		"in %lld.%03lld s (%u workers, %.1f scripts/s)\n",
+		count, stats.compiled, stats.up_to_date, stats.failed,
+		msecs / 1000, msecs % 1000, workers,
+		(msecs > 0 ? count * 1000.0 / msecs : (double)count));
+
+	return ( stats.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
 /*
  * Tool implementation
  */
@@ -44,11 +263,13 @@ int main(int argc, char **argv)
 	struct stat st;
 	struct sieve_binary *sbin;
 	bool dump = FALSE;
-	const char *scriptfile, *outfile;
+	const char *scriptfile, *outfile, *list_file = NULL;
+	const char *profile_file = NULL, *error;
+	unsigned int workers = 0;
 	int exit_status = EXIT_SUCCESS;
 	int c;
 
-	sieve_tool = sieve_tool_init("sievec", &argc, &argv, "DdP:x:u:", FALSE);
+	sieve_tool = sieve_tool_init("sievec", &argc, &argv, "DdP:x:u:j:l:p:", FALSE);
 
 	outfile = NULL;
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -57,6 +278,22 @@ int main(int argc, char **argv)
 			/* dump file */
 			dump = TRUE;
 			break;
+		case 'j':
+			/* number of worker processes */
+			if ( str_to_uint(optarg, &workers) < 0 || workers == 0 ) {
+				print_help();
+				i_fatal_status(EX_USAGE,
+					"Invalid number of workers: %s", optarg);
+			}
+			break;
+		case 'l':
+			/* file listing script locations */
+			list_file = optarg;
+			break;
+		case 'p':
+			/* execution profile of the script */
+			profile_file = optarg;
+			break;
 		default:
 			print_help();
 			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
@@ -64,6 +301,33 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if ( workers > 0 || list_file != NULL ) {
+		ARRAY_TYPE(const_string) locations;
+
+		/* Bulk compilation */
+		if ( dump )
+			i_fatal_status(EX_USAGE,
+				"the -d option is not allowed for bulk compilation.");
+		if ( profile_file != NULL )
+			i_fatal_status(EX_USAGE,
+				"the -p option is not allowed for bulk compilation.");
+
+		svinst = sieve_tool_init_finish(sieve_tool, FALSE, TRUE);
+		sieve_enable_debug_extension(svinst);
+
+		t_array_init(&locations, 256);
+		if ( list_file != NULL )
+			sievec_bulk_read_list(&locations, list_file);
+		for ( ; optind < argc; optind++ )
+			sievec_bulk_add(&locations, argv[optind]);
+
+		exit_status = sievec_bulk(svinst, &locations,
+			( workers == 0 ? 1 : workers ));
+
+		sieve_tool_deinit(&sieve_tool);
+		return exit_status;
+	}
+
 	if ( optind < argc ) {
 		scriptfile = argv[optind++];
 	} else {
@@ -82,6 +346,15 @@ int main(int argc, char **argv)
 	/* Enable debug extension */
 	sieve_enable_debug_extension(svinst);
 
+	/* The profile refers to the lines of a single script */
+	if ( profile_file != NULL ) {
+		if ( stat(scriptfile, &st) == 0 && S_ISDIR(st.st_mode) )
+			i_fatal_status(EX_USAGE,
+				"the -p option is not allowed when scriptfile is a directory.");
+		if ( sieve_set_optimizer_profile(svinst, profile_file, &error) < 0 )
+			i_fatal("failed to read profile: %s", error);
+	}
+
 	if ( stat(scriptfile, &st) == 0 && S_ISDIR(st.st_mode) ) {
 		/* Script directory */
 		DIR *dirp;
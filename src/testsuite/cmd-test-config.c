@@ -388,6 +388,7 @@ cmd_test_config_set_operation_execute(const struct sieve_runtime_env *renv,
 	}
 
 	testsuite_setting_set(str_c(setting), str_c(value));
+	sieve_settings_cache_clear(renv->exec_env->svinst);
 
 	return SIEVE_EXEC_OK;
 }
@@ -421,6 +422,7 @@ cmd_test_config_unset_operation_execute(const struct sieve_runtime_env *renv,
 	}
 
 	testsuite_setting_unset(str_c(setting));
+	sieve_settings_cache_clear(renv->exec_env->svinst);
 
 	return SIEVE_EXEC_OK;
 }
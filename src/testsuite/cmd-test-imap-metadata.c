@@ -9,6 +9,7 @@
 #include "sieve-code.h"
 #include "sieve-binary.h"
 #include "sieve-dump.h"
+#include "sieve-message.h"
 
 #include "testsuite-common.h"
 #include "testsuite-mailstore.h"
@@ -216,7 +217,9 @@ static bool cmd_test_imap_metadata_operation_dump
 static int cmd_test_imap_metadata_operation_execute
 (const struct sieve_runtime_env *renv, sieve_size_t *address)
 {
+	const struct sieve_execute_env *eenv = renv->exec_env;
 	const struct sieve_operation *oprtn = renv->oprtn;
+	const struct sieve_extension *ext;
 	int opt_code = 0;
 	string_t *mailbox = NULL, *annotation = NULL, *value = NULL;
 	int ret;
@@ -278,6 +281,14 @@ static int cmd_test_imap_metadata_operation_execute
 			(( mailbox == NULL ? NULL : str_c(mailbox) ),
 				str_c(annotation), str_c(value)) < 0)
 			return SIEVE_EXEC_FAILURE;
+
+		/* Drop annotations cached by the metadata extensions */
+		ext = sieve_extension_get_by_name(eenv->svinst, "mboxmetadata");
+		if ( ext != NULL )
+			sieve_message_context_extension_set(renv->msgctx, ext, NULL);
+		ext = sieve_extension_get_by_name(eenv->svinst, "servermetadata");
+		if ( ext != NULL )
+			sieve_message_context_extension_set(renv->msgctx, ext, NULL);
 	}
 
 	return SIEVE_EXEC_OK;
@@ -308,10 +308,28 @@ bool testsuite_testcase_result(bool expect_failure)
 
 static char *testsuite_tmp_dir;
 
-static void testsuite_tmp_dir_init(void)
+/* Memory-backed file system used for the temporary directory when requested;
+   this keeps the test mail store off the disk. */
+#define TESTSUITE_MEMORY_TMP_DIR "/dev/shm"
+
+static void testsuite_tmp_dir_init(bool memory_store)
 {
-	testsuite_tmp_dir = i_strdup_printf("/tmp/dsieve-testsuite.%s.%s",
-					    dec2str(time(NULL)),
+	const char *parent = "/tmp";
+	struct stat st;
+
+	if (memory_store) {
+		if (stat(TESTSUITE_MEMORY_TMP_DIR, &st) == 0 &&
+		    S_ISDIR(st.st_mode))
+			parent = TESTSUITE_MEMORY_TMP_DIR;
+		else {
+			i_warning("%s is not available; "
+				  "keeping the mail store in %s",
+				  TESTSUITE_MEMORY_TMP_DIR, parent);
+		}
+	}
+
+	testsuite_tmp_dir = i_strdup_printf("%s/dsieve-testsuite.%s.%s",
+					    parent, dec2str(time(NULL)),
 					    dec2str(getpid()));
 
 	if (mkdir(testsuite_tmp_dir, 0700) < 0) {
@@ -342,13 +360,13 @@ const char *testsuite_tmp_dir_get(void)
  */
 
 void testsuite_init(struct sieve_instance *svinst, const char *test_path,
-		    bool log_stdout)
+		    bool log_stdout, bool memory_store)
 {
 	testsuite_sieve_instance = svinst;
 
 	testsuite_test_context_init();
 	testsuite_log_init(log_stdout);
-	testsuite_tmp_dir_init();
+	testsuite_tmp_dir_init(memory_store);
 
 	testsuite_script_init();
 	testsuite_binary_init();
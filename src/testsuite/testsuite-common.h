@@ -187,7 +187,7 @@ const char *testsuite_tmp_dir_get(void);
  */
 
 void testsuite_init(struct sieve_instance *svinst, const char *test_path,
-		    bool log_stdout);
+		    bool log_stdout, bool memory_store);
 void testsuite_deinit(void);
 
 #endif
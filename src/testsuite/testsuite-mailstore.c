@@ -116,6 +116,10 @@ void testsuite_mailstore_init(void)
 	mail_set->mail_attribute_dict = p_strconcat(
 		mail_user->pool, "file:",
 		testsuite_mailstore_attrs, NULL);
+	/* The mail store is discarded at the end of the test, so there is no
+	   point in paying for durability */
+	mail_set->mail_fsync = "never";
+	mail_set->parsed_fsync_mode = FSYNC_MODE_NEVER;
 	ns->mail_set = mail_set;
 
 	if (mail_storage_create(ns, "maildir", 0, &error) < 0)
@@ -8,6 +8,8 @@
 #include "ostream.h"
 #include "hostpid.h"
 #include "path-util.h"
+#include "strnum.h"
+#include "time-util.h"
 
 #include "sieve.h"
 #include "sieve-extensions.h"
@@ -30,6 +32,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 
 const struct sieve_script_env *testsuite_scriptenv;
@@ -47,13 +50,21 @@ const struct sieve_script_env *testsuite_scriptenv;
 static void print_help(void)
 {
 	printf(
-"Usage: testsuite [-D] [-E] [-F] [-d <dump-filename>]\n"
+"Usage: testsuite [-D] [-E] [-F] [-M] [-d <dump-filename>] [-j <jobs>]\n"
 "                 [-t <trace-filename>] [-T <trace-option>]\n"
 "                 [-P <plugin>] [-x <extensions>]\n"
-"                 <scriptfile>\n"
+"                 <scriptfile> [<scriptfile> ...]\n"
 	);
 }
 
+struct testsuite_options {
+	const char *dumpfile, *tracefile;
+	struct sieve_trace_config trace_config;
+	bool log_stdout:1;
+	bool expect_failure:1;
+	bool memory_store:1;
+};
+
 static int
 testsuite_run(struct sieve_binary *sbin, struct sieve_error_handler *ehandler)
 {
@@ -77,60 +88,15 @@ testsuite_run(struct sieve_binary *sbin, struct sieve_error_handler *ehandler)
 	return ret;
 }
 
-int main(int argc, char **argv)
+static int
+testsuite_run_file(const char *scriptfile,
+		   const struct testsuite_options *opts)
 {
 	struct sieve_instance *svinst;
-	const char *abspath, *scriptfile, *dumpfile, *tracefile;
-	struct sieve_trace_config trace_config;
+	const char *abspath;
 	struct sieve_binary *sbin;
 	const char *sieve_dir, *cwd, *error;
-	bool log_stdout = FALSE, expect_failure = FALSE;
-	int ret, c;
-
-	sieve_tool = sieve_tool_init("testsuite", &argc, &argv,
-				     "d:t:T:EFDP:", TRUE);
-
-	/* Parse arguments */
-	dumpfile = tracefile = NULL;
-	i_zero(&trace_config);
-	trace_config.level = SIEVE_TRLVL_ACTIONS;
-	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
-		switch (c) {
-		case 'd':
-			/* destination address */
-			dumpfile = optarg;
-			break;
-		case 't':
-			/* trace file */
-			tracefile = optarg;
-			break;
-		case 'T':
-			sieve_tool_parse_trace_option(&trace_config, optarg);
-			break;
-		case 'E':
-			log_stdout = TRUE;
-			break;
-		case 'F':
-			expect_failure = TRUE;
-			break;
-		default:
-			print_help();
-			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
-			break;
-		}
-	}
-
-	if (optind < argc) {
-		scriptfile = t_strdup(argv[optind++]);
-	} else {
-		print_help();
-		i_fatal_status(EX_USAGE, "Missing <scriptfile> argument");
-	}
-
-	if (optind != argc) {
-		print_help();
-		i_fatal_status(EX_USAGE, "Unknown argument: %s", argv[optind]);
-	}
+	int ret;
 
 	// FIXME: very very ugly
 	master_service_parse_option(
@@ -164,7 +130,7 @@ int main(int argc, char **argv)
 
 	/* Finish testsuite initialization */
 	svinst = sieve_tool_init_finish(sieve_tool, FALSE, FALSE);
-	testsuite_init(svinst, sieve_dir, log_stdout);
+	testsuite_init(svinst, sieve_dir, opts->log_stdout, opts->memory_store);
 
 	printf("Test case: %s:\n\n", scriptfile);
 
@@ -177,12 +143,12 @@ int main(int argc, char **argv)
 		struct sieve_script_env scriptenv;
 
 		/* Dump script */
-		sieve_tool_dump_binary_to(sbin, dumpfile, FALSE);
+		sieve_tool_dump_binary_to(sbin, opts->dumpfile, FALSE);
 
-		if (tracefile != NULL) {
+		if (opts->tracefile != NULL) {
 			(void)sieve_trace_log_create(
-				svinst, (strcmp(tracefile, "-") == 0 ?
-					 NULL : tracefile), &trace_log);
+				svinst, (strcmp(opts->tracefile, "-") == 0 ?
+					 NULL : opts->tracefile), &trace_log);
 		}
 
 		testsuite_mailstore_init();
@@ -204,7 +170,7 @@ int main(int argc, char **argv)
 		scriptenv.smtp_abort = testsuite_smtp_abort;
 		scriptenv.smtp_finish = testsuite_smtp_finish;
 		scriptenv.trace_log = trace_log;
-		scriptenv.trace_config = trace_config;
+		scriptenv.trace_config = opts->trace_config;
 		scriptenv.exec_status = &exec_status;
 
 		testsuite_scriptenv = &scriptenv;
@@ -254,8 +220,220 @@ int main(int argc, char **argv)
 
 	sieve_tool_deinit(&sieve_tool);
 
-	if (!testsuite_testcase_result(expect_failure))
+	if (!testsuite_testcase_result(opts->expect_failure))
 		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
 }
+
+/*
+ * Parallel execution
+ */
+
+struct testsuite_job {
+	const char *scriptfile;
+	pid_t pid;
+	FILE *output;
+	struct timeval start;
+	long long usecs;
+	bool failed;
+};
+
+static int
+testsuite_job_cmp_usecs(const struct testsuite_job *job1,
+			const struct testsuite_job *job2)
+{
+	if (job1->usecs == job2->usecs)
+		return 0;
+	return (job1->usecs > job2->usecs ? -1 : 1);
+}
+
+static void
+testsuite_job_start(struct testsuite_job *job,
+		    const struct testsuite_options *opts)
+{
+	job->output = tmpfile();
+	if (job->output == NULL)
+		i_fatal("tmpfile() failed: %m");
+
+	/* Make sure buffered output is not written twice */
+	fflush(stdout);
+	fflush(stderr);
+
+	i_gettimeofday(&job->start);
+	job->pid = fork();
+	if (job->pid < 0)
+		i_fatal("fork() failed: %m");
+	if (job->pid == 0) {
+		/* Collect all output of the test case, so that it is not
+		   interleaved with that of the others */
+		if (dup2(fileno(job->output), STDOUT_FILENO) < 0 ||
+		    dup2(fileno(job->output), STDERR_FILENO) < 0)
+			i_fatal("dup2() failed: %m");
+		exit(testsuite_run_file(job->scriptfile, opts));
+	}
+}
+
+static void testsuite_job_finish(struct testsuite_job *job, int status)
+{
+	struct timeval end;
+	char buf[IO_BLOCK_SIZE];
+	size_t size;
+
+	i_gettimeofday(&end);
+	job->usecs = timeval_diff_usecs(&end, &job->start);
+	job->failed = (!WIFEXITED(status) ||
+		       WEXITSTATUS(status) != EXIT_SUCCESS);
+
+	rewind(job->output);
+	while ((size = fread(buf, 1, sizeof(buf), job->output)) > 0)
+		fwrite(buf, 1, size, stdout);
+	if (fclose(job->output) < 0)
+		i_error("fclose(tmpfile) failed: %m");
+	job->output = NULL;
+
+	printf("Test case: %s: %s (%lld.%03lld ms)\n\n", job->scriptfile,
+	       (job->failed ? "FAILED" : "finished"),
+	       job->usecs / 1000, job->usecs % 1000);
+	fflush(stdout);
+}
+
+static int
+testsuite_run_parallel(const char *const *scriptfiles, unsigned int count,
+		       unsigned int max_jobs,
+		       const struct testsuite_options *opts)
+{
+	ARRAY(struct testsuite_job) jobs_arr;
+	struct testsuite_job *jobs, *job;
+	unsigned int next = 0, running = 0, failed = 0, i;
+	long long total_usecs = 0;
+	pid_t pid;
+	int status;
+
+	t_array_init(&jobs_arr, count);
+	for (i = 0; i < count; i++) {
+		job = array_append_space(&jobs_arr);
+		job->scriptfile = scriptfiles[i];
+	}
+	jobs = array_idx_modifiable(&jobs_arr, 0);
+
+	while (next < count || running > 0) {
+		while (running < max_jobs && next < count) {
+			testsuite_job_start(&jobs[next++], opts);
+			running++;
+		}
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			i_fatal("waitpid() failed: %m");
+		}
+		for (i = 0; i < next; i++) {
+			if (jobs[i].pid == pid)
+				break;
+		}
+		if (i == next)
+			continue;
+
+		testsuite_job_finish(&jobs[i], status);
+		jobs[i].pid = 0;
+		running--;
+
+		total_usecs += jobs[i].usecs;
+		if (jobs[i].failed)
+			failed++;
+	}
+
+	/* Report timing of all test cases, slowest first */
+	array_sort(&jobs_arr, testsuite_job_cmp_usecs);
+	printf("Test case timing:\n");
+	array_foreach_modifiable(&jobs_arr, job) {
+		printf("%10lld.%03lld ms  %s%s\n",
+		       job->usecs / 1000, job->usecs % 1000,
+		       job->scriptfile, (job->failed ? " (FAILED)" : ""));
+	}
+	printf("\n%u test cases, %u failed, %lld.%03lld ms total "
+	       "(%u parallel jobs)\n", count, failed,
+	       total_usecs / 1000, total_usecs % 1000, max_jobs);
+
+	return (failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Tool implementation
+ */
+
+int main(int argc, char **argv)
+{
+	struct testsuite_options opts;
+	unsigned int max_jobs = 1;
+	int ret, c;
+
+	sieve_tool = sieve_tool_init("testsuite", &argc, &argv,
+				     "d:j:t:T:EFMDP:", TRUE);
+
+	/* Parse arguments */
+	i_zero(&opts);
+	opts.trace_config.level = SIEVE_TRLVL_ACTIONS;
+	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
+		switch (c) {
+		case 'd':
+			/* destination address */
+			opts.dumpfile = optarg;
+			break;
+		case 'j':
+			/* number of parallel test cases */
+			if (str_to_uint(optarg, &max_jobs) < 0 ||
+			    max_jobs == 0) {
+				print_help();
+				i_fatal_status(EX_USAGE,
+					"Invalid number of jobs: %s", optarg);
+			}
+			break;
+		case 't':
+			/* trace file */
+			opts.tracefile = optarg;
+			break;
+		case 'T':
+			sieve_tool_parse_trace_option(&opts.trace_config,
+						      optarg);
+			break;
+		case 'E':
+			opts.log_stdout = TRUE;
+			break;
+		case 'F':
+			opts.expect_failure = TRUE;
+			break;
+		case 'M':
+			/* keep temporary files (the mail store) in memory */
+			opts.memory_store = TRUE;
+			break;
+		default:
+			print_help();
+			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
+			break;
+		}
+	}
+
+	if (optind >= argc) {
+		print_help();
+		i_fatal_status(EX_USAGE, "Missing <scriptfile> argument");
+	}
+
+	if (argc - optind == 1)
+		return testsuite_run_file(t_strdup(argv[optind]), &opts);
+
+	/* Multiple test cases; each runs in its own worker process */
+	if (opts.dumpfile != NULL || opts.tracefile != NULL) {
+		print_help();
+		i_fatal_status(EX_USAGE,
+			"The -d and -t options need a single <scriptfile>");
+	}
+
+	ret = testsuite_run_parallel((const char *const *)&argv[optind],
+				     argc - optind, max_jobs, &opts);
+
+	sieve_tool_deinit(&sieve_tool);
+	return ret;
+}
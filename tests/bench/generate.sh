@@ -0,0 +1,158 @@
+#!/bin/sh
+
+# Generates the large parts of the benchmark corpus into the directory given
+# as the first argument: a rule set with many rules, scripts that are
+# expensive to compile and a multi-megabyte MIME message. These are not
+# distributed, since they are easily recreated.
+
+set -e
+
+outdir="$1"
+rules="${2:-1000}"
+parts="${3:-32}"
+
+if [ -z "$outdir" ]; then
+	echo "Usage: $0 <output-dir> [<rules> [<parts>]]" >&2
+	exit 1
+fi
+
+mkdir -p "$outdir"
+
+# Many rules, as generated by web frontends for users with a long list of
+# folders
+script="$outdir/many-rules.sieve"
+if [ ! -f "$script" ]; then
+	{
+		echo 'require ["fileinto", "imap4flags"];'
+		i=0
+		while [ $i -lt $rules ]; do
+			echo "if header :contains \"subject\" \"topic-$i\" {"
+			echo "	fileinto \"Topics.$i\";"
+			echo "} elsif address :is \"from\" \"sender-$i@example.com\" {"
+			echo "	addflag \"sender-$i\";"
+			echo "}"
+			i=$((i + 1))
+		done
+		echo 'keep;'
+	} > "$script.tmp"
+	mv "$script.tmp" "$script"
+fi
+
+# Scripts that stress the compiler: deeply nested blocks, a huge text:
+# literal and a long string list. Compile time should grow linearly with the
+# size of these.
+script="$outdir/nested-blocks.sieve"
+if [ ! -f "$script" ]; then
+	{
+		i=0
+		while [ $i -lt 100 ]; do
+			d=0
+			while [ $d -lt 30 ]; do
+				echo "if true {"
+				d=$((d + 1))
+			done
+			echo "keep;"
+			d=0
+			while [ $d -lt 30 ]; do
+				echo "}"
+				d=$((d + 1))
+			done
+			i=$((i + 1))
+		done
+	} > "$script.tmp"
+	mv "$script.tmp" "$script"
+fi
+
+script="$outdir/huge-literals.sieve"
+if [ ! -f "$script" ]; then
+	{
+		echo 'require "reject";'
+		echo 'if header :contains "subject" ['
+		i=0
+		while [ $i -lt 10000 ]; do
+			echo "	\"keyword-$i\","
+			i=$((i + 1))
+		done
+		echo '	"keyword"] {'
+		echo '	reject text:'
+		i=0
+		while [ $i -lt 10000 ]; do
+			echo "This line is part of a very long rejection message ($i)."
+			i=$((i + 1))
+		done
+		echo '.'
+		echo ';'
+		echo '}'
+	} > "$script.tmp"
+	mv "$script.tmp" "$script"
+fi
+
+# A long if/elsif chain of header :is tests on the same header; with
+# sieve_optimize enabled this compiles into a single header switch
+script="$outdir/header-chain.sieve"
+if [ ! -f "$script" ]; then
+	{
+		echo 'require "fileinto";'
+		echo 'if header :is "x-folder" "folder-0" {'
+		echo '	fileinto "Folders.0";'
+		i=1
+		while [ $i -lt $rules ]; do
+			echo "} elsif header :is \"x-folder\" [\"folder-$i\", \"alias-$i\"] {"
+			echo "	fileinto \"Folders.$i\";"
+			i=$((i + 1))
+		done
+		echo '} else {'
+		echo '	keep;'
+		echo '}'
+	} > "$script.tmp"
+	mv "$script.tmp" "$script"
+fi
+
+# A very large generated script of about 100k lines. Compiling this shows the
+# memory used by the parser and the AST; see the maxrss reported with -C.
+script="$outdir/large-script.sieve"
+if [ ! -f "$script" ]; then
+	{
+		echo 'require ["fileinto", "imap4flags", "variables"];'
+		i=0
+		while [ $i -lt 20000 ]; do
+			echo "if anyof (header :contains \"list-id\" \"list-$i.example.com\","
+			echo "	address :is :domain \"from\" [\"domain-$i.example.com\", \"domain-$i.example.net\"]) {"
+			echo "	set \"folder\" \"Lists.$i\";"
+			printf '%s\n' '	fileinto :flags "\\Seen" "${folder}";'
+			echo "}"
+			i=$((i + 1))
+		done
+		echo 'keep;'
+	} > "$script.tmp"
+	mv "$script.tmp" "$script"
+fi
+
+# A large MIME message with several base64 encoded attachments of 64 KiB each
+message="$outdir/large-mime.eml"
+if [ ! -f "$message" ]; then
+	{
+		echo 'From: Stephan Bosch <stephan@example.com>'
+		echo 'To: Timo Sirainen <timo@example.org>'
+		echo 'Subject: Large MIME message'
+		echo 'Message-ID: <large-mime@example.com>'
+		echo 'MIME-Version: 1.0'
+		echo 'Content-Type: multipart/mixed; boundary="bench-boundary"'
+		echo
+		echo 'This is a multi-part message in MIME format.'
+		i=0
+		while [ $i -lt $parts ]; do
+			echo
+			echo '--bench-boundary'
+			echo "Content-Type: application/octet-stream; name=\"part-$i.bin\""
+			echo 'Content-Transfer-Encoding: base64'
+			echo
+			head -c 65536 /dev/zero | tr '\0' "$(printf '\\%o' $((65 + i % 26)))" | \
+				base64
+			i=$((i + 1))
+		done
+		echo
+		echo '--bench-boundary--'
+	} > "$message.tmp"
+	mv "$message.tmp" "$message"
+fi
@@ -0,0 +1,152 @@
+#!/bin/sh
+
+# Measures what the imap_sieve plugin adds to IMAP APPEND, COPY and MOVE. The
+# imap binary is run in pre-authenticated mode against a temporary Maildir,
+# once without the plugin, once with the plugin but no rules for the
+# mailboxes involved and once with a rule set that is run for every message.
+# The reported overhead per message is relative to the run without the
+# plugin.
+#
+# Usage: imapsieve.sh <work-dir> <imap-binary> <plugin-dir> [<messages>
+#                     [<rules>]]
+#
+# The plugin directory is the one containing the built imap_sieve plugin
+# (lib95_imap_sieve_plugin.so).
+
+set -e
+
+workdir="$1"
+imap="$2"
+plugindir="$3"
+messages="${4:-1000}"
+rules="${5:-100}"
+
+if [ -z "$workdir" ] || [ -z "$imap" ] || [ -z "$plugindir" ]; then
+	echo "Usage: $0 <work-dir> <imap-binary> <plugin-dir>" \
+		"[<messages> [<rules>]]" >&2
+	exit 1
+fi
+
+srcdir=`dirname "$0"`
+mkdir -p "$workdir"
+workdir=`cd "$workdir" && pwd`
+
+# Rule set run for each message; the last rule matches, so all are evaluated
+script="$workdir/rules.sieve"
+{
+	echo 'require ["imap4flags", "environment", "imapsieve"];'
+	i=0
+	while [ $i -lt $rules ]; do
+		echo "if header :contains \"subject\" \"topic-$i\" {"
+		echo "	addflag \"topic-$i\";"
+		echo "}"
+		i=$((i + 1))
+	done
+	echo 'if environment :is "imap.cause" "COPY" {'
+	echo '	addflag "copied";'
+	echo '}'
+} > "$script"
+
+# Commands for the three measured sessions
+message="$workdir/message.eml"
+sed "s/^Subject: .*/Subject: Benchmark topic-$((rules - 1))/" \
+	"$srcdir/message.eml" > "$message"
+size=`wc -c < "$message"`
+{
+	i=0
+	while [ $i -lt $messages ]; do
+		echo "a$i APPEND INBOX {$size+}"
+		cat "$message"
+		echo
+		i=$((i + 1))
+	done
+	echo "z LOGOUT"
+} > "$workdir/append.imap"
+{
+	echo "c CREATE Target"
+	echo "s SELECT INBOX"
+	echo "x COPY 1:* Target"
+	echo "z LOGOUT"
+} > "$workdir/copy.imap"
+{
+	echo "c CREATE Other"
+	echo "s SELECT Target"
+	echo "x MOVE 1:* Other"
+	echo "z LOGOUT"
+} > "$workdir/move.imap"
+
+# Writes the configuration for a run: none, unmatched or matched
+write_config()
+{
+	case "$1" in
+	none)
+		plugins=""
+		mailboxes="Elsewhere"
+		;;
+	unmatched)
+		plugins="imap_sieve"
+		mailboxes="Elsewhere"
+		;;
+	matched)
+		plugins="imap_sieve"
+		mailboxes="INBOX Target Other"
+		;;
+	esac
+
+	cat > "$workdir/dovecot.conf" <<EOF
+base_dir = $workdir/run
+state_dir = $workdir/state
+log_path = $workdir/log
+mail_location = maildir:$workdir/mail
+mail_plugin_dir = $plugindir
+mail_plugins = $plugins
+ssl = no
+
+plugin {
+EOF
+	n=1
+	for mailbox in $mailboxes; do
+		if [ "$mailbox" = "INBOX" ]; then
+			causes="APPEND"
+		else
+			causes="COPY"
+		fi
+		cat >> "$workdir/dovecot.conf" <<EOF
+  imapsieve_mailbox${n}_name = $mailbox
+  imapsieve_mailbox${n}_causes = $causes
+  imapsieve_mailbox${n}_before = file:$script
+EOF
+		n=$((n + 1))
+	done
+	echo "}" >> "$workdir/dovecot.conf"
+}
+
+# Runs one session and prints its duration in microseconds
+run_session()
+{
+	start=`date +%s%N`
+	USER=bench HOME="$workdir" "$imap" -c "$workdir/dovecot.conf" \
+		< "$workdir/$1.imap" > "$workdir/$1.out" 2>&1
+	end=`date +%s%N`
+	if ! grep -q '^z OK' "$workdir/$1.out"; then
+		echo "Session $1 failed; see $workdir/$1.out" >&2
+		exit 1
+	fi
+	echo $(((end - start) / 1000))
+}
+
+printf "%-10s %-10s %12s %16s\n" "operation" "rules" "total_usecs" \
+	"overhead_usecs/msg"
+for run in none unmatched matched; do
+	rm -rf "$workdir/mail" "$workdir/run" "$workdir/state"
+	mkdir -p "$workdir/run" "$workdir/state"
+	write_config $run
+
+	for op in append copy move; do
+		usecs=`run_session $op`
+		eval "${op}_$run=$usecs"
+		base=`eval echo \\$${op}_none`
+		printf "%-10s %-10s %12d %16d\n" $op $run $usecs \
+			$(((usecs - base) / messages))
+	done
+done